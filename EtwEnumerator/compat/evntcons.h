@@ -0,0 +1,165 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Minimal stand-in for <evntcons.h> (and the parts of <evntprov.h> and
+<evntrace.h> that it uses) for non-Windows builds. See windows.h.
+Layouts match the Windows SDK so that EVENT_RECORD data captured on Windows
+can be decoded here.
+*/
+
+#pragma once
+#include <windows.h>
+
+typedef ULONG64 TRACEHANDLE;
+
+#define EVENT_TRACE_TYPE_INFO 0x00
+
+DEFINE_GUID( /* 68fdd900-4a3e-11d1-84f4-0000f80464e3 */
+    EventTraceGuid,
+    0x68fdd900, 0x4a3e, 0x11d1, 0x84, 0xf4, 0x00, 0x00, 0xf8, 0x04, 0x64, 0xe3);
+
+typedef struct _TRACE_LOGFILE_HEADER {
+    ULONG BufferSize;
+    union {
+        ULONG Version;
+        struct {
+            UCHAR MajorVersion;
+            UCHAR MinorVersion;
+            UCHAR SubVersion;
+            UCHAR SubMinorVersion;
+        } VersionDetail;
+    };
+    ULONG ProviderVersion;
+    ULONG NumberOfProcessors;
+    LARGE_INTEGER EndTime;
+    ULONG TimerResolution;
+    ULONG MaximumFileSize;
+    ULONG LogFileMode;
+    ULONG BuffersWritten;
+    union {
+        GUID LogInstanceGuid;
+        struct {
+            ULONG StartBuffers;
+            ULONG PointerSize;
+            ULONG EventsLost;
+            ULONG CpuSpeedInMHz;
+        };
+    };
+    LPWSTR LoggerName;
+    LPWSTR LogFileName;
+    TIME_ZONE_INFORMATION TimeZone;
+    LARGE_INTEGER BootTime;
+    LARGE_INTEGER PerfFreq;
+    LARGE_INTEGER StartTime;
+    ULONG ReservedFlags;
+    ULONG BuffersLost;
+} TRACE_LOGFILE_HEADER, *PTRACE_LOGFILE_HEADER;
+
+typedef struct _EVENT_DESCRIPTOR {
+    USHORT Id;
+    UCHAR Version;
+    UCHAR Channel;
+    UCHAR Level;
+    UCHAR Opcode;
+    USHORT Task;
+    ULONGLONG Keyword;
+} EVENT_DESCRIPTOR, *PEVENT_DESCRIPTOR;
+
+typedef EVENT_DESCRIPTOR const* PCEVENT_DESCRIPTOR;
+
+#define EVENT_HEADER_EXT_TYPE_RELATED_ACTIVITYID   0x0001
+#define EVENT_HEADER_EXT_TYPE_SID                  0x0002
+#define EVENT_HEADER_EXT_TYPE_TS_ID                0x0003
+#define EVENT_HEADER_EXT_TYPE_INSTANCE_INFO        0x0004
+#define EVENT_HEADER_EXT_TYPE_STACK_TRACE32        0x0005
+#define EVENT_HEADER_EXT_TYPE_STACK_TRACE64        0x0006
+#define EVENT_HEADER_EXT_TYPE_PEBS_INDEX           0x0007
+#define EVENT_HEADER_EXT_TYPE_PMC_COUNTERS         0x0008
+#define EVENT_HEADER_EXT_TYPE_PSM_KEY              0x0009
+#define EVENT_HEADER_EXT_TYPE_EVENT_KEY            0x000A
+#define EVENT_HEADER_EXT_TYPE_EVENT_SCHEMA_TL      0x000B
+#define EVENT_HEADER_EXT_TYPE_PROV_TRAITS          0x000C
+#define EVENT_HEADER_EXT_TYPE_PROCESS_START_KEY    0x000D
+#define EVENT_HEADER_EXT_TYPE_CONTROL_GUID         0x000E
+#define EVENT_HEADER_EXT_TYPE_QPC_DELTA            0x000F
+#define EVENT_HEADER_EXT_TYPE_CONTAINER_ID         0x0010
+#define EVENT_HEADER_EXT_TYPE_MAX                  0x0013
+
+typedef struct _EVENT_HEADER_EXTENDED_DATA_ITEM {
+    USHORT Reserved1;
+    USHORT ExtType;
+    struct {
+        USHORT Linkage : 1;
+        USHORT Reserved2 : 15;
+    };
+    USHORT DataSize;
+    ULONGLONG DataPtr;
+} EVENT_HEADER_EXTENDED_DATA_ITEM, *PEVENT_HEADER_EXTENDED_DATA_ITEM;
+
+#define EVENT_HEADER_FLAG_EXTENDED_INFO     0x0001
+#define EVENT_HEADER_FLAG_PRIVATE_SESSION   0x0002
+#define EVENT_HEADER_FLAG_STRING_ONLY       0x0004
+#define EVENT_HEADER_FLAG_TRACE_MESSAGE     0x0008
+#define EVENT_HEADER_FLAG_NO_CPUTIME        0x0010
+#define EVENT_HEADER_FLAG_32_BIT_HEADER     0x0020
+#define EVENT_HEADER_FLAG_64_BIT_HEADER     0x0040
+#define EVENT_HEADER_FLAG_DECODE_GUID       0x0080
+#define EVENT_HEADER_FLAG_CLASSIC_HEADER    0x0100
+#define EVENT_HEADER_FLAG_PROCESSOR_INDEX   0x0200
+
+#define EVENT_HEADER_PROPERTY_XML           0x0001
+#define EVENT_HEADER_PROPERTY_FORWARDED_XML 0x0002
+#define EVENT_HEADER_PROPERTY_LEGACY_EVENTLOG 0x0004
+#define EVENT_HEADER_PROPERTY_RELOGGABLE    0x0008
+
+typedef struct _EVENT_HEADER {
+    USHORT Size;
+    USHORT HeaderType;
+    USHORT Flags;
+    USHORT EventProperty;
+    ULONG ThreadId;
+    ULONG ProcessId;
+    LARGE_INTEGER TimeStamp;
+    GUID ProviderId;
+    EVENT_DESCRIPTOR EventDescriptor;
+    union {
+        struct {
+            ULONG KernelTime;
+            ULONG UserTime;
+        };
+        ULONG64 ProcessorTime;
+    };
+    GUID ActivityId;
+} EVENT_HEADER, *PEVENT_HEADER;
+
+typedef struct _ETW_BUFFER_CONTEXT {
+    union {
+        struct {
+            UCHAR ProcessorNumber;
+            UCHAR Alignment;
+        };
+        USHORT ProcessorIndex;
+    };
+    USHORT LoggerId;
+} ETW_BUFFER_CONTEXT, *PETW_BUFFER_CONTEXT;
+
+typedef struct _EVENT_RECORD {
+    EVENT_HEADER EventHeader;
+    ETW_BUFFER_CONTEXT BufferContext;
+    USHORT ExtendedDataCount;
+    USHORT UserDataLength;
+    PEVENT_HEADER_EXTENDED_DATA_ITEM ExtendedData;
+    PVOID UserData;
+    PVOID UserContext;
+} EVENT_RECORD, *PEVENT_RECORD;
+
+typedef EVENT_RECORD const* PCEVENT_RECORD;
+
+inline ULONG
+GetEventProcessorIndex(PCEVENT_RECORD EventRecord) noexcept
+{
+    return (EventRecord->EventHeader.Flags & EVENT_HEADER_FLAG_PROCESSOR_INDEX) != 0
+        ? EventRecord->BufferContext.ProcessorIndex
+        : EventRecord->BufferContext.ProcessorNumber;
+}
@@ -0,0 +1,45 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Minimal stand-in for <guiddef.h> for non-Windows builds. See windows.h.
+Like the Windows SDK header, this may be included again after defining
+INITGUID so that DEFINE_GUID produces a definition instead of a declaration.
+*/
+
+#ifndef GUID_DEFINED
+#define GUID_DEFINED
+
+#include <string.h>
+
+typedef struct _GUID {
+    unsigned int Data1;
+    unsigned short Data2;
+    unsigned short Data3;
+    unsigned char Data4[8];
+} GUID;
+
+typedef GUID const& REFGUID;
+
+inline bool
+operator==(GUID const& a, GUID const& b) noexcept
+{
+    return 0 == memcmp(&a, &b, sizeof(GUID));
+}
+
+inline bool
+operator!=(GUID const& a, GUID const& b) noexcept
+{
+    return !(a == b);
+}
+
+#endif // GUID_DEFINED
+
+#undef DEFINE_GUID
+#ifdef INITGUID
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    extern "C" GUID const name = { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
+#else
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    extern "C" GUID const name
+#endif
@@ -0,0 +1,65 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Minimal stand-in for <intrin.h> for non-Windows builds. See windows.h.
+*/
+
+#pragma once
+
+inline unsigned char
+_BitScanForward(unsigned int* pIndex, unsigned int mask) noexcept
+{
+    if (mask == 0)
+    {
+        return 0;
+    }
+
+    *pIndex = static_cast<unsigned int>(__builtin_ctz(mask));
+    return 1;
+}
+
+inline unsigned char
+_BitScanForward(unsigned long* pIndex, unsigned int mask) noexcept
+{
+    unsigned int index = 0;
+    unsigned char const found = _BitScanForward(&index, mask);
+    *pIndex = index;
+    return found;
+}
+
+inline unsigned short
+_byteswap_ushort(unsigned short value) noexcept
+{
+    return __builtin_bswap16(value);
+}
+
+inline unsigned int
+_byteswap_ulong(unsigned int value) noexcept
+{
+    return __builtin_bswap32(value);
+}
+
+inline unsigned long long
+_byteswap_uint64(unsigned long long value) noexcept
+{
+    return __builtin_bswap64(value);
+}
+
+#if defined(__SIZEOF_INT128__)
+
+inline unsigned long long
+__umulh(unsigned long long a, unsigned long long b) noexcept
+{
+    return static_cast<unsigned long long>((static_cast<unsigned __int128>(a) * b) >> 64);
+}
+
+inline unsigned long long
+_umul128(unsigned long long a, unsigned long long b, unsigned long long* pHigh) noexcept
+{
+    unsigned __int128 const product = static_cast<unsigned __int128>(a) * b;
+    *pHigh = static_cast<unsigned long long>(product >> 64);
+    return static_cast<unsigned long long>(product);
+}
+
+#endif // __SIZEOF_INT128__
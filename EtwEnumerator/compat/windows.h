@@ -0,0 +1,928 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Minimal stand-in for <windows.h> for building EtwEnumerator and its tests on
+non-Windows platforms. The compat directory is added to the include path only
+when not building for Windows.
+
+Provides:
+- The Win32 base types, error codes, and SAL annotations used by this project.
+- Win32 functions used by this project (heap, FILETIME/SYSTEMTIME conversion,
+  MultiByteToWideChar for CP_UTF8 and CP_ACP, GetLastError).
+- MSVC CRT wide-string functions (wcslen, _vsnwprintf, ...) for the 16-bit
+  wchar_t used by this project. Build with -fshort-wchar so that wchar_t and
+  L"" literals are UTF-16, as on Windows. Printf-style formatting follows
+  MSVC rules: %s and %c in a wide format string take wide arguments, l on an
+  integer means 32 bits, and _vsnwprintf returns -1 on truncation.
+- MSVC intrinsics (_BitScanForward, _byteswap_ushort, _umul128, __umulh).
+
+Not provided: TDH and ETW consumption. TdhGetEventInformation and
+TdhGetEventMapInformation return ERROR_NOT_SUPPORTED, so decoding requires an
+EtwEnumeratorCallbacks that supplies TRACE_EVENT_INFO and EVENT_MAP_INFO.
+*/
+
+#pragma once
+
+#if !defined(__SIZEOF_WCHAR_T__) || __SIZEOF_WCHAR_T__ != 2
+#error The EtwEnumerator compat headers require a 16-bit wchar_t (-fshort-wchar).
+#endif
+
+// Include the C/C++ runtime headers before redirecting the wide-string
+// functions below, so that their declarations are not affected.
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#ifdef __cplusplus
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+#endif
+
+#if defined(__x86_64__)
+#define _M_X64 100
+#elif defined(__i386__)
+#define _M_IX86 600
+#elif defined(__aarch64__)
+#define _M_ARM64 1
+#endif
+
+#pragma region Calling conventions, SAL, and MSVC keywords
+
+#define __stdcall
+#define __cdecl
+#define WINAPI
+#define DECLSPEC_NOVTABLE
+#define UNALIGNED
+#define __forceinline inline __attribute__((always_inline))
+#define __int64 long long
+#define __wchar_t wchar_t
+#define __fallthrough [[fallthrough]]
+#define __analysis_assume(expr)
+#define __analysis_assert(expr)
+#define UNREFERENCED_PARAMETER(p) ((void)(p))
+
+#define _In_
+#define _In_opt_
+#define _In_z_
+#define _In_opt_z_
+#define _In_count_(n)
+#define _In_z_count_(n)
+#define _In_range_(lo, hi)
+#define _In_reads_(n)
+#define _In_reads_opt_(n)
+#define _In_reads_bytes_(n)
+#define _In_reads_bytes_opt_(n)
+#define _Inout_
+#define _Inout_opt_
+#define _Inout_updates_(n)
+#define _Out_
+#define _Out_opt_
+#define _Out_writes_(n)
+#define _Out_writes_opt_(n)
+#define _Out_writes_to_(n, c)
+#define _Out_writes_bytes_(n)
+#define _Out_writes_bytes_opt_(n)
+#define _Outptr_result_maybenull_
+#define _Ret_z_
+#define _Ret_opt_z_
+#define _Ret_maybenull_
+#define _Field_size_(n)
+#define _Field_size_bytes_(n)
+#define _Null_terminated_
+#define _Printf_format_string_
+
+#pragma endregion
+
+#pragma region Base types
+
+typedef char CHAR;
+typedef unsigned char UCHAR;
+typedef unsigned char BYTE;
+typedef unsigned char BOOLEAN;
+typedef short SHORT;
+typedef unsigned short USHORT;
+typedef unsigned short WORD;
+typedef int INT;
+typedef int BOOL;
+typedef int LONG;
+typedef unsigned int UINT;
+typedef unsigned int ULONG;
+typedef unsigned int DWORD;
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG;
+typedef unsigned long long ULONG64;
+typedef unsigned long long DWORD64;
+typedef signed char INT8;
+typedef unsigned char UINT8;
+typedef short INT16;
+typedef unsigned short UINT16;
+typedef int INT32;
+typedef unsigned int UINT32;
+typedef long long INT64;
+typedef unsigned long long UINT64;
+typedef intptr_t INT_PTR;
+typedef uintptr_t UINT_PTR;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR;
+typedef size_t SIZE_T;
+typedef LONG HRESULT;
+
+// On Windows, LSTATUS is LONG, a type distinct from int (the project relies
+// on this to catch status/bool mixups). LONG must stay 32 bits here for
+// struct layouts, so LSTATUS uses long instead.
+typedef long LSTATUS;
+typedef void VOID;
+typedef void* PVOID;
+typedef void* HANDLE;
+typedef void* HMODULE;
+
+typedef wchar_t WCHAR;
+typedef WCHAR* PWSTR;
+typedef WCHAR* LPWSTR;
+typedef WCHAR const* PCWSTR;
+typedef WCHAR const* LPCWSTR;
+typedef WCHAR const* LPCWCH;
+typedef CHAR const* LPCCH;
+typedef CHAR const* PCSTR;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        DWORD LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct _FILETIME {
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+} FILETIME, *PFILETIME;
+
+typedef struct _SYSTEMTIME {
+    WORD wYear;
+    WORD wMonth;
+    WORD wDayOfWeek;
+    WORD wDay;
+    WORD wHour;
+    WORD wMinute;
+    WORD wSecond;
+    WORD wMilliseconds;
+} SYSTEMTIME, *PSYSTEMTIME;
+
+typedef struct _SID_IDENTIFIER_AUTHORITY {
+    BYTE Value[6];
+} SID_IDENTIFIER_AUTHORITY;
+
+typedef struct _SID {
+    BYTE Revision;
+    BYTE SubAuthorityCount;
+    SID_IDENTIFIER_AUTHORITY IdentifierAuthority;
+    DWORD SubAuthority[1];
+} SID;
+
+typedef struct _TIME_ZONE_INFORMATION {
+    LONG Bias;
+    WCHAR StandardName[32];
+    SYSTEMTIME StandardDate;
+    LONG StandardBias;
+    WCHAR DaylightName[32];
+    SYSTEMTIME DaylightDate;
+    LONG DaylightBias;
+} TIME_ZONE_INFORMATION;
+
+#include <guiddef.h>
+
+#define TRUE 1
+#define FALSE 0
+#define ANYSIZE_ARRAY 1
+#define MAXUINT ((UINT)~((UINT)0))
+#define MAXINT64 ((INT64)(~((UINT64)0) >> 1))
+#define MAXUINT64 (~((UINT64)0))
+#define WSTR_ALIGNED(s) (((ULONG_PTR)(s) & (sizeof(WCHAR) - 1)) == 0)
+
+#ifdef __cplusplus
+template<class T, size_t N>
+char (&EtwCompatCountofHelper(T (&)[N]))[N];
+#define _countof(a) (sizeof(EtwCompatCountofHelper(a)))
+#else
+#define _countof(a) (sizeof(a) / sizeof((a)[0]))
+#endif
+#define ARRAYSIZE(a) _countof(a)
+
+#pragma endregion
+
+#pragma region Error codes
+
+#define ERROR_SUCCESS                    0L
+#define ERROR_INVALID_FUNCTION           1L
+#define ERROR_INVALID_DATA               13L
+#define ERROR_OUTOFMEMORY                14L
+#define ERROR_NOT_SUPPORTED              50L
+#define ERROR_INVALID_PARAMETER          87L
+#define ERROR_INSUFFICIENT_BUFFER        122L
+#define ERROR_NO_UNICODE_TRANSLATION     1113L
+#define ERROR_NOT_FOUND                  1168L
+#define ERROR_UNSUPPORTED_TYPE           1630L
+#define ERROR_MR_MID_NOT_FOUND           317L
+#define ERROR_ARITHMETIC_OVERFLOW        534L
+#define ERROR_INVALID_STATE              5023L
+#define ERROR_ASSERTION_FAILURE          668L
+#define E_OUTOFMEMORY                    ((HRESULT)0x8007000EL)
+#define FACILITY_NT_BIT                  0x10000000
+
+#pragma endregion
+
+#pragma region Win32 functions
+
+#define CP_ACP 0
+#define CP_UTF8 65001
+
+#define FORMAT_MESSAGE_ALLOCATE_BUFFER   0x00000100
+#define FORMAT_MESSAGE_IGNORE_INSERTS    0x00000200
+#define FORMAT_MESSAGE_FROM_HMODULE      0x00000800
+#define FORMAT_MESSAGE_FROM_SYSTEM       0x00001000
+
+inline DWORD&
+EtwCompatLastError() noexcept
+{
+    static thread_local DWORD lastError;
+    return lastError;
+}
+
+inline DWORD
+GetLastError() noexcept
+{
+    return EtwCompatLastError();
+}
+
+inline void
+SetLastError(DWORD error) noexcept
+{
+    EtwCompatLastError() = error;
+}
+
+inline HANDLE
+GetProcessHeap() noexcept
+{
+    return nullptr;
+}
+
+inline void*
+HeapAlloc(HANDLE, DWORD, SIZE_T cb) noexcept
+{
+    return malloc(cb ? cb : 1);
+}
+
+inline void*
+HeapReAlloc(HANDLE, DWORD, void* p, SIZE_T cb) noexcept
+{
+    return realloc(p, cb ? cb : 1);
+}
+
+inline BOOL
+HeapFree(HANDLE, DWORD, void* p) noexcept
+{
+    free(p);
+    return TRUE;
+}
+
+inline HMODULE
+GetModuleHandleW(LPCWSTR) noexcept
+{
+    return nullptr;
+}
+
+// No message tables on this platform: always fails, so callers use their
+// fallback formatting.
+inline DWORD
+FormatMessageW(DWORD, void const*, DWORD, DWORD, LPWSTR, DWORD, va_list*) noexcept
+{
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return 0;
+}
+
+// 100ns intervals from 1601-01-01 to 1970-01-01.
+#define ETW_COMPAT_UNIX_EPOCH_FILETIME 116444736000000000ull
+
+inline UINT64
+EtwCompatDaysFromCivil(UINT64 year, unsigned month, unsigned day) noexcept
+{
+    // Days since 1601-01-01 (proleptic Gregorian).
+    year -= month <= 2;
+    UINT64 const era = year / 400;
+    unsigned const yoe = static_cast<unsigned>(year - era * 400);
+    unsigned const doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    unsigned const doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 584694; // 584694 = days from 0000-03-01 to 1601-01-01.
+}
+
+inline BOOL
+FileTimeToSystemTime(FILETIME const* pFileTime, SYSTEMTIME* pSystemTime) noexcept
+{
+    UINT64 const ft = (static_cast<UINT64>(pFileTime->dwHighDateTime) << 32) | pFileTime->dwLowDateTime;
+    if (ft >= 0x8000000000000000)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    UINT64 const ticksPerDay = 864000000000ull;
+    UINT64 const days = ft / ticksPerDay;
+    UINT64 const ticks = ft % ticksPerDay;
+
+    // Civil from days, with days counted from 0000-03-01.
+    UINT64 const z = days + 584694;
+    UINT64 const era = z / 146097;
+    unsigned const doe = static_cast<unsigned>(z - era * 146097);
+    unsigned const yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned const doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned const mp = (5 * doy + 2) / 153;
+    unsigned const day = doy - (153 * mp + 2) / 5 + 1;
+    unsigned const month = mp < 10 ? mp + 3 : mp - 9;
+    UINT64 const year = yoe + era * 400 + (month <= 2);
+
+    pSystemTime->wYear = static_cast<WORD>(year);
+    pSystemTime->wMonth = static_cast<WORD>(month);
+    pSystemTime->wDayOfWeek = static_cast<WORD>((days + 1) % 7); // 1601-01-01 was a Monday.
+    pSystemTime->wDay = static_cast<WORD>(day);
+    pSystemTime->wHour = static_cast<WORD>(ticks / 36000000000ull);
+    pSystemTime->wMinute = static_cast<WORD>(ticks / 600000000 % 60);
+    pSystemTime->wSecond = static_cast<WORD>(ticks / 10000000 % 60);
+    pSystemTime->wMilliseconds = static_cast<WORD>(ticks / 10000 % 1000);
+    return TRUE;
+}
+
+inline BOOL
+SystemTimeToFileTime(SYSTEMTIME const* pSystemTime, FILETIME* pFileTime) noexcept
+{
+    static unsigned char const daysInMonth[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    SYSTEMTIME const& st = *pSystemTime;
+    bool const leap = (st.wYear % 4 == 0 && st.wYear % 100 != 0) || st.wYear % 400 == 0;
+    if (st.wYear < 1601 || st.wYear > 30827 ||
+        st.wMonth < 1 || st.wMonth > 12 ||
+        st.wDay < 1 || st.wDay > daysInMonth[st.wMonth - 1] + (st.wMonth == 2 && leap) ||
+        st.wHour > 23 || st.wMinute > 59 || st.wSecond > 59 || st.wMilliseconds > 999)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    UINT64 const ft =
+        EtwCompatDaysFromCivil(st.wYear, st.wMonth, st.wDay) * 864000000000ull +
+        st.wHour * 36000000000ull +
+        st.wMinute * 600000000ull +
+        st.wSecond * 10000000ull +
+        st.wMilliseconds * 10000ull;
+    pFileTime->dwLowDateTime = static_cast<DWORD>(ft);
+    pFileTime->dwHighDateTime = static_cast<DWORD>(ft >> 32);
+    return TRUE;
+}
+
+// Uses the C runtime's local time zone (TZ) at the given time.
+inline BOOL
+FileTimeToLocalFileTime(FILETIME const* pFileTime, FILETIME* pLocalFileTime) noexcept
+{
+    UINT64 const ft = (static_cast<UINT64>(pFileTime->dwHighDateTime) << 32) | pFileTime->dwLowDateTime;
+    time_t const unixTime = static_cast<time_t>(
+        (static_cast<INT64>(ft) - static_cast<INT64>(ETW_COMPAT_UNIX_EPOCH_FILETIME)) / 10000000);
+    struct tm local = {};
+    long bias = 0;
+    if (localtime_r(&unixTime, &local))
+    {
+        bias = local.tm_gmtoff;
+    }
+
+    UINT64 const localFt = ft + static_cast<UINT64>(static_cast<INT64>(bias) * 10000000);
+    pLocalFileTime->dwLowDateTime = static_cast<DWORD>(localFt);
+    pLocalFileTime->dwHighDateTime = static_cast<DWORD>(localFt >> 32);
+    return TRUE;
+}
+
+/*
+Supports CP_UTF8 (ill-formed sequences become U+FFFD, one per maximal
+subpart) and CP_ACP (treated as Latin-1). flags must be 0.
+*/
+inline int
+MultiByteToWideChar(
+    UINT codePage,
+    DWORD flags,
+    LPCCH pb,
+    int cb,
+    LPWSTR pch,
+    int cch) noexcept
+{
+    if (flags != 0 || (codePage != CP_UTF8 && codePage != CP_ACP) ||
+        pb == nullptr || cb == 0 || cch < 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+
+    size_t const cbIn = cb < 0 ? strlen(pb) + 1 : static_cast<size_t>(cb);
+    auto const p = reinterpret_cast<unsigned char const*>(pb);
+    int cchOut = 0;
+    auto const put = [&](unsigned ch) -> bool
+    {
+        unsigned const units = ch >= 0x10000 ? 2 : 1;
+        if (cch != 0)
+        {
+            if (cchOut + static_cast<int>(units) > cch)
+            {
+                return false;
+            }
+
+            if (units == 2)
+            {
+                pch[cchOut] = static_cast<WCHAR>(0xD800 + ((ch - 0x10000) >> 10));
+                pch[cchOut + 1] = static_cast<WCHAR>(0xDC00 + (ch & 0x3FF));
+            }
+            else
+            {
+                pch[cchOut] = static_cast<WCHAR>(ch);
+            }
+        }
+
+        cchOut += units;
+        return true;
+    };
+
+    for (size_t i = 0; i != cbIn;)
+    {
+        unsigned ch = p[i];
+        size_t seqLen = 1;
+        if (codePage == CP_UTF8 && ch >= 0x80)
+        {
+            unsigned need;
+            unsigned lo = 0x80, hi = 0xBF;
+            if (ch >= 0xC2 && ch <= 0xDF) { need = 1; ch &= 0x1F; }
+            else if (ch == 0xE0) { need = 2; ch &= 0x0F; lo = 0xA0; }
+            else if (ch >= 0xE1 && ch <= 0xEC) { need = 2; ch &= 0x0F; }
+            else if (ch == 0xED) { need = 2; ch &= 0x0F; hi = 0x9F; }
+            else if (ch >= 0xEE && ch <= 0xEF) { need = 2; ch &= 0x0F; }
+            else if (ch == 0xF0) { need = 3; ch &= 0x07; lo = 0x90; }
+            else if (ch >= 0xF1 && ch <= 0xF3) { need = 3; ch &= 0x07; }
+            else if (ch == 0xF4) { need = 3; ch &= 0x07; hi = 0x8F; }
+            else { need = 0; ch = 0xFFFD; }
+
+            for (unsigned k = 0; k != need; k += 1)
+            {
+                if (i + seqLen == cbIn ||
+                    p[i + seqLen] < lo || p[i + seqLen] > hi)
+                {
+                    ch = 0xFFFD;
+                    break;
+                }
+
+                ch = (ch << 6) | (p[i + seqLen] & 0x3F);
+                seqLen += 1;
+                lo = 0x80;
+                hi = 0xBF;
+            }
+        }
+
+        if (!put(ch))
+        {
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return 0;
+        }
+
+        i += seqLen;
+    }
+
+    return cchOut;
+}
+
+#pragma endregion
+
+#pragma region MSVC CRT wide-string functions
+
+inline size_t
+EtwCompat_wcslen(wchar_t const* s) noexcept
+{
+    size_t i = 0;
+    while (s[i] != 0)
+    {
+        i += 1;
+    }
+    return i;
+}
+
+inline size_t
+EtwCompat_wcsnlen(wchar_t const* s, size_t n) noexcept
+{
+    size_t i = 0;
+    while (i != n && s[i] != 0)
+    {
+        i += 1;
+    }
+    return i;
+}
+
+inline int
+EtwCompat_wcsncmp(wchar_t const* a, wchar_t const* b, size_t n) noexcept
+{
+    for (size_t i = 0; i != n; i += 1)
+    {
+        if (a[i] != b[i])
+        {
+            return static_cast<WORD>(a[i]) < static_cast<WORD>(b[i]) ? -1 : 1;
+        }
+        else if (a[i] == 0)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+inline int
+EtwCompat_wcscmp(wchar_t const* a, wchar_t const* b) noexcept
+{
+    return EtwCompat_wcsncmp(a, b, ~static_cast<size_t>(0));
+}
+
+#ifdef __cplusplus
+inline wchar_t const*
+EtwCompat_wcschr(wchar_t const* s, wchar_t ch) noexcept
+{
+    for (;; s += 1)
+    {
+        if (*s == ch)
+        {
+            return s;
+        }
+        else if (*s == 0)
+        {
+            return nullptr;
+        }
+    }
+}
+
+inline wchar_t*
+EtwCompat_wcschr(wchar_t* s, wchar_t ch) noexcept
+{
+    return const_cast<wchar_t*>(EtwCompat_wcschr(const_cast<wchar_t const*>(s), ch));
+}
+#endif // __cplusplus
+
+/*
+MSVC _vsnwprintf: writes at most count characters. Returns the number of
+characters written (not counting the nul, which is written only if there is
+room), or -1 if the output did not fit.
+*/
+inline int
+EtwCompat_vsnwprintf(
+    wchar_t* buffer,
+    size_t count,
+    wchar_t const* format,
+    va_list args) noexcept
+{
+    va_list ap;
+    va_copy(ap, args);
+
+    size_t pos = 0;
+    auto const put = [&](wchar_t ch)
+    {
+        if (pos < count)
+        {
+            buffer[pos] = ch;
+        }
+        pos += 1;
+    };
+    auto const pad = [&](int n, wchar_t ch)
+    {
+        for (; n > 0; n -= 1)
+        {
+            put(ch);
+        }
+    };
+
+    for (wchar_t const* p = format; *p != 0; p += 1)
+    {
+        if (*p != L'%')
+        {
+            put(*p);
+            continue;
+        }
+
+        p += 1;
+        if (*p == L'%')
+        {
+            put(L'%');
+            continue;
+        }
+
+        // Collect the spec in narrow form for the C runtime's snprintf.
+        char spec[48];
+        size_t cchSpec = 0;
+        spec[cchSpec++] = '%';
+
+        bool leftJustify = false;
+        while (*p == L'-' || *p == L'+' || *p == L' ' || *p == L'#' || *p == L'0')
+        {
+            leftJustify |= *p == L'-';
+            if (cchSpec < 8)
+            {
+                spec[cchSpec++] = static_cast<char>(*p);
+            }
+            p += 1;
+        }
+
+        int width = -1;
+        if (*p == L'*')
+        {
+            width = va_arg(ap, int);
+            if (width < 0)
+            {
+                leftJustify = true;
+                width = -width;
+                spec[cchSpec++] = '-';
+            }
+            p += 1;
+        }
+        else if (*p >= L'0' && *p <= L'9')
+        {
+            width = 0;
+            for (; *p >= L'0' && *p <= L'9'; p += 1)
+            {
+                width = width * 10 + (*p - L'0');
+            }
+        }
+
+        if (width >= 0)
+        {
+            cchSpec += snprintf(spec + cchSpec, 12, "%d", width);
+        }
+
+        int precision = -1;
+        if (*p == L'.')
+        {
+            p += 1;
+            precision = 0;
+            if (*p == L'*')
+            {
+                precision = va_arg(ap, int);
+                p += 1;
+            }
+            else
+            {
+                for (; *p >= L'0' && *p <= L'9'; p += 1)
+                {
+                    precision = precision * 10 + (*p - L'0');
+                }
+            }
+
+            if (precision >= 0)
+            {
+                cchSpec += snprintf(spec + cchSpec, 13, ".%d", precision);
+            }
+        }
+
+        // Size prefix: 0 = int, 'h' = short, 'H' = char, 'q' = 64-bit,
+        // 'z' = pointer-sized, 'l' = wide (for c/s), 'n' = narrow (for c/s).
+        char size = 0;
+        if (*p == L'h')
+        {
+            p += 1;
+            size = 'h';
+            if (*p == L'h')
+            {
+                p += 1;
+                size = 'H';
+            }
+        }
+        else if (*p == L'l')
+        {
+            p += 1;
+            size = 'l';
+            if (*p == L'l')
+            {
+                p += 1;
+                size = 'q';
+            }
+        }
+        else if (*p == L'w')
+        {
+            p += 1;
+            size = 'l';
+        }
+        else if (*p == L'L' || *p == L'j')
+        {
+            p += 1;
+            size = 'q';
+        }
+        else if (*p == L'z' || *p == L't')
+        {
+            p += 1;
+            size = 'z';
+        }
+        else if (*p == L'I')
+        {
+            p += 1;
+            if (p[0] == L'6' && p[1] == L'4')
+            {
+                p += 2;
+                size = 'q';
+            }
+            else if (p[0] == L'3' && p[1] == L'2')
+            {
+                p += 2;
+            }
+            else
+            {
+                size = 'z';
+            }
+        }
+
+        wchar_t const conv = *p;
+        if (conv == 0)
+        {
+            break;
+        }
+
+        char text[512];
+        int cchText;
+        switch (conv)
+        {
+        case L'd':
+        case L'i':
+        case L'u':
+        case L'o':
+        case L'x':
+        case L'X':
+        {
+            bool const isSigned = conv == L'd' || conv == L'i';
+            long long value;
+            if (size == 'q')
+            {
+                value = va_arg(ap, long long);
+            }
+            else if (size == 'z')
+            {
+                value = static_cast<long long>(va_arg(ap, size_t));
+                if (isSigned && sizeof(size_t) == 4)
+                {
+                    value = static_cast<int>(value);
+                }
+            }
+            else
+            {
+                int const v = va_arg(ap, int);
+                value = size == 'H' ? (isSigned ? static_cast<signed char>(v) : static_cast<unsigned char>(v))
+                    : size == 'h' ? (isSigned ? static_cast<short>(v) : static_cast<unsigned short>(v))
+                    : isSigned ? static_cast<long long>(v)
+                    : static_cast<long long>(static_cast<unsigned>(v));
+            }
+
+            spec[cchSpec++] = 'l';
+            spec[cchSpec++] = 'l';
+            spec[cchSpec++] = static_cast<char>(conv);
+            spec[cchSpec] = 0;
+            cchText = snprintf(text, sizeof(text), spec, value);
+            break;
+        }
+        case L'e':
+        case L'E':
+        case L'f':
+        case L'F':
+        case L'g':
+        case L'G':
+        case L'a':
+        case L'A':
+            spec[cchSpec++] = static_cast<char>(conv);
+            spec[cchSpec] = 0;
+            cchText = snprintf(text, sizeof(text), spec, va_arg(ap, double));
+            break;
+        case L'p':
+            cchText = snprintf(text, sizeof(text), "%0*llX",
+                static_cast<int>(sizeof(void*) * 2),
+                static_cast<unsigned long long>(reinterpret_cast<uintptr_t>(va_arg(ap, void*))));
+            break;
+        case L'c':
+        case L'C':
+        {
+            wchar_t const ch = static_cast<wchar_t>(
+                (size == 'h' || (conv == L'C' && size != 'l'))
+                ? static_cast<unsigned char>(va_arg(ap, int))
+                : va_arg(ap, int));
+            int const padCount = width > 1 ? width - 1 : 0;
+            if (!leftJustify) pad(padCount, L' ');
+            put(ch);
+            if (leftJustify) pad(padCount, L' ');
+            continue;
+        }
+        case L's':
+        case L'S':
+        {
+            bool const narrow = size == 'h' || (conv == L'S' && size != 'l');
+            void const* const pv = va_arg(ap, void const*);
+            size_t const maxLen = precision >= 0 ? static_cast<size_t>(precision) : ~static_cast<size_t>(0);
+            size_t len;
+            if (pv == nullptr)
+            {
+                static char const NullText[] = "(null)";
+                len = maxLen < 6 ? maxLen : 6;
+                int const padCount = width > static_cast<int>(len) ? width - static_cast<int>(len) : 0;
+                if (!leftJustify) pad(padCount, L' ');
+                for (size_t i = 0; i != len; i += 1) put(static_cast<wchar_t>(NullText[i]));
+                if (leftJustify) pad(padCount, L' ');
+            }
+            else if (narrow)
+            {
+                auto const s = static_cast<char const*>(pv);
+                len = strnlen(s, maxLen);
+                int const padCount = width > static_cast<int>(len) ? width - static_cast<int>(len) : 0;
+                if (!leftJustify) pad(padCount, L' ');
+                for (size_t i = 0; i != len; i += 1) put(static_cast<unsigned char>(s[i]));
+                if (leftJustify) pad(padCount, L' ');
+            }
+            else
+            {
+                auto const s = static_cast<wchar_t const*>(pv);
+                len = EtwCompat_wcsnlen(s, maxLen);
+                int const padCount = width > static_cast<int>(len) ? width - static_cast<int>(len) : 0;
+                if (!leftJustify) pad(padCount, L' ');
+                for (size_t i = 0; i != len; i += 1) put(s[i]);
+                if (leftJustify) pad(padCount, L' ');
+            }
+            continue;
+        }
+        default:
+            // Unsupported conversion: emit it unchanged.
+            put(L'%');
+            put(conv);
+            continue;
+        }
+
+        if (cchText < 0)
+        {
+            va_end(ap);
+            return -1;
+        }
+
+        if (cchText >= static_cast<int>(sizeof(text)))
+        {
+            cchText = sizeof(text) - 1;
+        }
+
+        for (int i = 0; i != cchText; i += 1)
+        {
+            put(static_cast<unsigned char>(text[i]));
+        }
+    }
+
+    va_end(ap);
+
+    if (pos > count)
+    {
+        return -1;
+    }
+    else if (pos < count)
+    {
+        buffer[pos] = 0;
+    }
+
+    return static_cast<int>(pos);
+}
+
+// ISO swprintf: always nul-terminates; returns -1 if the output did not fit.
+inline int
+EtwCompat_swprintf(
+    wchar_t* buffer,
+    size_t count,
+    wchar_t const* format,
+    ...) noexcept
+{
+    va_list args;
+    va_start(args, format);
+    int result = EtwCompat_vsnwprintf(buffer, count, format, args);
+    va_end(args);
+    if (result < 0 || static_cast<size_t>(result) == count)
+    {
+        if (count != 0)
+        {
+            buffer[count - 1] = 0;
+        }
+        result = -1;
+    }
+    return result;
+}
+
+#define wcslen EtwCompat_wcslen
+#define wcsnlen EtwCompat_wcsnlen
+#define wcscmp EtwCompat_wcscmp
+#define wcsncmp EtwCompat_wcsncmp
+#define wcschr EtwCompat_wcschr
+#define _vsnwprintf EtwCompat_vsnwprintf
+#define swprintf EtwCompat_swprintf
+
+#pragma endregion
+
+#include <intrin.h>
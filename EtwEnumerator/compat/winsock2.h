@@ -0,0 +1,10 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Minimal stand-in for <winsock2.h> for non-Windows builds. See windows.h.
+*/
+
+#pragma once
+#include <windows.h>
+#include <ws2def.h>
@@ -0,0 +1,40 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Minimal stand-in for <ws2def.h> for non-Windows builds. See windows.h.
+Event payloads use the Windows socket address layout and address family
+values (e.g. AF_INET6 is 23), so these do not come from the host's socket
+headers.
+*/
+
+#pragma once
+#include <windows.h>
+
+#define AF_INET    2
+#define AF_INET6   23
+#define AF_LINK    33
+
+typedef USHORT ADDRESS_FAMILY;
+
+typedef struct in_addr {
+    UCHAR s_b[4];
+} IN_ADDR;
+
+typedef struct sockaddr {
+    ADDRESS_FAMILY sa_family;
+    CHAR sa_data[14];
+} SOCKADDR;
+
+typedef struct sockaddr_in {
+    ADDRESS_FAMILY sin_family;
+    USHORT sin_port;
+    IN_ADDR sin_addr;
+    CHAR sin_zero[8];
+} SOCKADDR_IN;
+
+typedef struct sockaddr_dl {
+    ADDRESS_FAMILY sdl_family;
+    UCHAR sdl_data[8];
+    UCHAR sdl_zero[4];
+} SOCKADDR_DL;
@@ -0,0 +1,21 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Minimal stand-in for <ws2ipdef.h> for non-Windows builds. See ws2def.h.
+*/
+
+#pragma once
+#include <ws2def.h>
+
+typedef struct in6_addr {
+    UCHAR s6_bytes[16];
+} IN6_ADDR;
+
+typedef struct sockaddr_in6 {
+    ADDRESS_FAMILY sin6_family;
+    USHORT sin6_port;
+    ULONG sin6_flowinfo;
+    IN6_ADDR sin6_addr;
+    ULONG sin6_scope_id;
+} SOCKADDR_IN6;
@@ -8,6 +8,7 @@ EtwEnumerator helps decode and format ETW events.
 
 #pragma once
 #include <tdh.h>
+#include <assert.h> // Visit
 
 #pragma warning(push)
 #pragma warning(disable:4201)  // nameless struct/union.
@@ -19,13 +20,34 @@ enum EtwEnumeratorState : UCHAR;    // Current state of an EtwEnumerator.
 struct EtwEventInfo;                // Information about the event: name, provider, etc.
 struct EtwAttributeInfo;            // The name and value of an event attribute.
 struct EtwRawDataPosition;          // Technical details about the raw event payload.
+struct EtwSchemaCacheInfo;          // Statistics for the StartEvent schema cache.
 struct EtwItemInfo;                 // Information about the current item in the event.
 struct EtwRawItemInfo;              // Technical details about the current item in the event.
 struct EtwStringView;               // Counted string returned from a Format method.
 struct EtwStringViewZ;              // Nul-terminated string returned from a Format method.
+struct EtwStringViewUtf8;           // Counted UTF-8 string returned from a Format*Utf8 method.
+struct EtwStringViewUtf8Z;          // Nul-terminated UTF-8 string returned from a Format*Utf8 method.
+class EtwCompiledPrefix;            // Prefix format string, parsed once for use with many events.
+class EtwOutputSink;                // Abstract base class for a destination of formatted output.
 enum EtwJsonItemFlags : unsigned;   // Selects options to use when formatting an item as JSON.
 enum EtwJsonSuffixFlags : unsigned; // Selects the metadata to include in a JSON string.
 enum EtwTimestampFormat : unsigned; // Controls timestamp formatting.
+enum EtwFloatFormat : unsigned;     // Controls FLOAT and DOUBLE formatting.
+enum EtwColumnType : UCHAR;         // Type of a column in an EtwColumnBatch.
+struct EtwColumnTableInfo;          // Information about a table in an EtwColumnBatch.
+struct EtwColumnInfo;               // Information about a column in an EtwColumnBatch.
+struct EtwColumnStructInfo;         // Information about a struct property in an EtwColumnBatch.
+class EtwColumnBatch;               // Typed column buffers from DecodeEventsToColumns.
+enum EtwArrowFormat : UCHAR;        // Selects the Arrow IPC format written by EtwArrowWriter.
+class EtwArrowWriter;               // Writes EtwColumnBatch tables as Arrow IPC streams or files.
+class EtwParquetWriter;             // Writes EtwColumnBatch tables as Parquet files.
+class EtwJsonSchemaTable;           // Schema IDs assigned by WriteCurrentEventAsSchemaJsonUtf8.
+class EtwJsonRehydrator;            // Converts schema JSON records back to JSON events.
+class EtwFieldProjection;           // Selects a subset of an event's fields by path.
+class EtwEventFilter;               // Selects events by header and payload field values.
+class EtwVisitor;                   // Base class for visitors used with EtwEnumerator::Visit.
+template<class T>
+struct EtwArraySpan;                // Typed view of a fixed-size array in the event data.
 class EtwEnumeratorCallbacks;       // Abstract base class for customizing EtwEnumerator.
 using EtwWCHAR = __wchar_t;         // Use native wchar_t for this API.
 using EtwPCWSTR = _Null_terminated_ __wchar_t const*; // Nul-terminated __wchar_t string.
@@ -92,6 +114,328 @@ namespace EtwInternal
         size_type m_size;
         size_type m_capacity;
     };
+
+    /*
+    Bounded cache of TRACE_EVENT_INFO blocks, keyed by event schema.
+    Used by EtwEnumerator::StartEvent to avoid calling GetEventInformation for
+    every event. When full, evicts the least-recently-used entry.
+
+    Manifest and WBEM events are keyed by provider ID and EVENT_DESCRIPTOR.
+    TraceLogging events are additionally keyed by the content of their
+    EVENT_SCHEMA_TL (and PROV_TRAITS) extended data items.
+    */
+    class SchemaCache
+    {
+    public:
+
+        struct Key
+        {
+            GUID ProviderId;
+            EVENT_DESCRIPTOR EventDescriptor;
+            USHORT Flags;         // EVENT_HEADER.Flags bits that affect decoding.
+            USHORT EventProperty; // EVENT_HEADER.EventProperty.
+            unsigned Hash;
+            USHORT cbSchemaTl;    // 0 if not TraceLogging.
+            USHORT cbProvTraits;  // 0 if not TraceLogging or no traits.
+            _Field_size_bytes_(cbSchemaTl) BYTE const* pSchemaTl;
+            _Field_size_bytes_(cbProvTraits) BYTE const* pProvTraits;
+        };
+
+        SchemaCache(SchemaCache const&) = delete;
+        SchemaCache& operator=(SchemaCache const&) = delete;
+        SchemaCache() noexcept;
+        ~SchemaCache() noexcept;
+
+        unsigned Capacity() const noexcept;
+        unsigned Count() const noexcept;
+        UINT64 Hits() const noexcept;
+        UINT64 Misses() const noexcept;
+
+        // Removes all entries and sets a new capacity. 0 disables the cache.
+        void SetCapacity(unsigned capacity) noexcept;
+
+        // Removes all entries and resets the hit/miss counters.
+        void Clear() noexcept;
+
+        // Initializes *pKey for the specified event. The key references the
+        // event's extended data, so it is only valid while pEventRecord is.
+        static void MakeKey(
+            _In_ EVENT_RECORD const* pEventRecord,
+            _Out_ Key* pKey) noexcept;
+
+        // Returns the cached TRACE_EVENT_INFO for key, or null if not found.
+        // Sets *ppPlan to the cached plan, or null if the entry has no plan.
+        // Updates the hit/miss counters and marks the entry as most-recent.
+        _Ret_maybenull_ TRACE_EVENT_INFO const* Find(
+            Key const& key,
+            _Outptr_result_maybenull_ void const** ppPlan) noexcept;
+
+        // Stores a copy of pTei and of the (optional) plan, evicting the
+        // least-recently-used entry if necessary. Returns the cached copy of
+        // pTei and sets *ppCachedPlan to the cached copy of the plan, or
+        // returns null if the cache is disabled or out of memory. May
+        // invalidate pointers returned by Find.
+        _Ret_maybenull_ TRACE_EVENT_INFO const* Insert(
+            Key const& key,
+            _In_reads_bytes_(cbTei) TRACE_EVENT_INFO const* pTei,
+            unsigned cbTei,
+            _In_reads_bytes_opt_(cbPlan) void const* pPlan,
+            unsigned cbPlan,
+            _Outptr_result_maybenull_ void const** ppCachedPlan) noexcept;
+
+    private:
+
+        struct Entry
+        {
+            GUID ProviderId;
+            EVENT_DESCRIPTOR EventDescriptor;
+            USHORT Flags;
+            USHORT EventProperty;
+            unsigned Hash;
+            USHORT cbSchemaTl;
+            USHORT cbProvTraits;
+            unsigned HashNext; // Next entry in the same hash bucket.
+            unsigned LruPrev;  // Next more-recently-used entry.
+            unsigned LruNext;  // Next less-recently-used entry.
+            unsigned cbTeiAligned;
+            unsigned cbPlanAligned; // 0 if no plan.
+            BYTE* pBlob;       // TRACE_EVENT_INFO, plan, SchemaTl, ProvTraits.
+        };
+
+        static unsigned const NoEntry = ~0u;
+
+        bool Matches(
+            Entry const& entry,
+            Key const& key) const noexcept;
+
+        void LruUnlink(
+            unsigned index) noexcept;
+
+        void LruPushFront(
+            unsigned index) noexcept;
+
+        void Evict(
+            unsigned index) noexcept;
+
+        Buffer<Entry> m_entries;
+        Buffer<unsigned> m_buckets; // Size is a power of 2.
+        unsigned m_capacity;
+        unsigned m_lruHead; // Most-recently-used.
+        unsigned m_lruTail; // Least-recently-used.
+        UINT64 m_hits;
+        UINT64 m_misses;
+    };
+
+    enum MapIndexKind : UCHAR
+    {
+        MapIndexKind_Scan,   // No index. Use the EVENT_MAP_INFO directly.
+        MapIndexKind_Dense,  // Slots[value - MinValue] is an entry index, or NoEntry.
+        MapIndexKind_Sorted, // Slots is { value, entry index } pairs, sorted by value.
+        MapIndexKind_Bitmap, // BitEntries and ComplexEntries.
+    };
+
+    /*
+    Lookup index for a cached EVENT_MAP_INFO, built by MapCache::Insert.
+    Value maps are indexed by value. Bitmaps (with up to 64 entries) are
+    indexed by bit. Entry sets are bitmasks of MapEntryArray positions.
+    */
+    struct MapIndex
+    {
+        static ULONG const NoEntry = ~ULONG(0);
+
+        // Returns the position of the first entry with the specified value,
+        // or NoEntry if there is no such entry. Requires Dense or Sorted.
+        ULONG FindValue(
+            ULONG value) const noexcept;
+
+        // Returns the set of entries that match value, i.e. the entries that
+        // a scan of the bitmap would select. Requires Bitmap.
+        UINT64 FindBits(
+            _In_ EVENT_MAP_INFO const* pMapInfo,
+            ULONG value) const noexcept;
+
+        MapIndexKind Kind;
+        ULONG MinValue;         // Dense: value of Slots[0].
+        ULONG SlotCount;        // Dense: number of slots. Sorted: number of pairs.
+        UINT64 ComplexEntries;  // Bitmap: entries with zero or multi-bit masks.
+        UINT64 BitEntries[32];  // Bitmap: BitEntries[n] = entries with mask (1 << n).
+        ULONG Slots[ANYSIZE_ARRAY];
+    };
+
+    /*
+    Bounded cache of EVENT_MAP_INFO blocks, keyed by provider ID and map name.
+    Used by EtwEnumerator to avoid calling GetEventMapInformation for every
+    formatted enumeration value. Also caches "map not found" results. Each
+    cached map has a MapIndex. When full, all entries are discarded.
+    */
+    class MapCache
+    {
+    public:
+
+        struct Key
+        {
+            GUID ProviderId;
+            unsigned Hash;
+            unsigned cchMapName;
+            _Field_size_(cchMapName) EtwPCWSTR pMapName;
+        };
+
+        MapCache(MapCache const&) = delete;
+        MapCache& operator=(MapCache const&) = delete;
+        MapCache() noexcept;
+        ~MapCache() noexcept;
+
+        unsigned Capacity() const noexcept;
+
+        // Removes all entries and sets a new capacity. 0 disables the cache.
+        void SetCapacity(unsigned capacity) noexcept;
+
+        // Removes all entries.
+        void Clear() noexcept;
+
+        // Initializes *pKey. The key references pMapName.
+        static void MakeKey(
+            _In_ EVENT_RECORD const* pEventRecord,
+            _In_ EtwPCWSTR pMapName,
+            _Out_ Key* pKey) noexcept;
+
+        // Returns true if key is in the cache. Sets *ppMapInfo and *ppMapIndex
+        // to the cached map, or to null if the map was not found.
+        bool Find(
+            Key const& key,
+            _Outptr_result_maybenull_ EVENT_MAP_INFO const** ppMapInfo,
+            _Outptr_result_maybenull_ MapIndex const** ppMapIndex) noexcept;
+
+        // Stores a copy of pMapInfo (null to record that the map was not
+        // found) and builds its index. Returns true and sets *ppMapInfo and
+        // *ppMapIndex to the cached copies on success. Returns false if the
+        // cache is disabled or out of memory. May invalidate pointers
+        // returned by Find.
+        bool Insert(
+            Key const& key,
+            _In_reads_bytes_opt_(cbMapInfo) EVENT_MAP_INFO const* pMapInfo,
+            unsigned cbMapInfo,
+            _Outptr_result_maybenull_ EVENT_MAP_INFO const** ppMapInfo,
+            _Outptr_result_maybenull_ MapIndex const** ppMapIndex) noexcept;
+
+    private:
+
+        struct Entry
+        {
+            GUID ProviderId;
+            unsigned Hash;
+            unsigned cchMapName;
+            unsigned HashNext;      // Next entry in the same hash bucket.
+            unsigned cbMapAligned;  // 0 if map was not found.
+            BYTE* pBlob;            // EVENT_MAP_INFO, map name, MapIndex.
+        };
+
+        static unsigned const NoEntry = ~0u;
+
+        Buffer<Entry> m_entries;
+        Buffer<unsigned> m_buckets; // Size is a power of 2.
+        unsigned m_capacity;
+    };
+
+    /*
+    Bounded cache of compiled event messages, keyed by the address and content
+    of the message string. Used by EtwEnumerator::FormatCurrentEvent to avoid
+    parsing the same message for every event. The compiled form is opaque to
+    the cache. When full, all entries are discarded.
+    */
+    class MessageCache
+    {
+    public:
+
+        struct Key
+        {
+            unsigned Hash;
+            unsigned cchMessage;
+            _Field_size_(cchMessage) EtwPCWSTR pMessage;
+        };
+
+        MessageCache(MessageCache const&) = delete;
+        MessageCache& operator=(MessageCache const&) = delete;
+        MessageCache() noexcept;
+        ~MessageCache() noexcept;
+
+        unsigned Capacity() const noexcept;
+
+        // Removes all entries and sets a new capacity. 0 disables the cache.
+        void SetCapacity(unsigned capacity) noexcept;
+
+        // Removes all entries.
+        void Clear() noexcept;
+
+        // Initializes *pKey. The key references szMessage.
+        static void MakeKey(
+            _In_z_ EtwPCWSTR szMessage,
+            _Out_ Key* pKey) noexcept;
+
+        // Returns the compiled message for key, or null if not found.
+        _Ret_maybenull_ void const* Find(
+            Key const& key) const noexcept;
+
+        // Stores a copy of the message and of the compiled message. Returns
+        // the cached copy of the compiled message, or null if the cache is
+        // disabled or out of memory. May invalidate pointers returned by Find.
+        _Ret_maybenull_ void const* Insert(
+            Key const& key,
+            _In_reads_bytes_(cbCompiled) void const* pCompiled,
+            unsigned cbCompiled) noexcept;
+
+    private:
+
+        struct Entry
+        {
+            EtwPCWSTR pMessage;     // Address of the original message (not owned).
+            unsigned Hash;
+            unsigned cchMessage;
+            unsigned HashNext;      // Next entry in the same hash bucket.
+            BYTE* pBlob;            // Message text, compiled message.
+        };
+
+        static unsigned const NoEntry = ~0u;
+
+        Buffer<Entry> m_entries;
+        Buffer<unsigned> m_buckets; // Size is a power of 2.
+        unsigned m_capacity;
+    };
+
+    /*
+    The date and time most recently formatted from a FILETIME. Timestamps in
+    the same second as the previous one only need their subseconds and time
+    zone suffix to be formatted.
+    */
+    struct TimestampCache
+    {
+        UINT64 Second;        // Adjusted FILETIME / 10000000.
+        unsigned Type;        // EtwTimestampFormat type, or 0 if empty.
+        unsigned cchDateTime;
+        EtwWCHAR DateTime[24]; // e.g. "2009-06-15T13:45:30".
+    };
+
+    // Buffer size needed by FormatShortestDouble and FormatShortestFloat.
+    unsigned const FloatCharsMax = 32;
+
+    /*
+    Writes the shortest decimal string that parses back to exactly value,
+    e.g. "0.1", "-5e-324", "1e+21". Uses plain notation when
+    1e-7 < |value| < 1e21 and scientific notation otherwise. Returns the
+    number of characters written (not nul-terminated).
+    PRECONDITION: value is finite.
+    */
+    unsigned FormatShortestDouble(
+        double value,
+        _Out_writes_to_(FloatCharsMax, return) wchar_t* pchOut) noexcept;
+
+    /*
+    Same as FormatShortestDouble, but the result is the shortest string that
+    parses back to exactly value when parsed as a float.
+    */
+    unsigned FormatShortestFloat(
+        float value,
+        _Out_writes_to_(FloatCharsMax, return) wchar_t* pchOut) noexcept;
 }
 // namespace EtwInternal
 
@@ -405,6 +749,9 @@ public:
     /*
     Starts decoding the specified event. This method uses
     enumeratorCallbacks.GetEventInformation() to obtain decoding information.
+    The decoding information is stored in the enumerator's schema cache, and
+    subsequent events with the same schema will use the cached information
+    without calling GetEventInformation() (see SetSchemaCacheCapacity).
 
     On success, changes the state to BeforeFirstItem and returns true.
     On failure, changes the state to None and returns false. Check LastError()
@@ -496,10 +843,167 @@ public:
     This method is useful to efficiently skip past an array of fixed-size
     items (i.e. an array where ElementSize is nonzero) if you process all of
     the array items within the ArrayBegin state. This method is also useful if
-    you are only interested in the top-level fields of an event.
+    you are only interested in the top-level fields of an event. When decode
+    plans are enabled, a struct or array of structs with a fixed size (see
+    GetFixedStructSize) is also skipped in one step.
     */
     bool MoveNextSibling() noexcept;
 
+    /*
+    Moves the enumerator to the next item selected by the projection (see
+    EtwFieldProjection). Items are visited in event order. Properties that
+    are not selected are skipped without being formatted, using precomputed
+    offsets to jump over runs of fixed-size properties and direct indexing
+    to jump to an element of an array of fixed-size items.
+
+    PRECONDITION: State != None.
+
+    To start, call this when State == BeforeFirstItem (i.e. after StartEvent
+    or Reset). Then call it repeatedly until it returns false. If it returns
+    true, the current item is the selected item (Value, ArrayBegin, or
+    StructBegin) and *pFieldIndex is the index of the path that selected it.
+    The item can be used as usual, e.g. with GetItemInfo, FormatCurrentValue,
+    or FormatCurrentItemAsJsonAndMoveNextSibling. Before the next call, the
+    enumerator must be either left at the selected item or moved past it
+    with a single MoveNextSibling (or with
+    FormatCurrentItemAsJsonAndMoveNextSibling). Do not use the same
+    projection with another enumerator until this returns false.
+
+    Returns false when there are no more selected items. In that case, if
+    the event was decoded successfully, State is AfterLastItem even if the
+    rest of the event was not decoded. Returns false if a decoding error
+    occurs (State == Error). Check LastError() for details. Possible errors
+    include ERROR_OUTOFMEMORY and ERROR_INVALID_DATA.
+    */
+    bool MoveNextProjected(
+        EtwFieldProjection& projection,
+        _Out_ unsigned* pFieldIndex) noexcept;
+
+    /*
+    Moves the enumerator directly to the top-level property with the
+    specified index (0 <= propertyIndex < TopLevelPropertyCount) and sets
+    *pItemInfo to GetItemInfo() for that property.
+
+    PRECONDITION: State != None.
+
+    When decode plans are enabled (see SetDecodePlansEnabled), the offset of
+    each top-level property that follows only fixed-size properties is
+    computed once per schema and cached with the TRACE_EVENT_INFO, so such a
+    property is reached without decoding the properties before it. Other
+    properties are reached by jumping to the last property with a known
+    offset and then decoding forward (as with MoveNextSibling).
+
+    Returns true if moved to the property. The current item is then the
+    property's Value, ArrayBegin, or StructBegin, exactly as if it had been
+    reached with MoveNext, so enumeration may continue from there.
+    Returns false if propertyIndex is out of range (LastError() ==
+    ERROR_NOT_FOUND, State unchanged) or if a decoding error occurs
+    (State == Error). On failure, *pItemInfo is zero-initialized.
+    */
+    bool GetFieldByIndex(
+        unsigned propertyIndex,
+        _Out_ EtwItemInfo* pItemInfo) noexcept;
+
+    /*
+    Same as GetFieldByIndex, but finds the first top-level property with the
+    specified name (case-sensitive). When decode plans are enabled, names
+    are found with a hash index that is cached with the TRACE_EVENT_INFO.
+    Returns false with LastError() == ERROR_NOT_FOUND if the event has no
+    top-level property with the specified name.
+    */
+    bool GetFieldByName(
+        _In_z_ EtwPCWSTR szName,
+        _Out_ EtwItemInfo* pItemInfo) noexcept;
+
+    /*
+    Evaluates the filter's expression against the current event (see
+    EtwEventFilter) and sets *pMatch to the result. Payload comparisons read
+    the field's data in place with GetFieldByIndex, and evaluation stops as
+    soon as the result is known, so an event that does not match is
+    rejected without being formatted or fully decoded.
+
+    PRECONDITION: State != None.
+
+    On return, State == BeforeFirstItem (as if by Reset), so a matching event
+    can be enumerated or formatted as usual. A payload field that cannot be
+    decoded compares as false. Returns false only if the filter's names
+    cannot be resolved for the event's schema (LastError() ==
+    ERROR_OUTOFMEMORY), in which case *pMatch is false. Do not use the same
+    filter with more than one thread at a time.
+    */
+    bool EvaluateFilter(
+        EtwEventFilter& filter,
+        _Out_ bool* pMatch) noexcept;
+
+    /*
+    Enumerates the items of the current event, calling a typed handler of
+    visitor for each item (see EtwVisitor). Visit is a template so that the
+    handlers are called directly: the compiler can inline them, and the
+    cases for types that the visitor does not handle reduce to nothing.
+
+    PRECONDITION: State == BeforeFirstItem (i.e. after StartEvent or Reset).
+
+    Simple arrays (ElementSize != 0) are delivered with a single call to a
+    typed array handler (e.g. OnUInt32Array) that receives an EtwArraySpan
+    over the event data, and are then skipped as if by MoveNextSibling.
+    Arrays of UNICODECHAR or ANSICHAR are delivered as a single string.
+    Arrays of POINTER or SIZET (whose element size depends on the event) and
+    all other arrays are delivered as OnArrayBegin, one call per element,
+    then OnArrayEnd. Structs are delivered as OnStructBegin, one call per
+    member, then OnStructEnd.
+
+    Handlers must not move the enumerator, but may call GetItemInfo or
+    GetRawItemInfo for details that are not passed to the handler (e.g.
+    OutType or MapName). A handler returns true to continue or false to
+    stop. If a handler returns false, Visit returns true and the enumerator
+    is left at the item that was passed to the handler.
+
+    Returns true if all items were visited (State == AfterLastItem) or if
+    the visitor stopped the enumeration. Returns false if a decoding error
+    occurs (State == Error). Check LastError() for details.
+    */
+    template<class Visitor>
+    bool Visit(
+        Visitor& visitor) noexcept;
+
+    /*
+    If the current item is the ArrayBegin of a simple array (ElementSize !=
+    0) and ElementSize == sizeof(T), sets *pSpan to a typed view of the
+    array's elements and returns true. Otherwise sets *pSpan to { null, 0 }
+    and returns false. Does not change the state of the enumerator.
+
+    The elements of a simple array are contiguous, and their total size is
+    validated against the event data when the array starts, so the span can
+    be read at ArrayBegin without visiting the elements. Use MoveNextSibling
+    to move past the array. Only the element size is checked: choose T based
+    on InType (e.g. UINT32 for UINT32 or HEXINT32, GUID for GUID, UINT64 for
+    POINTER when ElementSize == 8).
+    */
+    template<class T>
+    bool GetArraySpan(
+        _Out_ EtwArraySpan<T>* pSpan) const noexcept;
+
+    /*
+    If the current item is the StructBegin of a struct, or the ArrayBegin of
+    an array of structs, and the struct has a fixed size, sets *pcbStruct to
+    the size of one struct and returns true. Otherwise sets *pcbStruct to 0
+    and returns false. Does not change the state of the enumerator.
+
+    A struct has a fixed size if each member is a fixed-size value (not a
+    string, binary, SID, POINTER, or SIZET) or struct, or a fixed-count array
+    of these, and no member is used as the count or length of another
+    property. Sizes are computed once per schema as part of the decode plan,
+    so this returns false if decode plans are not in use for the event (see
+    SetDecodePlansEnabled).
+
+    On success, the structs start at GetItemInfo().Data and are contiguous,
+    so element i of an array of structs starts at Data + i * *pcbStruct, and
+    the event is known to contain all of the array's structs (ArrayCount *
+    *pcbStruct bytes at ArrayBegin, *pcbStruct bytes at StructBegin).
+    */
+    bool GetFixedStructSize(
+        _Out_ unsigned* pcbStruct) const noexcept;
+
     /*
     Gets information that applies to the current event, e.g. the provider
     name, event name (if available), control GUID, decode GUID.
@@ -845,6 +1349,17 @@ public:
         EtwJsonSuffixFlags jsonSuffixFlags,
         _Out_ EtwStringViewZ* pString) noexcept;
 
+    /*
+    Same as FormatCurrentEvent, but uses a compiled prefix instead of a
+    prefix format string. Use this when formatting many events with the same
+    prefix. The prefix variables that are not used by the compiled prefix are
+    not computed.
+    */
+    bool FormatCurrentEvent(
+        EtwCompiledPrefix const& prefix,
+        EtwJsonSuffixFlags jsonSuffixFlags,
+        _Out_ EtwStringViewZ* pString) noexcept;
+
     /*
     Formats the current event as a nul-terminated string. Uses the specified
     event message.
@@ -992,6 +1507,14 @@ public:
         _In_z_ EtwPCWSTR szPrefixFormat,
         _Out_ EtwStringViewZ* pString) noexcept;
 
+    /*
+    Same as FormatCurrentEventPrefix, but uses a compiled prefix instead of a
+    prefix format string.
+    */
+    bool FormatCurrentEventPrefix(
+        EtwCompiledPrefix const& prefix,
+        _Out_ EtwStringViewZ* pString) noexcept;
+
     /*
     Formats the current event as a nul-terminated string containing an
     optional prefix followed by a JSON object string.
@@ -1060,6 +1583,23 @@ public:
         EtwJsonSuffixFlags jsonSuffixFlags,
         _Out_ EtwStringViewZ* pString) noexcept;
 
+    /*
+    Same as FormatCurrentEventAsJson, but the JSON object contains only the
+    items selected by the projection, in event order. Each item's JSON name
+    is its path, e.g. for paths "FileName" and "Info.Size":
+
+        PREFIX{"FileName":"a.txt","Info.Size":5,"meta":{...}}
+
+    Selected items that are not present in the event (e.g. the path's name
+    is not in the event's schema, or the array index is out of range) are
+    omitted. The event's EventMessage is not used.
+    */
+    bool FormatCurrentEventAsJson(
+        EtwFieldProjection& projection,
+        _In_opt_z_ EtwPCWSTR szPrefixFormat,
+        EtwJsonSuffixFlags jsonSuffixFlags,
+        _Out_ EtwStringViewZ* pString) noexcept;
+
     /*
     Formats the current logical item (value, struct, array, or event) as a
     nul-terminated JSON string and moves the enumerator to the logical item's
@@ -1236,144 +1776,717 @@ public:
         _Out_ EtwStringView* pString) noexcept;
 
     /*
-    Returns the number of 100ns units per "timer tick". This value is used to
-    format the KTIME and UTIME variables (i.e. for converting the KernelTime
-    and UserTime tick counts into milliseconds).
+    Same as FormatCurrentEvent, but returns a UTF-8 string.
+
+    The string is built by the same code as FormatCurrentEvent and is then
+    encoded as UTF-8 in a single pass (unpaired surrogates become U+FFFD).
+    Use this instead of converting the result of FormatCurrentEvent, e.g.
+    when writing to a file or socket.
+
+    The returned Data pointer points into a buffer maintained within the
+    EtwEnumerator object. This buffer becomes invalid the next time a
+    non-const method is invoked on this EtwEnumerator object or when the
+    EtwEnumerator object is destroyed.
     */
-    unsigned TimerResolution() const noexcept;
+    bool FormatCurrentEventUtf8(
+        _In_opt_z_ EtwPCWSTR szPrefixFormat,
+        EtwJsonSuffixFlags jsonSuffixFlags,
+        _Out_ EtwStringViewUtf8Z* pString) noexcept;
 
     /*
-    Sets the number of 100ns units per "timer tick". This value is used to
-    format the KTIME and UTIME variables (i.e. for converting the KernelTime
-    and UserTime tick counts into milliseconds).
-
-    The value to use here comes from the TimerResolution value of the
-    TRACE_LOGFILE_HEADER structure. Use PreviewEvent to automatically update
-    TimerResolution.
+    Same as FormatCurrentEvent with a compiled prefix, but returns a UTF-8
+    string. See FormatCurrentEventUtf8 for details.
     */
-    void SetTimerResolution(
-        unsigned value) noexcept;
+    bool FormatCurrentEventUtf8(
+        EtwCompiledPrefix const& prefix,
+        EtwJsonSuffixFlags jsonSuffixFlags,
+        _Out_ EtwStringViewUtf8Z* pString) noexcept;
 
     /*
-    Helper function that converts an EVENT_HEADER KernelTime or UserTime value
-    into milliseconds, based on the current TimerResolution property.
+    Same as FormatCurrentEventAsJson, but returns a UTF-8 string.
+
+    Names and values are written as UTF-8 directly. String values
+    (UNICODESTRING, and ANSI strings with outType UTF8, JSON, or XML) are
+    escaped and encoded straight from the event payload. Other values, the
+    prefix, and the "meta" suffix are formatted as UTF-16 and then encoded.
+    Otherwise the same as FormatCurrentEventUtf8.
     */
-    unsigned TicksToMilliseconds(
-        unsigned ticks) const noexcept;
+    bool FormatCurrentEventAsJsonUtf8(
+        _In_opt_z_ EtwPCWSTR szPrefixFormat,
+        EtwJsonSuffixFlags jsonSuffixFlags,
+        _Out_ EtwStringViewUtf8Z* pString) noexcept;
 
     /*
-    Returns the size that will be used for POINTER and SIZE_T fields when the
-    event does not specify its own pointer size. This size will be 4 or 8.
-    This value is not used very often since most events specify their own
-    pointer size.
+    Same as FormatCurrentItemAsJsonAndMoveNextSibling, but returns a UTF-8
+    string. See FormatCurrentEventAsJsonUtf8 for details.
     */
-    UCHAR PointerSizeFallback() const noexcept;
+    bool FormatCurrentItemAsJsonAndMoveNextSiblingUtf8(
+        EtwJsonItemFlags jsonItemFlags,
+        _Out_ EtwStringViewUtf8Z* pString) noexcept;
 
     /*
-    This method is not needed very often. The default behavior is usually ok.
+    Same as FormatCurrentValue, but returns a UTF-8 string.
 
-    PRECONDITION: value is 4 or 8.
+    ANSI string values with outType UTF8, JSON, or XML are returned without
+    conversion if they contain valid UTF-8. UNICODESTRING values are encoded
+    directly from the event payload. Other values are formatted by the same
+    code as FormatCurrentValue and then encoded as UTF-8. See
+    FormatCurrentEventUtf8 for details.
+    */
+    bool FormatCurrentValueUtf8(
+        _Out_ EtwStringViewUtf8* pString) noexcept;
 
-    Sets the size to use for POINTER and SIZE_T fields when the event does not
-    specify its own pointer size. The default pointer size fallback is the
-    size of a pointer in the current (decoder) process, i.e. 4 if the
-    enumerator is running in a 32-bit process, 8 if the enumerator is running
-    in a 64-bit process. Changes to this setting take effect on the next
-    StartEvent or MoveNext.
+    /*
+    Same as FormatCurrentEvent, but sends the result to the specified sink
+    (as UTF-16, without nul termination) instead of returning it.
 
-    Most events have a flag indicating whether the event originated from a
-    32-bit process or a 64-bit process. If the flag is present, the size from
-    the flag is used. WBEM/MOF events from very old trace files might not have
-    the flag, in which case the pointer size fallback is used.
+    On success, returns true. On failure, returns false. Check LastError()
+    for details. Errors returned by the sink are reported via LastError().
+    The JSON items of an event without a message are sent to the sink in
+    segments as they are formatted, each segment ending after a complete item,
+    so the enumerator does not buffer the whole result of a large event. The
+    prefix, an event message, and the "meta" suffix are buffered. On failure,
+    nothing is sent to the sink unless the sink's Write or Commit method
+    failed or a segment had already been sent. In that case the sink's Abort
+    method is called so that it can discard the partial result.
+
+    Use this with a sink that writes to the final destination (e.g. a file,
+    a ring buffer, or a caller-owned arena) to avoid copying the result out
+    of an EtwStringView.
     */
-    void SetPointerSizeFallback(
-        UCHAR value) noexcept;
+    bool WriteCurrentEvent(
+        EtwOutputSink& sink,
+        _In_opt_z_ EtwPCWSTR szPrefixFormat,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
 
     /*
-    Returns the format that will be used when formatting timestamps.
-    This affects both event timestamps (e.g. from %!TIME! variables in the
-    prefix) and FILETIME or SYSTEMTIME fields in the event.
-    The default format is EtwTimestampFormat_Default.
+    Same as FormatCurrentEvent with a compiled prefix, but sends the result
+    to the specified sink. See WriteCurrentEvent for details.
     */
-    EtwTimestampFormat TimestampFormat() const noexcept;
+    bool WriteCurrentEvent(
+        EtwOutputSink& sink,
+        EtwCompiledPrefix const& prefix,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
 
     /*
-    Sets the format that will be used when formatting timestamps.
-    This affects both event timestamps (e.g. from %!TIME! variables in the
-    prefix) and FILETIME or SYSTEMTIME fields in the event.
-    The default value is EtwTimestampFormat_Default.
+    Same as FormatCurrentEventAsJson, but sends the result to the specified
+    sink. See WriteCurrentEvent for details.
+    */
+    bool WriteCurrentEventAsJson(
+        EtwOutputSink& sink,
+        _In_opt_z_ EtwPCWSTR szPrefixFormat,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
 
-    Returns true and updates format if value is a valid timestamp format.
-    Returns false and does nothing if value is not a valid timestamp format.
+    /*
+    Same as FormatCurrentItemAsJsonAndMoveNextSibling, but sends the result
+    to the specified sink. See WriteCurrentEvent for details.
     */
-    bool SetTimestampFormat(EtwTimestampFormat value) noexcept;
+    bool WriteCurrentItemAsJsonAndMoveNextSibling(
+        EtwOutputSink& sink,
+        EtwJsonItemFlags jsonItemFlags) noexcept;
 
     /*
-    Gets the time zone bias that will be used when converting time stamps to
-    local time (used only if the TimestampFormat has the
-    EtwTimestampFormat_Local flag set).
+    Same as FormatCurrentValue, but sends the result to the specified sink.
+    See WriteCurrentEvent for details.
     */
-    int TimeZoneBiasMinutes() const noexcept;
+    bool WriteCurrentValue(
+        EtwOutputSink& sink) noexcept;
 
     /*
-    Sets the time zone bias that will be used when converting time stamps to
-    local time (used only if the TimestampFormat has the
-    EtwTimestampFormat_Local flag set). The default value is based on the
-    local time zone when the EtwEnumerator object is constructed.
+    Same as WriteCurrentEvent, but sends the result to the sink as UTF-8.
 
-    PRECONDITION: value must be in the range -1440 and 1440 (i.e. bias must be
-    24 hours or less).
+    If the sink implements Reserve, the result is encoded directly into the
+    sink's memory. Otherwise, the result is encoded into a buffer maintained
+    within the EtwEnumerator object and then passed to the sink's Write
+    method.
     */
-    void SetTimeZoneBiasMinutes(
-        _In_range_(-1440, 1440) int value) noexcept;
+    bool WriteCurrentEventUtf8(
+        EtwOutputSink& sink,
+        _In_opt_z_ EtwPCWSTR szPrefixFormat,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
 
     /*
-    Adds TimeZoneBiasMinutes() to the specified utcFileTime value. Returns the
-    adjusted time. Adjustment is performed using saturation, i.e. returns 0
-    instead of a negative value and returns MAXINT64 instead of overflowing.
+    Same as WriteCurrentEvent with a compiled prefix, but sends the result
+    to the sink as UTF-8. See WriteCurrentEventUtf8 for details.
     */
-    INT64 AdjustFileTimeToLocal(
-        INT64 utcFileTime) const noexcept;
+    bool WriteCurrentEventUtf8(
+        EtwOutputSink& sink,
+        EtwCompiledPrefix const& prefix,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
 
     /*
-    Adds biasMinutes to the specified fileTime value. Returns the adjusted
-    time. Adjustment is performed using saturation, i.e. returns 0 instead of a
-    negative value and returns MAXINT64 instead of overflowing.
+    Same as WriteCurrentEventAsJson, but sends the result to the sink as
+    UTF-8. The result is built by the same code as
+    FormatCurrentEventAsJsonUtf8 and passed to the sink's Write method in
+    segments. See WriteCurrentEvent for details.
     */
-    static INT64 AdjustFileTime(
-        INT64 fileTime,
-        int biasMinutes) noexcept;
+    bool WriteCurrentEventAsJsonUtf8(
+        EtwOutputSink& sink,
+        _In_opt_z_ EtwPCWSTR szPrefixFormat,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
 
-private:
+    /*
+    Same as FormatCurrentEventAsJson with a projection, but encodes the
+    result as UTF-8 and sends it to the specified sink. See WriteCurrentEvent
+    for details.
+    */
+    bool WriteCurrentEventAsJsonUtf8(
+        EtwOutputSink& sink,
+        EtwFieldProjection& projection,
+        _In_opt_z_ EtwPCWSTR szPrefixFormat,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
 
-    struct StackEntry
-    {
-        USHORT PropertyIndex;
-        USHORT PropertyEnd;
-        USHORT ArrayIndex;
-        USHORT ArrayCount;
-        bool IsStruct;
-        bool IsArray;
-    };
+    /*
+    Same as WriteCurrentItemAsJsonAndMoveNextSibling, but sends the result
+    to the sink as UTF-8. The result is built by the same code as
+    FormatCurrentItemAsJsonAndMoveNextSiblingUtf8 and passed to the sink's
+    Write method in segments. See WriteCurrentEvent for details.
+    */
+    bool WriteCurrentItemAsJsonAndMoveNextSiblingUtf8(
+        EtwOutputSink& sink,
+        EtwJsonItemFlags jsonItemFlags) noexcept;
 
-    enum SubState : UCHAR;
-    enum ValueType : UCHAR;
-    enum Categories : UCHAR;
-    class ParsedPrintf;
-    class FormatContext;
+    /*
+    Same as FormatCurrentValueUtf8, but sends the result to the specified
+    sink. See WriteCurrentEvent for details.
+    */
+    bool WriteCurrentValueUtf8(
+        EtwOutputSink& sink) noexcept;
 
-private:
+    /*
+    Encodes the current event as CBOR (RFC 8949) and sends the result to the
+    specified sink. The structure is the same as FormatCurrentEventAsJson
+    with no prefix: a map of the event's fields followed by an optional
+    "meta" map controlled by jsonSuffixFlags. Structs are maps and arrays
+    are arrays (both with indefinite length). Values are encoded directly
+    from the event data instead of as text:
+
+    - Integers (including hex integers, pointers, and keywords) are CBOR
+      integers. BOOLEAN is true or false. FLOAT and DOUBLE are CBOR floats
+      of the same size. TDH_INTYPE_NULL is null.
+    - Strings are UTF-8 text strings. Binary values are byte strings.
+    - GUIDs are tag 37 (UUID) byte strings in RFC 4122 byte order.
+    - FILETIME values and the "time" metadata are tag 1 (seconds since
+      1970): an integer, or a float64 if there are fractional seconds.
+      FILETIME values are not adjusted for EtwTimestampFormat or time zone.
+    - Values with a map or result-code name (e.g. HRESULT) are text strings
+      if the name is found and integers otherwise. Other values (ANSI
+      strings, SYSTEMTIME, SID, IP addresses, etc.) are text strings
+      formatted as for FormatCurrentValue.
+
+    This method moves the enumeration position as it encodes the items.
+    After this method returns, the enumerator's position is unspecified.
 
-    void ResetImpl() noexcept;
+    On success, returns true. On failure, returns false. Check LastError()
+    for details. Possible errors include ERROR_OUTOFMEMORY or
+    ERROR_INVALID_DATA for decoding problems, and errors returned by the
+    sink. As with WriteCurrentEvent, the items of a large event are sent to
+    the sink in segments. On failure, nothing is sent to the sink unless the
+    sink's Write method failed or a segment had already been sent.
+
+    Use this instead of WriteCurrentEventAsJsonUtf8 when the consumer can
+    read CBOR. The output is typically smaller and is faster to produce and
+    to parse.
+    */
+    bool WriteCurrentEventAsCbor(
+        EtwOutputSink& sink,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
 
-    bool NextProperty() noexcept;
+    /*
+    Writes the current event as "schema JSON": newline-delimited JSON
+    records in UTF-8 that carry field names once per schema instead of once
+    per event. Use EtwJsonRehydrator to convert the records back to the
+    FormatCurrentEventAsJson format.
+
+    The first time an event schema is seen (same key as the schema cache,
+    plus jsonSuffixFlags), a schema record is written and the schema is
+    added to the table with the next ID (0, 1, 2...):
+
+        {"schema":ID,"meta":{...},"dynamic":[...],"fields":[...]}
+
+    - "meta" has the metadata that is the same for every event of the
+      schema (provider, event, id, version, channel, level, opcode, task,
+      keywords, tags, attribs), formatted as for FormatCurrentEventAsJson.
+      Omitted if jsonSuffixFlags is 0.
+    - "dynamic" has the names of the per-event metadata selected by
+      jsonSuffixFlags (time, cpu, pid, tid, activity, relatedActivity,
+      ptime, ktime, utime). Omitted if none are selected.
+    - "fields" has an entry per top-level property: {"name":NAME,"in":N,
+      "out":N} for a value, or {"name":NAME,"fields":[...]} for a struct,
+      plus "array":true if the property is an array.
+
+    Then an event record is written:
+
+        [ID,[VALUES...],[DYNAMIC...]]
+
+    VALUES has the property values in order, formatted as for
+    FormatCurrentEventAsJson. Arrays are JSON arrays and structs are JSON
+    arrays of member values. DYNAMIC has the per-event metadata in the order
+    given by the schema's "dynamic" list, with null for values that are
+    omitted for this event (e.g. pid 0xFFFFFFFF). DYNAMIC is omitted if the
+    schema has no "dynamic" list.
+
+    Each record ends with '\n'. The schema and event records are sent to
+    the sink in a single Write. Use one table per output stream, and Clear
+    the table when starting a new stream.
+
+    This method moves the enumeration position as it formats the items.
+    After this method returns, the enumerator's position is unspecified.
 
-    void StartStruct() noexcept;
+    On success, returns true. On failure, returns false. Check LastError()
+    for details. On failure, nothing is sent to the sink (unless the sink's
+    Write method failed) and the table is unchanged.
+    */
+    bool WriteCurrentEventAsSchemaJsonUtf8(
+        EtwJsonSchemaTable& schemas,
+        EtwOutputSink& sink,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
+
+    /*
+    Formats a batch of events as newline-delimited JSON (NDJSON) in UTF-8.
+    For each event record, calls PreviewEvent and StartEvent, then appends
+    the event's JSON (as from FormatCurrentEventAsJson with no prefix) and a
+    '\n' to a single output block. Returns the number of event records
+    processed, i.e. the index of the first event record that is not included
+    in the block.
+
+    Processing stops early when the block size reaches cbFlushThreshold
+    bytes (if cbFlushThreshold is nonzero), or if the block cannot grow to
+    hold the next event. The caller should write the block to its
+    destination, then call again with the unprocessed event records. Unless
+    cEventRecords is 0, each call processes at least one event record.
+
+    If pEventErrors is not null, pEventErrors[i] receives the result of
+    processing event record i, for each processed event record. An event
+    that fails to start or format (e.g. a WPP event, or an event with a
+    decoding error) is left out of the block, and processing continues with
+    the next event record.
+
+    Use this instead of calling StartEvent and FormatCurrentEventAsJsonUtf8
+    for each event when converting many events to NDJSON, so that the output
+    can be written with a few large writes.
+
+    After this method returns, the enumerator's state is unspecified. The
+    returned Data pointer points into a buffer maintained within the
+    EtwEnumerator object. This buffer becomes invalid the next time a
+    non-const method is invoked on this EtwEnumerator object or when the
+    EtwEnumerator object is destroyed.
+    */
+    unsigned FormatEventsAsJsonUtf8(
+        _In_reads_(cEventRecords) EVENT_RECORD const* const* ppEventRecords,
+        unsigned cEventRecords,
+        EtwJsonSuffixFlags jsonSuffixFlags,
+        unsigned cbFlushThreshold,
+        _Out_writes_opt_(cEventRecords) LSTATUS* pEventErrors,
+        _Out_ EtwStringViewUtf8* pBlock) noexcept;
+
+    /*
+    Decodes a batch of events into typed columns, without formatting. For
+    each event record, calls PreviewEvent and StartEvent, then adds a row to
+    the batch table for the event's schema (creating the table if needed).
+    See EtwColumnBatch for the layout of the tables. Returns the number of
+    rows added.
+
+    If pEventErrors is not null, pEventErrors[i] receives the result of
+    processing event record i. An event that fails to start (e.g. a WPP
+    event, or an event with no decoding information) does not get a row. An
+    event that fails partway through decoding (e.g. ERROR_INVALID_DATA for a
+    truncated payload) gets a row in which the remaining columns are null,
+    and its error is reported in pEventErrors.
+
+    Use this instead of MoveNext, GetItemInfo, and FormatCurrentValue when
+    loading events into a columnar store.
+
+    After this method returns, the enumerator's state is unspecified.
+    */
+    unsigned DecodeEventsToColumns(
+        _In_reads_(cEventRecords) EVENT_RECORD const* const* ppEventRecords,
+        unsigned cEventRecords,
+        EtwColumnBatch& batch,
+        _Out_writes_opt_(cEventRecords) LSTATUS* pEventErrors) noexcept;
+
+    /*
+    Same as DecodeEventsToColumns, but adds a row for the current event
+    (i.e. the event from the most recent successful StartEvent) instead of
+    starting a new one. Use this when the event has already been started,
+    e.g. to check it with EvaluateFilter before adding it to the batch.
+
+    PRECONDITION: State != None.
+
+    Returns true if a row was added. LastError() receives the result of
+    processing the event: ERROR_SUCCESS, the error for an event that fails
+    partway through decoding (the row's remaining columns are null), or
+    ERROR_OUTOFMEMORY if no row could be added.
+
+    After this method returns, the enumerator's state is unspecified.
+    */
+    bool DecodeCurrentEventToColumns(
+        EtwColumnBatch& batch) noexcept;
+
+    /*
+    Gets the capacity, entry count, and hit/miss counters of the schema cache
+    used by StartEvent. The counters can be used to tune the cache capacity.
+    */
+    EtwSchemaCacheInfo GetSchemaCacheInfo() const noexcept;
+
+    /*
+    Sets the maximum number of schemas (TRACE_EVENT_INFO blocks) that
+    StartEvent will cache. When the cache is full, the least-recently-used
+    schema is evicted. The default capacity is 4096. Set to 0 to disable the
+    cache, i.e. to call enumeratorCallbacks.GetEventInformation() for every
+    event.
+
+    Manifest and WBEM events are cached by provider ID and EVENT_DESCRIPTOR.
+    TraceLogging events are cached by provider ID, EVENT_DESCRIPTOR, and the
+    content of the event's TraceLogging metadata. Disable the cache if your
+    GetEventInformation() callback can return different information for
+    events with the same key (e.g. if decoding manifests are unloaded or
+    replaced while processing a trace).
+
+    This removes all cached schemas and sets State to None.
+    */
+    void SetSchemaCacheCapacity(
+        unsigned value) noexcept;
+
+    /*
+    Removes all schemas from the schema cache and resets the hit/miss
+    counters. Capacity is unchanged.
+
+    This sets State to None.
+    */
+    void ClearSchemaCache() noexcept;
+
+    /*
+    Sets the maximum number of maps (EVENT_MAP_INFO blocks) that the format
+    methods will cache. When the cache is full, all cached maps are
+    discarded. The default capacity is 1024. Set to 0 to disable the cache,
+    i.e. to call enumeratorCallbacks.GetEventMapInformation() every time a
+    value with a map is formatted.
+
+    Maps are cached by provider ID and map name, along with an index that
+    allows a value to be formatted without scanning the map. Disable the
+    cache if your GetEventMapInformation() callback can return different
+    information for the same provider and map name.
+
+    This removes all cached maps.
+    */
+    void SetMapCacheCapacity(
+        unsigned value) noexcept;
+
+    /*
+    Removes all maps from the map cache. Capacity is unchanged.
+    */
+    void ClearMapCache() noexcept;
+
+    /*
+    Sets the maximum number of compiled event messages that FormatCurrentEvent
+    and FormatCurrentEventWithMessage will cache. When the cache is full, all
+    compiled messages are discarded. The default capacity is 256. Set to 0 to
+    disable the cache, i.e. to parse the message for every event.
+
+    Messages are cached by the address and content of the message string, so
+    a caller-supplied message may be modified between calls.
+
+    This removes all compiled messages.
+    */
+    void SetMessageCacheCapacity(
+        unsigned value) noexcept;
+
+    /*
+    Removes all compiled messages from the message cache. Capacity is
+    unchanged.
+    */
+    void ClearMessageCache() noexcept;
+
+    /*
+    Returns true if StartEvent will use compiled decode plans.
+    */
+    bool DecodePlansEnabled() const noexcept;
+
+    /*
+    This method is not needed very often. The default behavior is usually ok.
+
+    Controls whether events started with StartEvent are enumerated using a
+    compiled decode plan. The default value is true.
+
+    When the schema cache stores a new TRACE_EVENT_INFO, StartEvent also
+    compiles the event's properties into a decode plan: a flat list of steps
+    with precomputed element sizes, count and length sources, and cooked
+    intypes. MoveNext then follows the plan instead of re-interpreting each
+    EVENT_PROPERTY_INFO. The results are the same either way. Set this to
+    false to always use the reference decoder, e.g. to compare the two.
+
+    Decode plans are not used for events started with
+    StartEventWithTraceEventInfo, for events that are not cached (e.g. if the
+    schema cache is disabled), or for TRACE_EVENT_INFO blocks with
+    out-of-range property references. Changes to this setting take effect on
+    the next StartEvent.
+    */
+    void SetDecodePlansEnabled(
+        bool value) noexcept;
+
+    /*
+    Returns true if StartEvent will record an item tape.
+    */
+    bool ItemTapeEnabled() const noexcept;
+
+    /*
+    Controls whether StartEvent records an item tape. The default value is
+    false.
+
+    When enabled, the first pass over each event (MoveNext calls starting
+    from StartEvent) records the state of each item (position, cooked data,
+    sizes, types, property and array indexes) in a reusable buffer. The
+    first call to Reset, MoveNextSibling, GetFieldByIndex, or
+    MoveNextProjected finishes the recording. After that, MoveNext,
+    MoveNextSibling, GetFieldByIndex, MoveNextProjected, and the
+    FormatCurrentEvent* methods replay items from the tape instead of
+    decoding the payload again. A decoding error is recorded and replayed at
+    the item where it occurred. The results are the same either way.
+
+    This helps when each event is enumerated or formatted more than once,
+    e.g. formatted as text and as JSON. It does not help (and costs a little)
+    when each event is enumerated once, or when only a few fields are read
+    with GetFieldByIndex. If the tape cannot be allocated, the event is
+    decoded normally. Changes to this setting take effect on the next
+    StartEvent.
+    */
+    void SetItemTapeEnabled(
+        bool value) noexcept;
+
+    /*
+    Returns the number of 100ns units per "timer tick". This value is used to
+    format the KTIME and UTIME variables (i.e. for converting the KernelTime
+    and UserTime tick counts into milliseconds).
+    */
+    unsigned TimerResolution() const noexcept;
+
+    /*
+    Sets the number of 100ns units per "timer tick". This value is used to
+    format the KTIME and UTIME variables (i.e. for converting the KernelTime
+    and UserTime tick counts into milliseconds).
+
+    The value to use here comes from the TimerResolution value of the
+    TRACE_LOGFILE_HEADER structure. Use PreviewEvent to automatically update
+    TimerResolution.
+    */
+    void SetTimerResolution(
+        unsigned value) noexcept;
+
+    /*
+    Helper function that converts an EVENT_HEADER KernelTime or UserTime value
+    into milliseconds, based on the current TimerResolution property.
+    */
+    unsigned TicksToMilliseconds(
+        unsigned ticks) const noexcept;
+
+    /*
+    Returns the size that will be used for POINTER and SIZE_T fields when the
+    event does not specify its own pointer size. This size will be 4 or 8.
+    This value is not used very often since most events specify their own
+    pointer size.
+    */
+    UCHAR PointerSizeFallback() const noexcept;
+
+    /*
+    This method is not needed very often. The default behavior is usually ok.
+
+    PRECONDITION: value is 4 or 8.
+
+    Sets the size to use for POINTER and SIZE_T fields when the event does not
+    specify its own pointer size. The default pointer size fallback is the
+    size of a pointer in the current (decoder) process, i.e. 4 if the
+    enumerator is running in a 32-bit process, 8 if the enumerator is running
+    in a 64-bit process. Changes to this setting take effect on the next
+    StartEvent or MoveNext.
+
+    Most events have a flag indicating whether the event originated from a
+    32-bit process or a 64-bit process. If the flag is present, the size from
+    the flag is used. WBEM/MOF events from very old trace files might not have
+    the flag, in which case the pointer size fallback is used.
+    */
+    void SetPointerSizeFallback(
+        UCHAR value) noexcept;
+
+    /*
+    Returns the format that will be used when formatting timestamps.
+    This affects both event timestamps (e.g. from %!TIME! variables in the
+    prefix) and FILETIME or SYSTEMTIME fields in the event.
+    The default format is EtwTimestampFormat_Default.
+    */
+    EtwTimestampFormat TimestampFormat() const noexcept;
+
+    /*
+    Sets the format that will be used when formatting timestamps.
+    This affects both event timestamps (e.g. from %!TIME! variables in the
+    prefix) and FILETIME or SYSTEMTIME fields in the event.
+    The default value is EtwTimestampFormat_Default.
+
+    Returns true and updates format if value is a valid timestamp format.
+    Returns false and does nothing if value is not a valid timestamp format.
+    */
+    bool SetTimestampFormat(EtwTimestampFormat value) noexcept;
+
+    /*
+    Returns the format that will be used when formatting FLOAT and DOUBLE
+    fields. The default format is EtwFloatFormat_Default.
+    */
+    EtwFloatFormat FloatFormat() const noexcept;
+
+    /*
+    Sets the format that will be used when formatting FLOAT and DOUBLE
+    fields. This affects FormatCurrentValue, JSON formatting, and event
+    messages (except for fields formatted with an explicit printf-style
+    float specifier, e.g. "%.2f"). The default value is
+    EtwFloatFormat_Default.
+
+    Returns true and updates format if value is a valid float format.
+    Returns false and does nothing if value is not a valid float format.
+    */
+    bool SetFloatFormat(EtwFloatFormat value) noexcept;
+
+    /*
+    Gets the time zone bias that will be used when converting time stamps to
+    local time (used only if the TimestampFormat has the
+    EtwTimestampFormat_Local flag set).
+    */
+    int TimeZoneBiasMinutes() const noexcept;
+
+    /*
+    Sets the time zone bias that will be used when converting time stamps to
+    local time (used only if the TimestampFormat has the
+    EtwTimestampFormat_Local flag set). The default value is based on the
+    local time zone when the EtwEnumerator object is constructed.
+
+    PRECONDITION: value must be in the range -1440 and 1440 (i.e. bias must be
+    24 hours or less).
+    */
+    void SetTimeZoneBiasMinutes(
+        _In_range_(-1440, 1440) int value) noexcept;
+
+    /*
+    Adds TimeZoneBiasMinutes() to the specified utcFileTime value. Returns the
+    adjusted time. Adjustment is performed using saturation, i.e. returns 0
+    instead of a negative value and returns MAXINT64 instead of overflowing.
+    */
+    INT64 AdjustFileTimeToLocal(
+        INT64 utcFileTime) const noexcept;
+
+    /*
+    Adds biasMinutes to the specified fileTime value. Returns the adjusted
+    time. Adjustment is performed using saturation, i.e. returns 0 instead of a
+    negative value and returns MAXINT64 instead of overflowing.
+    */
+    static INT64 AdjustFileTime(
+        INT64 fileTime,
+        int biasMinutes) noexcept;
+
+private:
+
+    struct StackEntry
+    {
+        USHORT PropertyIndex;
+        USHORT PropertyEnd;
+        USHORT ArrayIndex;
+        USHORT ArrayCount;
+        bool IsStruct;
+        bool IsArray;
+    };
+
+    // One step of a decode plan, compiled from one EVENT_PROPERTY_INFO.
+    // Plan steps have the same indexes as the TRACE_EVENT_INFO properties.
+    struct PlanOp
+    {
+        UCHAR Shape;         // PlanShape: scalar, struct, array, array of struct.
+        UCHAR Size;          // PlanSize: how to find the size of a value.
+        UCHAR CbElement;     // Size of a fixed-size element, or 0.
+        UCHAR Flags;         // PlanFlags.
+        USHORT CookedInType;
+        USHORT Count;        // Fixed array count, or index of the count property.
+        USHORT Length;       // Fixed length, or index of the length property.
+        USHORT StructBegin;  // Index of first struct member.
+        USHORT StructEnd;    // Index after last struct member.
+        USHORT CbStruct;     // Struct or struct array: fixed size of one struct, or PlanNone.
+        USHORT Offset;       // Fixed offset within the property's group, or PlanNone.
+        USHORT NameBucket;   // Top-level only: first property in name hash bucket, or PlanNone.
+        USHORT NameNext;     // Top-level only: next property in name hash bucket, or PlanNone.
+    };
+
+    static USHORT const PlanNone = 0xffff;
+
+    // One recorded item: the enumerator state after a MoveNext.
+    struct TapeItem
+    {
+        BYTE const* pbDataNext;
+        BYTE const* pbCooked;
+        unsigned EndIndex;   // ArrayBegin/StructBegin: index of the matching end, or NoTapeIndex.
+        StackEntry StackTop;
+        USHORT cbCooked;
+        USHORT cbRaw;
+        USHORT CookedInType;
+        USHORT cbElement;
+        USHORT StackSize;    // m_stack.size().
+        UCHAR State;         // EtwEnumeratorState.
+        UCHAR SubState;      // SubState.
+    };
 
-    bool StartArray() noexcept;
+    static unsigned const NoTapeIndex = ~0u;
+
+    // While a Write method is formatting JSON items, output is sent to the
+    // sink whenever it reaches this many code units.
+    static unsigned const FlushThreshold = 8192;
+
+    enum SubState : UCHAR;
+    enum PlanShape : UCHAR;
+    enum PlanSize : UCHAR;
+    enum PlanFlags : UCHAR;
+    enum ValueType : UCHAR;
+    enum Categories : UCHAR;
+    class ParsedPrintf;
+    class FormatContext;
+    friend class EtwCompiledPrefix; // Uses FormatContext to compile the prefix.
+
+private:
+
+    bool StartEventImpl(
+        _In_ EVENT_RECORD const* pEventRecord,
+        _In_ TRACE_EVENT_INFO const* pTraceEventInfo,
+        _In_opt_ PlanOp const* pPlan) noexcept;
+
+    void ResetImpl() noexcept;
+
+    // Appends the current state to m_tape (called by MoveNext).
+    void RecordTapeItem() noexcept;
+
+    // Records the rest of the event, then returns to the current item.
+    void FinishTape() noexcept;
+
+    // Loads the enumerator state from m_tape[tapeIndex]. Moving into a struct
+    // is only supported from its StructBegin item. Returns true if the
+    // recorded state is an item (i.e. MoveNext would have returned true).
+    bool TapeMoveTo(
+        unsigned tapeIndex) noexcept;
+
+    bool NextProperty() noexcept;
+
+    bool NextPropertyFromTei() noexcept;
+
+    bool NextPropertyFromPlan() noexcept;
+
+    void StartStruct() noexcept;
+
+    bool StartArrayFromTei() noexcept;
+
+    bool StartArrayFromPlan(
+        PlanOp const& op) noexcept;
 
     bool StartValue() noexcept;
 
+    bool StartValueFromTei() noexcept;
+
+    bool StartValueFromPlan(
+        PlanOp const& op) noexcept;
+
     void StartValueSimple() noexcept;
 
     void StartValueCounted() noexcept;
@@ -1396,6 +2509,33 @@ private:
 
     UCHAR PointerSize() const noexcept;
 
+    // Returns false if the TRACE_EVENT_INFO cannot be compiled into a plan.
+    static bool CompilePlan(
+        _In_ TRACE_EVENT_INFO const* pTraceEventInfo,
+        EtwInternal::Buffer<PlanOp>& plan) noexcept;
+
+    // Sets Offset for properties [groupBegin, groupEnd) of a compiled plan.
+    static USHORT PlanStructSize(
+        EtwInternal::Buffer<PlanOp>& plan,
+        unsigned structIndex,
+        unsigned depth) noexcept;
+
+    static void PlanGroupOffsets(
+        EtwInternal::Buffer<PlanOp>& plan,
+        unsigned groupBegin,
+        unsigned groupEnd) noexcept;
+
+    // Hash used for the plan's top-level name index.
+    static unsigned PlanNameHash(
+        _In_z_ EtwPCWSTR szName) noexcept;
+
+    // Uses pPrefix if not null, otherwise uses szPrefixFormat.
+    bool FormatCurrentEventImpl(
+        _In_opt_z_ EtwPCWSTR szPrefixFormat,
+        _In_opt_ EtwCompiledPrefix const* pPrefix,
+        EtwJsonSuffixFlags jsonSuffixFlags,
+        _Out_ EtwStringViewZ* pString) noexcept;
+
     bool
     StringViewResult(
         EtwInternal::Buffer<EtwWCHAR>& output,
@@ -1406,9 +2546,151 @@ private:
         EtwInternal::Buffer<EtwWCHAR>& output,
         _Out_ EtwStringViewZ* pString) noexcept;
 
+    // Encodes output as UTF-8 in m_utf8Buffer.
+    bool
+    StringViewResult(
+        EtwInternal::Buffer<EtwWCHAR> const& output,
+        _Out_ EtwStringViewUtf8* pString) noexcept;
+
+    // Encodes output as UTF-8 in m_utf8Buffer.
+    bool
+    StringViewResult(
+        EtwInternal::Buffer<EtwWCHAR> const& output,
+        _Out_ EtwStringViewUtf8Z* pString) noexcept;
+
+    // Nul-terminates a UTF-8 output buffer.
+    bool
+    StringViewResult(
+        EtwInternal::Buffer<char>& output,
+        _Out_ EtwStringViewUtf8Z* pString) noexcept;
+
+    // Sends pch[0..cch) to sink.Write.
+    bool
+    SinkResult(
+        EtwOutputSink& sink,
+        _In_reads_(cch) EtwWCHAR const* pch,
+        unsigned cch) noexcept;
+
+    // Encodes pch[0..cch) as UTF-8 and sends it to the sink.
+    bool
+    SinkResultUtf8(
+        EtwOutputSink& sink,
+        _In_reads_(cch) EtwWCHAR const* pch,
+        unsigned cch) noexcept;
+
+    // Sends pb[0..cb) to sink.Write.
+    bool
+    SinkResultBytes(
+        EtwOutputSink& sink,
+        _In_reads_bytes_(cb) void const* pb,
+        unsigned cb) noexcept;
+
+    // Called at the start of a Write method. Sets m_pFlushSink (nullptr if
+    // the method does not send items in segments) and m_flushUtf8, and
+    // clears m_sinkWritten.
+    void
+    BeginSinkResult(
+        _In_opt_ EtwOutputSink* pFlushSink,
+        bool flushUtf8) noexcept;
+
+    // Called at the end of a Write method. Clears m_pFlushSink. If ok is
+    // false and part of the result was sent, calls sink.Abort(). Returns ok.
+    bool
+    EndSinkResult(
+        EtwOutputSink& sink,
+        bool ok) noexcept;
+
+    // Called by the JSON walkers after each complete item. If m_pFlushSink
+    // is set and output has at least FlushThreshold units, sends output to
+    // m_pFlushSink and clears it.
+    bool
+    FlushOutput(
+        EtwInternal::Buffer<EtwWCHAR>& output) noexcept;
+
+    bool
+    FlushOutput(
+        EtwInternal::Buffer<char>& output) noexcept;
+
+    // Finds or adds the batch table for the current event's schema.
+    bool FindColumnTable(
+        EtwColumnBatch& batch,
+        _Out_ unsigned* pTableIndex) noexcept;
+
+    // Adds the columns of properties propertyBegin..propertyEnd of the current
+    // schema to a new table, recursing into structs.
+    bool AddPropertyColumns(
+        EtwColumnBatch& batch,
+        unsigned firstColumn,
+        unsigned firstProperty,
+        EtwInternal::Buffer<EtwWCHAR>& prefix,
+        unsigned propertyBegin,
+        unsigned propertyEnd,
+        bool inList,
+        unsigned depth,
+        unsigned firstStruct,
+        unsigned parentStruct,
+        _Inout_ unsigned* pDroppedColumnCount) noexcept;
+
+    // Adds a row for the current event. State must be BeforeFirstItem.
+    // Returns true if a row was added. Sets m_lastError to the event's result.
+    bool AddCurrentEventToColumns(
+        EtwColumnBatch& batch,
+        unsigned tableIndex) noexcept;
+
     bool CurrentPropertyLength(
         _Out_ USHORT* pLength) const noexcept;
 
+    // Finds or adds the projection schema for the current event's schema.
+    bool FindProjectionSchema(
+        EtwFieldProjection& projection,
+        _Out_ unsigned* pSchemaIndex) noexcept;
+
+    // Resolves the projection's paths against the current event's schema.
+    bool AddProjectionSchema(
+        EtwFieldProjection& projection,
+        EtwInternal::SchemaCache::Key const& key,
+        _Out_ unsigned* pSchemaIndex) noexcept;
+
+    // Finds or adds the filter schema for the current event's schema.
+    bool FindFilterSchema(
+        EtwEventFilter& filter,
+        _Out_ unsigned* pSchemaIndex) noexcept;
+
+    // Resolves the filter's payload names against the current event's schema.
+    bool AddFilterSchema(
+        EtwEventFilter& filter,
+        EtwInternal::SchemaCache::Key const& key,
+        _Out_ unsigned* pSchemaIndex) noexcept;
+
+    // Moves forward at the current level to the property with the specified
+    // index, or to the end of the level. Returns false at end of event.
+    bool SkipToProperty(
+        USHORT propertyIndex,
+        _In_opt_ USHORT const* pFixedOffsets,
+        unsigned stackSize) noexcept;
+
+    // Moves to an element of the current array of fixed-size items.
+    template<class Visitor>
+    bool VisitValue(
+        Visitor& visitor,
+        _In_z_ EtwPCWSTR szName) noexcept;
+
+    template<class Visitor>
+    bool VisitSimpleArray(
+        Visitor& visitor,
+        _In_z_ EtwPCWSTR szName) noexcept;
+
+    template<class T>
+    EtwArraySpan<T> CurrentArraySpan() const noexcept;
+
+    USHORT CurrentFixedStructSize() const noexcept;
+
+    bool SkipFixedStructs(
+        unsigned structCount) noexcept;
+
+    void MoveToSimpleArrayElement(
+        USHORT arrayIndex) noexcept;
+
     _Ret_opt_z_ EtwPCWSTR EventName() const noexcept;
 
     _Ret_opt_z_ EtwPCWSTR EventAttributes() const noexcept;
@@ -1466,15 +2748,68 @@ private:
         EtwInternal::Buffer<EtwWCHAR>& scratchBuffer,
         EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
 
-    bool AddCurrentItemAsJsonAndMoveNext(
+    bool AddCurrentEventAsJson(
+        EtwFieldProjection& projection,
         EtwInternal::Buffer<EtwWCHAR>& output,
         EtwInternal::Buffer<EtwWCHAR>& scratchBuffer,
-        EtwJsonItemFlags jsonItemFlags) noexcept;
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
+
+    bool AddCurrentMetaAsJson(
+        EtwInternal::Buffer<EtwWCHAR>& output,
+        EtwInternal::Buffer<EtwWCHAR>& scratchBuffer,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
+
+    bool AddCurrentDynamicMetaAsJsonArray(
+        EtwInternal::Buffer<EtwWCHAR>& output,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
+
+    bool AddCurrentSchemaAsJson(
+        EtwInternal::Buffer<EtwWCHAR>& output,
+        EtwInternal::Buffer<EtwWCHAR>& scratchBuffer,
+        unsigned schemaId,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
+
+    bool AddCurrentEventValuesAsJsonArray(
+        EtwInternal::Buffer<EtwWCHAR>& output,
+        EtwInternal::Buffer<EtwWCHAR>& scratchBuffer) noexcept;
+
+    bool AddCurrentItemAsJsonAndMoveNext(
+        EtwInternal::Buffer<EtwWCHAR>& output,
+        EtwInternal::Buffer<EtwWCHAR>& scratchBuffer,
+        EtwJsonItemFlags jsonItemFlags) noexcept;
 
     bool AddCurrentValueAsJson(
         EtwInternal::Buffer<EtwWCHAR>& output,
         EtwInternal::Buffer<EtwWCHAR>& scratchBuffer) noexcept;
 
+    LSTATUS AppendCurrentNameAsJsonUtf8(
+        EtwInternal::Buffer<char>& output,
+        bool wantSpace) noexcept;
+
+    // Uses m_stringBuffer and m_stringBuffer2 for the prefix and suffix.
+    bool AddCurrentEventAsJsonUtf8(
+        EtwInternal::Buffer<char>& output,
+        _In_opt_z_ EtwPCWSTR szPrefixFormat,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
+
+    bool AddCurrentItemAsJsonAndMoveNextUtf8(
+        EtwInternal::Buffer<char>& output,
+        EtwInternal::Buffer<EtwWCHAR>& scratchBuffer,
+        EtwJsonItemFlags jsonItemFlags) noexcept;
+
+    bool AddCurrentValueAsJsonUtf8(
+        EtwInternal::Buffer<char>& output,
+        EtwInternal::Buffer<EtwWCHAR>& scratchBuffer) noexcept;
+
+    bool AddCurrentEventAsCbor(
+        EtwInternal::Buffer<char>& output,
+        EtwInternal::Buffer<EtwWCHAR>& scratchBuffer,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
+
+    bool AddCurrentValueAsCbor(
+        EtwInternal::Buffer<char>& output,
+        EtwInternal::Buffer<EtwWCHAR>& scratchBuffer) noexcept;
+
     ValueType AddCurrentValue(
         EtwInternal::Buffer<EtwWCHAR>& output) noexcept;
 
@@ -1493,7 +2828,8 @@ private:
         unsigned cbData,
         _TDH_IN_TYPE inType,
         _TDH_OUT_TYPE outType,
-        _In_opt_ EVENT_MAP_INFO const* pMapInfo) noexcept;
+        _In_opt_ EVENT_MAP_INFO const* pMapInfo,
+        _In_opt_ EtwInternal::MapIndex const* pMapIndex) noexcept;
 
     ValueType AddValue(
         EtwInternal::Buffer<EtwWCHAR>& output,
@@ -1505,6 +2841,7 @@ private:
 private:
 
     TRACE_EVENT_INFO const* m_pTraceEventInfo;
+    PlanOp const* m_pPlan; // Null if using the reference decoder.
     EVENT_RECORD const* m_pEventRecord;
     BYTE const* m_pbDataEnd;
 
@@ -1519,13 +2856,26 @@ private:
     EtwEnumeratorState m_state;
     SubState m_subState;
     UCHAR m_cbPointerFallback; // Pointer size to use if event doesn't specify a size.
+    bool m_decodePlansEnabled;
+    bool m_itemTapeEnabled;
+    bool m_tapeRecording; // True if MoveNext appends to m_tape.
+    bool m_tapeActive;    // True if MoveNext replays m_tape.
 
     LSTATUS m_lastError;
+    LSTATUS m_tapeError;  // LastError at the end of the tape.
+    unsigned m_tapeIndex; // Current tape item, or NoTapeIndex if BeforeFirstItem.
     EtwTimestampFormat m_timestampFormat;
+    EtwFloatFormat m_floatFormat;
     int m_timeZoneBiasMinutes;
     unsigned m_ticksToMilliseconds; // Number of milliseconds per tick.
     EtwEnumeratorCallbacks& m_enumeratorCallbacks;
 
+    // Set only while a Write method is formatting JSON items. See FlushOutput.
+    EtwOutputSink* m_pFlushSink;
+    unsigned m_cchFlushed; // Units sent by FlushOutput. Wraps.
+    bool m_flushUtf8;      // FlushOutput encodes UTF-16 output as UTF-8.
+    bool m_sinkWritten;    // The current Write method has called the sink.
+
     // Assume most events have fewer than 32 properties.
     EtwInternal::Buffer<USHORT, 32> m_integerValues;
 
@@ -1540,9 +2890,29 @@ private:
     // invalid parameter errors from _vsnwprintf by inlining a tiny buffer.
     EtwInternal::Buffer<EtwWCHAR, sizeof(void*)/sizeof(EtwWCHAR)> m_stringBuffer2;
 
+    // Results of the Format*Utf8 methods. Always heap-allocate.
+    EtwInternal::Buffer<char> m_utf8Buffer;
+
     // TDH buffers are too large to allocate inline. Always heap-allocate.
     EtwInternal::Buffer<BYTE> m_teiBuffer;
     EtwInternal::Buffer<BYTE> m_mapBuffer;
+
+    // Used when compiling a decode plan for the schema cache.
+    EtwInternal::Buffer<PlanOp> m_planBuffer;
+
+    // Items of the current event, if the item tape is enabled.
+    EtwInternal::Buffer<TapeItem> m_tape;
+    EtwInternal::Buffer<unsigned, 8> m_tapeOpenItems; // Unmatched ArrayBegin/StructBegin.
+
+    // Used when compiling an event message for the message cache.
+    EtwInternal::Buffer<BYTE> m_messageBuffer;
+
+    // TRACE_EVENT_INFO blocks (and decode plans) from previous calls to
+    // StartEvent.
+    EtwInternal::SchemaCache m_schemaCache;
+    EtwInternal::MapCache m_mapCache;
+    EtwInternal::MessageCache m_messageCache;
+    EtwInternal::TimestampCache m_timestampCache;
 };
 
 /*
@@ -1713,6 +3083,97 @@ enum EtwTimestampFormat
     EtwTimestampFormat_TypeMask = 0x0ff,
 };
 
+/*
+Specifies FLOAT and DOUBLE formatting.
+*/
+enum EtwFloatFormat
+    : unsigned
+{
+    /*
+    No float format type has been set.
+    Invalid type - valid format types are greater than this value.
+    */
+    EtwFloatFormat_None = 0,
+
+    /*
+    Uses printf "%g" format, i.e. 6 significant digits, "3.14159".
+    Values with more precision do not round-trip.
+    */
+    EtwFloatFormat_Printf,
+
+    /*
+    Uses the shortest string that parses back to exactly the same value,
+    "3.141592653589793" for a DOUBLE or "3.1415927" for a FLOAT. Uses plain
+    notation when 1e-7 < |value| < 1e21 and "1.5e+21" notation otherwise.
+    Infinity and NaN are formatted the same as EtwFloatFormat_Printf.
+    */
+    EtwFloatFormat_RoundTrip,
+
+    /*
+    Invalid type - valid float format types are less than this value.
+    */
+    EtwFloatFormat_Max,
+
+    /*
+    Default: printf "%g" format.
+    */
+    EtwFloatFormat_Default = EtwFloatFormat_Printf,
+};
+
+/*
+Type of a column in an EtwColumnBatch. Determines the layout of the
+column's Values (and Offsets) as returned by EtwColumnBatch::GetColumnInfo.
+*/
+enum EtwColumnType
+    : UCHAR
+{
+    /*
+    NULL property, or an array that is nested in an array of structs (which
+    is not decoded). Every row is null. Values is null.
+    */
+    EtwColumnType_None,
+
+    /*
+    INT8, INT16, INT32, INT64. Values is INT64[ValueCount].
+    */
+    EtwColumnType_Int64,
+
+    /*
+    UINT8, UINT16, UINT32, UINT64, HEXINT32, HEXINT64, BOOLEAN, POINTER,
+    SIZET, FILETIME. Values is UINT64[ValueCount].
+    */
+    EtwColumnType_UInt64,
+
+    /*
+    FLOAT, DOUBLE. Values is double[ValueCount].
+    */
+    EtwColumnType_Double,
+
+    /*
+    GUID. Values is GUID[ValueCount].
+    */
+    EtwColumnType_Guid,
+
+    /*
+    UNICODESTRING (all variations), UNICODECHAR, and any property with a
+    value map (see EtwColumnInfo::MapName). Values is a heap of UTF-16 code
+    units. Value i is at byte offsets Offsets[i] to Offsets[i + 1].
+    */
+    EtwColumnType_String,
+
+    /*
+    ANSISTRING (all variations), ANSICHAR. Values is a heap of bytes as
+    encoded in the event. Value i is at Offsets[i] to Offsets[i + 1].
+    */
+    EtwColumnType_AnsiString,
+
+    /*
+    BINARY (all variations), SID, SYSTEMTIME, and any other intype. Values
+    is a heap of bytes. Value i is at Offsets[i] to Offsets[i + 1].
+    */
+    EtwColumnType_Binary,
+};
+
 /*
 Receives information about the event currently being processed.
 Note that all of the string fields may be null if the event does not have an
@@ -1781,6 +3242,17 @@ struct EtwRawDataPosition
     _Field_size_bytes_(DataSize) void const* Data;
 };
 
+/*
+Receives statistics about the schema cache used by EtwEnumerator::StartEvent.
+*/
+struct EtwSchemaCacheInfo
+{
+    unsigned Capacity; // Maximum number of cached schemas.
+    unsigned Count;    // Number of schemas currently cached.
+    UINT64 Hits;       // Number of StartEvent calls that used a cached schema.
+    UINT64 Misses;     // Number of StartEvent calls that needed a lookup.
+};
+
 /*
 Receives information about the item on which the enumerator is currently
 positioned. The meaning of some fields in EtwItemInfo depends on the type of
@@ -1909,127 +3381,1646 @@ struct EtwItemInfo
     USHORT DataSize;
     _Field_size_bytes_(DataSize) void const* Data;
 
-    /*
-    If the value is an enumeration or bitfield with a map, MapName contains
-    the name of the map for use with TdhGetEventMapInformation(). Otherwise,
-    MapName is null.
-    */
-    EtwPCWSTR MapName;
+    /*
+    If the value is an enumeration or bitfield with a map, MapName contains
+    the name of the map for use with TdhGetEventMapInformation(). Otherwise,
+    MapName is null.
+    */
+    EtwPCWSTR MapName;
+};
+
+/*
+Receives technical details about the item on which the enumerator is currently
+positioned. The meaning of some fields in EtwRawItemInfo depends on the type
+of the current item (i.e. the current State() of the enumerator).
+*/
+struct EtwRawItemInfo
+{
+    union {
+        struct {
+            /*
+            EtwItemInfo::InType returns a canonical intype value, i.e. several
+            different variations of utf-16le strings are reduced to the single
+            type TDH_INTYPE_UNICODESTRING. EtwRawItemInfo::RawInType returns
+            the original (raw) intype of the event.
+            */
+            _TDH_IN_TYPE RawInType : 16;
+
+            /*
+            The property flags set for the current item.
+            */
+            PROPERTY_FLAGS Flags  : 16;
+        };
+        UINT32 Reserved_RawInType;
+    };
+
+    /*
+    EtwItemInfo::Data sometimes skips certain parts of the raw event data such
+    as the raw size prefix or the string's nul termination.
+    EtwRawItemInfo::RawData presents the full binary field value, including
+    size prefix and nul termination.
+    */
+    UINT32 RawDataSize;
+    _Field_size_bytes_(RawDataSize) void const* RawData;
+
+    /*
+    Pointer to the field's custom schema information, or null if the field
+    does not have custom schema information. Custom schema information is
+    rarely used, so this will almost always be null.
+
+    Custom schema information is decoding information for use by another tool.
+    Some fields contain encoded data that can be processed by another tool,
+    e.g. binary data packed using a serialization system such as Protocol
+    Buffers or Bond. These fields will be encoded using a normal ETW intype
+    (e.g. BINARY), but can contain schema information to be passed to the
+    deserialization tool. If such as system is in use, the CustomSchema
+    pointer will point at the schema data. The schema data is a structure
+    laid out as follows:
+
+    UINT16 Protocol; // User-defined protocol identifier 5..31
+    UINT16 Length;
+    BYTE SchemaData[Length]; // Decoding information for the decoding tool.
+    */
+    void const* CustomSchema;
+};
+
+/*
+Receives a pointer to a counted string and a length.
+Note that ETW supports strings with embedded nul characters. The string
+referenced by this structure will not be nul-terminated and may contain
+embedded nul characters. Use DataLength instead of assuming the string is
+nul-terminated.
+*/
+struct EtwStringView
+{
+    _Field_size_(DataLength) EtwWCHAR const* Data;
+    UINT32 DataLength;
+};
+
+/*
+Receives a pointer to a nul-terminated string and a length. The nul
+termination character is not included in the length, i.e. the nul termination
+will always be at position Data[DataLength].
+*/
+struct EtwStringViewZ
+{
+    _Field_size_(DataLength + 1) EtwPCWSTR Data;
+    UINT32 DataLength;
+};
+
+/*
+Receives a pointer to a counted UTF-8 string and a length in bytes.
+As with EtwStringView, the string will not be nul-terminated and may contain
+embedded nul characters.
+*/
+struct EtwStringViewUtf8
+{
+    _Field_size_(DataLength) char const* Data;
+    UINT32 DataLength;
+};
+
+/*
+Receives a pointer to a nul-terminated UTF-8 string and a length in bytes.
+The nul termination character is not included in the length.
+*/
+struct EtwStringViewUtf8Z
+{
+    _Field_size_(DataLength + 1) _Null_terminated_ char const* Data;
+    UINT32 DataLength;
+};
+
+namespace EtwInternal
+{
+    /*
+    Bulk kernels used by EtwArraySpan. The templates are simple loops that
+    the compiler can vectorize. The overloads for 32-bit and 64-bit integers
+    are implemented in EtwArraySpan.cpp using SSE2 on x86 and x64.
+    */
+
+    void ArraySpanCopy(
+        _Out_writes_bytes_(cb) void* pDest,
+        _In_reads_bytes_(cb) void const UNALIGNED* pData,
+        UINT32 cb) noexcept;
+
+    template<class T>
+    void ArraySpanWiden(
+        _Out_writes_(count) INT64* pDest,
+        _In_reads_(count) T const UNALIGNED* pData,
+        UINT32 count) noexcept
+    {
+        for (UINT32 i = 0; i != count; i += 1)
+        {
+            pDest[i] = static_cast<INT64>(pData[i]);
+        }
+    }
+
+    void ArraySpanWiden(
+        _Out_writes_(count) INT64* pDest,
+        _In_reads_(count) INT32 const UNALIGNED* pData,
+        UINT32 count) noexcept;
+
+    void ArraySpanWiden(
+        _Out_writes_(count) INT64* pDest,
+        _In_reads_(count) UINT32 const UNALIGNED* pData,
+        UINT32 count) noexcept;
+
+    template<class T>
+    UINT64 ArraySpanSum(
+        _In_reads_(count) T const UNALIGNED* pData,
+        UINT32 count) noexcept
+    {
+        UINT64 sum = 0; // Unsigned so that wrapping is well-defined.
+        for (UINT32 i = 0; i != count; i += 1)
+        {
+            sum += static_cast<UINT64>(static_cast<INT64>(pData[i]));
+        }
+        return sum;
+    }
+
+    UINT64 ArraySpanSum(
+        _In_reads_(count) INT32 const UNALIGNED* pData,
+        UINT32 count) noexcept;
+
+    UINT64 ArraySpanSum(
+        _In_reads_(count) UINT32 const UNALIGNED* pData,
+        UINT32 count) noexcept;
+
+    UINT64 ArraySpanSum(
+        _In_reads_(count) INT64 const UNALIGNED* pData,
+        UINT32 count) noexcept;
+
+    UINT64 ArraySpanSum(
+        _In_reads_(count) UINT64 const UNALIGNED* pData,
+        UINT32 count) noexcept;
+
+    // PRECONDITION: count != 0.
+    template<class T>
+    void ArraySpanMinMax(
+        _In_reads_(count) T const UNALIGNED* pData,
+        UINT32 count,
+        _Out_ T* pMin,
+        _Out_ T* pMax) noexcept
+    {
+        T lo = pData[0];
+        T hi = lo;
+        for (UINT32 i = 1; i != count; i += 1)
+        {
+            T const value = pData[i];
+            if (value < lo)
+            {
+                lo = value;
+            }
+
+            if (hi < value)
+            {
+                hi = value;
+            }
+        }
+
+        *pMin = lo;
+        *pMax = hi;
+    }
+
+    void ArraySpanMinMax(
+        _In_reads_(count) INT32 const UNALIGNED* pData,
+        UINT32 count,
+        _Out_ INT32* pMin,
+        _Out_ INT32* pMax) noexcept;
+
+    void ArraySpanMinMax(
+        _In_reads_(count) UINT32 const UNALIGNED* pData,
+        UINT32 count,
+        _Out_ UINT32* pMin,
+        _Out_ UINT32* pMax) noexcept;
+}
+// namespace EtwInternal
+
+/*
+Receives a pointer to an array of fixed-size values and an element count.
+Data points into the event data, so it may be unaligned and will become
+invalid when the event's buffer becomes invalid. Read elements with
+operator[] or through the UNALIGNED Data pointer, or convert them in bulk
+with the helpers below. For 32-bit and 64-bit integer elements, the helpers
+use SSE2 on x86 and x64. Otherwise they are simple loops over the whole
+array that the compiler can vectorize.
+*/
+template<class T>
+struct EtwArraySpan
+{
+    _Field_size_(Count) T const UNALIGNED* Data;
+    UINT32 Count;
+
+    T operator[](UINT32 index) const noexcept
+    {
+        return Data[index];
+    }
+
+    /*
+    Copies the elements to pDest[0..Count), e.g. to aligned column storage.
+    */
+    void CopyTo(
+        _Out_writes_(Count) T* pDest) const noexcept
+    {
+        EtwInternal::ArraySpanCopy(pDest, Data, Count * static_cast<UINT32>(sizeof(T)));
+    }
+
+    /*
+    Converts the elements to INT64 and stores them in pDest[0..Count).
+    T must be an integer type. UINT64 values above INT64 max wrap.
+    */
+    void WidenTo(
+        _Out_writes_(Count) INT64* pDest) const noexcept
+    {
+        EtwInternal::ArraySpanWiden(pDest, Data, Count);
+    }
+
+    /*
+    Returns the sum of the elements, wrapping modulo 2^64. T must be an
+    integer type. For UINT64 elements, cast the result to UINT64.
+    */
+    INT64 SumAsInt64() const noexcept
+    {
+        return static_cast<INT64>(EtwInternal::ArraySpanSum(Data, Count));
+    }
+
+    /*
+    Returns the sum of the elements as double. Element i is added to partial
+    sum i % 4 so that the additions can be done in parallel, so the result
+    may differ in the last bits from a sequential sum.
+    */
+    double SumAsDouble() const noexcept
+    {
+        double sums[4] = {};
+        UINT32 i = 0;
+        for (; Count - i >= 4; i += 4)
+        {
+            sums[0] += static_cast<double>(Data[i + 0]);
+            sums[1] += static_cast<double>(Data[i + 1]);
+            sums[2] += static_cast<double>(Data[i + 2]);
+            sums[3] += static_cast<double>(Data[i + 3]);
+        }
+        for (; i != Count; i += 1)
+        {
+            sums[i % 4] += static_cast<double>(Data[i]);
+        }
+        return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+    }
+
+    /*
+    If Count != 0, sets *pMin and *pMax to the smallest and largest elements
+    (as ordered by operator<) and returns true. Otherwise, sets *pMin and
+    *pMax to T() and returns false. T must be an arithmetic type.
+    */
+    bool MinMax(
+        _Out_ T* pMin,
+        _Out_ T* pMax) const noexcept
+    {
+        if (Count == 0)
+        {
+            *pMin = *pMax = T();
+            return false;
+        }
+
+        EtwInternal::ArraySpanMinMax(Data, Count, pMin, pMax);
+        return true;
+    }
+};
+
+/*
+Receives information about a table in an EtwColumnBatch.
+*/
+struct EtwColumnTableInfo
+{
+    EtwPCWSTR ProviderName; // "" if the schema has no provider name.
+    EtwPCWSTR EventName;    // "" if the schema has no event name.
+    GUID ProviderId;
+    EVENT_DESCRIPTOR EventDescriptor;
+    UINT32 ColumnCount;     // EtwColumnBatch::HeaderColumnCount + flattened property count.
+    UINT32 RowCount;
+    UINT32 DroppedColumnCount; // None columns for arrays nested in arrays of structs.
+    UINT32 StructCount;     // Struct properties. See EtwColumnBatch::GetStructInfo.
+};
+
+/*
+Receives information about a column in an EtwColumnBatch. Refer to
+EtwColumnType for the layout of Values and Offsets.
+
+A list column (ListOffsets is not null) has a list of values in each row:
+the values of row i are ListOffsets[i] to ListOffsets[i + 1]. Other columns
+have one value per row, so value i is row i.
+*/
+struct EtwColumnInfo
+{
+    EtwPCWSTR Name;
+    EtwColumnType Type;
+    _TDH_IN_TYPE InType : 16;   // From the schema (raw intype). 0 for header columns.
+    _TDH_OUT_TYPE OutType : 16; // From the schema. 0 for header columns.
+    UINT32 RowCount;
+
+    /*
+    Bit (i % 8) of Validity[i / 8] is set if value i is not null. Values
+    that are null are 0 (fixed-size types) or an empty range (variable-size
+    types).
+    */
+    _Field_size_bytes_((ValueCount + 7) / 8) BYTE const* Validity;
+
+    void const* Values;
+
+    /*
+    For String, AnsiString, and Binary columns, ValueCount + 1 byte offsets
+    into Values. Otherwise null.
+    */
+    UINT32 const* Offsets;
+
+    /*
+    RowCount for a column with one value per row. For a list column, the
+    total number of list elements, i.e. ListOffsets[RowCount].
+    */
+    UINT32 ValueCount;
+
+    /*
+    For list columns, RowCount + 1 offsets into the values. Otherwise null.
+    */
+    UINT32 const* ListOffsets;
+
+    /*
+    For list columns, bit (i % 8) of ListValidity[i / 8] is set if the list
+    in row i is not null, i.e. if the array was decoded. Null lists are
+    empty. Otherwise null.
+    */
+    BYTE const* ListValidity;
+
+    /*
+    For a property with a value map, the map name from the schema. The
+    column's Type is String and its values are formatted as by
+    FormatCurrentValue, e.g. the name of the map entry. Otherwise null.
+    */
+    EtwPCWSTR MapName;
+
+    /*
+    The property's own name, i.e. Name without the "Struct." prefixes of
+    the structs that contain it. Same as Name for a column that is not in a
+    struct.
+    */
+    EtwPCWSTR MemberName;
+
+    /*
+    Index of the innermost struct that contains the property (see
+    EtwColumnBatch::GetStructInfo), or EtwColumnBatch::NoStruct.
+    */
+    UINT32 Struct;
+};
+
+/*
+Receives information about a struct property of a table in an
+EtwColumnBatch. The struct's members, including the members of nested
+structs, are the columns FirstColumn to FirstColumn + ColumnCount - 1.
+Structs are numbered in schema order, so a struct comes before the structs
+that it contains.
+*/
+struct EtwColumnStructInfo
+{
+    EtwPCWSTR Name;         // Without the "Struct." prefixes of containing structs.
+    UINT32 Parent;          // Index of the containing struct, or EtwColumnBatch::NoStruct.
+    UINT32 FirstColumn;
+    UINT32 ColumnCount;     // 0 for a struct with no members.
+
+    /*
+    True for an array of structs. Each member is then a list column (or a
+    None column), and all of the list columns have the same list lengths and
+    list validity.
+    */
+    bool IsArray;
+};
+
+/*
+EtwEnumerator passes an instance of EtwStringBuilder to the methods of
+EtwEnumeratorCallbacks.
+*/
+class EtwStringBuilder
+{
+    // EtwStringBuilder is constructed only by EtwEnumerator.
+    friend class EtwEnumerator;
+    explicit EtwStringBuilder(EtwInternal::Buffer<EtwWCHAR>& buffer) noexcept;
+
+public:
+
+    EtwStringBuilder(EtwStringBuilder const&) = delete;
+    EtwStringBuilder& operator=(EtwStringBuilder const&) = delete;
+
+    // Appends the specified character to the string builder.
+    LSTATUS __stdcall
+    AppendChar(
+        EtwWCHAR value) noexcept;
+
+    // Appends the specified nul-terminated string to the string builder.
+    LSTATUS __stdcall
+    AppendWide(
+        _In_z_ EtwPCWSTR szValue) noexcept;
+
+    // Appends the specified swprintf-formatted string to the string builder.
+    LSTATUS __stdcall
+    AppendPrintf(
+        _Printf_format_string_ EtwPCWSTR szFormat,
+        ...) noexcept;
+
+private:
+
+    EtwInternal::Buffer<EtwWCHAR>& m_buffer;
+};
+
+/*
+A prefix format string that has been parsed once, for use with the
+FormatCurrentEvent and FormatCurrentEventPrefix overloads that accept an
+EtwCompiledPrefix. Refer to FormatCurrentEventPrefix for the format syntax.
+
+Formatting with a compiled prefix produces the same result as formatting
+with the original string, but the string is not parsed for each event, and
+the %1..%9 values that the prefix does not use are not computed (e.g. the
+provider and event names are not looked up unless the prefix uses %1 or %2).
+
+A default-constructed EtwCompiledPrefix is empty (formats no prefix). An
+EtwCompiledPrefix may be used with any number of EtwEnumerator objects, but
+must not be modified while in use.
+*/
+class EtwCompiledPrefix
+{
+public:
+
+    EtwCompiledPrefix(EtwCompiledPrefix const&) = delete;
+    EtwCompiledPrefix& operator=(EtwCompiledPrefix const&) = delete;
+    EtwCompiledPrefix() noexcept;
+    ~EtwCompiledPrefix() noexcept;
+
+    /*
+    Parses szPrefixFormat and stores the result, replacing any previous
+    result. A null or empty szPrefixFormat results in an empty prefix.
+
+    Returns ERROR_SUCCESS or ERROR_OUTOFMEMORY. On failure, the prefix is
+    empty.
+    */
+    LSTATUS
+    Compile(
+        _In_opt_z_ EtwPCWSTR szPrefixFormat) noexcept;
+
+    // Returns true if the prefix is empty.
+    bool
+    Empty() const noexcept;
+
+private:
+
+    friend class EtwEnumerator;
+
+    EtwInternal::Buffer<EtwWCHAR> m_format;   // Nul-terminated copy of the prefix format.
+    EtwInternal::Buffer<BYTE> m_compiled;     // Empty if the prefix is empty.
+};
+
+/*
+EtwOutputSink is an abstract base class for a destination of formatted
+output, e.g. a file, a ring buffer, or a caller-owned arena. The Write
+methods of EtwEnumerator (e.g. WriteCurrentEvent) send their results to a
+sink instead of returning an EtwStringView.
+
+A sink receives bytes. The encoding of the bytes (UTF-16 or UTF-8) depends
+on the EtwEnumerator method that produced them. Each Write method sends one
+result, e.g. one event, so a sink that needs separators (e.g. newlines)
+between results should add them. A large result may arrive in several calls
+to Write (or Reserve and Commit), so add separators after the Write method
+returns rather than after each call. If a Write method fails after part of
+its result has been sent, it calls Abort, and the sink must discard the
+partial result.
+*/
+class DECLSPEC_NOVTABLE EtwOutputSink // abstract
+{
+protected:
+
+    // This class is abstract.
+    constexpr EtwOutputSink() noexcept = default;
+
+public:
+
+    // Copy construction is not allowed on the abstract base class.
+    EtwOutputSink(EtwOutputSink const&) = delete;
+
+    // Copy assignment is not allowed on the abstract base class.
+    EtwOutputSink& operator=(EtwOutputSink const&) = delete;
+
+    /*
+    Appends pb[0..cb) to the output. Return ERROR_SUCCESS on success. Any
+    other status will be returned to the caller of the EtwEnumerator method
+    via LastError().
+    */
+    virtual LSTATUS __stdcall Write(
+        _In_reads_bytes_(cb) void const* pb,
+        unsigned cb) noexcept = 0;
+
+    /*
+    Optional. Provides space for a contiguous write of up to *pcbAvailable
+    bytes, where *pcbAvailable >= cbMin. EtwEnumerator fills some or all of
+    the space and then calls Commit with the number of bytes used. Return
+    nullptr if the space is not available, in which case EtwEnumerator will
+    use Write instead.
+
+    EtwEnumerator uses this to encode UTF-8 directly into the sink. cbMin is
+    a worst-case size, so it may be considerably larger than the committed
+    size.
+
+    The default implementation returns nullptr.
+    */
+    virtual _Ret_maybenull_ void* __stdcall Reserve(
+        unsigned cbMin,
+        _Out_ unsigned* pcbAvailable) noexcept;
+
+    /*
+    Appends the first cb bytes of the space returned by the most recent call
+    to Reserve to the output. Called exactly once after each successful
+    Reserve. Return ERROR_SUCCESS on success. Any other status will be
+    returned to the caller of the EtwEnumerator method via LastError().
+
+    The default implementation fails with ERROR_INVALID_FUNCTION (it is not
+    called unless Reserve is overridden).
+    */
+    virtual LSTATUS __stdcall Commit(
+        unsigned cb) noexcept;
+
+    /*
+    Called when an EtwEnumerator Write method fails after it has called
+    Write or Commit for its result (including when that Write or Commit
+    failed), e.g. when a large event was sent in segments and a later item
+    could not be formatted. The bytes received since the Write method
+    started are an incomplete result. The sink must discard them, e.g. by
+    moving its write position back to where the result started. Not called
+    when a Write method succeeds or fails before sending anything.
+
+    The default implementation does nothing, which leaves the partial result
+    in the output. Override it for any sink that is used with events that
+    might be larger than a few kilobytes.
+    */
+    virtual void __stdcall Abort() noexcept;
+};
+
+/*
+Typed column buffers filled by EtwEnumerator::DecodeEventsToColumns.
+
+Events are grouped into tables by schema, using the same key as the schema
+cache (provider ID, EVENT_DESCRIPTOR, and TraceLogging metadata). A table
+has one row per event and the following columns:
+
+- Header columns 0..HeaderColumnCount-1: TimeStamp (Int64, the raw
+  EVENT_HEADER TimeStamp), ProcessId (UInt64), ThreadId (UInt64),
+  ProcessorIndex (UInt64), and ActivityId (Guid).
+- Columns for the properties of the schema, in schema order. Structs are
+  flattened: each member of struct "S" gets its own column named "S.Member"
+  (recursively). An array of simple values is a list column. An array of
+  structs "A" is flattened into a list column "A.Member" for each member,
+  all with the same list lengths.
+- An array that is nested in an array of structs is not decoded. It gets a
+  column of type None (every row is null), counted in the table's
+  DroppedColumnCount.
+
+GetStructInfo describes the struct properties, so that writers can turn
+the flattened columns back into nested fields.
+
+Property values are copied from the event payload as-is. Integers are
+widened to 64 bits and FLOAT is widened to double. A property's value is
+null if its size or canonical intype does not match the column type. The
+exception is a property with a value map, which gets a String column of
+formatted values (e.g. map entry names) so that writers can
+dictionary-encode it.
+
+Tables and rows accumulate across calls to DecodeEventsToColumns. After
+consuming the columns, use ClearRows to start the next batch while keeping
+the tables and their allocations, or Clear to remove everything.
+Pointers returned by GetTableInfo and GetColumnInfo become invalid when the
+batch is modified or destroyed.
+*/
+class EtwColumnBatch
+{
+public:
+
+    static unsigned const HeaderColumnCount = 5;
+    static unsigned const NoStruct = ~0u;
+
+    EtwColumnBatch(EtwColumnBatch const&) = delete;
+    EtwColumnBatch& operator=(EtwColumnBatch const&) = delete;
+    EtwColumnBatch() noexcept;
+    ~EtwColumnBatch() noexcept;
+
+    // Removes all tables and rows.
+    void
+    Clear() noexcept;
+
+    // Removes all rows. Tables and column allocations are kept.
+    void
+    ClearRows() noexcept;
+
+    // Returns the number of tables, i.e. the number of schemas seen.
+    unsigned
+    TableCount() const noexcept;
+
+    // PRECONDITION: tableIndex < TableCount().
+    EtwColumnTableInfo
+    GetTableInfo(
+        unsigned tableIndex) const noexcept;
+
+    // PRECONDITION: tableIndex < TableCount(), columnIndex < ColumnCount.
+    EtwColumnInfo
+    GetColumnInfo(
+        unsigned tableIndex,
+        unsigned columnIndex) const noexcept;
+
+    // PRECONDITION: tableIndex < TableCount(), structIndex < StructCount.
+    EtwColumnStructInfo
+    GetStructInfo(
+        unsigned tableIndex,
+        unsigned structIndex) const noexcept;
+
+private:
+
+    friend class EtwEnumerator;
+
+    // Growable byte array, freed by FreeColumns.
+    struct ColumnData
+    {
+        BYTE* pData;
+        UINT32 cbSize;
+        UINT32 cbCapacity;
+    };
+
+    struct Column
+    {
+        unsigned NameOffset;     // Offset into m_names.
+        unsigned MemberNameOffset; // Offset into m_names.
+        unsigned Struct;         // Index into the table's structs, or NoStruct.
+        EtwColumnType Type;
+        USHORT InType;
+        USHORT OutType;
+        bool IsList;
+        unsigned MapNameOffset;  // Offset into m_names, or NoMap.
+        UINT32 ValueCount;
+        ColumnData Values;
+        ColumnData Offsets;      // Variable-size types only.
+        ColumnData Validity;
+        ColumnData ListOffsets;  // List columns only.
+        ColumnData ListValidity; // List columns only.
+    };
+
+    // How DecodeEventsToColumns handles a property of a table's schema.
+    struct PropertyColumns
+    {
+        unsigned FirstColumn;    // Index into the table's columns.
+        unsigned ColumnCount;
+        UCHAR Kind;              // ColumnPropertyKind (implementation detail).
+    };
+
+    struct Struct
+    {
+        unsigned NameOffset;     // Offset into m_names.
+        unsigned Parent;         // Index into the table's structs, or NoStruct.
+        unsigned FirstColumn;    // Index into the table's columns.
+        unsigned ColumnCount;
+        bool IsArray;
+    };
+
+    struct Table
+    {
+        GUID ProviderId;
+        EVENT_DESCRIPTOR EventDescriptor;
+        USHORT Flags;
+        USHORT EventProperty;
+        unsigned Hash;
+        USHORT cbSchemaTl;
+        USHORT cbProvTraits;
+        unsigned HashNext;       // Next table in the same hash bucket.
+        unsigned FirstColumn;    // Index into m_columns.
+        unsigned ColumnCount;
+        unsigned FirstProperty;  // Index into m_properties.
+        unsigned PropertyCount;
+        unsigned FirstStruct;    // Index into m_structs.
+        unsigned StructCount;
+        unsigned DroppedColumnCount;
+        unsigned RowCount;
+        unsigned ProviderNameOffset; // Offset into m_names.
+        unsigned EventNameOffset;    // Offset into m_names.
+        BYTE* pKeyBlob;          // SchemaTl, ProvTraits. Null if both are empty.
+    };
+
+    static unsigned const NoTable = ~0u;
+    static unsigned const NoMap = ~0u;
+
+    // Grows data.pData to at least cbRequired bytes.
+    static bool ReserveData(
+        ColumnData& data,
+        UINT32 cbRequired) noexcept;
+
+    // Reserves room for one more value.
+    static bool ReserveValue(
+        Column& column) noexcept;
+
+    // Reserves room for row: a value, or for a list column, an empty list.
+    static bool ReserveRow(
+        Column& column,
+        unsigned row) noexcept;
+
+    // Appends a null value (to the last row's list, for a list column).
+    // Room must have been reserved.
+    static void AppendNullValue(
+        Column& column) noexcept;
+
+    // Appends row: a null value, or for a list column, a null (empty) list.
+    // Room must have been reserved.
+    static void AppendNullRow(
+        Column& column,
+        unsigned row) noexcept;
+
+    // Appends a column named prefix + szName to m_columns.
+    bool AddColumn(
+        _In_reads_(cchPrefix) EtwWCHAR const* pchPrefix,
+        unsigned cchPrefix,
+        _In_z_ EtwPCWSTR szName,
+        unsigned structIndex,
+        EtwColumnType type,
+        USHORT inType,
+        USHORT outType,
+        bool isList,
+        _In_opt_z_ EtwPCWSTR szMapName) noexcept;
+
+    void FreeColumns() noexcept;
+
+    EtwInternal::Buffer<Table> m_tables;
+    EtwInternal::Buffer<Column> m_columns; // Columns of all tables.
+    EtwInternal::Buffer<PropertyColumns> m_properties; // Schema properties of all tables.
+    EtwInternal::Buffer<Struct> m_structs; // Struct properties of all tables.
+    EtwInternal::Buffer<EtwWCHAR> m_names; // Nul-terminated column and table names.
+    EtwInternal::Buffer<unsigned> m_buckets; // Size is a power of 2.
+    unsigned m_lastTable; // Table of the most recent event, or NoTable.
+};
+
+/*
+Selects the Apache Arrow IPC format written by EtwArrowWriter.
+*/
+enum EtwArrowFormat
+    : UCHAR
+{
+    /*
+    IPC streaming format: a Schema message, then the DictionaryBatch and
+    RecordBatch messages, then the end-of-stream marker.
+    */
+    EtwArrowFormat_Stream,
+
+    /*
+    IPC file format (.arrow files): the "ARROW1" magic, the streaming
+    format, and a footer with the schema and the location of each batch.
+    */
+    EtwArrowFormat_File,
+};
+
+/*
+Writes the tables of an EtwColumnBatch as Apache Arrow IPC streams or files,
+one stream per table (i.e. per schema), one record batch per call to
+WriteRecordBatch.
+
+Column types map to Arrow types as follows:
+- TimeStamp and FILETIME: timestamp[ns, UTC]. Values outside the range of
+  timestamp[ns] (including FILETIME 0) are written as null.
+- ProcessId, ThreadId, ProcessorIndex: uint32.
+- ActivityId and Guid: fixed_size_binary(16).
+- Int64 and UInt64: int8..int64 or uint8..uint64 according to the
+  property's intype. BOOLEAN is bool.
+- Double: float (for FLOAT) or double.
+- String: utf8. A column with a value map (EtwColumnInfo::MapName) is
+  dictionary-encoded with int32 indexes.
+- AnsiString and Binary: binary.
+- None: null.
+- List columns: list of the above, with an "item" child field.
+- Struct properties (see EtwColumnBatch::GetStructInfo): struct, with a
+  child field for each member, named by EtwColumnInfo::MemberName. An array
+  of structs is a list of struct. Struct values are never null: a member
+  that was not decoded is null in the member's own field.
+The schema's custom metadata contains ProviderName and EventName.
+
+A dictionary is shared by all record batches of a stream. Each record batch
+is preceded by a DictionaryBatch for each dictionary-encoded column that
+has new values: the first one has the column's values so far, and the
+later ones are deltas.
+
+Usage: Begin(batch, tableIndex, format, sink), then after each batch of
+events call WriteRecordBatch(batch, tableIndex, sink) (then
+batch.ClearRows()), and finally End(sink). A writer can be reused for
+another stream after End.
+*/
+class EtwArrowWriter
+{
+public:
+
+    EtwArrowWriter(EtwArrowWriter const&) = delete;
+    EtwArrowWriter& operator=(EtwArrowWriter const&) = delete;
+    EtwArrowWriter() noexcept;
+    ~EtwArrowWriter() noexcept;
+
+    /*
+    Starts an Arrow stream or file for the specified table: records the
+    table's schema and writes the Schema message (preceded by the file
+    magic for EtwArrowFormat_File) to sink.
+    PRECONDITION: tableIndex < batch.TableCount().
+    */
+    LSTATUS
+    Begin(
+        EtwColumnBatch const& batch,
+        unsigned tableIndex,
+        EtwArrowFormat format,
+        EtwOutputSink& sink) noexcept;
+
+    /*
+    Writes the current rows of the specified table as a RecordBatch
+    message, preceded by any DictionaryBatch messages that it needs. The
+    table must be the one that was passed to Begin.
+    */
+    LSTATUS
+    WriteRecordBatch(
+        EtwColumnBatch const& batch,
+        unsigned tableIndex,
+        EtwOutputSink& sink) noexcept;
+
+    /*
+    Writes the end-of-stream marker (and for EtwArrowFormat_File, the file
+    footer) to sink, completing the stream.
+    */
+    LSTATUS
+    End(
+        EtwOutputSink& sink) noexcept;
+
+private:
+
+    struct Field
+    {
+        unsigned Column;         // Table column, or table struct for a struct field.
+        unsigned ChildCount;     // Struct fields: the children follow the field.
+        UCHAR TypeId;            // ArrowTypeId (implementation detail).
+        UCHAR ByteWidth;         // Int, FloatingPoint, FixedSizeBinary.
+        bool IsSigned;           // Int.
+        bool IsList;             // List of the type. False for members of an array of structs.
+        bool IsDictionary;
+        bool DictionaryWritten;  // A DictionaryBatch has been written.
+        unsigned DictionarySize; // Values in the dictionary.
+    };
+
+    // Body buffer of a RecordBatch.
+    struct BodyBuffer
+    {
+        BYTE const* pData;       // Null if the data is in m_scratch.
+        UINT32 ScratchOffset;    // Used if pData is null.
+        UINT32 cbData;
+    };
+
+    // Same layout as the Arrow FieldNode struct.
+    struct Node
+    {
+        UINT64 Length;
+        UINT64 NullCount;
+    };
+
+    // Same layout as the Arrow Block struct.
+    struct Block
+    {
+        INT64 Offset;
+        INT32 MetaDataLength;
+        INT32 Padding;
+        INT64 BodyLength;
+    };
+
+    struct DictionaryEntry
+    {
+        unsigned Field;          // Index of the dictionary's field.
+        unsigned Index;          // Index of the value in the column's dictionary.
+        unsigned Offset;         // Offset into m_dictionary (UTF-8).
+        unsigned Length;
+        unsigned Hash;
+        unsigned HashNext;
+    };
+
+    // Adds the fields for the members of parentStruct (NoStruct for the
+    // table), i.e. columns firstColumn..endColumn - 1, to m_fields.
+    // *pFieldCount receives the number of fields added at this level.
+    LSTATUS AddFields(
+        EtwColumnBatch const& batch,
+        unsigned tableIndex,
+        unsigned parentStruct,
+        bool inArray,
+        unsigned firstColumn,
+        unsigned endColumn,
+        _Out_ unsigned* pFieldCount) noexcept;
+
+    // Writes fieldCount sibling fields, starting at m_fields[fieldIndex], to
+    // the vector at vectorPos in m_schema. Returns the index after them.
+    unsigned WriteSchemaFields(
+        EtwColumnBatch const& batch,
+        unsigned tableIndex,
+        unsigned fieldIndex,
+        unsigned fieldCount,
+        unsigned vectorPos) noexcept;
+
+    // Adds the nodes and buffers of fieldCount sibling fields, starting at
+    // m_fields[fieldIndex], with length values each. *pFieldIndex receives
+    // the index after them.
+    LSTATUS AddFieldArrays(
+        EtwColumnBatch const& batch,
+        unsigned tableIndex,
+        unsigned fieldIndex,
+        unsigned fieldCount,
+        UINT32 length,
+        _Inout_ unsigned* pIndexesPos,
+        _Out_ unsigned* pFieldIndex) noexcept;
+
+    // Adds the node and buffers of a list array with rows lists. If
+    // pListOffsets is null, every list is null. *pValueCount receives the
+    // number of elements.
+    LSTATUS AddListArray(
+        _In_opt_ UINT32 const* pListOffsets,
+        _In_opt_ BYTE const* pListValidity,
+        UINT32 rows,
+        _Out_ UINT32* pValueCount) noexcept;
+
+    // Adds the dictionary indexes of the column's values to m_indexes.
+    LSTATUS AddDictionaryIndexes(
+        EtwColumnInfo const& columnInfo,
+        unsigned fieldIndex) noexcept;
+
+    // Adds the node and buffers of an array of count values to m_nodes and
+    // m_buffers. pIndexes is the dictionary indexes of a dictionary field
+    // (null if count is 0).
+    LSTATUS AddArray(
+        EtwColumnInfo const& columnInfo,
+        Field const& field,
+        UINT32 count,
+        _In_opt_ INT32 const* pIndexes) noexcept;
+
+    // Writes a DictionaryBatch with the field's new dictionary values.
+    LSTATUS WriteDictionaryBatch(
+        unsigned fieldIndex,
+        unsigned firstEntry,
+        EtwOutputSink& sink) noexcept;
+
+    // Writes a RecordBatch message (or if dictionaryId != NoDictionary, a
+    // DictionaryBatch message) from m_nodes and m_buffers, then its body.
+    LSTATUS WriteBatch(
+        UINT64 length,
+        unsigned dictionaryId,
+        bool isDelta,
+        EtwOutputSink& sink) noexcept;
+
+    // Writes to sink and advances m_filePos.
+    LSTATUS WriteToSink(
+        _In_reads_bytes_(cb) void const* pb,
+        unsigned cb,
+        EtwOutputSink& sink) noexcept;
+
+    bool AddDictionaryValue(
+        unsigned fieldIndex,
+        _In_reads_bytes_(cb) BYTE const* pb,
+        unsigned cb,
+        _Out_ unsigned* pIndex) noexcept;
+
+    static unsigned const NoDictionary = ~0u;
+
+    EtwInternal::Buffer<Field> m_fields;          // In schema order (depth first).
+    EtwInternal::Buffer<BYTE> m_metadata;         // Current message (prefix + flatbuffer), footer.
+    EtwInternal::Buffer<BYTE> m_schema;           // Schema message, for the file footer.
+    EtwInternal::Buffer<BYTE> m_scratch;          // Converted body buffers.
+    EtwInternal::Buffer<BodyBuffer> m_buffers;
+    EtwInternal::Buffer<Node> m_nodes;
+    EtwInternal::Buffer<INT32> m_indexes;         // Dictionary indexes of the current batch.
+    EtwInternal::Buffer<Block> m_dictionaryBlocks; // File format only.
+    EtwInternal::Buffer<Block> m_recordBatchBlocks; // File format only.
+    EtwInternal::Buffer<BYTE> m_dictionary;       // Dictionary values (UTF-8) of all columns.
+    EtwInternal::Buffer<DictionaryEntry> m_dictionaryEntries;
+    EtwInternal::Buffer<unsigned> m_dictionaryBuckets; // Size is a power of 2.
+    UINT64 m_filePos;
+    unsigned m_schemaBegin;                       // Start of the Schema table's vtable in m_schema.
+    unsigned m_schemaPos;                         // Position of the Schema table in m_schema.
+    unsigned m_columnCount;                       // Columns of the table.
+    unsigned m_topLevelFieldCount;
+    EtwArrowFormat m_format;
 };
 
 /*
-Receives technical details about the item on which the enumerator is currently
-positioned. The meaning of some fields in EtwRawItemInfo depends on the type
-of the current item (i.e. the current State() of the enumerator).
+Writes the tables of an EtwColumnBatch as Apache Parquet files, one file per
+table (i.e. per schema), one row group per call to WriteRowGroup.
+
+Columns are written as optional (nullable) columns with the same types as
+EtwArrowWriter, except that GUIDs are written as UUID in RFC 4122 byte
+order. Struct members are written as top-level columns named "Struct.Member".
+List columns, including the members of an array of structs, are written as
+3-level LIST groups (an optional group with the column's name, a repeated
+group named "list", and an optional leaf named "element"). Pages are
+compressed with Snappy. Timestamps use DELTA_BINARY_PACKED encoding. String and binary
+columns use dictionary encoding unless the dictionary would exceed 1 MB, in
+which case they use PLAIN encoding. The file's key-value metadata contains
+ProviderName and EventName.
+
+Usage: Begin(batch, tableIndex, sink), then after each batch of events call
+WriteRowGroup(batch, tableIndex, sink) (then batch.ClearRows()), and finally
+End(sink). A writer can be reused for another file after End.
 */
-struct EtwRawItemInfo
+class EtwParquetWriter
 {
-    union {
-        struct {
-            /*
-            EtwItemInfo::InType returns a canonical intype value, i.e. several
-            different variations of utf-16le strings are reduced to the single
-            type TDH_INTYPE_UNICODESTRING. EtwRawItemInfo::RawInType returns
-            the original (raw) intype of the event.
-            */
-            _TDH_IN_TYPE RawInType : 16;
+public:
 
-            /*
-            The property flags set for the current item.
-            */
-            PROPERTY_FLAGS Flags  : 16;
-        };
-        UINT32 Reserved_RawInType;
-    };
+    EtwParquetWriter(EtwParquetWriter const&) = delete;
+    EtwParquetWriter& operator=(EtwParquetWriter const&) = delete;
+    EtwParquetWriter() noexcept;
+    ~EtwParquetWriter() noexcept;
 
     /*
-    EtwItemInfo::Data sometimes skips certain parts of the raw event data such
-    as the raw size prefix or the string's nul termination.
-    EtwRawItemInfo::RawData presents the full binary field value, including
-    size prefix and nul termination.
+    Starts a Parquet file for the specified table: records the table's schema
+    and writes the file header to sink.
+    PRECONDITION: tableIndex < batch.TableCount().
     */
-    UINT32 RawDataSize;
-    _Field_size_bytes_(RawDataSize) void const* RawData;
+    LSTATUS
+    Begin(
+        EtwColumnBatch const& batch,
+        unsigned tableIndex,
+        EtwOutputSink& sink) noexcept;
 
     /*
-    Pointer to the field's custom schema information, or null if the field
-    does not have custom schema information. Custom schema information is
-    rarely used, so this will almost always be null.
-
-    Custom schema information is decoding information for use by another tool.
-    Some fields contain encoded data that can be processed by another tool,
-    e.g. binary data packed using a serialization system such as Protocol
-    Buffers or Bond. These fields will be encoded using a normal ETW intype
-    (e.g. BINARY), but can contain schema information to be passed to the
-    deserialization tool. If such as system is in use, the CustomSchema
-    pointer will point at the schema data. The schema data is a structure
-    laid out as follows:
+    Writes the current rows of the specified table as a row group. The table
+    must be the one that was passed to Begin. Does nothing if the table has
+    no rows.
+    */
+    LSTATUS
+    WriteRowGroup(
+        EtwColumnBatch const& batch,
+        unsigned tableIndex,
+        EtwOutputSink& sink) noexcept;
 
-    UINT16 Protocol; // User-defined protocol identifier 5..31
-    UINT16 Length;
-    BYTE SchemaData[Length]; // Decoding information for the decoding tool.
+    /*
+    Writes the file footer to sink, completing the file.
     */
-    void const* CustomSchema;
+    LSTATUS
+    End(
+        EtwOutputSink& sink) noexcept;
+
+private:
+
+    struct Column
+    {
+        unsigned NameOffset; // Offset into m_names (UTF-8).
+        unsigned NameLength;
+        UCHAR Kind;          // ParquetKind (implementation detail).
+        UCHAR BitWidth;      // Integer kinds.
+        bool IsSigned;       // Integer kinds.
+        bool IsList;         // Written as a LIST group.
+    };
+
+    struct Chunk
+    {
+        UINT64 DictionaryPageOffset; // 0 if no dictionary page.
+        UINT64 DataPageOffset;
+        UINT64 NumValues;            // Level count (for a list column, >= row count).
+        UINT64 UncompressedSize;
+        UINT64 CompressedSize;
+        UCHAR Encoding;              // Encoding of the data page values.
+    };
+
+    struct DictionaryEntry
+    {
+        unsigned Offset;     // Offset into m_dictionary (after the length).
+        unsigned Length;
+        unsigned Hash;
+        unsigned HashNext;
+    };
+
+    LSTATUS WriteColumnChunk(
+        EtwColumnInfo const& columnInfo,
+        Column const& column,
+        EtwOutputSink& sink) noexcept;
+
+    LSTATUS WritePage(
+        _In_reads_bytes_(cbPage) BYTE const* pbPage,
+        unsigned cbPage,
+        bool isDictionaryPage,
+        unsigned valueCount,
+        UCHAR encoding,
+        EtwOutputSink& sink,
+        Chunk& chunk) noexcept;
+
+    bool AddDictionaryValue(
+        _In_reads_bytes_(cb) BYTE const* pb,
+        unsigned cb,
+        _Out_ unsigned* pIndex) noexcept;
+
+    EtwInternal::Buffer<Column> m_columns;
+    EtwInternal::Buffer<char> m_names;          // Column names, provider name, event name.
+    EtwInternal::Buffer<Chunk> m_chunks;        // ColumnCount chunks per row group.
+    EtwInternal::Buffer<UINT64> m_rowGroupRows; // Row count of each row group.
+    EtwInternal::Buffer<BYTE> m_page;           // Uncompressed page being built.
+    EtwInternal::Buffer<BYTE> m_values;         // Encoded values.
+    EtwInternal::Buffer<BYTE> m_compressed;     // Compressed page, page header, footer.
+    EtwInternal::Buffer<BYTE> m_defined;        // 1 if the value is not null.
+    EtwInternal::Buffer<BYTE> m_repetitionLevels; // List columns only.
+    EtwInternal::Buffer<BYTE> m_definitionLevels; // List columns only.
+    EtwInternal::Buffer<UINT64> m_deltaValues;  // Values for DELTA_BINARY_PACKED.
+    EtwInternal::Buffer<unsigned> m_indexes;    // Dictionary indexes of the values.
+    EtwInternal::Buffer<BYTE> m_dictionary;     // PLAIN-encoded dictionary values.
+    EtwInternal::Buffer<DictionaryEntry> m_dictionaryEntries;
+    EtwInternal::Buffer<unsigned> m_dictionaryBuckets; // Size is a power of 2.
+    EtwInternal::Buffer<USHORT> m_snappyTable;  // Snappy compressor hash table.
+    UINT64 m_filePos;
+    unsigned m_providerNameOffset;
+    unsigned m_providerNameLength;
+    unsigned m_eventNameOffset;
+    unsigned m_eventNameLength;
 };
 
 /*
-Receives a pointer to a counted string and a length.
-Note that ETW supports strings with embedded nul characters. The string
-referenced by this structure will not be nul-terminated and may contain
-embedded nul characters. Use DataLength instead of assuming the string is
-nul-terminated.
+Remembers the schemas written by EtwEnumerator::WriteCurrentEventAsSchemaJsonUtf8
+to an output stream, and assigns their IDs. Use one table per output stream
+and Clear it when starting a new stream.
 */
-struct EtwStringView
+class EtwJsonSchemaTable
 {
-    _Field_size_(DataLength) EtwWCHAR const* Data;
-    UINT32 DataLength;
+public:
+
+    EtwJsonSchemaTable(EtwJsonSchemaTable const&) = delete;
+    EtwJsonSchemaTable& operator=(EtwJsonSchemaTable const&) = delete;
+    EtwJsonSchemaTable() noexcept;
+    ~EtwJsonSchemaTable() noexcept;
+
+    // Removes all schemas. The next schema will get ID 0.
+    void
+    Clear() noexcept;
+
+    // Returns the number of schemas, i.e. the ID of the next schema.
+    unsigned
+    Count() const noexcept;
+
+private:
+
+    friend class EtwEnumerator;
+
+    struct Schema
+    {
+        GUID ProviderId;
+        EVENT_DESCRIPTOR EventDescriptor;
+        USHORT Flags;
+        USHORT EventProperty;
+        unsigned Hash;
+        USHORT cbSchemaTl;
+        USHORT cbProvTraits;
+        unsigned JsonSuffixFlags;
+        unsigned HashNext;       // Next schema in the same hash bucket.
+        BYTE* pKeyBlob;          // SchemaTl, ProvTraits. Null if both are empty.
+    };
+
+    static unsigned const NoSchema = ~0u;
+
+    // Returns the ID of the schema with the specified key, or NoSchema.
+    unsigned
+    Find(
+        EtwInternal::SchemaCache::Key const& key,
+        EtwJsonSuffixFlags jsonSuffixFlags) const noexcept;
+
+    // Adds a schema with ID Count(). Returns false if out of memory.
+    bool
+    Add(
+        EtwInternal::SchemaCache::Key const& key,
+        EtwJsonSuffixFlags jsonSuffixFlags) noexcept;
+
+    // Removes the schema most recently added.
+    void
+    RemoveLast() noexcept;
+
+    void
+    LinkSchema(
+        unsigned schemaId) noexcept;
+
+    EtwInternal::Buffer<Schema> m_schemas;
+    EtwInternal::Buffer<unsigned> m_buckets; // Size is a power of 2.
 };
 
 /*
-Receives a pointer to a nul-terminated string and a length. The nul
-termination character is not included in the length, i.e. the nul termination
-will always be at position Data[DataLength].
+Converts the records written by EtwEnumerator::WriteCurrentEventAsSchemaJsonUtf8
+back to events in the FormatCurrentEventAsJson format (with no prefix), so
+that tools that read the regular JSON output can read schema JSON streams.
+The output is the same as from WriteCurrentEventAsJsonUtf8.
+
+Pass each record (i.e. each line) of the stream to RehydrateRecord, in
+order. Use one rehydrator per stream, and Clear it when starting a new
+stream.
 */
-struct EtwStringViewZ
+class EtwJsonRehydrator
 {
-    _Field_size_(DataLength + 1) EtwPCWSTR Data;
-    UINT32 DataLength;
+public:
+
+    EtwJsonRehydrator(EtwJsonRehydrator const&) = delete;
+    EtwJsonRehydrator& operator=(EtwJsonRehydrator const&) = delete;
+    EtwJsonRehydrator() noexcept;
+    ~EtwJsonRehydrator() noexcept;
+
+    // Removes all schemas.
+    void
+    Clear() noexcept;
+
+    /*
+    Processes one record of a schema JSON stream. The record may include the
+    trailing '\n'. A schema record is stored (replacing any schema with the
+    same ID) and nothing is written. For an event record, the event's JSON
+    followed by '\n' is written to sink with a single Write. A blank record
+    is ignored.
+
+    Returns ERROR_SUCCESS, ERROR_INVALID_DATA if the record is not valid or
+    refers to an unknown schema, ERROR_OUTOFMEMORY, or an error from the
+    sink.
+    */
+    LSTATUS
+    RehydrateRecord(
+        _In_reads_(cchRecord) char const* pchRecord,
+        unsigned cchRecord,
+        EtwOutputSink& sink) noexcept;
+
+private:
+
+    struct Field
+    {
+        unsigned NameOffset;     // JSON string (with quotes) in m_text.
+        unsigned NameLength;
+        unsigned End;            // Index after the field's struct members.
+        bool IsArray;
+        bool IsStruct;
+    };
+
+    struct Meta
+    {
+        unsigned NameOffset;     // JSON string (with quotes) in m_text.
+        unsigned NameLength;
+        unsigned ValueOffset;    // Static value in m_text.
+        unsigned ValueLength;
+        unsigned DynamicIndex;   // Position in the event's dynamic array, or NoIndex.
+        unsigned Rank;           // Position in the FormatCurrentEventAsJson order.
+    };
+
+    struct Schema
+    {
+        unsigned FirstField;     // Index into m_fields.
+        unsigned FieldEnd;
+        unsigned FirstMeta;      // Index into m_meta.
+        unsigned MetaEnd;
+        unsigned DynamicCount;
+        bool HasMeta;
+        bool IsDefined;
+    };
+
+    static unsigned const NoIndex = ~0u;
+
+    LSTATUS
+    AddSchema(
+        _In_reads_(cch) char const* pch,
+        unsigned cch) noexcept;
+
+    LSTATUS
+    AddFields(
+        _Inout_ char const** ppch,
+        _In_ char const* pchEnd,
+        unsigned depth) noexcept;
+
+    LSTATUS
+    AddMeta(
+        _Inout_ char const** ppch,
+        _In_ char const* pchEnd) noexcept;
+
+    LSTATUS
+    AddDynamicNames(
+        _Inout_ char const** ppch,
+        _In_ char const* pchEnd) noexcept;
+
+    LSTATUS
+    AddEvent(
+        _In_reads_(cch) char const* pch,
+        unsigned cch) noexcept;
+
+    LSTATUS
+    AddStructValues(
+        unsigned firstField,
+        unsigned fieldEnd,
+        _Inout_ char const** ppch,
+        _In_ char const* pchEnd) noexcept;
+
+    LSTATUS
+    AddFieldValue(
+        unsigned fieldIndex,
+        _Inout_ char const** ppch,
+        _In_ char const* pchEnd) noexcept;
+
+    EtwInternal::Buffer<Schema> m_schemas;  // Indexed by schema ID.
+    EtwInternal::Buffer<Field> m_fields;    // Fields of all schemas, in pre-order.
+    EtwInternal::Buffer<Meta> m_meta;       // Metadata of all schemas, in Rank order.
+    EtwInternal::Buffer<char> m_text;       // Names and static metadata values.
+    EtwInternal::Buffer<char> m_output;     // Event being rehydrated.
+    EtwInternal::Buffer<unsigned> m_dynamic; // Offset, length of each dynamic value.
 };
 
 /*
-EtwEnumerator passes an instance of EtwStringBuilder to the methods of
-EtwEnumeratorCallbacks.
+Selects a subset of an event's fields for EtwEnumerator::MoveNextProjected
+and the projection overloads of FormatCurrentEventAsJson and
+WriteCurrentEventAsJsonUtf8, so that only the selected fields are decoded
+and formatted.
+
+Each field is selected by a path: a property name with an optional array
+index, then optionally '.' and a struct member name with an optional array
+index, and so on, e.g. "FileName", "Info.Size", or "Items[2].Id". Names
+must match the property names in the event's TRACE_EVENT_INFO exactly. A
+path selects the whole item it names, e.g. "Items" selects the whole array.
+A path that does not fit an event's schema (unknown name, index of a
+non-array, member of a non-struct, or member of an array without an index)
+selects nothing in that event. If one selected item contains another, only
+the outer item is selected.
+
+The paths are resolved to property indexes the first time an event schema
+(same key as the schema cache) is seen, and the result is reused for later
+events with the same schema. A projection also holds the position of a
+MoveNextProjected enumeration, so use one projection per thread.
 */
-class EtwStringBuilder
+class EtwFieldProjection
 {
-    // EtwStringBuilder is constructed only by EtwEnumerator.
+public:
+
+    EtwFieldProjection(EtwFieldProjection const&) = delete;
+    EtwFieldProjection& operator=(EtwFieldProjection const&) = delete;
+    EtwFieldProjection() noexcept;
+    ~EtwFieldProjection() noexcept;
+
+    /*
+    Sets the field paths (copies the strings), replacing any previous paths
+    and resolved schemas. Returns ERROR_SUCCESS, ERROR_INVALID_PARAMETER if
+    a path is not valid, or ERROR_OUTOFMEMORY. On failure, the projection
+    has no paths.
+    */
+    LSTATUS
+    SetFields(
+        _In_reads_(cPaths) EtwPCWSTR const* pszPaths,
+        unsigned cPaths) noexcept;
+
+    // Returns the number of paths.
+    unsigned
+    FieldCount() const noexcept;
+
+    // Returns a path. PRECONDITION: fieldIndex < FieldCount().
+    _Ret_z_ EtwPCWSTR
+    FieldPath(
+        unsigned fieldIndex) const noexcept;
+
+    // Removes the resolved schemas (e.g. after decoding information for a
+    // schema changes). Keeps the paths.
+    void
+    ClearSchemas() noexcept;
+
+private:
+
     friend class EtwEnumerator;
-    explicit EtwStringBuilder(EtwInternal::Buffer<EtwWCHAR>& buffer) noexcept;
 
+    struct Step
+    {
+        unsigned NameOffset;     // Offset into m_text.
+        unsigned NameLength;
+        USHORT ArrayIndex;       // Or NoArrayIndex.
+    };
+
+    // A selected item or an ancestor of one. Children are struct members.
+    struct Node
+    {
+        unsigned FirstChild;     // Or NoNode.
+        unsigned NextSibling;    // Or NoNode. Siblings are in event order.
+        unsigned FieldIndex;     // Path that selects this item, or NoField.
+        USHORT PropertyIndex;
+        USHORT ArrayIndex;       // Or NoArrayIndex to select the whole property.
+    };
+
+    struct Schema
+    {
+        unsigned FirstNode;      // Index into m_nodes, or NoNode.
+        unsigned FirstOffset;    // Index into m_offsets (PropertyCount entries).
+    };
+
+    // Enumeration position at one struct level.
+    struct Level
+    {
+        unsigned Node;           // Next node to visit, or NoNode.
+        unsigned StackSize;      // Enumerator stack size at this level.
+        bool InArray;            // Positioned within the array of a visited node.
+    };
+
+    // Identifies the item returned by MoveNextProjected.
+    struct Position
+    {
+        BYTE const* pbData;
+        unsigned StackSize;
+        USHORT PropertyIndex;
+        USHORT ArrayIndex;
+        UCHAR SubState;
+    };
+
+    static unsigned const NoNode = ~0u;
+    static unsigned const NoField = ~0u;
+    static unsigned const MaxPathSteps = 32; // Steps per path.
+    static USHORT const NoArrayIndex = 0xffff;
+    static USHORT const NoOffset = 0xffff;
+
+    void
+    ClearPaths() noexcept;
+
+    EtwInternal::Buffer<EtwWCHAR> m_text;     // Nul-terminated paths.
+    EtwInternal::Buffer<unsigned> m_paths;    // Offset of each path in m_text.
+    EtwInternal::Buffer<unsigned> m_pathSteps; // First step of each path, plus end.
+    EtwInternal::Buffer<Step> m_steps;
+    EtwJsonSchemaTable m_schemaIds;           // Index into m_schemas for each schema.
+    EtwInternal::Buffer<Schema> m_schemas;
+    EtwInternal::Buffer<Node> m_nodes;        // Nodes of all schemas.
+    EtwInternal::Buffer<USHORT> m_offsets;    // Offset from start of struct, or NoOffset.
+    EtwInternal::Buffer<Level> m_levels;      // Current MoveNextProjected enumeration.
+    Position m_returned;
+    unsigned m_schemaIndex;                   // Schema of the current enumeration.
+};
+
+/*
+Selects events by the values of event header fields and top-level payload
+fields, so that events can be rejected before they are formatted. For each
+event, call MatchesHeader (no decoding needed). If it does not decide the
+result, call StartEvent and then EtwEnumerator::EvaluateFilter.
+
+Expression syntax:
+
+    Expression := And ( "||" And )*
+    And        := Unary ( "&&" Unary )*
+    Unary      := "!" Unary | "(" Expression ")" | Name Operator Value
+    Operator   := "==" | "!=" | "<" | "<=" | ">" | ">=" | "&" | "contains"
+
+For example: level <= 3 && (Status != 0 || FileName contains \Temp\)
+
+The names provider, id, level, keywords, pid, and tid refer to fields of the
+event header. Any other name refers to the top-level payload property with
+that name (case-sensitive). A Value is either a "quoted" string or the text
+up to the next whitespace, ")", "&&", or "||". It is used as an integer if
+it is a decimal integer (optionally negative) or a 0x-prefixed hex integer,
+and as a GUID if it has the form XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX
+(optionally in braces).
+
+- Integer fields (all header fields except provider, plus INT, UINT, HEXINT,
+  BOOLEAN, POINTER, SIZET, FLOAT, and DOUBLE properties) support the
+  ordering operators and "&" (true if any of the value's bits are set).
+- String fields (UNICODESTRING and ANSISTRING properties, and provider when
+  the value is not a GUID) support ==, !=, and contains. ASCII letters
+  compare case-insensitively. provider compares with the provider name.
+- GUID fields (GUID properties, and provider when the value is a GUID)
+  support == and !=.
+
+A comparison is false if the event has no such property, if the property is
+an array or a struct, or if the property's type does not support the
+operator or the value. Within each && or ||, header comparisons are
+evaluated before payload comparisons, and evaluation stops as soon as the
+result is known.
+
+Payload names are resolved to property indexes the first time an event
+schema (same key as the schema cache) is seen, and the result is reused for
+later events with the same schema.
+*/
+class EtwEventFilter
+{
 public:
 
-    EtwStringBuilder(EtwStringBuilder const&) = delete;
-    EtwStringBuilder& operator=(EtwStringBuilder const&) = delete;
+    EtwEventFilter(EtwEventFilter const&) = delete;
+    EtwEventFilter& operator=(EtwEventFilter const&) = delete;
+    EtwEventFilter() noexcept;
+    ~EtwEventFilter() noexcept;
 
-    // Appends the specified character to the string builder.
-    LSTATUS __stdcall
-    AppendChar(
-        EtwWCHAR value) noexcept;
+    /*
+    Sets the expression, replacing any previous expression and resolved
+    schemas. An empty expression matches every event. Returns ERROR_SUCCESS,
+    ERROR_INVALID_PARAMETER if the expression is not valid, or
+    ERROR_OUTOFMEMORY. On failure, the filter is empty.
+    */
+    LSTATUS
+    SetExpression(
+        _In_z_ EtwPCWSTR szExpression) noexcept;
 
-    // Appends the specified nul-terminated string to the string builder.
-    LSTATUS __stdcall
-    AppendWide(
-        _In_z_ EtwPCWSTR szValue) noexcept;
+    // Returns true if the filter has no expression (matches every event).
+    bool
+    IsEmpty() const noexcept;
 
-    // Appends the specified swprintf-formatted string to the string builder.
-    LSTATUS __stdcall
-    AppendPrintf(
-        _Printf_format_string_ EtwPCWSTR szFormat,
-        ...) noexcept;
+    /*
+    Evaluates the expression using only the event's header. If the result
+    does not depend on the payload or on the provider name, sets *pMatch to
+    the result and returns true. Otherwise sets *pMatch to false and returns
+    false: use EtwEnumerator::EvaluateFilter to get the result.
+    */
+    bool
+    MatchesHeader(
+        _In_ EVENT_RECORD const* pEventRecord,
+        _Out_ bool* pMatch) const noexcept;
+
+    // Removes the resolved schemas (e.g. after decoding information for a
+    // schema changes). Keeps the expression.
+    void
+    ClearSchemas() noexcept;
 
 private:
 
-    EtwInternal::Buffer<EtwWCHAR>& m_buffer;
+    friend class EtwEnumerator;
+
+    enum NodeKind : UCHAR;
+    enum FieldKind : UCHAR;
+    enum Operator : UCHAR;
+    enum Result : UCHAR;
+
+    // An operator (&&, ||, !) or a comparison.
+    struct Node
+    {
+        unsigned FirstChild;     // First operand of &&, ||, !, or NoNode.
+        unsigned NextSibling;    // Next operand of the parent, or NoNode.
+        unsigned FieldIndex;     // Payload comparison: index into m_fields.
+        unsigned TextOffset;     // Comparison: value (not nul-terminated) in m_text.
+        unsigned TextLength;
+        UINT64 Integer;          // Comparison: magnitude, if IsInteger.
+        GUID Guid;               // Comparison: value, if IsGuid.
+        UCHAR Kind;              // NodeKind.
+        UCHAR Field;             // FieldKind.
+        UCHAR Op;                // Operator.
+        bool IsInteger;
+        bool IsNegative;
+        bool IsGuid;
+        bool NeedsPayload;       // Result may depend on the payload or provider name.
+    };
+
+    // The event being evaluated.
+    struct Context
+    {
+        EVENT_RECORD const* pEventRecord;
+        EtwEnumerator* pEnumerator;          // Null when evaluating only the header.
+        USHORT const* pPropertyIndices;      // Property index for each of m_fields.
+        EtwPCWSTR szProviderName;            // Null if none.
+    };
+
+    static unsigned const NoNode = ~0u;
+    static USHORT const NoProperty = 0xffff;
+    static unsigned const MaxDepth = 32;     // Nesting of ( and !.
+
+    LSTATUS
+    ParseList(
+        _Inout_ EtwPCWSTR* ppch,
+        UCHAR kind,
+        unsigned depth,
+        _Out_ unsigned* pNode) noexcept;
+
+    LSTATUS
+    ParseUnary(
+        _Inout_ EtwPCWSTR* ppch,
+        unsigned depth,
+        _Out_ unsigned* pNode) noexcept;
+
+    LSTATUS
+    ParseComparison(
+        _Inout_ EtwPCWSTR* ppch,
+        _Out_ unsigned* pNode) noexcept;
+
+    LSTATUS
+    AddText(
+        _In_reads_(cch) EtwWCHAR const* pch,
+        unsigned cch,
+        _Out_ unsigned* pTextOffset) noexcept;
+
+    Result
+    Evaluate(
+        unsigned nodeIndex,
+        Context const& context) const noexcept;
+
+    static bool
+    OrderMatches(
+        UCHAR op,
+        int order) noexcept;
+
+    Result
+    EvaluateComparison(
+        Node const& node,
+        Context const& context) const noexcept;
+
+    bool
+    CompareItem(
+        Node const& node,
+        EtwItemInfo const& item) const noexcept;
+
+    template<class CharT>
+    bool
+    CompareText(
+        Node const& node,
+        _In_reads_(cch) CharT const UNALIGNED* pch,
+        unsigned cch) const noexcept;
+
+    EtwInternal::Buffer<EtwWCHAR> m_text;     // Payload names (nul-terminated) and values.
+    EtwInternal::Buffer<Node> m_nodes;
+    EtwInternal::Buffer<unsigned> m_fields;   // Offset of each payload name in m_text.
+    EtwJsonSchemaTable m_schemaIds;           // Index into m_schemas for each schema.
+    EtwInternal::Buffer<unsigned> m_schemas;  // First entry in m_propertyIndices.
+    EtwInternal::Buffer<USHORT> m_propertyIndices; // Per schema, one per m_fields, or NoProperty.
+    unsigned m_root;                          // Or NoNode if empty.
 };
 
 /*
@@ -2210,6 +5201,314 @@ public:
         UnderlyingType valueType,
         ULONG value,
         EtwStringBuilder& mapBuilder) noexcept;
+
+    /*
+    This method will be called instead of FormatMapValue when EtwEnumerator
+    attempts to format an integer value with a map that is in EtwEnumerator's
+    map cache. mapIndex is a lookup index for pMapInfo.
+
+    The default implementation calls FormatMapValue.
+
+    Callbacks that do not override FormatMapValue can override this method to
+    call FormatMapValueUsingIndex, which produces the same output as the
+    default FormatMapValue without scanning the map. (The callbacks used by a
+    default-constructed EtwEnumerator do this.)
+    */
+    virtual LSTATUS __stdcall FormatIndexedMapValue(
+        _In_ EVENT_MAP_INFO const* pMapInfo,
+        EtwInternal::MapIndex const& mapIndex,
+        UnderlyingType valueType,
+        ULONG value,
+        EtwStringBuilder& mapBuilder) noexcept;
+
+protected:
+
+    /*
+    Same behavior as the default implementation of FormatMapValue, but uses
+    mapIndex to find the matching map entries.
+    */
+    LSTATUS FormatMapValueUsingIndex(
+        _In_ EVENT_MAP_INFO const* pMapInfo,
+        EtwInternal::MapIndex const& mapIndex,
+        UnderlyingType valueType,
+        ULONG value,
+        EtwStringBuilder& mapBuilder) noexcept;
+};
+
+/*
+Base class for a visitor used with EtwEnumerator::Visit. Visit calls the
+handlers of the derived class directly (not virtually), so derive from
+EtwVisitor and declare only the handlers you need. The handlers of this class
+do nothing and return true (continue).
+
+The szName parameter is the name of the property, or "" if the property has
+no name. Array elements and the array handlers use the name of the array.
+Strings, spans, and binary data point into the event data: they may be
+unaligned and will become invalid when the event's buffer becomes invalid.
+Strings are not nul-terminated.
+
+Canonical InType         Handler
+-------------------------------------------------
+TDH_INTYPE_INT8          OnInt8, OnInt8Array
+TDH_INTYPE_UINT8         OnUInt8, OnUInt8Array
+TDH_INTYPE_INT16         OnInt16, OnInt16Array
+TDH_INTYPE_UINT16        OnUInt16, OnUInt16Array
+TDH_INTYPE_INT32         OnInt32, OnInt32Array
+TDH_INTYPE_UINT32        OnUInt32, OnUInt32Array
+TDH_INTYPE_HEXINT32      OnUInt32, OnUInt32Array
+TDH_INTYPE_INT64         OnInt64, OnInt64Array
+TDH_INTYPE_UINT64        OnUInt64, OnUInt64Array
+TDH_INTYPE_HEXINT64      OnUInt64, OnUInt64Array
+TDH_INTYPE_FLOAT         OnFloat, OnFloatArray
+TDH_INTYPE_DOUBLE        OnDouble, OnDoubleArray
+TDH_INTYPE_BOOLEAN       OnBoolean, OnBooleanArray
+TDH_INTYPE_GUID          OnGuid, OnGuidArray
+TDH_INTYPE_FILETIME      OnFileTime, OnFileTimeArray
+TDH_INTYPE_SYSTEMTIME    OnSystemTime, OnSystemTimeArray
+TDH_INTYPE_POINTER       OnPointer (zero-extended to 64 bits)
+TDH_INTYPE_SIZET         OnPointer (zero-extended to 64 bits)
+TDH_INTYPE_UNICODESTRING OnString
+TDH_INTYPE_UNICODECHAR   OnString
+TDH_INTYPE_ANSISTRING    OnAnsiString
+TDH_INTYPE_ANSICHAR      OnAnsiString
+Other (BINARY, SID, ...) OnOther
+*/
+class EtwVisitor
+{
+public:
+
+    bool OnInt8(EtwPCWSTR, INT8) noexcept { return true; }
+    bool OnUInt8(EtwPCWSTR, UINT8) noexcept { return true; }
+    bool OnInt16(EtwPCWSTR, INT16) noexcept { return true; }
+    bool OnUInt16(EtwPCWSTR, UINT16) noexcept { return true; }
+    bool OnInt32(EtwPCWSTR, INT32) noexcept { return true; }
+    bool OnUInt32(EtwPCWSTR, UINT32) noexcept { return true; }
+    bool OnInt64(EtwPCWSTR, INT64) noexcept { return true; }
+    bool OnUInt64(EtwPCWSTR, UINT64) noexcept { return true; }
+    bool OnFloat(EtwPCWSTR, float) noexcept { return true; }
+    bool OnDouble(EtwPCWSTR, double) noexcept { return true; }
+    bool OnBoolean(EtwPCWSTR, bool) noexcept { return true; }
+    bool OnGuid(EtwPCWSTR, GUID const&) noexcept { return true; }
+    bool OnFileTime(EtwPCWSTR, INT64) noexcept { return true; }
+    bool OnSystemTime(EtwPCWSTR, SYSTEMTIME const&) noexcept { return true; }
+    bool OnPointer(EtwPCWSTR, UINT64) noexcept { return true; }
+    bool OnString(EtwPCWSTR, EtwStringView) noexcept { return true; }
+    bool OnAnsiString(EtwPCWSTR, _In_reads_(cch) char const*, UINT32 cch) noexcept { (void)cch; return true; }
+    bool OnOther(EtwPCWSTR, _TDH_IN_TYPE, _In_reads_bytes_(cbData) void const*, UINT32 cbData) noexcept { (void)cbData; return true; }
+
+    bool OnInt8Array(EtwPCWSTR, EtwArraySpan<INT8>) noexcept { return true; }
+    bool OnUInt8Array(EtwPCWSTR, EtwArraySpan<UINT8>) noexcept { return true; }
+    bool OnInt16Array(EtwPCWSTR, EtwArraySpan<INT16>) noexcept { return true; }
+    bool OnUInt16Array(EtwPCWSTR, EtwArraySpan<UINT16>) noexcept { return true; }
+    bool OnInt32Array(EtwPCWSTR, EtwArraySpan<INT32>) noexcept { return true; }
+    bool OnUInt32Array(EtwPCWSTR, EtwArraySpan<UINT32>) noexcept { return true; }
+    bool OnInt64Array(EtwPCWSTR, EtwArraySpan<INT64>) noexcept { return true; }
+    bool OnUInt64Array(EtwPCWSTR, EtwArraySpan<UINT64>) noexcept { return true; }
+    bool OnFloatArray(EtwPCWSTR, EtwArraySpan<float>) noexcept { return true; }
+    bool OnDoubleArray(EtwPCWSTR, EtwArraySpan<double>) noexcept { return true; }
+    bool OnBooleanArray(EtwPCWSTR, EtwArraySpan<BOOL>) noexcept { return true; }
+    bool OnGuidArray(EtwPCWSTR, EtwArraySpan<GUID>) noexcept { return true; }
+    bool OnFileTimeArray(EtwPCWSTR, EtwArraySpan<INT64>) noexcept { return true; }
+    bool OnSystemTimeArray(EtwPCWSTR, EtwArraySpan<SYSTEMTIME>) noexcept { return true; }
+
+    // elementType is TDH_INTYPE_NULL for an array of structs.
+    bool OnArrayBegin(EtwPCWSTR, UINT32, _TDH_IN_TYPE) noexcept { return true; }
+    bool OnArrayEnd(EtwPCWSTR) noexcept { return true; }
+    bool OnStructBegin(EtwPCWSTR) noexcept { return true; }
+    bool OnStructEnd(EtwPCWSTR) noexcept { return true; }
 };
 
+template<class Visitor>
+bool
+EtwEnumerator::Visit(
+    Visitor& visitor) noexcept
+{
+    assert(m_state == EtwEnumeratorState_BeforeFirstItem); // PRECONDITION
+
+    bool keepGoing = true;
+    bool moved = MoveNext();
+
+    while (moved)
+    {
+        auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
+        EtwPCWSTR const szName = epi.NameOffset != 0
+            ? reinterpret_cast<EtwPCWSTR>(
+                reinterpret_cast<BYTE const*>(m_pTraceEventInfo) + epi.NameOffset)
+            : L"";
+        bool skipChildren = false;
+
+        switch (m_state)
+        {
+        case EtwEnumeratorState_ArrayBegin:
+            if (m_cbElement != 0 &&
+                m_cookedInType != TDH_INTYPE_POINTER &&
+                m_cookedInType != TDH_INTYPE_SIZET)
+            {
+                keepGoing = VisitSimpleArray(visitor, szName);
+                skipChildren = true;
+            }
+            else
+            {
+                keepGoing = visitor.OnArrayBegin(
+                    szName,
+                    m_stackTop.ArrayCount,
+                    static_cast<_TDH_IN_TYPE>(m_cookedInType));
+            }
+            break;
+        case EtwEnumeratorState_ArrayEnd:
+            keepGoing = visitor.OnArrayEnd(szName);
+            break;
+        case EtwEnumeratorState_StructBegin:
+            keepGoing = visitor.OnStructBegin(szName);
+            break;
+        case EtwEnumeratorState_StructEnd:
+            keepGoing = visitor.OnStructEnd(szName);
+            break;
+        default:
+            keepGoing = VisitValue(visitor, szName);
+            break;
+        }
+
+        moved = keepGoing && (skipChildren ? MoveNextSibling() : MoveNext());
+    }
+
+    return !keepGoing || m_state != EtwEnumeratorState_Error;
+}
+
+template<class Visitor>
+bool
+EtwEnumerator::VisitValue(
+    Visitor& visitor,
+    _In_z_ EtwPCWSTR szName) noexcept
+{
+    auto const pb = m_pbCooked;
+    switch (m_cookedInType)
+    {
+    case TDH_INTYPE_INT8:
+        return visitor.OnInt8(szName, *reinterpret_cast<INT8 const*>(pb));
+    case TDH_INTYPE_UINT8:
+        return visitor.OnUInt8(szName, *pb);
+    case TDH_INTYPE_INT16:
+        return visitor.OnInt16(szName, *reinterpret_cast<INT16 const UNALIGNED*>(pb));
+    case TDH_INTYPE_UINT16:
+        return visitor.OnUInt16(szName, *reinterpret_cast<UINT16 const UNALIGNED*>(pb));
+    case TDH_INTYPE_INT32:
+        return visitor.OnInt32(szName, *reinterpret_cast<INT32 const UNALIGNED*>(pb));
+    case TDH_INTYPE_UINT32:
+    case TDH_INTYPE_HEXINT32:
+        return visitor.OnUInt32(szName, *reinterpret_cast<UINT32 const UNALIGNED*>(pb));
+    case TDH_INTYPE_INT64:
+        return visitor.OnInt64(szName, *reinterpret_cast<INT64 const UNALIGNED*>(pb));
+    case TDH_INTYPE_UINT64:
+    case TDH_INTYPE_HEXINT64:
+        return visitor.OnUInt64(szName, *reinterpret_cast<UINT64 const UNALIGNED*>(pb));
+    case TDH_INTYPE_FLOAT:
+        return visitor.OnFloat(szName, *reinterpret_cast<float const UNALIGNED*>(pb));
+    case TDH_INTYPE_DOUBLE:
+        return visitor.OnDouble(szName, *reinterpret_cast<double const UNALIGNED*>(pb));
+    case TDH_INTYPE_BOOLEAN:
+        return visitor.OnBoolean(szName, 0 != *reinterpret_cast<BOOL const UNALIGNED*>(pb));
+    case TDH_INTYPE_GUID:
+    {
+        GUID const value = *reinterpret_cast<GUID const UNALIGNED*>(pb);
+        return visitor.OnGuid(szName, value);
+    }
+    case TDH_INTYPE_FILETIME:
+        return visitor.OnFileTime(szName, *reinterpret_cast<INT64 const UNALIGNED*>(pb));
+    case TDH_INTYPE_SYSTEMTIME:
+    {
+        SYSTEMTIME const value = *reinterpret_cast<SYSTEMTIME const UNALIGNED*>(pb);
+        return visitor.OnSystemTime(szName, value);
+    }
+    case TDH_INTYPE_POINTER:
+    case TDH_INTYPE_SIZET:
+        return visitor.OnPointer(szName, m_cbCooked == 8
+            ? *reinterpret_cast<UINT64 const UNALIGNED*>(pb)
+            : *reinterpret_cast<UINT32 const UNALIGNED*>(pb));
+    case TDH_INTYPE_UNICODESTRING:
+    case TDH_INTYPE_UNICODECHAR:
+        return visitor.OnString(szName, EtwStringView{
+            reinterpret_cast<EtwWCHAR const*>(pb), m_cbCooked / 2u });
+    case TDH_INTYPE_ANSISTRING:
+    case TDH_INTYPE_ANSICHAR:
+        return visitor.OnAnsiString(szName, reinterpret_cast<char const*>(pb), m_cbCooked);
+    default:
+        return visitor.OnOther(szName, static_cast<_TDH_IN_TYPE>(m_cookedInType), pb, m_cbCooked);
+    }
+}
+
+template<class Visitor>
+bool
+EtwEnumerator::VisitSimpleArray(
+    Visitor& visitor,
+    _In_z_ EtwPCWSTR szName) noexcept
+{
+    switch (m_cookedInType)
+    {
+    case TDH_INTYPE_INT8:
+        return visitor.OnInt8Array(szName, CurrentArraySpan<INT8>());
+    case TDH_INTYPE_UINT8:
+        return visitor.OnUInt8Array(szName, CurrentArraySpan<UINT8>());
+    case TDH_INTYPE_INT16:
+        return visitor.OnInt16Array(szName, CurrentArraySpan<INT16>());
+    case TDH_INTYPE_UINT16:
+        return visitor.OnUInt16Array(szName, CurrentArraySpan<UINT16>());
+    case TDH_INTYPE_INT32:
+        return visitor.OnInt32Array(szName, CurrentArraySpan<INT32>());
+    case TDH_INTYPE_UINT32:
+    case TDH_INTYPE_HEXINT32:
+        return visitor.OnUInt32Array(szName, CurrentArraySpan<UINT32>());
+    case TDH_INTYPE_INT64:
+        return visitor.OnInt64Array(szName, CurrentArraySpan<INT64>());
+    case TDH_INTYPE_UINT64:
+    case TDH_INTYPE_HEXINT64:
+        return visitor.OnUInt64Array(szName, CurrentArraySpan<UINT64>());
+    case TDH_INTYPE_FLOAT:
+        return visitor.OnFloatArray(szName, CurrentArraySpan<float>());
+    case TDH_INTYPE_DOUBLE:
+        return visitor.OnDoubleArray(szName, CurrentArraySpan<double>());
+    case TDH_INTYPE_BOOLEAN:
+        return visitor.OnBooleanArray(szName, CurrentArraySpan<BOOL>());
+    case TDH_INTYPE_GUID:
+        return visitor.OnGuidArray(szName, CurrentArraySpan<GUID>());
+    case TDH_INTYPE_FILETIME:
+        return visitor.OnFileTimeArray(szName, CurrentArraySpan<INT64>());
+    case TDH_INTYPE_SYSTEMTIME:
+        return visitor.OnSystemTimeArray(szName, CurrentArraySpan<SYSTEMTIME>());
+    case TDH_INTYPE_UNICODECHAR:
+        return visitor.OnString(szName, EtwStringView{
+            reinterpret_cast<EtwWCHAR const*>(m_pbCooked), m_stackTop.ArrayCount });
+    case TDH_INTYPE_ANSICHAR:
+        return visitor.OnAnsiString(szName, reinterpret_cast<char const*>(m_pbCooked), m_stackTop.ArrayCount);
+    default:
+        return visitor.OnOther(szName, static_cast<_TDH_IN_TYPE>(m_cookedInType), m_pbCooked, m_cbCooked);
+    }
+}
+
+template<class T>
+bool
+EtwEnumerator::GetArraySpan(
+    _Out_ EtwArraySpan<T>* pSpan) const noexcept
+{
+    if (m_state != EtwEnumeratorState_ArrayBegin ||
+        m_cbElement != sizeof(T))
+    {
+        pSpan->Data = nullptr;
+        pSpan->Count = 0;
+        return false;
+    }
+
+    *pSpan = CurrentArraySpan<T>();
+    return true;
+}
+
+template<class T>
+EtwArraySpan<T>
+EtwEnumerator::CurrentArraySpan() const noexcept
+{
+    return EtwArraySpan<T>{
+        reinterpret_cast<T const UNALIGNED*>(m_pbCooked),
+        m_stackTop.ArrayCount };
+}
+
 #pragma warning(pop)
@@ -9,6 +9,9 @@ This sample demonstrates the following:
 - How to process events from ETL files using OpenTrace and ProcessTrace.
 - How to format non-WPP events using EtwEnumerator.
 - How to format WPP events using TdhGetProperty.
+- How to convert events to Parquet files using DecodeCurrentEventToColumns
+  and EtwParquetWriter.
+- How to skip events with EtwEventFilter before formatting them.
 */
 
 #ifndef WIN32_LEAN_AND_MEAN
@@ -17,24 +20,83 @@ This sample demonstrates the following:
 
 #include <windows.h>
 #include <tdh.h>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include <wchar.h> // wprintf
+#include <wctype.h> // iswalnum
 
 #include <EtwEnumerator.h>
 
 #pragma comment(lib, "tdh.lib") // Link against TDH.dll
 
+/*
+A Parquet file for one table of an EtwColumnBatch.
+*/
+class ParquetFile
+    : public EtwOutputSink
+{
+    HANDLE m_hFile;
+
+public:
+
+    EtwParquetWriter writer;
+
+    ParquetFile() noexcept
+        : m_hFile(INVALID_HANDLE_VALUE)
+        , writer()
+    {
+        return;
+    }
+
+    ~ParquetFile()
+    {
+        Close();
+    }
+
+    LSTATUS Create(_In_z_ PCWSTR szFileName) noexcept
+    {
+        m_hFile = CreateFileW(szFileName, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        return m_hFile == INVALID_HANDLE_VALUE ? GetLastError() : ERROR_SUCCESS;
+    }
+
+    void Close() noexcept
+    {
+        if (m_hFile != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_hFile);
+            m_hFile = INVALID_HANDLE_VALUE;
+        }
+    }
+
+    LSTATUS __stdcall Write(
+        _In_reads_bytes_(cb) void const* pb,
+        unsigned cb) noexcept override
+    {
+        DWORD cbWritten;
+        return WriteFile(m_hFile, pb, cb, &cbWritten, nullptr) ? ERROR_SUCCESS : GetLastError();
+    }
+};
+
 /*
 Decodes event data using EtwEnumerator and TdhGetProperty.
-Prints event information to stdout.
+Prints event information to stdout, or writes it to Parquet files.
 */
 class DecoderContext
 {
+    static unsigned const ParquetRowGroupSize = 65536; // Rows per flush.
+
     EtwEnumerator m_enumerator;
+    EtwCompiledPrefix m_prefix; // Prefix for each formatted event.
     TDH_CONTEXT m_tdhContext[1]; // May contain TDH_CONTEXT_WPP_TMFSEARCHPATH.
     BYTE m_tdhContextCount;  // 1 if a TMF search path is present.
     std::vector<wchar_t> m_propertyBuffer; // Buffer for the string returned by TdhGetProperty.
+    PCWSTR m_szParquetDirectory; // If not null, write Parquet files instead of printing.
+    EtwColumnBatch m_columns; // Rows not yet written to the Parquet files.
+    unsigned m_columnRows;    // Number of rows in m_columns.
+    std::vector<std::unique_ptr<ParquetFile>> m_parquetFiles; // One per table.
+    EtwEventFilter m_filter;  // Events that do not match are skipped.
 
 public:
 
@@ -44,12 +106,19 @@ public:
     - Configures the EtwEnumerator.
     - Sets up the TDH_CONTEXT array that will be used for decoding WPP.
     */
-    explicit
-    DecoderContext(_In_opt_ PCWSTR szTmfSearchPath)
+    DecoderContext(
+        _In_opt_ PCWSTR szTmfSearchPath,
+        _In_opt_ PCWSTR szParquetDirectory)
         : m_enumerator() // Default-constructed enumerator uses default callbacks.
+        , m_prefix()
         , m_tdhContext()
         , m_tdhContextCount()
         , m_propertyBuffer()
+        , m_szParquetDirectory(szParquetDirectory)
+        , m_columns()
+        , m_columnRows()
+        , m_parquetFiles()
+        , m_filter()
     {
         // Configure the EtwEnumerator as desired.
         // This generates results similar to "tracefmt -sortableTime -utc".
@@ -58,6 +127,9 @@ public:
             EtwTimestampFormat_LowPrecision |
             EtwTimestampFormat_NoTimeZoneSuffix));
 
+        // Parse the prefix once instead of once per event.
+        m_prefix.Compile(L"[%9]%8.%3::%4 [%1]"); // Traditional tracefmt message prefix.
+
         // If a TMF search path was provided, set up the TDH_CONTEXT for it.
         if (szTmfSearchPath != nullptr)
         {
@@ -68,6 +140,16 @@ public:
         }
     }
 
+    /*
+    Set the filter expression (see EtwEventFilter). Events that do not match
+    are skipped.
+    */
+    LSTATUS
+    SetFilter(_In_z_ PCWSTR szFilter) noexcept
+    {
+        return m_filter.SetExpression(szFilter);
+    }
+
     /*
     Decode and print the data for an event.
     */
@@ -75,11 +157,26 @@ public:
     PrintEventRecord(_In_ EVENT_RECORD* pEventRecord) noexcept
     {
         auto eventCategory = m_enumerator.PreviewEvent(pEventRecord);
+
+        // Skip the event if its header fields rule it out. If the result
+        // depends on the payload, check the event after StartEvent.
+        bool headerMatch;
+        bool const headerDecided = m_filter.MatchesHeader(pEventRecord, &headerMatch);
+        if (headerDecided && !headerMatch)
+        {
+            return;
+        }
+
         switch (eventCategory)
         {
         case EtwEventCategory_TmfWpp:
 
-            PrintWppEvent(pEventRecord); // EtwEnumerator does not handle WPP events.
+            // Payload conditions cannot be checked without EtwEnumerator, so
+            // print a WPP event only if its header fields match the filter.
+            if (m_szParquetDirectory == nullptr && headerDecided)
+            {
+                PrintWppEvent(pEventRecord); // EtwEnumerator does not handle WPP events.
+            }
             break;
 
         case EtwEventCategory_Wbem:
@@ -106,12 +203,27 @@ public:
                 // Usually because we were unable to decode event.
                 wprintf(L"[StartEvent error %u]\n", m_enumerator.LastError());
             }
+            else if (!headerDecided && !CurrentEventMatchesFilter())
+            {
+                // Skipped by the filter. Nothing was formatted.
+            }
+            else if (m_szParquetDirectory != nullptr)
+            {
+                // Add a row for the started event to the table for the
+                // event's schema. Write the tables when enough rows have
+                // accumulated.
+                m_columnRows += m_enumerator.DecodeCurrentEventToColumns(m_columns);
+                if (m_columnRows >= ParquetRowGroupSize)
+                {
+                    WriteParquetRowGroups();
+                }
+            }
             else
             {
                 // Use EtwEnumerator to format the message.
                 EtwStringViewZ formattedEvent;
                 m_enumerator.FormatCurrentEvent(
-                    L"[%9]%8.%3::%4 [%1]", // Traditional tracefmt message prefix.
+                    m_prefix,
                     EtwJsonSuffixFlags_Default,
                     &formattedEvent);
                 wprintf(L"%ls\n", formattedEvent.Data);
@@ -120,8 +232,137 @@ public:
         }
     }
 
+    /*
+    Writes any remaining rows and finishes the Parquet files.
+    */
+    void
+    CloseParquetFiles()
+    {
+        if (m_szParquetDirectory != nullptr)
+        {
+            WriteParquetRowGroups();
+            for (auto& pFile : m_parquetFiles)
+            {
+                if (pFile != nullptr)
+                {
+                    LSTATUS status = pFile->writer.End(*pFile);
+                    if (status != ERROR_SUCCESS)
+                    {
+                        wprintf(L"[EtwParquetWriter error %u]\n", status);
+                    }
+
+                    pFile->Close();
+                }
+            }
+
+            m_parquetFiles.clear();
+        }
+    }
+
 private:
 
+    /*
+    Evaluate the filter against the payload of the current event (after
+    StartEvent). Only the fields needed to decide the result are read.
+    If the filter cannot be evaluated, report the error and skip the event.
+    */
+    bool
+    CurrentEventMatchesFilter() noexcept
+    {
+        bool match;
+        if (!m_enumerator.EvaluateFilter(m_filter, &match))
+        {
+            wprintf(L"[EvaluateFilter error %u]\n", m_enumerator.LastError());
+            return false;
+        }
+
+        return match;
+    }
+
+    /*
+    Writes one row group to each table's Parquet file, creating the file if
+    needed, then clears the rows from m_columns. Files are named
+    "Index-Provider-Event.parquet".
+    */
+    void
+    WriteParquetRowGroups()
+    {
+        unsigned const tableCount = m_columns.TableCount();
+        if (m_parquetFiles.size() < tableCount)
+        {
+            m_parquetFiles.resize(tableCount);
+        }
+
+        for (unsigned i = 0; i != tableCount; i += 1)
+        {
+            auto const tableInfo = m_columns.GetTableInfo(i);
+            LSTATUS status = ERROR_SUCCESS;
+            auto& pFile = m_parquetFiles[i];
+            if (tableInfo.RowCount == 0)
+            {
+                continue;
+            }
+            else if (pFile == nullptr)
+            {
+                std::wstring fileName = m_szParquetDirectory;
+                fileName += L'\\';
+                fileName += std::to_wstring(i);
+                fileName += L'-';
+                AppendFileNamePart(fileName, tableInfo.ProviderName);
+                fileName += L'-';
+                if (tableInfo.EventName[0] != 0)
+                {
+                    AppendFileNamePart(fileName, tableInfo.EventName);
+                }
+                else
+                {
+                    fileName += L"Id";
+                    fileName += std::to_wstring(tableInfo.EventDescriptor.Id);
+                }
+
+                fileName += L".parquet";
+
+                pFile.reset(new ParquetFile());
+                status = pFile->Create(fileName.c_str());
+                if (status != ERROR_SUCCESS)
+                {
+                    wprintf(L"[CreateFile error %u for file: %ls]\n", status, fileName.c_str());
+                }
+                else
+                {
+                    status = pFile->writer.Begin(m_columns, i, *pFile);
+                }
+            }
+
+            if (status == ERROR_SUCCESS)
+            {
+                status = pFile->writer.WriteRowGroup(m_columns, i, *pFile);
+            }
+
+            if (status != ERROR_SUCCESS)
+            {
+                wprintf(L"[EtwParquetWriter error %u]\n", status);
+            }
+        }
+
+        m_columns.ClearRows();
+        m_columnRows = 0;
+    }
+
+    /*
+    Appends szPart to fileName, replacing characters that are not letters,
+    digits, '_', or '.' with '_'.
+    */
+    static void
+    AppendFileNamePart(std::wstring& fileName, _In_z_ PCWSTR szPart)
+    {
+        for (PCWSTR pch = szPart; *pch != 0; pch += 1)
+        {
+            wchar_t ch = *pch;
+            fileName += iswalnum(ch) || ch == L'_' || ch == L'.' ? ch : L'_';
+        }
+    }
+
     void PrintWppEvent(_In_ EVENT_RECORD* pEventRecord) noexcept
     {
         /*
@@ -232,12 +473,16 @@ struct DecoderSettings
     std::vector<PCWSTR> manFiles;
     std::vector<PCWSTR> binFiles;
     PCWSTR szTmfSearchPath;
+    PCWSTR szParquetDirectory;
+    PCWSTR szFilter;
     bool showUsage;
 
     DecoderSettings(
         int argc,
         _In_count_(argc) PWSTR argv[])
         : szTmfSearchPath()
+        , szParquetDirectory()
+        , szFilter()
         , showUsage()
     {
         for (int i = 1; i < argc; i += 1)
@@ -247,6 +492,12 @@ struct DecoderSettings
             {
                 etlFiles.push_back(szArg);
             }
+            else if (0 == _wcsnicmp(&szArg[1], L"filter", 6) &&
+                (szArg[7] == L':' || szArg[7] == L'='))
+            {
+                // Long form of /F:Expression.
+                SetFilter(szArg, &szArg[8]);
+            }
             else if (szArg[1] == L'\0' ||
                 (szArg[2] != L'\0' && szArg[2] != L':' && szArg[2] != L'='))
             {
@@ -270,11 +521,29 @@ struct DecoderSettings
                     binFiles.push_back(szArgValue);
                     break;
 
+                case L'F':
+                case L'f':
+                    SetFilter(szArg, szArgValue);
+                    break;
+
                 case L'M':
                 case L'm':
                     manFiles.push_back(szArgValue);
                     break;
 
+                case L'P':
+                case L'p':
+                    if (szParquetDirectory == nullptr)
+                    {
+                        szParquetDirectory = szArgValue;
+                    }
+                    else
+                    {
+                        wprintf(L"ERROR: Parquet directory already set: %ls\n", szArg);
+                        showUsage = true;
+                    }
+                    break;
+
                 case L'T':
                 case L't':
                     if (szTmfSearchPath == nullptr)
@@ -302,6 +571,24 @@ struct DecoderSettings
             showUsage = true;
         }
     }
+
+private:
+
+    void
+    SetFilter(
+        _In_z_ PCWSTR szArg,
+        _In_z_ PCWSTR szArgValue)
+    {
+        if (szFilter == nullptr)
+        {
+            szFilter = szArgValue;
+        }
+        else
+        {
+            wprintf(L"ERROR: Filter already set: %ls\n", szArg);
+            showUsage = true;
+        }
+    }
 };
 
 /*
@@ -398,12 +685,34 @@ Options:
   -b:ResourceFile.dll  Load decoding data from a DLL with
                        TdhLoadManifestFromBinary.
   -t:TmfSearchPath     Set the TMF search path to use for WPP events.
+  -p:OutputDirectory   Instead of printing the events, write them to Parquet
+                       files in OutputDirectory, one file per event schema.
+                       WPP events are skipped.
+  -filter:Expression   Only decode events that match the expression, e.g.
+                       -filter:"level <= 3 && Status != 0". Header fields
+                       (provider, id, level, keywords, pid, tid) and raw
+                       payload values are checked before the event is
+                       formatted. See EtwEventFilter for the syntax. WPP
+                       events match only if their header fields match.
+                       Short form: -f:Expression.
 )");
             exitCode = 1;
             goto Done;
         }
 
-        DecoderContext context(settings.szTmfSearchPath);
+        DecoderContext context(settings.szTmfSearchPath, settings.szParquetDirectory);
+
+        if (settings.szFilter != nullptr)
+        {
+            exitCode = context.SetFilter(settings.szFilter);
+            if (exitCode != 0)
+            {
+                wprintf(L"ERROR: SetFilter error %u for filter: %ls\n",
+                    exitCode,
+                    settings.szFilter);
+                goto Done;
+            }
+        }
 
         for (size_t i = 0; i != settings.manFiles.size(); i += 1)
         {
@@ -462,6 +771,7 @@ Options:
         }
 
         exitCode = handles.ProcessTrace(nullptr, nullptr);
+        context.CloseParquetFiles(); // Finish the files even if ProcessTrace failed.
         if (exitCode != 0)
         {
             wprintf(L"ERROR: ProcessTrace error %u\n",
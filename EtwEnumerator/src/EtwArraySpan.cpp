@@ -0,0 +1,279 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "stdafx.h"
+#include <EtwEnumerator.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h> // SSE2
+#endif
+
+/*
+Implementation of the EtwArraySpan kernels for 32-bit and 64-bit integers.
+The SSE2 loops process 16 bytes at a time with unaligned loads. The scalar
+loops handle the remaining elements (all of them on other platforms).
+*/
+
+// Sign-extends (isSigned) or zero-extends count 32-bit values.
+static void
+Widen32(
+    _Out_writes_(count) INT64* pDest,
+    _In_reads_bytes_(count * 4) void const UNALIGNED* pData,
+    UINT32 count,
+    bool isSigned) noexcept
+{
+    auto const pb = static_cast<BYTE const*>(pData);
+    UINT32 i = 0;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    for (; count - i >= 4; i += 4)
+    {
+        __m128i const values = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pb + i * 4));
+        __m128i const high = isSigned ? _mm_srai_epi32(values, 31) : _mm_setzero_si128();
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pDest + i), _mm_unpacklo_epi32(values, high));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pDest + i + 2), _mm_unpackhi_epi32(values, high));
+    }
+#endif // SSE2
+
+    for (; i != count; i += 1)
+    {
+        UINT32 value;
+        memcpy(&value, pb + i * 4, 4);
+        pDest[i] = isSigned ? static_cast<INT64>(static_cast<INT32>(value)) : static_cast<INT64>(value);
+    }
+}
+
+// Sum of count sign-extended (isSigned) or zero-extended 32-bit values.
+static UINT64
+Sum32(
+    _In_reads_bytes_(count * 4) void const UNALIGNED* pData,
+    UINT32 count,
+    bool isSigned) noexcept
+{
+    auto const pb = static_cast<BYTE const*>(pData);
+    UINT64 sum = 0;
+    UINT32 i = 0;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    __m128i sums = _mm_setzero_si128(); // 2 lanes.
+    for (; count - i >= 4; i += 4)
+    {
+        __m128i const values = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pb + i * 4));
+        __m128i const high = isSigned ? _mm_srai_epi32(values, 31) : _mm_setzero_si128();
+        sums = _mm_add_epi64(sums, _mm_unpacklo_epi32(values, high));
+        sums = _mm_add_epi64(sums, _mm_unpackhi_epi32(values, high));
+    }
+
+    UINT64 lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), sums);
+    sum = lanes[0] + lanes[1];
+#endif // SSE2
+
+    for (; i != count; i += 1)
+    {
+        UINT32 value;
+        memcpy(&value, pb + i * 4, 4);
+        sum += isSigned ? static_cast<UINT64>(static_cast<INT64>(static_cast<INT32>(value))) : value;
+    }
+
+    return sum;
+}
+
+// Sum of count 64-bit values, wrapping modulo 2^64.
+static UINT64
+Sum64(
+    _In_reads_bytes_(count * 8) void const UNALIGNED* pData,
+    UINT32 count) noexcept
+{
+    auto const pb = static_cast<BYTE const*>(pData);
+    UINT64 sum = 0;
+    UINT32 i = 0;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    __m128i sums0 = _mm_setzero_si128();
+    __m128i sums1 = _mm_setzero_si128();
+    for (; count - i >= 4; i += 4)
+    {
+        sums0 = _mm_add_epi64(sums0, _mm_loadu_si128(reinterpret_cast<__m128i const*>(pb + i * 8)));
+        sums1 = _mm_add_epi64(sums1, _mm_loadu_si128(reinterpret_cast<__m128i const*>(pb + i * 8 + 16)));
+    }
+
+    UINT64 lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), _mm_add_epi64(sums0, sums1));
+    sum = lanes[0] + lanes[1];
+#endif // SSE2
+
+    for (; i != count; i += 1)
+    {
+        UINT64 value;
+        memcpy(&value, pb + i * 8, 8);
+        sum += value;
+    }
+
+    return sum;
+}
+
+/*
+Smallest and largest of count 32-bit values, count != 0. Unsigned values are
+compared as signed values after flipping the sign bit (SSE2 has only signed
+32-bit comparisons).
+*/
+static void
+MinMax32(
+    _In_reads_bytes_(count * 4) void const UNALIGNED* pData,
+    UINT32 count,
+    bool isSigned,
+    _Out_ UINT32* pMin,
+    _Out_ UINT32* pMax) noexcept
+{
+    ASSERT(count != 0); // PRECONDITION
+
+    auto const pb = static_cast<BYTE const*>(pData);
+    UINT32 const bias = isSigned ? 0u : 0x80000000u;
+    UINT32 first;
+    memcpy(&first, pb, 4);
+    INT32 lo = static_cast<INT32>(first ^ bias);
+    INT32 hi = lo;
+    UINT32 i = 1;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    if (count >= 4)
+    {
+        __m128i const biases = _mm_set1_epi32(static_cast<int>(bias));
+        __m128i los = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<__m128i const*>(pb)), biases);
+        __m128i his = los;
+        for (i = 4; count - i >= 4; i += 4)
+        {
+            __m128i const values = _mm_xor_si128(
+                _mm_loadu_si128(reinterpret_cast<__m128i const*>(pb + i * 4)), biases);
+            __m128i const below = _mm_cmplt_epi32(values, los);
+            __m128i const above = _mm_cmpgt_epi32(values, his);
+            los = _mm_or_si128(_mm_and_si128(below, values), _mm_andnot_si128(below, los));
+            his = _mm_or_si128(_mm_and_si128(above, values), _mm_andnot_si128(above, his));
+        }
+
+        INT32 laneLos[4];
+        INT32 laneHis[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(laneLos), los);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(laneHis), his);
+        for (unsigned lane = 0; lane != 4; lane += 1)
+        {
+            lo = laneLos[lane] < lo ? laneLos[lane] : lo;
+            hi = laneHis[lane] > hi ? laneHis[lane] : hi;
+        }
+    }
+#endif // SSE2
+
+    for (; i != count; i += 1)
+    {
+        UINT32 value;
+        memcpy(&value, pb + i * 4, 4);
+        INT32 const biased = static_cast<INT32>(value ^ bias);
+        lo = biased < lo ? biased : lo;
+        hi = biased > hi ? biased : hi;
+    }
+
+    *pMin = static_cast<UINT32>(lo) ^ bias;
+    *pMax = static_cast<UINT32>(hi) ^ bias;
+}
+
+namespace EtwInternal
+{
+    void
+    ArraySpanCopy(
+        _Out_writes_bytes_(cb) void* pDest,
+        _In_reads_bytes_(cb) void const UNALIGNED* pData,
+        UINT32 cb) noexcept
+    {
+        auto const pbDest = static_cast<BYTE*>(pDest);
+        auto const pbData = static_cast<BYTE const*>(pData);
+        UINT32 i = 0;
+
+#if defined(_M_IX86) || defined(_M_X64)
+        for (; cb - i >= 32; i += 32)
+        {
+            __m128i const chunk0 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pbData + i));
+            __m128i const chunk1 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pbData + i + 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(pbDest + i), chunk0);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(pbDest + i + 16), chunk1);
+        }
+#endif // SSE2
+
+        memcpy(pbDest + i, pbData + i, cb - i);
+    }
+
+    void
+    ArraySpanWiden(
+        _Out_writes_(count) INT64* pDest,
+        _In_reads_(count) INT32 const UNALIGNED* pData,
+        UINT32 count) noexcept
+    {
+        Widen32(pDest, pData, count, true);
+    }
+
+    void
+    ArraySpanWiden(
+        _Out_writes_(count) INT64* pDest,
+        _In_reads_(count) UINT32 const UNALIGNED* pData,
+        UINT32 count) noexcept
+    {
+        Widen32(pDest, pData, count, false);
+    }
+
+    UINT64
+    ArraySpanSum(
+        _In_reads_(count) INT32 const UNALIGNED* pData,
+        UINT32 count) noexcept
+    {
+        return Sum32(pData, count, true);
+    }
+
+    UINT64
+    ArraySpanSum(
+        _In_reads_(count) UINT32 const UNALIGNED* pData,
+        UINT32 count) noexcept
+    {
+        return Sum32(pData, count, false);
+    }
+
+    UINT64
+    ArraySpanSum(
+        _In_reads_(count) INT64 const UNALIGNED* pData,
+        UINT32 count) noexcept
+    {
+        return Sum64(pData, count);
+    }
+
+    UINT64
+    ArraySpanSum(
+        _In_reads_(count) UINT64 const UNALIGNED* pData,
+        UINT32 count) noexcept
+    {
+        return Sum64(pData, count);
+    }
+
+    void
+    ArraySpanMinMax(
+        _In_reads_(count) INT32 const UNALIGNED* pData,
+        UINT32 count,
+        _Out_ INT32* pMin,
+        _Out_ INT32* pMax) noexcept
+    {
+        UINT32 lo;
+        UINT32 hi;
+        MinMax32(pData, count, true, &lo, &hi);
+        *pMin = static_cast<INT32>(lo);
+        *pMax = static_cast<INT32>(hi);
+    }
+
+    void
+    ArraySpanMinMax(
+        _In_reads_(count) UINT32 const UNALIGNED* pData,
+        UINT32 count,
+        _Out_ UINT32* pMin,
+        _Out_ UINT32* pMax) noexcept
+    {
+        MinMax32(pData, count, false, pMin, pMax);
+    }
+}
+// namespace EtwInternal
@@ -0,0 +1,1574 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "stdafx.h"
+#include <EtwEnumerator.h>
+#include "EtwBuffer.inl"
+#include "EtwUtility.inl"
+
+/*
+Implementation of EtwArrowWriter (Apache Arrow IPC streams and files).
+This code is in a separate file so that users who don't write Arrow streams
+don't need to link it.
+
+Arrow IPC messages are a flatbuffer (the message metadata) followed by the
+message body. The flatbuffers are small, so they are written directly
+(front-to-back, patching offsets as the referenced objects are written)
+instead of depending on the flatbuffers library. Refer to Message.fbs,
+Schema.fbs, and File.fbs in the Arrow format specification for the tables
+used here.
+*/
+
+using EtwInternal::HashBytes;
+using EtwInternal::UnixEpochFileTime;
+using EtwInternal::WriteUtf16AsUtf8;
+
+static unsigned const NoEntry = ~0u;
+static char const ArrowMagic[8] = "ARROW1"; // Padded to 8 bytes at the start of a file.
+
+// Arrow flatbuffer enumeration values.
+static USHORT const ArrowMetadataVersionV5 = 4;
+static UCHAR const ArrowMessageHeaderSchema = 1;
+static UCHAR const ArrowMessageHeaderDictionaryBatch = 2;
+static UCHAR const ArrowMessageHeaderRecordBatch = 3;
+static USHORT const ArrowPrecisionSingle = 1;
+static USHORT const ArrowPrecisionDouble = 2;
+static USHORT const ArrowTimeUnitNanosecond = 3;
+
+// Values of the Arrow Type union.
+enum ArrowTypeId : UCHAR
+{
+    ArrowType_Null = 1,
+    ArrowType_Int = 2,
+    ArrowType_FloatingPoint = 3,
+    ArrowType_Binary = 4,
+    ArrowType_Utf8 = 5,
+    ArrowType_Bool = 6,
+    ArrowType_Timestamp = 10,
+    ArrowType_List = 12,
+    ArrowType_Struct = 13,
+    ArrowType_FixedSizeBinary = 15,
+};
+
+struct ArrowType
+{
+    ArrowTypeId Id;
+    UCHAR ByteWidth; // Int, FloatingPoint, FixedSizeBinary.
+    bool IsSigned;   // Int.
+};
+
+// A scalar or offset field of a flatbuffer table. Size 0 = field not present.
+struct FbField
+{
+    UCHAR Size;
+    UINT64 Value;
+};
+
+// Returns the type of the column's values (the list elements, for a list column).
+static ArrowType
+GetArrowType(
+    EtwColumnInfo const& column,
+    unsigned columnIndex) noexcept
+{
+    if (columnIndex == 0)
+    {
+        return { ArrowType_Timestamp, 8, true }; // TimeStamp
+    }
+    else if (columnIndex < EtwColumnBatch::HeaderColumnCount - 1)
+    {
+        return { ArrowType_Int, 4, false }; // ProcessId, ThreadId, ProcessorIndex
+    }
+
+    switch (column.Type)
+    {
+    case EtwColumnType_None:
+        return { ArrowType_Null, 0, false };
+
+    case EtwColumnType_Int64:
+        switch (column.InType)
+        {
+        case TDH_INTYPE_INT8:
+            return { ArrowType_Int, 1, true };
+        case TDH_INTYPE_INT16:
+            return { ArrowType_Int, 2, true };
+        case TDH_INTYPE_INT32:
+            return { ArrowType_Int, 4, true };
+        default:
+            return { ArrowType_Int, 8, true };
+        }
+
+    case EtwColumnType_UInt64:
+        switch (column.InType)
+        {
+        case TDH_INTYPE_BOOLEAN:
+            return { ArrowType_Bool, 0, false };
+        case TDH_INTYPE_FILETIME:
+            return { ArrowType_Timestamp, 8, true };
+        case TDH_INTYPE_UINT8:
+            return { ArrowType_Int, 1, false };
+        case TDH_INTYPE_UINT16:
+            return { ArrowType_Int, 2, false };
+        case TDH_INTYPE_UINT32:
+        case TDH_INTYPE_HEXINT32:
+            return { ArrowType_Int, 4, false };
+        default:
+            return { ArrowType_Int, 8, false };
+        }
+
+    case EtwColumnType_Double:
+        return { ArrowType_FloatingPoint, static_cast<UCHAR>(column.InType == TDH_INTYPE_FLOAT ? 4 : 8), true };
+
+    case EtwColumnType_Guid:
+        return { ArrowType_FixedSizeBinary, 16, false };
+
+    case EtwColumnType_String:
+        return { ArrowType_Utf8, 0, false };
+
+    default:
+        return { ArrowType_Binary, 0, false };
+    }
+}
+
+// Appends cb bytes to scratch. Returns the offset, or ~0u if out of memory.
+static unsigned
+ScratchAppend(
+    EtwInternal::Buffer<BYTE>& scratch,
+    UINT64 cb) noexcept
+{
+    auto const oldSize = scratch.size();
+    return oldSize + cb > 0x7FFFFFFF || !scratch.resize(static_cast<unsigned>(oldSize + cb))
+        ? ~0u
+        : oldSize;
+}
+
+// Returns the number of bits set in pBits[0..cBits).
+static UINT32
+CountBits(
+    _In_reads_bytes_((cBits + 7) / 8) BYTE const* pBits,
+    UINT32 cBits) noexcept
+{
+    UINT32 count = 0;
+    for (UINT32 i = 0; i != cBits / 8; i += 1)
+    {
+        unsigned x = pBits[i];
+        x = x - ((x >> 1) & 0x55);
+        x = (x & 0x33) + ((x >> 2) & 0x33);
+        count += (x + (x >> 4)) & 0x0F;
+    }
+
+    for (UINT32 i = cBits & ~7u; i != cBits; i += 1)
+    {
+        count += (pBits[i / 8] >> (i & 7)) & 1;
+    }
+
+    return count;
+}
+
+#pragma region Flatbuffer writer
+
+/*
+The Fb functions append to a buffer that has already been reserved with
+enough capacity for the whole message (they do not check for overflow).
+Positions are byte offsets from the start of the buffer. Offsets in a
+flatbuffer are relative to the position of the offset itself, so the
+buffer's alignment is the same as long as the flatbuffer starts at an
+8-byte-aligned position.
+*/
+
+static BYTE*
+FbAppend(
+    EtwInternal::Buffer<BYTE>& fb,
+    unsigned cb) noexcept
+{
+    auto const oldSize = fb.size();
+    ASSERT(cb <= fb.capacity() - oldSize);
+    fb.resize_unchecked(oldSize + cb);
+    return fb.data() + oldSize;
+}
+
+// Appends zeros until (size + bias) is a multiple of alignment.
+static void
+FbPad(
+    EtwInternal::Buffer<BYTE>& fb,
+    unsigned alignment,
+    unsigned bias = 0) noexcept
+{
+    unsigned const cbPad = (alignment - ((fb.size() + bias) & (alignment - 1))) & (alignment - 1);
+    memset(FbAppend(fb, cbPad), 0, cbPad);
+}
+
+// Sets the offset at fieldPos to refer to targetPos.
+static void
+FbPatch(
+    EtwInternal::Buffer<BYTE>& fb,
+    unsigned fieldPos,
+    unsigned targetPos) noexcept
+{
+    ASSERT(fieldPos < targetPos);
+    UINT32 const offset = targetPos - fieldPos;
+    memcpy(fb.data() + fieldPos, &offset, sizeof(offset));
+}
+
+/*
+Appends a table with the specified fields (field i has vtable slot i).
+Offset fields should be written as 4-byte zeros and patched later with
+FbPatch. If pFieldPos is not null, pFieldPos[i] receives the position of
+field i. Returns the position of the table.
+*/
+static unsigned
+FbTable(
+    EtwInternal::Buffer<BYTE>& fb,
+    _In_reads_(fieldCount) FbField const* pFields,
+    unsigned fieldCount,
+    _Out_writes_opt_(fieldCount) unsigned* pFieldPos) noexcept
+{
+    FbPad(fb, 2);
+    unsigned const vtablePos = fb.size();
+    unsigned const cbVtable = 4 + fieldCount * 2;
+    memset(FbAppend(fb, cbVtable), 0, cbVtable);
+
+    FbPad(fb, 4);
+    unsigned const tablePos = fb.size();
+    INT32 const vtableOffset = static_cast<INT32>(tablePos - vtablePos);
+    memcpy(FbAppend(fb, 4), &vtableOffset, 4);
+
+    USHORT vtable[2 + 8];
+    ASSERT(fieldCount <= 8);
+    for (unsigned i = 0; i != fieldCount; i += 1)
+    {
+        unsigned const cb = pFields[i].Size;
+        if (cb == 0)
+        {
+            vtable[2 + i] = 0;
+        }
+        else
+        {
+            FbPad(fb, cb);
+            unsigned const fieldPos = fb.size();
+            memcpy(FbAppend(fb, cb), &pFields[i].Value, cb); // Little-endian.
+            vtable[2 + i] = static_cast<USHORT>(fieldPos - tablePos);
+            if (pFieldPos)
+            {
+                pFieldPos[i] = fieldPos;
+            }
+        }
+    }
+
+    vtable[0] = static_cast<USHORT>(cbVtable);
+    vtable[1] = static_cast<USHORT>(fb.size() - tablePos);
+    memcpy(fb.data() + vtablePos, vtable, cbVtable);
+    return tablePos;
+}
+
+/*
+Appends a vector of count elements. If pElements is null, the elements are
+zeroed (e.g. a vector of offsets to be patched). Returns the position of the
+vector.
+*/
+static unsigned
+FbVector(
+    EtwInternal::Buffer<BYTE>& fb,
+    _In_reads_bytes_opt_(count * cbElement) void const* pElements,
+    unsigned count,
+    unsigned cbElement) noexcept
+{
+    FbPad(fb, 4);
+    FbPad(fb, cbElement < 8 ? 4 : 8, 4);
+    unsigned const vectorPos = fb.size();
+    memcpy(FbAppend(fb, 4), &count, 4);
+
+    auto const pb = FbAppend(fb, count * cbElement);
+    if (pElements)
+    {
+        memcpy(pb, pElements, count * cbElement);
+    }
+    else
+    {
+        memset(pb, 0, count * cbElement);
+    }
+
+    return vectorPos;
+}
+
+// Appends a string. Returns the position of the string.
+static unsigned
+FbString(
+    EtwInternal::Buffer<BYTE>& fb,
+    _In_reads_(cch) char const* pch,
+    unsigned cch) noexcept
+{
+    FbPad(fb, 4);
+    unsigned const stringPos = fb.size();
+    memcpy(FbAppend(fb, 4), &cch, 4);
+    memcpy(FbAppend(fb, cch), pch, cch);
+    *FbAppend(fb, 1) = 0;
+    return stringPos;
+}
+
+// Appends a string, converted from UTF-16 to UTF-8. Needs cch * 3 + 8 bytes.
+static unsigned
+FbStringUtf16(
+    EtwInternal::Buffer<BYTE>& fb,
+    EtwPCWSTR sz) noexcept
+{
+    unsigned const cch = static_cast<unsigned>(wcslen(sz));
+    FbPad(fb, 4);
+    unsigned const stringPos = fb.size();
+    auto const pbStart = FbAppend(fb, 4) + 4;
+    ASSERT(cch * 3 + 1 <= fb.capacity() - fb.size());
+    auto const pbEnd = WriteUtf16AsUtf8(pbStart, sz, cch);
+    *pbEnd = 0;
+    UINT32 const cb = static_cast<UINT32>(pbEnd - pbStart);
+    memcpy(fb.data() + stringPos, &cb, 4);
+    fb.resize_unchecked(stringPos + 4 + cb + 1);
+    return stringPos;
+}
+
+/*
+Prepares fb for an Arrow IPC message: reserves cbCapacity bytes, writes a
+placeholder for the 8-byte message prefix, and writes a placeholder for the
+flatbuffer's root offset. Returns false if out of memory.
+*/
+static bool
+FbBeginMessage(
+    EtwInternal::Buffer<BYTE>& fb,
+    unsigned cbCapacity) noexcept
+{
+    fb.clear();
+    if (!fb.reserve(cbCapacity))
+    {
+        return false;
+    }
+
+    memset(FbAppend(fb, 12), 0, 12);
+    return true;
+}
+
+/*
+Appends the Message table and finishes the message prefix. Returns the
+position of the header offset field, which the caller patches after
+writing the header table.
+*/
+static unsigned
+FbMessageTable(
+    EtwInternal::Buffer<BYTE>& fb,
+    UCHAR headerType,
+    UINT64 bodyLength) noexcept
+{
+    FbField const fields[] = {
+        { 2, ArrowMetadataVersionV5 }, // version
+        { 1, headerType },             // header_type
+        { 4, 0 },                      // header
+        { 8, bodyLength },             // bodyLength
+    };
+    unsigned fieldPos[_countof(fields)];
+    auto const messagePos = FbTable(fb, fields, _countof(fields), fieldPos);
+    FbPatch(fb, 8, messagePos); // Root offset.
+    return fieldPos[2];
+}
+
+// Pads the flatbuffer to a multiple of 8 bytes and fills in the prefix.
+static void
+FbEndMessage(
+    EtwInternal::Buffer<BYTE>& fb) noexcept
+{
+    FbPad(fb, 8);
+    UINT32 const prefix[2] = { 0xFFFFFFFF, fb.size() - 8 }; // Continuation, metadata size.
+    memcpy(fb.data(), prefix, sizeof(prefix));
+}
+
+// Appends the type table for the Type union. Returns its position.
+static unsigned
+FbTypeTable(
+    EtwInternal::Buffer<BYTE>& fb,
+    ArrowType type) noexcept
+{
+    unsigned typePos;
+    switch (type.Id)
+    {
+    case ArrowType_Int:
+    {
+        FbField const intFields[] = {
+            { 4, type.ByteWidth * 8u }, // bitWidth
+            { 1, type.IsSigned },       // is_signed
+        };
+        typePos = FbTable(fb, intFields, _countof(intFields), nullptr);
+        break;
+    }
+    case ArrowType_FloatingPoint:
+    {
+        FbField const floatFields[] = {
+            { 2, type.ByteWidth == 4 ? ArrowPrecisionSingle : ArrowPrecisionDouble }, // precision
+        };
+        typePos = FbTable(fb, floatFields, _countof(floatFields), nullptr);
+        break;
+    }
+    case ArrowType_FixedSizeBinary:
+    {
+        FbField const binaryFields[] = {
+            { 4, type.ByteWidth }, // byteWidth
+        };
+        typePos = FbTable(fb, binaryFields, _countof(binaryFields), nullptr);
+        break;
+    }
+    case ArrowType_Timestamp:
+    {
+        FbField const timestampFields[] = {
+            { 2, ArrowTimeUnitNanosecond }, // unit
+            { 4, 0 },                       // timezone
+        };
+        unsigned timestampFieldPos[_countof(timestampFields)];
+        typePos = FbTable(fb, timestampFields, _countof(timestampFields), timestampFieldPos);
+        FbPatch(fb, timestampFieldPos[1], FbString(fb, "UTC", 3));
+        break;
+    }
+    default:
+        typePos = FbTable(fb, nullptr, 0, nullptr); // Null, Bool, Utf8, Binary, List, Struct.
+        break;
+    }
+
+    return typePos;
+}
+
+/*
+Appends a Field table and its type. If isDictionary is true, the field is
+dictionary-encoded with int32 indexes. The caller patches the name and
+children offsets at *pNamePos and *pChildrenPos. Returns the position of
+the Field table.
+*/
+static unsigned
+FbFieldTable(
+    EtwInternal::Buffer<BYTE>& fb,
+    ArrowType type,
+    bool isDictionary,
+    UINT64 dictionaryId,
+    _Out_ unsigned* pNamePos,
+    _Out_ unsigned* pChildrenPos) noexcept
+{
+    FbField const fieldFields[] = {
+        { 4, 0 },                                         // name
+        { 1, 1 },                                         // nullable
+        { 1, type.Id },                                   // type_type
+        { 4, 0 },                                         // type
+        { static_cast<UCHAR>(isDictionary ? 4 : 0), 0 }, // dictionary
+        { 4, 0 },                                         // children
+    };
+    unsigned fieldFieldPos[_countof(fieldFields)];
+    auto const fieldPos = FbTable(fb, fieldFields, _countof(fieldFields), fieldFieldPos);
+    FbPatch(fb, fieldFieldPos[3], FbTypeTable(fb, type));
+
+    if (isDictionary)
+    {
+        FbField const encodingFields[] = {
+            { 8, dictionaryId }, // id
+            { 4, 0 },            // indexType
+            { 1, 0 },            // isOrdered
+        };
+        unsigned encodingFieldPos[_countof(encodingFields)];
+        FbPatch(fb, fieldFieldPos[4], FbTable(fb, encodingFields, _countof(encodingFields), encodingFieldPos));
+        FbPatch(fb, encodingFieldPos[1], FbTypeTable(fb, { ArrowType_Int, 4, true }));
+    }
+
+    *pNamePos = fieldFieldPos[0];
+    *pChildrenPos = fieldFieldPos[5];
+    return fieldPos;
+}
+
+#pragma endregion
+
+#pragma region EtwArrowWriter
+
+EtwArrowWriter::EtwArrowWriter() noexcept
+    : m_fields()
+    , m_metadata()
+    , m_schema()
+    , m_scratch()
+    , m_buffers()
+    , m_nodes()
+    , m_indexes()
+    , m_dictionaryBlocks()
+    , m_recordBatchBlocks()
+    , m_dictionary()
+    , m_dictionaryEntries()
+    , m_dictionaryBuckets()
+    , m_filePos(0)
+    , m_schemaBegin(0)
+    , m_schemaPos(0)
+    , m_columnCount(0)
+    , m_topLevelFieldCount(0)
+    , m_format(EtwArrowFormat_Stream)
+{
+    return;
+}
+
+EtwArrowWriter::~EtwArrowWriter() noexcept
+{
+    return;
+}
+
+LSTATUS
+EtwArrowWriter::Begin(
+    EtwColumnBatch const& batch,
+    unsigned tableIndex,
+    EtwArrowFormat format,
+    EtwOutputSink& sink) noexcept
+{
+    ASSERT(tableIndex < batch.TableCount()); // PRECONDITION
+
+    LSTATUS status;
+    auto const tableInfo = batch.GetTableInfo(tableIndex);
+    auto& fb = m_schema;
+
+    m_fields.clear();
+    m_dictionaryBlocks.clear();
+    m_recordBatchBlocks.clear();
+    m_dictionary.clear();
+    m_dictionaryEntries.clear();
+    m_filePos = 0;
+    m_columnCount = tableInfo.ColumnCount;
+    m_format = format;
+
+    status = AddFields(batch, tableIndex, EtwColumnBatch::NoStruct, false,
+        0, tableInfo.ColumnCount, &m_topLevelFieldCount);
+    if (status != ERROR_SUCCESS)
+    {
+        goto Done;
+    }
+
+    {
+        // Upper bound on the message size: fixed overhead per field (a list
+        // field has a child field, and a dictionary field has an encoding),
+        // plus up to 3 bytes of UTF-8 per UTF-16 code unit of names.
+        UINT64 cbCapacity = 512 + 3 * UINT64(wcslen(tableInfo.ProviderName) + wcslen(tableInfo.EventName));
+        for (auto const& field : m_fields)
+        {
+            cbCapacity += 512 + 3 * UINT64(wcslen(field.TypeId == ArrowType_Struct
+                ? batch.GetStructInfo(tableIndex, field.Column).Name
+                : batch.GetColumnInfo(tableIndex, field.Column).MemberName));
+        }
+
+        if (cbCapacity > 0x7FFFFFFF ||
+            !FbBeginMessage(fb, static_cast<unsigned>(cbCapacity)))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+    }
+
+    {
+        auto const headerFieldPos = FbMessageTable(fb, ArrowMessageHeaderSchema, 0);
+
+        FbField const schemaFields[] = {
+            { 2, 0 }, // endianness = Little
+            { 4, 0 }, // fields
+            { 4, 0 }, // custom_metadata
+        };
+        unsigned schemaFieldPos[_countof(schemaFields)];
+        m_schemaBegin = fb.size();
+        m_schemaPos = FbTable(fb, schemaFields, _countof(schemaFields), schemaFieldPos);
+        FbPatch(fb, headerFieldPos, m_schemaPos);
+
+        auto const fieldsPos = FbVector(fb, nullptr, m_topLevelFieldCount, 4);
+        FbPatch(fb, schemaFieldPos[1], fieldsPos);
+        WriteSchemaFields(batch, tableIndex, 0, m_topLevelFieldCount, fieldsPos);
+
+        EtwPCWSTR const metadata[][2] = {
+            { L"ProviderName", tableInfo.ProviderName },
+            { L"EventName", tableInfo.EventName },
+        };
+        auto const metadataPos = FbVector(fb, nullptr, _countof(metadata), 4);
+        FbPatch(fb, schemaFieldPos[2], metadataPos);
+        for (unsigned i = 0; i != _countof(metadata); i += 1)
+        {
+            FbField const keyValueFields[] = {
+                { 4, 0 }, // key
+                { 4, 0 }, // value
+            };
+            unsigned keyValueFieldPos[_countof(keyValueFields)];
+            FbPatch(fb, metadataPos + 4 + i * 4, FbTable(fb, keyValueFields, _countof(keyValueFields), keyValueFieldPos));
+            FbPatch(fb, keyValueFieldPos[0], FbStringUtf16(fb, metadata[i][0]));
+            FbPatch(fb, keyValueFieldPos[1], FbStringUtf16(fb, metadata[i][1]));
+        }
+
+        FbEndMessage(fb);
+    }
+
+    if (format == EtwArrowFormat_File)
+    {
+        status = WriteToSink(ArrowMagic, sizeof(ArrowMagic), sink);
+        if (status != ERROR_SUCCESS)
+        {
+            goto Done;
+        }
+    }
+
+    status = WriteToSink(fb.data(), fb.size(), sink);
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwArrowWriter::WriteRecordBatch(
+    EtwColumnBatch const& batch,
+    unsigned tableIndex,
+    EtwOutputSink& sink) noexcept
+{
+    ASSERT(tableIndex < batch.TableCount()); // PRECONDITION
+    ASSERT(batch.GetTableInfo(tableIndex).ColumnCount == m_columnCount); // PRECONDITION
+
+    LSTATUS status = ERROR_SUCCESS;
+    auto const tableInfo = batch.GetTableInfo(tableIndex);
+    UINT32 const rows = tableInfo.RowCount;
+    unsigned const firstNewEntry = m_dictionaryEntries.size();
+    unsigned indexesPos = 0;
+    unsigned fieldEnd;
+
+    // Look up the values of the dictionary fields first, so that the new
+    // dictionary values can be written before the record batch.
+    m_indexes.clear();
+    for (unsigned i = 0; i != m_fields.size(); i += 1)
+    {
+        if (m_fields[i].IsDictionary)
+        {
+            status = AddDictionaryIndexes(batch.GetColumnInfo(tableIndex, m_fields[i].Column), i);
+            if (status != ERROR_SUCCESS)
+            {
+                goto Done;
+            }
+        }
+    }
+
+    for (unsigned i = 0; i != m_fields.size(); i += 1)
+    {
+        if (m_fields[i].IsDictionary)
+        {
+            status = WriteDictionaryBatch(i, firstNewEntry, sink);
+            if (status != ERROR_SUCCESS)
+            {
+                goto Done;
+            }
+        }
+    }
+
+    m_scratch.clear();
+    m_buffers.clear();
+    m_nodes.clear();
+
+    if (!m_nodes.reserve(m_fields.size() * 2) ||
+        !m_buffers.reserve(m_fields.size() * 5))
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto Done;
+    }
+
+    status = AddFieldArrays(batch, tableIndex, 0, m_topLevelFieldCount, rows, &indexesPos, &fieldEnd);
+    if (status != ERROR_SUCCESS)
+    {
+        goto Done;
+    }
+
+    ASSERT(fieldEnd == m_fields.size());
+    status = WriteBatch(rows, NoDictionary, false, sink);
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwArrowWriter::End(
+    EtwOutputSink& sink) noexcept
+{
+    static UINT32 const EndOfStream[2] = { 0xFFFFFFFF, 0 };
+    LSTATUS status = WriteToSink(EndOfStream, sizeof(EndOfStream), sink);
+    if (status == ERROR_SUCCESS && m_format == EtwArrowFormat_File)
+    {
+        // Footer: Footer flatbuffer, its size, magic.
+        auto& fb = m_metadata;
+        unsigned const cbSchema = m_schema.size() - m_schemaBegin;
+        fb.clear();
+        if (!fb.reserve(256 + (m_dictionaryBlocks.size() + m_recordBatchBlocks.size()) * sizeof(Block) + cbSchema))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        memset(FbAppend(fb, 4), 0, 4); // Root offset.
+
+        FbField const footerFields[] = {
+            { 2, ArrowMetadataVersionV5 }, // version
+            { 4, 0 },                      // schema
+            { 4, 0 },                      // dictionaries
+            { 4, 0 },                      // recordBatches
+        };
+        unsigned footerFieldPos[_countof(footerFields)];
+        FbPatch(fb, 0, FbTable(fb, footerFields, _countof(footerFields), footerFieldPos));
+        FbPatch(fb, footerFieldPos[2], FbVector(fb, m_dictionaryBlocks.data(), m_dictionaryBlocks.size(), sizeof(Block)));
+        FbPatch(fb, footerFieldPos[3], FbVector(fb, m_recordBatchBlocks.data(), m_recordBatchBlocks.size(), sizeof(Block)));
+
+        // Copy the Schema table (and everything it refers to) from the
+        // Schema message. Its offsets are relative, so only its alignment
+        // needs to be kept.
+        FbPad(fb, 8, 8 - (m_schemaBegin & 7));
+        unsigned const schemaBegin = fb.size();
+        memcpy(FbAppend(fb, cbSchema), m_schema.data() + m_schemaBegin, cbSchema);
+        FbPatch(fb, footerFieldPos[1], schemaBegin + (m_schemaPos - m_schemaBegin));
+
+        UINT32 const cbFooter = fb.size();
+        memcpy(FbAppend(fb, 4), &cbFooter, 4);
+        memcpy(FbAppend(fb, 6), ArrowMagic, 6);
+        status = WriteToSink(fb.data(), fb.size(), sink);
+    }
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwArrowWriter::AddFields(
+    EtwColumnBatch const& batch,
+    unsigned tableIndex,
+    unsigned parentStruct,
+    bool inArray,
+    unsigned firstColumn,
+    unsigned endColumn,
+    _Out_ unsigned* pFieldCount) noexcept
+{
+    LSTATUS status = ERROR_SUCCESS;
+    unsigned const structCount = batch.GetTableInfo(tableIndex).StructCount;
+    unsigned fieldCount = 0;
+    unsigned column = firstColumn;
+    unsigned structIndex = parentStruct == EtwColumnBatch::NoStruct ? 0 : parentStruct + 1;
+
+    // Columns that are direct members, interleaved with the child structs
+    // (which contain the other columns), in schema order.
+    for (;;)
+    {
+        EtwColumnStructInfo structInfo = {};
+        for (; structIndex != structCount; structIndex += 1)
+        {
+            structInfo = batch.GetStructInfo(tableIndex, structIndex);
+            if (structInfo.Parent == parentStruct)
+            {
+                break;
+            }
+        }
+
+        unsigned const leafEnd = structIndex == structCount ? endColumn : structInfo.FirstColumn;
+        for (; column != leafEnd; column += 1)
+        {
+            auto const columnInfo = batch.GetColumnInfo(tableIndex, column);
+            auto const type = GetArrowType(columnInfo, column);
+            Field field;
+            field.Column = column;
+            field.ChildCount = 0;
+            field.TypeId = type.Id;
+            field.ByteWidth = type.ByteWidth;
+            field.IsSigned = type.IsSigned;
+            field.IsList = columnInfo.ListOffsets != nullptr && !inArray;
+            field.IsDictionary = columnInfo.MapName != nullptr && type.Id == ArrowType_Utf8;
+            field.DictionaryWritten = false;
+            field.DictionarySize = 0;
+            if (!m_fields.push_back(field))
+            {
+                status = ERROR_OUTOFMEMORY;
+                goto Done;
+            }
+
+            fieldCount += 1;
+        }
+
+        if (structIndex == structCount)
+        {
+            break;
+        }
+
+        {
+            Field field = {};
+            field.Column = structIndex;
+            field.TypeId = ArrowType_Struct;
+            field.IsList = structInfo.IsArray;
+            unsigned const fieldIndex = m_fields.size();
+            if (!m_fields.push_back(field))
+            {
+                status = ERROR_OUTOFMEMORY;
+                goto Done;
+            }
+
+            unsigned childCount;
+            fieldCount += 1;
+            column = structInfo.FirstColumn + structInfo.ColumnCount;
+            status = AddFields(batch, tableIndex, structIndex, inArray || structInfo.IsArray,
+                structInfo.FirstColumn, column, &childCount);
+            if (status != ERROR_SUCCESS)
+            {
+                goto Done;
+            }
+
+            m_fields[fieldIndex].ChildCount = childCount; // m_fields may have moved.
+        }
+
+        structIndex += 1;
+    }
+
+Done:
+
+    *pFieldCount = fieldCount;
+    return status;
+}
+
+unsigned
+EtwArrowWriter::WriteSchemaFields(
+    EtwColumnBatch const& batch,
+    unsigned tableIndex,
+    unsigned fieldIndex,
+    unsigned fieldCount,
+    unsigned vectorPos) noexcept
+{
+    auto& fb = m_schema;
+    for (unsigned i = 0; i != fieldCount; i += 1)
+    {
+        unsigned const thisIndex = fieldIndex;
+        auto const& field = m_fields[thisIndex];
+        ArrowType const type = { static_cast<ArrowTypeId>(field.TypeId), field.ByteWidth, field.IsSigned };
+        EtwPCWSTR const szName = field.TypeId == ArrowType_Struct
+            ? batch.GetStructInfo(tableIndex, field.Column).Name
+            : batch.GetColumnInfo(tableIndex, field.Column).MemberName;
+        unsigned namePos;
+        unsigned childrenPos;
+
+        if (!field.IsList)
+        {
+            FbPatch(fb, vectorPos + 4 + i * 4, FbFieldTable(fb, type, field.IsDictionary, thisIndex, &namePos, &childrenPos));
+            FbPatch(fb, namePos, FbStringUtf16(fb, szName));
+        }
+        else
+        {
+            // List field with one child field, "item", for the elements.
+            FbPatch(fb, vectorPos + 4 + i * 4, FbFieldTable(fb, { ArrowType_List, 0, false }, false, 0, &namePos, &childrenPos));
+            FbPatch(fb, namePos, FbStringUtf16(fb, szName));
+
+            auto const childrenVectorPos = FbVector(fb, nullptr, 1, 4);
+            FbPatch(fb, childrenPos, childrenVectorPos);
+            FbPatch(fb, childrenVectorPos + 4, FbFieldTable(fb, type, field.IsDictionary, thisIndex, &namePos, &childrenPos));
+            FbPatch(fb, namePos, FbString(fb, "item", 4));
+        }
+
+        // A struct field's children are the fields that follow it.
+        auto const childrenVectorPos = FbVector(fb, nullptr, field.ChildCount, 4);
+        FbPatch(fb, childrenPos, childrenVectorPos);
+        fieldIndex = WriteSchemaFields(batch, tableIndex, thisIndex + 1, field.ChildCount, childrenVectorPos);
+    }
+
+    return fieldIndex;
+}
+
+LSTATUS
+EtwArrowWriter::AddFieldArrays(
+    EtwColumnBatch const& batch,
+    unsigned tableIndex,
+    unsigned fieldIndex,
+    unsigned fieldCount,
+    UINT32 length,
+    _Inout_ unsigned* pIndexesPos,
+    _Out_ unsigned* pFieldIndex) noexcept
+{
+    LSTATUS status = ERROR_SUCCESS;
+
+    for (unsigned i = 0; i != fieldCount; i += 1)
+    {
+        auto const& field = m_fields[fieldIndex];
+        UINT32 count = length;
+
+        if (field.TypeId == ArrowType_Struct)
+        {
+            auto const structInfo = batch.GetStructInfo(tableIndex, field.Column);
+            if (field.IsList)
+            {
+                // The list offsets and validity are the same in every list
+                // column of the struct. If there are none (every member is a
+                // None column), the lists are null.
+                UINT32 const* pListOffsets = nullptr;
+                BYTE const* pListValidity = nullptr;
+                for (unsigned c = 0; c != structInfo.ColumnCount; c += 1)
+                {
+                    auto const columnInfo = batch.GetColumnInfo(tableIndex, structInfo.FirstColumn + c);
+                    if (columnInfo.ListOffsets != nullptr)
+                    {
+                        pListOffsets = columnInfo.ListOffsets;
+                        pListValidity = columnInfo.ListValidity;
+                        break;
+                    }
+                }
+
+                status = AddListArray(pListOffsets, pListValidity, length, &count);
+                if (status != ERROR_SUCCESS)
+                {
+                    goto Done;
+                }
+            }
+
+            m_nodes.push_back({ count, 0 });
+            m_buffers.push_back({ nullptr, 0, 0 }); // No nulls, so no validity bitmap.
+            status = AddFieldArrays(batch, tableIndex, fieldIndex + 1, field.ChildCount, count, pIndexesPos, &fieldIndex);
+            if (status != ERROR_SUCCESS)
+            {
+                goto Done;
+            }
+
+            continue;
+        }
+
+        {
+            auto const columnInfo = batch.GetColumnInfo(tableIndex, field.Column);
+            INT32 const* pIndexes = nullptr;
+
+            if (field.IsList)
+            {
+                status = AddListArray(columnInfo.ListOffsets, columnInfo.ListValidity, length, &count);
+                if (status != ERROR_SUCCESS)
+                {
+                    goto Done;
+                }
+            }
+
+            // A None column has one value per row, even in an array of
+            // structs, but Arrow's null arrays don't have buffers, so it can
+            // take whatever length the struct needs.
+            if (columnInfo.Type != EtwColumnType_None &&
+                columnInfo.ValueCount != count)
+            {
+                status = ERROR_INVALID_DATA; // Lists of an array of structs don't line up.
+                goto Done;
+            }
+
+            if (field.IsDictionary)
+            {
+                pIndexes = m_indexes.data() + *pIndexesPos;
+                *pIndexesPos += columnInfo.ValueCount;
+            }
+
+            status = AddArray(columnInfo, field, count, pIndexes);
+            if (status != ERROR_SUCCESS)
+            {
+                goto Done;
+            }
+
+            fieldIndex += 1;
+        }
+    }
+
+Done:
+
+    *pFieldIndex = fieldIndex;
+    return status;
+}
+
+LSTATUS
+EtwArrowWriter::AddListArray(
+    _In_opt_ UINT32 const* pListOffsets,
+    _In_opt_ BYTE const* pListValidity,
+    UINT32 rows,
+    _Out_ UINT32* pValueCount) noexcept
+{
+    LSTATUS status = ERROR_SUCCESS;
+    UINT32 const cbListValidity = (rows + 7) / 8;
+    Node node = { rows, rows };
+    BodyBuffer validity = { pListValidity, 0, cbListValidity };
+    BodyBuffer offsets;
+    UINT32 valueCount = 0;
+
+    if (rows == 0 || pListOffsets == nullptr)
+    {
+        // Null lists: zero offsets (Arrow expects one offset even if there
+        // are no rows) and a zero validity bitmap.
+        auto const offsetsOffset = ScratchAppend(m_scratch, (UINT64(rows) + 1) * 4);
+        auto const validityOffset = ScratchAppend(m_scratch, cbListValidity);
+        if (offsetsOffset == ~0u || validityOffset == ~0u)
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        memset(m_scratch.data() + offsetsOffset, 0, (rows + 1) * 4);
+        memset(m_scratch.data() + validityOffset, 0, cbListValidity);
+        offsets = { nullptr, offsetsOffset, (rows + 1) * 4 };
+        validity = { nullptr, validityOffset, cbListValidity };
+    }
+    else if (pListOffsets[rows] > 0x7FFFFFFF)
+    {
+        status = ERROR_ARITHMETIC_OVERFLOW;
+        goto Done;
+    }
+    else
+    {
+        node.NullCount = rows - CountBits(pListValidity, rows);
+        offsets = { reinterpret_cast<BYTE const*>(pListOffsets), 0, (rows + 1) * 4 };
+        valueCount = pListOffsets[rows];
+    }
+
+    if (node.NullCount == 0)
+    {
+        validity.cbData = 0; // Arrow allows omitting the bitmap.
+    }
+
+    // The list array, followed (by the caller) by the array of all of the
+    // elements.
+    m_nodes.push_back(node);
+    m_buffers.push_back(validity);
+    m_buffers.push_back(offsets);
+
+Done:
+
+    *pValueCount = valueCount;
+    return status;
+}
+
+LSTATUS
+EtwArrowWriter::AddDictionaryIndexes(
+    EtwColumnInfo const& columnInfo,
+    unsigned fieldIndex) noexcept
+{
+    LSTATUS status = ERROR_SUCCESS;
+    UINT32 const count = columnInfo.ValueCount;
+    auto const oldSize = m_indexes.size();
+
+    if (!m_indexes.resize(oldSize + count))
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto Done;
+    }
+
+    for (UINT32 i = 0; i != count; i += 1)
+    {
+        unsigned index = 0; // Null values use index 0.
+        if ((columnInfo.Validity[i / 8] >> (i & 7)) & 1)
+        {
+            UINT32 const cch = (columnInfo.Offsets[i + 1] - columnInfo.Offsets[i]) / 2;
+            m_scratch.clear();
+            if (UINT64(cch) * 3 > 0x7FFFFFFF ||
+                !m_scratch.resize(cch * 3))
+            {
+                status = ERROR_OUTOFMEMORY;
+                goto Done;
+            }
+
+            auto const pbEnd = WriteUtf16AsUtf8(
+                m_scratch.data(),
+                reinterpret_cast<EtwWCHAR const*>(static_cast<BYTE const*>(columnInfo.Values) + columnInfo.Offsets[i]),
+                cch);
+            if (!AddDictionaryValue(fieldIndex, m_scratch.data(), static_cast<unsigned>(pbEnd - m_scratch.data()), &index))
+            {
+                status = ERROR_OUTOFMEMORY;
+                goto Done;
+            }
+        }
+
+        m_indexes[oldSize + i] = static_cast<INT32>(index);
+    }
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwArrowWriter::AddArray(
+    EtwColumnInfo const& columnInfo,
+    Field const& field,
+    UINT32 count,
+    _In_opt_ INT32 const* pIndexes) noexcept
+{
+    LSTATUS status = ERROR_SUCCESS;
+    UINT32 const cbValidity = (count + 7) / 8;
+    ArrowType const type = { static_cast<ArrowTypeId>(field.TypeId), field.ByteWidth, field.IsSigned };
+    Node node = { count, count };
+    BodyBuffer validity = { columnInfo.Validity, 0, cbValidity };
+    BodyBuffer values = { static_cast<BYTE const*>(columnInfo.Values), 0, 0 };
+    BodyBuffer offsets = {};
+
+    if (type.Id == ArrowType_Null)
+    {
+        m_nodes.push_back(node); // No buffers.
+        goto Done;
+    }
+
+    node.NullCount = count - (count == 0 ? 0 : CountBits(columnInfo.Validity, count));
+
+    // Convert the values. Fixed-size 64-bit values, GUIDs, binary heaps, and
+    // validity bitmaps are written as-is. Everything else goes to scratch.
+    if (field.IsDictionary)
+    {
+        values = { reinterpret_cast<BYTE const*>(pIndexes), 0, count * 4 };
+    }
+    else switch (type.Id)
+    {
+    case ArrowType_Timestamp:
+    {
+        // FILETIME to nanoseconds since 1970. Out-of-range values are null,
+        // so the timestamp column gets its own copy of the validity bitmap.
+        auto const validityOffset = ScratchAppend(m_scratch, cbValidity);
+        auto const valuesOffset = ScratchAppend(m_scratch, UINT64(count) * 8);
+        if (validityOffset == ~0u || valuesOffset == ~0u)
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        auto const pValidity = m_scratch.data() + validityOffset;
+        auto const pValues = m_scratch.data() + valuesOffset;
+        if (count != 0)
+        {
+            memcpy(pValidity, columnInfo.Validity, cbValidity);
+        }
+
+        for (UINT32 i = 0; i != count; i += 1)
+        {
+            UINT64 fileTime;
+            INT64 nanoseconds = 0;
+            memcpy(&fileTime, static_cast<BYTE const*>(columnInfo.Values) + i * 8, 8);
+            if ((pValidity[i / 8] >> (i & 7)) & 1)
+            {
+                INT64 const ticks = static_cast<INT64>(fileTime - UnixEpochFileTime);
+                if (fileTime > 0x7FFFFFFFFFFFFFFF ||
+                    ticks < -0x7FFFFFFFFFFFFFFF / 100 ||
+                    ticks > 0x7FFFFFFFFFFFFFFF / 100)
+                {
+                    pValidity[i / 8] &= static_cast<BYTE>(~(1u << (i & 7)));
+                    node.NullCount += 1;
+                }
+                else
+                {
+                    nanoseconds = ticks * 100;
+                }
+            }
+
+            memcpy(pValues + i * 8, &nanoseconds, 8);
+        }
+
+        validity = { nullptr, validityOffset, cbValidity };
+        values = { nullptr, valuesOffset, count * 8 };
+        break;
+    }
+
+    case ArrowType_Bool:
+    {
+        auto const valuesOffset = ScratchAppend(m_scratch, cbValidity);
+        if (valuesOffset == ~0u)
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        auto const pValues = m_scratch.data() + valuesOffset;
+        memset(pValues, 0, cbValidity);
+        for (UINT32 i = 0; i != count; i += 1)
+        {
+            UINT64 value;
+            memcpy(&value, static_cast<BYTE const*>(columnInfo.Values) + i * 8, 8);
+            pValues[i / 8] |= static_cast<BYTE>((value != 0) << (i & 7));
+        }
+
+        values = { nullptr, valuesOffset, cbValidity };
+        break;
+    }
+
+    case ArrowType_Int:
+    case ArrowType_FloatingPoint:
+        if (type.ByteWidth == 8)
+        {
+            values.cbData = count * 8;
+        }
+        else
+        {
+            // Narrow from the 64-bit column values.
+            auto const valuesOffset = ScratchAppend(m_scratch, UINT64(count) * type.ByteWidth);
+            if (valuesOffset == ~0u)
+            {
+                status = ERROR_OUTOFMEMORY;
+                goto Done;
+            }
+
+            auto const pValues = m_scratch.data() + valuesOffset;
+            for (UINT32 i = 0; i != count; i += 1)
+            {
+                auto const pValue = static_cast<BYTE const*>(columnInfo.Values) + i * 8;
+                if (type.Id == ArrowType_FloatingPoint)
+                {
+                    double value;
+                    memcpy(&value, pValue, 8);
+                    float const narrowValue = static_cast<float>(value);
+                    memcpy(pValues + i * 4, &narrowValue, 4);
+                }
+                else
+                {
+                    memcpy(pValues + i * type.ByteWidth, pValue, type.ByteWidth); // Little-endian.
+                }
+            }
+
+            values = { nullptr, valuesOffset, count * type.ByteWidth };
+        }
+        break;
+
+    case ArrowType_FixedSizeBinary:
+        values.cbData = count * type.ByteWidth;
+        break;
+
+    case ArrowType_Utf8:
+    {
+        auto const pOffsets = columnInfo.Offsets;
+        UINT32 const cchHeap = count == 0 ? 0 : pOffsets[count] / 2;
+        auto const offsetsOffset = ScratchAppend(m_scratch, (UINT64(count) + 1) * 4);
+        auto const valuesOffset = ScratchAppend(m_scratch, UINT64(cchHeap) * 3);
+        if (offsetsOffset == ~0u || valuesOffset == ~0u)
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        auto const pUtf8Offsets = reinterpret_cast<UINT32*>(m_scratch.data() + offsetsOffset);
+        auto const pbStart = m_scratch.data() + valuesOffset;
+        auto pb = pbStart;
+        pUtf8Offsets[0] = 0;
+        for (UINT32 i = 0; i != count; i += 1)
+        {
+            pb = WriteUtf16AsUtf8(
+                pb,
+                reinterpret_cast<EtwWCHAR const*>(static_cast<BYTE const*>(columnInfo.Values) + pOffsets[i]),
+                (pOffsets[i + 1] - pOffsets[i]) / 2);
+            pUtf8Offsets[i + 1] = static_cast<UINT32>(pb - pbStart);
+        }
+
+        UINT32 const cbUtf8 = static_cast<UINT32>(pb - pbStart);
+        if (cbUtf8 > 0x7FFFFFFF)
+        {
+            status = ERROR_ARITHMETIC_OVERFLOW;
+            goto Done;
+        }
+
+        m_scratch.resize_unchecked(valuesOffset + cbUtf8);
+        offsets = { nullptr, offsetsOffset, (count + 1) * 4 };
+        values = { nullptr, valuesOffset, cbUtf8 };
+        break;
+    }
+
+    default: // Binary
+        if (count == 0)
+        {
+            // Arrow expects one offset even if there are no values.
+            auto const offsetsOffset = ScratchAppend(m_scratch, 4);
+            if (offsetsOffset == ~0u)
+            {
+                status = ERROR_OUTOFMEMORY;
+                goto Done;
+            }
+
+            memset(m_scratch.data() + offsetsOffset, 0, 4);
+            offsets = { nullptr, offsetsOffset, 4 };
+        }
+        else if (columnInfo.Offsets[count] > 0x7FFFFFFF)
+        {
+            status = ERROR_ARITHMETIC_OVERFLOW;
+            goto Done;
+        }
+        else
+        {
+            offsets = { reinterpret_cast<BYTE const*>(columnInfo.Offsets), 0, (count + 1) * 4 };
+            values.cbData = columnInfo.Offsets[count];
+        }
+        break;
+    }
+
+    if (node.NullCount == 0)
+    {
+        validity.cbData = 0; // Arrow allows omitting the bitmap.
+    }
+
+    m_nodes.push_back(node);
+    m_buffers.push_back(validity);
+    if (!field.IsDictionary && (type.Id == ArrowType_Utf8 || type.Id == ArrowType_Binary))
+    {
+        m_buffers.push_back(offsets);
+    }
+
+    m_buffers.push_back(values);
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwArrowWriter::WriteDictionaryBatch(
+    unsigned fieldIndex,
+    unsigned firstEntry,
+    EtwOutputSink& sink) noexcept
+{
+    LSTATUS status = ERROR_SUCCESS;
+    auto& field = m_fields[fieldIndex];
+    UINT32 count = 0;
+    UINT64 cbValues = 0;
+    unsigned offsetsOffset;
+    unsigned valuesOffset;
+
+    for (unsigned i = firstEntry; i != m_dictionaryEntries.size(); i += 1)
+    {
+        if (m_dictionaryEntries[i].Field == fieldIndex)
+        {
+            count += 1;
+            cbValues += m_dictionaryEntries[i].Length;
+        }
+    }
+
+    if (count == 0 && field.DictionaryWritten)
+    {
+        goto Done; // No new values.
+    }
+
+    // A utf8 array of the new values.
+    m_scratch.clear();
+    m_buffers.clear();
+    m_nodes.clear();
+    offsetsOffset = ScratchAppend(m_scratch, (UINT64(count) + 1) * 4);
+    valuesOffset = ScratchAppend(m_scratch, cbValues);
+    if (offsetsOffset == ~0u || valuesOffset == ~0u ||
+        !m_nodes.reserve(1) ||
+        !m_buffers.reserve(3))
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto Done;
+    }
+
+    {
+        auto const pOffsets = reinterpret_cast<UINT32*>(m_scratch.data() + offsetsOffset);
+        UINT32 cb = 0;
+        UINT32 index = 0;
+        pOffsets[0] = 0;
+        for (unsigned i = firstEntry; i != m_dictionaryEntries.size(); i += 1)
+        {
+            auto const& entry = m_dictionaryEntries[i];
+            if (entry.Field == fieldIndex)
+            {
+                memcpy(m_scratch.data() + valuesOffset + cb, m_dictionary.data() + entry.Offset, entry.Length);
+                cb += entry.Length;
+                index += 1;
+                pOffsets[index] = cb;
+            }
+        }
+    }
+
+    m_nodes.push_back({ count, 0 });
+    m_buffers.push_back({ nullptr, 0, 0 }); // No nulls, so no validity bitmap.
+    m_buffers.push_back({ nullptr, offsetsOffset, (count + 1) * 4 });
+    m_buffers.push_back({ nullptr, valuesOffset, static_cast<UINT32>(cbValues) });
+
+    status = WriteBatch(count, fieldIndex, field.DictionaryWritten, sink);
+    field.DictionaryWritten = status == ERROR_SUCCESS;
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwArrowWriter::WriteBatch(
+    UINT64 length,
+    unsigned dictionaryId,
+    bool isDelta,
+    EtwOutputSink& sink) noexcept
+{
+    static BYTE const Padding[8] = {};
+    LSTATUS status;
+    auto& fb = m_metadata;
+    auto& blocks = dictionaryId == NoDictionary ? m_recordBatchBlocks : m_dictionaryBlocks;
+    UINT64 bodyLength = 0;
+    Block block;
+
+    // Metadata: Message, DictionaryBatch, RecordBatch, nodes, and buffers
+    // (offset + length).
+    if (!FbBeginMessage(fb, 320 + m_nodes.byte_size() + m_buffers.size() * 16) ||
+        (m_format == EtwArrowFormat_File && !blocks.reserve(blocks.size() + 1)))
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto Done;
+    }
+
+    for (auto const& buffer : m_buffers)
+    {
+        bodyLength += (buffer.cbData + 7u) & ~UINT64(7);
+    }
+
+    {
+        auto recordBatchFieldPos = FbMessageTable(fb,
+            dictionaryId == NoDictionary ? ArrowMessageHeaderRecordBatch : ArrowMessageHeaderDictionaryBatch,
+            bodyLength);
+
+        if (dictionaryId != NoDictionary)
+        {
+            FbField const dictionaryBatchFields[] = {
+                { 8, dictionaryId }, // id
+                { 4, 0 },            // data
+                { 1, isDelta },      // isDelta
+            };
+            unsigned dictionaryBatchFieldPos[_countof(dictionaryBatchFields)];
+            FbPatch(fb, recordBatchFieldPos, FbTable(fb, dictionaryBatchFields, _countof(dictionaryBatchFields), dictionaryBatchFieldPos));
+            recordBatchFieldPos = dictionaryBatchFieldPos[1];
+        }
+
+        FbField const recordBatchFields[] = {
+            { 8, length }, // length
+            { 4, 0 },      // nodes
+            { 4, 0 },      // buffers
+        };
+        unsigned recordBatchFieldsPos[_countof(recordBatchFields)];
+        FbPatch(fb, recordBatchFieldPos, FbTable(fb, recordBatchFields, _countof(recordBatchFields), recordBatchFieldsPos));
+        FbPatch(fb, recordBatchFieldsPos[1], FbVector(fb, m_nodes.data(), m_nodes.size(), sizeof(Node)));
+
+        auto const buffersPos = FbVector(fb, nullptr, m_buffers.size(), 16);
+        FbPatch(fb, recordBatchFieldsPos[2], buffersPos);
+
+        UINT64 bodyOffset = 0;
+        for (unsigned i = 0; i != m_buffers.size(); i += 1)
+        {
+            UINT64 const buffer[2] = { bodyOffset, m_buffers[i].cbData };
+            memcpy(fb.data() + buffersPos + 4 + i * 16, buffer, 16);
+            bodyOffset += (m_buffers[i].cbData + 7u) & ~UINT64(7);
+        }
+
+        FbEndMessage(fb);
+    }
+
+    block.Offset = static_cast<INT64>(m_filePos);
+    block.MetaDataLength = static_cast<INT32>(fb.size());
+    block.Padding = 0;
+    block.BodyLength = static_cast<INT64>(bodyLength);
+
+    // Write the message and then the body.
+    status = WriteToSink(fb.data(), fb.size(), sink);
+    for (unsigned i = 0; status == ERROR_SUCCESS && i != m_buffers.size(); i += 1)
+    {
+        auto const& buffer = m_buffers[i];
+        if (buffer.cbData != 0)
+        {
+            status = WriteToSink(
+                buffer.pData ? buffer.pData : m_scratch.data() + buffer.ScratchOffset,
+                buffer.cbData,
+                sink);
+            if (status == ERROR_SUCCESS && (buffer.cbData & 7) != 0)
+            {
+                status = WriteToSink(Padding, 8 - (buffer.cbData & 7), sink);
+            }
+        }
+    }
+
+    if (status == ERROR_SUCCESS && m_format == EtwArrowFormat_File)
+    {
+        blocks.push_back(block);
+    }
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwArrowWriter::WriteToSink(
+    _In_reads_bytes_(cb) void const* pb,
+    unsigned cb,
+    EtwOutputSink& sink) noexcept
+{
+    m_filePos += cb;
+    return sink.Write(pb, cb);
+}
+
+bool
+EtwArrowWriter::AddDictionaryValue(
+    unsigned fieldIndex,
+    _In_reads_bytes_(cb) BYTE const* pb,
+    unsigned cb,
+    _Out_ unsigned* pIndex) noexcept
+{
+    bool ok = true;
+    unsigned const hash = static_cast<unsigned>(HashBytes(fieldIndex, pb, cb));
+    unsigned index = 0;
+
+    if (m_dictionaryEntries.size() == 0)
+    {
+        // New dictionaries.
+        if (!m_dictionaryBuckets.resize(1024, false))
+        {
+            ok = false;
+            goto Done;
+        }
+
+        memset(m_dictionaryBuckets.data(), 0xff, m_dictionaryBuckets.byte_size()); // NoEntry
+    }
+
+    for (unsigned i = m_dictionaryBuckets[hash & (m_dictionaryBuckets.size() - 1)];
+        i != NoEntry;
+        i = m_dictionaryEntries[i].HashNext)
+    {
+        auto const& entry = m_dictionaryEntries[i];
+        if (entry.Hash == hash &&
+            entry.Field == fieldIndex &&
+            entry.Length == cb &&
+            0 == memcmp(m_dictionary.data() + entry.Offset, pb, cb))
+        {
+            index = entry.Index;
+            goto Done;
+        }
+    }
+
+    if (m_dictionary.size() + UINT64(cb) > 0x7FFFFFFF)
+    {
+        ok = false; // Too large for int32 offsets.
+    }
+    else
+    {
+        DictionaryEntry entry;
+        entry.Field = fieldIndex;
+        entry.Index = m_fields[fieldIndex].DictionarySize;
+        entry.Offset = m_dictionary.size();
+        entry.Length = cb;
+        entry.Hash = hash;
+        if (!m_dictionary.resize(entry.Offset + cb) ||
+            !m_dictionaryEntries.reserve(m_dictionaryEntries.size() + 1))
+        {
+            ok = false;
+            goto Done;
+        }
+
+        memcpy(m_dictionary.data() + entry.Offset, pb, cb);
+
+        unsigned const entryIndex = m_dictionaryEntries.size();
+        if (entryIndex == m_dictionaryBuckets.size() &&
+            m_dictionaryBuckets.resize(entryIndex * 2, false))
+        {
+            // Rehash for an average chain length <= 1.
+            memset(m_dictionaryBuckets.data(), 0xff, m_dictionaryBuckets.byte_size()); // NoEntry
+            for (unsigned i = 0; i != m_dictionaryEntries.size(); i += 1)
+            {
+                auto& bucket = m_dictionaryBuckets[m_dictionaryEntries[i].Hash & (m_dictionaryBuckets.size() - 1)];
+                m_dictionaryEntries[i].HashNext = bucket;
+                bucket = i;
+            }
+        }
+
+        auto& bucket = m_dictionaryBuckets[hash & (m_dictionaryBuckets.size() - 1)];
+        entry.HashNext = bucket;
+        bucket = entryIndex;
+        m_dictionaryEntries.push_back(entry);
+        m_fields[fieldIndex].DictionarySize += 1;
+        index = entry.Index;
+    }
+
+Done:
+
+    *pIndex = index;
+    return ok;
+}
+
+#pragma endregion
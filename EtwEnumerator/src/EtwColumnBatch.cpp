@@ -0,0 +1,1105 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "stdafx.h"
+#include <EtwEnumerator.h>
+#include "EtwBuffer.inl"
+
+/*
+Implementation of EtwColumnBatch and EtwEnumerator::DecodeEventsToColumns
+and DecodeCurrentEventToColumns.
+This code is in a separate file so that users who don't decode to columns
+don't need to link it.
+*/
+
+// Macros for some recently-defined constants so that this can compile
+// using an older Windows SDK.
+#define TDH_InTypeManifestCountedString        22 // TDH_INTYPE_MANIFEST_COUNTEDSTRING
+#define TDH_InTypeManifestCountedAnsiString    23 // TDH_INTYPE_MANIFEST_COUNTEDANSISTRING
+#define TDH_InTypeManifestCountedBinary        25 // TDH_INTYPE_MANIFEST_COUNTEDBINARY
+
+static wchar_t const* const HeaderColumnNames[EtwColumnBatch::HeaderColumnCount] = {
+    L"TimeStamp",
+    L"ProcessId",
+    L"ThreadId",
+    L"ProcessorIndex",
+    L"ActivityId",
+};
+
+static EtwColumnType const HeaderColumnTypes[EtwColumnBatch::HeaderColumnCount] = {
+    EtwColumnType_Int64,
+    EtwColumnType_UInt64,
+    EtwColumnType_UInt64,
+    EtwColumnType_UInt64,
+    EtwColumnType_Guid,
+};
+
+// Returns the column type for a raw or canonical intype.
+static EtwColumnType
+ColumnTypeFromInType(
+    unsigned inType) noexcept
+{
+    switch (inType)
+    {
+    case TDH_INTYPE_NULL:
+        return EtwColumnType_None;
+
+    case TDH_INTYPE_INT8:
+    case TDH_INTYPE_INT16:
+    case TDH_INTYPE_INT32:
+    case TDH_INTYPE_INT64:
+        return EtwColumnType_Int64;
+
+    case TDH_INTYPE_UINT8:
+    case TDH_INTYPE_UINT16:
+    case TDH_INTYPE_UINT32:
+    case TDH_INTYPE_UINT64:
+    case TDH_INTYPE_HEXINT32:
+    case TDH_INTYPE_HEXINT64:
+    case TDH_INTYPE_BOOLEAN:
+    case TDH_INTYPE_POINTER:
+    case TDH_INTYPE_SIZET:
+    case TDH_INTYPE_FILETIME:
+        return EtwColumnType_UInt64;
+
+    case TDH_INTYPE_FLOAT:
+    case TDH_INTYPE_DOUBLE:
+        return EtwColumnType_Double;
+
+    case TDH_INTYPE_GUID:
+        return EtwColumnType_Guid;
+
+    case TDH_INTYPE_UNICODESTRING:
+    case TDH_InTypeManifestCountedString:
+    case TDH_INTYPE_COUNTEDSTRING:
+    case TDH_INTYPE_REVERSEDCOUNTEDSTRING:
+    case TDH_INTYPE_NONNULLTERMINATEDSTRING:
+    case TDH_INTYPE_UNICODECHAR:
+        return EtwColumnType_String;
+
+    case TDH_INTYPE_ANSISTRING:
+    case TDH_InTypeManifestCountedAnsiString:
+    case TDH_INTYPE_COUNTEDANSISTRING:
+    case TDH_INTYPE_REVERSEDCOUNTEDANSISTRING:
+    case TDH_INTYPE_NONNULLTERMINATEDANSISTRING:
+    case TDH_INTYPE_ANSICHAR:
+        return EtwColumnType_AnsiString;
+
+    default:
+        return EtwColumnType_Binary;
+    }
+}
+
+// Returns the size of a value in a fixed-size column, or 0 for a
+// variable-size (or None) column.
+static unsigned
+ColumnValueSize(
+    EtwColumnType type) noexcept
+{
+    switch (type)
+    {
+    case EtwColumnType_Int64:
+    case EtwColumnType_UInt64:
+    case EtwColumnType_Double:
+        return 8;
+    case EtwColumnType_Guid:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+static bool
+IsVariableSizeColumn(
+    EtwColumnType type) noexcept
+{
+    return
+        type == EtwColumnType_String ||
+        type == EtwColumnType_AnsiString ||
+        type == EtwColumnType_Binary;
+}
+
+static unsigned const MaxStructDepth = 32; // Deeper structs are not flattened.
+
+// How a property is decoded. Stored in EtwColumnBatch::PropertyColumns::Kind.
+enum ColumnPropertyKind : UCHAR
+{
+    ColumnPropertyKind_Skip,   // No column, or a None column. Not decoded.
+    ColumnPropertyKind_Value,  // Sets the last value of column FirstColumn.
+    ColumnPropertyKind_Struct, // Non-array struct. Members have their own columns.
+    ColumnPropertyKind_List,   // Array. Each element appends to the list columns.
+};
+
+#pragma region EtwColumnBatch
+
+EtwColumnBatch::EtwColumnBatch() noexcept
+    : m_tables()
+    , m_columns()
+    , m_properties()
+    , m_structs()
+    , m_names()
+    , m_buckets()
+    , m_lastTable(NoTable)
+{
+    return;
+}
+
+EtwColumnBatch::~EtwColumnBatch() noexcept
+{
+    FreeColumns();
+}
+
+void
+EtwColumnBatch::Clear() noexcept
+{
+    FreeColumns();
+    m_tables.clear();
+    m_columns.clear();
+    m_properties.clear();
+    m_structs.clear();
+    m_names.clear();
+    m_buckets.clear();
+    m_lastTable = NoTable;
+}
+
+void
+EtwColumnBatch::ClearRows() noexcept
+{
+    for (auto& table : m_tables)
+    {
+        table.RowCount = 0;
+    }
+
+    for (auto& column : m_columns)
+    {
+        column.ValueCount = 0;
+        column.Values.cbSize = 0;
+        column.Offsets.cbSize = 0;
+        column.Validity.cbSize = 0;
+        column.ListOffsets.cbSize = 0;
+        column.ListValidity.cbSize = 0;
+    }
+}
+
+unsigned
+EtwColumnBatch::TableCount() const noexcept
+{
+    return m_tables.size();
+}
+
+EtwColumnTableInfo
+EtwColumnBatch::GetTableInfo(
+    unsigned tableIndex) const noexcept
+{
+    ASSERT(tableIndex < m_tables.size()); // PRECONDITION
+
+    auto const& table = m_tables[tableIndex];
+    EtwColumnTableInfo value;
+    value.ProviderName = m_names.data() + table.ProviderNameOffset;
+    value.EventName = m_names.data() + table.EventNameOffset;
+    value.ProviderId = table.ProviderId;
+    value.EventDescriptor = table.EventDescriptor;
+    value.ColumnCount = table.ColumnCount;
+    value.RowCount = table.RowCount;
+    value.DroppedColumnCount = table.DroppedColumnCount;
+    value.StructCount = table.StructCount;
+    return value;
+}
+
+EtwColumnInfo
+EtwColumnBatch::GetColumnInfo(
+    unsigned tableIndex,
+    unsigned columnIndex) const noexcept
+{
+    ASSERT(tableIndex < m_tables.size()); // PRECONDITION
+    ASSERT(columnIndex < m_tables[tableIndex].ColumnCount); // PRECONDITION
+
+    auto const& table = m_tables[tableIndex];
+    auto const& column = m_columns[table.FirstColumn + columnIndex];
+    EtwColumnInfo value;
+    value.Name = m_names.data() + column.NameOffset;
+    value.Type = column.Type;
+    value.InType = static_cast<_TDH_IN_TYPE>(column.InType);
+    value.OutType = static_cast<_TDH_OUT_TYPE>(column.OutType);
+    value.RowCount = table.RowCount;
+    value.Validity = column.Validity.pData;
+    value.Values = column.Values.pData;
+    value.Offsets = IsVariableSizeColumn(column.Type)
+        ? reinterpret_cast<UINT32 const*>(column.Offsets.pData)
+        : nullptr;
+    value.ValueCount = column.ValueCount;
+    value.ListOffsets = column.IsList
+        ? reinterpret_cast<UINT32 const*>(column.ListOffsets.pData)
+        : nullptr;
+    value.ListValidity = column.IsList
+        ? column.ListValidity.pData
+        : nullptr;
+    value.MapName = column.MapNameOffset != NoMap
+        ? m_names.data() + column.MapNameOffset
+        : nullptr;
+    value.MemberName = m_names.data() + column.MemberNameOffset;
+    value.Struct = column.Struct;
+    return value;
+}
+
+EtwColumnStructInfo
+EtwColumnBatch::GetStructInfo(
+    unsigned tableIndex,
+    unsigned structIndex) const noexcept
+{
+    ASSERT(tableIndex < m_tables.size()); // PRECONDITION
+    ASSERT(structIndex < m_tables[tableIndex].StructCount); // PRECONDITION
+
+    auto const& st = m_structs[m_tables[tableIndex].FirstStruct + structIndex];
+    EtwColumnStructInfo value;
+    value.Name = m_names.data() + st.NameOffset;
+    value.Parent = st.Parent;
+    value.FirstColumn = st.FirstColumn;
+    value.ColumnCount = st.ColumnCount;
+    value.IsArray = st.IsArray;
+    return value;
+}
+
+bool
+EtwColumnBatch::ReserveData(
+    ColumnData& data,
+    UINT32 cbRequired) noexcept
+{
+    bool ok;
+
+    if (cbRequired <= data.cbCapacity)
+    {
+        ok = true;
+    }
+    else
+    {
+        // Grow by at least 2x so that appending a row is amortized O(1).
+        UINT32 cbNewCapacity = data.cbCapacity < 64 ? 64 : data.cbCapacity;
+        while (cbNewCapacity < cbRequired)
+        {
+            cbNewCapacity = cbNewCapacity > 0x7FFFFFFF ? 0xFFFFFFFF : cbNewCapacity * 2;
+        }
+
+        auto const pNewData = static_cast<BYTE*>(data.pData == nullptr
+            ? HeapAlloc(GetProcessHeap(), 0, cbNewCapacity)
+            : HeapReAlloc(GetProcessHeap(), 0, data.pData, cbNewCapacity));
+        if (pNewData == nullptr)
+        {
+            ok = false;
+        }
+        else
+        {
+            data.pData = pNewData;
+            data.cbCapacity = cbNewCapacity;
+            ok = true;
+        }
+    }
+
+    return ok;
+}
+
+bool
+EtwColumnBatch::ReserveValue(
+    Column& column) noexcept
+{
+    UINT32 const index = column.ValueCount;
+    UINT64 const cbValues = UINT64(index + 1) * ColumnValueSize(column.Type);
+    return
+        index != 0xFFFFFFFE &&
+        cbValues <= 0xFFFFFFFF &&
+        ReserveData(column.Validity, index / 8 + 1) &&
+        ReserveData(column.Values, static_cast<UINT32>(cbValues)) &&
+        (!IsVariableSizeColumn(column.Type) ||
+            ReserveData(column.Offsets, (index + 2) * sizeof(UINT32)));
+}
+
+bool
+EtwColumnBatch::ReserveRow(
+    Column& column,
+    unsigned row) noexcept
+{
+    // A list starts empty, so a list column only needs room for the list.
+    // Variable-size list columns need Offsets[0] even if there are no values.
+    return column.IsList
+        ? ReserveData(column.ListValidity, row / 8 + 1) &&
+            ReserveData(column.ListOffsets, (row + 2) * sizeof(UINT32)) &&
+            (!IsVariableSizeColumn(column.Type) ||
+                ReserveData(column.Offsets, (column.ValueCount + 1) * sizeof(UINT32)))
+        : ReserveValue(column);
+}
+
+void
+EtwColumnBatch::AppendNullValue(
+    Column& column) noexcept
+{
+    UINT32 const index = column.ValueCount;
+
+    if ((index & 7) == 0)
+    {
+        column.Validity.pData[index / 8] = 0;
+        column.Validity.cbSize = index / 8 + 1;
+    }
+
+    if (IsVariableSizeColumn(column.Type))
+    {
+        auto const pOffsets = reinterpret_cast<UINT32*>(column.Offsets.pData);
+        if (index == 0)
+        {
+            pOffsets[0] = 0;
+        }
+
+        pOffsets[index + 1] = column.Values.cbSize;
+        column.Offsets.cbSize = (index + 2) * sizeof(UINT32);
+    }
+    else if (auto const cbValue = ColumnValueSize(column.Type))
+    {
+        memset(column.Values.pData + index * cbValue, 0, cbValue);
+        column.Values.cbSize = (index + 1) * cbValue;
+    }
+
+    column.ValueCount = index + 1;
+    if (column.IsList)
+    {
+        // Add the value to the list of the last row.
+        reinterpret_cast<UINT32*>(column.ListOffsets.pData)[column.ListOffsets.cbSize / sizeof(UINT32) - 1] = index + 1;
+    }
+}
+
+void
+EtwColumnBatch::AppendNullRow(
+    Column& column,
+    unsigned row) noexcept
+{
+    if (!column.IsList)
+    {
+        AppendNullValue(column);
+    }
+    else
+    {
+        auto const pListOffsets = reinterpret_cast<UINT32*>(column.ListOffsets.pData);
+        if ((row & 7) == 0)
+        {
+            column.ListValidity.pData[row / 8] = 0;
+            column.ListValidity.cbSize = row / 8 + 1;
+        }
+
+        if (row == 0)
+        {
+            pListOffsets[0] = 0;
+        }
+
+        pListOffsets[row + 1] = column.ValueCount;
+        column.ListOffsets.cbSize = (row + 2) * sizeof(UINT32);
+
+        if (IsVariableSizeColumn(column.Type) && column.ValueCount == 0)
+        {
+            reinterpret_cast<UINT32*>(column.Offsets.pData)[0] = 0;
+            column.Offsets.cbSize = sizeof(UINT32);
+        }
+    }
+}
+
+bool
+EtwColumnBatch::AddColumn(
+    _In_reads_(cchPrefix) EtwWCHAR const* pchPrefix,
+    unsigned cchPrefix,
+    _In_z_ EtwPCWSTR szName,
+    unsigned structIndex,
+    EtwColumnType type,
+    USHORT inType,
+    USHORT outType,
+    bool isList,
+    _In_opt_z_ EtwPCWSTR szMapName) noexcept
+{
+    bool ok;
+    auto const oldSize = m_names.size();
+    auto const cchName = static_cast<unsigned>(wcslen(szName)) + 1;
+    auto const cchMapName = szMapName ? static_cast<unsigned>(wcslen(szMapName)) + 1 : 0u;
+    Column column = {};
+    column.NameOffset = oldSize;
+    column.MemberNameOffset = oldSize + cchPrefix;
+    column.Struct = structIndex;
+    column.Type = type;
+    column.InType = inType;
+    column.OutType = outType;
+    column.IsList = isList;
+    column.MapNameOffset = szMapName ? oldSize + cchPrefix + cchName : NoMap;
+
+    if (!m_names.resize(oldSize + cchPrefix + cchName + cchMapName))
+    {
+        ok = false;
+    }
+    else if (!m_columns.push_back(column))
+    {
+        m_names.resize_unchecked(oldSize);
+        ok = false;
+    }
+    else
+    {
+        memcpy(m_names.data() + oldSize, pchPrefix, cchPrefix * sizeof(EtwWCHAR));
+        memcpy(m_names.data() + oldSize + cchPrefix, szName, cchName * sizeof(EtwWCHAR));
+        memcpy(m_names.data() + oldSize + cchPrefix + cchName, szMapName, cchMapName * sizeof(EtwWCHAR));
+        ok = true;
+    }
+
+    return ok;
+}
+
+void
+EtwColumnBatch::FreeColumns() noexcept
+{
+    for (auto& column : m_columns)
+    {
+        HeapFree(GetProcessHeap(), 0, column.Values.pData);
+        HeapFree(GetProcessHeap(), 0, column.Offsets.pData);
+        HeapFree(GetProcessHeap(), 0, column.Validity.pData);
+        HeapFree(GetProcessHeap(), 0, column.ListOffsets.pData);
+        HeapFree(GetProcessHeap(), 0, column.ListValidity.pData);
+    }
+
+    for (auto& table : m_tables)
+    {
+        HeapFree(GetProcessHeap(), 0, table.pKeyBlob);
+    }
+}
+
+#pragma endregion
+
+#pragma region EtwEnumerator
+
+bool
+EtwEnumerator::FindColumnTable(
+    EtwColumnBatch& batch,
+    _Out_ unsigned* pTableIndex) noexcept
+{
+    using Table = EtwColumnBatch::Table;
+
+    bool ok = false;
+    EtwInternal::SchemaCache::Key key;
+    EtwInternal::SchemaCache::MakeKey(m_pEventRecord, &key);
+
+    auto const matches = [&key](Table const& table) noexcept
+    {
+        return
+            table.Hash == key.Hash &&
+            table.Flags == key.Flags &&
+            table.EventProperty == key.EventProperty &&
+            table.cbSchemaTl == key.cbSchemaTl &&
+            table.cbProvTraits == key.cbProvTraits &&
+            0 == memcmp(&table.EventDescriptor, &key.EventDescriptor, sizeof(key.EventDescriptor)) &&
+            0 == memcmp(&table.ProviderId, &key.ProviderId, sizeof(key.ProviderId)) &&
+            (key.cbSchemaTl == 0 || (
+                0 == memcmp(table.pKeyBlob, key.pSchemaTl, key.cbSchemaTl) &&
+                0 == memcmp(table.pKeyBlob + key.cbSchemaTl, key.pProvTraits, key.cbProvTraits)));
+    };
+
+    unsigned tableIndex = batch.m_lastTable;
+    if (tableIndex == EtwColumnBatch::NoTable ||
+        !matches(batch.m_tables[tableIndex]))
+    {
+        tableIndex = EtwColumnBatch::NoTable;
+        if (batch.m_buckets.size() != 0)
+        {
+            auto const bucketMask = batch.m_buckets.size() - 1;
+            for (unsigned i = batch.m_buckets[key.Hash & bucketMask];
+                i != EtwColumnBatch::NoTable;
+                i = batch.m_tables[i].HashNext)
+            {
+                if (matches(batch.m_tables[i]))
+                {
+                    tableIndex = i;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (tableIndex == EtwColumnBatch::NoTable)
+    {
+        // New schema. Add a table with the header columns and the flattened
+        // property columns.
+        auto const pTei = m_pTraceEventInfo;
+        auto const oldNamesSize = batch.m_names.size();
+        auto const oldColumnsSize = batch.m_columns.size();
+        auto const oldPropertiesSize = batch.m_properties.size();
+        auto const oldStructsSize = batch.m_structs.size();
+        unsigned const propertyCount = pTei->PropertyCount;
+        unsigned const cbKeyBlob = static_cast<unsigned>(key.cbSchemaTl) + key.cbProvTraits;
+        EtwInternal::Buffer<EtwWCHAR, 128> prefix;
+        auto const appendName = [&batch](_In_opt_z_ EtwPCWSTR szName) noexcept
+        {
+            if (szName == nullptr)
+            {
+                szName = L"";
+            }
+
+            auto const oldSize = batch.m_names.size();
+            auto const cch = static_cast<unsigned>(wcslen(szName)) + 1;
+            if (!batch.m_names.resize(oldSize + cch))
+            {
+                return false;
+            }
+
+            memcpy(batch.m_names.data() + oldSize, szName, cch * sizeof(EtwWCHAR));
+            return true;
+        };
+
+        Table table = {};
+        table.ProviderId = key.ProviderId;
+        table.EventDescriptor = key.EventDescriptor;
+        table.Flags = key.Flags;
+        table.EventProperty = key.EventProperty;
+        table.Hash = key.Hash;
+        table.cbSchemaTl = key.cbSchemaTl;
+        table.cbProvTraits = key.cbProvTraits;
+        table.FirstColumn = oldColumnsSize;
+        table.FirstProperty = oldPropertiesSize;
+        table.PropertyCount = propertyCount;
+        table.FirstStruct = oldStructsSize;
+        table.DroppedColumnCount = 0;
+        table.RowCount = 0;
+
+        if (pTei->TopLevelPropertyCount > propertyCount ||
+            !batch.m_properties.resize(oldPropertiesSize + propertyCount))
+        {
+            goto Done;
+        }
+
+        // Properties that are not reached from the top level are skipped.
+        memset(batch.m_properties.data() + oldPropertiesSize, 0, // ColumnPropertyKind_Skip
+            propertyCount * sizeof(EtwColumnBatch::PropertyColumns));
+
+        table.ProviderNameOffset = batch.m_names.size();
+        if (!appendName(TeiString(pTei->ProviderNameOffset)))
+        {
+            goto Rollback;
+        }
+
+        table.EventNameOffset = batch.m_names.size();
+        if (!appendName(EventName()))
+        {
+            goto Rollback;
+        }
+
+        for (unsigned i = 0; i != EtwColumnBatch::HeaderColumnCount; i += 1)
+        {
+            if (!batch.AddColumn(nullptr, 0, HeaderColumnNames[i], EtwColumnBatch::NoStruct,
+                HeaderColumnTypes[i], 0, 0, false, nullptr))
+            {
+                goto Rollback;
+            }
+        }
+
+        if (!AddPropertyColumns(batch, oldColumnsSize, oldPropertiesSize, prefix,
+            0, pTei->TopLevelPropertyCount, false, 0, oldStructsSize, EtwColumnBatch::NoStruct,
+            &table.DroppedColumnCount))
+        {
+            goto Rollback;
+        }
+
+        table.ColumnCount = batch.m_columns.size() - oldColumnsSize;
+        table.StructCount = batch.m_structs.size() - oldStructsSize;
+
+        if (cbKeyBlob != 0)
+        {
+            table.pKeyBlob = static_cast<BYTE*>(HeapAlloc(GetProcessHeap(), 0, cbKeyBlob));
+            if (table.pKeyBlob == nullptr)
+            {
+                goto Rollback;
+            }
+
+            memcpy(table.pKeyBlob, key.pSchemaTl, key.cbSchemaTl);
+            memcpy(table.pKeyBlob + key.cbSchemaTl, key.pProvTraits, key.cbProvTraits);
+        }
+
+        tableIndex = batch.m_tables.size();
+        if (!batch.m_tables.push_back(table))
+        {
+            HeapFree(GetProcessHeap(), 0, table.pKeyBlob);
+            goto Rollback;
+        }
+
+        if (batch.m_buckets.size() < batch.m_tables.size())
+        {
+            // Rehash for an average chain length <= 1.
+            unsigned const bucketCount = batch.m_buckets.size() == 0
+                ? 16u
+                : batch.m_buckets.size() * 2;
+            if (batch.m_buckets.resize(bucketCount, false))
+            {
+                memset(batch.m_buckets.data(), 0xff, batch.m_buckets.byte_size()); // NoTable
+                for (unsigned i = 0; i != batch.m_tables.size(); i += 1)
+                {
+                    auto& bucket = batch.m_buckets[batch.m_tables[i].Hash & (bucketCount - 1)];
+                    batch.m_tables[i].HashNext = bucket;
+                    bucket = i;
+                }
+            }
+            else if (batch.m_buckets.size() == 0)
+            {
+                batch.m_tables.pop_back();
+                HeapFree(GetProcessHeap(), 0, table.pKeyBlob);
+                goto Rollback;
+            }
+            else
+            {
+                // Keep the old buckets. Chains get longer, which is ok.
+                auto& bucket = batch.m_buckets[table.Hash & (batch.m_buckets.size() - 1)];
+                batch.m_tables[tableIndex].HashNext = bucket;
+                bucket = tableIndex;
+            }
+        }
+        else
+        {
+            auto& bucket = batch.m_buckets[table.Hash & (batch.m_buckets.size() - 1)];
+            batch.m_tables[tableIndex].HashNext = bucket;
+            bucket = tableIndex;
+        }
+
+        goto Found;
+
+    Rollback:
+
+        batch.m_names.resize_unchecked(oldNamesSize);
+        batch.m_columns.resize_unchecked(oldColumnsSize);
+        batch.m_properties.resize_unchecked(oldPropertiesSize);
+        batch.m_structs.resize_unchecked(oldStructsSize);
+        goto Done;
+    }
+
+Found:
+
+    batch.m_lastTable = tableIndex;
+    *pTableIndex = tableIndex;
+    ok = true;
+
+Done:
+
+    return ok;
+}
+
+bool
+EtwEnumerator::AddPropertyColumns(
+    EtwColumnBatch& batch,
+    unsigned firstColumn,
+    unsigned firstProperty,
+    EtwInternal::Buffer<EtwWCHAR>& prefix,
+    unsigned propertyBegin,
+    unsigned propertyEnd,
+    bool inList,
+    unsigned depth,
+    unsigned firstStruct,
+    unsigned parentStruct,
+    _Inout_ unsigned* pDroppedColumnCount) noexcept
+{
+    auto const pTei = m_pTraceEventInfo;
+    unsigned const cchPrefix = prefix.size();
+    bool ok = true;
+
+    for (unsigned i = propertyBegin; ok && i != propertyEnd; i += 1)
+    {
+        auto const& epi = pTei->EventPropertyInfoArray[i];
+        auto& property = batch.m_properties[firstProperty + i];
+        EtwPCWSTR const szName = epi.NameOffset ? TeiStringNoCheck(epi.NameOffset) : L"";
+        bool const isArray =
+            0 != (epi.Flags & (PropertyParamCount | PropertyParamFixedCount)) ||
+            epi.count != 1;
+        unsigned const structEnd = 0 != (epi.Flags & PropertyStruct)
+            ? static_cast<unsigned>(epi.structType.StructStartIndex) + epi.structType.NumOfStructMembers
+            : 0u;
+
+        property.FirstColumn = batch.m_columns.size() - firstColumn;
+        if ((isArray && inList) ||
+            structEnd > pTei->PropertyCount ||
+            depth == MaxStructDepth)
+        {
+            // Not decoded: a None column marks where the values would be.
+            property.Kind = ColumnPropertyKind_Skip;
+            *pDroppedColumnCount += 1;
+            ok = batch.AddColumn(prefix.data(), cchPrefix, szName, parentStruct,
+                EtwColumnType_None, 0, 0, false, nullptr);
+        }
+        else if (epi.Flags & PropertyStruct)
+        {
+            // Members are named "Struct.Member". Members of an array of
+            // structs are list columns.
+            auto const cchName = static_cast<unsigned>(wcslen(szName));
+            auto const structIndex = batch.m_structs.size();
+            EtwColumnBatch::Struct st;
+            st.NameOffset = batch.m_names.size();
+            st.Parent = parentStruct;
+            st.FirstColumn = property.FirstColumn;
+            st.ColumnCount = 0;
+            st.IsArray = isArray;
+            property.Kind = isArray ? ColumnPropertyKind_List : ColumnPropertyKind_Struct;
+            ok = prefix.resize(cchPrefix + cchName + 1) &&
+                batch.m_names.resize(st.NameOffset + cchName + 1) &&
+                batch.m_structs.push_back(st);
+            if (ok)
+            {
+                memcpy(batch.m_names.data() + st.NameOffset, szName, (cchName + 1) * sizeof(EtwWCHAR));
+                memcpy(prefix.data() + cchPrefix, szName, cchName * sizeof(EtwWCHAR));
+                prefix[cchPrefix + cchName] = L'.';
+                ok = AddPropertyColumns(batch, firstColumn, firstProperty, prefix,
+                    epi.structType.StructStartIndex, structEnd, inList || isArray, depth + 1,
+                    firstStruct, structIndex - firstStruct, pDroppedColumnCount);
+                prefix.resize_unchecked(cchPrefix);
+                batch.m_structs[structIndex].ColumnCount =
+                    batch.m_columns.size() - firstColumn - property.FirstColumn;
+            }
+        }
+        else
+        {
+            // A value with a map is stored as its formatted text.
+            EtwPCWSTR const szMapName =
+                epi.nonStructType.MapNameOffset == 0 ||
+                0 != (epi.Flags & PropertyHasCustomSchema)
+                ? nullptr
+                : TeiStringNoCheck(epi.nonStructType.MapNameOffset);
+            property.Kind = isArray ? ColumnPropertyKind_List : ColumnPropertyKind_Value;
+            ok = batch.AddColumn(prefix.data(), cchPrefix, szName, parentStruct,
+                szMapName ? EtwColumnType_String : ColumnTypeFromInType(epi.nonStructType.InType),
+                epi.nonStructType.InType,
+                epi.nonStructType.OutType,
+                inList || isArray,
+                szMapName);
+        }
+
+        property.ColumnCount = batch.m_columns.size() - firstColumn - property.FirstColumn;
+    }
+
+    return ok;
+}
+
+bool
+EtwEnumerator::AddCurrentEventToColumns(
+    EtwColumnBatch& batch,
+    unsigned tableIndex) noexcept
+{
+    ASSERT(m_state == EtwEnumeratorState_BeforeFirstItem);
+
+    static EtwColumnBatch::PropertyColumns const SkipProperty = {}; // ColumnPropertyKind_Skip
+    auto& table = batch.m_tables[tableIndex];
+    auto const pColumns = batch.m_columns.data() + table.FirstColumn;
+    auto const pProperties = batch.m_properties.data() + table.FirstProperty;
+    unsigned const row = table.RowCount;
+    LSTATUS status = ERROR_SUCCESS;
+    bool rowAdded = false;
+
+    if (row == 0xFFFFFFFE)
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto Done;
+    }
+
+    // Reserve room for the row in every column so that only the variable-size
+    // heaps and the lists can fail to grow while the row is being filled in.
+    for (unsigned i = 0; i != table.ColumnCount; i += 1)
+    {
+        if (!EtwColumnBatch::ReserveRow(pColumns[i], row))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+    }
+
+    // Start with a null row.
+    for (unsigned i = 0; i != table.ColumnCount; i += 1)
+    {
+        EtwColumnBatch::AppendNullRow(pColumns[i], row);
+    }
+
+    table.RowCount = row + 1;
+    rowAdded = true;
+
+    // Header columns.
+    {
+        auto const& header = m_pEventRecord->EventHeader;
+        UINT64 const headerValues[] = {
+            static_cast<UINT64>(header.TimeStamp.QuadPart),
+            header.ProcessId,
+            header.ThreadId,
+            GetEventProcessorIndex(m_pEventRecord),
+        };
+        static_assert(_countof(headerValues) == EtwColumnBatch::HeaderColumnCount - 1, "Header columns");
+
+        for (unsigned i = 0; i != _countof(headerValues); i += 1)
+        {
+            memcpy(pColumns[i].Values.pData + row * 8, &headerValues[i], 8);
+            pColumns[i].Validity.pData[row / 8] |= static_cast<BYTE>(1u << (row & 7));
+        }
+
+        auto& activityColumn = pColumns[EtwColumnBatch::HeaderColumnCount - 1];
+        memcpy(activityColumn.Values.pData + row * 16, &header.ActivityId, 16);
+        activityColumn.Validity.pData[row / 8] |= static_cast<BYTE>(1u << (row & 7));
+    }
+
+    // Property columns. A value sets the last value of its column: the row's
+    // value, or the element appended for the current array element.
+    if (MoveNext())
+    {
+        for (;;)
+        {
+            auto const& property = m_stackTop.PropertyIndex < table.PropertyCount
+                ? pProperties[m_stackTop.PropertyIndex]
+                : SkipProperty;
+            auto const pFirst = pColumns + property.FirstColumn;
+            bool moved;
+
+            switch (m_state)
+            {
+            case EtwEnumeratorState_ArrayBegin:
+                if (property.Kind != ColumnPropertyKind_List)
+                {
+                    moved = MoveNextSibling(); // Not decoded.
+                }
+                else
+                {
+                    // The array is present, so its lists are not null.
+                    for (unsigned i = 0; i != property.ColumnCount; i += 1)
+                    {
+                        if (pFirst[i].IsList)
+                        {
+                            pFirst[i].ListValidity.pData[row / 8] |= static_cast<BYTE>(1u << (row & 7));
+                        }
+                    }
+
+                    moved = MoveNext();
+                }
+                break;
+
+            case EtwEnumeratorState_StructBegin:
+                if (property.Kind == ColumnPropertyKind_Struct)
+                {
+                    moved = MoveNext();
+                }
+                else if (property.Kind != ColumnPropertyKind_List)
+                {
+                    moved = MoveNextSibling(); // Not decoded.
+                }
+                else
+                {
+                    // Element of an array of structs: append a null element to
+                    // each member's list so that the lists stay aligned.
+                    moved = true;
+                    for (unsigned i = 0; moved && i != property.ColumnCount; i += 1)
+                    {
+                        moved = !pFirst[i].IsList || EtwColumnBatch::ReserveValue(pFirst[i]);
+                    }
+
+                    if (!moved)
+                    {
+                        status = ERROR_OUTOFMEMORY;
+                        break;
+                    }
+
+                    for (unsigned i = 0; i != property.ColumnCount; i += 1)
+                    {
+                        if (pFirst[i].IsList)
+                        {
+                            EtwColumnBatch::AppendNullValue(pFirst[i]);
+                        }
+                    }
+
+                    moved = MoveNext();
+                }
+                break;
+
+            case EtwEnumeratorState_Value:
+                if (property.Kind == ColumnPropertyKind_List)
+                {
+                    // Element of an array of simple values.
+                    if (!EtwColumnBatch::ReserveValue(*pFirst))
+                    {
+                        status = ERROR_OUTOFMEMORY;
+                        moved = false;
+                        break;
+                    }
+
+                    EtwColumnBatch::AppendNullValue(*pFirst);
+                }
+
+                if (property.Kind == ColumnPropertyKind_List ||
+                    property.Kind == ColumnPropertyKind_Value)
+                {
+                    auto& column = *pFirst;
+                    BYTE const* pb = m_pbCooked;
+                    unsigned cb = m_cbCooked;
+                    bool matched;
+                    if (column.MapNameOffset == EtwColumnBatch::NoMap)
+                    {
+                        matched = column.Type == ColumnTypeFromInType(m_cookedInType);
+                    }
+                    else
+                    {
+                        // Mapped value: store the formatted text. If it can't
+                        // be formatted, leave the value null.
+                        EtwStringView text;
+                        matched = FormatCurrentValue(&text);
+                        pb = reinterpret_cast<BYTE const*>(text.Data);
+                        cb = text.DataLength * sizeof(EtwWCHAR);
+                    }
+
+                    if (matched)
+                    {
+                        union
+                        {
+                            INT64 i64;
+                            UINT64 u64;
+                            double f64;
+                        } value;
+                        bool valid = true;
+                        UINT32 const index = column.ValueCount - 1;
+
+                        switch (column.Type)
+                        {
+                        case EtwColumnType_Int64:
+                            switch (cb)
+                            {
+                            case 1: { INT8 v; memcpy(&v, pb, 1); value.i64 = v; break; }
+                            case 2: { INT16 v; memcpy(&v, pb, 2); value.i64 = v; break; }
+                            case 4: { INT32 v; memcpy(&v, pb, 4); value.i64 = v; break; }
+                            case 8: { memcpy(&value.i64, pb, 8); break; }
+                            default: valid = false; break;
+                            }
+                            break;
+                        case EtwColumnType_UInt64:
+                            switch (cb)
+                            {
+                            case 1: { UINT8 v; memcpy(&v, pb, 1); value.u64 = v; break; }
+                            case 2: { UINT16 v; memcpy(&v, pb, 2); value.u64 = v; break; }
+                            case 4: { UINT32 v; memcpy(&v, pb, 4); value.u64 = v; break; }
+                            case 8: { memcpy(&value.u64, pb, 8); break; }
+                            default: valid = false; break;
+                            }
+                            break;
+                        case EtwColumnType_Double:
+                            switch (cb)
+                            {
+                            case 4: { float v; memcpy(&v, pb, 4); value.f64 = v; break; }
+                            case 8: { memcpy(&value.f64, pb, 8); break; }
+                            default: valid = false; break;
+                            }
+                            break;
+                        case EtwColumnType_Guid:
+                            valid = cb == 16;
+                            break;
+                        case EtwColumnType_String:
+                            valid = (cb & 1) == 0;
+                            break;
+                        case EtwColumnType_AnsiString:
+                        case EtwColumnType_Binary:
+                            break;
+                        default:
+                            valid = false;
+                            break;
+                        }
+
+                        if (!valid)
+                        {
+                            // Leave the value null.
+                        }
+                        else if (column.Type == EtwColumnType_Guid)
+                        {
+                            memcpy(column.Values.pData + index * 16, pb, 16);
+                        }
+                        else if (!IsVariableSizeColumn(column.Type))
+                        {
+                            memcpy(column.Values.pData + index * 8, &value, 8);
+                        }
+                        else if (column.Values.cbSize + UINT64(cb) > 0xFFFFFFFF ||
+                            !EtwColumnBatch::ReserveData(column.Values, column.Values.cbSize + cb))
+                        {
+                            status = ERROR_OUTOFMEMORY;
+                            valid = false;
+                        }
+                        else
+                        {
+                            memcpy(column.Values.pData + column.Values.cbSize, pb, cb);
+                            column.Values.cbSize += cb;
+                            reinterpret_cast<UINT32*>(column.Offsets.pData)[index + 1] = column.Values.cbSize;
+                        }
+
+                        if (valid)
+                        {
+                            column.Validity.pData[index / 8] |= static_cast<BYTE>(1u << (index & 7));
+                        }
+                    }
+                }
+
+                moved = MoveNext();
+                break;
+
+            default:
+                moved = MoveNext();
+                break;
+            }
+
+            if (!moved)
+            {
+                break;
+            }
+        }
+    }
+
+    if (status == ERROR_SUCCESS && m_state == EtwEnumeratorState_Error)
+    {
+        status = m_lastError;
+    }
+
+Done:
+
+    m_lastError = status;
+    return rowAdded;
+}
+
+unsigned
+EtwEnumerator::DecodeEventsToColumns(
+    _In_reads_(cEventRecords) EVENT_RECORD const* const* ppEventRecords,
+    unsigned cEventRecords,
+    EtwColumnBatch& batch,
+    _Out_writes_opt_(cEventRecords) LSTATUS* pEventErrors) noexcept
+{
+    unsigned cRows = 0;
+
+    for (unsigned iEvent = 0; iEvent != cEventRecords; iEvent += 1)
+    {
+        auto const pEventRecord = ppEventRecords[iEvent];
+        if (EtwEventCategory_Error != PreviewEvent(pEventRecord) &&
+            StartEvent(pEventRecord))
+        {
+            cRows += DecodeCurrentEventToColumns(batch);
+        }
+
+        if (pEventErrors)
+        {
+            pEventErrors[iEvent] = m_lastError;
+        }
+    }
+
+    m_lastError = ERROR_SUCCESS;
+    return cRows;
+}
+
+bool
+EtwEnumerator::DecodeCurrentEventToColumns(
+    EtwColumnBatch& batch) noexcept
+{
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    unsigned tableIndex;
+    if (m_state != EtwEnumeratorState_BeforeFirstItem)
+    {
+        ResetImpl();
+    }
+
+    if (!FindColumnTable(batch, &tableIndex))
+    {
+        m_lastError = ERROR_OUTOFMEMORY;
+        return false;
+    }
+
+    return AddCurrentEventToColumns(batch, tableIndex);
+}
+
+#pragma endregion
@@ -106,6 +106,17 @@ GetTimeZoneBiasMinutes()
     return static_cast<int>((biased - unbiased) / (10000000 * 60));
 }
 
+// Sort key for projection nodes: property index, then whole property before
+// array elements, then array index.
+static unsigned
+ProjectionNodeKey(
+    USHORT propertyIndex,
+    USHORT arrayIndex) noexcept
+{
+    return (static_cast<unsigned>(propertyIndex) << 16) |
+        static_cast<USHORT>(arrayIndex + 1u); // NoArrayIndex -> 0.
+}
+
 enum EtwEnumerator::SubState
     : UCHAR
 {
@@ -122,6 +133,49 @@ enum EtwEnumerator::SubState
     SubState_StructEnd,
 };
 
+enum EtwEnumerator::PlanShape
+    : UCHAR
+{
+    PlanShape_Scalar,       // Single value.
+    PlanShape_Struct,       // Single struct.
+    PlanShape_Array,        // Array of values.
+    PlanShape_StructArray,  // Array of structs.
+};
+
+enum EtwEnumerator::PlanSize
+    : UCHAR
+{
+    PlanSize_Fixed,               // CbElement bytes.
+    PlanSize_Pointer,             // PointerSize() bytes.
+    PlanSize_Null,                // 0 bytes.
+    PlanSize_Length,              // Length bytes.
+    PlanSize_Length16,            // Length UTF-16 code units.
+    PlanSize_AnsiZ,               // Nul-terminated 8-bit string.
+    PlanSize_Utf16Z,              // Nul-terminated UTF-16 string.
+    PlanSize_Counted,             // Little-endian UINT16 byte count, then bytes.
+    PlanSize_Counted16,           // Same as Counted, rounded to multiple of 2.
+    PlanSize_ReversedCounted,     // Big-endian UINT16 byte count, then bytes.
+    PlanSize_ReversedCounted16,   // Same as ReversedCounted, rounded to multiple of 2.
+    PlanSize_HexDump,             // UINT32 byte count, then bytes.
+    PlanSize_NonNullTerminated,   // Rest of event.
+    PlanSize_NonNullTerminated16, // Rest of event, rounded to multiple of 2.
+    PlanSize_Sid,                 // SID.
+    PlanSize_WbemSid,             // TOKEN_USER, then SID.
+    PlanSize_Unsupported,         // Unrecognized InType.
+};
+
+enum EtwEnumerator::PlanFlags
+    : UCHAR
+{
+    PlanFlags_None = 0,
+    PlanFlags_CountFromProperty = 0x01,  // Count is the index of the count property.
+    PlanFlags_LengthFromProperty = 0x02, // Length is the index of the length property.
+    PlanFlags_RememberInteger = 0x04,    // Save value for use as a count or length.
+    PlanFlags_Referenced = 0x08,         // Used as the count or length of another property.
+    PlanFlags_Grouped = 0x10,            // Offset has been computed (CompilePlan only).
+    PlanFlags_Sized = 0x20,              // CbStruct has been computed (CompilePlan only).
+};
+
 EtwEnumerator::~EtwEnumerator()
 {
     // Can't use the compiler-generated destructor because it leads to a link
@@ -132,6 +186,7 @@ EtwEnumerator::~EtwEnumerator()
 EtwEnumerator::EtwEnumerator(
     EtwEnumeratorCallbacks& enumeratorCallbacks) noexcept
     : m_pTraceEventInfo()
+    , m_pPlan()
     , m_pEventRecord()
     , m_pbDataEnd()
     , m_pbDataNext()
@@ -144,17 +199,37 @@ EtwEnumerator::EtwEnumerator(
     , m_state(EtwEnumeratorState_None)
     , m_subState(SubState_None)
     , m_cbPointerFallback(sizeof(void*))
+    , m_decodePlansEnabled(true)
+    , m_itemTapeEnabled(false)
+    , m_tapeRecording(false)
+    , m_tapeActive(false)
     , m_lastError(ERROR_SUCCESS)
+    , m_tapeError(ERROR_SUCCESS)
+    , m_tapeIndex(NoTapeIndex)
     , m_timestampFormat(EtwTimestampFormat_Default)
+    , m_floatFormat(EtwFloatFormat_Default)
     , m_timeZoneBiasMinutes(GetTimeZoneBiasMinutes())
     , m_ticksToMilliseconds()
     , m_enumeratorCallbacks(enumeratorCallbacks)
+    , m_pFlushSink()
+    , m_cchFlushed()
+    , m_flushUtf8()
+    , m_sinkWritten()
     , m_integerValues()
     , m_stack()
     , m_stringBuffer()
     , m_stringBuffer2()
+    , m_utf8Buffer()
     , m_teiBuffer()
     , m_mapBuffer()
+    , m_planBuffer()
+    , m_tape()
+    , m_tapeOpenItems()
+    , m_messageBuffer()
+    , m_schemaCache()
+    , m_mapCache()
+    , m_messageCache()
+    , m_timestampCache()
 {
     // Note: we capture time zone bias at construction so we get consistent
     // time zone adjustment for the entire trace, even if time zone changes
@@ -243,42 +318,86 @@ EtwEnumerator::StartEvent(
     _In_ EVENT_RECORD const* pEventRecord) noexcept
 {
     // Note: to maintain consistent behavior, every path through this function
-    // should call either SetNoneState() or StartEventWithEventInfo().
+    // should call either SetNoneState() or StartEventImpl().
 
     bool succeeded;
-
-    for (;;)
+    EtwInternal::SchemaCache::Key cacheKey;
+    TRACE_EVENT_INFO const* pCachedTei = nullptr;
+    void const* pCachedPlan = nullptr;
+    bool const useCache =
+        m_schemaCache.Capacity() != 0 &&
+        !(pEventRecord->EventHeader.Flags & EVENT_HEADER_FLAG_TRACE_MESSAGE);
+
+    if (useCache)
     {
-        ULONG cbTei = m_teiBuffer.capacity();
-        PTRACE_EVENT_INFO pTei = reinterpret_cast<PTRACE_EVENT_INFO>(m_teiBuffer.data());
+        EtwInternal::SchemaCache::MakeKey(pEventRecord, &cacheKey);
+        pCachedTei = m_schemaCache.Find(cacheKey, &pCachedPlan);
+    }
 
-        LSTATUS status = m_enumeratorCallbacks.GetEventInformation(
+    if (pCachedTei != nullptr)
+    {
+        succeeded = StartEventImpl(
             pEventRecord,
-            0,
-            nullptr,
-            pTei,
-            &cbTei);
-        if (status == ERROR_SUCCESS)
+            pCachedTei,
+            m_decodePlansEnabled ? static_cast<PlanOp const*>(pCachedPlan) : nullptr);
+    }
+    else
+    {
+        for (;;)
         {
-            succeeded = StartEventWithTraceEventInfo(
+            ULONG cbTei = m_teiBuffer.capacity();
+            PTRACE_EVENT_INFO pTei = reinterpret_cast<PTRACE_EVENT_INFO>(m_teiBuffer.data());
+
+            LSTATUS status = m_enumeratorCallbacks.GetEventInformation(
                 pEventRecord,
-                pTei);
-            break;
-        }
-        else if (
-            status != ERROR_INSUFFICIENT_BUFFER ||
-            m_teiBuffer.capacity() >= cbTei)
-        {
-            // If we return ERROR_INSUFFICIENT_BUFFER it means
-            // GetEventInformation has a bug (it did not set cbTei correctly).
-            ASSERT(status != ERROR_INSUFFICIENT_BUFFER);
-            succeeded = SetNoneState(status);
-            break;
-        }
-        else if (!m_teiBuffer.reserve(cbTei, false))
-        {
-            succeeded = SetNoneState(ERROR_OUTOFMEMORY);
-            break;
+                0,
+                nullptr,
+                pTei,
+                &cbTei);
+            if (status == ERROR_SUCCESS)
+            {
+                if (useCache)
+                {
+                    // On success, cbTei might not have been updated.
+                    auto const cbUsed = cbTei < m_teiBuffer.capacity()
+                        ? cbTei
+                        : m_teiBuffer.capacity();
+                    bool const planned = CompilePlan(pTei, m_planBuffer);
+                    pCachedTei = m_schemaCache.Insert(
+                        cacheKey,
+                        pTei,
+                        cbUsed,
+                        m_planBuffer.data(),
+                        planned ? m_planBuffer.byte_size() : 0u,
+                        &pCachedPlan);
+                }
+
+                succeeded = pCachedTei != nullptr
+                    ? StartEventImpl(
+                        pEventRecord,
+                        pCachedTei,
+                        m_decodePlansEnabled ? static_cast<PlanOp const*>(pCachedPlan) : nullptr)
+                    : StartEventImpl(
+                        pEventRecord,
+                        pTei,
+                        nullptr);
+                break;
+            }
+            else if (
+                status != ERROR_INSUFFICIENT_BUFFER ||
+                m_teiBuffer.capacity() >= cbTei)
+            {
+                // If we return ERROR_INSUFFICIENT_BUFFER it means
+                // GetEventInformation has a bug (it did not set cbTei correctly).
+                ASSERT(status != ERROR_INSUFFICIENT_BUFFER);
+                succeeded = SetNoneState(status);
+                break;
+            }
+            else if (!m_teiBuffer.reserve(cbTei, false))
+            {
+                succeeded = SetNoneState(ERROR_OUTOFMEMORY);
+                break;
+            }
         }
     }
 
@@ -289,6 +408,15 @@ bool
 EtwEnumerator::StartEventWithTraceEventInfo(
     _In_ EVENT_RECORD const* pEventRecord,
     _In_ TRACE_EVENT_INFO const* pTraceEventInfo) noexcept
+{
+    return StartEventImpl(pEventRecord, pTraceEventInfo, nullptr);
+}
+
+bool
+EtwEnumerator::StartEventImpl(
+    _In_ EVENT_RECORD const* pEventRecord,
+    _In_ TRACE_EVENT_INFO const* pTraceEventInfo,
+    _In_opt_ PlanOp const* pPlan) noexcept
 {
     // Note: to maintain consistent behavior, every path through this function
     // should call either SetNoneState() or ResetImpl().
@@ -308,6 +436,7 @@ EtwEnumerator::StartEventWithTraceEventInfo(
     else
     {
         m_pTraceEventInfo = pTraceEventInfo;
+        m_pPlan = pPlan;
         m_pEventRecord = pEventRecord;
         m_pbDataEnd = static_cast<BYTE const*>(m_pEventRecord->UserData) + m_pEventRecord->UserDataLength;
 
@@ -316,7 +445,12 @@ EtwEnumerator::StartEventWithTraceEventInfo(
         // an invalid property as an array length or field size.
         memset(m_integerValues.data(), 0xff, m_integerValues.byte_size());
 
+        m_tape.clear();
+        m_tapeOpenItems.clear();
+        m_tapeRecording = false;
         ResetImpl();
+        m_tapeRecording = m_itemTapeEnabled;
+
         succeeded = true;
     }
 
@@ -336,6 +470,14 @@ EtwEnumerator::ResetImpl() noexcept
     ASSERT(m_pTraceEventInfo != nullptr);
     ASSERT(m_pEventRecord != nullptr);
 
+    if (m_tapeRecording)
+    {
+        // Record the rest of the event so that later passes can replay it.
+        while (MoveNext())
+        {
+        }
+    }
+
     m_pbDataNext = static_cast<BYTE const*>(m_pEventRecord->UserData);
     ASSERT(m_pbDataEnd == m_pbDataNext + m_pEventRecord->UserDataLength);
 
@@ -346,6 +488,109 @@ EtwEnumerator::ResetImpl() noexcept
 
     SetState(EtwEnumeratorState_BeforeFirstItem, SubState_BeforeFirstItem);
     m_lastError = ERROR_SUCCESS;
+
+    m_tapeIndex = NoTapeIndex;
+    m_tapeActive = m_tape.size() != 0;
+}
+
+void
+EtwEnumerator::RecordTapeItem() noexcept
+{
+    ASSERT(m_tapeRecording);
+
+    unsigned const tapeIndex = m_tape.size();
+    TapeItem item;
+    item.pbDataNext = m_pbDataNext;
+    item.pbCooked = m_pbCooked;
+    item.EndIndex = NoTapeIndex;
+    item.StackTop = m_stackTop;
+    item.cbCooked = m_cbCooked;
+    item.cbRaw = m_cbRaw;
+    item.CookedInType = m_cookedInType;
+    item.cbElement = m_cbElement;
+    item.StackSize = static_cast<USHORT>(m_stack.size());
+    item.State = m_state;
+    item.SubState = m_subState;
+
+    if ((m_subState == SubState_ArrayEnd || m_subState == SubState_StructEnd) &&
+        m_tapeOpenItems.size() != 0)
+    {
+        m_tape[m_tapeOpenItems[m_tapeOpenItems.size() - 1]].EndIndex = tapeIndex;
+        m_tapeOpenItems.pop_back();
+    }
+
+    if (!m_tape.push_back(item) ||
+        ((m_subState == SubState_ArrayBegin || m_subState == SubState_StructBegin) &&
+            !m_tapeOpenItems.push_back(tapeIndex)))
+    {
+        // Out of memory: decode normally.
+        m_tape.clear();
+        m_tapeRecording = false;
+    }
+    else if (m_state <= EtwEnumeratorState_BeforeFirstItem)
+    {
+        // End of event: the tape is complete.
+        m_tapeError = m_lastError;
+        m_tapeRecording = false;
+    }
+
+    m_tapeIndex = tapeIndex;
+}
+
+void
+EtwEnumerator::FinishTape() noexcept
+{
+    ASSERT(m_tapeRecording);
+
+    auto const tapeIndex = m_tapeIndex;
+
+    // Record the rest of the event, then return to the current item by
+    // replaying the tape (or by decoding normally if out of memory).
+    ResetImpl();
+    for (unsigned i = 0; i != tapeIndex + 1; i += 1)
+    {
+        MoveNext();
+    }
+}
+
+bool
+EtwEnumerator::TapeMoveTo(
+    unsigned tapeIndex) noexcept
+{
+    ASSERT(m_tapeActive);
+    ASSERT(tapeIndex < m_tape.size());
+
+    auto const& item = m_tape[tapeIndex];
+    if (item.StackSize <= m_stack.size())
+    {
+        m_stack.resize_unchecked(item.StackSize);
+    }
+    else if (item.State > EtwEnumeratorState_BeforeFirstItem)
+    {
+        // Entering a struct: same as MoveNext from StructBegin.
+        ASSERT(item.StackSize == m_stack.size() + 1);
+        ASSERT(m_subState == SubState_StructBegin);
+        if (!m_stack.push_back(m_stackTop))
+        {
+            return SetErrorState(ERROR_OUTOFMEMORY);
+        }
+    }
+    // else: end of the tape, where the stack is not used.
+
+    m_pbDataNext = item.pbDataNext;
+    m_pbCooked = item.pbCooked;
+    m_cbCooked = item.cbCooked;
+    m_cbRaw = item.cbRaw;
+    m_cookedInType = item.CookedInType;
+    m_cbElement = item.cbElement;
+    m_stackTop = item.StackTop;
+    m_state = static_cast<EtwEnumeratorState>(item.State);
+    m_subState = static_cast<SubState>(item.SubState);
+    m_tapeIndex = tapeIndex;
+
+    bool const movedToItem = m_state > EtwEnumeratorState_BeforeFirstItem;
+    m_lastError = movedToItem ? ERROR_SUCCESS : m_tapeError;
+    return movedToItem;
 }
 
 bool
@@ -355,6 +600,12 @@ EtwEnumerator::MoveNext() noexcept
 
     bool movedToItem;
 
+    if (m_tapeActive)
+    {
+        // The tape always ends with a non-item (AfterLastItem or Error).
+        return TapeMoveTo(m_tapeIndex + 1);
+    }
+
     switch (m_subState)
     {
     default:
@@ -491,12 +742,19 @@ EtwEnumerator::MoveNext() noexcept
         {
             movedToItem = SetErrorState(ERROR_OUTOFMEMORY);
         }
+        else if (m_pPlan != nullptr)
+        {
+            auto& op = m_pPlan[m_stackTop.PropertyIndex];
+            m_stackTop.PropertyIndex = op.StructBegin;
+            m_stackTop.PropertyEnd = op.StructEnd;
+            movedToItem = NextPropertyFromPlan();
+        }
         else
         {
             auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
             m_stackTop.PropertyIndex = epi.structType.StructStartIndex;
             m_stackTop.PropertyEnd = static_cast<USHORT>(m_stackTop.PropertyIndex + epi.structType.NumOfStructMembers);
-            movedToItem = NextProperty();
+            movedToItem = NextPropertyFromTei();
         }
 
         break;
@@ -536,6 +794,11 @@ EtwEnumerator::MoveNext() noexcept
         break;
     }
 
+    if (m_tapeRecording)
+    {
+        RecordTapeItem();
+    }
+
     return movedToItem;
 }
 
@@ -547,6 +810,27 @@ EtwEnumerator::MoveNextSibling() noexcept
     bool movedToItem;
     int depth = 0;
 
+    if (m_tapeRecording)
+    {
+        FinishTape();
+    }
+
+    if (m_tapeActive)
+    {
+        unsigned nextIndex = m_tapeIndex + 1;
+        if (m_subState == SubState_ArrayBegin || m_subState == SubState_StructBegin)
+        {
+            // Move past the matching end. If there is no matching end, the
+            // tape ended (with an error) within this item.
+            auto const endIndex = m_tape[m_tapeIndex].EndIndex;
+            nextIndex = endIndex != NoTapeIndex
+                ? endIndex + 1
+                : m_tape.size() - 1;
+        }
+
+        return TapeMoveTo(nextIndex);
+    }
+
     do
     {
         switch (m_subState)
@@ -560,11 +844,26 @@ EtwEnumerator::MoveNextSibling() noexcept
             break;
 
         case SubState_StructBegin:
+            if (!m_stackTop.IsArray && CurrentFixedStructSize() != PlanNone)
+            {
+                // Struct with fixed size - skip to next sibling.
+                movedToItem = SkipFixedStructs(1);
+                continue; // Don't call MoveNext() for this iteration.
+            }
+
             depth += 1;
             break;
 
         case SubState_ArrayBegin:
-            if (m_cbElement != 0)
+            if (m_cbElement == 0 && m_stackTop.IsStruct && CurrentFixedStructSize() != PlanNone)
+            {
+                // Array of fixed-size structs - skip to next sibling.
+                ASSERT(m_state == EtwEnumeratorState_ArrayBegin);
+                ASSERT(m_stackTop.ArrayIndex == 0);
+                movedToItem = SkipFixedStructs(m_stackTop.ArrayCount);
+                continue; // Don't call MoveNext() for this iteration.
+            }
+            else if (m_cbElement != 0)
             {
                 // Array of simple elements - skip to next sibling.
                 ASSERT(m_state == EtwEnumeratorState_ArrayBegin);
@@ -591,383 +890,1780 @@ EtwEnumerator::MoveNextSibling() noexcept
     return movedToItem;
 }
 
-EtwEventInfo
-EtwEnumerator::GetEventInfo() const noexcept
+bool
+EtwEnumerator::FindProjectionSchema(
+    EtwFieldProjection& projection,
+    _Out_ unsigned* pSchemaIndex) noexcept
 {
-    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+    EtwInternal::SchemaCache::Key key;
+    EtwInternal::SchemaCache::MakeKey(m_pEventRecord, &key);
 
-    EtwEventInfo value;
+    auto const schemaIndex = projection.m_schemaIds.Find(key, static_cast<EtwJsonSuffixFlags>(0));
+    if (schemaIndex != EtwJsonSchemaTable::NoSchema)
+    {
+        *pSchemaIndex = schemaIndex;
+        return true;
+    }
 
-    value.Name = EventName();
-    value.Reserved_Tags = m_pTraceEventInfo->Tags;
-    value.BinaryXmlSize = m_pTraceEventInfo->BinaryXMLSize;
-    value.BinaryXml = m_pTraceEventInfo->BinaryXMLOffset == 0
-        ? nullptr
-        : reinterpret_cast<BYTE const*>(m_pTraceEventInfo) + m_pTraceEventInfo->BinaryXMLOffset;
-    //value.DecodeGuid = decoding-source-dependent;
-    //value.ControlGuid = decoding-source-dependent;
-    //value.EventGuid = decoding-source-dependent;
-    value.ProviderName = TeiString(m_pTraceEventInfo->ProviderNameOffset);
-    value.LevelName = TeiString(m_pTraceEventInfo->LevelNameOffset);
-    value.ChannelName = TeiString(m_pTraceEventInfo->ChannelNameOffset);
-    value.KeywordsName = TeiString(m_pTraceEventInfo->KeywordsNameOffset);
-    value.TaskName = TaskName();
-    value.OpcodeName = OpcodeName();
-    value.EventMessage = TeiString(m_pTraceEventInfo->EventMessageOffset);
-    value.ProviderMessage = TeiString(m_pTraceEventInfo->ProviderMessageOffset);
-    value.EventAttributes = EventAttributes();
-    //value.WbemActivityIdName = decoding-source-dependent;
-    //value.WbemRelatedActivityIdName = decoding-source-dependent;
+    return AddProjectionSchema(projection, key, pSchemaIndex);
+}
 
-    if (m_pTraceEventInfo->DecodingSource == DecodingSourceWbem)
+bool
+EtwEnumerator::AddProjectionSchema(
+    EtwFieldProjection& projection,
+    EtwInternal::SchemaCache::Key const& key,
+    _Out_ unsigned* pSchemaIndex) noexcept
+{
+    using Projection = EtwFieldProjection;
+
+    auto const pTei = m_pTraceEventInfo;
+    unsigned const propertyCount = pTei->PropertyCount <= 0xffff ? pTei->PropertyCount : 0u;
+    unsigned const topLevelCount = pTei->TopLevelPropertyCount <= propertyCount ? pTei->TopLevelPropertyCount : 0u;
+    auto const oldNodesSize = projection.m_nodes.size();
+    auto const oldOffsetsSize = projection.m_offsets.size();
+    auto& nodes = projection.m_nodes;
+    Projection::Schema schema = { Projection::NoNode, oldOffsetsSize };
+    EtwInternal::Buffer<PlanOp> plan;
+    EtwInternal::Buffer<USHORT, EtwFieldProjection::MaxPathSteps> resolved; // Property index of each step.
+    bool ok = false;
+
+    *pSchemaIndex = Projection::NoNode;
+
+    if (!projection.m_offsets.resize(oldOffsetsSize + propertyCount))
     {
-        if (m_pTraceEventInfo->EventGuid == GUID())
+        goto Done;
+    }
+
+    memset(projection.m_offsets.data() + oldOffsetsSize, 0xff, propertyCount * sizeof(USHORT)); // NoOffset
+
+    // Fixed offsets within each group of properties (see CompilePlan).
+    if (CompilePlan(pTei, plan))
+    {
+        auto const pOffsets = projection.m_offsets.data() + oldOffsetsSize;
+        for (unsigned i = 0; i != propertyCount; i += 1)
         {
-            value.DecodeGuid = &m_pTraceEventInfo->ProviderGuid;
-            value.ControlGuid = &m_pTraceEventInfo->ProviderGuid;
+            static_assert(PlanNone == EtwFieldProjection::NoOffset, "PlanNone != NoOffset");
+            pOffsets[i] = plan[i].Offset;
         }
-        else
+    }
+
+    // Resolve each path and add its nodes.
+    for (unsigned pathIndex = 0; pathIndex != projection.m_paths.size(); pathIndex += 1)
+    {
+        unsigned const firstStep = projection.m_pathSteps[pathIndex];
+        unsigned const stepCount = projection.m_pathSteps[pathIndex + 1] - firstStep;
+        unsigned groupBegin = 0;
+        unsigned groupEnd = topLevelCount;
+
+        resolved.clear();
+        for (unsigned stepIndex = 0; stepIndex != stepCount; stepIndex += 1)
         {
-            value.DecodeGuid = &m_pTraceEventInfo->EventGuid;
-            value.ControlGuid = &m_pTraceEventInfo->ProviderGuid;
+            auto const& step = projection.m_steps[firstStep + stepIndex];
+            auto const pchName = projection.m_text.data() + step.NameOffset;
+            unsigned propertyIndex = groupBegin;
+            for (; propertyIndex != groupEnd; propertyIndex += 1)
+            {
+                auto const szPropertyName = TeiString(pTei->EventPropertyInfoArray[propertyIndex].NameOffset);
+                if (szPropertyName != nullptr &&
+                    0 == wcsncmp(szPropertyName, pchName, step.NameLength) &&
+                    szPropertyName[step.NameLength] == 0)
+                {
+                    break;
+                }
+            }
+
+            if (propertyIndex == groupEnd)
+            {
+                break; // Name not found.
+            }
+
+            auto const& epi = pTei->EventPropertyInfoArray[propertyIndex];
+            bool const isArray =
+                0 != (epi.Flags & (PropertyParamCount | PropertyParamFixedCount)) ||
+                epi.count != 1;
+            if (step.ArrayIndex != Projection::NoArrayIndex && !isArray)
+            {
+                break; // Index of a non-array.
+            }
+
+            if (stepIndex + 1 != stepCount)
+            {
+                if (0 == (epi.Flags & PropertyStruct) ||
+                    (isArray && step.ArrayIndex == Projection::NoArrayIndex))
+                {
+                    break; // Member of a non-struct or of a non-indexed array.
+                }
+
+                groupBegin = epi.structType.StructStartIndex;
+                groupEnd = groupBegin + epi.structType.NumOfStructMembers;
+                if (groupEnd > propertyCount)
+                {
+                    break;
+                }
+            }
+
+            if (!resolved.push_back(static_cast<USHORT>(propertyIndex)))
+            {
+                goto Done;
+            }
         }
 
-        value.EventGuid = nullptr;
-        value.WbemActivityIdName = TeiString(m_pTraceEventInfo->ActivityIDNameOffset);
-        value.WbemRelatedActivityIdName = TeiString(m_pTraceEventInfo->RelatedActivityIDNameOffset);
-    }
-    else
-    {
-        value.DecodeGuid = &m_pTraceEventInfo->ProviderGuid;
+        if (resolved.size() != stepCount)
+        {
+            continue; // Path does not fit this schema.
+        }
 
-        if (m_pTraceEventInfo->Flags & TDH_TemplateControlGuid)
+        // Find or insert a node for each step.
+        unsigned parent = Projection::NoNode;
+        for (unsigned stepIndex = 0; stepIndex != stepCount; stepIndex += 1)
         {
-            value.ControlGuid = &m_pTraceEventInfo->EventGuid;
-            value.EventGuid = nullptr;
+            auto const propertyIndex = resolved[stepIndex];
+            auto const arrayIndex = projection.m_steps[firstStep + stepIndex].ArrayIndex;
+            auto const key = ProjectionNodeKey(propertyIndex, arrayIndex);
+            unsigned prev = Projection::NoNode;
+            unsigned node = parent == Projection::NoNode
+                ? schema.FirstNode
+                : nodes[parent].FirstChild;
+            while (node != Projection::NoNode &&
+                ProjectionNodeKey(nodes[node].PropertyIndex, nodes[node].ArrayIndex) < key)
+            {
+                prev = node;
+                node = nodes[node].NextSibling;
+            }
+
+            if (node == Projection::NoNode ||
+                ProjectionNodeKey(nodes[node].PropertyIndex, nodes[node].ArrayIndex) != key)
+            {
+                Projection::Node newNode;
+                newNode.FirstChild = Projection::NoNode;
+                newNode.NextSibling = node;
+                newNode.FieldIndex = Projection::NoField;
+                newNode.PropertyIndex = propertyIndex;
+                newNode.ArrayIndex = arrayIndex;
+
+                node = nodes.size();
+                if (!nodes.push_back(newNode))
+                {
+                    goto Done;
+                }
+
+                if (prev != Projection::NoNode)
+                {
+                    nodes[prev].NextSibling = node;
+                }
+                else if (parent != Projection::NoNode)
+                {
+                    nodes[parent].FirstChild = node;
+                }
+                else
+                {
+                    schema.FirstNode = node;
+                }
+            }
+
+            parent = node;
         }
-        else
+
+        if (nodes[parent].FieldIndex == Projection::NoField)
         {
-            value.ControlGuid = &m_pTraceEventInfo->ProviderGuid;
-            value.EventGuid = m_pTraceEventInfo->EventGuid == GUID()
-                ? nullptr
-                : &m_pTraceEventInfo->EventGuid;
+            nodes[parent].FieldIndex = pathIndex;
         }
+    }
 
-        value.WbemActivityIdName = nullptr;
-        value.WbemRelatedActivityIdName = nullptr;
+    if (!projection.m_schemas.push_back(schema))
+    {
+        goto Done;
     }
 
-    // PREfast is unhappy about us returning pointers into m_pTraceEventInfo
-    // that it can't prove are valid pointers.
-#pragma warning(suppress: 26045)
-    return value;
+    if (!projection.m_schemaIds.Add(key, static_cast<EtwJsonSuffixFlags>(0)))
+    {
+        projection.m_schemas.pop_back();
+        goto Done;
+    }
+
+    ASSERT(projection.m_schemas.size() == projection.m_schemaIds.Count());
+    *pSchemaIndex = projection.m_schemas.size() - 1;
+    ok = true;
+
+Done:
+
+    if (!ok)
+    {
+        nodes.resize_unchecked(oldNodesSize);
+        projection.m_offsets.resize_unchecked(oldOffsetsSize);
+    }
+
+    return ok;
 }
 
-EtwItemInfo
-EtwEnumerator::GetItemInfo() const noexcept
+bool
+EtwEnumerator::SkipToProperty(
+    USHORT propertyIndex,
+    _In_opt_ USHORT const* pFixedOffsets,
+    unsigned stackSize) noexcept
 {
-    ASSERT(m_state > EtwEnumeratorState_BeforeFirstItem); // PRECONDITION
+    while (
+        m_state != EtwEnumeratorState_AfterLastItem &&
+        !(m_state == EtwEnumeratorState_StructEnd && m_stack.size() < stackSize) &&
+        m_stackTop.PropertyIndex < propertyIndex)
+    {
+        if (pFixedOffsets != nullptr &&
+            (m_subState == SubState_Value_Scalar ||
+                m_subState == SubState_ArrayBegin ||
+                m_subState == SubState_StructBegin))
+        {
+            // Positioned at the start of a property. If the target and all
+            // properties before it are fixed-size, jump to the target.
+            auto const offset = pFixedOffsets[m_stackTop.PropertyIndex];
+            auto const targetOffset = pFixedOffsets[propertyIndex];
+            if (offset != EtwFieldProjection::NoOffset &&
+                targetOffset != EtwFieldProjection::NoOffset &&
+                offset <= targetOffset)
+            {
+                unsigned const cbSkip = targetOffset - offset;
+                if (static_cast<unsigned>(m_pbDataEnd - m_pbDataNext) < cbSkip)
+                {
+                    return SetErrorState(ERROR_INVALID_DATA);
+                }
 
-    UINT32 const IsArrayMask = 1 << 28;
-    EtwItemInfo value;
+                m_pbDataNext += cbSkip;
+                m_stackTop.PropertyIndex = propertyIndex;
+                return NextProperty();
+            }
+        }
 
-    auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
-    value.Name = epi.NameOffset ? TeiStringNoCheck(epi.NameOffset) : L"";
-    value.Reserved_Tags =
-        (m_stackTop.IsArray ? IsArrayMask : 0u) |
-        (epi.Flags & PropertyHasTags ? epi.Tags : 0u);
-    value.InType = static_cast<_TDH_IN_TYPE>(m_cookedInType);
-    value.OutType = 0 != (epi.Flags & PropertyStruct)
-        ? TDH_OUTTYPE_NULL
-        : static_cast<_TDH_OUT_TYPE>(epi.nonStructType.OutType);
-    value.ArrayIndex = m_stackTop.ArrayIndex;
-    value.ArrayCount = m_stackTop.ArrayCount;
-    value.ElementSize = m_cbElement;
-    value.DataSize = m_cbCooked;
-    value.Data = m_pbCooked;
-    value.MapName =
-        epi.nonStructType.MapNameOffset == 0 ||
-        0 != (epi.Flags & (PropertyHasCustomSchema | PropertyStruct))
-        ? nullptr
-        : TeiStringNoCheck(epi.nonStructType.MapNameOffset);
+        if (!MoveNextSibling())
+        {
+            return false;
+        }
+    }
 
-    return value;
+    return true;
 }
 
 bool
-EtwEnumerator::CurrentEventHasEventMessage() const noexcept
-{
-    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
-
-    return m_pTraceEventInfo->EventMessageOffset != 0;
-}
-
-EtwRawDataPosition
-EtwEnumerator::GetRawDataPosition() const noexcept
+EtwEnumerator::GetFixedStructSize(
+    _Out_ unsigned* pcbStruct) const noexcept
 {
-    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
-
-    EtwRawDataPosition value;
+    USHORT const cbStruct = CurrentFixedStructSize();
+    unsigned const structCount = m_subState == SubState_ArrayBegin
+        ? m_stackTop.ArrayCount
+        : 1u;
 
-    value.DataSize = static_cast<USHORT>(m_pbDataEnd - m_pbDataNext);
-    value.Data = m_pbDataNext;
+    if (cbStruct == PlanNone ||
+        static_cast<unsigned>(m_pbDataEnd - m_pbDataNext) < structCount * cbStruct)
+    {
+        *pcbStruct = 0;
+        return false;
+    }
 
-    return value;
+    *pcbStruct = cbStruct;
+    return true;
 }
 
-EtwRawItemInfo
-EtwEnumerator::GetRawItemInfo() const noexcept
+/*
+Returns the fixed size of one struct if the current item is the StructBegin
+or ArrayBegin of a struct with a fixed size (see PlanStructSize). Otherwise
+returns PlanNone.
+*/
+USHORT
+EtwEnumerator::CurrentFixedStructSize() const noexcept
 {
-    ASSERT(m_state > EtwEnumeratorState_BeforeFirstItem);
-
-    EtwRawItemInfo value;
-
-    auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
-    value.RawInType = (epi.Flags & PropertyStruct)
-        ? TDH_INTYPE_NULL
-        : static_cast<_TDH_IN_TYPE>(epi.nonStructType.InType);
-    value.Flags = epi.Flags;
-    value.RawDataSize = m_cbRaw;
-    value.RawData = m_pbDataNext;
-    value.CustomSchema =
-        (epi.Flags & PropertyHasCustomSchema)
-        ? TeiString(epi.customSchemaType.CustomSchemaOffset)
-        : nullptr;
-
-    return value;
+    return m_pPlan != nullptr &&
+        m_stackTop.IsStruct &&
+        (m_subState == SubState_StructBegin || m_subState == SubState_ArrayBegin)
+        ? m_pPlan[m_stackTop.PropertyIndex].CbStruct
+        : PlanNone;
 }
 
+/*
+Skips structCount structs of the current property's fixed size and moves to
+the next property.
+*/
 bool
-EtwEnumerator::FindCurrentEventAttribute(
-    _In_z_ EtwPCWSTR szAttributeName,
-    _Out_ EtwStringViewZ* pString) noexcept
+EtwEnumerator::SkipFixedStructs(
+    unsigned structCount) noexcept
 {
-    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+    unsigned const cbSkip = structCount * m_pPlan[m_stackTop.PropertyIndex].CbStruct;
+    if (static_cast<unsigned>(m_pbDataEnd - m_pbDataNext) < cbSkip)
+    {
+        return SetErrorState(ERROR_INVALID_DATA);
+    }
 
-    return FindEventAttribute(EventAttributes(), szAttributeName, pString);
+    m_pbDataNext += cbSkip;
+    m_stackTop.PropertyIndex += 1;
+    return NextProperty();
 }
 
-bool
-EtwEnumerator::FindEventAttribute(
-    _In_opt_z_ EtwPCWSTR szEventAttributes,
-    _In_z_ EtwPCWSTR szAttributeName,
-    _Out_ EtwStringViewZ* pString) noexcept
+void
+EtwEnumerator::MoveToSimpleArrayElement(
+    USHORT arrayIndex) noexcept
 {
-    m_stringBuffer.clear();
-    if (szEventAttributes == nullptr)
-    {
-        m_lastError = ERROR_NOT_FOUND;
-    }
-    else
+    ASSERT(m_stackTop.IsArray);
+    ASSERT(m_cbElement != 0);
+    ASSERT(arrayIndex < m_stackTop.ArrayCount);
+    ASSERT(m_subState == SubState_ArrayBegin || (
+        m_subState == SubState_Value_SimpleArrayElement &&
+        m_stackTop.ArrayIndex <= arrayIndex));
+
+    if (m_tapeActive)
     {
-        m_lastError = AppendEventAttribute(
-            m_stringBuffer,
-            szEventAttributes,
-            static_cast<unsigned>(wcslen(szEventAttributes)),
-            szAttributeName,
-            static_cast<unsigned>(wcslen(szAttributeName)));
+        // Elements are recorded in order, right after the ArrayBegin.
+        TapeMoveTo(m_subState == SubState_ArrayBegin
+            ? m_tapeIndex + 1 + arrayIndex
+            : m_tapeIndex + (arrayIndex - m_stackTop.ArrayIndex));
+        return;
     }
 
-    return StringViewResult(m_stringBuffer, pString);
+    // The array's size was validated at ArrayBegin.
+    unsigned const currentIndex = m_subState == SubState_ArrayBegin
+        ? 0u
+        : m_stackTop.ArrayIndex;
+    m_pbDataNext += static_cast<unsigned>(arrayIndex - currentIndex) * m_cbElement;
+    m_stackTop.ArrayIndex = arrayIndex;
+    m_cbCooked = m_cbElement;
+    m_cbRaw = m_cbCooked;
+    SetState(EtwEnumeratorState_Value, SubState_Value_SimpleArrayElement);
+    StartValueSimple();
+    m_lastError = ERROR_SUCCESS;
 }
 
 bool
-EtwEnumerator::SplitCurrentEventAttributes(
-    _Out_writes_to_(cAttributes, *pcAttributes) EtwAttributeInfo* pAttributes,
-    unsigned cAttributes,
-    _Out_ unsigned* pcAttributes) noexcept
+EtwEnumerator::MoveNextProjected(
+    EtwFieldProjection& projection,
+    _Out_ unsigned* pFieldIndex) noexcept
 {
     ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
 
-    return SplitEventAttributes(
-            EventAttributes(), pAttributes, cAttributes, pcAttributes);
-}
+    using Projection = EtwFieldProjection;
 
-bool
-EtwEnumerator::SplitEventAttributes(
-    _In_opt_z_ EtwPCWSTR szEventAttributes,
-    _Out_writes_to_(cAttributes, *pcAttributes) EtwAttributeInfo* pAttributes,
-    unsigned cAttributes,
-    _Out_ unsigned* pcAttributes) noexcept
-{
-    auto& output = m_stringBuffer;
-    unsigned cActual = 0;
-    ASSERT(cAttributes == 0 || pAttributes != nullptr);
+    auto& levels = projection.m_levels;
+    auto& returned = projection.m_returned;
+    USHORT const* pFixedOffsets;
+    bool movedToItem;
 
-    output.clear();
+    *pFieldIndex = Projection::NoField;
 
-    if (szEventAttributes == nullptr || szEventAttributes[0] == L'\0')
+    if (m_tapeRecording)
     {
-        m_lastError = ERROR_SUCCESS;
+        FinishTape();
     }
-    else if (!output.resize(
-        static_cast<unsigned>(wcslen(szEventAttributes)) + 1))
+
+    if (m_state == EtwEnumeratorState_BeforeFirstItem)
     {
-        m_lastError = ERROR_OUTOFMEMORY;
+        unsigned schemaIndex;
+
+        levels.clear();
+        projection.m_schemaIndex = Projection::NoNode;
+        if (!FindProjectionSchema(projection, &schemaIndex))
+        {
+            movedToItem = SetErrorState(ERROR_OUTOFMEMORY);
+            goto Done;
+        }
+
+        auto const& schema = projection.m_schemas[schemaIndex];
+        if (schema.FirstNode == Projection::NoNode)
+        {
+            goto NoMoreItems;
+        }
+
+        Projection::Level const level = { schema.FirstNode, 0, false };
+        if (!levels.push_back(level))
+        {
+            movedToItem = SetErrorState(ERROR_OUTOFMEMORY);
+            goto Done;
+        }
+
+        projection.m_schemaIndex = schemaIndex;
+        if (!MoveNext())
+        {
+            goto EndOfEvent;
+        }
     }
-    else
+    else if (m_state < EtwEnumeratorState_BeforeFirstItem || levels.size() == 0)
     {
-        wchar_t* pOut = output.data();
-        LPCWSTR pIn = szEventAttributes;
-        while (*pIn)
+        // Enumeration is already complete.
+        levels.clear();
+        movedToItem = false;
+        goto Done;
+    }
+    else if (
+        returned.pbData == m_pbDataNext &&
+        returned.StackSize == m_stack.size() &&
+        returned.PropertyIndex == m_stackTop.PropertyIndex &&
+        returned.ArrayIndex == m_stackTop.ArrayIndex &&
+        returned.SubState == m_subState)
+    {
+        // Still at the previously-returned item. Skip it.
+        if (!MoveNextSibling())
         {
-            LPCWSTR pName = pOut;
-            SkipTo(pIn, pOut, [](wchar_t ch) { return ch == L'=' || ch == L';'; });
-            *pOut++ = L'\0';
+            goto EndOfEvent;
+        }
+    }
 
-            // Does the attribute have a value?
-            LPCWSTR pValue;
-            if (pIn[-1] == L'=')
+    // Offset jumps are not needed when replaying the item tape.
+    pFixedOffsets = m_tapeActive
+        ? nullptr
+        : projection.m_offsets.data() + projection.m_schemas[projection.m_schemaIndex].FirstOffset;
+
+    for (;;)
+    {
+        unsigned const levelIndex = levels.size() - 1;
+        auto const stackSize = levels[levelIndex].StackSize;
+        auto const nodeIndex = levels[levelIndex].Node;
+
+        if (nodeIndex == Projection::NoNode)
+        {
+            // No more selected items at this level.
+            if (levelIndex == 0)
             {
-                pValue = pOut;
-                SkipTo(pIn, pOut, [](wchar_t ch) { return ch == L';'; });
-                *pOut++ = L'\0';
+                goto NoMoreItems;
+            }
+
+            // Skip the rest of the struct, then move past its StructEnd.
+            while (m_state != EtwEnumeratorState_StructEnd || m_stack.size() >= stackSize)
+            {
+                if (!MoveNextSibling())
+                {
+                    goto EndOfEvent;
+                }
+            }
+
+            levels.pop_back();
+            if (!MoveNext())
+            {
+                goto EndOfEvent;
+            }
+
+            continue;
+        }
+
+        auto const node = projection.m_nodes[nodeIndex];
+        levels[levelIndex].Node = node.NextSibling;
+
+        if (levels[levelIndex].InArray &&
+            (node.PropertyIndex != m_stackTop.PropertyIndex || node.ArrayIndex == Projection::NoArrayIndex))
+        {
+            // Leave the array of the previous node.
+            if (m_subState == SubState_Value_SimpleArrayElement)
+            {
+                if (m_tapeActive)
+                {
+                    TapeMoveTo(m_tapeIndex + (m_stackTop.ArrayCount - m_stackTop.ArrayIndex));
+                }
+                else
+                {
+                    m_pbDataNext += static_cast<unsigned>(m_stackTop.ArrayCount - m_stackTop.ArrayIndex) * m_cbElement;
+                    m_stackTop.ArrayIndex = m_stackTop.ArrayCount;
+                    SetEndState(EtwEnumeratorState_ArrayEnd, SubState_ArrayEnd);
+                }
+            }
+
+            while (m_subState != SubState_ArrayEnd)
+            {
+                if (!MoveNextSibling())
+                {
+                    goto EndOfEvent;
+                }
+            }
+
+            levels[levelIndex].InArray = false;
+            if (!MoveNext())
+            {
+                goto EndOfEvent;
+            }
+        }
+
+        if (!levels[levelIndex].InArray)
+        {
+            if (!SkipToProperty(node.PropertyIndex, pFixedOffsets, stackSize))
+            {
+                goto EndOfEvent;
+            }
+
+            if (m_state == EtwEnumeratorState_AfterLastItem ||
+                (m_state == EtwEnumeratorState_StructEnd && m_stack.size() < stackSize) ||
+                m_stackTop.PropertyIndex != node.PropertyIndex)
+            {
+                continue; // Not present.
+            }
+
+            if (node.ArrayIndex != Projection::NoArrayIndex)
+            {
+                if (m_subState != SubState_ArrayBegin ||
+                    node.ArrayIndex >= m_stackTop.ArrayCount)
+                {
+                    continue; // Not present.
+                }
+
+                if (m_cbElement != 0)
+                {
+                    MoveToSimpleArrayElement(node.ArrayIndex);
+                }
+                else if (!MoveNext())
+                {
+                    goto EndOfEvent;
+                }
+
+                levels[levelIndex].InArray = true;
+            }
+        }
+
+        if (node.ArrayIndex != Projection::NoArrayIndex)
+        {
+            // Within the array: move to the element.
+            if (m_subState == SubState_Value_SimpleArrayElement)
+            {
+                if (node.ArrayIndex >= m_stackTop.ArrayCount)
+                {
+                    continue; // Not present.
+                }
+
+                MoveToSimpleArrayElement(node.ArrayIndex);
             }
             else
             {
-                // We got to the end of the attribute without finding '='.
-                // Treat as an empty value.
-                pValue = &pOut[-1]; // = L""
+                while (m_subState != SubState_ArrayEnd &&
+                    m_stackTop.ArrayIndex < node.ArrayIndex)
+                {
+                    if (!MoveNextSibling())
+                    {
+                        goto EndOfEvent;
+                    }
+                }
+
+                if (m_subState == SubState_ArrayEnd ||
+                    m_stackTop.ArrayIndex != node.ArrayIndex)
+                {
+                    continue; // Not present.
+                }
             }
+        }
+
+        if (node.FieldIndex != Projection::NoField)
+        {
+            // Selected item.
+            returned.pbData = m_pbDataNext;
+            returned.StackSize = m_stack.size();
+            returned.PropertyIndex = m_stackTop.PropertyIndex;
+            returned.ArrayIndex = m_stackTop.ArrayIndex;
+            returned.SubState = m_subState;
+            *pFieldIndex = node.FieldIndex;
+            movedToItem = true;
+            goto Done;
+        }
+
+        // Ancestor of selected struct members: enter the struct.
+        if (m_state != EtwEnumeratorState_StructBegin)
+        {
+            continue; // Not present.
+        }
+
+        Projection::Level const level = { node.FirstChild, m_stack.size() + 1, false };
+        if (!levels.push_back(level))
+        {
+            movedToItem = SetErrorState(ERROR_OUTOFMEMORY);
+            goto Done;
+        }
+
+        if (!MoveNext())
+        {
+            goto EndOfEvent;
+        }
+    }
+
+NoMoreItems:
+
+    // All selected items have been visited. Skip the rest of the event.
+    levels.clear();
+    SetEndState(EtwEnumeratorState_AfterLastItem, SubState_AfterLastItem);
+    m_lastError = ERROR_SUCCESS;
+    movedToItem = false;
+    goto Done;
+
+EndOfEvent:
+
+    // Reached the end of the event (AfterLastItem) or an error (Error).
+    levels.clear();
+    movedToItem = false;
+
+Done:
+
+    return movedToItem;
+}
+
+bool
+EtwEnumerator::GetFieldByIndex(
+    unsigned propertyIndex,
+    _Out_ EtwItemInfo* pItemInfo) noexcept
+{
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    bool moved;
+
+    *pItemInfo = EtwItemInfo();
+
+    if (propertyIndex >= m_pTraceEventInfo->TopLevelPropertyCount)
+    {
+        m_lastError = ERROR_NOT_FOUND;
+        moved = false;
+        goto Done;
+    }
+
+    ResetImpl();
+
+    if (m_pPlan != nullptr && !m_tapeActive)
+    {
+        // Jump to the nearest property (at or before the target) that has a
+        // known offset. Property 0 is always at the start of the data.
+        unsigned jumpIndex = propertyIndex;
+        while (jumpIndex != 0 && m_pPlan[jumpIndex].Offset == PlanNone)
+        {
+            jumpIndex -= 1;
+        }
+
+        unsigned const offset = jumpIndex != 0 ? m_pPlan[jumpIndex].Offset : 0u;
+        if (static_cast<unsigned>(m_pbDataEnd - m_pbDataNext) < offset)
+        {
+            moved = SetErrorState(ERROR_INVALID_DATA);
+            goto Done;
+        }
+
+        m_pbDataNext += offset;
+        m_stackTop.PropertyIndex = static_cast<USHORT>(jumpIndex);
+    }
+
+    // Decode (or replay) forward from the jump target or from the start.
+    moved = MoveNext();
+    while (moved && m_stackTop.PropertyIndex != propertyIndex)
+    {
+        moved = MoveNextSibling();
+    }
+
+    if (moved)
+    {
+        *pItemInfo = GetItemInfo();
+    }
+
+Done:
+
+    return moved;
+}
+
+bool
+EtwEnumerator::GetFieldByName(
+    _In_z_ EtwPCWSTR szName,
+    _Out_ EtwItemInfo* pItemInfo) noexcept
+{
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    auto const topLevelCount = m_pTraceEventInfo->TopLevelPropertyCount;
+    auto const pProperties = m_pTraceEventInfo->EventPropertyInfoArray;
+    unsigned propertyIndex = topLevelCount; // Not found.
+
+    if (m_pPlan != nullptr)
+    {
+        if (topLevelCount != 0)
+        {
+            for (unsigned i = m_pPlan[PlanNameHash(szName) % topLevelCount].NameBucket;
+                i != PlanNone;
+                i = m_pPlan[i].NameNext)
+            {
+                if (0 == wcscmp(szName, TeiStringNoCheck(pProperties[i].NameOffset)))
+                {
+                    propertyIndex = i;
+                    break;
+                }
+            }
+        }
+    }
+    else
+    {
+        for (unsigned i = 0; i != topLevelCount; i += 1)
+        {
+            if (pProperties[i].NameOffset != 0 &&
+                0 == wcscmp(szName, TeiStringNoCheck(pProperties[i].NameOffset)))
+            {
+                propertyIndex = i;
+                break;
+            }
+        }
+    }
+
+    return GetFieldByIndex(propertyIndex, pItemInfo);
+}
+
+EtwEventInfo
+EtwEnumerator::GetEventInfo() const noexcept
+{
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    EtwEventInfo value;
+
+    value.Name = EventName();
+    value.Reserved_Tags = m_pTraceEventInfo->Tags;
+    value.BinaryXmlSize = m_pTraceEventInfo->BinaryXMLSize;
+    value.BinaryXml = m_pTraceEventInfo->BinaryXMLOffset == 0
+        ? nullptr
+        : reinterpret_cast<BYTE const*>(m_pTraceEventInfo) + m_pTraceEventInfo->BinaryXMLOffset;
+    //value.DecodeGuid = decoding-source-dependent;
+    //value.ControlGuid = decoding-source-dependent;
+    //value.EventGuid = decoding-source-dependent;
+    value.ProviderName = TeiString(m_pTraceEventInfo->ProviderNameOffset);
+    value.LevelName = TeiString(m_pTraceEventInfo->LevelNameOffset);
+    value.ChannelName = TeiString(m_pTraceEventInfo->ChannelNameOffset);
+    value.KeywordsName = TeiString(m_pTraceEventInfo->KeywordsNameOffset);
+    value.TaskName = TaskName();
+    value.OpcodeName = OpcodeName();
+    value.EventMessage = TeiString(m_pTraceEventInfo->EventMessageOffset);
+    value.ProviderMessage = TeiString(m_pTraceEventInfo->ProviderMessageOffset);
+    value.EventAttributes = EventAttributes();
+    //value.WbemActivityIdName = decoding-source-dependent;
+    //value.WbemRelatedActivityIdName = decoding-source-dependent;
+
+    if (m_pTraceEventInfo->DecodingSource == DecodingSourceWbem)
+    {
+        if (m_pTraceEventInfo->EventGuid == GUID())
+        {
+            value.DecodeGuid = &m_pTraceEventInfo->ProviderGuid;
+            value.ControlGuid = &m_pTraceEventInfo->ProviderGuid;
+        }
+        else
+        {
+            value.DecodeGuid = &m_pTraceEventInfo->EventGuid;
+            value.ControlGuid = &m_pTraceEventInfo->ProviderGuid;
+        }
+
+        value.EventGuid = nullptr;
+        value.WbemActivityIdName = TeiString(m_pTraceEventInfo->ActivityIDNameOffset);
+        value.WbemRelatedActivityIdName = TeiString(m_pTraceEventInfo->RelatedActivityIDNameOffset);
+    }
+    else
+    {
+        value.DecodeGuid = &m_pTraceEventInfo->ProviderGuid;
+
+        if (m_pTraceEventInfo->Flags & TDH_TemplateControlGuid)
+        {
+            value.ControlGuid = &m_pTraceEventInfo->EventGuid;
+            value.EventGuid = nullptr;
+        }
+        else
+        {
+            value.ControlGuid = &m_pTraceEventInfo->ProviderGuid;
+            value.EventGuid = m_pTraceEventInfo->EventGuid == GUID()
+                ? nullptr
+                : &m_pTraceEventInfo->EventGuid;
+        }
+
+        value.WbemActivityIdName = nullptr;
+        value.WbemRelatedActivityIdName = nullptr;
+    }
+
+    // PREfast is unhappy about us returning pointers into m_pTraceEventInfo
+    // that it can't prove are valid pointers.
+#pragma warning(suppress: 26045)
+    return value;
+}
+
+EtwItemInfo
+EtwEnumerator::GetItemInfo() const noexcept
+{
+    ASSERT(m_state > EtwEnumeratorState_BeforeFirstItem); // PRECONDITION
+
+    UINT32 const IsArrayMask = 1 << 28;
+    EtwItemInfo value;
+
+    auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
+    value.Name = epi.NameOffset ? TeiStringNoCheck(epi.NameOffset) : L"";
+    value.Reserved_Tags =
+        (m_stackTop.IsArray ? IsArrayMask : 0u) |
+        (epi.Flags & PropertyHasTags ? epi.Tags : 0u);
+    value.InType = static_cast<_TDH_IN_TYPE>(m_cookedInType);
+    value.OutType = 0 != (epi.Flags & PropertyStruct)
+        ? TDH_OUTTYPE_NULL
+        : static_cast<_TDH_OUT_TYPE>(epi.nonStructType.OutType);
+    value.ArrayIndex = m_stackTop.ArrayIndex;
+    value.ArrayCount = m_stackTop.ArrayCount;
+    value.ElementSize = m_cbElement;
+    value.DataSize = m_cbCooked;
+    value.Data = m_pbCooked;
+    value.MapName =
+        epi.nonStructType.MapNameOffset == 0 ||
+        0 != (epi.Flags & (PropertyHasCustomSchema | PropertyStruct))
+        ? nullptr
+        : TeiStringNoCheck(epi.nonStructType.MapNameOffset);
+
+    return value;
+}
+
+bool
+EtwEnumerator::CurrentEventHasEventMessage() const noexcept
+{
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    return m_pTraceEventInfo->EventMessageOffset != 0;
+}
+
+EtwRawDataPosition
+EtwEnumerator::GetRawDataPosition() const noexcept
+{
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    EtwRawDataPosition value;
+
+    value.DataSize = static_cast<USHORT>(m_pbDataEnd - m_pbDataNext);
+    value.Data = m_pbDataNext;
+
+    return value;
+}
+
+EtwRawItemInfo
+EtwEnumerator::GetRawItemInfo() const noexcept
+{
+    ASSERT(m_state > EtwEnumeratorState_BeforeFirstItem);
+
+    EtwRawItemInfo value;
+
+    auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
+    value.RawInType = (epi.Flags & PropertyStruct)
+        ? TDH_INTYPE_NULL
+        : static_cast<_TDH_IN_TYPE>(epi.nonStructType.InType);
+    value.Flags = epi.Flags;
+    value.RawDataSize = m_cbRaw;
+    value.RawData = m_pbDataNext;
+    value.CustomSchema =
+        (epi.Flags & PropertyHasCustomSchema)
+        ? TeiString(epi.customSchemaType.CustomSchemaOffset)
+        : nullptr;
+
+    return value;
+}
+
+bool
+EtwEnumerator::FindCurrentEventAttribute(
+    _In_z_ EtwPCWSTR szAttributeName,
+    _Out_ EtwStringViewZ* pString) noexcept
+{
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    return FindEventAttribute(EventAttributes(), szAttributeName, pString);
+}
+
+bool
+EtwEnumerator::FindEventAttribute(
+    _In_opt_z_ EtwPCWSTR szEventAttributes,
+    _In_z_ EtwPCWSTR szAttributeName,
+    _Out_ EtwStringViewZ* pString) noexcept
+{
+    m_stringBuffer.clear();
+    if (szEventAttributes == nullptr)
+    {
+        m_lastError = ERROR_NOT_FOUND;
+    }
+    else
+    {
+        m_lastError = AppendEventAttribute(
+            m_stringBuffer,
+            szEventAttributes,
+            static_cast<unsigned>(wcslen(szEventAttributes)),
+            szAttributeName,
+            static_cast<unsigned>(wcslen(szAttributeName)));
+    }
+
+    return StringViewResult(m_stringBuffer, pString);
+}
+
+bool
+EtwEnumerator::SplitCurrentEventAttributes(
+    _Out_writes_to_(cAttributes, *pcAttributes) EtwAttributeInfo* pAttributes,
+    unsigned cAttributes,
+    _Out_ unsigned* pcAttributes) noexcept
+{
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    return SplitEventAttributes(
+            EventAttributes(), pAttributes, cAttributes, pcAttributes);
+}
+
+bool
+EtwEnumerator::SplitEventAttributes(
+    _In_opt_z_ EtwPCWSTR szEventAttributes,
+    _Out_writes_to_(cAttributes, *pcAttributes) EtwAttributeInfo* pAttributes,
+    unsigned cAttributes,
+    _Out_ unsigned* pcAttributes) noexcept
+{
+    auto& output = m_stringBuffer;
+    unsigned cActual = 0;
+    ASSERT(cAttributes == 0 || pAttributes != nullptr);
+
+    output.clear();
+
+    if (szEventAttributes == nullptr || szEventAttributes[0] == L'\0')
+    {
+        m_lastError = ERROR_SUCCESS;
+    }
+    else if (!output.resize(
+        static_cast<unsigned>(wcslen(szEventAttributes)) + 1))
+    {
+        m_lastError = ERROR_OUTOFMEMORY;
+    }
+    else
+    {
+        wchar_t* pOut = output.data();
+        LPCWSTR pIn = szEventAttributes;
+        while (*pIn)
+        {
+            LPCWSTR pName = pOut;
+            SkipTo(pIn, pOut, [](wchar_t ch) { return ch == L'=' || ch == L';'; });
+            *pOut++ = L'\0';
+
+            // Does the attribute have a value?
+            LPCWSTR pValue;
+            if (pIn[-1] == L'=')
+            {
+                pValue = pOut;
+                SkipTo(pIn, pOut, [](wchar_t ch) { return ch == L';'; });
+                *pOut++ = L'\0';
+            }
+            else
+            {
+                // We got to the end of the attribute without finding '='.
+                // Treat as an empty value.
+                pValue = &pOut[-1]; // = L""
+            }
+
+            ASSERT(pOut <= output.data() + output.size());
+
+            if (pName[0] != L'\0' || pValue[0] != L'\0')
+            {
+                if (cActual < cAttributes)
+                {
+                    pAttributes[cActual] = { pName, pValue };
+                }
+
+                cActual += 1;
+            }
+        }
+
+        if (cActual <= cAttributes)
+        {
+            m_lastError = ERROR_SUCCESS;
+        }
+        else
+        {
+            m_lastError = ERROR_INSUFFICIENT_BUFFER;
+        }
+    }
+
+    *pcAttributes = cActual;
+    return m_lastError == ERROR_SUCCESS;
+}
+
+EtwSchemaCacheInfo
+EtwEnumerator::GetSchemaCacheInfo() const noexcept
+{
+    EtwSchemaCacheInfo info;
+    info.Capacity = m_schemaCache.Capacity();
+    info.Count = m_schemaCache.Count();
+    info.Hits = m_schemaCache.Hits();
+    info.Misses = m_schemaCache.Misses();
+    return info;
+}
+
+void
+EtwEnumerator::SetSchemaCacheCapacity(
+    unsigned value) noexcept
+{
+    // The current event might be using a cached TRACE_EVENT_INFO.
+    SetNoneState(ERROR_SUCCESS);
+    m_schemaCache.SetCapacity(value);
+}
+
+void
+EtwEnumerator::ClearSchemaCache() noexcept
+{
+    // The current event might be using a cached TRACE_EVENT_INFO.
+    SetNoneState(ERROR_SUCCESS);
+    m_schemaCache.Clear();
+}
+
+void
+EtwEnumerator::SetMapCacheCapacity(
+    unsigned value) noexcept
+{
+    m_mapCache.SetCapacity(value);
+}
+
+void
+EtwEnumerator::ClearMapCache() noexcept
+{
+    m_mapCache.Clear();
+}
+
+void
+EtwEnumerator::SetMessageCacheCapacity(
+    unsigned value) noexcept
+{
+    m_messageCache.SetCapacity(value);
+}
+
+void
+EtwEnumerator::ClearMessageCache() noexcept
+{
+    m_messageCache.Clear();
+}
+
+bool
+EtwEnumerator::DecodePlansEnabled() const noexcept
+{
+    return m_decodePlansEnabled;
+}
+
+void
+EtwEnumerator::SetDecodePlansEnabled(
+    bool value) noexcept
+{
+    m_decodePlansEnabled = value;
+}
+
+bool
+EtwEnumerator::ItemTapeEnabled() const noexcept
+{
+    return m_itemTapeEnabled;
+}
+
+void
+EtwEnumerator::SetItemTapeEnabled(
+    bool value) noexcept
+{
+    m_itemTapeEnabled = value;
+}
+
+unsigned
+EtwEnumerator::TimerResolution() const noexcept
+{
+    // We store number of milliseconds per tick, but return value is number of
+    // 100ns units per tick.
+    return m_ticksToMilliseconds * 10000;
+}
+
+void
+EtwEnumerator::SetTimerResolution(unsigned value) noexcept
+{
+    // Parameter is number of 100ns units per tick, but we store number of
+    // milliseconds per tick.
+    m_ticksToMilliseconds = value / 10000;
+}
+
+unsigned
+EtwEnumerator::TicksToMilliseconds(
+    unsigned ticks) const noexcept
+{
+    return ticks * m_ticksToMilliseconds;
+}
+
+UCHAR
+EtwEnumerator::PointerSizeFallback() const noexcept
+{
+    return m_cbPointerFallback;
+}
+
+void
+EtwEnumerator::SetPointerSizeFallback(
+    UCHAR value) noexcept
+{
+    ASSERT(value == 4 || value == 8); // PRECONDITION
+    m_cbPointerFallback = value;
+}
+
+EtwTimestampFormat
+EtwEnumerator::TimestampFormat() const noexcept
+{
+    return m_timestampFormat;
+}
+
+bool
+EtwEnumerator::SetTimestampFormat(EtwTimestampFormat value) noexcept
+{
+    auto const type = value & EtwTimestampFormat_TypeMask;
+    auto const nonType = value & ~EtwTimestampFormat_TypeMask;
+    if (type <= EtwTimestampFormat_None ||
+        type >= EtwTimestampFormat_Max ||
+        (nonType & ~EtwTimestampFormat_FlagMask) != 0)
+    {
+        m_lastError = ERROR_INVALID_PARAMETER;
+    }
+    else
+    {
+        m_timestampFormat = value;
+        m_lastError = ERROR_SUCCESS;
+    }
+
+    return m_lastError == ERROR_SUCCESS;
+}
+
+EtwFloatFormat
+EtwEnumerator::FloatFormat() const noexcept
+{
+    return m_floatFormat;
+}
+
+bool
+EtwEnumerator::SetFloatFormat(EtwFloatFormat value) noexcept
+{
+    if (value <= EtwFloatFormat_None ||
+        value >= EtwFloatFormat_Max)
+    {
+        m_lastError = ERROR_INVALID_PARAMETER;
+    }
+    else
+    {
+        m_floatFormat = value;
+        m_lastError = ERROR_SUCCESS;
+    }
+
+    return m_lastError == ERROR_SUCCESS;
+}
+
+int
+EtwEnumerator::TimeZoneBiasMinutes() const noexcept
+{
+    return m_timeZoneBiasMinutes;
+}
+
+void
+EtwEnumerator::SetTimeZoneBiasMinutes(_In_range_(-1440, 1440) int value) noexcept
+{
+    ASSERT(value >= -1440 && value <= 1440); // PRECONDITION
+    m_timeZoneBiasMinutes = value;
+}
+
+INT64
+EtwEnumerator::AdjustFileTimeToLocal(
+    INT64 utcFileTime) const noexcept
+{
+    return AdjustFileTime(utcFileTime, m_timeZoneBiasMinutes);
+}
+
+INT64
+EtwEnumerator::AdjustFileTime(
+    INT64 fileTime,
+    int biasMinutes) noexcept
+{
+    static INT64 const fileTimePerMinute = 10000000 * 60;
+
+    INT64 const fileTimeAdjusted = fileTime + biasMinutes * fileTimePerMinute;
+    return fileTimeAdjusted >= 0
+        ? fileTimeAdjusted
+        : fileTime < 0 || biasMinutes < 0
+        ? 0
+        : MAXINT64;
+}
+
+/*
+Called after m_stackTop.PropertyIndex changes to a new property index.
+Assumes:
+- PropertyIndex <= PropertyEnd.
+Sets:
+- ArrayIndex, ArrayCount, IsStruct, IsArray.
+- m_pbCooked, m_cbCooked, m_cbRaw, m_state.
+- m_cookedInType, m_cbElement.
+*/
+bool
+EtwEnumerator::NextProperty() noexcept
+{
+    return m_pPlan != nullptr
+        ? NextPropertyFromPlan()
+        : NextPropertyFromTei();
+}
+
+/*
+Reference implementation of NextProperty. Interprets EVENT_PROPERTY_INFO.
+*/
+bool
+EtwEnumerator::NextPropertyFromTei() noexcept
+{
+    ASSERT(m_stackTop.PropertyIndex <=  m_stackTop.PropertyEnd);
+
+    bool movedToItem;
+
+    if (m_stackTop.PropertyEnd == m_stackTop.PropertyIndex)
+    {
+        // End of current group of properties.
+        if (m_stack.size() == 0)
+        {
+            SetEndState(EtwEnumeratorState_AfterLastItem, SubState_AfterLastItem);
+            m_lastError = ERROR_SUCCESS;
+            movedToItem = false;
+        }
+        else
+        {
+            m_stackTop = m_stack[m_stack.size() - 1];
+            m_stack.pop_back();
+            m_cookedInType = TDH_INTYPE_NULL;
+            m_cbElement = 0;
+            SetEndState(EtwEnumeratorState_StructEnd, SubState_StructEnd);
+            m_lastError = ERROR_SUCCESS;
+            movedToItem = true;
+        }
+    }
+    else
+    {
+        auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
+
+        m_stackTop.ArrayIndex = 0;
+
+        if ((epi.Flags & (PropertyStruct | PropertyParamCount | PropertyParamFixedCount)) == 0 &&
+            epi.count == 1)
+        {
+            // Scalar:
+
+            m_stackTop.ArrayCount = 1;
+            m_stackTop.IsStruct = false;
+            m_stackTop.IsArray = false;
+
+            SetState(EtwEnumeratorState_Value, SubState_Value_Scalar);
+            movedToItem = StartValueFromTei();
+        }
+        else
+        {
+            // Array and/or Struct:
+
+            m_stackTop.IsStruct = 0 != (epi.Flags & PropertyStruct);
+
+            if (epi.Flags & PropertyParamCount)
+            {
+                // Count comes from the value of a previous property.
+                m_stackTop.ArrayCount = m_integerValues[epi.countPropertyIndex];
+                m_stackTop.IsArray = true;
+                movedToItem = StartArrayFromTei();
+            }
+            else
+            {
+                m_stackTop.ArrayCount = epi.count;
+
+                // Note that PropertyParamFixedCount is a new flag, so it is unset in
+                // some cases where it should be set (providers built using older mc.exe),
+                // and it is ignored by many decoders. Without the PropertyParamFixedCount
+                // flag, decoders will assume that a property is an array if it has
+                // either a count parameter or a fixed count other than 1. The
+                // PropertyParamFixedCount flag allows for fixed-count arrays with one
+                // element to be propertly recognized as arrays (though this is probably
+                // not a common or particularly important case).
+                if (1 != epi.count ||
+                    0 != (epi.Flags & PropertyParamFixedCount))
+                {
+                    m_stackTop.IsArray = true;
+                    movedToItem = StartArrayFromTei();
+                }
+                else
+                {
+                    m_stackTop.IsArray = false;
+                    StartStruct();
+                    m_lastError = ERROR_SUCCESS;
+                    movedToItem = true;
+                }
+            }
+        }
+    }
+
+    return movedToItem;
+}
+
+/*
+Sets:
+- m_pbCooked, m_cbCooked, m_cbRaw, m_state.
+- m_cookedInType, m_cbElement.
+*/
+void
+EtwEnumerator::StartStruct() noexcept
+{
+    m_pbCooked = m_pbDataNext;
+    m_cbCooked = 0;
+    m_cbRaw = 0;
+    m_cookedInType = TDH_INTYPE_NULL;
+    m_cbElement = 0;
+    SetState(EtwEnumeratorState_StructBegin, SubState_StructBegin);
+}
+
+/*
+Decodes array type, especially m_cookedInType and m_cbElement.
+If the array contains simple elements, also computes and validates array size.
+Sets:
+- m_pbCooked, m_cbCooked, m_cbRaw.
+- m_cookedInType, m_cbElement.
+*/
+bool
+EtwEnumerator::StartArrayFromTei() noexcept
+{
+    bool movedToItem;
+    auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
+
+    m_pbCooked = m_pbDataNext;
+    m_cbCooked = 0;
+    m_cbRaw = 0;
+    m_cookedInType = epi.nonStructType.InType;
+    m_cbElement = 0;
+    SetState(EtwEnumeratorState_ArrayBegin, SubState_ArrayBegin);
+
+    if (m_stackTop.IsStruct)
+    {
+        m_cookedInType = TDH_INTYPE_NULL;
+        m_lastError = ERROR_SUCCESS;
+        movedToItem = true;
+        goto Done;
+    }
+
+    // Determine the m_cbElement and m_cookedInType values.
+    switch (epi.nonStructType.InType)
+    {
+    case TDH_INTYPE_INT8:
+    case TDH_INTYPE_UINT8:
+    case TDH_INTYPE_ANSICHAR:
+        m_cbElement = 1;
+        break;
+
+    case TDH_INTYPE_INT16:
+    case TDH_INTYPE_UINT16:
+    case TDH_INTYPE_UNICODECHAR:
+        m_cbElement = 2;
+        break;
+
+    case TDH_INTYPE_INT32:
+    case TDH_INTYPE_UINT32:
+    case TDH_INTYPE_HEXINT32:
+    case TDH_INTYPE_FLOAT:
+    case TDH_INTYPE_BOOLEAN:
+        m_cbElement = 4;
+        break;
+
+    case TDH_INTYPE_INT64:
+    case TDH_INTYPE_UINT64:
+    case TDH_INTYPE_DOUBLE:
+    case TDH_INTYPE_FILETIME:
+    case TDH_INTYPE_HEXINT64:
+        m_cbElement = 8;
+        break;
+
+    case TDH_INTYPE_GUID:
+    case TDH_INTYPE_SYSTEMTIME:
+        m_cbElement = 16;
+        break;
+
+    case TDH_INTYPE_POINTER:
+    case TDH_INTYPE_SIZET:
+        m_cbElement = PointerSize();
+        break;
+
+    case TDH_INTYPE_NULL:
+    case TDH_INTYPE_UNICODESTRING:
+    case TDH_INTYPE_ANSISTRING:
+    case TDH_INTYPE_BINARY:
+    case TDH_INTYPE_SID:
+        m_lastError = ERROR_SUCCESS;
+        movedToItem = true;
+        goto Done;
+
+    case TDH_InTypeManifestCountedString:
+    case TDH_INTYPE_COUNTEDSTRING:
+    case TDH_INTYPE_REVERSEDCOUNTEDSTRING:
+    case TDH_INTYPE_NONNULLTERMINATEDSTRING:
+        m_cookedInType = TDH_INTYPE_UNICODESTRING;
+        m_lastError = ERROR_SUCCESS;
+        movedToItem = true;
+        goto Done;
+
+    case TDH_InTypeManifestCountedAnsiString:
+    case TDH_INTYPE_COUNTEDANSISTRING:
+    case TDH_INTYPE_REVERSEDCOUNTEDANSISTRING:
+    case TDH_INTYPE_NONNULLTERMINATEDANSISTRING:
+        m_cookedInType = TDH_INTYPE_ANSISTRING;
+        m_lastError = ERROR_SUCCESS;
+        movedToItem = true;
+        goto Done;
+
+    case TDH_InTypeManifestCountedBinary:
+    case TDH_INTYPE_HEXDUMP:
+        m_cookedInType = TDH_INTYPE_BINARY;
+        m_lastError = ERROR_SUCCESS;
+        movedToItem = true;
+        goto Done;
+
+    case TDH_INTYPE_WBEMSID:
+        m_cookedInType = TDH_INTYPE_SID;
+        m_lastError = ERROR_SUCCESS;
+        movedToItem = true;
+        goto Done;
+
+    default:
+        movedToItem = SetErrorState(ERROR_UNSUPPORTED_TYPE);
+        goto Done;
+    }
+
+    // For simple array element types, validate that Count * m_cbElement <= RemainingSize.
+    // That way we can skip per-element validation and we can safely expose the array data
+    // during ArrayBegin.
+    {
+        USHORT const cbRemaining = static_cast<USHORT>(m_pbDataEnd - m_pbDataNext);
+        unsigned const cbArray = static_cast<unsigned>(m_stackTop.ArrayCount) * m_cbElement;
+        if (cbRemaining < cbArray)
+        {
+            movedToItem = SetErrorState(ERROR_INVALID_DATA);
+        }
+        else
+        {
+            m_cbRaw = m_cbCooked = static_cast<USHORT>(cbArray);
+            movedToItem = true;
+        }
+    }
+
+Done:
+
+    return movedToItem;
+}
+
+/*
+Decodes the current field's data and type.
+Sets:
+- m_pbCooked, m_cbCooked, m_cbRaw.
+- m_cookedInType, m_cbElement.
+*/
+bool
+EtwEnumerator::StartValue() noexcept
+{
+    return m_pPlan != nullptr
+        ? StartValueFromPlan(m_pPlan[m_stackTop.PropertyIndex])
+        : StartValueFromTei();
+}
+
+/*
+Reference implementation of StartValue. Interprets EVENT_PROPERTY_INFO.
+*/
+bool
+EtwEnumerator::StartValueFromTei() noexcept
+{
+    ASSERT(!m_stackTop.IsStruct);
+
+    bool movedToItem;
+    auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
+    USHORT const cbRemaining = static_cast<USHORT>(m_pbDataEnd - m_pbDataNext);
+    USHORT propertyLength;
+
+    m_pbCooked = m_pbDataNext;
+    m_cookedInType = epi.nonStructType.InType;
+    m_cbElement = 0;
+
+    // Each switch case needs to be sure the following are set correctly:
+    // m_cookedInType - default is InType.
+    // m_cbElement  - default is 0, should be set for fixed-size types.
+    // m_pbCooked   - default is m_pbDataNext.
+    // m_cbCooked   - no default, must be set.
+    // m_cbRaw      - no default, must be set.
+    switch (epi.nonStructType.InType)
+    {
+        // Note:
+        // If this property is an 8/16/32-bit integer, we need to remember the
+        // value in case it is needed for a subsequent property's length or
+        // count. In these cases, since we have to validate cbRemaining before
+        // reading the value, we skip straight to Done to avoid redundant work.
+
+    case TDH_INTYPE_UINT8:
+        m_cbRaw = m_cbCooked = m_cbElement = 1;
+        if (m_cbRaw <= cbRemaining)
+        {
+            UINT8 const val = *m_pbDataNext;
+            m_integerValues[m_stackTop.PropertyIndex] = val;
+            m_lastError = ERROR_SUCCESS;
+            movedToItem = true;
+            goto Done;
+        }
+        break;
+
+    case TDH_INTYPE_UINT16:
+        m_cbRaw = m_cbCooked = m_cbElement = 2;
+        if (m_cbRaw <= cbRemaining)
+        {
+            UINT16 const val = *reinterpret_cast<UINT16 const UNALIGNED*>(m_pbDataNext);
+            m_integerValues[m_stackTop.PropertyIndex] = val;
+            m_lastError = ERROR_SUCCESS;
+            movedToItem = true;
+            goto Done;
+        }
+        break;
+
+    case TDH_INTYPE_UINT32:
+    case TDH_INTYPE_HEXINT32:
+        m_cbRaw = m_cbCooked = m_cbElement = 4;
+        if (m_cbRaw <= cbRemaining)
+        {
+            UINT32 const val = *reinterpret_cast<UINT32 const UNALIGNED*>(m_pbDataNext);
+            m_integerValues[m_stackTop.PropertyIndex] = static_cast<USHORT>(val > 0xffffu ? 0xffffu : val);
+            m_lastError = ERROR_SUCCESS;
+            movedToItem = true;
+            goto Done;
+        }
+        break;
+
+    case TDH_INTYPE_INT8:
+    case TDH_INTYPE_ANSICHAR:
+        m_cbRaw = m_cbCooked = m_cbElement = 1;
+        break;
+
+    case TDH_INTYPE_INT16:
+    case TDH_INTYPE_UNICODECHAR:
+        m_cbRaw = m_cbCooked = m_cbElement = 2;
+        break;
+
+    case TDH_INTYPE_INT32:
+    case TDH_INTYPE_FLOAT:
+    case TDH_INTYPE_BOOLEAN:
+        m_cbRaw = m_cbCooked = m_cbElement = 4;
+        break;
+
+    case TDH_INTYPE_INT64:
+    case TDH_INTYPE_UINT64:
+    case TDH_INTYPE_DOUBLE:
+    case TDH_INTYPE_FILETIME:
+    case TDH_INTYPE_HEXINT64:
+        m_cbRaw = m_cbCooked = m_cbElement = 8;
+        break;
+
+    case TDH_INTYPE_GUID:
+    case TDH_INTYPE_SYSTEMTIME:
+        m_cbRaw = m_cbCooked = m_cbElement = 16;
+        break;
+
+    case TDH_INTYPE_POINTER:
+    case TDH_INTYPE_SIZET:
+        m_cbRaw = m_cbCooked = m_cbElement = PointerSize();
+        break;
+
+    case TDH_INTYPE_UNICODESTRING:
+
+        if (CurrentPropertyLength(&propertyLength))
+        {
+            m_cbRaw = m_cbCooked = 2u * propertyLength;
+        }
+        else
+        {
+            // Note that while it's technically incorrect to reach end-of-event
+            // without a nul-termination, we tolerate that condition here.
+            propertyLength = static_cast<USHORT>(unaligned_wcsnlen(
+                reinterpret_cast<wchar_t const UNALIGNED*>(m_pbDataNext),
+                cbRemaining / 2u));
+            m_cbCooked = propertyLength * 2u;
+            m_cbRaw =
+                cbRemaining / 2u == propertyLength
+                ? cbRemaining
+                : m_cbCooked + 2u;
+
+            // We've already validated that m_cbRaw <= cbRemaining.
+            m_lastError = ERROR_SUCCESS;
+            movedToItem = true;
+            goto Done;
+        }
+        break;
+
+    case TDH_INTYPE_ANSISTRING:
+        if (CurrentPropertyLength(&propertyLength))
+        {
+            m_cbRaw = m_cbCooked = propertyLength;
+        }
+        else
+        {
+            // Note that while it's technically incorrect to reach end-of-event
+            // without a nul-termination, we tolerate that condition here.
+            propertyLength = static_cast<USHORT>(strnlen(
+                reinterpret_cast<char const*>(m_pbDataNext),
+                cbRemaining));
+            m_cbCooked = propertyLength;
+            m_cbRaw =
+                cbRemaining == propertyLength
+                ? cbRemaining
+                : m_cbCooked + 1u;
+
+            // We've already validated that m_cbRaw <= cbRemaining.
+            m_lastError = ERROR_SUCCESS;
+            movedToItem = true;
+            goto Done;
+        }
+        break;
+
+    case TDH_INTYPE_BINARY:
+        if (!CurrentPropertyLength(&propertyLength) &&
+            TDH_OUTTYPE_IPV6 == epi.nonStructType.OutType &&
+            TDH_INTYPE_BINARY == epi.nonStructType.InType)
+        {
+            // Special case for incorrectly-defined IPV6 addresses.
+            propertyLength = 16;
+        }
+        m_cbRaw = m_cbCooked = propertyLength;
+        break;
+
+    case TDH_InTypeManifestCountedString:
+    case TDH_INTYPE_COUNTEDSTRING:
+        m_cookedInType = TDH_INTYPE_UNICODESTRING;
+        StartValueCounted();
+        m_cbCooked &= ~1u; // Round to multiple of 2.
+        break;
+
+    case TDH_INTYPE_REVERSEDCOUNTEDSTRING:
+        m_cookedInType = TDH_INTYPE_UNICODESTRING;
+        StartValueReversedCounted();
+        m_cbCooked &= ~1u; // Round to multiple of 2.
+        break;
 
-            ASSERT(pOut <= output.data() + output.size());
+    case TDH_InTypeManifestCountedAnsiString:
+    case TDH_INTYPE_COUNTEDANSISTRING:
+        m_cookedInType = TDH_INTYPE_ANSISTRING;
+        StartValueCounted();
+        break;
 
-            if (pName[0] != L'\0' || pValue[0] != L'\0')
-            {
-                if (cActual < cAttributes)
-                {
-                    pAttributes[cActual] = { pName, pValue };
-                }
+    case TDH_INTYPE_REVERSEDCOUNTEDANSISTRING:
+        m_cookedInType = TDH_INTYPE_ANSISTRING;
+        StartValueReversedCounted();
+        break;
 
-                cActual += 1;
-            }
-        }
+    case TDH_InTypeManifestCountedBinary:
+        m_cookedInType = TDH_INTYPE_BINARY;
+        StartValueCounted();
+        break;
 
-        if (cActual <= cAttributes)
+    case TDH_INTYPE_HEXDUMP:
+        m_cookedInType = TDH_INTYPE_BINARY;
+        if (cbRemaining < 4)
         {
-            m_lastError = ERROR_SUCCESS;
+            m_cbRaw = 4;
         }
         else
         {
-            m_lastError = ERROR_INSUFFICIENT_BUFFER;
+            m_pbCooked = m_pbDataNext + 4;
+            m_cbCooked = *reinterpret_cast<UINT16 const UNALIGNED*>(m_pbDataNext);
+            m_cbRaw = static_cast<USHORT>(m_cbCooked + 4);
         }
-    }
-
-    *pcAttributes = cActual;
-    return m_lastError == ERROR_SUCCESS;
-}
+        break;
 
-unsigned
-EtwEnumerator::TimerResolution() const noexcept
-{
-    // We store number of milliseconds per tick, but return value is number of
-    // 100ns units per tick.
-    return m_ticksToMilliseconds * 10000;
-}
+    case TDH_INTYPE_NONNULLTERMINATEDSTRING:
+        m_cookedInType = TDH_INTYPE_UNICODESTRING;
+        m_cbCooked = cbRemaining & ~1u; // Round to multiple of 2.
+        m_cbRaw = cbRemaining;
+        break;
 
-void
-EtwEnumerator::SetTimerResolution(unsigned value) noexcept
-{
-    // Parameter is number of 100ns units per tick, but we store number of
-    // milliseconds per tick.
-    m_ticksToMilliseconds = value / 10000;
-}
+    case TDH_INTYPE_NONNULLTERMINATEDANSISTRING:
+        m_cookedInType = TDH_INTYPE_ANSISTRING;
+        m_cbCooked = cbRemaining;
+        m_cbRaw = cbRemaining;
+        break;
 
-unsigned
-EtwEnumerator::TicksToMilliseconds(
-    unsigned ticks) const noexcept
-{
-    return ticks * m_ticksToMilliseconds;
-}
+    case TDH_INTYPE_NULL:
+        m_cbRaw = m_cbCooked = 0;
+        m_lastError = ERROR_SUCCESS;
+        movedToItem = true;
+        goto Done;
 
-UCHAR
-EtwEnumerator::PointerSizeFallback() const noexcept
-{
-    return m_cbPointerFallback;
-}
+    case TDH_INTYPE_SID:
+        if (cbRemaining < 8u)
+        {
+            m_cbRaw = 8u;
+        }
+        else
+        {
+            m_cbRaw = m_cbCooked = 8u + (m_pbDataNext[1u] * 4u);
+        }
+        break;
 
-void
-EtwEnumerator::SetPointerSizeFallback(
-    UCHAR value) noexcept
-{
-    ASSERT(value == 4 || value == 8); // PRECONDITION
-    m_cbPointerFallback = value;
-}
+    case TDH_INTYPE_WBEMSID:
+        // A WBEM SID is actually a TOKEN_USER structure followed
+        // by the SID. The TOKEN_USER structure is 2 * pointerSize.
+        m_cookedInType = TDH_INTYPE_SID;
+        propertyLength = 2u * PointerSize();
+        if (cbRemaining < propertyLength + 8u)
+        {
+            m_cbRaw = propertyLength + 8u;
+        }
+        else
+        {
+            m_pbCooked += propertyLength;
+            m_cbCooked = 8u + (m_pbDataNext[propertyLength + 1u] * 4u);
+            m_cbRaw = static_cast<USHORT>(propertyLength + m_cbCooked);
+        }
+        break;
 
-EtwTimestampFormat
-EtwEnumerator::TimestampFormat() const noexcept
-{
-    return m_timestampFormat;
-}
+    default:
+        m_cbRaw = m_cbCooked = 0;
+        movedToItem = SetErrorState(ERROR_UNSUPPORTED_TYPE);
+        goto Done;
+    }
 
-bool
-EtwEnumerator::SetTimestampFormat(EtwTimestampFormat value) noexcept
-{
-    auto const type = value & EtwTimestampFormat_TypeMask;
-    auto const nonType = value & ~EtwTimestampFormat_TypeMask;
-    if (type <= EtwTimestampFormat_None ||
-        type >= EtwTimestampFormat_Max ||
-        (nonType & ~EtwTimestampFormat_FlagMask) != 0)
+    if (cbRemaining < m_cbRaw)
     {
-        m_lastError = ERROR_INVALID_PARAMETER;
+        m_cbRaw = m_cbCooked = 0;
+        movedToItem = SetErrorState(ERROR_INVALID_DATA);
     }
     else
     {
-        m_timestampFormat = value;
         m_lastError = ERROR_SUCCESS;
+        movedToItem = true;
     }
 
-    return m_lastError == ERROR_SUCCESS;
-}
+Done:
 
-int
-EtwEnumerator::TimeZoneBiasMinutes() const noexcept
-{
-    return m_timeZoneBiasMinutes;
+    return movedToItem;
 }
 
 void
-EtwEnumerator::SetTimeZoneBiasMinutes(_In_range_(-1440, 1440) int value) noexcept
+EtwEnumerator::StartValueSimple() noexcept
 {
-    ASSERT(value >= -1440 && value <= 1440); // PRECONDITION
-    m_timeZoneBiasMinutes = value;
+    ASSERT(m_stackTop.ArrayIndex < m_stackTop.ArrayCount);
+    ASSERT(!m_stackTop.IsStruct);
+    ASSERT(m_stackTop.IsArray);
+    ASSERT(m_cbElement != 0);
+    ASSERT(m_cbCooked == m_cbElement);
+    ASSERT(m_cbRaw == m_cbElement);
+    ASSERT(m_pbDataNext + m_cbRaw <= m_pbDataEnd);
+    ASSERT(m_state == EtwEnumeratorState_Value);
+    m_pbCooked = m_pbDataNext;
 }
 
-INT64
-EtwEnumerator::AdjustFileTimeToLocal(
-    INT64 utcFileTime) const noexcept
+void
+EtwEnumerator::StartValueCounted() noexcept
 {
-    return AdjustFileTime(utcFileTime, m_timeZoneBiasMinutes);
+    unsigned const cbRemaining = static_cast<unsigned>(m_pbDataEnd - m_pbDataNext);
+    if (cbRemaining < 2)
+    {
+        m_cbRaw = 2;
+    }
+    else
+    {
+        m_pbCooked = m_pbDataNext + 2;
+        m_cbCooked = m_pbDataNext[0] | (static_cast<unsigned>(m_pbDataNext[1]) << 8);
+        m_cbRaw = static_cast<USHORT>(m_cbCooked + 2);
+    }
 }
 
-INT64
-EtwEnumerator::AdjustFileTime(
-    INT64 fileTime,
-    int biasMinutes) noexcept
+void
+EtwEnumerator::StartValueReversedCounted() noexcept
 {
-    static INT64 const fileTimePerMinute = 10000000 * 60;
-
-    INT64 const fileTimeAdjusted = fileTime + biasMinutes * fileTimePerMinute;
-    return fileTimeAdjusted >= 0
-        ? fileTimeAdjusted
-        : fileTime < 0 || biasMinutes < 0
-        ? 0
-        : MAXINT64;
+    unsigned const cbRemaining = static_cast<unsigned>(m_pbDataEnd - m_pbDataNext);
+    if (cbRemaining < 2)
+    {
+        m_cbRaw = 2;
+    }
+    else
+    {
+        m_pbCooked = m_pbDataNext + 2;
+        m_cbCooked = (static_cast<unsigned>(m_pbDataNext[0]) << 8) | m_pbDataNext[1];
+        m_cbRaw = static_cast<USHORT>(m_cbCooked + 2);
+    }
 }
 
 /*
-Called after m_stackTop.PropertyIndex changes to a new property index.
-Assumes:
-- PropertyIndex <= PropertyEnd.
-Sets:
-- ArrayIndex, ArrayCount, IsStruct, IsArray.
-- m_pbCooked, m_cbCooked, m_cbRaw, m_state.
-- m_cookedInType, m_cbElement.
+Same as NextPropertyFromTei, but uses the precompiled decode plan.
 */
 bool
-EtwEnumerator::NextProperty() noexcept
+EtwEnumerator::NextPropertyFromPlan() noexcept
 {
-    ASSERT(m_stackTop.PropertyIndex <=  m_stackTop.PropertyEnd);
+    ASSERT(m_stackTop.PropertyIndex <= m_stackTop.PropertyEnd);
 
     bool movedToItem;
 
@@ -993,61 +2689,37 @@ EtwEnumerator::NextProperty() noexcept
     }
     else
     {
-        auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
+        auto& op = m_pPlan[m_stackTop.PropertyIndex];
 
         m_stackTop.ArrayIndex = 0;
 
-        if ((epi.Flags & (PropertyStruct | PropertyParamCount | PropertyParamFixedCount)) == 0 &&
-            epi.count == 1)
+        switch (op.Shape)
         {
-            // Scalar:
-
+        case PlanShape_Scalar:
             m_stackTop.ArrayCount = 1;
             m_stackTop.IsStruct = false;
             m_stackTop.IsArray = false;
-
             SetState(EtwEnumeratorState_Value, SubState_Value_Scalar);
-            movedToItem = StartValue();
-        }
-        else
-        {
-            // Array and/or Struct:
-
-            m_stackTop.IsStruct = 0 != (epi.Flags & PropertyStruct);
-
-            if (epi.Flags & PropertyParamCount)
-            {
-                // Count comes from the value of a previous property.
-                m_stackTop.ArrayCount = m_integerValues[epi.countPropertyIndex];
-                m_stackTop.IsArray = true;
-                movedToItem = StartArray();
-            }
-            else
-            {
-                m_stackTop.ArrayCount = epi.count;
+            movedToItem = StartValueFromPlan(op);
+            break;
 
-                // Note that PropertyParamFixedCount is a new flag, so it is unset in
-                // some cases where it should be set (providers built using older mc.exe),
-                // and it is ignored by many decoders. Without the PropertyParamFixedCount
-                // flag, decoders will assume that a property is an array if it has
-                // either a count parameter or a fixed count other than 1. The
-                // PropertyParamFixedCount flag allows for fixed-count arrays with one
-                // element to be propertly recognized as arrays (though this is probably
-                // not a common or particularly important case).
-                if (1 != epi.count ||
-                    0 != (epi.Flags & PropertyParamFixedCount))
-                {
-                    m_stackTop.IsArray = true;
-                    movedToItem = StartArray();
-                }
-                else
-                {
-                    m_stackTop.IsArray = false;
-                    StartStruct();
-                    m_lastError = ERROR_SUCCESS;
-                    movedToItem = true;
-                }
-            }
+        case PlanShape_Struct:
+            m_stackTop.ArrayCount = 1;
+            m_stackTop.IsStruct = true;
+            m_stackTop.IsArray = false;
+            StartStruct();
+            m_lastError = ERROR_SUCCESS;
+            movedToItem = true;
+            break;
+
+        default:
+            m_stackTop.ArrayCount = op.Flags & PlanFlags_CountFromProperty
+                ? m_integerValues[op.Count]
+                : op.Count;
+            m_stackTop.IsStruct = op.Shape == PlanShape_StructArray;
+            m_stackTop.IsArray = true;
+            movedToItem = StartArrayFromPlan(op);
+            break;
         }
     }
 
@@ -1055,138 +2727,49 @@ EtwEnumerator::NextProperty() noexcept
 }
 
 /*
-Sets:
-- m_pbCooked, m_cbCooked, m_cbRaw, m_state.
-- m_cookedInType, m_cbElement.
-*/
-void
-EtwEnumerator::StartStruct() noexcept
-{
-    m_pbCooked = m_pbDataNext;
-    m_cbCooked = 0;
-    m_cbRaw = 0;
-    m_cookedInType = TDH_INTYPE_NULL;
-    m_cbElement = 0;
-    SetState(EtwEnumeratorState_StructBegin, SubState_StructBegin);
-}
-
-/*
-Decodes array type, especially m_cookedInType and m_cbElement.
-If the array contains simple elements, also computes and validates array size.
-Sets:
-- m_pbCooked, m_cbCooked, m_cbRaw.
-- m_cookedInType, m_cbElement.
+Same as StartArrayFromTei, but uses the precompiled decode plan.
 */
 bool
-EtwEnumerator::StartArray() noexcept
+EtwEnumerator::StartArrayFromPlan(
+    PlanOp const& op) noexcept
 {
     bool movedToItem;
-    auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
 
     m_pbCooked = m_pbDataNext;
     m_cbCooked = 0;
     m_cbRaw = 0;
-    m_cookedInType = epi.nonStructType.InType;
+    m_cookedInType = op.CookedInType;
     m_cbElement = 0;
     SetState(EtwEnumeratorState_ArrayBegin, SubState_ArrayBegin);
 
     if (m_stackTop.IsStruct)
     {
-        m_cookedInType = TDH_INTYPE_NULL;
         m_lastError = ERROR_SUCCESS;
         movedToItem = true;
         goto Done;
     }
 
-    // Determine the m_cbElement and m_cookedInType values.
-    switch (epi.nonStructType.InType)
+    switch (op.Size)
     {
-    case TDH_INTYPE_INT8:
-    case TDH_INTYPE_UINT8:
-    case TDH_INTYPE_ANSICHAR:
-        m_cbElement = 1;
-        break;
-
-    case TDH_INTYPE_INT16:
-    case TDH_INTYPE_UINT16:
-    case TDH_INTYPE_UNICODECHAR:
-        m_cbElement = 2;
-        break;
-
-    case TDH_INTYPE_INT32:
-    case TDH_INTYPE_UINT32:
-    case TDH_INTYPE_HEXINT32:
-    case TDH_INTYPE_FLOAT:
-    case TDH_INTYPE_BOOLEAN:
-        m_cbElement = 4;
-        break;
-
-    case TDH_INTYPE_INT64:
-    case TDH_INTYPE_UINT64:
-    case TDH_INTYPE_DOUBLE:
-    case TDH_INTYPE_FILETIME:
-    case TDH_INTYPE_HEXINT64:
-        m_cbElement = 8;
-        break;
-
-    case TDH_INTYPE_GUID:
-    case TDH_INTYPE_SYSTEMTIME:
-        m_cbElement = 16;
+    case PlanSize_Fixed:
+        m_cbElement = op.CbElement;
         break;
 
-    case TDH_INTYPE_POINTER:
-    case TDH_INTYPE_SIZET:
+    case PlanSize_Pointer:
         m_cbElement = PointerSize();
         break;
 
-    case TDH_INTYPE_NULL:
-    case TDH_INTYPE_UNICODESTRING:
-    case TDH_INTYPE_ANSISTRING:
-    case TDH_INTYPE_BINARY:
-    case TDH_INTYPE_SID:
-        m_lastError = ERROR_SUCCESS;
-        movedToItem = true;
-        goto Done;
-
-    case TDH_InTypeManifestCountedString:
-    case TDH_INTYPE_COUNTEDSTRING:
-    case TDH_INTYPE_REVERSEDCOUNTEDSTRING:
-    case TDH_INTYPE_NONNULLTERMINATEDSTRING:
-        m_cookedInType = TDH_INTYPE_UNICODESTRING;
-        m_lastError = ERROR_SUCCESS;
-        movedToItem = true;
-        goto Done;
-
-    case TDH_InTypeManifestCountedAnsiString:
-    case TDH_INTYPE_COUNTEDANSISTRING:
-    case TDH_INTYPE_REVERSEDCOUNTEDANSISTRING:
-    case TDH_INTYPE_NONNULLTERMINATEDANSISTRING:
-        m_cookedInType = TDH_INTYPE_ANSISTRING;
-        m_lastError = ERROR_SUCCESS;
-        movedToItem = true;
-        goto Done;
-
-    case TDH_InTypeManifestCountedBinary:
-    case TDH_INTYPE_HEXDUMP:
-        m_cookedInType = TDH_INTYPE_BINARY;
-        m_lastError = ERROR_SUCCESS;
-        movedToItem = true;
+    case PlanSize_Unsupported:
+        movedToItem = SetErrorState(ERROR_UNSUPPORTED_TYPE);
         goto Done;
 
-    case TDH_INTYPE_WBEMSID:
-        m_cookedInType = TDH_INTYPE_SID;
+    default:
         m_lastError = ERROR_SUCCESS;
         movedToItem = true;
         goto Done;
-
-    default:
-        movedToItem = SetErrorState(ERROR_UNSUPPORTED_TYPE);
-        goto Done;
     }
 
     // For simple array element types, validate that Count * m_cbElement <= RemainingSize.
-    // That way we can skip per-element validation and we can safely expose the array data
-    // during ArrayBegin.
     {
         USHORT const cbRemaining = static_cast<USHORT>(m_pbDataEnd - m_pbDataNext);
         unsigned const cbArray = static_cast<unsigned>(m_stackTop.ArrayCount) * m_cbElement;
@@ -1207,69 +2790,36 @@ Done:
 }
 
 /*
-Decodes the current field's data and type.
-Sets:
-- m_pbCooked, m_cbCooked, m_cbRaw.
-- m_cookedInType, m_cbElement.
+Same as StartValueFromTei, but uses the precompiled decode plan.
 */
 bool
-EtwEnumerator::StartValue() noexcept
+EtwEnumerator::StartValueFromPlan(
+    PlanOp const& op) noexcept
 {
     ASSERT(!m_stackTop.IsStruct);
 
     bool movedToItem;
-    auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
     USHORT const cbRemaining = static_cast<USHORT>(m_pbDataEnd - m_pbDataNext);
-    USHORT propertyLength;
+    USHORT const propertyLength = op.Flags & PlanFlags_LengthFromProperty
+        ? m_integerValues[op.Length]
+        : op.Length;
+    USHORT cch;
 
     m_pbCooked = m_pbDataNext;
-    m_cookedInType = epi.nonStructType.InType;
+    m_cookedInType = op.CookedInType;
     m_cbElement = 0;
 
-    // Each switch case needs to be sure the following are set correctly:
-    // m_cookedInType - default is InType.
-    // m_cbElement  - default is 0, should be set for fixed-size types.
-    // m_pbCooked   - default is m_pbDataNext.
-    // m_cbCooked   - no default, must be set.
-    // m_cbRaw      - no default, must be set.
-    switch (epi.nonStructType.InType)
+    switch (op.Size)
     {
-        // Note:
-        // If this property is an 8/16/32-bit integer, we need to remember the
-        // value in case it is needed for a subsequent property's length or
-        // count. In these cases, since we have to validate cbRemaining before
-        // reading the value, we skip straight to Done to avoid redundant work.
-
-    case TDH_INTYPE_UINT8:
-        m_cbRaw = m_cbCooked = m_cbElement = 1;
-        if (m_cbRaw <= cbRemaining)
-        {
-            UINT8 const val = *m_pbDataNext;
-            m_integerValues[m_stackTop.PropertyIndex] = val;
-            m_lastError = ERROR_SUCCESS;
-            movedToItem = true;
-            goto Done;
-        }
-        break;
-
-    case TDH_INTYPE_UINT16:
-        m_cbRaw = m_cbCooked = m_cbElement = 2;
-        if (m_cbRaw <= cbRemaining)
+    case PlanSize_Fixed:
+        m_cbRaw = m_cbCooked = m_cbElement = op.CbElement;
+        if ((op.Flags & PlanFlags_RememberInteger) &&
+            m_cbRaw <= cbRemaining)
         {
-            UINT16 const val = *reinterpret_cast<UINT16 const UNALIGNED*>(m_pbDataNext);
-            m_integerValues[m_stackTop.PropertyIndex] = val;
-            m_lastError = ERROR_SUCCESS;
-            movedToItem = true;
-            goto Done;
-        }
-        break;
-
-    case TDH_INTYPE_UINT32:
-    case TDH_INTYPE_HEXINT32:
-        m_cbRaw = m_cbCooked = m_cbElement = 4;
-        if (m_cbRaw <= cbRemaining)
-        {
-            UINT32 const val = *reinterpret_cast<UINT32 const UNALIGNED*>(m_pbDataNext);
+            UINT32 const val =
+                m_cbRaw == 1 ? *m_pbDataNext
+                : m_cbRaw == 2 ? *reinterpret_cast<UINT16 const UNALIGNED*>(m_pbDataNext)
+                : *reinterpret_cast<UINT32 const UNALIGNED*>(m_pbDataNext);
             m_integerValues[m_stackTop.PropertyIndex] = static_cast<USHORT>(val > 0xffffu ? 0xffffu : val);
             m_lastError = ERROR_SUCCESS;
             movedToItem = true;
@@ -1277,133 +2827,69 @@ EtwEnumerator::StartValue() noexcept
         }
         break;
 
-    case TDH_INTYPE_INT8:
-    case TDH_INTYPE_ANSICHAR:
-        m_cbRaw = m_cbCooked = m_cbElement = 1;
-        break;
-
-    case TDH_INTYPE_INT16:
-    case TDH_INTYPE_UNICODECHAR:
-        m_cbRaw = m_cbCooked = m_cbElement = 2;
-        break;
-
-    case TDH_INTYPE_INT32:
-    case TDH_INTYPE_FLOAT:
-    case TDH_INTYPE_BOOLEAN:
-        m_cbRaw = m_cbCooked = m_cbElement = 4;
-        break;
-
-    case TDH_INTYPE_INT64:
-    case TDH_INTYPE_UINT64:
-    case TDH_INTYPE_DOUBLE:
-    case TDH_INTYPE_FILETIME:
-    case TDH_INTYPE_HEXINT64:
-        m_cbRaw = m_cbCooked = m_cbElement = 8;
-        break;
-
-    case TDH_INTYPE_GUID:
-    case TDH_INTYPE_SYSTEMTIME:
-        m_cbRaw = m_cbCooked = m_cbElement = 16;
-        break;
-
-    case TDH_INTYPE_POINTER:
-    case TDH_INTYPE_SIZET:
+    case PlanSize_Pointer:
         m_cbRaw = m_cbCooked = m_cbElement = PointerSize();
         break;
 
-    case TDH_INTYPE_UNICODESTRING:
-
-        if (CurrentPropertyLength(&propertyLength))
-        {
-            m_cbRaw = m_cbCooked = 2u * propertyLength;
-        }
-        else
-        {
-            // Note that while it's technically incorrect to reach end-of-event
-            // without a nul-termination, we tolerate that condition here.
-            propertyLength = static_cast<USHORT>(unaligned_wcsnlen(
-                reinterpret_cast<wchar_t const UNALIGNED*>(m_pbDataNext),
-                cbRemaining / 2u));
-            m_cbCooked = propertyLength * 2u;
-            m_cbRaw =
-                cbRemaining / 2u == propertyLength
-                ? cbRemaining
-                : m_cbCooked + 2u;
+    case PlanSize_Null:
+        m_cbRaw = m_cbCooked = 0;
+        m_lastError = ERROR_SUCCESS;
+        movedToItem = true;
+        goto Done;
 
-            // We've already validated that m_cbRaw <= cbRemaining.
-            m_lastError = ERROR_SUCCESS;
-            movedToItem = true;
-            goto Done;
-        }
+    case PlanSize_Length:
+        m_cbRaw = m_cbCooked = propertyLength;
         break;
 
-    case TDH_INTYPE_ANSISTRING:
-        if (CurrentPropertyLength(&propertyLength))
-        {
-            m_cbRaw = m_cbCooked = propertyLength;
-        }
-        else
-        {
-            // Note that while it's technically incorrect to reach end-of-event
-            // without a nul-termination, we tolerate that condition here.
-            propertyLength = static_cast<USHORT>(strnlen(
-                reinterpret_cast<char const*>(m_pbDataNext),
-                cbRemaining));
-            m_cbCooked = propertyLength;
-            m_cbRaw =
-                cbRemaining == propertyLength
-                ? cbRemaining
-                : m_cbCooked + 1u;
-
-            // We've already validated that m_cbRaw <= cbRemaining.
-            m_lastError = ERROR_SUCCESS;
-            movedToItem = true;
-            goto Done;
-        }
+    case PlanSize_Length16:
+        m_cbRaw = m_cbCooked = 2u * propertyLength;
         break;
 
-    case TDH_INTYPE_BINARY:
-        if (!CurrentPropertyLength(&propertyLength) &&
-            TDH_OUTTYPE_IPV6 == epi.nonStructType.OutType &&
-            TDH_INTYPE_BINARY == epi.nonStructType.InType)
-        {
-            // Special case for incorrectly-defined IPV6 addresses.
-            propertyLength = 16;
-        }
-        m_cbRaw = m_cbCooked = propertyLength;
-        break;
+    case PlanSize_AnsiZ:
+        cch = static_cast<USHORT>(strnlen(
+            reinterpret_cast<char const*>(m_pbDataNext),
+            cbRemaining));
+        m_cbCooked = cch;
+        m_cbRaw =
+            cbRemaining == cch
+            ? cbRemaining
+            : m_cbCooked + 1u;
+        m_lastError = ERROR_SUCCESS;
+        movedToItem = true;
+        goto Done;
+
+    case PlanSize_Utf16Z:
+        cch = static_cast<USHORT>(unaligned_wcsnlen(
+            reinterpret_cast<wchar_t const UNALIGNED*>(m_pbDataNext),
+            cbRemaining / 2u));
+        m_cbCooked = cch * 2u;
+        m_cbRaw =
+            cbRemaining / 2u == cch
+            ? cbRemaining
+            : m_cbCooked + 2u;
+        m_lastError = ERROR_SUCCESS;
+        movedToItem = true;
+        goto Done;
 
-    case TDH_InTypeManifestCountedString:
-    case TDH_INTYPE_COUNTEDSTRING:
-        m_cookedInType = TDH_INTYPE_UNICODESTRING;
+    case PlanSize_Counted:
         StartValueCounted();
-        m_cbCooked &= ~1u; // Round to multiple of 2.
-        break;
-
-    case TDH_INTYPE_REVERSEDCOUNTEDSTRING:
-        m_cookedInType = TDH_INTYPE_UNICODESTRING;
-        StartValueReversedCounted();
-        m_cbCooked &= ~1u; // Round to multiple of 2.
         break;
 
-    case TDH_InTypeManifestCountedAnsiString:
-    case TDH_INTYPE_COUNTEDANSISTRING:
-        m_cookedInType = TDH_INTYPE_ANSISTRING;
+    case PlanSize_Counted16:
         StartValueCounted();
+        m_cbCooked &= ~1u; // Round to multiple of 2.
         break;
 
-    case TDH_INTYPE_REVERSEDCOUNTEDANSISTRING:
-        m_cookedInType = TDH_INTYPE_ANSISTRING;
+    case PlanSize_ReversedCounted:
         StartValueReversedCounted();
         break;
 
-    case TDH_InTypeManifestCountedBinary:
-        m_cookedInType = TDH_INTYPE_BINARY;
-        StartValueCounted();
+    case PlanSize_ReversedCounted16:
+        StartValueReversedCounted();
+        m_cbCooked &= ~1u; // Round to multiple of 2.
         break;
 
-    case TDH_INTYPE_HEXDUMP:
-        m_cookedInType = TDH_INTYPE_BINARY;
+    case PlanSize_HexDump:
         if (cbRemaining < 4)
         {
             m_cbRaw = 4;
@@ -1416,25 +2902,17 @@ EtwEnumerator::StartValue() noexcept
         }
         break;
 
-    case TDH_INTYPE_NONNULLTERMINATEDSTRING:
-        m_cookedInType = TDH_INTYPE_UNICODESTRING;
-        m_cbCooked = cbRemaining & ~1u; // Round to multiple of 2.
+    case PlanSize_NonNullTerminated:
+        m_cbCooked = cbRemaining;
         m_cbRaw = cbRemaining;
         break;
 
-    case TDH_INTYPE_NONNULLTERMINATEDANSISTRING:
-        m_cookedInType = TDH_INTYPE_ANSISTRING;
-        m_cbCooked = cbRemaining;
+    case PlanSize_NonNullTerminated16:
+        m_cbCooked = cbRemaining & ~1u; // Round to multiple of 2.
         m_cbRaw = cbRemaining;
         break;
 
-    case TDH_INTYPE_NULL:
-        m_cbRaw = m_cbCooked = 0;
-        m_lastError = ERROR_SUCCESS;
-        movedToItem = true;
-        goto Done;
-
-    case TDH_INTYPE_SID:
+    case PlanSize_Sid:
         if (cbRemaining < 8u)
         {
             m_cbRaw = 8u;
@@ -1445,20 +2923,17 @@ EtwEnumerator::StartValue() noexcept
         }
         break;
 
-    case TDH_INTYPE_WBEMSID:
-        // A WBEM SID is actually a TOKEN_USER structure followed
-        // by the SID. The TOKEN_USER structure is 2 * pointerSize.
-        m_cookedInType = TDH_INTYPE_SID;
-        propertyLength = 2u * PointerSize();
-        if (cbRemaining < propertyLength + 8u)
+    case PlanSize_WbemSid:
+        cch = 2u * PointerSize(); // Size of TOKEN_USER.
+        if (cbRemaining < cch + 8u)
         {
-            m_cbRaw = propertyLength + 8u;
+            m_cbRaw = cch + 8u;
         }
         else
         {
-            m_pbCooked += propertyLength;
-            m_cbCooked = 8u + (m_pbDataNext[propertyLength + 1u] * 4u);
-            m_cbRaw = static_cast<USHORT>(propertyLength + m_cbCooked);
+            m_pbCooked += cch;
+            m_cbCooked = 8u + (m_pbDataNext[cch + 1u] * 4u);
+            m_cbRaw = static_cast<USHORT>(cch + m_cbCooked);
         }
         break;
 
@@ -1484,56 +2959,440 @@ Done:
     return movedToItem;
 }
 
-void
-EtwEnumerator::StartValueSimple() noexcept
+/*
+Returns the size of one struct of the struct (or array of structs) property
+plan[structIndex], or PlanNone if the struct does not have a fixed size.
+The result is saved in CbStruct. Members must be fixed-size values, structs,
+or fixed-count arrays of these, and must not be referenced (skipping a
+referenced property would lose its value).
+*/
+USHORT
+EtwEnumerator::PlanStructSize(
+    EtwInternal::Buffer<PlanOp>& plan,
+    unsigned structIndex,
+    unsigned depth) noexcept
 {
-    ASSERT(m_stackTop.ArrayIndex < m_stackTop.ArrayCount);
-    ASSERT(!m_stackTop.IsStruct);
-    ASSERT(m_stackTop.IsArray);
-    ASSERT(m_cbElement != 0);
-    ASSERT(m_cbCooked == m_cbElement);
-    ASSERT(m_cbRaw == m_cbElement);
-    ASSERT(m_pbDataNext + m_cbRaw <= m_pbDataEnd);
-    ASSERT(m_state == EtwEnumeratorState_Value);
-    m_pbCooked = m_pbDataNext;
+    auto& structOp = plan[structIndex];
+    ASSERT(structOp.Shape == PlanShape_Struct || structOp.Shape == PlanShape_StructArray);
+
+    if (structOp.Flags & PlanFlags_Sized)
+    {
+        return structOp.CbStruct; // PlanNone while in progress, i.e. for cyclic structs.
+    }
+    else if (depth == 32)
+    {
+        return PlanNone; // Don't cache: may have a size when computed directly.
+    }
+
+    structOp.Flags |= PlanFlags_Sized;
+
+    unsigned cbStruct = 0;
+    for (unsigned i = structOp.StructBegin; i != structOp.StructEnd; i += 1)
+    {
+        auto const& op = plan[i];
+        unsigned cbMember;
+
+        if (op.Flags & (PlanFlags_CountFromProperty | PlanFlags_Referenced))
+        {
+            return PlanNone;
+        }
+
+        switch (op.Shape)
+        {
+        case PlanShape_Scalar:
+        case PlanShape_Array:
+            if (op.Size != PlanSize_Fixed)
+            {
+                return PlanNone;
+            }
+
+            cbMember = op.CbElement;
+            break;
+
+        default:
+            cbMember = PlanStructSize(plan, i, depth + 1);
+            if (cbMember == PlanNone)
+            {
+                return PlanNone;
+            }
+
+            break;
+        }
+
+        if (op.Shape == PlanShape_Array || op.Shape == PlanShape_StructArray)
+        {
+            cbMember *= op.Count;
+        }
+
+        cbStruct += cbMember;
+        if (cbStruct >= PlanNone)
+        {
+            return PlanNone;
+        }
+    }
+
+    structOp.CbStruct = static_cast<USHORT>(cbStruct);
+    return structOp.CbStruct;
 }
 
 void
-EtwEnumerator::StartValueCounted() noexcept
+EtwEnumerator::PlanGroupOffsets(
+    EtwInternal::Buffer<PlanOp>& plan,
+    unsigned groupBegin,
+    unsigned groupEnd) noexcept
 {
-    unsigned const cbRemaining = static_cast<unsigned>(m_pbDataEnd - m_pbDataNext);
-    if (cbRemaining < 2)
+    unsigned offset = 0;
+    for (unsigned i = groupBegin; i != groupEnd; i += 1)
     {
-        m_cbRaw = 2;
+        auto& op = plan[i];
+        unsigned cbProperty;
+
+        op.Offset = (op.Flags & PlanFlags_Grouped) ? PlanNone : static_cast<USHORT>(offset);
+        op.Flags |= PlanFlags_Grouped;
+
+        if (op.Flags & (PlanFlags_CountFromProperty | PlanFlags_Referenced))
+        {
+            break;
+        }
+        else if (op.Shape == PlanShape_Scalar || op.Shape == PlanShape_Array)
+        {
+            if (op.Size != PlanSize_Fixed)
+            {
+                break;
+            }
+
+            cbProperty = op.CbElement;
+        }
+        else if (op.CbStruct != PlanNone)
+        {
+            cbProperty = op.CbStruct;
+        }
+        else
+        {
+            break;
+        }
+
+        offset += cbProperty * (op.Shape == PlanShape_Scalar || op.Shape == PlanShape_Struct ? 1u : op.Count);
+        if (offset >= PlanNone)
+        {
+            break;
+        }
     }
-    else
+}
+
+unsigned
+EtwEnumerator::PlanNameHash(
+    _In_z_ EtwPCWSTR szName) noexcept
+{
+    // FNV-1a over UTF-16 code units.
+    unsigned hash = 2166136261u;
+    for (auto pch = szName; *pch != 0; pch += 1)
     {
-        m_pbCooked = m_pbDataNext + 2;
-        m_cbCooked = m_pbDataNext[0] | (static_cast<unsigned>(m_pbDataNext[1]) << 8);
-        m_cbRaw = static_cast<USHORT>(m_cbCooked + 2);
+        hash = (hash ^ static_cast<USHORT>(*pch)) * 16777619u;
     }
+
+    return hash;
 }
 
-void
-EtwEnumerator::StartValueReversedCounted() noexcept
+bool
+EtwEnumerator::CompilePlan(
+    _In_ TRACE_EVENT_INFO const* pTraceEventInfo,
+    EtwInternal::Buffer<PlanOp>& plan) noexcept
 {
-    unsigned const cbRemaining = static_cast<unsigned>(m_pbDataEnd - m_pbDataNext);
-    if (cbRemaining < 2)
+    bool ok;
+    unsigned const propertyCount = pTraceEventInfo->PropertyCount;
+
+    plan.clear();
+
+    // WPP events are decoded via TDH, not via the property state machine.
+    if (pTraceEventInfo->DecodingSource == DecodingSourceWPP ||
+        propertyCount > 0xffff ||
+        pTraceEventInfo->TopLevelPropertyCount > propertyCount ||
+        !plan.resize(propertyCount, false))
     {
-        m_cbRaw = 2;
+        ok = false;
+        goto Done;
     }
-    else
+
+    for (unsigned i = 0; i != propertyCount; i += 1)
     {
-        m_pbCooked = m_pbDataNext + 2;
-        m_cbCooked = (static_cast<unsigned>(m_pbDataNext[0]) << 8) | m_pbDataNext[1];
-        m_cbRaw = static_cast<USHORT>(m_cbCooked + 2);
+        auto& epi = pTraceEventInfo->EventPropertyInfoArray[i];
+        auto& op = plan[i];
+        bool hasLength;
+
+        op = PlanOp();
+        op.CbStruct = PlanNone;
+        op.Offset = PlanNone;
+        op.NameBucket = PlanNone;
+        op.NameNext = PlanNone;
+
+        if (epi.Flags & PropertyParamCount)
+        {
+            if (epi.countPropertyIndex >= propertyCount)
+            {
+                ok = false;
+                goto Done;
+            }
+
+            op.Flags |= PlanFlags_CountFromProperty;
+        }
+
+        op.Count = epi.count; // Union with countPropertyIndex.
+
+        if (epi.Flags & PropertyStruct)
+        {
+            unsigned const structEnd =
+                static_cast<unsigned>(epi.structType.StructStartIndex) +
+                epi.structType.NumOfStructMembers;
+            if (structEnd > propertyCount)
+            {
+                ok = false;
+                goto Done;
+            }
+
+            op.Shape = (epi.Flags & (PropertyParamCount | PropertyParamFixedCount)) || epi.count != 1
+                ? PlanShape_StructArray
+                : PlanShape_Struct;
+            op.CookedInType = TDH_INTYPE_NULL;
+            op.StructBegin = epi.structType.StructStartIndex;
+            op.StructEnd = static_cast<USHORT>(structEnd);
+            continue;
+        }
+
+        op.Shape = (epi.Flags & (PropertyParamCount | PropertyParamFixedCount)) || epi.count != 1
+            ? PlanShape_Array
+            : PlanShape_Scalar;
+        op.CookedInType = epi.nonStructType.InType;
+
+        if (epi.Flags & PropertyParamLength)
+        {
+            if (epi.lengthPropertyIndex >= propertyCount)
+            {
+                ok = false;
+                goto Done;
+            }
+
+            op.Flags |= PlanFlags_LengthFromProperty;
+            hasLength = true;
+        }
+        else
+        {
+            hasLength = epi.length != 0 || (epi.Flags & PropertyParamFixedLength);
+        }
+
+        op.Length = epi.length; // Union with lengthPropertyIndex.
+
+        switch (epi.nonStructType.InType)
+        {
+        case TDH_INTYPE_UINT8:
+            op.Size = PlanSize_Fixed;
+            op.CbElement = 1;
+            op.Flags |= PlanFlags_RememberInteger;
+            break;
+
+        case TDH_INTYPE_UINT16:
+            op.Size = PlanSize_Fixed;
+            op.CbElement = 2;
+            op.Flags |= PlanFlags_RememberInteger;
+            break;
+
+        case TDH_INTYPE_UINT32:
+        case TDH_INTYPE_HEXINT32:
+            op.Size = PlanSize_Fixed;
+            op.CbElement = 4;
+            op.Flags |= PlanFlags_RememberInteger;
+            break;
+
+        case TDH_INTYPE_INT8:
+        case TDH_INTYPE_ANSICHAR:
+            op.Size = PlanSize_Fixed;
+            op.CbElement = 1;
+            break;
+
+        case TDH_INTYPE_INT16:
+        case TDH_INTYPE_UNICODECHAR:
+            op.Size = PlanSize_Fixed;
+            op.CbElement = 2;
+            break;
+
+        case TDH_INTYPE_INT32:
+        case TDH_INTYPE_FLOAT:
+        case TDH_INTYPE_BOOLEAN:
+            op.Size = PlanSize_Fixed;
+            op.CbElement = 4;
+            break;
+
+        case TDH_INTYPE_INT64:
+        case TDH_INTYPE_UINT64:
+        case TDH_INTYPE_DOUBLE:
+        case TDH_INTYPE_FILETIME:
+        case TDH_INTYPE_HEXINT64:
+            op.Size = PlanSize_Fixed;
+            op.CbElement = 8;
+            break;
+
+        case TDH_INTYPE_GUID:
+        case TDH_INTYPE_SYSTEMTIME:
+            op.Size = PlanSize_Fixed;
+            op.CbElement = 16;
+            break;
+
+        case TDH_INTYPE_POINTER:
+        case TDH_INTYPE_SIZET:
+            op.Size = PlanSize_Pointer;
+            break;
+
+        case TDH_INTYPE_UNICODESTRING:
+            op.Size = hasLength ? PlanSize_Length16 : PlanSize_Utf16Z;
+            break;
+
+        case TDH_INTYPE_ANSISTRING:
+            op.Size = hasLength ? PlanSize_Length : PlanSize_AnsiZ;
+            break;
+
+        case TDH_INTYPE_BINARY:
+            op.Size = PlanSize_Length;
+            if (!hasLength)
+            {
+                // Special case for incorrectly-defined IPV6 addresses.
+                op.Length = TDH_OUTTYPE_IPV6 == epi.nonStructType.OutType ? 16 : 0;
+            }
+            break;
+
+        case TDH_InTypeManifestCountedString:
+        case TDH_INTYPE_COUNTEDSTRING:
+            op.Size = PlanSize_Counted16;
+            op.CookedInType = TDH_INTYPE_UNICODESTRING;
+            break;
+
+        case TDH_INTYPE_REVERSEDCOUNTEDSTRING:
+            op.Size = PlanSize_ReversedCounted16;
+            op.CookedInType = TDH_INTYPE_UNICODESTRING;
+            break;
+
+        case TDH_InTypeManifestCountedAnsiString:
+        case TDH_INTYPE_COUNTEDANSISTRING:
+            op.Size = PlanSize_Counted;
+            op.CookedInType = TDH_INTYPE_ANSISTRING;
+            break;
+
+        case TDH_INTYPE_REVERSEDCOUNTEDANSISTRING:
+            op.Size = PlanSize_ReversedCounted;
+            op.CookedInType = TDH_INTYPE_ANSISTRING;
+            break;
+
+        case TDH_InTypeManifestCountedBinary:
+            op.Size = PlanSize_Counted;
+            op.CookedInType = TDH_INTYPE_BINARY;
+            break;
+
+        case TDH_INTYPE_HEXDUMP:
+            op.Size = PlanSize_HexDump;
+            op.CookedInType = TDH_INTYPE_BINARY;
+            break;
+
+        case TDH_INTYPE_NONNULLTERMINATEDSTRING:
+            op.Size = PlanSize_NonNullTerminated16;
+            op.CookedInType = TDH_INTYPE_UNICODESTRING;
+            break;
+
+        case TDH_INTYPE_NONNULLTERMINATEDANSISTRING:
+            op.Size = PlanSize_NonNullTerminated;
+            op.CookedInType = TDH_INTYPE_ANSISTRING;
+            break;
+
+        case TDH_INTYPE_NULL:
+            op.Size = PlanSize_Null;
+            break;
+
+        case TDH_INTYPE_SID:
+            op.Size = PlanSize_Sid;
+            break;
+
+        case TDH_INTYPE_WBEMSID:
+            op.Size = PlanSize_WbemSid;
+            op.CookedInType = TDH_INTYPE_SID;
+            break;
+
+        default:
+            op.Size = PlanSize_Unsupported;
+            break;
+        }
+    }
+
+    for (unsigned i = 0; i != propertyCount; i += 1)
+    {
+        auto const& op = plan[i];
+        if (op.Flags & PlanFlags_CountFromProperty)
+        {
+            plan[op.Count].Flags |= PlanFlags_Referenced;
+        }
+
+        if (op.Flags & PlanFlags_LengthFromProperty)
+        {
+            plan[op.Length].Flags |= PlanFlags_Referenced;
+        }
+    }
+
+    // Fixed struct sizes, used to skip structs and arrays of structs.
+    for (unsigned i = 0; i != propertyCount; i += 1)
+    {
+        if (plan[i].Shape == PlanShape_Struct || plan[i].Shape == PlanShape_StructArray)
+        {
+            PlanStructSize(plan, i, 0);
+        }
+    }
+
+    /*
+    Fixed offsets: within each group of properties (top-level or members of a
+    struct), a property's offset from the start of the group is known if all
+    properties before it in the group are fixed-size (including fixed-size
+    structs) and are not used as the count or length of another property
+    (skipping such a property would lose its value). A property in more than
+    one group gets no offset.
+    */
+    PlanGroupOffsets(plan, 0, pTraceEventInfo->TopLevelPropertyCount);
+    for (unsigned i = 0; i != propertyCount; i += 1)
+    {
+        auto const& op = plan[i];
+        if (op.Shape == PlanShape_Struct || op.Shape == PlanShape_StructArray)
+        {
+            PlanGroupOffsets(plan, op.StructBegin, op.StructEnd);
+        }
+    }
+
+    // Name index for the top-level properties. Insert in reverse order so
+    // that each bucket lists its properties in ascending order.
+    for (unsigned i = pTraceEventInfo->TopLevelPropertyCount; i != 0; i -= 1)
+    {
+        auto const nameOffset = pTraceEventInfo->EventPropertyInfoArray[i - 1].NameOffset;
+        if (nameOffset != 0)
+        {
+            auto const szName = reinterpret_cast<EtwPCWSTR>(
+                reinterpret_cast<BYTE const*>(pTraceEventInfo) + nameOffset);
+            auto& bucket = plan[PlanNameHash(szName) % pTraceEventInfo->TopLevelPropertyCount].NameBucket;
+            plan[i - 1].NameNext = bucket;
+            bucket = static_cast<USHORT>(i - 1);
+        }
     }
+
+    ok = true;
+
+Done:
+
+    if (!ok)
+    {
+        plan.clear();
+    }
+
+    return ok;
 }
 
 bool
 EtwEnumerator::SetNoneState(LSTATUS error) noexcept
 {
     m_pTraceEventInfo = nullptr;
+    m_pPlan = nullptr;
     m_pEventRecord = nullptr;
     m_pbDataEnd = nullptr;
     m_pbDataNext = nullptr;
@@ -1541,6 +3400,8 @@ EtwEnumerator::SetNoneState(LSTATUS error) noexcept
     m_state = EtwEnumeratorState_None;
     m_subState = SubState_None;
     m_lastError = error;
+    m_tapeRecording = false;
+    m_tapeActive = false;
     return false;
 }
 
@@ -335,3 +335,122 @@ Done:
 
     return status;
 }
+
+LSTATUS __stdcall
+EtwEnumeratorCallbacks::FormatIndexedMapValue(
+    _In_ EVENT_MAP_INFO const* pMapInfo,
+    EtwInternal::MapIndex const& mapIndex,
+    UnderlyingType valueType,
+    ULONG value,
+    EtwStringBuilder& mapBuilder) noexcept
+{
+    UNREFERENCED_PARAMETER(mapIndex);
+    return FormatMapValue(pMapInfo, valueType, value, mapBuilder);
+}
+
+LSTATUS
+EtwEnumeratorCallbacks::FormatMapValueUsingIndex(
+    _In_ EVENT_MAP_INFO const* pMapInfo,
+    EtwInternal::MapIndex const& mapIndex,
+    UnderlyingType valueType,
+    ULONG value,
+    EtwStringBuilder& mapBuilder) noexcept
+{
+    LSTATUS status = ERROR_NOT_FOUND;
+    ULONG entryIndex;
+    UINT64 matchedEntries;
+    ULONG matchedBits;
+    PCWSTR szMap;
+
+    switch (mapIndex.Kind)
+    {
+    case EtwInternal::MapIndexKind_Dense:
+    case EtwInternal::MapIndexKind_Sorted:
+
+        // Valuemap:
+        entryIndex = mapIndex.FindValue(value);
+        if (entryIndex != EtwInternal::MapIndex::NoEntry)
+        {
+            szMap = MapString(pMapInfo, entryIndex);
+            status = mapBuilder.AppendPrintf(
+                valueType == UnderlyingTypeHexadecimal
+                ? L"0x%lX(%.*ls)"
+                :   L"%lu(%.*ls)",
+                value, MapStringLen(szMap), szMap);
+        }
+        else
+        {
+            status = mapBuilder.AppendPrintf(
+                valueType == UnderlyingTypeHexadecimal
+                ? L"0x%lX(??)"
+                :   L"%lu(??)",
+                value);
+        }
+        break;
+
+    case EtwInternal::MapIndexKind_Bitmap:
+
+        // Bitmap: same output as FormatMapValue, entries in map order.
+        matchedBits = 0;
+        matchedEntries = mapIndex.FindBits(pMapInfo, value);
+
+        for (; matchedEntries != 0; matchedEntries &= matchedEntries - 1)
+        {
+            unsigned long i;
+            if (!_BitScanForward(&i, static_cast<ULONG>(matchedEntries)))
+            {
+                _BitScanForward(&i, static_cast<ULONG>(matchedEntries >> 32));
+                i += 32;
+            }
+
+            szMap = MapString(pMapInfo, i);
+            status = status == ERROR_SUCCESS
+                ? mapBuilder.AppendPrintf(
+                    L",%.*ls",
+                    MapStringLen(szMap), szMap)
+                : mapBuilder.AppendPrintf(
+                    valueType == UnderlyingTypeHexadecimal
+                    ? L"0x%lX[%.*ls"
+                    :   L"%lu[%.*ls",
+                    value, MapStringLen(szMap), szMap);
+            if (status != ERROR_SUCCESS)
+            {
+                break;
+            }
+
+            matchedBits |= pMapInfo->MapEntryArray[i].Value;
+        }
+
+        if (status != ERROR_SUCCESS)
+        {
+            // Nothing matched.
+            PCWSTR szItemName = value == 0
+                ? L"" // If value was zero, just show an empty set.
+                : L"??"; // If value was nonzero, indicate no match.
+            status = mapBuilder.AppendPrintf(
+                valueType == UnderlyingTypeHexadecimal
+                ? L"0x%lX[%ls]"
+                :   L"%lu[%ls]",
+                value, szItemName);
+        }
+        else if (matchedBits != value)
+        {
+            // Something matched, but some unused bits were left over.
+            status = mapBuilder.AppendPrintf(L",0x%lX]", value ^ matchedBits);
+        }
+        else
+        {
+            // Everything matched.
+            status = mapBuilder.AppendChar(L']');
+        }
+        break;
+
+    default:
+
+        // No index (e.g. indexed value map): use the map directly.
+        status = EtwEnumeratorCallbacks::FormatMapValue(pMapInfo, valueType, value, mapBuilder);
+        break;
+    }
+
+    return status;
+}
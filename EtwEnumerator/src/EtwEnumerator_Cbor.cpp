@@ -0,0 +1,855 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "stdafx.h"
+#include <EtwEnumerator.h>
+#include "EtwBuffer.inl"
+#include "EtwUtility.inl"
+
+/*
+Implementation of EtwEnumerator::WriteCurrentEventAsCbor.
+This code is in a separate file so that users who don't need CBOR output
+don't need to link it.
+*/
+
+using EtwInternal::UnixEpochFileTime;
+using EtwInternal::WriteUtf16AsUtf8;
+
+// Macros for some recently-defined constants so that this can compile
+// using an older Windows SDK.
+#define TDH_InTypeManifestCountedString        22 // TDH_INTYPE_MANIFEST_COUNTEDSTRING
+#define TDH_InTypeManifestCountedAnsiString    23 // TDH_INTYPE_MANIFEST_COUNTEDANSISTRING
+#define TDH_InTypeManifestCountedBinary        25 // TDH_INTYPE_MANIFEST_COUNTEDBINARY
+#define TDH_OutTypeCodePointer                 static_cast<_TDH_OUT_TYPE>(37) // TDH_OUTTYPE_CODE_POINTER
+
+// if OP != ERROR_SUCCESS then set status = result_of_OP and goto Done.
+#define CheckWin32(status, op) \
+    { \
+    LSTATUS const tmpStatus = (op); \
+    if (ERROR_SUCCESS != tmpStatus) { status = tmpStatus; goto Done; } \
+    } \
+
+// if OP == false then set status = ERROR_OUTOFMEMORY and goto Done.
+#define CheckOutOfMem(status, op) \
+    { \
+    if (!(op)) { status = ERROR_OUTOFMEMORY; goto Done; } \
+    } \
+
+// if OP == false then goto Done.
+#define CheckAdd(op) \
+    { \
+    if (!(op)) { goto Done; } \
+    } \
+
+using Utf8Buffer = EtwInternal::Buffer<char>;
+
+// Must match the definition in EtwEnumerator_Format.cpp.
+enum EtwEnumerator::ValueType
+    : UCHAR
+{
+    ValueType_None,
+    ValueType_JsonString,      // string, may need to be escaped.
+    ValueType_JsonCleanString, // string, does not need to be escaped.
+    ValueType_JsonLiteral,     // true, false, null, or finite number.
+};
+
+static UINT64 const FileTimeTicksPerSecond = 10000000;
+
+// CBOR major types (RFC 8949 section 3.1).
+static BYTE const CborUnsigned = 0;
+static BYTE const CborNegative = 1;
+static BYTE const CborBytes = 2;
+static BYTE const CborText = 3;
+static BYTE const CborTag = 6;
+
+// CBOR initial bytes for simple values and indefinite-length items.
+static char const CborFalse = '\xF4';
+static char const CborTrue = '\xF5';
+static char const CborNull = '\xF6';
+static char const CborArrayStart = '\x9F';
+static char const CborMapStart = '\xBF';
+static char const CborBreak = '\xFF';
+
+// CBOR tags.
+static UINT64 const CborTagEpochTime = 1;
+static UINT64 const CborTagUuid = 37;
+
+static bool
+CborAppend(
+    Utf8Buffer& output,
+    _In_reads_bytes_(cb) void const* pb,
+    unsigned cb) noexcept
+{
+    auto const oldSize = output.size();
+    bool const ok = output.resize(oldSize + cb);
+    if (ok)
+    {
+        memcpy(output.data() + oldSize, pb, cb);
+    }
+
+    return ok;
+}
+
+// Appends an initial byte and argument (RFC 8949 section 3).
+static bool
+CborHead(
+    Utf8Buffer& output,
+    BYTE majorType,
+    UINT64 argument) noexcept
+{
+    BYTE head[9];
+    unsigned cb;
+
+    if (argument < 24)
+    {
+        head[0] = static_cast<BYTE>((majorType << 5) | argument);
+        cb = 1;
+    }
+    else
+    {
+        unsigned const cbArgument =
+            argument <= 0xFF ? 1
+            : argument <= 0xFFFF ? 2
+            : argument <= 0xFFFFFFFF ? 4
+            : 8;
+        head[0] = static_cast<BYTE>((majorType << 5) | (cbArgument == 1 ? 24 : cbArgument == 2 ? 25 : cbArgument == 4 ? 26 : 27));
+        for (unsigned i = 0; i != cbArgument; i += 1)
+        {
+            head[cbArgument - i] = static_cast<BYTE>(argument >> (i * 8)); // Big-endian.
+        }
+
+        cb = 1 + cbArgument;
+    }
+
+    return CborAppend(output, head, cb);
+}
+
+static bool
+CborSigned(
+    Utf8Buffer& output,
+    INT64 value) noexcept
+{
+    return value >= 0
+        ? CborHead(output, CborUnsigned, static_cast<UINT64>(value))
+        : CborHead(output, CborNegative, ~static_cast<UINT64>(value)); // -1 - value
+}
+
+static bool
+CborFloat(
+    Utf8Buffer& output,
+    float value) noexcept
+{
+    UINT32 bits;
+    memcpy(&bits, &value, 4);
+    BYTE const bytes[] = {
+        0xFA,
+        static_cast<BYTE>(bits >> 24), static_cast<BYTE>(bits >> 16),
+        static_cast<BYTE>(bits >> 8), static_cast<BYTE>(bits) };
+    return CborAppend(output, bytes, sizeof(bytes));
+}
+
+static bool
+CborDouble(
+    Utf8Buffer& output,
+    double value) noexcept
+{
+    UINT64 bits;
+    memcpy(&bits, &value, 8);
+    BYTE bytes[9];
+    bytes[0] = 0xFB;
+    for (unsigned i = 0; i != 8; i += 1)
+    {
+        bytes[8 - i] = static_cast<BYTE>(bits >> (i * 8)); // Big-endian.
+    }
+
+    return CborAppend(output, bytes, sizeof(bytes));
+}
+
+static bool
+CborByteString(
+    Utf8Buffer& output,
+    _In_reads_bytes_(cb) void const* pb,
+    unsigned cb) noexcept
+{
+    return CborHead(output, CborBytes, cb)
+        && CborAppend(output, pb, cb);
+}
+
+// Appends an ASCII string literal as a text string.
+template<unsigned N>
+static bool
+CborLiteral(
+    Utf8Buffer& output,
+    char const (&stringLiteral)[N]) noexcept
+{
+    return CborHead(output, CborText, N - 1)
+        && CborAppend(output, stringLiteral, N - 1);
+}
+
+// Appends pch[0..cch) as a UTF-8 text string.
+static bool
+CborUtf16Text(
+    Utf8Buffer& output,
+    _In_reads_(cch) EtwWCHAR const* pch,
+    unsigned cch) noexcept
+{
+    // Encode after room for the largest head, then move the text down to
+    // follow the actual head.
+    bool ok;
+    auto const oldSize = output.size();
+    UINT64 const maxSize = oldSize + 9 + UINT64(cch) * 3;
+    if (maxSize > 0xFFFFFFFF || !output.reserve(static_cast<unsigned>(maxSize)))
+    {
+        ok = false;
+    }
+    else
+    {
+        auto const pbText = reinterpret_cast<BYTE*>(output.data() + oldSize + 9);
+        unsigned const cbText = static_cast<unsigned>(WriteUtf16AsUtf8(pbText, pch, cch) - pbText);
+        CborHead(output, CborText, cbText); // Cannot fail: capacity is reserved.
+        memmove(output.data() + output.size(), pbText, cbText);
+        output.resize_unchecked(output.size() + cbText);
+        ok = true;
+    }
+
+    return ok;
+}
+
+static bool
+CborUtf16Text(
+    Utf8Buffer& output,
+    _In_z_ EtwPCWSTR sz) noexcept
+{
+    return CborUtf16Text(output, sz, static_cast<unsigned>(wcslen(sz)));
+}
+
+// Appends a GUID as tag 37 with the bytes in RFC 4122 order.
+static bool
+CborUuid(
+    Utf8Buffer& output,
+    GUID const& guid) noexcept
+{
+    BYTE bytes[16];
+    bytes[0] = static_cast<BYTE>(guid.Data1 >> 24);
+    bytes[1] = static_cast<BYTE>(guid.Data1 >> 16);
+    bytes[2] = static_cast<BYTE>(guid.Data1 >> 8);
+    bytes[3] = static_cast<BYTE>(guid.Data1);
+    bytes[4] = static_cast<BYTE>(guid.Data2 >> 8);
+    bytes[5] = static_cast<BYTE>(guid.Data2);
+    bytes[6] = static_cast<BYTE>(guid.Data3 >> 8);
+    bytes[7] = static_cast<BYTE>(guid.Data3);
+    memcpy(bytes + 8, guid.Data4, 8);
+    return CborHead(output, CborTag, CborTagUuid)
+        && CborByteString(output, bytes, sizeof(bytes));
+}
+
+// Appends a FILETIME as tag 1 (seconds since 1970).
+static bool
+CborFileTime(
+    Utf8Buffer& output,
+    UINT64 fileTime) noexcept
+{
+    bool const afterEpoch = fileTime >= UnixEpochFileTime;
+    UINT64 const ticks = afterEpoch ? fileTime - UnixEpochFileTime : UnixEpochFileTime - fileTime;
+    UINT64 const seconds = ticks / FileTimeTicksPerSecond;
+    UINT64 const fraction = ticks % FileTimeTicksPerSecond;
+
+    if (!CborHead(output, CborTag, CborTagEpochTime))
+    {
+        return false;
+    }
+    else if (fraction == 0)
+    {
+        return afterEpoch
+            ? CborHead(output, CborUnsigned, seconds)
+            : CborHead(output, CborNegative, seconds - 1); // -seconds
+    }
+    else
+    {
+        double const value = static_cast<double>(seconds) +
+            static_cast<double>(fraction) / FileTimeTicksPerSecond;
+        return CborDouble(output, afterEpoch ? value : -value);
+    }
+}
+
+bool
+EtwEnumerator::AddCurrentEventAsCbor(
+    Utf8Buffer& output,
+    EtwInternal::Buffer<wchar_t>& scratchBuffer,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
+{
+    ASSERT(m_state == EtwEnumeratorState_BeforeFirstItem);
+
+    auto& desc = m_pEventRecord->EventHeader.EventDescriptor;
+    int depth = 1;
+
+    // items start
+    CheckOutOfMem(m_lastError, output.push_back(CborMapStart));
+
+    if (MoveNext())
+    {
+        do
+        {
+            switch (m_state)
+            {
+            case EtwEnumeratorState_Value:
+
+                if (!m_stackTop.IsArray)
+                {
+                    auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
+                    CheckOutOfMem(m_lastError, CborUtf16Text(output,
+                        epi.NameOffset ? TeiStringNoCheck(epi.NameOffset) : L""));
+                }
+
+                CheckAdd(AddCurrentValueAsCbor(output, scratchBuffer));
+                CheckAdd(FlushOutput(output));
+                break;
+
+            case EtwEnumeratorState_ArrayBegin:
+            case EtwEnumeratorState_StructBegin:
+
+                // Array elements have no name. Arrays of structs begin with
+                // ArrayBegin (named), then each struct is an unnamed element.
+                if (m_state == EtwEnumeratorState_ArrayBegin || !m_stackTop.IsArray)
+                {
+                    auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
+                    CheckOutOfMem(m_lastError, CborUtf16Text(output,
+                        epi.NameOffset ? TeiStringNoCheck(epi.NameOffset) : L""));
+                }
+
+                CheckOutOfMem(m_lastError, output.push_back(
+                    m_state == EtwEnumeratorState_ArrayBegin ? CborArrayStart : CborMapStart));
+                depth += 1;
+                break;
+
+            case EtwEnumeratorState_ArrayEnd:
+            case EtwEnumeratorState_StructEnd:
+
+                CheckOutOfMem(m_lastError, output.push_back(CborBreak));
+                CheckAdd(FlushOutput(output));
+                depth -= 1;
+                break;
+
+            default:
+
+                m_lastError = ERROR_INVALID_STATE;
+                goto Done;
+            }
+        } while (MoveNext() && depth > 0);
+
+        if (m_lastError != ERROR_SUCCESS)
+        {
+            goto Done;
+        }
+    }
+    else if (m_lastError != ERROR_SUCCESS)
+    {
+        goto Done;
+    }
+
+    if (jsonSuffixFlags != 0)
+    {
+        // meta start
+        CheckOutOfMem(m_lastError, CborLiteral(output, "meta"));
+        CheckOutOfMem(m_lastError, output.push_back(CborMapStart));
+
+        if (jsonSuffixFlags & EtwJsonSuffixFlags_provider)
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "provider"));
+            if (m_pTraceEventInfo->ProviderNameOffset)
+            {
+                CheckOutOfMem(m_lastError, CborUtf16Text(output,
+                    TeiStringNoCheck(m_pTraceEventInfo->ProviderNameOffset)));
+            }
+            else
+            {
+                unsigned const oldSize = scratchBuffer.size();
+                CheckWin32(m_lastError, AppendCurrentProviderNameFallback(scratchBuffer));
+                CheckOutOfMem(m_lastError, CborUtf16Text(output,
+                    scratchBuffer.data() + oldSize,
+                    scratchBuffer.size() - oldSize));
+                scratchBuffer.resize_unchecked(oldSize);
+            }
+        }
+
+        if (jsonSuffixFlags & EtwJsonSuffixFlags_event)
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "event"));
+            LPCWSTR const eventName = EventName();
+            if (eventName)
+            {
+                CheckOutOfMem(m_lastError, CborUtf16Text(output, eventName));
+            }
+            else
+            {
+                // No EventName set. Use fallback.
+                unsigned const oldSize = scratchBuffer.size();
+                CheckWin32(m_lastError, AppendCurrentEventNameFallback(scratchBuffer));
+                CheckOutOfMem(m_lastError, CborUtf16Text(output,
+                    scratchBuffer.data() + oldSize,
+                    scratchBuffer.size() - oldSize));
+                scratchBuffer.resize_unchecked(oldSize);
+            }
+        }
+
+        if (jsonSuffixFlags & EtwJsonSuffixFlags_time)
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "time"));
+            CheckOutOfMem(m_lastError, CborFileTime(output,
+                static_cast<UINT64>(m_pEventRecord->EventHeader.TimeStamp.QuadPart)));
+        }
+
+        if (jsonSuffixFlags & EtwJsonSuffixFlags_cpu)
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "cpu"));
+            CheckOutOfMem(m_lastError, CborHead(output, CborUnsigned,
+                GetEventProcessorIndex(m_pEventRecord)));
+        }
+
+        if ((jsonSuffixFlags & EtwJsonSuffixFlags_pid) &&
+            m_pEventRecord->EventHeader.ProcessId != 0xffffffff)
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "pid"));
+            CheckOutOfMem(m_lastError, CborHead(output, CborUnsigned,
+                m_pEventRecord->EventHeader.ProcessId));
+        }
+
+        if ((jsonSuffixFlags & EtwJsonSuffixFlags_tid) &&
+            m_pEventRecord->EventHeader.ThreadId != 0xffffffff)
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "tid"));
+            CheckOutOfMem(m_lastError, CborHead(output, CborUnsigned,
+                m_pEventRecord->EventHeader.ThreadId));
+        }
+
+        if (jsonSuffixFlags & EtwJsonSuffixFlags_id)
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "id"));
+            CheckOutOfMem(m_lastError, CborHead(output, CborUnsigned, desc.Id));
+        }
+
+        if ((jsonSuffixFlags & EtwJsonSuffixFlags_version) &&
+            desc.Version != 0)
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "version"));
+            CheckOutOfMem(m_lastError, CborHead(output, CborUnsigned, desc.Version));
+        }
+
+        if ((jsonSuffixFlags & EtwJsonSuffixFlags_channel) &&
+            desc.Channel != 0)
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "channel"));
+            CheckOutOfMem(m_lastError, m_pTraceEventInfo->ChannelNameOffset != 0
+                ? CborUtf16Text(output, TeiStringNoCheck(m_pTraceEventInfo->ChannelNameOffset))
+                : CborHead(output, CborUnsigned, desc.Channel));
+        }
+
+        if ((jsonSuffixFlags & EtwJsonSuffixFlags_level) &&
+            desc.Level != 0)
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "level"));
+            CheckOutOfMem(m_lastError, m_pTraceEventInfo->LevelNameOffset != 0
+                ? CborUtf16Text(output, TeiStringNoCheck(m_pTraceEventInfo->LevelNameOffset))
+                : CborHead(output, CborUnsigned, desc.Level));
+        }
+
+        if ((jsonSuffixFlags & EtwJsonSuffixFlags_opcode) &&
+            desc.Opcode != 0 &&
+            // Note: for Wbem, opcode is the event name, so don't show an opcode property.
+            m_pTraceEventInfo->DecodingSource != DecodingSourceWbem)
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "opcode"));
+            auto const opcodeName = OpcodeName();
+            CheckOutOfMem(m_lastError, opcodeName
+                ? CborUtf16Text(output, opcodeName)
+                : CborHead(output, CborUnsigned, desc.Opcode));
+        }
+
+        if ((jsonSuffixFlags & EtwJsonSuffixFlags_task) &&
+            // Note: for Wbem, we show task name even if task is 0.
+            (desc.Task != 0 || m_pTraceEventInfo->DecodingSource == DecodingSourceWbem))
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "task"));
+            auto const taskName = TaskName();
+            CheckOutOfMem(m_lastError, taskName
+                ? CborUtf16Text(output, taskName)
+                : CborHead(output, CborUnsigned, desc.Task));
+        }
+
+        if ((jsonSuffixFlags & EtwJsonSuffixFlags_keywords) &&
+            desc.Keyword != 0)
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "keywords"));
+            CheckOutOfMem(m_lastError, m_pTraceEventInfo->KeywordsNameOffset != 0
+                ? CborUtf16Text(output, TeiStringNoCheck(m_pTraceEventInfo->KeywordsNameOffset))
+                : CborHead(output, CborUnsigned, desc.Keyword));
+        }
+
+        if ((jsonSuffixFlags & EtwJsonSuffixFlags_tags) &&
+            m_pTraceEventInfo->Tags != 0)
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "tags"));
+            CheckOutOfMem(m_lastError, CborHead(output, CborUnsigned, m_pTraceEventInfo->Tags));
+        }
+
+        if ((jsonSuffixFlags & EtwJsonSuffixFlags_activity) &&
+            m_pEventRecord->EventHeader.ActivityId != GUID())
+        {
+            CheckOutOfMem(m_lastError, CborLiteral(output, "activity"));
+            CheckOutOfMem(m_lastError, CborUuid(output, m_pEventRecord->EventHeader.ActivityId));
+        }
+
+        if (jsonSuffixFlags & EtwJsonSuffixFlags_relatedActivity)
+        {
+            for (unsigned i = 0; i != m_pEventRecord->ExtendedDataCount; i++)
+            {
+                if (m_pEventRecord->ExtendedData[i].ExtType == EVENT_HEADER_EXT_TYPE_RELATED_ACTIVITYID &&
+                    m_pEventRecord->ExtendedData[i].DataSize == 16)
+                {
+                    GUID g;
+                    memcpy(&g, reinterpret_cast<void const*>(
+                        static_cast<UINT_PTR>(m_pEventRecord->ExtendedData[i].DataPtr)), 16);
+                    CheckOutOfMem(m_lastError, CborLiteral(output, "relatedActivity"));
+                    CheckOutOfMem(m_lastError, CborUuid(output, g));
+                    break;
+                }
+            }
+        }
+
+        if (0 != (m_pEventRecord->EventHeader.Flags & EVENT_HEADER_FLAG_PRIVATE_SESSION))
+        {
+            // ptime is only valid for private sessions where ProviderId != EventTraceGuid.
+            if ((jsonSuffixFlags & EtwJsonSuffixFlags_ptime) &&
+                m_pEventRecord->EventHeader.ProviderId != EventTraceGuid)
+            {
+                CheckOutOfMem(m_lastError, CborLiteral(output, "ptime"));
+                CheckOutOfMem(m_lastError, CborHead(output, CborUnsigned,
+                    m_pEventRecord->EventHeader.ProcessorTime));
+            }
+        }
+        else if (0 == (m_pEventRecord->EventHeader.Flags & EVENT_HEADER_FLAG_NO_CPUTIME))
+        {
+            if (jsonSuffixFlags & EtwJsonSuffixFlags_ktime)
+            {
+                CheckOutOfMem(m_lastError, CborLiteral(output, "ktime"));
+                CheckOutOfMem(m_lastError, CborHead(output, CborUnsigned,
+                    TicksToMilliseconds(m_pEventRecord->EventHeader.KernelTime)));
+            }
+
+            if (jsonSuffixFlags & EtwJsonSuffixFlags_utime)
+            {
+                CheckOutOfMem(m_lastError, CborLiteral(output, "utime"));
+                CheckOutOfMem(m_lastError, CborHead(output, CborUnsigned,
+                    TicksToMilliseconds(m_pEventRecord->EventHeader.UserTime)));
+            }
+        }
+
+        if (jsonSuffixFlags & EtwJsonSuffixFlags_attribs)
+        {
+            LPCWSTR const eventAttributes = EventAttributes();
+            if (eventAttributes)
+            {
+                CheckOutOfMem(m_lastError, CborLiteral(output, "attribs"));
+                CheckOutOfMem(m_lastError, CborUtf16Text(output, eventAttributes));
+            }
+        }
+
+        // meta end
+        CheckOutOfMem(m_lastError, output.push_back(CborBreak));
+    }
+
+    // items end
+    CheckOutOfMem(m_lastError, output.push_back(CborBreak));
+
+    m_lastError = ERROR_SUCCESS;
+
+Done:
+
+    return m_lastError == ERROR_SUCCESS;
+}
+
+bool
+EtwEnumerator::AddCurrentValueAsCbor(
+    Utf8Buffer& output,
+    EtwInternal::Buffer<wchar_t>& scratchBuffer) noexcept
+{
+    ASSERT(m_state == EtwEnumeratorState_Value);
+
+    auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
+    auto const outType = static_cast<_TDH_OUT_TYPE>(epi.nonStructType.OutType);
+    auto const pData = m_pbCooked;
+    unsigned const cbData = m_cbCooked;
+    auto const scratchOldSize = scratchBuffer.size();
+    bool formatted = false; // true if the value should be formatted as text.
+
+#pragma warning(push)
+#pragma warning(disable: 4063) // case '...' is not a valid value for switch of enum '...'
+
+    if ((epi.nonStructType.MapNameOffset != 0 &&
+        0 == (epi.Flags & (PropertyHasCustomSchema | PropertyStruct))) ||
+        outType == TDH_OUTTYPE_HRESULT ||
+        outType == TDH_OUTTYPE_WIN32ERROR ||
+        outType == TDH_OUTTYPE_NTSTATUS)
+    {
+        // If the value has a map name or result-code name, use the name.
+        // Otherwise, AddCurrentValue formats the number, which is encoded as
+        // an integer below.
+        auto const result = AddCurrentValue(scratchBuffer);
+        if (result == ValueType_None)
+        {
+            goto Done;
+        }
+        else if (result == ValueType_JsonString)
+        {
+            CheckOutOfMem(m_lastError, CborUtf16Text(output,
+                scratchBuffer.data() + scratchOldSize,
+                scratchBuffer.size() - scratchOldSize));
+            goto Done;
+        }
+
+        scratchBuffer.resize_unchecked(scratchOldSize);
+    }
+
+    switch (m_cookedInType)
+    {
+    case TDH_INTYPE_NULL:
+        CheckOutOfMem(m_lastError, output.push_back(CborNull));
+        break;
+
+    case TDH_INTYPE_UNICODESTRING:
+    case TDH_InTypeManifestCountedString:
+    case TDH_INTYPE_COUNTEDSTRING:
+    case TDH_INTYPE_REVERSEDCOUNTEDSTRING:
+    case TDH_INTYPE_NONNULLTERMINATEDSTRING:
+    case TDH_INTYPE_UNICODECHAR:
+        CheckOutOfMem(m_lastError, CborUtf16Text(output,
+            reinterpret_cast<EtwWCHAR const*>(pData), cbData / 2));
+        break;
+
+    case TDH_INTYPE_INT8:
+    case TDH_INTYPE_INT16:
+    case TDH_INTYPE_INT32:
+    case TDH_INTYPE_INT64:
+        if (cbData == 1 && outType != TDH_OUTTYPE_STRING)
+        {
+            CheckOutOfMem(m_lastError, CborSigned(output, *reinterpret_cast<INT8 const*>(pData)));
+        }
+        else if (cbData == 2 && m_cookedInType == TDH_INTYPE_INT16)
+        {
+            INT16 value;
+            memcpy(&value, pData, 2);
+            CheckOutOfMem(m_lastError, CborSigned(output, value));
+        }
+        else if (cbData == 4 && m_cookedInType == TDH_INTYPE_INT32)
+        {
+            INT32 value;
+            memcpy(&value, pData, 4);
+            CheckOutOfMem(m_lastError, CborSigned(output, value));
+        }
+        else if (cbData == 8 && m_cookedInType == TDH_INTYPE_INT64)
+        {
+            INT64 value;
+            memcpy(&value, pData, 8);
+            CheckOutOfMem(m_lastError, CborSigned(output, value));
+        }
+        else
+        {
+            formatted = true; // Invalid size or string.
+        }
+        break;
+
+    case TDH_INTYPE_UINT8:
+    case TDH_INTYPE_UINT16:
+    case TDH_INTYPE_UINT32:
+    case TDH_INTYPE_HEXINT32:
+    case TDH_INTYPE_UINT64:
+    case TDH_INTYPE_HEXINT64:
+        if (cbData == 1 && m_cookedInType == TDH_INTYPE_UINT8 && outType != TDH_OUTTYPE_STRING)
+        {
+            CheckOutOfMem(m_lastError, CborHead(output, CborUnsigned, *pData));
+        }
+        else if (cbData == 2 && m_cookedInType == TDH_INTYPE_UINT16 && outType != TDH_OUTTYPE_STRING)
+        {
+            UINT16 value;
+            memcpy(&value, pData, 2);
+            CheckOutOfMem(m_lastError, CborHead(output, CborUnsigned,
+                outType == TDH_OUTTYPE_PORT ? _byteswap_ushort(value) : value));
+        }
+        else if (cbData == 4 &&
+            (m_cookedInType == TDH_INTYPE_UINT32 || m_cookedInType == TDH_INTYPE_HEXINT32) &&
+            outType != TDH_OUTTYPE_IPV4)
+        {
+            UINT32 value;
+            memcpy(&value, pData, 4);
+            CheckOutOfMem(m_lastError, CborHead(output, CborUnsigned, value));
+        }
+        else if (cbData == 8 &&
+            (m_cookedInType == TDH_INTYPE_UINT64 || m_cookedInType == TDH_INTYPE_HEXINT64))
+        {
+            UINT64 value;
+            memcpy(&value, pData, 8);
+            CheckOutOfMem(m_lastError, CborHead(output, CborUnsigned, value));
+        }
+        else
+        {
+            formatted = true; // Invalid size, string, or IP address.
+        }
+        break;
+
+    case TDH_INTYPE_POINTER:
+    case TDH_INTYPE_SIZET:
+        if (cbData == 8)
+        {
+            UINT64 value;
+            memcpy(&value, pData, 8);
+            CheckOutOfMem(m_lastError, outType == TDH_OUTTYPE_LONG
+                ? CborSigned(output, static_cast<INT64>(value))
+                : CborHead(output, CborUnsigned, value));
+        }
+        else if (cbData == 4)
+        {
+            UINT32 value;
+            memcpy(&value, pData, 4);
+            CheckOutOfMem(m_lastError, outType == TDH_OUTTYPE_LONG
+                ? CborSigned(output, static_cast<INT32>(value))
+                : CborHead(output, CborUnsigned, value));
+        }
+        else
+        {
+            formatted = true; // Invalid size.
+        }
+        break;
+
+    case TDH_INTYPE_FLOAT:
+        if (cbData == 4)
+        {
+            float value;
+            memcpy(&value, pData, 4);
+            CheckOutOfMem(m_lastError, CborFloat(output, value));
+        }
+        else
+        {
+            formatted = true; // Invalid size.
+        }
+        break;
+
+    case TDH_INTYPE_DOUBLE:
+        if (cbData == 8)
+        {
+            double value;
+            memcpy(&value, pData, 8);
+            CheckOutOfMem(m_lastError, CborDouble(output, value));
+        }
+        else
+        {
+            formatted = true; // Invalid size.
+        }
+        break;
+
+    case TDH_INTYPE_BOOLEAN:
+        if (cbData == 4)
+        {
+            INT32 value;
+            memcpy(&value, pData, 4);
+            CheckOutOfMem(m_lastError, output.push_back(value != 0 ? CborTrue : CborFalse));
+        }
+        else
+        {
+            formatted = true; // Invalid size.
+        }
+        break;
+
+    case TDH_INTYPE_GUID:
+        if (cbData == 16)
+        {
+            GUID value;
+            memcpy(&value, pData, 16);
+            CheckOutOfMem(m_lastError, CborUuid(output, value));
+        }
+        else
+        {
+            formatted = true; // Invalid size.
+        }
+        break;
+
+    case TDH_INTYPE_FILETIME:
+        if (cbData == 8)
+        {
+            UINT64 value;
+            memcpy(&value, pData, 8);
+            CheckOutOfMem(m_lastError, CborFileTime(output, value));
+        }
+        else
+        {
+            formatted = true; // Invalid size.
+        }
+        break;
+
+    case TDH_INTYPE_ANSISTRING:
+    case TDH_InTypeManifestCountedAnsiString:
+    case TDH_INTYPE_COUNTEDANSISTRING:
+    case TDH_INTYPE_REVERSEDCOUNTEDANSISTRING:
+    case TDH_INTYPE_NONNULLTERMINATEDANSISTRING:
+    case TDH_INTYPE_ANSICHAR:
+    case TDH_INTYPE_SYSTEMTIME:
+    case TDH_INTYPE_SID:
+    case TDH_INTYPE_WBEMSID:
+        formatted = true; // Needs code page conversion or formatting.
+        break;
+
+    case TDH_INTYPE_BINARY:
+    case TDH_InTypeManifestCountedBinary:
+    case TDH_INTYPE_HEXDUMP:
+    default:
+        if (outType == TDH_OUTTYPE_IPV6 || outType == TDH_OUTTYPE_SOCKETADDRESS)
+        {
+            formatted = true;
+        }
+        else
+        {
+            CheckOutOfMem(m_lastError, CborByteString(output, pData, cbData));
+        }
+        break;
+    }
+
+#pragma warning(pop)
+
+    if (formatted)
+    {
+        if (ValueType_None == AddCurrentValue(scratchBuffer))
+        {
+            goto Done;
+        }
+
+        CheckOutOfMem(m_lastError, CborUtf16Text(output,
+            scratchBuffer.data() + scratchOldSize,
+            scratchBuffer.size() - scratchOldSize));
+    }
+
+    m_lastError = ERROR_SUCCESS;
+
+Done:
+
+    scratchBuffer.resize_unchecked(scratchOldSize);
+    return m_lastError == ERROR_SUCCESS;
+}
+
+bool
+EtwEnumerator::WriteCurrentEventAsCbor(
+    EtwOutputSink& sink,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
+{
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    auto& output = m_utf8Buffer;
+    auto& scratchBuffer = m_stringBuffer;
+    output.clear();
+    scratchBuffer.clear();
+
+    Reset();
+
+    BeginSinkResult(&sink, true);
+    bool const ok = AddCurrentEventAsCbor(output, scratchBuffer, jsonSuffixFlags)
+        && SinkResultBytes(sink, output.data(), output.size());
+    return EndSinkResult(sink, ok);
+}
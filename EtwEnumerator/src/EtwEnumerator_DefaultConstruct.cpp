@@ -13,7 +13,18 @@ tdh.lib or DefaultCallbacksInstance.
 namespace EtwInternal
 {
     // EtwEnumeratorCallbacks used for default-constructed EtwEnumerator:
-    struct DefaultCallbacks final : EtwEnumeratorCallbacks {};
+    struct DefaultCallbacks final : EtwEnumeratorCallbacks
+    {
+        LSTATUS __stdcall FormatIndexedMapValue(
+            _In_ EVENT_MAP_INFO const* pMapInfo,
+            MapIndex const& mapIndex,
+            UnderlyingType valueType,
+            ULONG value,
+            EtwStringBuilder& mapBuilder) noexcept override
+        {
+            return FormatMapValueUsingIndex(pMapInfo, mapIndex, valueType, value, mapBuilder);
+        }
+    };
 }
 // namespace EtwInternal
 
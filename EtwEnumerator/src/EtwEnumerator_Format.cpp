@@ -4,18 +4,25 @@
 #include "stdafx.h"
 #include <EtwEnumerator.h>
 #include "EtwBuffer.inl"
+#include "EtwUtility.inl"
 #include <ws2def.h>
 #include <ws2ipdef.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h> // SSE2
+#endif
+
 /*
 This code is in a separate file so that if the user doesn't use the Format
 functions they won't need to link against the APIs we use here (_vsnwprintf,
 MultiByteToWideChar).
 */
 
+using EtwInternal::WriteUtf16AsUtf8;
+
 #pragma region Local definitions
 
 // Macros for some recently-defined constants so that this can compile
@@ -59,9 +66,35 @@ static LSTATUS VerifyLstatus(int op) = delete;
 static __forceinline bool VerifyBool(bool op) { return op; }
 static bool VerifyBool(int op) = delete;
 
+// Metadata that can differ between events with the same schema. Schema JSON
+// writes these per event and the rest once per schema.
+static auto const JsonSuffixFlags_Dynamic = static_cast<EtwJsonSuffixFlags>(
+    EtwJsonSuffixFlags_time |
+    EtwJsonSuffixFlags_cpu |
+    EtwJsonSuffixFlags_pid |
+    EtwJsonSuffixFlags_tid |
+    EtwJsonSuffixFlags_activity |
+    EtwJsonSuffixFlags_relatedActivity |
+    EtwJsonSuffixFlags_ptime |
+    EtwJsonSuffixFlags_ktime |
+    EtwJsonSuffixFlags_utime);
+
 static char const* const UppercaseHexChars = "0123456789ABCDEF";
 static char const* const LowercaseHexChars = "0123456789abcdef";
 
+// "00" through "99", for writing two decimal digits at a time.
+static char const DecimalDigitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
 using Buffer = EtwInternal::Buffer<wchar_t>;
 
 static bool
@@ -283,6 +316,152 @@ AppendBoolean(
         : AppendLiteral(output, L"false");
 }
 
+/*
+Writes the decimal digits of value so that they end at pchEnd.
+Returns a pointer to the first digit. Needs room for 20 digits.
+*/
+static wchar_t*
+WriteDecimalDigits(
+    wchar_t* pchEnd,
+    UINT64 value) noexcept
+{
+    wchar_t* pch = pchEnd;
+
+    while (value > 0xFFFFFFFF)
+    {
+        unsigned const pair = static_cast<unsigned>(value % 100) * 2;
+        value /= 100;
+        pch -= 2;
+        pch[0] = DecimalDigitPairs[pair];
+        pch[1] = DecimalDigitPairs[pair + 1];
+    }
+
+    // Remaining digits fit in 32 bits, which is faster to divide.
+    auto value32 = static_cast<UINT32>(value);
+    while (value32 >= 100)
+    {
+        unsigned const pair = (value32 % 100) * 2;
+        value32 /= 100;
+        pch -= 2;
+        pch[0] = DecimalDigitPairs[pair];
+        pch[1] = DecimalDigitPairs[pair + 1];
+    }
+
+    if (value32 >= 10)
+    {
+        pch -= 2;
+        pch[0] = DecimalDigitPairs[value32 * 2];
+        pch[1] = DecimalDigitPairs[value32 * 2 + 1];
+    }
+    else
+    {
+        pch -= 1;
+        pch[0] = static_cast<wchar_t>(L'0' + value32);
+    }
+
+    return pch;
+}
+
+// Same output as AppendPrintf(output, L"%llu", value).
+static LSTATUS
+AppendUnsigned(
+    Buffer& output,
+    UINT64 value) noexcept
+{
+    wchar_t digits[20];
+    wchar_t* const pchEnd = digits + ARRAYSIZE(digits);
+    wchar_t const* const pch = WriteDecimalDigits(pchEnd, value);
+    return AppendWide(output, pch, static_cast<unsigned>(pchEnd - pch));
+}
+
+// Same output as AppendPrintf(output, L"%lld", value).
+static LSTATUS
+AppendSigned(
+    Buffer& output,
+    INT64 value) noexcept
+{
+    wchar_t digits[21];
+    wchar_t* const pchEnd = digits + ARRAYSIZE(digits);
+    wchar_t* pch;
+    if (value < 0)
+    {
+        pch = WriteDecimalDigits(pchEnd, 0u - static_cast<UINT64>(value));
+        *--pch = L'-';
+    }
+    else
+    {
+        pch = WriteDecimalDigits(pchEnd, static_cast<UINT64>(value));
+    }
+
+    return AppendWide(output, pch, static_cast<unsigned>(pchEnd - pch));
+}
+
+// Same output as AppendPrintf(output, L"0x%llX", value).
+static LSTATUS
+AppendHex(
+    Buffer& output,
+    UINT64 value) noexcept
+{
+    wchar_t digits[18];
+    wchar_t* const pchEnd = digits + ARRAYSIZE(digits);
+    wchar_t* pch = pchEnd;
+    do
+    {
+        *--pch = UppercaseHexChars[value & 0xf];
+        value >>= 4;
+    } while (value != 0);
+    *--pch = L'x';
+    *--pch = L'0';
+
+    return AppendWide(output, pch, static_cast<unsigned>(pchEnd - pch));
+}
+
+// Appends the shortest string that round-trips to value. Precondition: finite.
+static LSTATUS
+AppendRoundTrip(
+    Buffer& output,
+    double value) noexcept
+{
+    LSTATUS status;
+
+    auto const oldSize = output.size();
+    if (!output.reserve(oldSize + EtwInternal::FloatCharsMax))
+    {
+        status = ERROR_OUTOFMEMORY;
+    }
+    else
+    {
+        auto const cch = EtwInternal::FormatShortestDouble(value, output.data() + oldSize);
+        output.resize_unchecked(oldSize + cch);
+        status = ERROR_SUCCESS;
+    }
+
+    return status;
+}
+
+// Appends the shortest string that round-trips to value. Precondition: finite.
+static LSTATUS
+AppendRoundTrip(
+    Buffer& output,
+    float value) noexcept
+{
+    LSTATUS status;
+
+    auto const oldSize = output.size();
+    if (!output.reserve(oldSize + EtwInternal::FloatCharsMax))
+    {
+        status = ERROR_OUTOFMEMORY;
+    }
+    else
+    {
+        auto const cch = EtwInternal::FormatShortestFloat(value, output.data() + oldSize);
+        output.resize_unchecked(oldSize + cch);
+        status = ERROR_SUCCESS;
+    }
+
+    return status;
+}
+
 static LSTATUS
 AppendHexDump(
     Buffer& output,
@@ -301,9 +480,52 @@ AppendHexDump(
         wchar_t* pch = output.data() + oldSize;
         *pch++ = L'0';
         *pch++ = L'x';
-        for (unsigned i = 0; i != cbData; i++)
+
+        auto const pbData = static_cast<UINT8 const*>(pData);
+        unsigned i = 0;
+
+#if defined(_M_IX86) || defined(_M_X64)
+        static_assert(sizeof(wchar_t) == 2, "SSE2 kernel assumes UTF-16");
+
+        // 16 bytes per step: split into nibbles, convert each nibble to
+        // '0'..'9' or 'A'..'F' with nibble + '0' + (nibble > 9 ? 7 : 0),
+        // then widen the 32 resulting chars to wchar_t.
+        __m128i const nibbleMask = _mm_set1_epi8(0x0F);
+        __m128i const nine = _mm_set1_epi8(9);
+        __m128i const asciiZero = _mm_set1_epi8('0');
+        __m128i const letterOffset = _mm_set1_epi8('A' - '0' - 10);
+        __m128i const zero = _mm_setzero_si128();
+
+        for (; cbData - i >= 16; i += 16)
+        {
+            __m128i const bytes = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pbData + i));
+            __m128i const high = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibbleMask);
+            __m128i const low = _mm_and_si128(bytes, nibbleMask);
+
+            // Nibbles in output order: high0, low0, high1, low1, ...
+            __m128i nibbles[2] = {
+                _mm_unpacklo_epi8(high, low),
+                _mm_unpackhi_epi8(high, low) };
+
+            wchar_t* const pchOut = pch + i * 2;
+            for (unsigned j = 0; j != 2; j += 1)
+            {
+                __m128i const chars = _mm_add_epi8(
+                    _mm_add_epi8(nibbles[j], asciiZero),
+                    _mm_and_si128(_mm_cmpgt_epi8(nibbles[j], nine), letterOffset));
+                _mm_storeu_si128(
+                    reinterpret_cast<__m128i*>(pchOut + j * 16),
+                    _mm_unpacklo_epi8(chars, zero));
+                _mm_storeu_si128(
+                    reinterpret_cast<__m128i*>(pchOut + j * 16 + 8),
+                    _mm_unpackhi_epi8(chars, zero));
+            }
+        }
+#endif // SSE2
+
+        for (; i != cbData; i++)
         {
-            UINT8 val = static_cast<UINT8 const*>(pData)[i];
+            UINT8 val = pbData[i];
             pch[i * 2 + 0] = UppercaseHexChars[val >> 4];
             pch[i * 2 + 1] = UppercaseHexChars[val & 0xf];
         }
@@ -314,67 +536,164 @@ AppendHexDump(
     return status;
 }
 
-static LSTATUS
-AppendAdjustedSystemTime(
-    Buffer& output,
-    SYSTEMTIME const& st,
-    EtwTimestampFormat format,
-    int timeZoneBiasMinutes,
-    unsigned subseconds,
-    unsigned subsecondsDigits)
+/*
+Writes value in decimal with at least minDigits digits, the same as printf
+"%0*u". Returns a pointer to the end of the output. Needs room for 10
+digits.
+*/
+static wchar_t*
+WritePaddedDecimal(
+    wchar_t* pchOutput,
+    unsigned value,
+    unsigned minDigits) noexcept
 {
-    LSTATUS status;
+    ASSERT(minDigits <= 10);
+
+    wchar_t digits[10];
+    wchar_t* const pchEnd = digits + ARRAYSIZE(digits);
+    wchar_t* pch = WriteDecimalDigits(pchEnd, value);
+    while (static_cast<unsigned>(pchEnd - pch) < minDigits)
+    {
+        *--pch = L'0';
+    }
+
+    auto const cch = static_cast<unsigned>(pchEnd - pch);
+    memcpy(pchOutput, pch, cch * sizeof(wchar_t));
+    return pchOutput + cch;
+}
 
+/*
+Writes the date and time in WPP format "MM/DD/YYYY-HH:MM:SS" or rfc3339
+format "YYYY-MM-DDTHH:MM:SS", the same as the corresponding "%02u" and "%04u"
+printf fields. Returns a pointer to the end of the output. Needs room for
+DateTimeCharsMax characters.
+*/
+static unsigned const DateTimeCharsMax = 40;
+static wchar_t*
+WriteDateTime(
+    wchar_t* pch,
+    EtwTimestampFormat format,
+    unsigned year,
+    unsigned month,
+    unsigned day,
+    unsigned hour,
+    unsigned minute,
+    unsigned second) noexcept
+{
     if ((format & EtwTimestampFormat_TypeMask) == EtwTimestampFormat_Wpp)
     {
         // WPP-style.
-        status = AppendPrintf(output, L"%02u/%02u/%04u-%02u:%02u:%02u.%0*u",
-            st.wMonth, st.wDay, st.wYear,
-            st.wHour, st.wMinute, st.wSecond,
-            subsecondsDigits, subseconds);
+        pch = WritePaddedDecimal(pch, month, 2);
+        *pch++ = L'/';
+        pch = WritePaddedDecimal(pch, day, 2);
+        *pch++ = L'/';
+        pch = WritePaddedDecimal(pch, year, 4);
+        *pch++ = L'-';
     }
     else
     {
         // rfc3339-style.
-        status = AppendPrintf(output, L"%04u-%02u-%02uT%02u:%02u:%02u.%0*u",
-            st.wYear, st.wMonth, st.wDay,
-            st.wHour, st.wMinute, st.wSecond,
-            subsecondsDigits, subseconds);
+        pch = WritePaddedDecimal(pch, year, 4);
+        *pch++ = L'-';
+        pch = WritePaddedDecimal(pch, month, 2);
+        *pch++ = L'-';
+        pch = WritePaddedDecimal(pch, day, 2);
+        *pch++ = L'T';
     }
 
-    if (status != ERROR_SUCCESS ||
-        (format & EtwTimestampFormat_NoTimeZoneSuffix))
-    {
-        // No suffix.
-    }
-    else if (format & EtwTimestampFormat_Local)
+    pch = WritePaddedDecimal(pch, hour, 2);
+    *pch++ = L':';
+    pch = WritePaddedDecimal(pch, minute, 2);
+    *pch++ = L':';
+    pch = WritePaddedDecimal(pch, second, 2);
+    return pch;
+}
+
+/*
+Appends the date and time (from WriteDateTime), then the subseconds, then
+the time zone suffix (if any).
+*/
+static LSTATUS
+AppendTimestamp(
+    Buffer& output,
+    _In_reads_(cchDateTime) wchar_t const* pchDateTime,
+    unsigned cchDateTime,
+    EtwTimestampFormat format,
+    int timeZoneBiasMinutes,
+    unsigned subseconds,
+    unsigned subsecondsDigits) noexcept
+{
+    LSTATUS status;
+
+    // DateTime + "." + up to 10 subsecond digits + "+HH:MM".
+    auto const oldSize = output.size();
+    if (!output.reserve(oldSize + cchDateTime + 17))
     {
-        // "+HH:MM" suffix.
-        unsigned const absBiasMinutes =
-            timeZoneBiasMinutes < 0
-            ? -timeZoneBiasMinutes
-            : timeZoneBiasMinutes;
-        status = AppendPrintf(output,
-            L"%lc%02u:%02u",
-            timeZoneBiasMinutes < 0 ? L'-' : L'+',
-            absBiasMinutes / 60, absBiasMinutes % 60);
+        status = ERROR_OUTOFMEMORY;
     }
-    else if (!output.push_back(L'Z'))
+    else
     {
-        status = ERROR_OUTOFMEMORY;
+        wchar_t* pch = output.data() + oldSize;
+        memcpy(pch, pchDateTime, cchDateTime * sizeof(wchar_t));
+        pch += cchDateTime;
+        *pch++ = L'.';
+        pch = WritePaddedDecimal(pch, subseconds, subsecondsDigits);
+
+        if (format & EtwTimestampFormat_NoTimeZoneSuffix)
+        {
+            // No suffix.
+        }
+        else if (format & EtwTimestampFormat_Local)
+        {
+            // "+HH:MM" suffix.
+            unsigned const absBiasMinutes =
+                timeZoneBiasMinutes < 0
+                ? -timeZoneBiasMinutes
+                : timeZoneBiasMinutes;
+            *pch++ = timeZoneBiasMinutes < 0 ? L'-' : L'+';
+            pch = WritePaddedDecimal(pch, absBiasMinutes / 60, 2);
+            *pch++ = L':';
+            pch = WritePaddedDecimal(pch, absBiasMinutes % 60, 2);
+        }
+        else
+        {
+            *pch++ = L'Z';
+        }
+
+        output.resize_unchecked(static_cast<unsigned>(pch - output.data()));
+        status = ERROR_SUCCESS;
     }
 
     return status;
 }
 
+static LSTATUS
+AppendAdjustedSystemTime(
+    Buffer& output,
+    SYSTEMTIME const& st,
+    EtwTimestampFormat format,
+    int timeZoneBiasMinutes,
+    unsigned subseconds,
+    unsigned subsecondsDigits)
+{
+    wchar_t dateTime[DateTimeCharsMax];
+    wchar_t const* const pchEnd = WriteDateTime(dateTime, format,
+        st.wYear, st.wMonth, st.wDay,
+        st.wHour, st.wMinute, st.wSecond);
+    return AppendTimestamp(output, dateTime, static_cast<unsigned>(pchEnd - dateTime),
+        format, timeZoneBiasMinutes, subseconds, subsecondsDigits);
+}
+
 static LSTATUS
 AppendFileTime(
     Buffer& output,
+    EtwInternal::TimestampCache& cache,
     UINT64 fileTime,
     EtwTimestampFormat format,
     int timeZoneBiasMinutes,
     bool timeIsUtc)
 {
+    LSTATUS status;
     UINT64 fileTimeAdjusted;
     EtwTimestampFormat formatAdjusted = format;
 
@@ -396,26 +715,80 @@ AppendFileTime(
         fileTimeAdjusted = EtwEnumerator::AdjustFileTime(fileTime, timeZoneBiasMinutes);
     }
 
-    SYSTEMTIME systemTimeAdjusted = {};
-    FileTimeToSystemTime(
-        reinterpret_cast<FILETIME const*>(&fileTimeAdjusted), &systemTimeAdjusted);
+    UINT64 const second = fileTimeAdjusted / 10000000u;
+    unsigned const ticks = static_cast<unsigned>(fileTimeAdjusted % 10000000u);
 
     unsigned subseconds;
     unsigned subsecondsDigits;
     if (formatAdjusted & EtwTimestampFormat_LowPrecision)
     {
-        subseconds = systemTimeAdjusted.wMilliseconds;
+        subseconds = ticks / 10000u;
         subsecondsDigits = 3;
     }
     else
     {
-        subseconds = static_cast<unsigned>(fileTimeAdjusted % 10000000u);
+        subseconds = ticks;
         subsecondsDigits = 7;
     }
 
-    LSTATUS status = AppendAdjustedSystemTime(
-        output, systemTimeAdjusted, formatAdjusted,
-        timeZoneBiasMinutes, subseconds, subsecondsDigits);
+    if (fileTimeAdjusted > 0x7FFFFFFFFFFFFFFF)
+    {
+        // Out of range for FileTimeToSystemTime, which leaves SYSTEMTIME zeroed.
+        SYSTEMTIME const systemTimeZero = {};
+        status = AppendAdjustedSystemTime(
+            output, systemTimeZero, formatAdjusted, timeZoneBiasMinutes,
+            (formatAdjusted & EtwTimestampFormat_LowPrecision) ? 0u : subseconds,
+            subsecondsDigits);
+    }
+    else
+    {
+        // Consecutive events are usually in the same second. If not, convert
+        // to a civil date (days since 1601-01-01, which starts a 400-year
+        // Gregorian cycle, as with FileTimeToSystemTime).
+        unsigned const type = formatAdjusted & EtwTimestampFormat_TypeMask;
+        if (cache.Second != second || cache.Type != type)
+        {
+            unsigned const secondOfDay = static_cast<unsigned>(second % 86400u);
+            unsigned const days = static_cast<unsigned>(second / 86400u);
+
+            unsigned const cycle = days / 146097u; // 400-year cycles.
+            unsigned const dayOfCycle = days % 146097u;
+            unsigned const yearOfCycle =
+                (dayOfCycle - dayOfCycle / 1460u + dayOfCycle / 36524u - dayOfCycle / 146096u) / 365u;
+            unsigned const dayOfYear =
+                dayOfCycle - (365u * yearOfCycle + yearOfCycle / 4u - yearOfCycle / 100u);
+
+            // Month lengths are [31, 28/29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31].
+            unsigned const leap = (yearOfCycle + 1u) % 4u == 0 &&
+                ((yearOfCycle + 1u) % 100u != 0 || (yearOfCycle + 1u) % 400u == 0);
+            unsigned month = 1;
+            unsigned day = dayOfYear;
+            static UCHAR const monthDays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+            for (;;)
+            {
+                unsigned const cDays = monthDays[month - 1] + (month == 2 ? leap : 0u);
+                if (day < cDays)
+                {
+                    break;
+                }
+
+                day -= cDays;
+                month += 1;
+            }
+
+            wchar_t const* const pchEnd = WriteDateTime(cache.DateTime, formatAdjusted,
+                1601u + cycle * 400u + yearOfCycle, month, day + 1,
+                secondOfDay / 3600u, secondOfDay / 60u % 60u, secondOfDay % 60u);
+            cache.Second = second;
+            cache.Type = type;
+            cache.cchDateTime = static_cast<unsigned>(pchEnd - cache.DateTime);
+        }
+
+        status = AppendTimestamp(
+            output, cache.DateTime, cache.cchDateTime, formatAdjusted,
+            timeZoneBiasMinutes, subseconds, subsecondsDigits);
+    }
+
     return status;
 }
 
@@ -702,6 +1075,107 @@ Done:
     return status;
 }
 
+// Returns true if ch must be escaped in a JSON string.
+static bool
+NeedsJsonEscape(
+    wchar_t ch) noexcept
+{
+    return ch < 0x20 || ch == L'"' || ch == L'\\';
+}
+
+/*
+Returns the index of the first character in pchInput[iStart..cchInput) that
+must be escaped in a JSON string, or cchInput if there is no such character.
+Checks 8 characters at a time when SSE2 is available.
+*/
+static unsigned
+FindJsonEscape(
+    _In_reads_(cchInput) wchar_t const* pchInput,
+    unsigned iStart,
+    unsigned cchInput) noexcept
+{
+    unsigned i = iStart;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    static_assert(sizeof(wchar_t) == 2, "SSE2 kernel assumes UTF-16");
+
+    __m128i const controlMax = _mm_set1_epi16(0x1F);
+    __m128i const quote = _mm_set1_epi16(L'"');
+    __m128i const backslash = _mm_set1_epi16(L'\\');
+    __m128i const zero = _mm_setzero_si128();
+
+    for (; cchInput - i >= 8; i += 8)
+    {
+        __m128i const chars = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pchInput + i));
+
+        // ch <= 0x1F if and only if saturating ch - 0x1F is 0.
+        __m128i const flags = _mm_or_si128(
+            _mm_cmpeq_epi16(_mm_subs_epu16(chars, controlMax), zero),
+            _mm_or_si128(
+                _mm_cmpeq_epi16(chars, quote),
+                _mm_cmpeq_epi16(chars, backslash)));
+
+        // 2 mask bits per character.
+        auto const mask = static_cast<ULONG>(_mm_movemask_epi8(flags));
+        if (mask != 0)
+        {
+            ULONG bit;
+            _BitScanForward(&bit, mask);
+            return i + bit / 2;
+        }
+    }
+#endif // SSE2
+
+    for (; i != cchInput; i += 1)
+    {
+        if (NeedsJsonEscape(pchInput[i]))
+        {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/*
+Writes the JSON escape sequence for ch, e.g. "\n" or "\u001F".
+Returns a pointer to the character after the escape sequence.
+PRECONDITION: NeedsJsonEscape(ch).
+*/
+static wchar_t*
+WriteJsonEscape(
+    _Out_writes_to_(6, return - pchOutput) wchar_t* pchOutput,
+    wchar_t ch) noexcept
+{
+    ASSERT(NeedsJsonEscape(ch));
+
+    switch (ch)
+    {
+    case 8:  ch = L'b'; break;
+    case 9:  ch = L't'; break;
+    case 10: ch = L'n'; break;
+    case 12: ch = L'f'; break;
+    case 13: ch = L'r'; break;
+    case L'"':
+    case L'\\':
+        break;
+    default:
+        // Something like "\u001F".
+        pchOutput[0] = L'\\';
+        pchOutput[1] = L'u';
+        pchOutput[2] = L'0';
+        pchOutput[3] = L'0';
+        pchOutput[4] = UppercaseHexChars[ch >> 4];
+        pchOutput[5] = UppercaseHexChars[ch & 0xf];
+        return pchOutput + 6;
+    }
+
+    // Something like "\\" or "\r".
+    pchOutput[0] = L'\\';
+    pchOutput[1] = ch;
+    return pchOutput + 2;
+}
+
 static LSTATUS
 AppendStringAsJson(
     EtwInternal::Buffer<wchar_t>& output,
@@ -711,83 +1185,53 @@ AppendStringAsJson(
     LSTATUS status;
 
     /*
-    Note: the inner loop is optimized in favor of not escaping, at a cost of
-    some extra complexity when escaping is needed. Before the loop, we ensure
-    that the buffer has capacity for the string assuming nothing needs to be
-    escaped. Each time we have to escape something, we do the following:
-    - Increment offset by the newly-discovered escape overhead.
-    - Ensure that the buffer has room for the original reservation plus the
-      total escape overhead.
-    - Reset pchOutput to point to the (potentially reallocated) output buffer,
-      offset by the number of escape characters so far so that i is still the
-      correct index.
+    Note: this is optimized for strings that need little or no escaping.
+    FindJsonEscape skips runs of clean characters (8 at a time with SSE2).
+    A prescan uses it to compute the exact output size so that output is
+    resized once, then clean runs are copied with memcpy and only the
+    flagged characters are escaped. If nothing needs to be escaped, the
+    string is copied without a second scan.
     */
 
-    // Minimum number of characters to be added to output after opening quote.
-    unsigned const baseSize = cchInput + 1; // unescaped input + closing quote
+    unsigned const iFirstEscape = FindJsonEscape(pchInput, 0, cchInput);
 
-    // Number of characters in output other than unescaped input characters.
-    unsigned offset = output.size() + 1; // Initially: existing content + opening quote
+    // Escape overhead: 1 extra character for "\\", 5 for "\u001F".
+    unsigned cchExtra = 0;
+    for (unsigned i = iFirstEscape; i != cchInput; i = FindJsonEscape(pchInput, i + 1, cchInput))
+    {
+        wchar_t const ch = pchInput[i];
+        cchExtra += ch < 0x20 && ch != 8 && ch != 9 && ch != 10 && ch != 12 && ch != 13
+            ? 5u
+            : 1u;
+    }
 
-    if (!output.resize(baseSize + offset)) // Initial estimate: assume no escaping needed.
+    auto const oldSize = output.size();
+    if (!output.resize(oldSize + cchInput + cchExtra + 2)) // Quotes
     {
         status = ERROR_OUTOFMEMORY;
     }
     else
     {
-        wchar_t* pchOutput = output.data() + offset; // Output buffer.
-        pchOutput[-1] = '"'; // Opening quote
+        wchar_t* pchOutput = output.data() + oldSize;
+        *pchOutput++ = '"'; // Opening quote
 
-        for (unsigned i = 0; i != cchInput; i += 1)
+        unsigned iClean = 0; // Start of current run of clean characters.
+        for (unsigned i = iFirstEscape; i != cchInput; i = FindJsonEscape(pchInput, iClean, cchInput))
         {
-            wchar_t ch = pchInput[i];
-            if (ch < 0x20)
-            {
-                switch (ch)
-                {
-                case 8:  ch = L'b'; goto SingleCharEscape;
-                case 9:  ch = L't'; goto SingleCharEscape;
-                case 10: ch = L'n'; goto SingleCharEscape;
-                case 12: ch = L'f'; goto SingleCharEscape;
-                case 13: ch = L'r'; goto SingleCharEscape;
-                }
-
-                // Something like "\u001F": five extra characters.
-                offset += 5;
-                CheckOutOfMem(status, output.resize(baseSize + offset));
-                pchOutput = output.data() + offset;
-
-                *(pchOutput + i - 5) = L'\\';
-                *(pchOutput + i - 4) = L'u';
-                *(pchOutput + i - 3) = L'0';
-                *(pchOutput + i - 2) = L'0';
-                *(pchOutput + i - 1) = UppercaseHexChars[ch >> 4];
-                *(pchOutput + i - 0) = UppercaseHexChars[ch & 0xf];
-            }
-            else if (ch == L'"' || ch == L'\\')
-            {
-            SingleCharEscape:
-
-                // Something like "\\" or "\r": one extra character.
-                offset += 1;
-                CheckOutOfMem(status, output.resize(baseSize + offset));
-                pchOutput = output.data() + offset;
-
-                *(pchOutput + i - 1) = L'\\';
-                *(pchOutput + i - 0) = ch;
-            }
-            else
-            {
-                pchOutput[i] = ch;
-            }
+            memcpy(pchOutput, pchInput + iClean, (i - iClean) * sizeof(wchar_t));
+            pchOutput += i - iClean;
+            pchOutput = WriteJsonEscape(pchOutput, pchInput[i]);
+            iClean = i + 1;
         }
 
-        pchOutput[cchInput] = '"'; // Closing quote
+        memcpy(pchOutput, pchInput + iClean, (cchInput - iClean) * sizeof(wchar_t));
+        pchOutput += cchInput - iClean;
+
+        *pchOutput++ = '"'; // Closing quote
+        ASSERT(pchOutput == output.data() + output.size());
         status = ERROR_SUCCESS;
     }
 
-Done:
-
     return status;
 }
 
@@ -799,32 +1243,336 @@ AppendStringAsJson(
     return AppendStringAsJson(output, szInput, static_cast<unsigned>(wcslen(szInput)));
 }
 
-#pragma endregion
-
-#pragma region EtwStringBuilder
-
-EtwStringBuilder::EtwStringBuilder(
-    EtwInternal::Buffer<wchar_t>& buffer) noexcept
-    : m_buffer(buffer)
+/*
+Returns true if pb[0..cb) is well-formed UTF-8, i.e. if MultiByteToWideChar
+would decode it without substituting replacement characters.
+*/
+static bool
+IsValidUtf8(
+    _In_reads_(cb) BYTE const* pb,
+    unsigned cb) noexcept
 {
-    return;
-}
+    bool valid = false;
+    unsigned i = 0;
 
-LSTATUS __stdcall
-EtwStringBuilder::AppendChar(
-    EtwWCHAR value) noexcept
-{
-    return m_buffer.push_back(value) ? ERROR_SUCCESS : ERROR_OUTOFMEMORY;
-}
+    while (i != cb)
+    {
+#if defined(_M_IX86) || defined(_M_X64)
+        // Skip ASCII 16 bytes at a time.
+        if (cb - i >= 16 &&
+            0 == _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const*>(pb + i))))
+        {
+            i += 16;
+            continue;
+        }
+#endif // SSE2
 
-LSTATUS __stdcall
-EtwStringBuilder::AppendWide(
-    _In_z_ EtwPCWSTR szValue) noexcept
-{
-    return ::AppendWide(m_buffer, szValue);
-}
+        BYTE const b0 = pb[i];
+        if (b0 < 0x80)
+        {
+            i += 1;
+            continue;
+        }
 
-LSTATUS __stdcall
+        unsigned cbChar;
+        unsigned ch;
+        if (b0 < 0xC2)
+        {
+            goto Done; // Continuation byte or overlong 2-byte sequence.
+        }
+        else if (b0 < 0xE0)
+        {
+            cbChar = 2;
+            ch = b0 & 0x1F;
+        }
+        else if (b0 < 0xF0)
+        {
+            cbChar = 3;
+            ch = b0 & 0x0F;
+        }
+        else if (b0 < 0xF5)
+        {
+            cbChar = 4;
+            ch = b0 & 0x07;
+        }
+        else
+        {
+            goto Done;
+        }
+
+        if (cb - i < cbChar)
+        {
+            goto Done;
+        }
+
+        for (unsigned j = 1; j != cbChar; j += 1)
+        {
+            BYTE const b = pb[i + j];
+            if ((b & 0xC0) != 0x80)
+            {
+                goto Done;
+            }
+
+            ch = (ch << 6) | (b & 0x3F);
+        }
+
+        // Reject overlong sequences, surrogates, and values above U+10FFFF.
+        if (cbChar == 3 && (ch < 0x800 || (ch >= 0xD800 && ch <= 0xDFFF)))
+        {
+            goto Done;
+        }
+        else if (cbChar == 4 && (ch < 0x10000 || ch > 0x10FFFF))
+        {
+            goto Done;
+        }
+
+        i += cbChar;
+    }
+
+    valid = true;
+
+Done:
+
+    return valid;
+}
+
+/*
+Appends pchInput[0..cchInput) to output, converted from UTF-16 to UTF-8.
+*/
+static LSTATUS
+AppendUtf16AsUtf8(
+    EtwInternal::Buffer<char>& output,
+    _In_reads_(cchInput) wchar_t const* pchInput,
+    unsigned cchInput) noexcept
+{
+    LSTATUS status;
+
+    // Each UTF-16 code unit becomes at most 3 bytes of UTF-8.
+    auto const oldSize = output.size();
+    UINT64 const maxSize = oldSize + UINT64(cchInput) * 3;
+    if (maxSize > 0xFFFFFFFF || !output.reserve(static_cast<unsigned>(maxSize)))
+    {
+        status = ERROR_OUTOFMEMORY;
+    }
+    else
+    {
+        auto const pbOutput = WriteUtf16AsUtf8(
+            reinterpret_cast<BYTE*>(output.data() + oldSize), pchInput, cchInput);
+        output.resize_unchecked(static_cast<unsigned>(
+            reinterpret_cast<char*>(pbOutput) - output.data()));
+        status = ERROR_SUCCESS;
+    }
+
+    return status;
+}
+
+/*
+Same as WriteJsonEscape, but writes UTF-8 (escape sequences are ASCII).
+*/
+static BYTE*
+WriteJsonEscapeUtf8(
+    _Out_writes_to_(6, return - pbOutput) BYTE* pbOutput,
+    wchar_t ch) noexcept
+{
+    wchar_t escape[6];
+    auto const cch = static_cast<unsigned>(WriteJsonEscape(escape, ch) - escape);
+    for (unsigned i = 0; i != cch; i += 1)
+    {
+        pbOutput[i] = static_cast<BYTE>(escape[i]);
+    }
+
+    return pbOutput + cch;
+}
+
+/*
+Appends pchInput[0..cchInput) to output as a quoted JSON string, escaped and
+converted from UTF-16 to UTF-8 in one pass. Same result as AppendStringAsJson
+followed by AppendUtf16AsUtf8.
+*/
+static LSTATUS
+AppendStringAsJsonUtf8(
+    EtwInternal::Buffer<char>& output,
+    _In_reads_(cchInput) wchar_t const* pchInput,
+    unsigned cchInput) noexcept
+{
+    LSTATUS status;
+
+    // Each UTF-16 code unit becomes at most 6 bytes ("\u001F"), plus quotes.
+    auto const oldSize = output.size();
+    UINT64 const maxSize = oldSize + UINT64(cchInput) * 6 + 2;
+    if (maxSize > 0xFFFFFFFF || !output.reserve(static_cast<unsigned>(maxSize)))
+    {
+        status = ERROR_OUTOFMEMORY;
+    }
+    else
+    {
+        auto pbOutput = reinterpret_cast<BYTE*>(output.data() + oldSize);
+        *pbOutput++ = '"'; // Opening quote
+
+        // Escapes are never inside a surrogate pair, so encoding each clean
+        // run separately gives the same result as encoding the whole string.
+        unsigned iClean = 0; // Start of current run of clean characters.
+        for (unsigned i = FindJsonEscape(pchInput, 0, cchInput); i != cchInput; i = FindJsonEscape(pchInput, iClean, cchInput))
+        {
+            pbOutput = WriteUtf16AsUtf8(pbOutput, pchInput + iClean, i - iClean);
+            pbOutput = WriteJsonEscapeUtf8(pbOutput, pchInput[i]);
+            iClean = i + 1;
+        }
+
+        pbOutput = WriteUtf16AsUtf8(pbOutput, pchInput + iClean, cchInput - iClean);
+        *pbOutput++ = '"'; // Closing quote
+
+        output.resize_unchecked(static_cast<unsigned>(
+            reinterpret_cast<char*>(pbOutput) - output.data()));
+        status = ERROR_SUCCESS;
+    }
+
+    return status;
+}
+
+static LSTATUS
+AppendStringAsJsonUtf8(
+    EtwInternal::Buffer<char>& output,
+    _In_z_ LPCWSTR szInput) noexcept
+{
+    return AppendStringAsJsonUtf8(output, szInput, static_cast<unsigned>(wcslen(szInput)));
+}
+
+/*
+Appends pbInput[0..cbInput) (well-formed UTF-8) to output as a quoted JSON
+string.
+*/
+static LSTATUS
+AppendUtf8AsJson(
+    EtwInternal::Buffer<char>& output,
+    _In_reads_(cbInput) BYTE const* pbInput,
+    unsigned cbInput) noexcept
+{
+    LSTATUS status;
+
+    // Each byte becomes at most 6 bytes ("\u001F"), plus quotes.
+    auto const oldSize = output.size();
+    UINT64 const maxSize = oldSize + UINT64(cbInput) * 6 + 2;
+    if (maxSize > 0xFFFFFFFF || !output.reserve(static_cast<unsigned>(maxSize)))
+    {
+        status = ERROR_OUTOFMEMORY;
+    }
+    else
+    {
+        auto pbOutput = reinterpret_cast<BYTE*>(output.data() + oldSize);
+        *pbOutput++ = '"'; // Opening quote
+
+        for (unsigned i = 0; i != cbInput; i += 1)
+        {
+            BYTE const b = pbInput[i];
+            if (NeedsJsonEscape(b))
+            {
+                pbOutput = WriteJsonEscapeUtf8(pbOutput, b);
+            }
+            else
+            {
+                *pbOutput++ = b;
+            }
+        }
+
+        *pbOutput++ = '"'; // Closing quote
+
+        output.resize_unchecked(static_cast<unsigned>(
+            reinterpret_cast<char*>(pbOutput) - output.data()));
+        status = ERROR_SUCCESS;
+    }
+
+    return status;
+}
+
+/*
+Appends sz (ASCII) to output.
+*/
+template<unsigned N>
+static LSTATUS
+AppendLiteralUtf8(
+    EtwInternal::Buffer<char>& output,
+    char const (&sz)[N]) noexcept
+{
+    LSTATUS status;
+
+    auto const oldSize = output.size();
+    if (!output.resize(oldSize + N - 1))
+    {
+        status = ERROR_OUTOFMEMORY;
+    }
+    else
+    {
+        memcpy(output.data() + oldSize, sz, N - 1);
+        status = ERROR_SUCCESS;
+    }
+
+    return status;
+}
+
+/*
+Returns true if AddCurrentValue would format the value by copying a UTF-16
+string from the event, i.e. if the value is a UTF-16 string with no map.
+*/
+static bool
+IsUtf16StringValue(
+    EVENT_PROPERTY_INFO const& epi,
+    unsigned cookedInType) noexcept
+{
+    return (epi.nonStructType.MapNameOffset == 0 ||
+        0 != (epi.Flags & (PropertyHasCustomSchema | PropertyStruct))) &&
+        cookedInType == TDH_INTYPE_UNICODESTRING;
+}
+
+/*
+Returns true if AddCurrentValue would format the value by decoding an 8-bit
+string from the event as UTF-8, i.e. if the value is an 8-bit string with
+outtype UTF8, JSON or XML and no map.
+*/
+static bool
+IsUtf8StringValue(
+    EVENT_PROPERTY_INFO const& epi,
+    unsigned cookedInType) noexcept
+{
+    return 0 == (epi.Flags & (PropertyHasCustomSchema | PropertyStruct)) &&
+        epi.nonStructType.MapNameOffset == 0 &&
+        (cookedInType == TDH_INTYPE_ANSISTRING ||
+            cookedInType == TDH_InTypeManifestCountedAnsiString ||
+            cookedInType == TDH_INTYPE_COUNTEDANSISTRING ||
+            cookedInType == TDH_INTYPE_REVERSEDCOUNTEDANSISTRING ||
+            cookedInType == TDH_INTYPE_NONNULLTERMINATEDANSISTRING ||
+            cookedInType == TDH_INTYPE_ANSICHAR) &&
+        (epi.nonStructType.OutType == TDH_OUTTYPE_UTF8 ||
+            epi.nonStructType.OutType == TDH_OUTTYPE_JSON ||
+            epi.nonStructType.OutType == TDH_OUTTYPE_XML);
+}
+
+#pragma endregion
+
+#pragma region EtwStringBuilder
+
+EtwStringBuilder::EtwStringBuilder(
+    EtwInternal::Buffer<wchar_t>& buffer) noexcept
+    : m_buffer(buffer)
+{
+    return;
+}
+
+LSTATUS __stdcall
+EtwStringBuilder::AppendChar(
+    EtwWCHAR value) noexcept
+{
+    return m_buffer.push_back(value) ? ERROR_SUCCESS : ERROR_OUTOFMEMORY;
+}
+
+LSTATUS __stdcall
+EtwStringBuilder::AppendWide(
+    _In_z_ EtwPCWSTR szValue) noexcept
+{
+    return ::AppendWide(m_buffer, szValue);
+}
+
+LSTATUS __stdcall
 EtwStringBuilder::AppendPrintf(
     _Printf_format_string_ EtwPCWSTR szFormat,
     ...) noexcept
@@ -839,6 +1587,35 @@ EtwStringBuilder::AppendPrintf(
 
 #pragma endregion
 
+#pragma region EtwOutputSink
+
+_Ret_maybenull_ void* __stdcall
+EtwOutputSink::Reserve(
+    unsigned cbMin,
+    _Out_ unsigned* pcbAvailable) noexcept
+{
+    UNREFERENCED_PARAMETER(cbMin);
+    *pcbAvailable = 0;
+    return nullptr;
+}
+
+LSTATUS __stdcall
+EtwOutputSink::Commit(
+    unsigned cb) noexcept
+{
+    // Not reached unless Reserve is overridden.
+    UNREFERENCED_PARAMETER(cb);
+    return ERROR_INVALID_FUNCTION;
+}
+
+void __stdcall
+EtwOutputSink::Abort() noexcept
+{
+    return;
+}
+
+#pragma endregion
+
 #pragma region Enums
 
 enum EtwEnumerator::ValueType
@@ -1278,6 +2055,8 @@ private:
 class EtwEnumerator::FormatContext
 {
     struct PropInfo;
+    struct FormatOp;
+    struct CompiledFormat;
     static const UINT8 InitialRecursionLimit = 3;
     static const UINT8 MaxRecursionLimit = 255;
 
@@ -1302,19 +2081,6 @@ public:
         , m_nameBuffer()
         , m_propInfo()
     {
-        auto& eventRec = *m_enum.m_pEventRecord;
-        if (0 == (eventRec.EventHeader.Flags &
-            (EVENT_HEADER_FLAG_NO_CPUTIME | EVENT_HEADER_FLAG_PRIVATE_SESSION)))
-        {
-            m_ktime = m_enum.TicksToMilliseconds(eventRec.EventHeader.KernelTime);
-            m_utime = m_enum.TicksToMilliseconds(eventRec.EventHeader.UserTime);
-        }
-        else
-        {
-            m_ktime = 0;
-            m_utime = 0;
-        }
-
         return;
     }
 
@@ -1322,113 +2088,42 @@ public:
     bool AddPrefix(
         _In_z_ LPCWSTR szFormat) noexcept
     {
-        auto& eventRec = *m_enum.m_pEventRecord;
+        CheckAdd(SetPrefixProperties(~0u));
+        AddFormatImpl(szFormat, 0);
 
-        m_removeTrailingSpaceAfterRecursionLevel = MaxRecursionLimit;
-        m_cpuIndex = GetEventProcessorIndex(&eventRec);
-        m_nameBuffer.clear();
+    Done:
 
-        // Prefix supports 9 numbered properties (%1..%9)
-        CheckOutOfMem(m_enum.m_lastError, m_propInfo.resize(9, false));
+        return m_enum.m_lastError == ERROR_SUCCESS;
+    }
 
-        // Not quite the same as AppendCurrentProviderName:
-        // Don't copy ProviderName into m_nameBuffer if we don't need to.
-        wchar_t const* pchProviderName;
-        USHORT cchProviderName;
-        if (m_enum.m_pTraceEventInfo->ProviderNameOffset)
-        {
-            pchProviderName = m_enum.TeiStringNoCheck(m_enum.m_pTraceEventInfo->ProviderNameOffset);
-            cchProviderName = ProviderNameLength(m_enum.m_pEventRecord->EventHeader.ProviderId, pchProviderName);
-        }
-        else
-        {
-            // ProviderName not set. Use fallback.
-            CheckWin32(m_enum.m_lastError, m_enum.AppendCurrentProviderNameFallback(m_nameBuffer));
+    // Same as AddPrefix, but uses a compiled prefix and only computes the
+    // %1..%9 values that the prefix uses.
+    bool AddCompiledPrefix(
+        EtwCompiledPrefix const& prefix) noexcept
+    {
+        ASSERT(!prefix.Empty());
+        auto const pCompiled = reinterpret_cast<CompiledFormat const*>(prefix.m_compiled.data());
 
-            // Note: we don't just set pchProviderName = m_nameBuffer.data()
-            // because m_nameBuffer might be reallocated for EventName.
-            pchProviderName = nullptr; // null means use m_nameBuffer.data().
-            cchProviderName = static_cast<USHORT>(m_nameBuffer.size());
-        }
+        CheckAdd(SetPrefixProperties(pCompiled->PropertyMask));
+        AddCompiledFormat(prefix.m_format.data(), pCompiled, 0);
 
-        // Not quite the same as AppendCurrentEventName:
-        // Don't copy EventName into m_nameBuffer if we don't need to.
-        wchar_t const* pchEventName;
-        USHORT cchEventName;
-        pchEventName = m_enum.EventName();
-        if (pchEventName)
-        {
-            cchEventName = static_cast<USHORT>(wcslen(pchEventName));
-        }
-        else
-        {
-            // EventName not set. Use fallback.
-            unsigned const iEventName = m_nameBuffer.size();
-            CheckWin32(m_enum.m_lastError, m_enum.AppendCurrentEventNameFallback(m_nameBuffer));
-            pchEventName = m_nameBuffer.data() + iEventName;
-            cchEventName = static_cast<USHORT>(m_nameBuffer.size() - iEventName);
-        }
+    Done:
 
-        // PROVIDER = %1
-        m_propInfo[1 - 1] = PropInfo(PropInfoAppendValue,
-            pchProviderName ? pchProviderName : m_nameBuffer.data(),
-            cchProviderName * sizeof(WCHAR),
-            TDH_INTYPE_UNICODESTRING);
+        return m_enum.m_lastError == ERROR_SUCCESS;
+    }
 
-        // EVENT = %2
-        m_propInfo[2 - 1] = PropInfo(PropInfoAppendValue,
-            pchEventName,
-            cchEventName * sizeof(WCHAR),
-            TDH_INTYPE_UNICODESTRING);
+    // Format a string using event property values for %1, %2, etc. variables.
+    bool AddCurrentEvent(
+        _In_z_ LPCWSTR szFormat,
+        bool removeTrailingSpace) noexcept
+    {
+        ASSERT(m_enum.m_state == EtwEnumeratorState_BeforeFirstItem);
 
-        // TID = %3!04X! (special treatment needed for !04X! formatting)
-        m_propInfo[3 - 1] = PropInfo(PropInfoAppendValue04X,
-            &eventRec.EventHeader.ThreadId, 4, TDH_INTYPE_UINT32, TDH_OUTTYPE_TID);
+        m_removeTrailingSpaceAfterRecursionLevel =
+            removeTrailingSpace ? InitialRecursionLimit : MaxRecursionLimit;
 
-        // TIME = %4
-        m_propInfo[4 - 1] = PropInfo(PropInfoAppendValue,
-            &eventRec.EventHeader.TimeStamp, 8, TDH_INTYPE_FILETIME, TDH_OutTypeDateTimeUtc);
-
-        // KTIME = %5!08u! (special treatment needed for !08u! formatting)
-        m_propInfo[5 - 1] = PropInfo(PropInfoAppendValue08u,
-            &m_ktime, 4, TDH_INTYPE_UINT32);
-
-        // UTIME = %6!08u! (special treatment needed for !08u! formatting)
-        m_propInfo[6 - 1] = PropInfo(PropInfoAppendValue08u,
-            &m_utime, 4, TDH_INTYPE_UINT32);
-
-        static const UINT32 sequenceNumber = 0;
-        // SEQ = %7!u!
-        m_propInfo[7 - 1] = PropInfo(PropInfoAppendValue,
-            &sequenceNumber, 4, TDH_INTYPE_UINT32);
-
-        // PID = %8!04X! (special treatment needed for !04X! formatting)
-        m_propInfo[8 - 1] = PropInfo(PropInfoAppendValue04X,
-            &eventRec.EventHeader.ProcessId, 4, TDH_INTYPE_UINT32, TDH_OUTTYPE_PID);
-
-        // CPU = %9!u!
-        m_propInfo[9 - 1] = PropInfo(PropInfoAppendValue,
-            &m_cpuIndex, 4, TDH_INTYPE_UINT32);
-
-        AddFormatImpl(szFormat, 0);
-
-    Done:
-
-        return m_enum.m_lastError == ERROR_SUCCESS;
-    }
-
-    // Format a string using event property values for %1, %2, etc. variables.
-    bool AddCurrentEvent(
-        _In_z_ LPCWSTR szFormat,
-        bool removeTrailingSpace) noexcept
-    {
-        ASSERT(m_enum.m_state == EtwEnumeratorState_BeforeFirstItem);
-
-        m_removeTrailingSpaceAfterRecursionLevel =
-            removeTrailingSpace ? InitialRecursionLimit : MaxRecursionLimit;
-
-        auto const cTopLevelProperties =
-            m_enum.m_pTraceEventInfo->TopLevelPropertyCount;
+        auto const cTopLevelProperties =
+            m_enum.m_pTraceEventInfo->TopLevelPropertyCount;
 
         m_enum.MoveNext(); // Move to first item in event.
         if (m_enum.m_lastError != ERROR_SUCCESS)
@@ -1485,40 +2180,33 @@ public:
 
         ASSERT(m_enum.m_state == EtwEnumeratorState_AfterLastItem);
 
-        AddFormatImpl(szFormat, InitialRecursionLimit);
+        AddCachedFormat(szFormat, InitialRecursionLimit);
 
     Done:
 
         return m_enum.m_lastError == ERROR_SUCCESS;
     }
 
-private:
-
-    bool AddFormatImpl(
-        _In_z_ LPCWSTR szFormatString,
-        UINT8 const recursionLimit) noexcept
+    /*
+    Compiles szFormat into a CompiledFormat header followed by its FormatOps
+    and ParsedPrintfs. Executing the result with AddCompiledFormat produces
+    the same output as AddFormatImpl(szFormat, ...). Property indexes are not
+    validated, so the result does not depend on the event's schema.
+    */
+    static bool CompileFormat(
+        _In_z_ LPCWSTR szFormat,
+        EtwInternal::Buffer<BYTE>& compiled) noexcept
     {
-        LPCWSTR p;
-        unsigned i;
-        UINT8 effectiveRecursionLimit = recursionLimit;
+        bool ok = false;
+        EtwInternal::Buffer<FormatOp, 16> ops;
+        EtwInternal::Buffer<ParsedPrintf> printfs;
+        CompiledFormat header;
+        unsigned cbOps;
+        unsigned cbPrintfs;
+        LPCWSTR const p = szFormat;
+        unsigned i = 0;
 
-        // Is szFormatString within m_scratchBuffer?
-        bool const formatFromScratch =
-            szFormatString >= m_scratchBuffer.data() &&
-            szFormatString <= m_scratchBuffer.data() + m_scratchBuffer.size();
-        if (formatFromScratch)
-        {
-            // szFormatString is within scratchBuffer, so we'll need to reset
-            // p any time we call a subroutine that might use m_scratchBuffer.
-            p = m_scratchBuffer.data();
-            i = static_cast<unsigned>(szFormatString - p);
-        }
-        else
-        {
-            // szFormatString is not related to m_scratchBuffer.
-            p = szFormatString;
-            i = 0;
-        }
+        header.PropertyMask = 0;
 
         for (;;)
         {
@@ -1536,21 +2224,13 @@ private:
                 i += 1;
             }
 
-            // Append a chunk of normal text.
-            CheckWin32(m_enum.m_lastError, AppendWide(m_output, p + iChunkStart, i - iChunkStart));
+            if (!AddLiteralOp(ops, iChunkStart, i - iChunkStart))
+            {
+                goto Done;
+            }
 
-            // If end of string, we're done.
             if (ch == L'\0')
             {
-                // TDH adds an extra space to EventMessage. Remove it.
-                if (recursionLimit == m_removeTrailingSpaceAfterRecursionLevel &&
-                    i != 0 && p[i - 1] == L' ')
-                {
-                    ASSERT(m_output.size() != 0);
-                    ASSERT(m_output[m_output.size() - 1] == L' ');
-                    m_output.resize_unchecked(m_output.size() - 1);
-                }
-
                 break;
             }
 
@@ -1561,8 +2241,6 @@ private:
             if (ch == L'!')
             {
                 // e.g. %!NAME!
-
-                // Consume "!NAME".
                 do
                 {
                     i += 1;
@@ -1573,16 +2251,20 @@ private:
                 if (p[i] != L'!' || cchVarName < 1)
                 {
                     // Not a valid variable name, pass "%!NAME" through to output.
-                    CheckWin32(m_enum.m_lastError, AppendWide(m_output, &p[iPercent], i - iPercent));
+                    if (!AddLiteralOp(ops, iPercent, i - iPercent))
+                    {
+                        goto Done;
+                    }
                 }
                 else
                 {
                     i += 1; // Consume trailing '!'
-                    CheckWin32(m_enum.m_lastError, AppendVariable(p + iPercent, i - iPercent));
+                    if (!ops.push_back({ FormatOpVariable, iPercent, i - iPercent }))
+                    {
+                        goto Done;
+                    }
                 }
 
-                // Safe to "continue" only if we haven't touched m_scratchBuffer.
-                ASSERT(!formatFromScratch || p == m_scratchBuffer.data());
                 continue;
             }
 
@@ -1595,23 +2277,27 @@ private:
 
             if (ch < L'0' || ch > L'9')
             {
+                unsigned cchLiteral;
                 if (doublePercent &&
                     ch == L'%' &&
                     p[i + 1] >= L'0' &&
                     p[i + 1] <= L'9')
                 {
                     // Treat %%%2 as "%%" + "%2".
-                    CheckWin32(m_enum.m_lastError, AppendLiteral(m_output, L"%%"));
+                    cchLiteral = 2;
                 }
                 else
                 {
                     // In all other cases, consume one '%' char at a time.
                     i -= doublePercent; // Restore the second '%' character.
-                    CheckOutOfMem(m_enum.m_lastError, m_output.push_back(L'%'));
+                    cchLiteral = 1;
+                }
+
+                if (!AddLiteralOp(ops, iPercent, cchLiteral))
+                {
+                    goto Done;
                 }
 
-                // Safe to "continue" only if we haven't touched m_scratchBuffer.
-                ASSERT(!formatFromScratch || p == m_scratchBuffer.data());
                 continue;
             }
 
@@ -1628,456 +2314,521 @@ private:
                 index = index * 10 + ch - L'0';
             }
 
+            FormatOp op = { FormatOpProperty, index, 0 };
             if (doublePercent)
             {
-                auto const scratchOldSize = m_scratchBuffer.size();
-
-                {
-                    EtwStringBuilder scratchBuilder(m_scratchBuffer);
-                    m_enum.m_lastError = m_enum.m_enumeratorCallbacks.GetParameterMessage(
-                        m_enum.m_pEventRecord, index, scratchBuilder);
-                    if (m_enum.m_lastError != ERROR_SUCCESS)
-                    {
-                        goto Done;
-                    }
-                }
-
-                // Trim trailing CR/LF.
-                LPWSTR pch = m_scratchBuffer.data() + scratchOldSize;
-                unsigned cch = m_scratchBuffer.size() - scratchOldSize;
-                while (cch != 0 && (pch[cch - 1] == L'\r' || pch[cch - 1] == L'\n'))
-                {
-                    cch -= 1;
-                }
-
-                if (effectiveRecursionLimit == 0)
-                {
-                    CheckWin32(m_enum.m_lastError, AppendWide(m_output, pch, cch));
-                }
-                else
-                {
-                    m_scratchBuffer.resize_unchecked(cch + scratchOldSize);
-                    CheckOutOfMem(m_enum.m_lastError, m_scratchBuffer.push_back(L'\0')); // Ensure nul-termination.
-                    pch = m_scratchBuffer.data() + scratchOldSize; // push_back may have reallocated.
-                    CheckAdd(AddFormatImpl(pch, effectiveRecursionLimit - 1));
-                }
-
-                // Clean up our use of scratch buffer.
-                m_scratchBuffer.resize_unchecked(scratchOldSize);
+                // e.g. %%2
+                op.Kind = FormatOpParameter;
             }
             else if (ch != L'!')
             {
                 // e.g. %2
-                CheckAdd(AddProperty(index, effectiveRecursionLimit));
             }
             else if (p[i + 1] == L'S' && p[i + 2] == L'!')
             {
                 // e.g. %2!S!
-
-                // Note: After seeing a !S!, MessageRender.cpp disables
-                // recursion for the rest of the current format string, not
-                // just the item that used the formatting. EtwEnumerator only
-                // disables recursion for the current item.
-
                 i += 3; // Consume "!S!".
-                CheckAdd(AddProperty(index, 0)); // No recursion.
+                op.Kind = FormatOpPropertyNoRecursion;
             }
             else
             {
                 // e.g. %2!08x!
-
                 ParsedPrintf format(&p[i + 1]);
                 if (format.Consumed() != 0 &&
                     p[i + 1 + format.Consumed()] == L'!')
                 {
                     // Valid printf format string.
                     i += format.Consumed() + 2; // Consume "!format!".
-                    CheckAdd(AddProperty(index, 0, // No recursion.
-                            format.IsPlainString() ? nullptr : &format));
+                    if (format.IsPlainString())
+                    {
+                        op.Kind = FormatOpPropertyNoRecursion;
+                    }
+                    else
+                    {
+                        op.Kind = FormatOpPropertyPrintf;
+                        op.Length = printfs.size();
+                        if (!printfs.push_back(format))
+                        {
+                            goto Done;
+                        }
+                    }
                 }
                 else
                 {
                     // Not a printf format string. Ignore it, don't consume it.
-                    CheckAdd(AddProperty(index, effectiveRecursionLimit));
                 }
             }
 
-            if (formatFromScratch)
+            if (!ops.push_back(op))
             {
-                p = m_scratchBuffer.data(); // We may have reallocated scratchBuffer.
+                goto Done;
+            }
+
+            if (op.Kind != FormatOpParameter &&
+                index - 1u < 32u)
+            {
+                header.PropertyMask |= 1u << (index - 1u);
             }
         }
 
-        m_enum.m_lastError = ERROR_SUCCESS;
+        header.OpCount = ops.size();
+        header.PrintfCount = printfs.size();
+        header.EndsWithSpace = i != 0 && p[i - 1] == L' ';
+
+        cbOps = ops.byte_size();
+        cbPrintfs = printfs.byte_size();
+        if (!compiled.resize(sizeof(header) + cbOps + cbPrintfs, false))
+        {
+            goto Done;
+        }
+
+        memcpy(compiled.data(), &header, sizeof(header));
+        memcpy(compiled.data() + sizeof(header), ops.data(), cbOps);
+        memcpy(compiled.data() + sizeof(header) + cbOps, printfs.data(), cbPrintfs);
+        ok = true;
 
     Done:
 
-        return m_enum.m_lastError == ERROR_SUCCESS;
+        return ok;
     }
 
-    static void ReplaceNulWithSpace(
-        _Inout_updates_(c) wchar_t* p,
-        unsigned c) noexcept
+private:
+
+    /*
+    Fills in m_propInfo for the %1..%9 prefix variables. Only computes the
+    values selected by propertyMask (bit n-1 selects %n). The entries for
+    the other variables are not initialized.
+    */
+    bool SetPrefixProperties(
+        UINT32 const propertyMask) noexcept
     {
-        for (unsigned i = 0; i != c; i += 1)
+        auto& eventRec = *m_enum.m_pEventRecord;
+        wchar_t const* pchProviderName = nullptr;
+        USHORT cchProviderName = 0;
+
+        m_removeTrailingSpaceAfterRecursionLevel = MaxRecursionLimit;
+        m_nameBuffer.clear();
+
+        // Prefix supports 9 numbered properties (%1..%9)
+        CheckOutOfMem(m_enum.m_lastError, m_propInfo.resize(9, false));
+
+        // Not quite the same as AppendCurrentProviderName:
+        // Don't copy ProviderName into m_nameBuffer if we don't need to.
+        if (0 == (propertyMask & (1u << (1 - 1))))
         {
-            if (p[i] == '\0')
-            {
-                p[i] = L' ';
-            }
+            // %1 not used.
         }
-    }
-
-    bool AddProperty(
-        unsigned index,
-        UINT8 recursionLimit,
-        _Inout_opt_ ParsedPrintf* pPrintf = nullptr) noexcept
-    {
-        if (index - 1u >= m_propInfo.size())
+        else if (m_enum.m_pTraceEventInfo->ProviderNameOffset)
         {
-            // Index out of range.
-            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, L"[IndexOutOfRange:%%%u]", index));
+            pchProviderName = m_enum.TeiStringNoCheck(m_enum.m_pTraceEventInfo->ProviderNameOffset);
+            cchProviderName = ProviderNameLength(m_enum.m_pEventRecord->EventHeader.ProviderId, pchProviderName);
         }
         else
         {
-            auto& pi = m_propInfo[index - 1];
+            // ProviderName not set. Use fallback.
+            CheckWin32(m_enum.m_lastError, m_enum.AppendCurrentProviderNameFallback(m_nameBuffer));
 
-            if (pi.InUse)
+            // Note: we don't just set pchProviderName = m_nameBuffer.data()
+            // because m_nameBuffer might be reallocated for EventName.
+            pchProviderName = nullptr; // null means use m_nameBuffer.data().
+            cchProviderName = static_cast<USHORT>(m_nameBuffer.size());
+        }
+
+        // Not quite the same as AppendCurrentEventName:
+        // Don't copy EventName into m_nameBuffer if we don't need to.
+        if (propertyMask & (1u << (2 - 1)))
+        {
+            wchar_t const* pchEventName;
+            USHORT cchEventName;
+            pchEventName = m_enum.EventName();
+            if (pchEventName)
             {
-                // Infinite recursion:
-                // The expansion of "...%4..." includes the string "...%4...".
-                CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, L"[IndexRecursion:%%%u]", index));
-                m_enum.m_lastError = ERROR_SUCCESS;
-                goto Done;
+                cchEventName = static_cast<USHORT>(wcslen(pchEventName));
             }
-
-            pi.InUse = true;
-
-            switch (pi.Type)
+            else
             {
-            case PropInfoAppendCurrentItemAsJson:
+                // EventName not set. Use fallback.
+                unsigned const iEventName = m_nameBuffer.size();
+                CheckWin32(m_enum.m_lastError, m_enum.AppendCurrentEventNameFallback(m_nameBuffer));
+                pchEventName = m_nameBuffer.data() + iEventName;
+                cchEventName = static_cast<USHORT>(m_nameBuffer.size() - iEventName);
+            }
 
-                // Move enumerator to the property, load it.
-                ASSERT(m_enum.m_stack.size() == 0);
-                m_enum.m_pbDataNext = pi.RawData;
-                m_enum.m_stackTop.PropertyIndex = pi.PropertyIndex;
-                m_enum.NextProperty();
-                CheckWin32(m_enum.m_lastError, m_enum.m_lastError);
+            // EVENT = %2
+            m_propInfo[2 - 1] = PropInfo(PropInfoAppendValue,
+                pchEventName,
+                cchEventName * sizeof(WCHAR),
+                TDH_INTYPE_UNICODESTRING);
+        }
 
-                // No recursion or nul-cleanup needed.
-                if (pPrintf == nullptr)
-                {
-                    // Render directly to output.
-                    CheckAdd(m_enum.AddCurrentItemAsJsonAndMoveNext(
-                        m_output, m_scratchBuffer, EtwJsonItemFlags_None));
-                }
-                else
-                {
-                    // Render item to m_scratchBuffer, then printf to m_output.
-                    auto const scratchOldSize = m_scratchBuffer.size();
+        if (propertyMask & (1u << (1 - 1)))
+        {
+            // PROVIDER = %1
+            m_propInfo[1 - 1] = PropInfo(PropInfoAppendValue,
+                pchProviderName ? pchProviderName : m_nameBuffer.data(),
+                cchProviderName * sizeof(WCHAR),
+                TDH_INTYPE_UNICODESTRING);
+        }
 
-                    CheckAdd(m_enum.AddCurrentItemAsJsonAndMoveNext(
-                        m_scratchBuffer, m_output, EtwJsonItemFlags_None));
-                    CheckOutOfMem(m_enum.m_lastError, m_scratchBuffer.push_back(L'\0')); // nul-terminate
+        // TID = %3!04X! (special treatment needed for !04X! formatting)
+        m_propInfo[3 - 1] = PropInfo(PropInfoAppendValue04X,
+            &eventRec.EventHeader.ThreadId, 4, TDH_INTYPE_UINT32, TDH_OUTTYPE_TID);
 
-                    auto value = m_scratchBuffer.data() + scratchOldSize;
-                    auto szFormat = pPrintf->MakeStringFormat();
-                    CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
+        // TIME = %4
+        m_propInfo[4 - 1] = PropInfo(PropInfoAppendValue,
+            &eventRec.EventHeader.TimeStamp, 8, TDH_INTYPE_FILETIME, TDH_OutTypeDateTimeUtc);
 
-                    m_scratchBuffer.resize_unchecked(scratchOldSize);
-                }
-                break;
+        // Only compute CPU times and CPU index if needed.
+        m_ktime = (propertyMask & (1u << (5 - 1))) && HasCpuTimes()
+            ? m_enum.TicksToMilliseconds(eventRec.EventHeader.KernelTime)
+            : 0;
+        m_utime = (propertyMask & (1u << (6 - 1))) && HasCpuTimes()
+            ? m_enum.TicksToMilliseconds(eventRec.EventHeader.UserTime)
+            : 0;
+        m_cpuIndex = (propertyMask & (1u << (9 - 1)))
+            ? GetEventProcessorIndex(&eventRec)
+            : 0;
 
-            case PropInfoAppendValue04X:
+        // KTIME = %5!08u! (special treatment needed for !08u! formatting)
+        m_propInfo[5 - 1] = PropInfo(PropInfoAppendValue08u,
+            &m_ktime, 4, TDH_INTYPE_UINT32);
 
-                if (pPrintf == nullptr)
-                {
-                    // No recursion or nul-cleanup needed.
-                    ASSERT(pi.CookedDataSize == 4);
-                    CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, L"%04X",
-                        *reinterpret_cast<UINT32 const UNALIGNED*>(pi.CookedData)));
-                    break;
-                }
-                goto PropInfoAppendValue;
+        // UTIME = %6!08u! (special treatment needed for !08u! formatting)
+        m_propInfo[6 - 1] = PropInfo(PropInfoAppendValue08u,
+            &m_utime, 4, TDH_INTYPE_UINT32);
 
-            case PropInfoAppendValue08u:
+        static const UINT32 sequenceNumber = 0;
+        // SEQ = %7!u!
+        m_propInfo[7 - 1] = PropInfo(PropInfoAppendValue,
+            &sequenceNumber, 4, TDH_INTYPE_UINT32);
 
-                if (pPrintf == nullptr)
-                {
-                    // No recursion or nul-cleanup needed.
-                    ASSERT(pi.CookedDataSize == 4);
-                    CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, L"%08u",
-                        *reinterpret_cast<UINT32 const UNALIGNED*>(pi.CookedData)));
-                    break;
-                }
-                goto PropInfoAppendValue;
+        // PID = %8!04X! (special treatment needed for !04X! formatting)
+        m_propInfo[8 - 1] = PropInfo(PropInfoAppendValue04X,
+            &eventRec.EventHeader.ProcessId, 4, TDH_INTYPE_UINT32, TDH_OUTTYPE_PID);
 
-            case PropInfoAppendValue:
-            PropInfoAppendValue:
+        // CPU = %9!u!
+        m_propInfo[9 - 1] = PropInfo(PropInfoAppendValue,
+            &m_cpuIndex, 4, TDH_INTYPE_UINT32);
 
-                recursionLimit = 0;
-                __fallthrough;
+        m_enum.m_lastError = ERROR_SUCCESS;
 
-            case PropInfoAppendValueRecurse:
+    Done:
 
-                if (pPrintf != nullptr)
-                {
-                    // There is a custom format string.
-                    // If the data type and the format string match, we can
-                    // printf directly to output. Otherwise, we render the data
-                    // as a string into m_scratchBuffer, then printf the
-                    // resulting string into output.
+        return m_enum.m_lastError == ERROR_SUCCESS;
+    }
 
-                    ASSERT(recursionLimit == 0);
+    // Returns true if the event's KernelTime and UserTime fields are valid.
+    bool HasCpuTimes() const noexcept
+    {
+        return 0 == (m_enum.m_pEventRecord->EventHeader.Flags &
+            (EVENT_HEADER_FLAG_NO_CPUTIME | EVENT_HEADER_FLAG_PRIVATE_SESSION));
+    }
 
-                    if (pPrintf->Category() == CategoryString)
-                    {
-                        goto RenderAsString;
-                    }
+    bool AddFormatImpl(
+        _In_z_ LPCWSTR szFormatString,
+        UINT8 const recursionLimit) noexcept
+    {
+        LPCWSTR p;
+        unsigned i;
+        UINT8 effectiveRecursionLimit = recursionLimit;
 
-                    switch (pi.CookedInType)
-                    {
-                    case TDH_INTYPE_INT8:
-                    case TDH_INTYPE_UINT8:
-                    case TDH_INTYPE_ANSICHAR:
+        // Is szFormatString within m_scratchBuffer?
+        bool const formatFromScratch =
+            szFormatString >= m_scratchBuffer.data() &&
+            szFormatString <= m_scratchBuffer.data() + m_scratchBuffer.size();
+        if (formatFromScratch)
+        {
+            // szFormatString is within scratchBuffer, so we'll need to reset
+            // p any time we call a subroutine that might use m_scratchBuffer.
+            p = m_scratchBuffer.data();
+            i = static_cast<unsigned>(szFormatString - p);
+        }
+        else
+        {
+            // szFormatString is not related to m_scratchBuffer.
+            p = szFormatString;
+            i = 0;
+        }
 
-                        ASSERT(pi.CookedDataSize == 1);
-                        if (pPrintf->Category() == CategoryInteger)
-                        {
-                            auto value = *reinterpret_cast<UINT8 const*>(pi.CookedData);
-                            auto szFormat = pPrintf->MakeInt8Format();
-                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
-                        }
-                        else if (pPrintf->Category() == CategoryCharacter)
-                        {
-                            // Convert input with MB2WC, then render.
-                            unsigned cp;
-                            switch (pi.OutType)
-                            {
-                            default:
-                            case TDH_OUTTYPE_STRING:
-                                cp = CP_ACP;
-                                break;
-                            case TDH_OUTTYPE_XML:
-                            case TDH_OUTTYPE_JSON:
-                            case TDH_OUTTYPE_UTF8:
-                                cp = CP_UTF8;
-                                break;
-                            }
+        for (;;)
+        {
+            auto const iChunkStart = i;
+            wchar_t ch;
 
-                            wchar_t value;
-                            if (1 != MultiByteToWideChar(
-                                cp, 0, (LPCCH)pi.CookedData, 1, &value, 1))
-                            {
-                                goto RenderAsString;
-                            }
+            // Find the next '%' (if any).
+            for (;;)
+            {
+                ch = p[i];
+                if (ch == L'\0' || ch == L'%')
+                {
+                    break;
+                }
+                i += 1;
+            }
 
-                            // Convert nul to space.
-                            if (value == L'\0')
-                            {
-                                value = L' ';
-                            }
+            // Append a chunk of normal text.
+            CheckWin32(m_enum.m_lastError, AppendWide(m_output, p + iChunkStart, i - iChunkStart));
 
-                            auto szFormat = pPrintf->MakeCharacterFormat();
-                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
-                        }
-                        else
-                        {
-                            goto RenderAsString;
-                        }
-                        break;
+            // If end of string, we're done.
+            if (ch == L'\0')
+            {
+                // TDH adds an extra space to EventMessage. Remove it.
+                if (recursionLimit == m_removeTrailingSpaceAfterRecursionLevel &&
+                    i != 0 && p[i - 1] == L' ')
+                {
+                    ASSERT(m_output.size() != 0);
+                    ASSERT(m_output[m_output.size() - 1] == L' ');
+                    m_output.resize_unchecked(m_output.size() - 1);
+                }
 
-                    case TDH_INTYPE_INT16:
-                    case TDH_INTYPE_UINT16:
-                    case TDH_INTYPE_UNICODECHAR:
+                break;
+            }
 
-                        ASSERT(pi.CookedDataSize == 2);
-                        if (pPrintf->Category() == CategoryInteger)
-                        {
-                            auto value =
-                                pi.OutType == TDH_OUTTYPE_PORT
-                                ? _byteswap_ushort(*reinterpret_cast<UINT16 const UNALIGNED*>(pi.CookedData))
-                                : *reinterpret_cast<UINT16 const UNALIGNED*>(pi.CookedData);
-                            auto szFormat = pPrintf->MakeInt16Format();
-                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
-                        }
-                        else if (pPrintf->Category() == CategoryCharacter)
-                        {
-                            auto value = *reinterpret_cast<wchar_t const UNALIGNED*>(pi.CookedData);
+            auto const iPercent = i; // Index of the '%' character.
+            i += 1; // Consume the first '%' character.
+            ch = p[i];
 
-                            // Convert nul to space.
-                            if (value == L'\0')
-                            {
-                                value = L' ';
-                            }
+            if (ch == L'!')
+            {
+                // e.g. %!NAME!
 
-                            auto szFormat = pPrintf->MakeCharacterFormat();
-                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
-                        }
-                        else
-                        {
-                            goto RenderAsString;
-                        }
-                        break;
+                // Consume "!NAME".
+                do
+                {
+                    i += 1;
+                } while (p[i] >= L'A' && p[i] <= L'Z');
 
-                    case TDH_INTYPE_INT32:
-                    case TDH_INTYPE_UINT32:
-                    case TDH_INTYPE_HEXINT32:
-                    case TDH_INTYPE_BOOLEAN:
-                    RenderAsInt32:
+                auto const cchVarName = i - (iPercent + 2);
 
-                        ASSERT(pi.CookedDataSize == 4);
-                        if (pPrintf->Category() == CategoryInteger)
-                        {
-                            auto value = *reinterpret_cast<UINT32 const UNALIGNED*>(pi.CookedData);
-                            auto szFormat = pPrintf->MakeInt32Format();
-                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
-                        }
-                        else
-                        {
-                            goto RenderAsString;
-                        }
-                        break;
+                if (p[i] != L'!' || cchVarName < 1)
+                {
+                    // Not a valid variable name, pass "%!NAME" through to output.
+                    CheckWin32(m_enum.m_lastError, AppendWide(m_output, &p[iPercent], i - iPercent));
+                }
+                else
+                {
+                    i += 1; // Consume trailing '!'
+                    CheckWin32(m_enum.m_lastError, AppendVariable(p + iPercent, i - iPercent));
+                }
 
-                    case TDH_INTYPE_INT64:
-                    case TDH_INTYPE_UINT64:
-                    case TDH_INTYPE_HEXINT64:
-                    case TDH_INTYPE_FILETIME:
-                    RenderAsInt64:
+                // Safe to "continue" only if we haven't touched m_scratchBuffer.
+                ASSERT(!formatFromScratch || p == m_scratchBuffer.data());
+                continue;
+            }
 
-                        ASSERT(pi.CookedDataSize == 8);
-                        if (pPrintf->Category() == CategoryInteger)
-                        {
-                            auto value = *reinterpret_cast<UINT64 const UNALIGNED*>(pi.CookedData);
-                            auto szFormat = pPrintf->MakeInt64Format();
-                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
-                        }
-                        else
-                        {
-                            goto RenderAsString;
-                        }
-                        break;
+            bool const doublePercent = (ch == L'%');
+            if (doublePercent)
+            {
+                i += 1; // Consume the second '%' character.
+                ch = p[i];
+            }
 
-                    case TDH_INTYPE_FLOAT:
+            if (ch < L'0' || ch > L'9')
+            {
+                if (doublePercent &&
+                    ch == L'%' &&
+                    p[i + 1] >= L'0' &&
+                    p[i + 1] <= L'9')
+                {
+                    // Treat %%%2 as "%%" + "%2".
+                    CheckWin32(m_enum.m_lastError, AppendLiteral(m_output, L"%%"));
+                }
+                else
+                {
+                    // In all other cases, consume one '%' char at a time.
+                    i -= doublePercent; // Restore the second '%' character.
+                    CheckOutOfMem(m_enum.m_lastError, m_output.push_back(L'%'));
+                }
 
-                        ASSERT(pi.CookedDataSize == 4);
-                        if (pPrintf->Category() == CategoryFloat)
-                        {
-                            auto value = *reinterpret_cast<float const UNALIGNED*>(pi.CookedData);
-                            auto szFormat = pPrintf->MakeFloatFormat();
-                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
-                        }
-                        else
-                        {
-                            goto RenderAsString;
-                        }
-                        break;
-
-                    case TDH_INTYPE_DOUBLE:
-
-                        ASSERT(pi.CookedDataSize == 8);
-                        if (pPrintf->Category() == CategoryFloat)
-                        {
-                            auto value = *reinterpret_cast<double const UNALIGNED*>(pi.CookedData);
-                            auto szFormat = pPrintf->MakeFloatFormat();
-                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
-                        }
-                        else
-                        {
-                            goto RenderAsString;
-                        }
-                        break;
-
-                    case TDH_INTYPE_POINTER:
-                    case TDH_INTYPE_SIZET:
+                // Safe to "continue" only if we haven't touched m_scratchBuffer.
+                ASSERT(!formatFromScratch || p == m_scratchBuffer.data());
+                continue;
+            }
 
-                        if (pi.CookedDataSize == 8)
-                        {
-                            goto RenderAsInt64;
-                        }
-                        else
-                        {
-                            goto RenderAsInt32;
-                        }
-                        break;
+            unsigned index = ch - L'0';
+            for (;;)
+            {
+                i += 1; // Consume a digit.
+                ch = p[i];
+                if (ch < L'0' || ch > L'9')
+                {
+                    break;
+                }
 
-                    default:
-                    RenderAsString:
+                index = index * 10 + ch - L'0';
+            }
 
-                        // Render item to m_scratchBuffer, then printf to m_output.
-                        auto const scratchOldSize = m_scratchBuffer.size();
-                        CheckAdd(AddSimplePropInfo(m_scratchBuffer, pi));
-                        CheckOutOfMem(m_enum.m_lastError, m_scratchBuffer.push_back(L'\0')); // nul-terminate
+            if (doublePercent)
+            {
+                // e.g. %%2
+                CheckAdd(AddParameterMessage(index, effectiveRecursionLimit));
+            }
+            else if (ch != L'!')
+            {
+                // e.g. %2
+                CheckAdd(AddProperty(index, effectiveRecursionLimit));
+            }
+            else if (p[i + 1] == L'S' && p[i + 2] == L'!')
+            {
+                // e.g. %2!S!
 
-                        auto value = m_scratchBuffer.data() + scratchOldSize;
-                        auto szFormat = pPrintf->MakeStringFormat();
-                        CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
+                // Note: After seeing a !S!, MessageRender.cpp disables
+                // recursion for the rest of the current format string, not
+                // just the item that used the formatting. EtwEnumerator only
+                // disables recursion for the current item.
 
-                        m_scratchBuffer.resize_unchecked(scratchOldSize);
-                        break;
-                    }
+                i += 3; // Consume "!S!".
+                CheckAdd(AddProperty(index, 0)); // No recursion.
+            }
+            else
+            {
+                // e.g. %2!08x!
 
-                }
-                else if (recursionLimit == 0)
+                ParsedPrintf format(&p[i + 1]);
+                if (format.Consumed() != 0 &&
+                    p[i + 1 + format.Consumed()] == L'!')
                 {
-                    // Recursion disabled: render directly into m_output.
-                    CheckAdd(AddSimplePropInfo(m_output, pi));
+                    // Valid printf format string.
+                    i += format.Consumed() + 2; // Consume "!format!".
+                    CheckAdd(AddProperty(index, 0, // No recursion.
+                            format.IsPlainString() ? nullptr : &format));
                 }
                 else
                 {
-                    // Recursion enabled:
-                    // Render into m_scratchBuffer, then format into m_output.
-                    auto const scratchOldSize = m_scratchBuffer.size();
-                    auto const appendResult = m_enum.AddValueWithMapName(
-                        m_scratchBuffer,
-                        pi.CookedData,
-                        pi.CookedDataSize,
-                        static_cast<_TDH_IN_TYPE>(pi.CookedInType),
-                        static_cast<_TDH_OUT_TYPE>(pi.OutType),
-                        m_enum.m_pEventRecord,
-                        pi.MapName);
+                    // Not a printf format string. Ignore it, don't consume it.
+                    CheckAdd(AddProperty(index, effectiveRecursionLimit));
+                }
+            }
 
-                    switch (appendResult)
-                    {
-                    case ValueType_JsonString:
+            if (formatFromScratch)
+            {
+                p = m_scratchBuffer.data(); // We may have reallocated scratchBuffer.
+            }
+        }
 
-                        ReplaceNulWithSpace(
-                            m_scratchBuffer.data() + scratchOldSize,
-                            m_scratchBuffer.size() - scratchOldSize);
+        m_enum.m_lastError = ERROR_SUCCESS;
 
-                        CheckOutOfMem(m_enum.m_lastError, m_scratchBuffer.push_back(L'\0')); // nul-terminate
+    Done:
 
-                        // Treat the value as a format string.
-                        CheckAdd(AddFormatImpl(
-                            m_scratchBuffer.data() + scratchOldSize,
-                            recursionLimit - 1));
-                        break;
+        return m_enum.m_lastError == ERROR_SUCCESS;
+    }
 
-                    case ValueType_JsonCleanString:
-                    case ValueType_JsonLiteral:
+    /*
+    Same as AddFormatImpl(szFormat, recursionLimit), but uses a compiled form
+    of szFormat from the message cache, compiling and caching it if needed.
+    Falls back to AddFormatImpl if the cache is disabled or out of memory.
+    szFormat must not be within m_scratchBuffer.
+    */
+    bool AddCachedFormat(
+        _In_z_ LPCWSTR szFormat,
+        UINT8 const recursionLimit) noexcept
+    {
+        auto& cache = m_enum.m_messageCache;
+        if (cache.Capacity() != 0)
+        {
+            EtwInternal::MessageCache::Key key;
+            EtwInternal::MessageCache::MakeKey(szFormat, &key);
 
-                        // No additional processing needed.
-                        CheckWin32(m_enum.m_lastError, AppendWide(
-                            m_output,
-                            m_scratchBuffer.data() + scratchOldSize,
-                            m_scratchBuffer.size() - scratchOldSize));
-                        break;
+            auto pCompiled = static_cast<CompiledFormat const*>(cache.Find(key));
+            if (pCompiled == nullptr &&
+                CompileFormat(szFormat, m_enum.m_messageBuffer))
+            {
+                pCompiled = static_cast<CompiledFormat const*>(cache.Insert(
+                    key,
+                    m_enum.m_messageBuffer.data(),
+                    m_enum.m_messageBuffer.size()));
+            }
 
-                    default:
-                        goto Done;
-                    }
+            if (pCompiled != nullptr)
+            {
+                return AddCompiledFormat(szFormat, pCompiled, recursionLimit);
+            }
+        }
 
-                    m_scratchBuffer.resize_unchecked(scratchOldSize);
-                }
+        return AddFormatImpl(szFormat, recursionLimit);
+    }
+
+    // Appends a literal op, merging it with the previous op if adjacent.
+    static bool AddLiteralOp(
+        EtwInternal::Buffer<FormatOp, 16>& ops,
+        unsigned offset,
+        unsigned length) noexcept
+    {
+        if (length == 0)
+        {
+            return true;
+        }
+
+        if (ops.size() != 0)
+        {
+            auto& last = ops[ops.size() - 1];
+            if (last.Kind == FormatOpLiteral &&
+                last.Arg + last.Length == offset)
+            {
+                last.Length += length;
+                return true;
+            }
+        }
+
+        return ops.push_back({ FormatOpLiteral, offset, length });
+    }
+
+    // Executes a format compiled by CompileFormat. szFormat is the string
+    // that was compiled.
+    bool AddCompiledFormat(
+        _In_z_ LPCWSTR szFormat,
+        _In_ CompiledFormat const* pCompiled,
+        UINT8 const recursionLimit) noexcept
+    {
+        auto const pOps = reinterpret_cast<FormatOp const*>(pCompiled + 1);
+        auto const pPrintfs = reinterpret_cast<ParsedPrintf const*>(pOps + pCompiled->OpCount);
+
+        for (unsigned iOp = 0; iOp != pCompiled->OpCount; iOp += 1)
+        {
+            auto const& op = pOps[iOp];
+            switch (op.Kind)
+            {
+            case FormatOpLiteral:
+                CheckWin32(m_enum.m_lastError, AppendWide(m_output, szFormat + op.Arg, op.Length));
                 break;
 
-            default:
+            case FormatOpVariable:
+                CheckWin32(m_enum.m_lastError, AppendVariable(szFormat + op.Arg, op.Length));
+                break;
 
-                m_enum.m_lastError = ERROR_ASSERTION_FAILURE;
-                goto Done;
+            case FormatOpProperty:
+                CheckAdd(AddProperty(op.Arg, recursionLimit));
+                break;
+
+            case FormatOpPropertyNoRecursion:
+                CheckAdd(AddProperty(op.Arg, 0));
+                break;
+
+            case FormatOpPropertyPrintf:
+            {
+                // AddProperty modifies the format, so use a copy.
+                ParsedPrintf format = pPrintfs[op.Length];
+                CheckAdd(AddProperty(op.Arg, 0, &format));
+                break;
             }
 
-            pi.InUse = false;
+            case FormatOpParameter:
+                CheckAdd(AddParameterMessage(op.Arg, recursionLimit));
+                break;
+
+            default:
+                ASSERT(!"Invalid FormatOpKind");
+                break;
+            }
+        }
+
+        // TDH adds an extra space to EventMessage. Remove it.
+        if (recursionLimit == m_removeTrailingSpaceAfterRecursionLevel &&
+            pCompiled->EndsWithSpace)
+        {
+            ASSERT(m_output.size() != 0);
+            ASSERT(m_output[m_output.size() - 1] == L' ');
+            m_output.resize_unchecked(m_output.size() - 1);
         }
 
         m_enum.m_lastError = ERROR_SUCCESS;
@@ -2087,604 +2838,2001 @@ private:
         return m_enum.m_lastError == ERROR_SUCCESS;
     }
 
-    bool
-    AddSimplePropInfo(
-        Buffer& output,
-        PropInfo& pi) const noexcept
+    // Appends the parameter string for %%index, expanding any %n inserts in
+    // the parameter string if recursionLimit != 0.
+    bool AddParameterMessage(
+        unsigned index,
+        UINT8 const recursionLimit) noexcept
     {
-        auto const oldSize = output.size();
-        auto const appendResult = m_enum.AddValueWithMapName(
-            output,
-            pi.CookedData,
-            pi.CookedDataSize,
-            static_cast<_TDH_IN_TYPE>(pi.CookedInType),
-            static_cast<_TDH_OUT_TYPE>(pi.OutType),
-            m_enum.m_pEventRecord,
-            pi.MapName);
+        auto const scratchOldSize = m_scratchBuffer.size();
 
-        switch (appendResult)
         {
-        case ValueType_JsonString:
-            ReplaceNulWithSpace(
-                output.data() + oldSize,
-                output.size() - oldSize);
-            ASSERT(m_enum.m_lastError == ERROR_SUCCESS);
-            break;
+            EtwStringBuilder scratchBuilder(m_scratchBuffer);
+            m_enum.m_lastError = m_enum.m_enumeratorCallbacks.GetParameterMessage(
+                m_enum.m_pEventRecord, index, scratchBuilder);
+            if (m_enum.m_lastError != ERROR_SUCCESS)
+            {
+                goto Done;
+            }
+        }
 
-        case ValueType_JsonCleanString:
-        case ValueType_JsonLiteral:
-            ASSERT(m_enum.m_lastError == ERROR_SUCCESS);
-            break;
+        {
+            // Trim trailing CR/LF.
+            LPWSTR pch = m_scratchBuffer.data() + scratchOldSize;
+            unsigned cch = m_scratchBuffer.size() - scratchOldSize;
+            while (cch != 0 && (pch[cch - 1] == L'\r' || pch[cch - 1] == L'\n'))
+            {
+                cch -= 1;
+            }
 
-        default:
-            ASSERT(m_enum.m_lastError != ERROR_SUCCESS);
-            break;
+            if (recursionLimit == 0)
+            {
+                CheckWin32(m_enum.m_lastError, AppendWide(m_output, pch, cch));
+            }
+            else
+            {
+                m_scratchBuffer.resize_unchecked(cch + scratchOldSize);
+                CheckOutOfMem(m_enum.m_lastError, m_scratchBuffer.push_back(L'\0')); // Ensure nul-termination.
+                pch = m_scratchBuffer.data() + scratchOldSize; // push_back may have reallocated.
+                CheckAdd(AddFormatImpl(pch, recursionLimit - 1));
+            }
         }
 
-        return appendResult != 0;
-    }
+        // Clean up our use of scratch buffer.
+        m_scratchBuffer.resize_unchecked(scratchOldSize);
+        m_enum.m_lastError = ERROR_SUCCESS;
 
-    /*
-    pchVariable is "%!NAME!".
-    */
-    LSTATUS
-    AppendVariable(
-        _In_reads_(cchVariable) wchar_t const* pchVariable,
-        _In_range_(3, MAXUINT) unsigned cchVariable) const noexcept
-    {
-        LSTATUS status = ERROR_SUCCESS;
+    Done:
 
-        // Starts with "%!" and ends with "!".
-        ASSERT(cchVariable >= 3);
-        ASSERT(pchVariable[0] == L'%');
-        ASSERT(pchVariable[1] == L'!');
-        ASSERT(pchVariable[cchVariable - 1] == L'!');
+        return m_enum.m_lastError == ERROR_SUCCESS;
+    }
 
-        // IS_VARNAME("NAME")
-        // Assumes that we've already matched the 'N', so only checks "AME".
-#define IS_VARNAME(name) ( \
-    cchVariable == ARRAYSIZE(L##name) + 2 && \
-    0 == memcmp(pchVariable + 3, L##name + 1, (ARRAYSIZE(L##name) - 2) * sizeof(wchar_t)) \
-    )
-
-        auto& eventRec = *m_enum.m_pEventRecord;
-        auto& tei = *m_enum.m_pTraceEventInfo;
-
-        switch (pchVariable[2])
+    static void ReplaceNulWithSpace(
+        _Inout_updates_(c) wchar_t* p,
+        unsigned c) noexcept
+    {
+        for (unsigned i = 0; i != c; i += 1)
         {
-        case L'A':
-            if (IS_VARNAME("ATTRIBS"))
-            {
-                auto const eventAttributes = m_enum.EventAttributes();
-                if (eventAttributes)
-                {
-                    CheckWin32(status, AppendWide(m_output, eventAttributes));
-                }
-                goto Done;
-            }
-            break;
-        case L'B':
-            if (IS_VARNAME("BANG"))
-            {
-                goto Exclamation;
-            }
-            break;
-        case L'C':
-            if (IS_VARNAME("COMPNAME")) // Alias for MJ
-            {
-            CompName:
-                CheckWin32(status, AppendEventAttribute(L"MJ", 2));
-                goto Done;
-            }
-            if (IS_VARNAME("CPU")) // CPU = %9!d!
-            {
-                CheckWin32(status, AppendPrintf(m_output, L"%u",
-                    GetEventProcessorIndex(&eventRec)));
-                goto Done;
-            }
-            break;
-        case L'E':
-            if (IS_VARNAME("EVENT")) // EVENT = %2
-            {
-                CheckWin32(status, m_enum.AppendCurrentEventName(m_output));
-                goto Done;
-            }
-            if (IS_VARNAME("EXCLAMATION"))
-            {
-            Exclamation:
-                CheckOutOfMem(status, m_output.push_back(L'!'));
-                goto Done;
-            }
-            break;
-        case L'F':
-            if (IS_VARNAME("FILE"))
-            {
-                CheckWin32(status, AppendEventAttribute(L"FILE", 4));
-                goto Done;
-            }
-            if (IS_VARNAME("FLAGS"))
-            {
-                goto Keywords;
-            }
-            if (IS_VARNAME("FUNC"))
-            {
-                CheckWin32(status, m_enum.AppendCurrentFunctionName(m_output));
-                goto Done;
-            }
-            break;
-        case L'K':
-            if (IS_VARNAME("KEYWORDS"))
-            {
-            Keywords:
-                CheckWin32(status, m_enum.AppendCurrentKeywordsName(m_output));
-                goto Done;
-            }
-            if (IS_VARNAME("KTIME")) // KTIME = %5
-            {
-                CheckWin32(status, AppendPrintf(m_output, L"%u", m_ktime));
-                goto Done;
-            }
-            break;
-        case L'L':
-            if (IS_VARNAME("LEVEL"))
-            {
-                CheckWin32(status, m_enum.AppendCurrentLevelName(m_output));
-                goto Done;
-            }
-            if (IS_VARNAME("LINE"))
-            {
-                CheckWin32(status, AppendEventAttribute(L"LINE", 4));
-                goto Done;
-            }
-            break;
-        case L'M':
-            if (IS_VARNAME("MJ")) // aka COMPNAME
-            {
-                goto CompName;
-            }
-            if (IS_VARNAME("MN")) // aka SUBCOMP
-            {
-                goto SubComp;
-            }
-            break;
-        case L'P':
-            if (IS_VARNAME("PROVIDER")) // PROVIDER = %1
+            if (p[i] == '\0')
             {
-                CheckWin32(status, m_enum.AppendCurrentProviderName(m_output));
-                goto Done;
+                p[i] = L' ';
             }
-            if (IS_VARNAME("PID")) // PID = %8!04X!
+        }
+    }
+
+    bool AddProperty(
+        unsigned index,
+        UINT8 recursionLimit,
+        _Inout_opt_ ParsedPrintf* pPrintf = nullptr) noexcept
+    {
+        if (index - 1u >= m_propInfo.size())
+        {
+            // Index out of range.
+            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, L"[IndexOutOfRange:%%%u]", index));
+        }
+        else
+        {
+            auto& pi = m_propInfo[index - 1];
+
+            if (pi.InUse)
             {
-                CheckWin32(status, AppendPrintf(m_output, L"%04X",
-                    eventRec.EventHeader.ProcessId));
+                // Infinite recursion:
+                // The expansion of "...%4..." includes the string "...%4...".
+                CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, L"[IndexRecursion:%%%u]", index));
+                m_enum.m_lastError = ERROR_SUCCESS;
                 goto Done;
             }
-            if (IS_VARNAME("PTIME"))
+
+            pi.InUse = true;
+
+            switch (pi.Type)
             {
-                // ptime is only valid for private sessions where ProviderId != EventTraceGuid.
-                if (0 != (eventRec.EventHeader.Flags & EVENT_HEADER_FLAG_PRIVATE_SESSION) &&
-                    eventRec.EventHeader.ProviderId != EventTraceGuid)
+            case PropInfoAppendCurrentItemAsJson:
+
+                // Move enumerator to the property, load it.
+                ASSERT(m_enum.m_stack.size() == 0);
+                if (m_enum.m_tapeActive)
                 {
-                    CheckWin32(status, AppendPrintf(m_output, L"%llu",
-                        eventRec.EventHeader.ProcessorTime));
+                    EtwItemInfo itemInfo;
+                    m_enum.GetFieldByIndex(pi.PropertyIndex, &itemInfo);
                 }
-                goto Done;
-            }
-            if (IS_VARNAME("PCT") ||
-                IS_VARNAME("PERCENT"))
-            {
-                CheckOutOfMem(status, m_output.push_back(L'%'));
-                goto Done;
-            }
-            break;
-        case L'S':
-            if (IS_VARNAME("SUBCOMP")) // alias for MN
-            {
-            SubComp:
-                CheckWin32(status, AppendEventAttribute(L"MN", 2));
-                goto Done;
-            }
-            if (IS_VARNAME("SEQ"))
-            {
-                CheckOutOfMem(status, m_output.push_back(L'0'));
-                goto Done;
-            }
-            break;
-        case L'T':
-            if (IS_VARNAME("TAGS"))
-            {
-                CheckWin32(status, AppendPrintf(m_output, L"0x%X",
-                    tei.Tags));
-                goto Done;
-            }
-            if (IS_VARNAME("TID")) // TID = %3!04X!
-            {
-                CheckWin32(status, AppendPrintf(m_output, L"%04X",
-                    eventRec.EventHeader.ThreadId));
-                goto Done;
-            }
-            if (IS_VARNAME("TIME")) // TIME = %4
-            {
-                CheckWin32(status, AppendFileTime(m_output, eventRec.EventHeader.TimeStamp.QuadPart,
-                    m_enum.m_timestampFormat, m_enum.m_timeZoneBiasMinutes, true));
-                goto Done;
-            }
-            break;
-        case L'U':
-            if (IS_VARNAME("UTIME")) // UTIME = %6
-            {
-                CheckWin32(status, AppendPrintf(m_output, L"%u", m_utime));
-                goto Done;
-            }
-            break;
-        }
+                else
+                {
+                    m_enum.m_pbDataNext = pi.RawData;
+                    m_enum.m_stackTop.PropertyIndex = pi.PropertyIndex;
+                    m_enum.NextProperty();
+                }
+
+                CheckWin32(m_enum.m_lastError, m_enum.m_lastError);
+
+                // No recursion or nul-cleanup needed.
+                if (pPrintf == nullptr)
+                {
+                    // Render directly to output.
+                    CheckAdd(m_enum.AddCurrentItemAsJsonAndMoveNext(
+                        m_output, m_scratchBuffer, EtwJsonItemFlags_None));
+                }
+                else
+                {
+                    // Render item to m_scratchBuffer, then printf to m_output.
+                    auto const scratchOldSize = m_scratchBuffer.size();
+
+                    CheckAdd(m_enum.AddCurrentItemAsJsonAndMoveNext(
+                        m_scratchBuffer, m_output, EtwJsonItemFlags_None));
+                    CheckOutOfMem(m_enum.m_lastError, m_scratchBuffer.push_back(L'\0')); // nul-terminate
+
+                    auto value = m_scratchBuffer.data() + scratchOldSize;
+                    auto szFormat = pPrintf->MakeStringFormat();
+                    CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
+
+                    m_scratchBuffer.resize_unchecked(scratchOldSize);
+                }
+                break;
+
+            case PropInfoAppendValue04X:
+
+                if (pPrintf == nullptr)
+                {
+                    // No recursion or nul-cleanup needed.
+                    ASSERT(pi.CookedDataSize == 4);
+                    CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, L"%04X",
+                        *reinterpret_cast<UINT32 const UNALIGNED*>(pi.CookedData)));
+                    break;
+                }
+                goto PropInfoAppendValue;
+
+            case PropInfoAppendValue08u:
+
+                if (pPrintf == nullptr)
+                {
+                    // No recursion or nul-cleanup needed.
+                    ASSERT(pi.CookedDataSize == 4);
+                    CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, L"%08u",
+                        *reinterpret_cast<UINT32 const UNALIGNED*>(pi.CookedData)));
+                    break;
+                }
+                goto PropInfoAppendValue;
+
+            case PropInfoAppendValue:
+            PropInfoAppendValue:
+
+                recursionLimit = 0;
+                __fallthrough;
+
+            case PropInfoAppendValueRecurse:
+
+                if (pPrintf != nullptr)
+                {
+                    // There is a custom format string.
+                    // If the data type and the format string match, we can
+                    // printf directly to output. Otherwise, we render the data
+                    // as a string into m_scratchBuffer, then printf the
+                    // resulting string into output.
+
+                    ASSERT(recursionLimit == 0);
+
+                    if (pPrintf->Category() == CategoryString)
+                    {
+                        goto RenderAsString;
+                    }
+
+                    switch (pi.CookedInType)
+                    {
+                    case TDH_INTYPE_INT8:
+                    case TDH_INTYPE_UINT8:
+                    case TDH_INTYPE_ANSICHAR:
+
+                        ASSERT(pi.CookedDataSize == 1);
+                        if (pPrintf->Category() == CategoryInteger)
+                        {
+                            auto value = *reinterpret_cast<UINT8 const*>(pi.CookedData);
+                            auto szFormat = pPrintf->MakeInt8Format();
+                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
+                        }
+                        else if (pPrintf->Category() == CategoryCharacter)
+                        {
+                            // Convert input with MB2WC, then render.
+                            unsigned cp;
+                            switch (pi.OutType)
+                            {
+                            default:
+                            case TDH_OUTTYPE_STRING:
+                                cp = CP_ACP;
+                                break;
+                            case TDH_OUTTYPE_XML:
+                            case TDH_OUTTYPE_JSON:
+                            case TDH_OUTTYPE_UTF8:
+                                cp = CP_UTF8;
+                                break;
+                            }
+
+                            wchar_t value;
+                            if (1 != MultiByteToWideChar(
+                                cp, 0, (LPCCH)pi.CookedData, 1, &value, 1))
+                            {
+                                goto RenderAsString;
+                            }
+
+                            // Convert nul to space.
+                            if (value == L'\0')
+                            {
+                                value = L' ';
+                            }
+
+                            auto szFormat = pPrintf->MakeCharacterFormat();
+                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
+                        }
+                        else
+                        {
+                            goto RenderAsString;
+                        }
+                        break;
+
+                    case TDH_INTYPE_INT16:
+                    case TDH_INTYPE_UINT16:
+                    case TDH_INTYPE_UNICODECHAR:
+
+                        ASSERT(pi.CookedDataSize == 2);
+                        if (pPrintf->Category() == CategoryInteger)
+                        {
+                            auto value =
+                                pi.OutType == TDH_OUTTYPE_PORT
+                                ? _byteswap_ushort(*reinterpret_cast<UINT16 const UNALIGNED*>(pi.CookedData))
+                                : *reinterpret_cast<UINT16 const UNALIGNED*>(pi.CookedData);
+                            auto szFormat = pPrintf->MakeInt16Format();
+                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
+                        }
+                        else if (pPrintf->Category() == CategoryCharacter)
+                        {
+                            auto value = *reinterpret_cast<wchar_t const UNALIGNED*>(pi.CookedData);
+
+                            // Convert nul to space.
+                            if (value == L'\0')
+                            {
+                                value = L' ';
+                            }
+
+                            auto szFormat = pPrintf->MakeCharacterFormat();
+                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
+                        }
+                        else
+                        {
+                            goto RenderAsString;
+                        }
+                        break;
+
+                    case TDH_INTYPE_INT32:
+                    case TDH_INTYPE_UINT32:
+                    case TDH_INTYPE_HEXINT32:
+                    case TDH_INTYPE_BOOLEAN:
+                    RenderAsInt32:
+
+                        ASSERT(pi.CookedDataSize == 4);
+                        if (pPrintf->Category() == CategoryInteger)
+                        {
+                            auto value = *reinterpret_cast<UINT32 const UNALIGNED*>(pi.CookedData);
+                            auto szFormat = pPrintf->MakeInt32Format();
+                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
+                        }
+                        else
+                        {
+                            goto RenderAsString;
+                        }
+                        break;
+
+                    case TDH_INTYPE_INT64:
+                    case TDH_INTYPE_UINT64:
+                    case TDH_INTYPE_HEXINT64:
+                    case TDH_INTYPE_FILETIME:
+                    RenderAsInt64:
+
+                        ASSERT(pi.CookedDataSize == 8);
+                        if (pPrintf->Category() == CategoryInteger)
+                        {
+                            auto value = *reinterpret_cast<UINT64 const UNALIGNED*>(pi.CookedData);
+                            auto szFormat = pPrintf->MakeInt64Format();
+                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
+                        }
+                        else
+                        {
+                            goto RenderAsString;
+                        }
+                        break;
+
+                    case TDH_INTYPE_FLOAT:
+
+                        ASSERT(pi.CookedDataSize == 4);
+                        if (pPrintf->Category() == CategoryFloat)
+                        {
+                            auto value = *reinterpret_cast<float const UNALIGNED*>(pi.CookedData);
+                            auto szFormat = pPrintf->MakeFloatFormat();
+                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
+                        }
+                        else
+                        {
+                            goto RenderAsString;
+                        }
+                        break;
+
+                    case TDH_INTYPE_DOUBLE:
+
+                        ASSERT(pi.CookedDataSize == 8);
+                        if (pPrintf->Category() == CategoryFloat)
+                        {
+                            auto value = *reinterpret_cast<double const UNALIGNED*>(pi.CookedData);
+                            auto szFormat = pPrintf->MakeFloatFormat();
+                            CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
+                        }
+                        else
+                        {
+                            goto RenderAsString;
+                        }
+                        break;
+
+                    case TDH_INTYPE_POINTER:
+                    case TDH_INTYPE_SIZET:
+
+                        if (pi.CookedDataSize == 8)
+                        {
+                            goto RenderAsInt64;
+                        }
+                        else
+                        {
+                            goto RenderAsInt32;
+                        }
+                        break;
+
+                    default:
+                    RenderAsString:
+
+                        // Render item to m_scratchBuffer, then printf to m_output.
+                        auto const scratchOldSize = m_scratchBuffer.size();
+                        CheckAdd(AddSimplePropInfo(m_scratchBuffer, pi));
+                        CheckOutOfMem(m_enum.m_lastError, m_scratchBuffer.push_back(L'\0')); // nul-terminate
+
+                        auto value = m_scratchBuffer.data() + scratchOldSize;
+                        auto szFormat = pPrintf->MakeStringFormat();
+                        CheckWin32(m_enum.m_lastError, AppendPrintf(m_output, szFormat, value));
+
+                        m_scratchBuffer.resize_unchecked(scratchOldSize);
+                        break;
+                    }
+
+                }
+                else if (recursionLimit == 0)
+                {
+                    // Recursion disabled: render directly into m_output.
+                    CheckAdd(AddSimplePropInfo(m_output, pi));
+                }
+                else
+                {
+                    // Recursion enabled:
+                    // Render into m_scratchBuffer, then format into m_output.
+                    auto const scratchOldSize = m_scratchBuffer.size();
+                    auto const appendResult = m_enum.AddValueWithMapName(
+                        m_scratchBuffer,
+                        pi.CookedData,
+                        pi.CookedDataSize,
+                        static_cast<_TDH_IN_TYPE>(pi.CookedInType),
+                        static_cast<_TDH_OUT_TYPE>(pi.OutType),
+                        m_enum.m_pEventRecord,
+                        pi.MapName);
+
+                    switch (appendResult)
+                    {
+                    case ValueType_JsonString:
+
+                        ReplaceNulWithSpace(
+                            m_scratchBuffer.data() + scratchOldSize,
+                            m_scratchBuffer.size() - scratchOldSize);
+
+                        CheckOutOfMem(m_enum.m_lastError, m_scratchBuffer.push_back(L'\0')); // nul-terminate
+
+                        // Treat the value as a format string.
+                        CheckAdd(AddFormatImpl(
+                            m_scratchBuffer.data() + scratchOldSize,
+                            recursionLimit - 1));
+                        break;
+
+                    case ValueType_JsonCleanString:
+                    case ValueType_JsonLiteral:
+
+                        // No additional processing needed.
+                        CheckWin32(m_enum.m_lastError, AppendWide(
+                            m_output,
+                            m_scratchBuffer.data() + scratchOldSize,
+                            m_scratchBuffer.size() - scratchOldSize));
+                        break;
+
+                    default:
+                        goto Done;
+                    }
+
+                    m_scratchBuffer.resize_unchecked(scratchOldSize);
+                }
+                break;
+
+            default:
+
+                m_enum.m_lastError = ERROR_ASSERTION_FAILURE;
+                goto Done;
+            }
+
+            pi.InUse = false;
+        }
+
+        m_enum.m_lastError = ERROR_SUCCESS;
+
+    Done:
+
+        return m_enum.m_lastError == ERROR_SUCCESS;
+    }
+
+    bool
+    AddSimplePropInfo(
+        Buffer& output,
+        PropInfo& pi) const noexcept
+    {
+        auto const oldSize = output.size();
+        auto const appendResult = m_enum.AddValueWithMapName(
+            output,
+            pi.CookedData,
+            pi.CookedDataSize,
+            static_cast<_TDH_IN_TYPE>(pi.CookedInType),
+            static_cast<_TDH_OUT_TYPE>(pi.OutType),
+            m_enum.m_pEventRecord,
+            pi.MapName);
+
+        switch (appendResult)
+        {
+        case ValueType_JsonString:
+            ReplaceNulWithSpace(
+                output.data() + oldSize,
+                output.size() - oldSize);
+            ASSERT(m_enum.m_lastError == ERROR_SUCCESS);
+            break;
+
+        case ValueType_JsonCleanString:
+        case ValueType_JsonLiteral:
+            ASSERT(m_enum.m_lastError == ERROR_SUCCESS);
+            break;
+
+        default:
+            ASSERT(m_enum.m_lastError != ERROR_SUCCESS);
+            break;
+        }
+
+        return appendResult != 0;
+    }
+
+    /*
+    pchVariable is "%!NAME!".
+    */
+    LSTATUS
+    AppendVariable(
+        _In_reads_(cchVariable) wchar_t const* pchVariable,
+        _In_range_(3, MAXUINT) unsigned cchVariable) const noexcept
+    {
+        LSTATUS status = ERROR_SUCCESS;
+
+        // Starts with "%!" and ends with "!".
+        ASSERT(cchVariable >= 3);
+        ASSERT(pchVariable[0] == L'%');
+        ASSERT(pchVariable[1] == L'!');
+        ASSERT(pchVariable[cchVariable - 1] == L'!');
+
+        // IS_VARNAME("NAME")
+        // Assumes that we've already matched the 'N', so only checks "AME".
+#define IS_VARNAME(name) ( \
+    cchVariable == ARRAYSIZE(L##name) + 2 && \
+    0 == memcmp(pchVariable + 3, L##name + 1, (ARRAYSIZE(L##name) - 2) * sizeof(wchar_t)) \
+    )
+
+        auto& eventRec = *m_enum.m_pEventRecord;
+        auto& tei = *m_enum.m_pTraceEventInfo;
+
+        switch (pchVariable[2])
+        {
+        case L'A':
+            if (IS_VARNAME("ATTRIBS"))
+            {
+                auto const eventAttributes = m_enum.EventAttributes();
+                if (eventAttributes)
+                {
+                    CheckWin32(status, AppendWide(m_output, eventAttributes));
+                }
+                goto Done;
+            }
+            break;
+        case L'B':
+            if (IS_VARNAME("BANG"))
+            {
+                goto Exclamation;
+            }
+            break;
+        case L'C':
+            if (IS_VARNAME("COMPNAME")) // Alias for MJ
+            {
+            CompName:
+                CheckWin32(status, AppendEventAttribute(L"MJ", 2));
+                goto Done;
+            }
+            if (IS_VARNAME("CPU")) // CPU = %9!d!
+            {
+                CheckWin32(status, AppendPrintf(m_output, L"%u",
+                    GetEventProcessorIndex(&eventRec)));
+                goto Done;
+            }
+            break;
+        case L'E':
+            if (IS_VARNAME("EVENT")) // EVENT = %2
+            {
+                CheckWin32(status, m_enum.AppendCurrentEventName(m_output));
+                goto Done;
+            }
+            if (IS_VARNAME("EXCLAMATION"))
+            {
+            Exclamation:
+                CheckOutOfMem(status, m_output.push_back(L'!'));
+                goto Done;
+            }
+            break;
+        case L'F':
+            if (IS_VARNAME("FILE"))
+            {
+                CheckWin32(status, AppendEventAttribute(L"FILE", 4));
+                goto Done;
+            }
+            if (IS_VARNAME("FLAGS"))
+            {
+                goto Keywords;
+            }
+            if (IS_VARNAME("FUNC"))
+            {
+                CheckWin32(status, m_enum.AppendCurrentFunctionName(m_output));
+                goto Done;
+            }
+            break;
+        case L'K':
+            if (IS_VARNAME("KEYWORDS"))
+            {
+            Keywords:
+                CheckWin32(status, m_enum.AppendCurrentKeywordsName(m_output));
+                goto Done;
+            }
+            if (IS_VARNAME("KTIME")) // KTIME = %5
+            {
+                CheckWin32(status, AppendPrintf(m_output, L"%u", HasCpuTimes()
+                    ? m_enum.TicksToMilliseconds(eventRec.EventHeader.KernelTime)
+                    : 0));
+                goto Done;
+            }
+            break;
+        case L'L':
+            if (IS_VARNAME("LEVEL"))
+            {
+                CheckWin32(status, m_enum.AppendCurrentLevelName(m_output));
+                goto Done;
+            }
+            if (IS_VARNAME("LINE"))
+            {
+                CheckWin32(status, AppendEventAttribute(L"LINE", 4));
+                goto Done;
+            }
+            break;
+        case L'M':
+            if (IS_VARNAME("MJ")) // aka COMPNAME
+            {
+                goto CompName;
+            }
+            if (IS_VARNAME("MN")) // aka SUBCOMP
+            {
+                goto SubComp;
+            }
+            break;
+        case L'P':
+            if (IS_VARNAME("PROVIDER")) // PROVIDER = %1
+            {
+                CheckWin32(status, m_enum.AppendCurrentProviderName(m_output));
+                goto Done;
+            }
+            if (IS_VARNAME("PID")) // PID = %8!04X!
+            {
+                CheckWin32(status, AppendPrintf(m_output, L"%04X",
+                    eventRec.EventHeader.ProcessId));
+                goto Done;
+            }
+            if (IS_VARNAME("PTIME"))
+            {
+                // ptime is only valid for private sessions where ProviderId != EventTraceGuid.
+                if (0 != (eventRec.EventHeader.Flags & EVENT_HEADER_FLAG_PRIVATE_SESSION) &&
+                    eventRec.EventHeader.ProviderId != EventTraceGuid)
+                {
+                    CheckWin32(status, AppendPrintf(m_output, L"%llu",
+                        eventRec.EventHeader.ProcessorTime));
+                }
+                goto Done;
+            }
+            if (IS_VARNAME("PCT") ||
+                IS_VARNAME("PERCENT"))
+            {
+                CheckOutOfMem(status, m_output.push_back(L'%'));
+                goto Done;
+            }
+            break;
+        case L'S':
+            if (IS_VARNAME("SUBCOMP")) // alias for MN
+            {
+            SubComp:
+                CheckWin32(status, AppendEventAttribute(L"MN", 2));
+                goto Done;
+            }
+            if (IS_VARNAME("SEQ"))
+            {
+                CheckOutOfMem(status, m_output.push_back(L'0'));
+                goto Done;
+            }
+            break;
+        case L'T':
+            if (IS_VARNAME("TAGS"))
+            {
+                CheckWin32(status, AppendPrintf(m_output, L"0x%X",
+                    tei.Tags));
+                goto Done;
+            }
+            if (IS_VARNAME("TID")) // TID = %3!04X!
+            {
+                CheckWin32(status, AppendPrintf(m_output, L"%04X",
+                    eventRec.EventHeader.ThreadId));
+                goto Done;
+            }
+            if (IS_VARNAME("TIME")) // TIME = %4
+            {
+                CheckWin32(status, AppendFileTime(m_output, m_enum.m_timestampCache, eventRec.EventHeader.TimeStamp.QuadPart,
+                    m_enum.m_timestampFormat, m_enum.m_timeZoneBiasMinutes, true));
+                goto Done;
+            }
+            break;
+        case L'U':
+            if (IS_VARNAME("UTIME")) // UTIME = %6
+            {
+                CheckWin32(status, AppendPrintf(m_output, L"%u", HasCpuTimes()
+                    ? m_enum.TicksToMilliseconds(eventRec.EventHeader.UserTime)
+                    : 0));
+                goto Done;
+            }
+            break;
+        }
+
+        // Not a recognized variable name, pass "%!NAME!" through to output.
+        CheckWin32(status, AppendWide(m_output, pchVariable, cchVariable));
+
+    Done:
+
+        return status;
+    }
+
+    LSTATUS
+    AppendEventAttribute(
+        _In_count_(cName) wchar_t const* pName,
+        unsigned cName) const noexcept
+    {
+        LSTATUS status;
+
+        if (m_cchEventAttributes == 0)
+        {
+            status = ERROR_SUCCESS;
+        }
+        else
+        {
+            status = m_enum.AppendEventAttribute(
+                m_output,
+                m_szEventAttributes,
+                m_cchEventAttributes,
+                pName,
+                cName);
+            if (status == ERROR_NOT_FOUND)
+            {
+                status = ERROR_SUCCESS;
+            }
+        }
+
+        return status;
+    }
+
+private:
+
+    enum FormatOpKind
+        : UCHAR
+    {
+        FormatOpLiteral,             // Text: Arg = offset, Length = length.
+        FormatOpVariable,            // %!NAME!: Arg = offset, Length = length.
+        FormatOpProperty,            // %2: Arg = index.
+        FormatOpPropertyNoRecursion, // %2!S!, %2!s!: Arg = index.
+        FormatOpPropertyPrintf,      // %2!08x!: Arg = index, Length = ParsedPrintf index.
+        FormatOpParameter,           // %%2: Arg = index.
+    };
+
+    struct FormatOp
+    {
+        FormatOpKind Kind;
+        unsigned Arg;
+        unsigned Length;
+    };
+
+    // Followed by OpCount FormatOps, then PrintfCount ParsedPrintfs.
+    struct CompiledFormat
+    {
+        unsigned OpCount;
+        unsigned PrintfCount;
+        UINT32 PropertyMask; // Bit n-1 is set if %n is used (n <= 32).
+        bool EndsWithSpace;
+    };
+
+    enum PropInfoType
+        : UCHAR
+    {
+        PropInfoNone,
+        PropInfoAppendCurrentItemAsJson, // Render with AppendCurrentItemAsJsonAndMoveNext.
+        PropInfoAppendValue,             // Render with AppendValue.
+        PropInfoAppendValueRecurse,      // Render with AppendValue, enable recursion.
+        PropInfoAppendValue04X,          // Render with AppendValue, default format is "%04X".
+        PropInfoAppendValue08u,          // Render with AppendValue, default format is "%08u".
+        PropInfoMax
+    };
+
+    struct PropInfo
+    {
+        PropInfo() noexcept = default;
+
+        // Constructor for type = PropInfoAppendCurrentItemAsJson.
+        PropInfo(
+            PropInfoType type,
+            _In_reads_(cbRawData) BYTE const* pbRawData,
+            USHORT cbRawData,
+            USHORT propertyIndex) noexcept
+            : RawData(pbRawData)
+            , RawDataSize(cbRawData)
+            , PropertyIndex(propertyIndex)
+            , Type(type)
+            , InUse(false)
+        {
+            ASSERT(type == PropInfoAppendCurrentItemAsJson);
+            return;
+        }
+
+        // Constructor for type = PropInfoAppendValue.
+        PropInfo(
+            PropInfoType type,
+            _In_reads_bytes_(cbCookedData) void const* pbCookedData,
+            USHORT cbCookedData,
+            _TDH_IN_TYPE cookedInType,
+            _TDH_OUT_TYPE outType = TDH_OUTTYPE_NULL,
+            LPCWSTR szMapName = nullptr) noexcept
+            : MapName(szMapName)
+            , CookedData(static_cast<BYTE const*>(pbCookedData))
+            , CookedDataSize(cbCookedData)
+            , CookedInType(static_cast<USHORT>(cookedInType))
+            , OutType(static_cast<USHORT>(outType))
+            , Type(type)
+            , InUse(false)
+        {
+            ASSERT(
+                type > PropInfoAppendCurrentItemAsJson &&
+                type < PropInfoMax);
+            return;
+        }
+
+#pragma warning(push)
+#pragma warning (disable:4201)  // nameless struct/union.
+#pragma pack(push, 2) // Minor optimization: remove unneeded padding between OutType and Type.
+        union
+        {
+            struct // Type == PropInfoAppendCurrent
+            {
+                _Field_size_bytes_(RawDataSize) BYTE const* RawData;
+                USHORT RawDataSize;
+                USHORT PropertyIndex;
+            };
+
+            struct // Type == PropInfoAppendValue
+            {
+                LPCWSTR MapName;
+                _Field_size_bytes_(CookedDataSize) BYTE const* CookedData;
+                USHORT CookedDataSize;
+                USHORT CookedInType;
+                USHORT OutType;
+            };
+        };
+#pragma pack(pop)
+#pragma warning(pop)
+
+        PropInfoType Type;
+        bool InUse;
+    };
+
+private:
+
+    EtwEnumerator& m_enum;
+    EtwInternal::Buffer<wchar_t>& m_output; // Final product goes here.
+    EtwInternal::Buffer<wchar_t>& m_scratchBuffer; // Temp strings go here.
+    _Field_size_(m_cchEventAttributes) LPCWSTR const m_szEventAttributes;
+    unsigned const m_cchEventAttributes;
+    unsigned m_ktime;
+    unsigned m_utime;
+    UINT8 m_removeTrailingSpaceAfterRecursionLevel;
+    _Field_size_(m_cParameterModules) HMODULE const* m_pParameterModules;
+    unsigned m_cParameterModules;
+    unsigned m_cpuIndex;
+    EtwInternal::Buffer<wchar_t, 64> m_nameBuffer; // Storage for fallback %1 and %2 prefix variables.
+    EtwInternal::Buffer<PropInfo, 16> m_propInfo; // 16 top-level properties without heap allocation
+};
+
+#pragma endregion
+
+#pragma region EtwCompiledPrefix
+
+EtwCompiledPrefix::EtwCompiledPrefix() noexcept
+    : m_format()
+    , m_compiled()
+{
+    return;
+}
+
+EtwCompiledPrefix::~EtwCompiledPrefix() noexcept
+{
+    return;
+}
+
+LSTATUS
+EtwCompiledPrefix::Compile(
+    _In_opt_z_ EtwPCWSTR szPrefixFormat) noexcept
+{
+    LSTATUS status = ERROR_SUCCESS;
+
+    m_format.clear();
+    m_compiled.clear();
+
+    if (szPrefixFormat && szPrefixFormat[0])
+    {
+        auto const cchFormat = static_cast<unsigned>(wcslen(szPrefixFormat));
+        if (!m_format.resize(cchFormat + 1, false))
+        {
+            status = ERROR_OUTOFMEMORY;
+        }
+        else
+        {
+            memcpy(m_format.data(), szPrefixFormat, (cchFormat + 1) * sizeof(EtwWCHAR));
+            if (!EtwEnumerator::FormatContext::CompileFormat(m_format.data(), m_compiled))
+            {
+                m_format.clear();
+                m_compiled.clear();
+                status = ERROR_OUTOFMEMORY;
+            }
+        }
+    }
+
+    return status;
+}
+
+bool
+EtwCompiledPrefix::Empty() const noexcept
+{
+    return m_compiled.size() == 0;
+}
+
+#pragma endregion
+
+#pragma region Private methods
+
+LSTATUS
+EtwEnumerator::AppendResultCode(
+    EtwInternal::Buffer<wchar_t>& output,
+    _In_reads_bytes_(4) void const* pData,
+    int domain,        // EtwEnumeratorCallbacks::ResultCodeDomain
+    int type) noexcept // EtwEnumeratorCallbacks::UnderlyingType
+{
+    EtwStringBuilder outputBuilder(output);
+    return m_enumeratorCallbacks.FormatResultCodeValue(
+        static_cast<EtwEnumeratorCallbacks::ResultCodeDomain>(domain),
+        static_cast<EtwEnumeratorCallbacks::UnderlyingType>(type),
+        *static_cast<UINT32 UNALIGNED const*>(pData),
+        outputBuilder);
+}
+
+LSTATUS
+EtwEnumerator::AppendCurrentProviderName(
+    EtwInternal::Buffer<wchar_t>& output) const noexcept
+{
+    LSTATUS status;
+
+    if (m_pTraceEventInfo->ProviderNameOffset)
+    {
+        auto teiString = TeiStringNoCheck(m_pTraceEventInfo->ProviderNameOffset);
+        status = AppendWide(output,
+            teiString, ProviderNameLength(m_pEventRecord->EventHeader.ProviderId, teiString));
+    }
+    else
+    {
+        status = AppendCurrentProviderNameFallback(output);;
+    }
+
+    return status;
+}
+
+LSTATUS
+EtwEnumerator::AppendCurrentProviderNameFallback(
+    EtwInternal::Buffer<wchar_t>& output) const noexcept
+{
+    // No ProviderName set. Fall back to ProviderId.
+    // Note: AppendCurrentEventAsJson assumes this won't need JSON escaping.
+    return AppendPrintf(output, GUID_PRINTF_FORMAT_UPPER,
+        GUID_PRINTF_VALUE(m_pEventRecord->EventHeader.ProviderId));
+}
+
+LSTATUS
+EtwEnumerator::AppendCurrentEventName(
+    EtwInternal::Buffer<wchar_t>& output) const noexcept
+{
+    LSTATUS status;
+
+    auto const eventName = EventName();
+    if (eventName)
+    {
+        status = AppendWide(output, eventName);
+    }
+    else
+    {
+        status = AppendCurrentEventNameFallback(output);
+    }
+
+    return status;
+}
+
+LSTATUS
+EtwEnumerator::AppendCurrentEventNameFallback(
+    EtwInternal::Buffer<wchar_t>& output) const noexcept
+{
+    LSTATUS status;
+
+    // No EventName set. Try FILE+LINE.
+    LPCWSTR const szEventAttributes = EventAttributes();
+    unsigned const cchEventAttributes = szEventAttributes
+        ? static_cast<unsigned>(wcslen(szEventAttributes))
+        : 0;
+    status = AppendEventAttribute(output,
+        szEventAttributes, cchEventAttributes, L"FILE", 4);
+    if (status == ERROR_SUCCESS)
+    {
+        status = AppendEventAttribute(output,
+            szEventAttributes, cchEventAttributes, L"LINE", 4);
+        if (status == ERROR_SUCCESS)
+        {
+            goto Done;
+        }
+    }
+
+    if (status != ERROR_NOT_FOUND)
+    {
+        goto Done;
+    }
+
+    // FILE+LINE not available. Fall back to IDvVERSION.
+    status = AppendPrintf(output, L"%uv%u",
+        m_pEventRecord->EventHeader.EventDescriptor.Id,
+        m_pEventRecord->EventHeader.EventDescriptor.Version);
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwEnumerator::AppendCurrentKeywordsName(
+    EtwInternal::Buffer<wchar_t>& output) const noexcept
+{
+    LSTATUS status;
+
+    status = ERROR_SUCCESS;
+
+    if (m_pTraceEventInfo->KeywordsNameOffset)
+    {
+        auto pch = TeiStringNoCheck(m_pTraceEventInfo->KeywordsNameOffset);
+        auto cch = static_cast<unsigned>(wcslen(pch));
+        while (cch != 0 && pch[cch - 1] == L' ')
+        {
+            cch -= 1;
+        }
+        CheckWin32(status, AppendWide(output, pch, cch));
+    }
+    else
+    {
+        CheckWin32(status, AppendPrintf(output, L"0x%llX",
+            m_pEventRecord->EventHeader.EventDescriptor.Keyword));
+    }
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwEnumerator::AppendCurrentLevelName(
+    EtwInternal::Buffer<wchar_t>& output) const noexcept
+{
+    LSTATUS status;
+
+    if (m_pTraceEventInfo->LevelNameOffset)
+    {
+        auto pch = TeiStringNoCheck(m_pTraceEventInfo->LevelNameOffset);
+        auto cch = static_cast<unsigned>(wcslen(pch));
+        while (cch != 0 && pch[cch - 1] == L' ')
+        {
+            cch -= 1;
+        }
+        CheckWin32(status, AppendWide(output, pch, cch));
+    }
+    else
+    {
+        CheckWin32(status, AppendPrintf(output, L"%u",
+            m_pEventRecord->EventHeader.EventDescriptor.Level));
+    }
+
+    status = ERROR_SUCCESS;
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwEnumerator::AppendCurrentFunctionName(
+    EtwInternal::Buffer<wchar_t>& output) const noexcept
+{
+    LSTATUS status;
+
+    LPCWSTR const szEventAttributes = EventAttributes();
+    unsigned const cchEventAttributes = szEventAttributes
+        ? static_cast<unsigned>(wcslen(szEventAttributes))
+        : 0;
+    status = AppendEventAttribute(output,
+        szEventAttributes, cchEventAttributes, L"FUNC", 4);
+    if (status != ERROR_NOT_FOUND)
+    {
+        goto Done;
+    }
+
+    // No FUNC attribute. If the first property of the event is a
+    // nul-terminated string named "%!FUNC!", we'll use that.
+    if (m_pTraceEventInfo->PropertyCount != 0)
+    {
+        auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[0];
+        if ((epi.Flags & 0x7f) == 0 && // Not a struct, no length, no count, nothing special.
+            epi.NameOffset != 0 && // Has a name.
+            (epi.nonStructType.InType == TDH_INTYPE_UNICODESTRING ||
+             epi.nonStructType.InType == TDH_INTYPE_ANSISTRING) &&
+            0 == wcscmp(L"!FUNC!", TeiStringNoCheck(epi.NameOffset)))
+        {
+            if (epi.nonStructType.InType == TDH_INTYPE_UNICODESTRING)
+            {
+                auto const pch = static_cast<wchar_t const*>(m_pEventRecord->UserData);
+                auto const cch = static_cast<unsigned>(wcsnlen(pch, m_pEventRecord->UserDataLength / sizeof(wchar_t)));
+                status = AppendWide(output, pch, cch);
+                goto Done;
+            }
+            else
+            {
+                auto const pch = static_cast<char const*>(m_pEventRecord->UserData);
+                auto const cch = static_cast<unsigned>(strnlen(pch, m_pEventRecord->UserDataLength / sizeof(char)));
+                auto const cp = epi.nonStructType.OutType == TDH_OUTTYPE_UTF8 ? CP_UTF8 : CP_ACP;
+                status = AppendMbcs(output, pch, cch, cp);
+                goto Done;
+            }
+        }
+    }
+
+    // Instead of ERROR_NOT_FOUND, return ERROR_SUCCESS with "" result.
+    status = ERROR_SUCCESS;
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwEnumerator::AppendCurrentNameAsJson(
+    EtwInternal::Buffer<wchar_t>& output,
+    bool wantSpace) noexcept
+{
+    LSTATUS status;
+    auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
+    LPCWSTR szName = epi.NameOffset ? TeiStringNoCheck(epi.NameOffset) : L"";
+
+    CheckWin32(status, AppendStringAsJson(output, szName));
+    CheckWin32(status, AppendWide(output, L": ", wantSpace ? 2 : 1));
+    status = ERROR_SUCCESS;
+
+Done:
+
+    return status;
+}
+
+bool
+EtwEnumerator::AddCurrentEventAsJson(
+    EtwInternal::Buffer<wchar_t>& output,
+    EtwInternal::Buffer<wchar_t>& scratchBuffer,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
+{
+    ASSERT(m_state == EtwEnumeratorState_BeforeFirstItem);
+
+    bool needComma = false;
+
+    // items start
+    CheckOutOfMem(m_lastError, output.push_back(L'{'));
+
+    {
+        // Items may have been flushed, so count them too.
+        auto const oldOutputSize = output.size() + m_cchFlushed;
+        CheckAdd(AddCurrentItemAsJsonAndMoveNext(
+            output, scratchBuffer, EtwJsonItemFlags_Name));
+        needComma = oldOutputSize != output.size() + m_cchFlushed;
+    }
+
+    if (jsonSuffixFlags != 0)
+    {
+        if (needComma)
+        {
+            CheckOutOfMem(m_lastError, output.push_back(L','));
+        }
+
+        CheckAdd(AddCurrentMetaAsJson(output, scratchBuffer, jsonSuffixFlags));
+    }
+
+    // items end
+    CheckOutOfMem(m_lastError, output.push_back(L'}'));
+
+    m_lastError = ERROR_SUCCESS;
+
+Done:
+
+    return m_lastError == ERROR_SUCCESS;
+}
+
+bool
+EtwEnumerator::AddCurrentEventAsJson(
+    EtwFieldProjection& projection,
+    EtwInternal::Buffer<wchar_t>& output,
+    EtwInternal::Buffer<wchar_t>& scratchBuffer,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
+{
+    ASSERT(m_state == EtwEnumeratorState_BeforeFirstItem);
+
+    bool needComma = false;
+    unsigned fieldIndex;
+
+    // items start
+    CheckOutOfMem(m_lastError, output.push_back(L'{'));
+
+    while (MoveNextProjected(projection, &fieldIndex))
+    {
+        if (needComma)
+        {
+            CheckOutOfMem(m_lastError, output.push_back(L','));
+        }
+
+        CheckWin32(m_lastError, AppendStringAsJson(output, projection.FieldPath(fieldIndex)));
+        CheckOutOfMem(m_lastError, output.push_back(L':'));
+        CheckAdd(AddCurrentItemAsJsonAndMoveNext(
+            output, scratchBuffer, EtwJsonItemFlags_None));
+        needComma = true;
+    }
+
+    if (m_lastError != ERROR_SUCCESS)
+    {
+        goto Done;
+    }
+
+    if (jsonSuffixFlags != 0)
+    {
+        if (needComma)
+        {
+            CheckOutOfMem(m_lastError, output.push_back(L','));
+        }
+
+        CheckAdd(AddCurrentMetaAsJson(output, scratchBuffer, jsonSuffixFlags));
+    }
+
+    // items end
+    CheckOutOfMem(m_lastError, output.push_back(L'}'));
+
+    m_lastError = ERROR_SUCCESS;
+
+Done:
 
-        // Not a recognized variable name, pass "%!NAME!" through to output.
-        CheckWin32(status, AppendWide(m_output, pchVariable, cchVariable));
+    return m_lastError == ERROR_SUCCESS;
+}
 
-    Done:
+bool
+EtwEnumerator::AddCurrentMetaAsJson(
+    EtwInternal::Buffer<wchar_t>& output,
+    EtwInternal::Buffer<wchar_t>& scratchBuffer,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
+{
+    auto& desc = m_pEventRecord->EventHeader.EventDescriptor;
+    bool needComma = false;
 
-        return status;
-    }
+    // meta start
+    CheckWin32(m_lastError, AppendLiteral(output, LR"("meta":{)"));
 
-    LSTATUS
-    AppendEventAttribute(
-        _In_count_(cName) wchar_t const* pName,
-        unsigned cName) const noexcept
+#define APPEND_COMMA(output) \
+        if (needComma) { CheckOutOfMem(m_lastError, output.push_back(L',')); } \
+        else { needComma = true; } \
+
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_provider)
     {
-        LSTATUS status;
+        APPEND_COMMA(output);
+        CheckWin32(m_lastError, AppendLiteral(output, LR"("provider":)"));
+        if (m_pTraceEventInfo->ProviderNameOffset)
+        {
+            CheckWin32(m_lastError, AppendStringAsJson(output,
+                TeiStringNoCheck(m_pTraceEventInfo->ProviderNameOffset)));
+        }
+        else
+        {
+            CheckOutOfMem(m_lastError, output.push_back(L'"'));
+            CheckWin32(m_lastError, AppendCurrentProviderNameFallback(output));
+            CheckOutOfMem(m_lastError, output.push_back(L'"'));
+        }
+    }
 
-        if (m_cchEventAttributes == 0)
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_event)
+    {
+        APPEND_COMMA(output);
+        CheckWin32(m_lastError, AppendLiteral(output, LR"("event":)"));
+        LPCWSTR const eventName = EventName();
+        if (eventName)
         {
-            status = ERROR_SUCCESS;
+            CheckWin32(m_lastError, AppendStringAsJson(output, eventName));
         }
         else
         {
-            status = m_enum.AppendEventAttribute(
-                m_output,
-                m_szEventAttributes,
-                m_cchEventAttributes,
-                pName,
-                cName);
-            if (status == ERROR_NOT_FOUND)
-            {
-                status = ERROR_SUCCESS;
-            }
+            // No EventName set. Use fallback.
+            unsigned const oldSize = scratchBuffer.size();
+            CheckWin32(m_lastError, AppendCurrentEventNameFallback(scratchBuffer));
+            CheckWin32(m_lastError, AppendStringAsJson(output,
+                scratchBuffer.data() + oldSize,
+                scratchBuffer.size() - oldSize));
+            scratchBuffer.resize_unchecked(oldSize);
         }
+    }
 
-        return status;
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_time)
+    {
+        APPEND_COMMA(output);
+        CheckWin32(m_lastError, AppendLiteral(output, LR"("time":")"));
+        CheckWin32(m_lastError, AppendFileTime(
+            output,
+            m_timestampCache,
+            m_pEventRecord->EventHeader.TimeStamp.QuadPart,
+            static_cast<EtwTimestampFormat>(
+                EtwTimestampFormat_Internet | (m_timestampFormat & EtwTimestampFormat_FlagMask)),
+            m_timeZoneBiasMinutes,
+            true));
+        CheckOutOfMem(m_lastError, output.push_back(L'"'));
     }
 
-private:
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_cpu)
+    {
+        APPEND_COMMA(output);
+        CheckWin32(m_lastError, AppendPrintf(output, LR"("cpu":%u)",
+            GetEventProcessorIndex(m_pEventRecord)));
+    }
 
-    enum PropInfoType
-        : UCHAR
+    if ((jsonSuffixFlags & EtwJsonSuffixFlags_pid) &&
+        m_pEventRecord->EventHeader.ProcessId != 0xffffffff)
     {
-        PropInfoNone,
-        PropInfoAppendCurrentItemAsJson, // Render with AppendCurrentItemAsJsonAndMoveNext.
-        PropInfoAppendValue,             // Render with AppendValue.
-        PropInfoAppendValueRecurse,      // Render with AppendValue, enable recursion.
-        PropInfoAppendValue04X,          // Render with AppendValue, default format is "%04X".
-        PropInfoAppendValue08u,          // Render with AppendValue, default format is "%08u".
-        PropInfoMax
-    };
+        APPEND_COMMA(output);
+        CheckWin32(m_lastError, AppendPrintf(output, LR"("pid":%u)",
+            m_pEventRecord->EventHeader.ProcessId));
+    }
 
-    struct PropInfo
+    if ((jsonSuffixFlags & EtwJsonSuffixFlags_tid) &&
+        m_pEventRecord->EventHeader.ThreadId != 0xffffffff)
     {
-        PropInfo() noexcept = default;
+        APPEND_COMMA(output);
+        CheckWin32(m_lastError, AppendPrintf(output, LR"("tid":%u)",
+            m_pEventRecord->EventHeader.ThreadId));
+    }
 
-        // Constructor for type = PropInfoAppendCurrentItemAsJson.
-        PropInfo(
-            PropInfoType type,
-            _In_reads_(cbRawData) BYTE const* pbRawData,
-            USHORT cbRawData,
-            USHORT propertyIndex) noexcept
-            : RawData(pbRawData)
-            , RawDataSize(cbRawData)
-            , PropertyIndex(propertyIndex)
-            , Type(type)
-            , InUse(false)
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_id)
+    {
+        APPEND_COMMA(output);
+        CheckWin32(m_lastError, AppendPrintf(output, LR"("id":%u)",
+            desc.Id));
+    }
+
+    if ((jsonSuffixFlags & EtwJsonSuffixFlags_version) &&
+        desc.Version != 0)
+    {
+        APPEND_COMMA(output);
+        CheckWin32(m_lastError, AppendPrintf(output, LR"("version":%u)",
+            desc.Version));
+    }
+
+    if ((jsonSuffixFlags & EtwJsonSuffixFlags_channel) &&
+        desc.Channel != 0)
+    {
+        APPEND_COMMA(output);
+        CheckWin32(m_lastError, AppendLiteral(output, LR"("channel":)"));
+        if (m_pTraceEventInfo->ChannelNameOffset != 0)
         {
-            ASSERT(type == PropInfoAppendCurrentItemAsJson);
-            return;
+            CheckWin32(m_lastError, AppendStringAsJson(output,
+                TeiStringNoCheck(m_pTraceEventInfo->ChannelNameOffset)));
+        }
+        else
+        {
+            CheckWin32(m_lastError, AppendPrintf(output, L"%u", desc.Channel));
         }
+    }
 
-        // Constructor for type = PropInfoAppendValue.
-        PropInfo(
-            PropInfoType type,
-            _In_reads_bytes_(cbCookedData) void const* pbCookedData,
-            USHORT cbCookedData,
-            _TDH_IN_TYPE cookedInType,
-            _TDH_OUT_TYPE outType = TDH_OUTTYPE_NULL,
-            LPCWSTR szMapName = nullptr) noexcept
-            : CookedData(static_cast<BYTE const*>(pbCookedData))
-            , CookedDataSize(cbCookedData)
-            , CookedInType(static_cast<USHORT>(cookedInType))
-            , OutType(static_cast<USHORT>(outType))
-            , MapName(szMapName)
-            , Type(type)
-            , InUse(false)
+    if ((jsonSuffixFlags & EtwJsonSuffixFlags_level) &&
+        desc.Level != 0)
+    {
+        APPEND_COMMA(output);
+        CheckWin32(m_lastError, AppendLiteral(output, LR"("level":)"));
+        if (m_pTraceEventInfo->LevelNameOffset != 0)
         {
-            ASSERT(
-                type > PropInfoAppendCurrentItemAsJson &&
-                type < PropInfoMax);
-            return;
+            CheckWin32(m_lastError, AppendStringAsJson(output,
+                TeiStringNoCheck(m_pTraceEventInfo->LevelNameOffset)));
+        }
+        else
+        {
+            CheckWin32(m_lastError, AppendPrintf(output, L"%u", desc.Level));
         }
+    }
 
-#pragma warning(push)
-#pragma warning (disable:4201)  // nameless struct/union.
-#pragma pack(push, 2) // Minor optimization: remove unneeded padding between OutType and Type.
-        union
+    if ((jsonSuffixFlags & EtwJsonSuffixFlags_opcode) &&
+        desc.Opcode != 0 &&
+        // Note: for Wbem, opcode is the event name, so don't show an opcode property.
+        m_pTraceEventInfo->DecodingSource != DecodingSourceWbem)
+    {
+        APPEND_COMMA(output);
+        CheckWin32(m_lastError, AppendLiteral(output, LR"("opcode":)"));
+        auto const opcodeName = OpcodeName();
+        if (opcodeName)
         {
-            struct // Type == PropInfoAppendCurrent
-            {
-                _Field_size_bytes_(RawDataSize) BYTE const* RawData;
-                USHORT RawDataSize;
-                USHORT PropertyIndex;
-            };
+            CheckWin32(m_lastError, AppendStringAsJson(output, opcodeName));
+        }
+        else
+        {
+            CheckWin32(m_lastError, AppendPrintf(output, L"%u", desc.Opcode));
+        }
+    }
 
-            struct // Type == PropInfoAppendValue
+    if ((jsonSuffixFlags & EtwJsonSuffixFlags_task) &&
+        // Note: for Wbem, we show task name even if task is 0.
+        (desc.Task != 0 || m_pTraceEventInfo->DecodingSource == DecodingSourceWbem))
+    {
+        APPEND_COMMA(output);
+        CheckWin32(m_lastError, AppendLiteral(output, LR"("task":)"));
+        auto const taskName = TaskName();
+        if (taskName)
+        {
+            CheckWin32(m_lastError, AppendStringAsJson(output, taskName));
+        }
+        else
+        {
+            CheckWin32(m_lastError, AppendPrintf(output, L"%u", desc.Task));
+        }
+    }
+
+    if ((jsonSuffixFlags & EtwJsonSuffixFlags_keywords) &&
+        desc.Keyword != 0)
+    {
+        APPEND_COMMA(output);
+        CheckWin32(m_lastError, AppendLiteral(output, LR"("keywords":)"));
+        if (m_pTraceEventInfo->KeywordsNameOffset != 0)
+        {
+            CheckWin32(m_lastError, AppendStringAsJson(output,
+                TeiStringNoCheck(m_pTraceEventInfo->KeywordsNameOffset)));
+        }
+        else
+        {
+            CheckWin32(m_lastError, AppendPrintf(output, LR"("0x%llX")", desc.Keyword));
+        }
+    }
+
+    if ((jsonSuffixFlags & EtwJsonSuffixFlags_tags) &&
+        m_pTraceEventInfo->Tags != 0)
+    {
+        APPEND_COMMA(output);
+        CheckWin32(m_lastError, AppendPrintf(output, LR"("tags":"0x%X")",
+            m_pTraceEventInfo->Tags));
+    }
+
+    if ((jsonSuffixFlags & EtwJsonSuffixFlags_activity) &&
+        m_pEventRecord->EventHeader.ActivityId != GUID())
+    {
+        APPEND_COMMA(output);
+        auto& g = m_pEventRecord->EventHeader.ActivityId;
+        CheckWin32(m_lastError, AppendPrintf(output,
+            LR"("activity":")" GUID_PRINTF_FORMAT_UPPER L"\"",
+            GUID_PRINTF_VALUE(g)));
+    }
+
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_relatedActivity)
+    {
+        for (unsigned i = 0; i != m_pEventRecord->ExtendedDataCount; i++)
+        {
+            if (m_pEventRecord->ExtendedData[i].ExtType == EVENT_HEADER_EXT_TYPE_RELATED_ACTIVITYID &&
+                m_pEventRecord->ExtendedData[i].DataSize == 16)
             {
-                LPCWSTR MapName;
-                _Field_size_bytes_(CookedDataSize) BYTE const* CookedData;
-                USHORT CookedDataSize;
-                USHORT CookedInType;
-                USHORT OutType;
-            };
-        };
-#pragma pack(pop)
-#pragma warning(pop)
+                APPEND_COMMA(output);
+                auto& g = *reinterpret_cast<GUID const*>(
+                    static_cast<UINT_PTR>(m_pEventRecord->ExtendedData[i].DataPtr));
+                CheckWin32(m_lastError, AppendPrintf(output,
+                    LR"("relatedActivity":")" GUID_PRINTF_FORMAT_UPPER L"\"",
+                    GUID_PRINTF_VALUE(g)));
+                break;
+            }
+        }
+    }
 
-        PropInfoType Type;
-        bool InUse;
-    };
+    if (0 != (m_pEventRecord->EventHeader.Flags & EVENT_HEADER_FLAG_PRIVATE_SESSION))
+    {
+        // ptime is only valid for private sessions where ProviderId != EventTraceGuid.
+        if ((jsonSuffixFlags & EtwJsonSuffixFlags_ptime) &&
+            m_pEventRecord->EventHeader.ProviderId != EventTraceGuid)
+        {
+            APPEND_COMMA(output);
+            CheckWin32(m_lastError, AppendPrintf(output, LR"("ptime":%llu)",
+                m_pEventRecord->EventHeader.ProcessorTime));
+        }
+    }
+    else if (0 == (m_pEventRecord->EventHeader.Flags & EVENT_HEADER_FLAG_NO_CPUTIME))
+    {
+        if (jsonSuffixFlags & EtwJsonSuffixFlags_ktime)
+        {
+            APPEND_COMMA(output);
+            CheckWin32(m_lastError, AppendPrintf(output, LR"("ktime":%u)",
+                TicksToMilliseconds(m_pEventRecord->EventHeader.KernelTime)));
+        }
 
-private:
+        if (jsonSuffixFlags & EtwJsonSuffixFlags_utime)
+        {
+            APPEND_COMMA(output);
+            CheckWin32(m_lastError, AppendPrintf(output, LR"("utime":%u)",
+                TicksToMilliseconds(m_pEventRecord->EventHeader.UserTime)));
+        }
+    }
 
-    EtwEnumerator& m_enum;
-    EtwInternal::Buffer<wchar_t>& m_output; // Final product goes here.
-    EtwInternal::Buffer<wchar_t>& m_scratchBuffer; // Temp strings go here.
-    _Field_size_(m_cchEventAttributes) LPCWSTR const m_szEventAttributes;
-    unsigned const m_cchEventAttributes;
-    unsigned m_ktime;
-    unsigned m_utime;
-    UINT8 m_removeTrailingSpaceAfterRecursionLevel;
-    _Field_size_(m_cParameterModules) HMODULE const* m_pParameterModules;
-    unsigned m_cParameterModules;
-    unsigned m_cpuIndex;
-    EtwInternal::Buffer<wchar_t, 64> m_nameBuffer; // Storage for fallback %1 and %2 prefix variables.
-    EtwInternal::Buffer<PropInfo, 16> m_propInfo; // 16 top-level properties without heap allocation
-};
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_attribs)
+    {
+        LPCWSTR const eventAttributes = EventAttributes();
+        if (eventAttributes)
+        {
+            APPEND_COMMA(output);
+            CheckWin32(m_lastError, AppendLiteral(output, LR"("attribs":)"));
+            CheckWin32(m_lastError, AppendStringAsJson(output, eventAttributes));
+        }
+    }
 
-#pragma endregion
+    // meta end
+    CheckOutOfMem(m_lastError, output.push_back(L'}'));
 
-#pragma region Private methods
+    m_lastError = ERROR_SUCCESS;
 
-LSTATUS
-EtwEnumerator::AppendResultCode(
-    EtwInternal::Buffer<wchar_t>& output,
-    _In_reads_bytes_(4) void const* pData,
-    int domain,        // EtwEnumeratorCallbacks::ResultCodeDomain
-    int type) noexcept // EtwEnumeratorCallbacks::UnderlyingType
-{
-    EtwStringBuilder outputBuilder(output);
-    return m_enumeratorCallbacks.FormatResultCodeValue(
-        static_cast<EtwEnumeratorCallbacks::ResultCodeDomain>(domain),
-        static_cast<EtwEnumeratorCallbacks::UnderlyingType>(type),
-        *static_cast<UINT32 UNALIGNED const*>(pData),
-        outputBuilder);
+Done:
+
+    return m_lastError == ERROR_SUCCESS;
 }
 
-LSTATUS
-EtwEnumerator::AppendCurrentProviderName(
-    EtwInternal::Buffer<wchar_t>& output) const noexcept
+bool
+EtwEnumerator::AddCurrentDynamicMetaAsJsonArray(
+    EtwInternal::Buffer<wchar_t>& output,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
 {
-    LSTATUS status;
+    // Same values as AddCurrentMetaAsJson, without names. Omitted values are
+    // null so that the positions match the schema's "dynamic" list.
+    auto& header = m_pEventRecord->EventHeader;
+    bool const privateSession = 0 != (header.Flags & EVENT_HEADER_FLAG_PRIVATE_SESSION);
+    bool const hasCpuTime = !privateSession && 0 == (header.Flags & EVENT_HEADER_FLAG_NO_CPUTIME);
+    bool needComma = false;
+
+    CheckOutOfMem(m_lastError, output.push_back(L'['));
+
+#define APPEND_DYNAMIC_COMMA(output) \
+        if (needComma) { CheckOutOfMem(m_lastError, output.push_back(L',')); } \
+        else { needComma = true; } \
+
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_time)
+    {
+        APPEND_DYNAMIC_COMMA(output);
+        CheckOutOfMem(m_lastError, output.push_back(L'"'));
+        CheckWin32(m_lastError, AppendFileTime(
+            output,
+            m_timestampCache,
+            header.TimeStamp.QuadPart,
+            static_cast<EtwTimestampFormat>(
+                EtwTimestampFormat_Internet | (m_timestampFormat & EtwTimestampFormat_FlagMask)),
+            m_timeZoneBiasMinutes,
+            true));
+        CheckOutOfMem(m_lastError, output.push_back(L'"'));
+    }
+
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_cpu)
+    {
+        APPEND_DYNAMIC_COMMA(output);
+        CheckWin32(m_lastError, AppendPrintf(output, L"%u",
+            GetEventProcessorIndex(m_pEventRecord)));
+    }
+
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_pid)
+    {
+        APPEND_DYNAMIC_COMMA(output);
+        CheckWin32(m_lastError, header.ProcessId != 0xffffffff
+            ? AppendPrintf(output, L"%u", header.ProcessId)
+            : AppendLiteral(output, L"null"));
+    }
+
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_tid)
+    {
+        APPEND_DYNAMIC_COMMA(output);
+        CheckWin32(m_lastError, header.ThreadId != 0xffffffff
+            ? AppendPrintf(output, L"%u", header.ThreadId)
+            : AppendLiteral(output, L"null"));
+    }
+
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_activity)
+    {
+        APPEND_DYNAMIC_COMMA(output);
+        auto& g = header.ActivityId;
+        CheckWin32(m_lastError, g != GUID()
+            ? AppendPrintf(output, L"\"" GUID_PRINTF_FORMAT_UPPER L"\"", GUID_PRINTF_VALUE(g))
+            : AppendLiteral(output, L"null"));
+    }
+
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_relatedActivity)
+    {
+        APPEND_DYNAMIC_COMMA(output);
+        bool found = false;
+        for (unsigned i = 0; i != m_pEventRecord->ExtendedDataCount; i++)
+        {
+            if (m_pEventRecord->ExtendedData[i].ExtType == EVENT_HEADER_EXT_TYPE_RELATED_ACTIVITYID &&
+                m_pEventRecord->ExtendedData[i].DataSize == 16)
+            {
+                auto& g = *reinterpret_cast<GUID const*>(
+                    static_cast<UINT_PTR>(m_pEventRecord->ExtendedData[i].DataPtr));
+                CheckWin32(m_lastError, AppendPrintf(output,
+                    L"\"" GUID_PRINTF_FORMAT_UPPER L"\"",
+                    GUID_PRINTF_VALUE(g)));
+                found = true;
+                break;
+            }
+        }
+
+        if (!found)
+        {
+            CheckWin32(m_lastError, AppendLiteral(output, L"null"));
+        }
+    }
 
-    if (m_pTraceEventInfo->ProviderNameOffset)
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_ptime)
     {
-        auto teiString = TeiStringNoCheck(m_pTraceEventInfo->ProviderNameOffset);
-        status = AppendWide(output,
-            teiString, ProviderNameLength(m_pEventRecord->EventHeader.ProviderId, teiString));
+        // ptime is only valid for private sessions where ProviderId != EventTraceGuid.
+        APPEND_DYNAMIC_COMMA(output);
+        CheckWin32(m_lastError, privateSession && header.ProviderId != EventTraceGuid
+            ? AppendPrintf(output, L"%llu", header.ProcessorTime)
+            : AppendLiteral(output, L"null"));
     }
-    else
+
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_ktime)
     {
-        status = AppendCurrentProviderNameFallback(output);;
+        APPEND_DYNAMIC_COMMA(output);
+        CheckWin32(m_lastError, hasCpuTime
+            ? AppendPrintf(output, L"%u", TicksToMilliseconds(header.KernelTime))
+            : AppendLiteral(output, L"null"));
     }
 
-    return status;
-}
+    if (jsonSuffixFlags & EtwJsonSuffixFlags_utime)
+    {
+        APPEND_DYNAMIC_COMMA(output);
+        CheckWin32(m_lastError, hasCpuTime
+            ? AppendPrintf(output, L"%u", TicksToMilliseconds(header.UserTime))
+            : AppendLiteral(output, L"null"));
+    }
 
-LSTATUS
-EtwEnumerator::AppendCurrentProviderNameFallback(
-    EtwInternal::Buffer<wchar_t>& output) const noexcept
-{
-    // No ProviderName set. Fall back to ProviderId.
-    // Note: AppendCurrentEventAsJson assumes this won't need JSON escaping.
-    return AppendPrintf(output, GUID_PRINTF_FORMAT_UPPER,
-        GUID_PRINTF_VALUE(m_pEventRecord->EventHeader.ProviderId));
+    CheckOutOfMem(m_lastError, output.push_back(L']'));
+
+    m_lastError = ERROR_SUCCESS;
+
+Done:
+
+    return m_lastError == ERROR_SUCCESS;
 }
 
-LSTATUS
-EtwEnumerator::AppendCurrentEventName(
-    EtwInternal::Buffer<wchar_t>& output) const noexcept
+bool
+EtwEnumerator::AddCurrentSchemaAsJson(
+    EtwInternal::Buffer<wchar_t>& output,
+    EtwInternal::Buffer<wchar_t>& scratchBuffer,
+    unsigned schemaId,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
 {
-    LSTATUS status;
+    struct Level
+    {
+        unsigned Begin;
+        unsigned Next;
+        unsigned End;
+    };
 
-    auto const eventName = EventName();
-    if (eventName)
+    static PCWSTR const DynamicNames[] = {
+        L"\"time\"", L"\"cpu\"", L"\"pid\"", L"\"tid\"", L"\"activity\"",
+        L"\"relatedActivity\"", L"\"ptime\"", L"\"ktime\"", L"\"utime\"" };
+    static EtwJsonSuffixFlags const DynamicFlags[] = {
+        EtwJsonSuffixFlags_time, EtwJsonSuffixFlags_cpu, EtwJsonSuffixFlags_pid,
+        EtwJsonSuffixFlags_tid, EtwJsonSuffixFlags_activity,
+        EtwJsonSuffixFlags_relatedActivity, EtwJsonSuffixFlags_ptime,
+        EtwJsonSuffixFlags_ktime, EtwJsonSuffixFlags_utime };
+
+    auto const pTei = m_pTraceEventInfo;
+    EtwInternal::Buffer<Level, 8> levels;
+    auto const dynamicFlags = jsonSuffixFlags & JsonSuffixFlags_Dynamic;
+
+    CheckWin32(m_lastError, AppendPrintf(output, LR"({"schema":%u)", schemaId));
+
+    if (jsonSuffixFlags != 0)
     {
-        status = AppendWide(output, eventName);
+        CheckOutOfMem(m_lastError, output.push_back(L','));
+        CheckAdd(AddCurrentMetaAsJson(output, scratchBuffer,
+            static_cast<EtwJsonSuffixFlags>(jsonSuffixFlags & ~JsonSuffixFlags_Dynamic)));
     }
-    else
+
+    if (dynamicFlags != 0)
     {
-        status = AppendCurrentEventNameFallback(output);
-    }
+        bool needComma = false;
+        CheckWin32(m_lastError, AppendLiteral(output, LR"(,"dynamic":[)"));
+        for (unsigned i = 0; i != _countof(DynamicFlags); i += 1)
+        {
+            if (dynamicFlags & DynamicFlags[i])
+            {
+                if (needComma)
+                {
+                    CheckOutOfMem(m_lastError, output.push_back(L','));
+                }
 
-    return status;
-}
+                CheckWin32(m_lastError, AppendWide(output, DynamicNames[i]));
+                needComma = true;
+            }
+        }
 
-LSTATUS
-EtwEnumerator::AppendCurrentEventNameFallback(
-    EtwInternal::Buffer<wchar_t>& output) const noexcept
-{
-    LSTATUS status;
+        CheckOutOfMem(m_lastError, output.push_back(L']'));
+    }
 
-    // No EventName set. Try FILE+LINE.
-    LPCWSTR const szEventAttributes = EventAttributes();
-    unsigned const cchEventAttributes = szEventAttributes
-        ? static_cast<unsigned>(wcslen(szEventAttributes))
-        : 0;
-    status = AppendEventAttribute(output,
-        szEventAttributes, cchEventAttributes, L"FILE", 4);
-    if (status == ERROR_SUCCESS)
+    CheckWin32(m_lastError, AppendLiteral(output, LR"(,"fields":[)"));
+
+    // Walk the property tree without recursion. Struct members always follow
+    // the struct, which rules out cycles.
+    CheckOutOfMem(m_lastError, levels.push_back({ 0, 0, pTei->TopLevelPropertyCount }));
+    while (levels.size() != 0)
     {
-        status = AppendEventAttribute(output,
-            szEventAttributes, cchEventAttributes, L"LINE", 4);
-        if (status == ERROR_SUCCESS)
+        auto& level = levels[levels.size() - 1];
+        if (level.Next == level.End)
+        {
+            levels.pop_back();
+            CheckWin32(m_lastError, levels.size() != 0
+                ? AppendLiteral(output, L"]}")
+                : AppendLiteral(output, L"]}\n"));
+            continue;
+        }
+
+        unsigned const propertyIndex = level.Next;
+        level.Next += 1;
+
+        if (propertyIndex >= pTei->PropertyCount)
         {
+            m_lastError = ERROR_INVALID_DATA;
             goto Done;
         }
-    }
 
-    if (status != ERROR_NOT_FOUND)
-    {
-        goto Done;
+        if (propertyIndex != level.Begin)
+        {
+            CheckOutOfMem(m_lastError, output.push_back(L','));
+        }
+
+        auto& epi = pTei->EventPropertyInfoArray[propertyIndex];
+        CheckWin32(m_lastError, AppendLiteral(output, LR"({"name":)"));
+        CheckWin32(m_lastError, AppendStringAsJson(output,
+            epi.NameOffset ? TeiStringNoCheck(epi.NameOffset) : L""));
+
+        if ((epi.Flags & (PropertyParamCount | PropertyParamFixedCount)) || epi.count != 1)
+        {
+            CheckWin32(m_lastError, AppendLiteral(output, LR"(,"array":true)"));
+        }
+
+        if (epi.Flags & PropertyStruct)
+        {
+            unsigned const structBegin = epi.structType.StructStartIndex;
+            unsigned const structEnd = structBegin + epi.structType.NumOfStructMembers;
+            if (structBegin <= propertyIndex || structEnd > pTei->PropertyCount)
+            {
+                m_lastError = ERROR_INVALID_DATA;
+                goto Done;
+            }
+
+            CheckWin32(m_lastError, AppendLiteral(output, LR"(,"fields":[)"));
+            CheckOutOfMem(m_lastError, levels.push_back({ structBegin, structBegin, structEnd }));
+        }
+        else
+        {
+            CheckWin32(m_lastError, AppendPrintf(output, LR"(,"in":%u,"out":%u})",
+                epi.nonStructType.InType,
+                epi.nonStructType.OutType));
+        }
     }
 
-    // FILE+LINE not available. Fall back to IDvVERSION.
-    status = AppendPrintf(output, L"%uv%u",
-        m_pEventRecord->EventHeader.EventDescriptor.Id,
-        m_pEventRecord->EventHeader.EventDescriptor.Version);
+    m_lastError = ERROR_SUCCESS;
 
 Done:
 
-    return status;
+    return m_lastError == ERROR_SUCCESS;
 }
 
-LSTATUS
-EtwEnumerator::AppendCurrentKeywordsName(
-    EtwInternal::Buffer<wchar_t>& output) const noexcept
+bool
+EtwEnumerator::AddCurrentEventValuesAsJsonArray(
+    EtwInternal::Buffer<wchar_t>& output,
+    EtwInternal::Buffer<wchar_t>& scratchBuffer) noexcept
 {
-    LSTATUS status;
+    ASSERT(m_state == EtwEnumeratorState_BeforeFirstItem);
 
-    status = ERROR_SUCCESS;
+    // Same as AddCurrentItemAsJsonAndMoveNext, but without names, and with
+    // structs as arrays.
+    int depth = 1;
+    bool wantComma = false;
 
-    if (m_pTraceEventInfo->KeywordsNameOffset)
+    CheckOutOfMem(m_lastError, output.push_back(L'['));
+
+    if (MoveNext())
     {
-        auto pch = TeiStringNoCheck(m_pTraceEventInfo->KeywordsNameOffset);
-        auto cch = static_cast<unsigned>(wcslen(pch));
-        while (cch != 0 && pch[cch - 1] == L' ')
+        do
         {
-            cch -= 1;
-        }
-        CheckWin32(status, AppendWide(output, pch, cch));
-    }
-    else
-    {
-        CheckWin32(status, AppendPrintf(output, L"0x%llX",
-            m_pEventRecord->EventHeader.EventDescriptor.Keyword));
+            switch (m_state)
+            {
+            case EtwEnumeratorState_Value:
+
+                if (wantComma)
+                {
+                    CheckOutOfMem(m_lastError, output.push_back(L','));
+                }
+
+                CheckAdd(AddCurrentValueAsJson(output, scratchBuffer));
+                wantComma = true;
+                break;
+
+            case EtwEnumeratorState_ArrayBegin:
+            case EtwEnumeratorState_StructBegin:
+
+                if (wantComma)
+                {
+                    CheckOutOfMem(m_lastError, output.push_back(L','));
+                }
+
+                CheckOutOfMem(m_lastError, output.push_back(L'['));
+                depth += 1;
+                wantComma = false;
+                break;
+
+            case EtwEnumeratorState_ArrayEnd:
+            case EtwEnumeratorState_StructEnd:
+
+                CheckOutOfMem(m_lastError, output.push_back(L']'));
+                depth -= 1;
+                wantComma = true;
+                break;
+
+            default:
+
+                m_lastError = ERROR_INVALID_STATE;
+                goto Done;
+            }
+        } while (MoveNext() && depth > 0);
     }
 
+    CheckAdd(m_lastError == ERROR_SUCCESS);
+    CheckOutOfMem(m_lastError, output.push_back(L']'));
+
 Done:
 
-    return status;
+    return m_lastError == ERROR_SUCCESS;
 }
 
-LSTATUS
-EtwEnumerator::AppendCurrentLevelName(
-    EtwInternal::Buffer<wchar_t>& output) const noexcept
+bool
+EtwEnumerator::AddCurrentItemAsJsonAndMoveNext(
+    EtwInternal::Buffer<wchar_t>& output,
+    EtwInternal::Buffer<wchar_t>& scratchBuffer,
+    EtwJsonItemFlags jsonItemFlags) noexcept
 {
-    LSTATUS status;
+    ASSERT(
+        m_state == EtwEnumeratorState_BeforeFirstItem ||
+        m_state == EtwEnumeratorState_Value ||
+        m_state == EtwEnumeratorState_ArrayBegin ||
+        m_state == EtwEnumeratorState_StructBegin);
 
-    if (m_pTraceEventInfo->LevelNameOffset)
+    int depth = 0;
+    bool wantComma = false;
+    bool includeName = (jsonItemFlags & EtwJsonItemFlags_Name) != 0;
+    bool const wantSpace = (jsonItemFlags & EtwJsonItemFlags_Space) != 0;
+    unsigned const cchComma = wantSpace ? 2 : 1;
+    PCWSTR const pchComma = L", ";
+
+    if (m_state == EtwEnumeratorState_BeforeFirstItem)
     {
-        auto pch = TeiStringNoCheck(m_pTraceEventInfo->LevelNameOffset);
-        auto cch = static_cast<unsigned>(wcslen(pch));
-        while (cch != 0 && pch[cch - 1] == L' ')
+        depth += 1;
+        includeName = true;
+        if (!MoveNext())
         {
-            cch -= 1;
+            goto Done;
+        }
+    }
+
+    do
+    {
+        switch (m_state)
+        {
+        case EtwEnumeratorState_Value:
+
+            if (wantComma)
+            {
+                CheckWin32(m_lastError, AppendWide(output, pchComma, cchComma));
+            }
+
+            if (!m_stackTop.IsArray && includeName)
+            {
+                CheckWin32(m_lastError, AppendCurrentNameAsJson(output, wantSpace));
+            }
+
+            CheckAdd(AddCurrentValueAsJson(output, scratchBuffer));
+            CheckAdd(FlushOutput(output));
+
+            wantComma = true;
+            break;
+
+        case EtwEnumeratorState_ArrayBegin:
+
+            if (wantComma)
+            {
+                CheckWin32(m_lastError, AppendWide(output, pchComma, cchComma));
+            }
+
+            if (includeName)
+            {
+                CheckWin32(m_lastError, AppendCurrentNameAsJson(output, wantSpace));
+            }
+
+            CheckOutOfMem(m_lastError, output.push_back(L'['));
+
+            depth += 1;
+            wantComma = false;
+            break;
+
+        case EtwEnumeratorState_ArrayEnd:
+
+            CheckOutOfMem(m_lastError, output.push_back(L']'));
+            CheckAdd(FlushOutput(output));
+
+            depth -= 1;
+            wantComma = true;
+            break;
+
+        case EtwEnumeratorState_StructBegin:
+
+            if (wantComma)
+            {
+                CheckWin32(m_lastError, AppendWide(output, pchComma, cchComma));
+            }
+
+            if (!m_stackTop.IsArray && includeName)
+            {
+                CheckWin32(m_lastError, AppendCurrentNameAsJson(output, wantSpace));
+            }
+
+            CheckOutOfMem(m_lastError, output.push_back(L'{'));
+
+            depth += 1;
+            wantComma = false;
+            break;
+
+        case EtwEnumeratorState_StructEnd:
+
+            CheckOutOfMem(m_lastError, output.push_back(L'}'));
+            CheckAdd(FlushOutput(output));
+
+            depth -= 1;
+            wantComma = true;
+            break;
+
+        default:
+
+            m_lastError = ERROR_INVALID_STATE;
+            goto Done;
         }
-        CheckWin32(status, AppendWide(output, pch, cch));
-    }
-    else
-    {
-        CheckWin32(status, AppendPrintf(output, L"%u",
-            m_pEventRecord->EventHeader.EventDescriptor.Level));
-    }
 
-    status = ERROR_SUCCESS;
+        includeName = true;
+    } while (MoveNext() && depth > 0);
 
 Done:
 
-    return status;
+    return m_lastError == ERROR_SUCCESS;
 }
 
-LSTATUS
-EtwEnumerator::AppendCurrentFunctionName(
-    EtwInternal::Buffer<wchar_t>& output) const noexcept
+bool
+EtwEnumerator::AddCurrentValueAsJson(
+    EtwInternal::Buffer<wchar_t>& output,
+    EtwInternal::Buffer<wchar_t>& scratchBuffer) noexcept
 {
-    LSTATUS status;
+    ASSERT(m_state == EtwEnumeratorState_Value);
 
-    LPCWSTR const szEventAttributes = EventAttributes();
-    unsigned const cchEventAttributes = szEventAttributes
-        ? static_cast<unsigned>(wcslen(szEventAttributes))
-        : 0;
-    status = AppendEventAttribute(output,
-        szEventAttributes, cchEventAttributes, L"FUNC", 4);
-    if (status != ERROR_NOT_FOUND)
-    {
-        goto Done;
-    }
+    auto const scratchOldSize = scratchBuffer.size();
 
-    // No FUNC attribute. If the first property of the event is a
-    // nul-terminated string named "%!FUNC!", we'll use that.
-    if (m_pTraceEventInfo->PropertyCount != 0)
+    auto const result = AddCurrentValue(scratchBuffer);
+    auto const pchValue = scratchBuffer.data() + scratchOldSize;
+    auto const cchValue = scratchBuffer.size() - scratchOldSize;
+    switch (result)
     {
-        auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[0];
-        if ((epi.Flags & 0x7f) == 0 && // Not a struct, no length, no count, nothing special.
-            epi.NameOffset != 0 && // Has a name.
-            (epi.nonStructType.InType == TDH_INTYPE_UNICODESTRING ||
-             epi.nonStructType.InType == TDH_INTYPE_ANSISTRING) &&
-            0 == wcscmp(L"!FUNC!", TeiStringNoCheck(epi.NameOffset)))
+    case ValueType_JsonCleanString:
+    {
+        ASSERT(m_lastError == ERROR_SUCCESS);
+        auto const oldSize = output.size();
+        if (!output.resize(oldSize + cchValue + 2))
         {
-            if (epi.nonStructType.InType == TDH_INTYPE_UNICODESTRING)
-            {
-                auto const pch = static_cast<wchar_t const*>(m_pEventRecord->UserData);
-                auto const cch = static_cast<unsigned>(wcsnlen(pch, m_pEventRecord->UserDataLength / sizeof(wchar_t)));
-                status = AppendWide(output, pch, cch);
-                goto Done;
-            }
-            else
-            {
-                auto const pch = static_cast<char const*>(m_pEventRecord->UserData);
-                auto const cch = static_cast<unsigned>(strnlen(pch, m_pEventRecord->UserDataLength / sizeof(char)));
-                auto const cp = epi.nonStructType.OutType == TDH_OUTTYPE_UTF8 ? CP_UTF8 : CP_ACP;
-                status = AppendMbcs(output, pch, cch, cp);
-                goto Done;
-            }
+            m_lastError = ERROR_OUTOFMEMORY;
+        }
+        else
+        {
+            auto pchDst = output.data() + oldSize;
+            *pchDst = L'"';
+            pchDst += 1;
+            memcpy(pchDst, pchValue, cchValue * 2);
+            pchDst += cchValue;
+            *pchDst = L'"';
+            m_lastError = ERROR_SUCCESS;
         }
+        break;
     }
+    case ValueType_JsonString:
 
-    // Instead of ERROR_NOT_FOUND, return ERROR_SUCCESS with "" result.
-    status = ERROR_SUCCESS;
+        ASSERT(m_lastError == ERROR_SUCCESS);
+        m_lastError = AppendStringAsJson(output, pchValue, cchValue);
+        break;
 
-Done:
+    case ValueType_JsonLiteral:
 
-    return status;
+        ASSERT(m_lastError == ERROR_SUCCESS);
+        m_lastError = AppendWide(output, pchValue, cchValue);
+        break;
+
+    default:
+
+        ASSERT(m_lastError != ERROR_SUCCESS);
+        break;
+    }
+
+    scratchBuffer.resize_unchecked(scratchOldSize);
+    return m_lastError == ERROR_SUCCESS;
 }
 
 LSTATUS
-EtwEnumerator::AppendCurrentNameAsJson(
-    EtwInternal::Buffer<wchar_t>& output,
+EtwEnumerator::AppendCurrentNameAsJsonUtf8(
+    EtwInternal::Buffer<char>& output,
     bool wantSpace) noexcept
 {
     LSTATUS status;
     auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
     LPCWSTR szName = epi.NameOffset ? TeiStringNoCheck(epi.NameOffset) : L"";
 
-    CheckWin32(status, AppendStringAsJson(output, szName));
-    CheckWin32(status, AppendWide(output, L": ", wantSpace ? 2 : 1));
+    CheckWin32(status, AppendStringAsJsonUtf8(output, szName));
+    CheckWin32(status, wantSpace
+        ? AppendLiteralUtf8(output, ": ")
+        : AppendLiteralUtf8(output, ":"));
     status = ERROR_SUCCESS;
 
 Done:
@@ -2693,295 +4841,56 @@ Done:
 }
 
 bool
-EtwEnumerator::AddCurrentEventAsJson(
-    EtwInternal::Buffer<wchar_t>& output,
-    EtwInternal::Buffer<wchar_t>& scratchBuffer,
+EtwEnumerator::AddCurrentEventAsJsonUtf8(
+    EtwInternal::Buffer<char>& output,
+    _In_opt_z_ EtwPCWSTR szPrefixFormat,
     EtwJsonSuffixFlags jsonSuffixFlags) noexcept
 {
     ASSERT(m_state == EtwEnumeratorState_BeforeFirstItem);
 
-    auto& desc = m_pEventRecord->EventHeader.EventDescriptor;
+    // The event's items are written to output directly. The prefix and the
+    // "meta" suffix come from the UTF-16 formatters: they are formatted into
+    // m_stringBuffer2 and then encoded.
+    auto& wideBuffer = m_stringBuffer2;
+    auto& scratchBuffer = m_stringBuffer;
     bool needComma = false;
 
+    wideBuffer.clear();
+    scratchBuffer.clear();
+
+    if (szPrefixFormat && szPrefixFormat[0])
+    {
+        FormatContext ctx(*this, wideBuffer, scratchBuffer);
+        CheckAdd(ctx.AddPrefix(szPrefixFormat));
+        CheckWin32(m_lastError, AppendUtf16AsUtf8(output, wideBuffer.data(), wideBuffer.size()));
+        wideBuffer.clear();
+        scratchBuffer.clear();
+    }
+
     // items start
-    CheckOutOfMem(m_lastError, output.push_back(L'{'));
+    CheckOutOfMem(m_lastError, output.push_back('{'));
 
     {
-        auto const oldOutputSize = output.size();
-        CheckAdd(AddCurrentItemAsJsonAndMoveNext(
+        // Items may have been flushed, so count them too.
+        auto const oldOutputSize = output.size() + m_cchFlushed;
+        CheckAdd(AddCurrentItemAsJsonAndMoveNextUtf8(
             output, scratchBuffer, EtwJsonItemFlags_Name));
-        needComma = oldOutputSize != output.size();
+        needComma = oldOutputSize != output.size() + m_cchFlushed;
     }
 
     if (jsonSuffixFlags != 0)
     {
-        if (needComma)
-        {
-            CheckOutOfMem(m_lastError, output.push_back(L','));
-        }
-
-        // meta start
-        CheckWin32(m_lastError, AppendLiteral(output, LR"("meta":{)"));
-        needComma = false;
-
-#define APPEND_COMMA(output) \
-            if (needComma) { CheckOutOfMem(m_lastError, output.push_back(L',')); } \
-            else { needComma = true; } \
-
-        if (jsonSuffixFlags & EtwJsonSuffixFlags_provider)
-        {
-            APPEND_COMMA(output);
-            CheckWin32(m_lastError, AppendLiteral(output, LR"("provider":)"));
-            if (m_pTraceEventInfo->ProviderNameOffset)
-            {
-                CheckWin32(m_lastError, AppendStringAsJson(output,
-                    TeiStringNoCheck(m_pTraceEventInfo->ProviderNameOffset)));
-            }
-            else
-            {
-                CheckOutOfMem(m_lastError, output.push_back(L'"'));
-                CheckWin32(m_lastError, AppendCurrentProviderNameFallback(output));
-                CheckOutOfMem(m_lastError, output.push_back(L'"'));
-            }
-        }
-
-        if (jsonSuffixFlags & EtwJsonSuffixFlags_event)
-        {
-            APPEND_COMMA(output);
-            CheckWin32(m_lastError, AppendLiteral(output, LR"("event":)"));
-            LPCWSTR const eventName = EventName();
-            if (eventName)
-            {
-                CheckWin32(m_lastError, AppendStringAsJson(output, eventName));
-            }
-            else
-            {
-                // No EventName set. Use fallback.
-                unsigned const oldSize = scratchBuffer.size();
-                CheckWin32(m_lastError, AppendCurrentEventNameFallback(scratchBuffer));
-                CheckWin32(m_lastError, AppendStringAsJson(output,
-                    scratchBuffer.data() + oldSize,
-                    scratchBuffer.size() - oldSize));
-                scratchBuffer.resize_unchecked(oldSize);
-            }
-        }
-
-        if (jsonSuffixFlags & EtwJsonSuffixFlags_time)
-        {
-            APPEND_COMMA(output);
-            CheckWin32(m_lastError, AppendLiteral(output, LR"("time":")"));
-            CheckWin32(m_lastError, AppendFileTime(
-                output,
-                m_pEventRecord->EventHeader.TimeStamp.QuadPart,
-                static_cast<EtwTimestampFormat>(
-                    EtwTimestampFormat_Internet | (m_timestampFormat & EtwTimestampFormat_FlagMask)),
-                m_timeZoneBiasMinutes,
-                true));
-            CheckOutOfMem(m_lastError, output.push_back(L'"'));
-        }
-
-        if (jsonSuffixFlags & EtwJsonSuffixFlags_cpu)
-        {
-            APPEND_COMMA(output);
-            CheckWin32(m_lastError, AppendPrintf(output, LR"("cpu":%u)",
-                GetEventProcessorIndex(m_pEventRecord)));
-        }
-
-        if ((jsonSuffixFlags & EtwJsonSuffixFlags_pid) &&
-            m_pEventRecord->EventHeader.ProcessId != 0xffffffff)
-        {
-            APPEND_COMMA(output);
-            CheckWin32(m_lastError, AppendPrintf(output, LR"("pid":%u)",
-                m_pEventRecord->EventHeader.ProcessId));
-        }
-
-        if ((jsonSuffixFlags & EtwJsonSuffixFlags_tid) &&
-            m_pEventRecord->EventHeader.ThreadId != 0xffffffff)
-        {
-            APPEND_COMMA(output);
-            CheckWin32(m_lastError, AppendPrintf(output, LR"("tid":%u)",
-                m_pEventRecord->EventHeader.ThreadId));
-        }
-
-        if (jsonSuffixFlags & EtwJsonSuffixFlags_id)
-        {
-            APPEND_COMMA(output);
-            CheckWin32(m_lastError, AppendPrintf(output, LR"("id":%u)",
-                desc.Id));
-        }
-
-        if ((jsonSuffixFlags & EtwJsonSuffixFlags_version) &&
-            desc.Version != 0)
-        {
-            APPEND_COMMA(output);
-            CheckWin32(m_lastError, AppendPrintf(output, LR"("version":%u)",
-                desc.Version));
-        }
-
-        if ((jsonSuffixFlags & EtwJsonSuffixFlags_channel) &&
-            desc.Channel != 0)
-        {
-            APPEND_COMMA(output);
-            CheckWin32(m_lastError, AppendLiteral(output, LR"("channel":)"));
-            if (m_pTraceEventInfo->ChannelNameOffset != 0)
-            {
-                CheckWin32(m_lastError, AppendStringAsJson(output,
-                    TeiStringNoCheck(m_pTraceEventInfo->ChannelNameOffset)));
-            }
-            else
-            {
-                CheckWin32(m_lastError, AppendPrintf(output, L"%u", desc.Channel));
-            }
-        }
-
-        if ((jsonSuffixFlags & EtwJsonSuffixFlags_level) &&
-            desc.Level != 0)
-        {
-            APPEND_COMMA(output);
-            CheckWin32(m_lastError, AppendLiteral(output, LR"("level":)"));
-            if (m_pTraceEventInfo->LevelNameOffset != 0)
-            {
-                CheckWin32(m_lastError, AppendStringAsJson(output,
-                    TeiStringNoCheck(m_pTraceEventInfo->LevelNameOffset)));
-            }
-            else
-            {
-                CheckWin32(m_lastError, AppendPrintf(output, L"%u", desc.Level));
-            }
-        }
-
-        if ((jsonSuffixFlags & EtwJsonSuffixFlags_opcode) &&
-            desc.Opcode != 0 &&
-            // Note: for Wbem, opcode is the event name, so don't show an opcode property.
-            m_pTraceEventInfo->DecodingSource != DecodingSourceWbem)
-        {
-            APPEND_COMMA(output);
-            CheckWin32(m_lastError, AppendLiteral(output, LR"("opcode":)"));
-            auto const opcodeName = OpcodeName();
-            if (opcodeName)
-            {
-                CheckWin32(m_lastError, AppendStringAsJson(output, opcodeName));
-            }
-            else
-            {
-                CheckWin32(m_lastError, AppendPrintf(output, L"%u", desc.Opcode));
-            }
-        }
-
-        if ((jsonSuffixFlags & EtwJsonSuffixFlags_task) &&
-            // Note: for Wbem, we show task name even if task is 0.
-            (desc.Task != 0 || m_pTraceEventInfo->DecodingSource == DecodingSourceWbem))
-        {
-            APPEND_COMMA(output);
-            CheckWin32(m_lastError, AppendLiteral(output, LR"("task":)"));
-            auto const taskName = TaskName();
-            if (taskName)
-            {
-                CheckWin32(m_lastError, AppendStringAsJson(output, taskName));
-            }
-            else
-            {
-                CheckWin32(m_lastError, AppendPrintf(output, L"%u", desc.Task));
-            }
-        }
-
-        if ((jsonSuffixFlags & EtwJsonSuffixFlags_keywords) &&
-            desc.Keyword != 0)
-        {
-            APPEND_COMMA(output);
-            CheckWin32(m_lastError, AppendLiteral(output, LR"("keywords":)"));
-            if (m_pTraceEventInfo->KeywordsNameOffset != 0)
-            {
-                CheckWin32(m_lastError, AppendStringAsJson(output,
-                    TeiStringNoCheck(m_pTraceEventInfo->KeywordsNameOffset)));
-            }
-            else
-            {
-                CheckWin32(m_lastError, AppendPrintf(output, LR"("0x%llX")", desc.Keyword));
-            }
-        }
-
-        if ((jsonSuffixFlags & EtwJsonSuffixFlags_tags) &&
-            m_pTraceEventInfo->Tags != 0)
-        {
-            APPEND_COMMA(output);
-            CheckWin32(m_lastError, AppendPrintf(output, LR"("tags":"0x%X")",
-                m_pTraceEventInfo->Tags));
-        }
-
-        if ((jsonSuffixFlags & EtwJsonSuffixFlags_activity) &&
-            m_pEventRecord->EventHeader.ActivityId != GUID())
-        {
-            APPEND_COMMA(output);
-            auto& g = m_pEventRecord->EventHeader.ActivityId;
-            CheckWin32(m_lastError, AppendPrintf(output,
-                LR"("activity":")" GUID_PRINTF_FORMAT_UPPER L"\"",
-                GUID_PRINTF_VALUE(g)));
-        }
-
-        if (jsonSuffixFlags & EtwJsonSuffixFlags_relatedActivity)
-        {
-            for (unsigned i = 0; i != m_pEventRecord->ExtendedDataCount; i++)
-            {
-                if (m_pEventRecord->ExtendedData[i].ExtType == EVENT_HEADER_EXT_TYPE_RELATED_ACTIVITYID &&
-                    m_pEventRecord->ExtendedData[i].DataSize == 16)
-                {
-                    APPEND_COMMA(output);
-                    auto& g = *reinterpret_cast<GUID const*>(
-                        static_cast<UINT_PTR>(m_pEventRecord->ExtendedData[i].DataPtr));
-                    CheckWin32(m_lastError, AppendPrintf(output,
-                        LR"("relatedActivity":")" GUID_PRINTF_FORMAT_UPPER L"\"",
-                        GUID_PRINTF_VALUE(g)));
-                    break;
-                }
-            }
-        }
-
-        if (0 != (m_pEventRecord->EventHeader.Flags & EVENT_HEADER_FLAG_PRIVATE_SESSION))
-        {
-            // ptime is only valid for private sessions where ProviderId != EventTraceGuid.
-            if ((jsonSuffixFlags & EtwJsonSuffixFlags_ptime) &&
-                m_pEventRecord->EventHeader.ProviderId != EventTraceGuid)
-            {
-                APPEND_COMMA(output);
-                CheckWin32(m_lastError, AppendPrintf(output, LR"("ptime":%llu)",
-                    m_pEventRecord->EventHeader.ProcessorTime));
-            }
-        }
-        else if (0 == (m_pEventRecord->EventHeader.Flags & EVENT_HEADER_FLAG_NO_CPUTIME))
-        {
-            if (jsonSuffixFlags & EtwJsonSuffixFlags_ktime)
-            {
-                APPEND_COMMA(output);
-                CheckWin32(m_lastError, AppendPrintf(output, LR"("ktime":%u)",
-                    TicksToMilliseconds(m_pEventRecord->EventHeader.KernelTime)));
-            }
-
-            if (jsonSuffixFlags & EtwJsonSuffixFlags_utime)
-            {
-                APPEND_COMMA(output);
-                CheckWin32(m_lastError, AppendPrintf(output, LR"("utime":%u)",
-                    TicksToMilliseconds(m_pEventRecord->EventHeader.UserTime)));
-            }
-        }
-
-        if (jsonSuffixFlags & EtwJsonSuffixFlags_attribs)
-        {
-            LPCWSTR const eventAttributes = EventAttributes();
-            if (eventAttributes)
-            {
-                APPEND_COMMA(output);
-                CheckWin32(m_lastError, AppendLiteral(output, LR"("attribs":)"));
-                CheckWin32(m_lastError, AppendStringAsJson(output, eventAttributes));
-            }
+        if (needComma)
+        {
+            CheckOutOfMem(m_lastError, output.push_back(','));
         }
 
-        // meta end
-        CheckOutOfMem(m_lastError, output.push_back(L'}'));
+        CheckAdd(AddCurrentMetaAsJson(wideBuffer, scratchBuffer, jsonSuffixFlags));
+        CheckWin32(m_lastError, AppendUtf16AsUtf8(output, wideBuffer.data(), wideBuffer.size()));
     }
 
     // items end
-    CheckOutOfMem(m_lastError, output.push_back(L'}'));
+    CheckOutOfMem(m_lastError, output.push_back('}'));
 
     m_lastError = ERROR_SUCCESS;
 
@@ -2991,8 +4900,8 @@ Done:
 }
 
 bool
-EtwEnumerator::AddCurrentItemAsJsonAndMoveNext(
-    EtwInternal::Buffer<wchar_t>& output,
+EtwEnumerator::AddCurrentItemAsJsonAndMoveNextUtf8(
+    EtwInternal::Buffer<char>& output,
     EtwInternal::Buffer<wchar_t>& scratchBuffer,
     EtwJsonItemFlags jsonItemFlags) noexcept
 {
@@ -3002,12 +4911,11 @@ EtwEnumerator::AddCurrentItemAsJsonAndMoveNext(
         m_state == EtwEnumeratorState_ArrayBegin ||
         m_state == EtwEnumeratorState_StructBegin);
 
+    // Same as AddCurrentItemAsJsonAndMoveNext, but writes UTF-8.
     int depth = 0;
     bool wantComma = false;
     bool includeName = (jsonItemFlags & EtwJsonItemFlags_Name) != 0;
     bool const wantSpace = (jsonItemFlags & EtwJsonItemFlags_Space) != 0;
-    unsigned const cchComma = wantSpace ? 2 : 1;
-    PCWSTR const pchComma = L", ";
 
     if (m_state == EtwEnumeratorState_BeforeFirstItem)
     {
@@ -3021,38 +4929,39 @@ EtwEnumerator::AddCurrentItemAsJsonAndMoveNext(
 
     do
     {
+        if (wantComma &&
+            (m_state == EtwEnumeratorState_Value ||
+                m_state == EtwEnumeratorState_ArrayBegin ||
+                m_state == EtwEnumeratorState_StructBegin))
+        {
+            CheckWin32(m_lastError, wantSpace
+                ? AppendLiteralUtf8(output, ", ")
+                : AppendLiteralUtf8(output, ","));
+        }
+
         switch (m_state)
         {
         case EtwEnumeratorState_Value:
 
-            if (wantComma)
-            {
-                CheckWin32(m_lastError, AppendWide(output, pchComma, cchComma));
-            }
-
             if (!m_stackTop.IsArray && includeName)
             {
-                CheckWin32(m_lastError, AppendCurrentNameAsJson(output, wantSpace));
+                CheckWin32(m_lastError, AppendCurrentNameAsJsonUtf8(output, wantSpace));
             }
 
-            CheckAdd(AddCurrentValueAsJson(output, scratchBuffer));
+            CheckAdd(AddCurrentValueAsJsonUtf8(output, scratchBuffer));
+            CheckAdd(FlushOutput(output));
 
             wantComma = true;
             break;
 
         case EtwEnumeratorState_ArrayBegin:
 
-            if (wantComma)
-            {
-                CheckWin32(m_lastError, AppendWide(output, pchComma, cchComma));
-            }
-
             if (includeName)
             {
-                CheckWin32(m_lastError, AppendCurrentNameAsJson(output, wantSpace));
+                CheckWin32(m_lastError, AppendCurrentNameAsJsonUtf8(output, wantSpace));
             }
 
-            CheckOutOfMem(m_lastError, output.push_back(L'['));
+            CheckOutOfMem(m_lastError, output.push_back('['));
 
             depth += 1;
             wantComma = false;
@@ -3060,7 +4969,8 @@ EtwEnumerator::AddCurrentItemAsJsonAndMoveNext(
 
         case EtwEnumeratorState_ArrayEnd:
 
-            CheckOutOfMem(m_lastError, output.push_back(L']'));
+            CheckOutOfMem(m_lastError, output.push_back(']'));
+            CheckAdd(FlushOutput(output));
 
             depth -= 1;
             wantComma = true;
@@ -3068,17 +4978,12 @@ EtwEnumerator::AddCurrentItemAsJsonAndMoveNext(
 
         case EtwEnumeratorState_StructBegin:
 
-            if (wantComma)
-            {
-                CheckWin32(m_lastError, AppendWide(output, pchComma, cchComma));
-            }
-
             if (!m_stackTop.IsArray && includeName)
             {
-                CheckWin32(m_lastError, AppendCurrentNameAsJson(output, wantSpace));
+                CheckWin32(m_lastError, AppendCurrentNameAsJsonUtf8(output, wantSpace));
             }
 
-            CheckOutOfMem(m_lastError, output.push_back(L'{'));
+            CheckOutOfMem(m_lastError, output.push_back('{'));
 
             depth += 1;
             wantComma = false;
@@ -3086,7 +4991,8 @@ EtwEnumerator::AddCurrentItemAsJsonAndMoveNext(
 
         case EtwEnumeratorState_StructEnd:
 
-            CheckOutOfMem(m_lastError, output.push_back(L'}'));
+            CheckOutOfMem(m_lastError, output.push_back('}'));
+            CheckAdd(FlushOutput(output));
 
             depth -= 1;
             wantComma = true;
@@ -3107,58 +5013,71 @@ Done:
 }
 
 bool
-EtwEnumerator::AddCurrentValueAsJson(
-    EtwInternal::Buffer<wchar_t>& output,
+EtwEnumerator::AddCurrentValueAsJsonUtf8(
+    EtwInternal::Buffer<char>& output,
     EtwInternal::Buffer<wchar_t>& scratchBuffer) noexcept
 {
     ASSERT(m_state == EtwEnumeratorState_Value);
 
-    auto const scratchOldSize = scratchBuffer.size();
-
-    auto const result = AddCurrentValue(scratchBuffer);
-    auto const pchValue = scratchBuffer.data() + scratchOldSize;
-    auto const cchValue = scratchBuffer.size() - scratchOldSize;
-    switch (result)
+    auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
+    if (IsUtf16StringValue(epi, m_cookedInType) &&
+        WSTR_ALIGNED(m_pbCooked))
     {
-    case ValueType_JsonCleanString:
+        // UTF-16 payload string: escape and encode directly from the event.
+        m_lastError = AppendStringAsJsonUtf8(
+            output, reinterpret_cast<wchar_t const*>(m_pbCooked), m_cbCooked / 2);
+    }
+    else if (IsUtf8StringValue(epi, m_cookedInType) &&
+        IsValidUtf8(m_pbCooked, m_cbCooked))
     {
-        ASSERT(m_lastError == ERROR_SUCCESS);
-        auto const oldSize = output.size();
-        if (!output.resize(oldSize + cchValue + 2))
-        {
-            m_lastError = ERROR_OUTOFMEMORY;
-        }
-        else
-        {
-            auto pchDst = output.data() + oldSize;
-            *pchDst = L'"';
-            pchDst += 1;
-            memcpy(pchDst, pchValue, cchValue * 2);
-            pchDst += cchValue;
-            *pchDst = L'"';
-            m_lastError = ERROR_SUCCESS;
-        }
-        break;
+        // UTF-8 payload string: escape directly from the event.
+        m_lastError = AppendUtf8AsJson(output, m_pbCooked, m_cbCooked);
     }
-    case ValueType_JsonString:
+    else
+    {
+        // Other values are short. Format as UTF-16, then encode.
+        auto const scratchOldSize = scratchBuffer.size();
 
-        ASSERT(m_lastError == ERROR_SUCCESS);
-        m_lastError = AppendStringAsJson(output, pchValue, cchValue);
-        break;
+        auto const result = AddCurrentValue(scratchBuffer);
+        auto const pchValue = scratchBuffer.data() + scratchOldSize;
+        auto const cchValue = scratchBuffer.size() - scratchOldSize;
+        switch (result)
+        {
+        case ValueType_JsonCleanString:
 
-    case ValueType_JsonLiteral:
+            ASSERT(m_lastError == ERROR_SUCCESS);
+            if (!output.push_back('"'))
+            {
+                m_lastError = ERROR_OUTOFMEMORY;
+            }
+            else if (ERROR_SUCCESS == (m_lastError = AppendUtf16AsUtf8(output, pchValue, cchValue)) &&
+                !output.push_back('"'))
+            {
+                m_lastError = ERROR_OUTOFMEMORY;
+            }
+            break;
 
-        ASSERT(m_lastError == ERROR_SUCCESS);
-        m_lastError = AppendWide(output, pchValue, cchValue);
-        break;
+        case ValueType_JsonString:
 
-    default:
+            ASSERT(m_lastError == ERROR_SUCCESS);
+            m_lastError = AppendStringAsJsonUtf8(output, pchValue, cchValue);
+            break;
 
-        ASSERT(m_lastError != ERROR_SUCCESS);
-        break;
+        case ValueType_JsonLiteral:
+
+            ASSERT(m_lastError == ERROR_SUCCESS);
+            m_lastError = AppendUtf16AsUtf8(output, pchValue, cchValue);
+            break;
+
+        default:
+
+            ASSERT(m_lastError != ERROR_SUCCESS);
+            break;
+        }
+
+        scratchBuffer.resize_unchecked(scratchOldSize);
     }
 
-    scratchBuffer.resize_unchecked(scratchOldSize);
     return m_lastError == ERROR_SUCCESS;
 }
 
@@ -3214,6 +5133,34 @@ EtwEnumerator::AddValueWithMapName(
 
     if (pMapName != nullptr)
     {
+        EtwInternal::MapCache::Key mapKey;
+        EVENT_MAP_INFO const* pCachedMapInfo;
+        EtwInternal::MapIndex const* pMapIndex;
+        bool const useCache = m_mapCache.Capacity() != 0;
+
+        if (useCache)
+        {
+            EtwInternal::MapCache::MakeKey(pEventRecord, pMapName, &mapKey);
+            if (m_mapCache.Find(mapKey, &pCachedMapInfo, &pMapIndex))
+            {
+                if (pCachedMapInfo == nullptr)
+                {
+                    // Cached ERROR_NOT_FOUND.
+                    goto NoMapInfo;
+                }
+
+                result = AddValueWithMapInfo(
+                    output,
+                    pData,
+                    cbData,
+                    inType,
+                    outType,
+                    pCachedMapInfo,
+                    pMapIndex);
+                goto Done;
+            }
+        }
+
         for (;;)
         {
             ULONG cbMapInfo = m_mapBuffer.capacity();
@@ -3226,18 +5173,38 @@ EtwEnumerator::AddValueWithMapName(
                 &cbMapInfo);
             if (m_lastError == ERROR_SUCCESS)
             {
-                // Found map information. Use it to format value.
+                // Found map information. Cache it and use it to format value.
+                if (useCache &&
+                    m_mapCache.Insert(
+                        mapKey,
+                        pMapInfo,
+                        cbMapInfo < m_mapBuffer.capacity() ? cbMapInfo : m_mapBuffer.capacity(),
+                        &pCachedMapInfo,
+                        &pMapIndex))
+                {
+                    pMapInfo = const_cast<EVENT_MAP_INFO*>(pCachedMapInfo);
+                }
+                else
+                {
+                    pMapIndex = nullptr;
+                }
+
                 result = AddValueWithMapInfo(
                     output,
                     pData,
                     cbData,
                     inType,
                     outType,
-                    pMapInfo);
+                    pMapInfo,
+                    pMapIndex);
                 goto Done;
             }
             else if (m_lastError == ERROR_NOT_FOUND)
             {
+                if (useCache)
+                {
+                    m_mapCache.Insert(mapKey, nullptr, 0, &pCachedMapInfo, &pMapIndex);
+                }
                 break;
             }
             else if (
@@ -3259,6 +5226,8 @@ EtwEnumerator::AddValueWithMapName(
         }
     }
 
+NoMapInfo:
+
     // Did not find map information. Format without it.
     result = AddValue(output, pData, cbData, inType, outType);
 
@@ -3274,7 +5243,8 @@ EtwEnumerator::AddValueWithMapInfo(
     unsigned cbData,
     _TDH_IN_TYPE inType,
     _TDH_OUT_TYPE outType,
-    _In_opt_ EVENT_MAP_INFO const* pMapInfo) noexcept
+    _In_opt_ EVENT_MAP_INFO const* pMapInfo,
+    _In_opt_ EtwInternal::MapIndex const* pMapIndex) noexcept
 {
     UINT32 value;
     EtwEnumeratorCallbacks::UnderlyingType valueType;
@@ -3334,7 +5304,9 @@ EtwEnumerator::AddValueWithMapInfo(
 
     {
         EtwStringBuilder outputBuilder(output);
-        m_lastError = m_enumeratorCallbacks.FormatMapValue(pMapInfo, valueType, value, outputBuilder);
+        m_lastError = pMapIndex != nullptr
+            ? m_enumeratorCallbacks.FormatIndexedMapValue(pMapInfo, *pMapIndex, valueType, value, outputBuilder)
+            : m_enumeratorCallbacks.FormatMapValue(pMapInfo, valueType, value, outputBuilder);
     }
 
     ValueType result;
@@ -3425,7 +5397,7 @@ EtwEnumerator::AddValue(
         else switch (outType)
         {
         default:
-            m_lastError = AppendPrintf(output, L"%d", *static_cast<INT8 const*>(pData));
+            m_lastError = AppendSigned(output, *static_cast<INT8 const*>(pData));
             type = ValueType_JsonLiteral;
             break;
         case TDH_OUTTYPE_STRING:
@@ -3444,11 +5416,11 @@ EtwEnumerator::AddValue(
         else switch (outType)
         {
         default:
-            m_lastError = AppendPrintf(output, L"%u", *static_cast<UINT8 const*>(pData));
+            m_lastError = AppendUnsigned(output, *static_cast<UINT8 const*>(pData));
             type = ValueType_JsonLiteral;
             break;
         case TDH_OUTTYPE_HEXINT8:
-            m_lastError = AppendPrintf(output, L"0x%X", *static_cast<UINT8 const*>(pData));
+            m_lastError = AppendHex(output, *static_cast<UINT8 const*>(pData));
             type = ValueType_JsonCleanString;
             break;
         case TDH_OUTTYPE_STRING:
@@ -3466,7 +5438,7 @@ EtwEnumerator::AddValue(
         }
         else
         {
-            m_lastError = AppendPrintf(output, L"%d", *static_cast<INT16 const UNALIGNED*>(pData));
+            m_lastError = AppendSigned(output, *static_cast<INT16 const UNALIGNED*>(pData));
             type = ValueType_JsonLiteral;
         }
         break;
@@ -3480,15 +5452,15 @@ EtwEnumerator::AddValue(
         else switch (outType)
         {
         default:
-            m_lastError = AppendPrintf(output, L"%u", *static_cast<UINT16 const UNALIGNED*>(pData));
+            m_lastError = AppendUnsigned(output, *static_cast<UINT16 const UNALIGNED*>(pData));
             type = ValueType_JsonLiteral;
             break;
         case TDH_OUTTYPE_HEXINT16:
-            m_lastError = AppendPrintf(output, L"0x%X", *static_cast<UINT16 const UNALIGNED*>(pData));
+            m_lastError = AppendHex(output, *static_cast<UINT16 const UNALIGNED*>(pData));
             type = ValueType_JsonCleanString;
             break;
         case TDH_OUTTYPE_PORT:
-            m_lastError = AppendPrintf(output, L"%u",
+            m_lastError = AppendUnsigned(output,
                 _byteswap_ushort(*static_cast<UINT16 const UNALIGNED*>(pData)));
             type = ValueType_JsonLiteral;
             break;
@@ -3509,7 +5481,7 @@ EtwEnumerator::AddValue(
         {
         default:
         DefaultINT32:
-            m_lastError = AppendPrintf(output, L"%d", *static_cast<INT32 const UNALIGNED*>(pData));
+            m_lastError = AppendSigned(output, *static_cast<INT32 const UNALIGNED*>(pData));
             type = ValueType_JsonLiteral;
             break;
 
@@ -3540,7 +5512,7 @@ EtwEnumerator::AddValue(
         case TDH_OUTTYPE_ETWTIME:
         case TDH_OUTTYPE_PID:
         case TDH_OUTTYPE_TID:
-            m_lastError = AppendPrintf(output, L"%u", *static_cast<UINT32 const UNALIGNED*>(pData));
+            m_lastError = AppendUnsigned(output, *static_cast<UINT32 const UNALIGNED*>(pData));
             type = ValueType_JsonLiteral;
             break;
         case TDH_OUTTYPE_WIN32ERROR:
@@ -3568,7 +5540,7 @@ EtwEnumerator::AddValue(
         case TDH_OUTTYPE_HEXINT32:
         case TDH_OUTTYPE_ERRORCODE:
         case TDH_OutTypeCodePointer:
-            m_lastError = AppendPrintf(output, L"0x%X", *static_cast<UINT32 const UNALIGNED*>(pData));
+            m_lastError = AppendHex(output, *static_cast<UINT32 const UNALIGNED*>(pData));
             type = ValueType_JsonCleanString;
             break;
         case TDH_OUTTYPE_IPV4:
@@ -3579,7 +5551,6 @@ EtwEnumerator::AddValue(
         break;
 
     case TDH_INTYPE_HEXINT32:
-    DefaultHEXINT32:
         if (cbData != 4)
         {
             m_lastError = ERROR_INVALID_PARAMETER;
@@ -3588,7 +5559,8 @@ EtwEnumerator::AddValue(
         else switch (outType)
         {
         default:
-            m_lastError = AppendPrintf(output, L"0x%X", *static_cast<UINT32 const UNALIGNED*>(pData));
+        DefaultHEXINT32:
+            m_lastError = AppendHex(output, *static_cast<UINT32 const UNALIGNED*>(pData));
             type = ValueType_JsonCleanString;
             break;
         case TDH_OUTTYPE_WIN32ERROR:
@@ -3624,7 +5596,7 @@ EtwEnumerator::AddValue(
         }
         else
         {
-            m_lastError = AppendPrintf(output, L"%lld", *static_cast<INT64 const UNALIGNED*>(pData));
+            m_lastError = AppendSigned(output, *static_cast<INT64 const UNALIGNED*>(pData));
             type = ValueType_JsonLiteral;
             break;
         }
@@ -3640,12 +5612,12 @@ EtwEnumerator::AddValue(
         {
         default:
         case TDH_OUTTYPE_ETWTIME:
-            m_lastError = AppendPrintf(output, L"%llu", *static_cast<UINT64 const UNALIGNED*>(pData));
+            m_lastError = AppendUnsigned(output, *static_cast<UINT64 const UNALIGNED*>(pData));
             type = ValueType_JsonLiteral;
             break;
         case TDH_OUTTYPE_HEXINT64:
         case TDH_OutTypeCodePointer:
-            m_lastError = AppendPrintf(output, L"0x%llX", *static_cast<UINT64 const UNALIGNED*>(pData));
+            m_lastError = AppendHex(output, *static_cast<UINT64 const UNALIGNED*>(pData));
             type = ValueType_JsonCleanString;
             break;
         }
@@ -3659,7 +5631,7 @@ EtwEnumerator::AddValue(
         }
         else
         {
-            m_lastError = AppendPrintf(output, L"0x%llX", *static_cast<UINT64 const UNALIGNED*>(pData));
+            m_lastError = AppendHex(output, *static_cast<UINT64 const UNALIGNED*>(pData));
             type = ValueType_JsonCleanString;
         }
         break;
@@ -3673,10 +5645,19 @@ EtwEnumerator::AddValue(
         else
         {
             auto const MantissaMask = 0x7f800000u; // 8 bits of exponent
-            m_lastError = AppendPrintf(output, L"%g", *static_cast<float const UNALIGNED*>(pData));
-            type = MantissaMask == (*static_cast<UINT32 UNALIGNED const*>(pData) & MantissaMask)
-                ? ValueType_JsonCleanString // Infinity or NaN
-                : ValueType_JsonLiteral;
+            auto const value = *static_cast<float const UNALIGNED*>(pData);
+            if (MantissaMask == (*static_cast<UINT32 UNALIGNED const*>(pData) & MantissaMask))
+            {
+                m_lastError = AppendPrintf(output, L"%g", value);
+                type = ValueType_JsonCleanString; // Infinity or NaN
+            }
+            else
+            {
+                m_lastError = m_floatFormat == EtwFloatFormat_RoundTrip
+                    ? AppendRoundTrip(output, value)
+                    : AppendPrintf(output, L"%g", value);
+                type = ValueType_JsonLiteral;
+            }
         }
         break;
 
@@ -3689,10 +5670,19 @@ EtwEnumerator::AddValue(
         else
         {
             auto const MantissaMask = 0x7ff0000000000000u; // 11 bits of exponent
-            m_lastError = AppendPrintf(output, L"%g", *static_cast<double const UNALIGNED*>(pData));
-            type = MantissaMask == (*static_cast<UINT64 UNALIGNED const*>(pData) & MantissaMask)
-                ? ValueType_JsonCleanString // Infinity or NaN
-                : ValueType_JsonLiteral;
+            auto const value = *static_cast<double const UNALIGNED*>(pData);
+            if (MantissaMask == (*static_cast<UINT64 UNALIGNED const*>(pData) & MantissaMask))
+            {
+                m_lastError = AppendPrintf(output, L"%g", value);
+                type = ValueType_JsonCleanString; // Infinity or NaN
+            }
+            else
+            {
+                m_lastError = m_floatFormat == EtwFloatFormat_RoundTrip
+                    ? AppendRoundTrip(output, value)
+                    : AppendPrintf(output, L"%g", value);
+                type = ValueType_JsonLiteral;
+            }
         }
         break;
 
@@ -3717,15 +5707,15 @@ EtwEnumerator::AddValue(
             {
             default:
             case TDH_OutTypeCodePointer:
-                m_lastError = AppendPrintf(output, L"0x%llX", *static_cast<UINT64 const UNALIGNED*>(pData));
+                m_lastError = AppendHex(output, *static_cast<UINT64 const UNALIGNED*>(pData));
                 type = ValueType_JsonCleanString;
                 break;
             case TDH_OUTTYPE_LONG:
-                m_lastError = AppendPrintf(output, L"%lld", *static_cast<UINT64 const UNALIGNED*>(pData));
+                m_lastError = AppendSigned(output, *static_cast<INT64 const UNALIGNED*>(pData));
                 type = ValueType_JsonLiteral;
                 break;
             case TDH_OUTTYPE_UNSIGNEDLONG:
-                m_lastError = AppendPrintf(output, L"%llu", *static_cast<UINT64 const UNALIGNED*>(pData));
+                m_lastError = AppendUnsigned(output, *static_cast<UINT64 const UNALIGNED*>(pData));
                 type = ValueType_JsonLiteral;
                 break;
             }
@@ -3736,15 +5726,15 @@ EtwEnumerator::AddValue(
             {
             default:
             case TDH_OutTypeCodePointer:
-                m_lastError = AppendPrintf(output, L"0x%X", *static_cast<UINT32 const UNALIGNED*>(pData));
+                m_lastError = AppendHex(output, *static_cast<UINT32 const UNALIGNED*>(pData));
                 type = ValueType_JsonCleanString;
                 break;
             case TDH_OUTTYPE_LONG:
-                m_lastError = AppendPrintf(output, L"%d", *static_cast<UINT32 const UNALIGNED*>(pData));
+                m_lastError = AppendSigned(output, *static_cast<INT32 const UNALIGNED*>(pData));
                 type = ValueType_JsonLiteral;
                 break;
             case TDH_OUTTYPE_UNSIGNEDLONG:
-                m_lastError = AppendPrintf(output, L"%u", *static_cast<UINT32 const UNALIGNED*>(pData));
+                m_lastError = AppendUnsigned(output, *static_cast<UINT32 const UNALIGNED*>(pData));
                 type = ValueType_JsonLiteral;
                 break;
             }
@@ -3811,7 +5801,7 @@ EtwEnumerator::AddValue(
         {
             bool const timeIsUtc = outType == TDH_OutTypeDateTimeUtc ||
                 0 != (m_timestampFormat & EtwTimestampFormat_AssumeFileTimeUTC);
-            m_lastError = AppendFileTime(output, *static_cast<UINT64 const UNALIGNED*>(pData),
+            m_lastError = AppendFileTime(output, m_timestampCache, *static_cast<UINT64 const UNALIGNED*>(pData),
                 m_timestampFormat, m_timeZoneBiasMinutes, timeIsUtc);
             type = ValueType_JsonCleanString;
         }
@@ -3878,6 +5868,224 @@ EtwEnumerator::AddValue(
         : ValueType_None;
 }
 
+bool
+EtwEnumerator::StringViewResult(
+    Buffer const& output,
+    _Out_ EtwStringViewUtf8* pString) noexcept
+{
+    bool ok;
+
+    m_utf8Buffer.clear();
+    if (m_lastError != ERROR_SUCCESS)
+    {
+        *pString = {};
+        ok = false;
+    }
+    else if (ERROR_SUCCESS != (m_lastError = AppendUtf16AsUtf8(m_utf8Buffer, output.data(), output.size())))
+    {
+        *pString = {};
+        ok = false;
+    }
+    else
+    {
+        *pString = { m_utf8Buffer.data(), m_utf8Buffer.size() };
+        ok = true;
+    }
+
+    return ok;
+}
+
+bool
+EtwEnumerator::StringViewResult(
+    Buffer const& output,
+    _Out_ EtwStringViewUtf8Z* pString) noexcept
+{
+    bool ok;
+
+    // On success, the wide output ends with the nul added by the wide
+    // StringViewResult. Convert it too.
+    m_utf8Buffer.clear();
+    if (m_lastError != ERROR_SUCCESS)
+    {
+        *pString = { "", 0 };
+        ok = false;
+    }
+    else if (ERROR_SUCCESS != (m_lastError = AppendUtf16AsUtf8(m_utf8Buffer, output.data(), output.size())))
+    {
+        *pString = { "", 0 };
+        ok = false;
+    }
+    else
+    {
+        ASSERT(m_utf8Buffer.size() != 0 && m_utf8Buffer.data()[m_utf8Buffer.size() - 1] == 0);
+        *pString = { m_utf8Buffer.data(), m_utf8Buffer.size() - 1 };
+        ok = true;
+    }
+
+    return ok;
+}
+
+bool
+EtwEnumerator::StringViewResult(
+    EtwInternal::Buffer<char>& output,
+    _Out_ EtwStringViewUtf8Z* pString) noexcept
+{
+    bool ok;
+
+    if (m_lastError != ERROR_SUCCESS)
+    {
+        *pString = { "", 0 };
+        ok = false;
+    }
+    else if (!output.push_back(0))
+    {
+        *pString = { "", 0 };
+        m_lastError = ERROR_OUTOFMEMORY;
+        ok = false;
+    }
+    else
+    {
+        *pString = { output.data(), output.size() - 1 };
+        ok = true;
+    }
+
+    return ok;
+}
+
+bool
+EtwEnumerator::SinkResult(
+    EtwOutputSink& sink,
+    _In_reads_(cch) EtwWCHAR const* pch,
+    unsigned cch) noexcept
+{
+    if (cch > 0xFFFFFFFF / sizeof(EtwWCHAR))
+    {
+        m_lastError = ERROR_OUTOFMEMORY;
+    }
+    else
+    {
+        m_sinkWritten = true;
+        m_lastError = sink.Write(pch, cch * static_cast<unsigned>(sizeof(EtwWCHAR)));
+    }
+
+    return m_lastError == ERROR_SUCCESS;
+}
+
+bool
+EtwEnumerator::SinkResultUtf8(
+    EtwOutputSink& sink,
+    _In_reads_(cch) EtwWCHAR const* pch,
+    unsigned cch) noexcept
+{
+    void* pbReserved = nullptr;
+
+    // Each UTF-16 code unit becomes at most 3 bytes of UTF-8. If the sink
+    // can provide that much contiguous space, encode directly into it.
+    if (cch <= 0xFFFFFFFF / 3)
+    {
+        unsigned cbAvailable;
+        pbReserved = sink.Reserve(cch * 3, &cbAvailable);
+        ASSERT(pbReserved == nullptr || cbAvailable >= cch * 3);
+    }
+
+    if (pbReserved != nullptr)
+    {
+        auto const pbEnd = WriteUtf16AsUtf8(static_cast<BYTE*>(pbReserved), pch, cch);
+        m_sinkWritten = true;
+        m_lastError = sink.Commit(static_cast<unsigned>(pbEnd - static_cast<BYTE*>(pbReserved)));
+    }
+    else
+    {
+        m_utf8Buffer.clear();
+        m_lastError = AppendUtf16AsUtf8(m_utf8Buffer, pch, cch);
+        if (m_lastError == ERROR_SUCCESS)
+        {
+            m_sinkWritten = true;
+            m_lastError = sink.Write(m_utf8Buffer.data(), m_utf8Buffer.size());
+        }
+    }
+
+    return m_lastError == ERROR_SUCCESS;
+}
+
+bool
+EtwEnumerator::SinkResultBytes(
+    EtwOutputSink& sink,
+    _In_reads_bytes_(cb) void const* pb,
+    unsigned cb) noexcept
+{
+    m_sinkWritten = true;
+    m_lastError = sink.Write(pb, cb);
+    return m_lastError == ERROR_SUCCESS;
+}
+
+void
+EtwEnumerator::BeginSinkResult(
+    _In_opt_ EtwOutputSink* pFlushSink,
+    bool flushUtf8) noexcept
+{
+    m_pFlushSink = pFlushSink;
+    m_flushUtf8 = flushUtf8;
+    m_sinkWritten = false;
+}
+
+bool
+EtwEnumerator::EndSinkResult(
+    EtwOutputSink& sink,
+    bool ok) noexcept
+{
+    m_pFlushSink = nullptr;
+    if (!ok && m_sinkWritten)
+    {
+        // Part of the result was sent. The sink must discard it.
+        sink.Abort();
+    }
+
+    return ok;
+}
+
+bool
+EtwEnumerator::FlushOutput(
+    EtwInternal::Buffer<wchar_t>& output) noexcept
+{
+    auto const cch = output.size();
+    if (m_pFlushSink != nullptr && cch >= FlushThreshold)
+    {
+        // Items end with an ASCII character, so a flush never splits a
+        // surrogate pair.
+        if (m_flushUtf8
+            ? !SinkResultUtf8(*m_pFlushSink, output.data(), cch)
+            : !SinkResult(*m_pFlushSink, output.data(), cch))
+        {
+            return false;
+        }
+
+        m_cchFlushed += cch;
+        output.clear();
+    }
+
+    return true;
+}
+
+bool
+EtwEnumerator::FlushOutput(
+    EtwInternal::Buffer<char>& output) noexcept
+{
+    auto const cch = output.size();
+    if (m_pFlushSink != nullptr && cch >= FlushThreshold)
+    {
+        if (!SinkResultBytes(*m_pFlushSink, output.data(), cch))
+        {
+            return false;
+        }
+
+        m_cchFlushed += cch;
+        output.clear();
+    }
+
+    return true;
+}
+
 #pragma endregion
 
 #pragma region Public methods
@@ -3930,16 +6138,35 @@ bool
 EtwEnumerator::FormatCurrentFunctionName(
     _Out_ EtwStringViewZ* pString) noexcept
 {
-    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
-
-    m_stringBuffer.clear();
-    m_lastError = AppendCurrentFunctionName(m_stringBuffer);
-    return StringViewResult(m_stringBuffer, pString);
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    m_stringBuffer.clear();
+    m_lastError = AppendCurrentFunctionName(m_stringBuffer);
+    return StringViewResult(m_stringBuffer, pString);
+}
+
+bool
+EtwEnumerator::FormatCurrentEvent(
+    _In_opt_z_ EtwPCWSTR szPrefixFormat,
+    EtwJsonSuffixFlags jsonSuffixFlags,
+    _Out_ EtwStringViewZ* pString) noexcept
+{
+    return FormatCurrentEventImpl(szPrefixFormat, nullptr, jsonSuffixFlags, pString);
+}
+
+bool
+EtwEnumerator::FormatCurrentEvent(
+    EtwCompiledPrefix const& prefix,
+    EtwJsonSuffixFlags jsonSuffixFlags,
+    _Out_ EtwStringViewZ* pString) noexcept
+{
+    return FormatCurrentEventImpl(nullptr, &prefix, jsonSuffixFlags, pString);
 }
 
 bool
-EtwEnumerator::FormatCurrentEvent(
+EtwEnumerator::FormatCurrentEventImpl(
     _In_opt_z_ EtwPCWSTR szPrefixFormat,
+    _In_opt_ EtwCompiledPrefix const* pPrefix,
     EtwJsonSuffixFlags jsonSuffixFlags,
     _Out_ EtwStringViewZ* pString) noexcept
 {
@@ -3954,7 +6181,15 @@ EtwEnumerator::FormatCurrentEvent(
 
     FormatContext ctx(*this, output, scratchBuffer);
 
-    if (szPrefixFormat && szPrefixFormat[0])
+    if (pPrefix)
+    {
+        if (!pPrefix->Empty())
+        {
+            CheckAdd(ctx.AddCompiledPrefix(*pPrefix));
+            ASSERT(scratchBuffer.size() == 0);
+        }
+    }
+    else if (szPrefixFormat && szPrefixFormat[0])
     {
         CheckAdd(ctx.AddPrefix(szPrefixFormat));
         ASSERT(scratchBuffer.size() == 0);
@@ -3963,9 +6198,14 @@ EtwEnumerator::FormatCurrentEvent(
     if (ULONG const eventMessageOffset = m_pTraceEventInfo->EventMessageOffset;
         eventMessageOffset != 0)
     {
+        // The message might be rolled back, so don't flush while formatting
+        // it.
         auto const oldOutputSize = output.size();
         auto const szEventMessage = TeiStringNoCheck(eventMessageOffset);
+        auto const pFlushSink = m_pFlushSink;
+        m_pFlushSink = nullptr;
         ctx.AddCurrentEvent(szEventMessage, true);
+        m_pFlushSink = pFlushSink;
         ASSERT(scratchBuffer.size() == 0 || m_lastError != ERROR_SUCCESS);
         if (m_lastError != ERROR_MR_MID_NOT_FOUND)
         {
@@ -4036,6 +6276,31 @@ EtwEnumerator::FormatCurrentEventPrefix(
     return StringViewResult(output, pString);
 }
 
+bool
+EtwEnumerator::FormatCurrentEventPrefix(
+    EtwCompiledPrefix const& prefix,
+    _Out_ EtwStringViewZ* pString) noexcept
+{
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    auto& output = m_stringBuffer2;
+    auto& scratchBuffer = m_stringBuffer;
+    output.clear();
+    scratchBuffer.clear();
+
+    if (prefix.Empty())
+    {
+        m_lastError = ERROR_SUCCESS;
+    }
+    else
+    {
+        FormatContext ctx(*this, output, scratchBuffer);
+        ctx.AddCompiledPrefix(prefix);
+    }
+
+    return StringViewResult(output, pString);
+}
+
 bool
 EtwEnumerator::FormatCurrentEventAsJson(
     _In_opt_z_ EtwPCWSTR szPrefixFormat,
@@ -4067,6 +6332,38 @@ Done:
     return StringViewResult(output, pString);
 }
 
+bool
+EtwEnumerator::FormatCurrentEventAsJson(
+    EtwFieldProjection& projection,
+    _In_opt_z_ EtwPCWSTR szPrefixFormat,
+    EtwJsonSuffixFlags jsonSuffixFlags,
+    _Out_ EtwStringViewZ* pString) noexcept
+{
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    auto& output = m_stringBuffer2;
+    auto& scratchBuffer = m_stringBuffer;
+    output.clear();
+    scratchBuffer.clear();
+
+    Reset();
+
+    if (szPrefixFormat && szPrefixFormat[0])
+    {
+        FormatContext ctx(*this, output, scratchBuffer);
+        CheckAdd(ctx.AddPrefix(szPrefixFormat));
+    }
+
+    CheckAdd(AddCurrentEventAsJson(
+        projection, output, scratchBuffer, jsonSuffixFlags));
+
+    m_lastError = ERROR_SUCCESS;
+
+Done:
+
+    return StringViewResult(output, pString);
+}
+
 bool
 EtwEnumerator::FormatCurrentItemAsJsonAndMoveNextSibling(
     EtwJsonItemFlags jsonItemFlags,
@@ -4124,7 +6421,7 @@ EtwEnumerator::FormatValueWithMapInfo(
     _Out_ EtwStringView* pString) noexcept
 {
     m_stringBuffer.clear();
-    AddValueWithMapInfo(m_stringBuffer, pData, cbData, inType, outType, pMapInfo);
+    AddValueWithMapInfo(m_stringBuffer, pData, cbData, inType, outType, pMapInfo, nullptr);
     return StringViewResult(m_stringBuffer, pString);
 }
 
@@ -4141,4 +6438,374 @@ EtwEnumerator::FormatValue(
     return StringViewResult(m_stringBuffer, pString);
 }
 
+bool
+EtwEnumerator::FormatCurrentEventUtf8(
+    _In_opt_z_ EtwPCWSTR szPrefixFormat,
+    EtwJsonSuffixFlags jsonSuffixFlags,
+    _Out_ EtwStringViewUtf8Z* pString) noexcept
+{
+    EtwStringViewZ wide;
+    FormatCurrentEvent(szPrefixFormat, jsonSuffixFlags, &wide);
+    return StringViewResult(m_stringBuffer2, pString);
+}
+
+bool
+EtwEnumerator::FormatCurrentEventUtf8(
+    EtwCompiledPrefix const& prefix,
+    EtwJsonSuffixFlags jsonSuffixFlags,
+    _Out_ EtwStringViewUtf8Z* pString) noexcept
+{
+    EtwStringViewZ wide;
+    FormatCurrentEvent(prefix, jsonSuffixFlags, &wide);
+    return StringViewResult(m_stringBuffer2, pString);
+}
+
+bool
+EtwEnumerator::FormatCurrentEventAsJsonUtf8(
+    _In_opt_z_ EtwPCWSTR szPrefixFormat,
+    EtwJsonSuffixFlags jsonSuffixFlags,
+    _Out_ EtwStringViewUtf8Z* pString) noexcept
+{
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    auto& output = m_utf8Buffer;
+    output.clear();
+
+    Reset();
+
+    CheckAdd(AddCurrentEventAsJsonUtf8(
+        output, szPrefixFormat, jsonSuffixFlags));
+
+    m_lastError = ERROR_SUCCESS;
+
+Done:
+
+    return StringViewResult(output, pString);
+}
+
+bool
+EtwEnumerator::FormatCurrentItemAsJsonAndMoveNextSiblingUtf8(
+    EtwJsonItemFlags jsonItemFlags,
+    _Out_ EtwStringViewUtf8Z* pString) noexcept
+{
+    ASSERT( // PRECONDITION
+        m_state == EtwEnumeratorState_BeforeFirstItem ||
+        m_state == EtwEnumeratorState_Value ||
+        m_state == EtwEnumeratorState_ArrayBegin ||
+        m_state == EtwEnumeratorState_StructBegin);
+
+    auto& output = m_utf8Buffer;
+    auto& scratchBuffer = m_stringBuffer;
+    output.clear();
+    scratchBuffer.clear();
+
+    AddCurrentItemAsJsonAndMoveNextUtf8(
+        output, scratchBuffer, jsonItemFlags);
+    return StringViewResult(output, pString);
+}
+
+bool
+EtwEnumerator::FormatCurrentValueUtf8(
+    _Out_ EtwStringViewUtf8* pString) noexcept
+{
+    ASSERT(m_state == EtwEnumeratorState_Value); // PRECONDITION
+
+    bool ok;
+
+    auto& epi = m_pTraceEventInfo->EventPropertyInfoArray[m_stackTop.PropertyIndex];
+    if (IsUtf8StringValue(epi, m_cookedInType) &&
+        IsValidUtf8(m_pbCooked, m_cbCooked))
+    {
+        // UTF-8 payload strings can be returned as-is.
+        m_lastError = ERROR_SUCCESS;
+        *pString = { reinterpret_cast<char const*>(m_pbCooked), m_cbCooked };
+        ok = true;
+    }
+    else if (IsUtf16StringValue(epi, m_cookedInType) &&
+        WSTR_ALIGNED(m_pbCooked))
+    {
+        // UTF-16 payload strings are encoded directly from the event.
+        m_utf8Buffer.clear();
+        m_lastError = AppendUtf16AsUtf8(
+            m_utf8Buffer, reinterpret_cast<wchar_t const*>(m_pbCooked), m_cbCooked / 2);
+        if (m_lastError != ERROR_SUCCESS)
+        {
+            *pString = {};
+            ok = false;
+        }
+        else
+        {
+            *pString = { m_utf8Buffer.data(), m_utf8Buffer.size() };
+            ok = true;
+        }
+    }
+    else
+    {
+        m_stringBuffer.clear();
+        AddCurrentValue(m_stringBuffer);
+        ok = StringViewResult(m_stringBuffer, pString);
+    }
+
+    return ok;
+}
+
+unsigned
+EtwEnumerator::FormatEventsAsJsonUtf8(
+    _In_reads_(cEventRecords) EVENT_RECORD const* const* ppEventRecords,
+    unsigned cEventRecords,
+    EtwJsonSuffixFlags jsonSuffixFlags,
+    unsigned cbFlushThreshold,
+    _Out_writes_opt_(cEventRecords) LSTATUS* pEventErrors,
+    _Out_ EtwStringViewUtf8* pBlock) noexcept
+{
+    auto& block = m_utf8Buffer;
+    unsigned iEvent;
+
+    block.clear();
+
+    for (iEvent = 0; iEvent != cEventRecords; iEvent += 1)
+    {
+        if (cbFlushThreshold != 0 && block.size() >= cbFlushThreshold)
+        {
+            break;
+        }
+
+        LSTATUS eventError;
+        auto const pEventRecord = ppEventRecords[iEvent];
+        if (EtwEventCategory_Error == PreviewEvent(pEventRecord) ||
+            !StartEvent(pEventRecord))
+        {
+            eventError = m_lastError;
+        }
+        else
+        {
+            // Each event is written directly to the block. On failure, the
+            // partial event is removed.
+            auto const blockOldSize = block.size();
+            if (!AddCurrentEventAsJsonUtf8(block, nullptr, jsonSuffixFlags))
+            {
+                eventError = m_lastError;
+            }
+            else if (!block.push_back('\n'))
+            {
+                eventError = ERROR_OUTOFMEMORY;
+            }
+            else
+            {
+                eventError = ERROR_SUCCESS;
+            }
+
+            if (eventError != ERROR_SUCCESS)
+            {
+                block.resize_unchecked(blockOldSize);
+                if (eventError == ERROR_OUTOFMEMORY && blockOldSize != 0)
+                {
+                    // Block is full. Let the caller flush it and retry this event.
+                    break;
+                }
+            }
+        }
+
+        if (pEventErrors)
+        {
+            pEventErrors[iEvent] = eventError;
+        }
+    }
+
+    m_lastError = ERROR_SUCCESS;
+    *pBlock = { block.data(), block.size() };
+    return iEvent;
+}
+
+bool
+EtwEnumerator::WriteCurrentEvent(
+    EtwOutputSink& sink,
+    _In_opt_z_ EtwPCWSTR szPrefixFormat,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
+{
+    EtwStringViewZ wide;
+    BeginSinkResult(&sink, false);
+    bool const ok = FormatCurrentEvent(szPrefixFormat, jsonSuffixFlags, &wide)
+        && SinkResult(sink, wide.Data, wide.DataLength);
+    return EndSinkResult(sink, ok);
+}
+
+bool
+EtwEnumerator::WriteCurrentEvent(
+    EtwOutputSink& sink,
+    EtwCompiledPrefix const& prefix,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
+{
+    EtwStringViewZ wide;
+    BeginSinkResult(&sink, false);
+    bool const ok = FormatCurrentEvent(prefix, jsonSuffixFlags, &wide)
+        && SinkResult(sink, wide.Data, wide.DataLength);
+    return EndSinkResult(sink, ok);
+}
+
+bool
+EtwEnumerator::WriteCurrentEventAsJson(
+    EtwOutputSink& sink,
+    _In_opt_z_ EtwPCWSTR szPrefixFormat,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
+{
+    EtwStringViewZ wide;
+    BeginSinkResult(&sink, false);
+    bool const ok = FormatCurrentEventAsJson(szPrefixFormat, jsonSuffixFlags, &wide)
+        && SinkResult(sink, wide.Data, wide.DataLength);
+    return EndSinkResult(sink, ok);
+}
+
+bool
+EtwEnumerator::WriteCurrentItemAsJsonAndMoveNextSibling(
+    EtwOutputSink& sink,
+    EtwJsonItemFlags jsonItemFlags) noexcept
+{
+    EtwStringViewZ wide;
+    BeginSinkResult(&sink, false);
+    bool const ok = FormatCurrentItemAsJsonAndMoveNextSibling(jsonItemFlags, &wide)
+        && SinkResult(sink, wide.Data, wide.DataLength);
+    return EndSinkResult(sink, ok);
+}
+
+bool
+EtwEnumerator::WriteCurrentValue(
+    EtwOutputSink& sink) noexcept
+{
+    EtwStringView wide;
+    BeginSinkResult(nullptr, false);
+    bool const ok = FormatCurrentValue(&wide)
+        && SinkResult(sink, wide.Data, wide.DataLength);
+    return EndSinkResult(sink, ok);
+}
+
+bool
+EtwEnumerator::WriteCurrentEventUtf8(
+    EtwOutputSink& sink,
+    _In_opt_z_ EtwPCWSTR szPrefixFormat,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
+{
+    EtwStringViewZ wide;
+    BeginSinkResult(&sink, true);
+    bool const ok = FormatCurrentEvent(szPrefixFormat, jsonSuffixFlags, &wide)
+        && SinkResultUtf8(sink, wide.Data, wide.DataLength);
+    return EndSinkResult(sink, ok);
+}
+
+bool
+EtwEnumerator::WriteCurrentEventUtf8(
+    EtwOutputSink& sink,
+    EtwCompiledPrefix const& prefix,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
+{
+    EtwStringViewZ wide;
+    BeginSinkResult(&sink, true);
+    bool const ok = FormatCurrentEvent(prefix, jsonSuffixFlags, &wide)
+        && SinkResultUtf8(sink, wide.Data, wide.DataLength);
+    return EndSinkResult(sink, ok);
+}
+
+bool
+EtwEnumerator::WriteCurrentEventAsJsonUtf8(
+    EtwOutputSink& sink,
+    _In_opt_z_ EtwPCWSTR szPrefixFormat,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
+{
+    EtwStringViewUtf8Z utf8;
+    BeginSinkResult(&sink, true);
+    bool const ok = FormatCurrentEventAsJsonUtf8(szPrefixFormat, jsonSuffixFlags, &utf8)
+        && SinkResultBytes(sink, utf8.Data, utf8.DataLength);
+    return EndSinkResult(sink, ok);
+}
+
+bool
+EtwEnumerator::WriteCurrentEventAsJsonUtf8(
+    EtwOutputSink& sink,
+    EtwFieldProjection& projection,
+    _In_opt_z_ EtwPCWSTR szPrefixFormat,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
+{
+    EtwStringViewZ wide;
+    BeginSinkResult(&sink, true);
+    bool const ok = FormatCurrentEventAsJson(projection, szPrefixFormat, jsonSuffixFlags, &wide)
+        && SinkResultUtf8(sink, wide.Data, wide.DataLength);
+    return EndSinkResult(sink, ok);
+}
+
+bool
+EtwEnumerator::WriteCurrentItemAsJsonAndMoveNextSiblingUtf8(
+    EtwOutputSink& sink,
+    EtwJsonItemFlags jsonItemFlags) noexcept
+{
+    EtwStringViewUtf8Z utf8;
+    BeginSinkResult(&sink, true);
+    bool const ok = FormatCurrentItemAsJsonAndMoveNextSiblingUtf8(jsonItemFlags, &utf8)
+        && SinkResultBytes(sink, utf8.Data, utf8.DataLength);
+    return EndSinkResult(sink, ok);
+}
+
+bool
+EtwEnumerator::WriteCurrentValueUtf8(
+    EtwOutputSink& sink) noexcept
+{
+    EtwStringViewUtf8 utf8;
+    BeginSinkResult(nullptr, true);
+    bool const ok = FormatCurrentValueUtf8(&utf8)
+        && SinkResultBytes(sink, utf8.Data, utf8.DataLength);
+    return EndSinkResult(sink, ok);
+}
+
+bool
+EtwEnumerator::WriteCurrentEventAsSchemaJsonUtf8(
+    EtwJsonSchemaTable& schemas,
+    EtwOutputSink& sink,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
+{
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    auto& output = m_stringBuffer2;
+    auto& scratchBuffer = m_stringBuffer;
+    output.clear();
+    scratchBuffer.clear();
+    BeginSinkResult(nullptr, true);
+
+    Reset();
+
+    EtwInternal::SchemaCache::Key key;
+    EtwInternal::SchemaCache::MakeKey(m_pEventRecord, &key);
+
+    unsigned schemaId = schemas.Find(key, jsonSuffixFlags);
+    bool const newSchema = schemaId == EtwJsonSchemaTable::NoSchema;
+    if (newSchema)
+    {
+        schemaId = schemas.Count();
+        CheckAdd(AddCurrentSchemaAsJson(output, scratchBuffer, schemaId, jsonSuffixFlags));
+    }
+
+    CheckWin32(m_lastError, AppendPrintf(output, L"[%u,", schemaId));
+    CheckAdd(AddCurrentEventValuesAsJsonArray(output, scratchBuffer));
+
+    if (jsonSuffixFlags & JsonSuffixFlags_Dynamic)
+    {
+        CheckOutOfMem(m_lastError, output.push_back(L','));
+        CheckAdd(AddCurrentDynamicMetaAsJsonArray(output, jsonSuffixFlags));
+    }
+
+    CheckWin32(m_lastError, AppendLiteral(output, L"]\n"));
+
+    if (newSchema)
+    {
+        CheckOutOfMem(m_lastError, schemas.Add(key, jsonSuffixFlags));
+    }
+
+    if (!SinkResultUtf8(sink, output.data(), output.size()) && newSchema)
+    {
+        schemas.RemoveLast();
+    }
+
+Done:
+
+    return EndSinkResult(sink, m_lastError == ERROR_SUCCESS);
+}
+
 #pragma endregion
@@ -0,0 +1,1113 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "stdafx.h"
+#include <EtwEnumerator.h>
+#include "EtwBuffer.inl"
+
+/*
+Implementation of EtwEventFilter and EtwEnumerator::EvaluateFilter.
+This code is in a separate file so that users who don't use filters don't
+need to link it.
+*/
+
+enum EtwEventFilter::NodeKind
+    : UCHAR
+{
+    NodeKind_And,
+    NodeKind_Or,
+    NodeKind_Not,
+    NodeKind_Comparison,
+};
+
+enum EtwEventFilter::FieldKind
+    : UCHAR
+{
+    FieldKind_Payload,
+    FieldKind_Provider,
+    FieldKind_Id,
+    FieldKind_Level,
+    FieldKind_Keywords,
+    FieldKind_Pid,
+    FieldKind_Tid,
+};
+
+enum EtwEventFilter::Operator
+    : UCHAR
+{
+    Operator_Equal,
+    Operator_NotEqual,
+    Operator_Less,
+    Operator_LessEqual,
+    Operator_Greater,
+    Operator_GreaterEqual,
+    Operator_AnyBits,
+    Operator_Contains,
+};
+
+enum EtwEventFilter::Result
+    : UCHAR
+{
+    Result_False,
+    Result_True,
+    Result_Unknown, // Depends on the payload, which is not available.
+};
+
+// Header field names, in FieldKind order (starting at FieldKind_Provider).
+static EtwPCWSTR const HeaderFieldNames[] = {
+    L"provider",
+    L"id",
+    L"level",
+    L"keywords",
+    L"pid",
+    L"tid",
+};
+
+static bool
+IsSpace(EtwWCHAR ch) noexcept
+{
+    return ch == L' ' || ch == L'\t' || ch == L'\r' || ch == L'\n';
+}
+
+static EtwPCWSTR
+SkipSpace(EtwPCWSTR pch) noexcept
+{
+    while (IsSpace(*pch))
+    {
+        pch += 1;
+    }
+
+    return pch;
+}
+
+// Characters that end a name.
+static bool
+IsNameEnd(EtwWCHAR ch) noexcept
+{
+    return ch == 0 || IsSpace(ch) || wcschr(L"()!=<>&|\"", ch) != nullptr;
+}
+
+static EtwWCHAR
+FoldAscii(EtwWCHAR ch) noexcept
+{
+    return ch >= L'A' && ch <= L'Z' ? static_cast<EtwWCHAR>(ch + (L'a' - L'A')) : ch;
+}
+
+static int
+HexDigitValue(EtwWCHAR ch) noexcept
+{
+    return
+        ch >= L'0' && ch <= L'9' ? ch - L'0' :
+        ch >= L'a' && ch <= L'f' ? ch - L'a' + 10 :
+        ch >= L'A' && ch <= L'F' ? ch - L'A' + 10 :
+        -1;
+}
+
+// Parses [-]digits or [-]0xhexdigits. Fails on overflow.
+static bool
+ParseInteger(
+    _In_reads_(cch) EtwWCHAR const* pch,
+    unsigned cch,
+    _Out_ bool* pIsNegative,
+    _Out_ UINT64* pMagnitude) noexcept
+{
+    unsigned i = 0;
+    UINT64 magnitude = 0;
+    bool const isNegative = cch != 0 && pch[0] == L'-';
+    if (isNegative)
+    {
+        i += 1;
+    }
+
+    unsigned const base =
+        cch - i > 2 && pch[i] == L'0' && (pch[i + 1] == L'x' || pch[i + 1] == L'X')
+        ? 16u
+        : 10u;
+    if (base == 16)
+    {
+        i += 2;
+    }
+
+    bool ok = i != cch;
+    for (; ok && i != cch; i += 1)
+    {
+        int const digit = HexDigitValue(pch[i]);
+        ok = digit >= 0 && static_cast<unsigned>(digit) < base &&
+            magnitude <= (~0ull - digit) / base;
+        magnitude = magnitude * base + digit;
+    }
+
+    *pIsNegative = isNegative && magnitude != 0;
+    *pMagnitude = ok ? magnitude : 0;
+    return ok;
+}
+
+// Parses XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX, optionally in braces.
+static bool
+ParseGuid(
+    _In_reads_(cch) EtwWCHAR const* pch,
+    unsigned cch,
+    _Out_ GUID* pGuid) noexcept
+{
+    static unsigned const GuidLength = 36;
+    BYTE bytes[16];
+    unsigned byteCount = 0;
+    bool ok;
+
+    if (cch == GuidLength + 2 && pch[0] == L'{' && pch[cch - 1] == L'}')
+    {
+        pch += 1;
+        cch -= 2;
+    }
+
+    ok = cch == GuidLength;
+    for (unsigned i = 0; ok && i != GuidLength; i += 2)
+    {
+        if (i == 8 || i == 13 || i == 18 || i == 23)
+        {
+            ok = pch[i] == L'-';
+            i -= 1; // Net += 1.
+            continue;
+        }
+
+        int const hi = HexDigitValue(pch[i]);
+        int const lo = HexDigitValue(pch[i + 1]);
+        ok = hi >= 0 && lo >= 0;
+        bytes[byteCount] = static_cast<BYTE>(hi * 16 + lo);
+        byteCount += 1;
+    }
+
+    *pGuid = GUID();
+    if (ok)
+    {
+        pGuid->Data1 =
+            static_cast<ULONG>(bytes[0]) << 24 | static_cast<ULONG>(bytes[1]) << 16 |
+            static_cast<ULONG>(bytes[2]) << 8 | bytes[3];
+        pGuid->Data2 = static_cast<USHORT>(bytes[4] << 8 | bytes[5]);
+        pGuid->Data3 = static_cast<USHORT>(bytes[6] << 8 | bytes[7]);
+        memcpy(pGuid->Data4, bytes + 8, sizeof(pGuid->Data4));
+    }
+
+    return ok;
+}
+
+// Compares two integers, each given as a sign and a magnitude.
+static int
+CompareSignMagnitude(
+    bool isNegative1,
+    UINT64 magnitude1,
+    bool isNegative2,
+    UINT64 magnitude2) noexcept
+{
+    int order =
+        magnitude1 < magnitude2 ? -1 :
+        magnitude1 > magnitude2 ? 1 :
+        0;
+    if (isNegative1 != isNegative2)
+    {
+        order = isNegative1 ? -1 : 1;
+    }
+    else if (isNegative1)
+    {
+        order = -order;
+    }
+
+    return order;
+}
+
+EtwEventFilter::EtwEventFilter() noexcept
+    : m_text()
+    , m_nodes()
+    , m_fields()
+    , m_schemaIds()
+    , m_schemas()
+    , m_propertyIndices()
+    , m_root(NoNode)
+{
+    return;
+}
+
+EtwEventFilter::~EtwEventFilter() noexcept
+{
+    return;
+}
+
+LSTATUS
+EtwEventFilter::SetExpression(
+    _In_z_ EtwPCWSTR szExpression) noexcept
+{
+    LSTATUS status;
+    EtwPCWSTR pch = SkipSpace(szExpression);
+    unsigned root = NoNode;
+
+    ClearSchemas();
+    m_text.clear();
+    m_nodes.clear();
+    m_fields.clear();
+    m_root = NoNode;
+
+    if (*pch != 0)
+    {
+        status = ParseList(&pch, NodeKind_Or, 0, &root);
+        if (status == ERROR_SUCCESS && *SkipSpace(pch) != 0)
+        {
+            status = ERROR_INVALID_PARAMETER; // e.g. unmatched ')'.
+        }
+
+        if (status != ERROR_SUCCESS)
+        {
+            m_text.clear();
+            m_nodes.clear();
+            m_fields.clear();
+            goto Done;
+        }
+    }
+
+    m_root = root;
+    status = ERROR_SUCCESS;
+
+Done:
+
+    return status;
+}
+
+bool
+EtwEventFilter::IsEmpty() const noexcept
+{
+    return m_root == NoNode;
+}
+
+bool
+EtwEventFilter::MatchesHeader(
+    _In_ EVENT_RECORD const* pEventRecord,
+    _Out_ bool* pMatch) const noexcept
+{
+    Context const context = { pEventRecord, nullptr, nullptr, nullptr };
+    Result const result = m_root == NoNode
+        ? Result_True
+        : Evaluate(m_root, context);
+    *pMatch = result == Result_True;
+    return result != Result_Unknown;
+}
+
+void
+EtwEventFilter::ClearSchemas() noexcept
+{
+    m_schemaIds.Clear();
+    m_schemas.clear();
+    m_propertyIndices.clear();
+}
+
+LSTATUS
+EtwEventFilter::ParseList(
+    _Inout_ EtwPCWSTR* ppch,
+    UCHAR kind,
+    unsigned depth,
+    _Out_ unsigned* pNode) noexcept
+{
+    // Or := And ( "||" And )*
+    // And := Unary ( "&&" Unary )*
+    LSTATUS status;
+    EtwWCHAR const separator = kind == NodeKind_Or ? L'|' : L'&';
+    unsigned first = NoNode;
+    unsigned lastHeader = NoNode; // Last operand that does not need the payload.
+    unsigned last = NoNode;
+    unsigned count = 0;
+    bool needsPayload = false;
+
+    *pNode = NoNode;
+
+    for (;;)
+    {
+        unsigned operand;
+        status = kind == NodeKind_Or
+            ? ParseList(ppch, NodeKind_And, depth, &operand)
+            : ParseUnary(ppch, depth, &operand);
+        if (status != ERROR_SUCCESS)
+        {
+            goto Done;
+        }
+
+        // Link header operands before payload operands so that they are
+        // evaluated first. Order of evaluation does not change the result.
+        auto& node = m_nodes[operand];
+        if (node.NeedsPayload)
+        {
+            needsPayload = true;
+            if (last != NoNode)
+            {
+                m_nodes[last].NextSibling = operand;
+            }
+            else
+            {
+                first = operand;
+            }
+
+            last = operand;
+        }
+        else
+        {
+            node.NextSibling = lastHeader != NoNode
+                ? m_nodes[lastHeader].NextSibling
+                : first;
+            if (lastHeader != NoNode)
+            {
+                m_nodes[lastHeader].NextSibling = operand;
+            }
+            else
+            {
+                first = operand;
+            }
+
+            if (last == lastHeader)
+            {
+                last = operand;
+            }
+
+            lastHeader = operand;
+        }
+
+        count += 1;
+
+        auto const pch = SkipSpace(*ppch);
+        if (pch[0] != separator || pch[1] != separator)
+        {
+            break;
+        }
+
+        *ppch = pch + 2;
+    }
+
+    if (count == 1)
+    {
+        *pNode = first;
+    }
+    else
+    {
+        Node listNode = {};
+        listNode.FirstChild = first;
+        listNode.NextSibling = NoNode;
+        listNode.Kind = kind;
+        listNode.NeedsPayload = needsPayload;
+
+        *pNode = m_nodes.size();
+        if (!m_nodes.push_back(listNode))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+    }
+
+    status = ERROR_SUCCESS;
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwEventFilter::ParseUnary(
+    _Inout_ EtwPCWSTR* ppch,
+    unsigned depth,
+    _Out_ unsigned* pNode) noexcept
+{
+    // Unary := "!" Unary | "(" Expression ")" | Comparison
+    LSTATUS status;
+    auto pch = SkipSpace(*ppch);
+
+    *pNode = NoNode;
+
+    if (pch[0] == L'!' && pch[1] != L'=')
+    {
+        if (depth == MaxDepth)
+        {
+            status = ERROR_INVALID_PARAMETER;
+            goto Done;
+        }
+
+        unsigned operand;
+        *ppch = pch + 1;
+        status = ParseUnary(ppch, depth + 1, &operand);
+        if (status != ERROR_SUCCESS)
+        {
+            goto Done;
+        }
+
+        Node notNode = {};
+        notNode.FirstChild = operand;
+        notNode.NextSibling = NoNode;
+        notNode.Kind = NodeKind_Not;
+        notNode.NeedsPayload = m_nodes[operand].NeedsPayload;
+
+        *pNode = m_nodes.size();
+        status = m_nodes.push_back(notNode) ? ERROR_SUCCESS : ERROR_OUTOFMEMORY;
+    }
+    else if (pch[0] == L'(')
+    {
+        if (depth == MaxDepth)
+        {
+            status = ERROR_INVALID_PARAMETER;
+            goto Done;
+        }
+
+        *ppch = pch + 1;
+        status = ParseList(ppch, NodeKind_Or, depth + 1, pNode);
+        if (status != ERROR_SUCCESS)
+        {
+            goto Done;
+        }
+
+        pch = SkipSpace(*ppch);
+        if (pch[0] != L')')
+        {
+            status = ERROR_INVALID_PARAMETER;
+            goto Done;
+        }
+
+        *ppch = pch + 1;
+    }
+    else
+    {
+        *ppch = pch;
+        status = ParseComparison(ppch, pNode);
+    }
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwEventFilter::ParseComparison(
+    _Inout_ EtwPCWSTR* ppch,
+    _Out_ unsigned* pNode) noexcept
+{
+    // Comparison := Name Operator Value
+    static EtwWCHAR const Contains[] = L"contains";
+    static unsigned const ContainsLength = ARRAYSIZE(Contains) - 1;
+
+    LSTATUS status;
+    auto pch = *ppch;
+    Node node = {};
+    node.FirstChild = NoNode;
+    node.NextSibling = NoNode;
+    node.FieldIndex = NoNode;
+    node.Kind = NodeKind_Comparison;
+
+    *pNode = NoNode;
+
+    // Name
+    auto const pchName = pch;
+    while (!IsNameEnd(*pch))
+    {
+        pch += 1;
+    }
+
+    auto const cchName = static_cast<unsigned>(pch - pchName);
+    if (cchName == 0)
+    {
+        status = ERROR_INVALID_PARAMETER;
+        goto Done;
+    }
+
+    node.Field = FieldKind_Payload;
+    for (unsigned i = 0; i != ARRAYSIZE(HeaderFieldNames); i += 1)
+    {
+        if (0 == wcsncmp(HeaderFieldNames[i], pchName, cchName) &&
+            HeaderFieldNames[i][cchName] == 0)
+        {
+            node.Field = static_cast<UCHAR>(FieldKind_Provider + i);
+            break;
+        }
+    }
+
+    // Operator
+    pch = SkipSpace(pch);
+    if (pch[0] == L'=' && pch[1] == L'=')
+    {
+        node.Op = Operator_Equal;
+        pch += 2;
+    }
+    else if (pch[0] == L'!' && pch[1] == L'=')
+    {
+        node.Op = Operator_NotEqual;
+        pch += 2;
+    }
+    else if (pch[0] == L'<')
+    {
+        node.Op = pch[1] == L'=' ? Operator_LessEqual : Operator_Less;
+        pch += pch[1] == L'=' ? 2 : 1;
+    }
+    else if (pch[0] == L'>')
+    {
+        node.Op = pch[1] == L'=' ? Operator_GreaterEqual : Operator_Greater;
+        pch += pch[1] == L'=' ? 2 : 1;
+    }
+    else if (pch[0] == L'&' && pch[1] != L'&')
+    {
+        node.Op = Operator_AnyBits;
+        pch += 1;
+    }
+    else if (0 == wcsncmp(pch, Contains, ContainsLength) &&
+        (IsSpace(pch[ContainsLength]) || pch[ContainsLength] == L'"'))
+    {
+        node.Op = Operator_Contains;
+        pch += ContainsLength;
+    }
+    else
+    {
+        status = ERROR_INVALID_PARAMETER;
+        goto Done;
+    }
+
+    // Value
+    pch = SkipSpace(pch);
+    EtwWCHAR const* pchValue;
+    unsigned cchValue;
+    if (pch[0] == L'"')
+    {
+        pchValue = pch + 1;
+        auto const pchQuote = wcschr(pchValue, L'"');
+        if (pchQuote == nullptr)
+        {
+            status = ERROR_INVALID_PARAMETER;
+            goto Done;
+        }
+
+        cchValue = static_cast<unsigned>(pchQuote - pchValue);
+        pch = pchQuote + 1;
+    }
+    else
+    {
+        pchValue = pch;
+        while (*pch != 0 && !IsSpace(*pch) && *pch != L')' &&
+            !(pch[0] == L'&' && pch[1] == L'&') &&
+            !(pch[0] == L'|' && pch[1] == L'|'))
+        {
+            pch += 1;
+        }
+
+        cchValue = static_cast<unsigned>(pch - pchValue);
+        if (cchValue == 0)
+        {
+            status = ERROR_INVALID_PARAMETER;
+            goto Done;
+        }
+    }
+
+    node.IsInteger = ParseInteger(pchValue, cchValue, &node.IsNegative, &node.Integer);
+    node.IsGuid = ParseGuid(pchValue, cchValue, &node.Guid);
+    node.NeedsPayload =
+        node.Field == FieldKind_Payload ||
+        (node.Field == FieldKind_Provider && !node.IsGuid);
+    node.TextLength = cchValue;
+    status = AddText(pchValue, cchValue, &node.TextOffset);
+    if (status != ERROR_SUCCESS)
+    {
+        goto Done;
+    }
+
+    if (node.Field == FieldKind_Payload)
+    {
+        // Find or add the name (nul-terminated) in m_fields.
+        for (unsigned i = 0; i != m_fields.size(); i += 1)
+        {
+            auto const szField = m_text.data() + m_fields[i];
+            if (0 == wcsncmp(szField, pchName, cchName) && szField[cchName] == 0)
+            {
+                node.FieldIndex = i;
+                break;
+            }
+        }
+
+        if (node.FieldIndex == NoNode)
+        {
+            unsigned nameOffset;
+            static EtwWCHAR const Nul = 0;
+            status = AddText(pchName, cchName, &nameOffset);
+            if (status == ERROR_SUCCESS)
+            {
+                unsigned nulOffset;
+                status = AddText(&Nul, 1, &nulOffset);
+            }
+
+            if (status != ERROR_SUCCESS)
+            {
+                goto Done;
+            }
+
+            node.FieldIndex = m_fields.size();
+            if (!m_fields.push_back(nameOffset))
+            {
+                status = ERROR_OUTOFMEMORY;
+                goto Done;
+            }
+        }
+    }
+
+    *pNode = m_nodes.size();
+    if (!m_nodes.push_back(node))
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto Done;
+    }
+
+    *ppch = pch;
+    status = ERROR_SUCCESS;
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwEventFilter::AddText(
+    _In_reads_(cch) EtwWCHAR const* pch,
+    unsigned cch,
+    _Out_ unsigned* pTextOffset) noexcept
+{
+    auto const textOffset = m_text.size();
+    *pTextOffset = textOffset;
+    if (!m_text.resize(textOffset + cch))
+    {
+        return ERROR_OUTOFMEMORY;
+    }
+
+    memcpy(m_text.data() + textOffset, pch, cch * sizeof(EtwWCHAR));
+    return ERROR_SUCCESS;
+}
+
+EtwEventFilter::Result
+EtwEventFilter::Evaluate(
+    unsigned nodeIndex,
+    Context const& context) const noexcept
+{
+    auto const& node = m_nodes[nodeIndex];
+    Result result;
+
+    if (node.Kind == NodeKind_Comparison)
+    {
+        result = node.NeedsPayload && context.pEnumerator == nullptr
+            ? Result_Unknown
+            : EvaluateComparison(node, context);
+    }
+    else if (node.Kind == NodeKind_Not)
+    {
+        result = Evaluate(node.FirstChild, context);
+        if (result != Result_Unknown)
+        {
+            result = result == Result_True ? Result_False : Result_True;
+        }
+    }
+    else
+    {
+        // && stops at the first false operand, || at the first true one.
+        Result const decider = node.Kind == NodeKind_And ? Result_False : Result_True;
+        result = node.Kind == NodeKind_And ? Result_True : Result_False;
+        for (unsigned child = node.FirstChild; child != NoNode; child = m_nodes[child].NextSibling)
+        {
+            Result const childResult = Evaluate(child, context);
+            if (childResult == decider)
+            {
+                result = decider;
+                break;
+            }
+            else if (childResult == Result_Unknown)
+            {
+                result = Result_Unknown;
+            }
+        }
+    }
+
+    return result;
+}
+
+EtwEventFilter::Result
+EtwEventFilter::EvaluateComparison(
+    Node const& node,
+    Context const& context) const noexcept
+{
+    auto const& header = context.pEventRecord->EventHeader;
+    UINT64 headerValue;
+    bool match;
+
+    switch (node.Field)
+    {
+    case FieldKind_Payload:
+    {
+        ASSERT(context.pEnumerator != nullptr);
+        auto const propertyIndex = context.pPropertyIndices[node.FieldIndex];
+        EtwItemInfo item;
+        match =
+            propertyIndex != NoProperty &&
+            context.pEnumerator->GetFieldByIndex(propertyIndex, &item) &&
+            context.pEnumerator->State() == EtwEnumeratorState_Value &&
+            CompareItem(node, item);
+        goto Done;
+    }
+
+    case FieldKind_Provider:
+        if (node.IsGuid)
+        {
+            bool const equal = 0 == memcmp(&header.ProviderId, &node.Guid, sizeof(GUID));
+            match =
+                (node.Op == Operator_Equal && equal) ||
+                (node.Op == Operator_NotEqual && !equal);
+        }
+        else
+        {
+            ASSERT(context.pEnumerator != nullptr);
+            match =
+                context.szProviderName != nullptr &&
+                CompareText(node, context.szProviderName,
+                    static_cast<unsigned>(wcslen(context.szProviderName)));
+        }
+        goto Done;
+
+    case FieldKind_Id:
+        headerValue = header.EventDescriptor.Id;
+        break;
+    case FieldKind_Level:
+        headerValue = header.EventDescriptor.Level;
+        break;
+    case FieldKind_Keywords:
+        headerValue = header.EventDescriptor.Keyword;
+        break;
+    case FieldKind_Pid:
+        headerValue = header.ProcessId;
+        break;
+    case FieldKind_Tid:
+        headerValue = header.ThreadId;
+        break;
+    default:
+        ASSERT(!"Invalid FieldKind");
+        match = false;
+        goto Done;
+    }
+
+    match =
+        node.IsInteger &&
+        (node.Op == Operator_AnyBits
+            ? 0 != (headerValue & (node.IsNegative ? 0 - node.Integer : node.Integer))
+            : OrderMatches(node.Op, CompareSignMagnitude(false, headerValue, node.IsNegative, node.Integer)));
+
+Done:
+
+    return match ? Result_True : Result_False;
+}
+
+bool
+EtwEventFilter::OrderMatches(
+    UCHAR op,
+    int order) noexcept
+{
+    switch (op)
+    {
+    case Operator_Equal: return order == 0;
+    case Operator_NotEqual: return order != 0;
+    case Operator_Less: return order < 0;
+    case Operator_LessEqual: return order <= 0;
+    case Operator_Greater: return order > 0;
+    case Operator_GreaterEqual: return order >= 0;
+    default: return false; // AnyBits and Contains are not orderings.
+    }
+}
+
+bool
+EtwEventFilter::CompareItem(
+    Node const& node,
+    EtwItemInfo const& item) const noexcept
+{
+    UINT64 bits;
+    bool isSigned = false;
+    bool match;
+
+    switch (item.InType)
+    {
+    case TDH_INTYPE_UNICODESTRING:
+        match = CompareText(node,
+            static_cast<EtwWCHAR const UNALIGNED*>(item.Data),
+            item.DataSize / sizeof(EtwWCHAR));
+        goto Done;
+
+    case TDH_INTYPE_ANSISTRING:
+        match = CompareText(node,
+            static_cast<unsigned char const*>(item.Data),
+            item.DataSize);
+        goto Done;
+
+    case TDH_INTYPE_GUID:
+        match =
+            node.IsGuid &&
+            item.DataSize == sizeof(GUID) &&
+            (node.Op == Operator_Equal || node.Op == Operator_NotEqual) &&
+            (node.Op == Operator_Equal) == (0 == memcmp(item.Data, &node.Guid, sizeof(GUID)));
+        goto Done;
+
+    case TDH_INTYPE_FLOAT:
+    case TDH_INTYPE_DOUBLE:
+    {
+        double value;
+        if (item.DataSize == sizeof(float))
+        {
+            value = *static_cast<float const UNALIGNED*>(item.Data);
+        }
+        else if (item.DataSize == sizeof(double))
+        {
+            value = *static_cast<double const UNALIGNED*>(item.Data);
+        }
+        else
+        {
+            match = false;
+            goto Done;
+        }
+
+        double const literal = node.IsNegative
+            ? -static_cast<double>(node.Integer)
+            : static_cast<double>(node.Integer);
+        match =
+            node.IsInteger &&
+            node.Op != Operator_AnyBits &&
+            (value != value // NaN is only != to anything.
+                ? node.Op == Operator_NotEqual
+                : OrderMatches(node.Op, value < literal ? -1 : value > literal ? 1 : 0));
+        goto Done;
+    }
+
+    case TDH_INTYPE_INT8:
+    case TDH_INTYPE_INT16:
+    case TDH_INTYPE_INT32:
+    case TDH_INTYPE_INT64:
+        isSigned = true;
+        break;
+
+    case TDH_INTYPE_UINT8:
+    case TDH_INTYPE_UINT16:
+    case TDH_INTYPE_UINT32:
+    case TDH_INTYPE_UINT64:
+    case TDH_INTYPE_HEXINT32:
+    case TDH_INTYPE_HEXINT64:
+    case TDH_INTYPE_BOOLEAN:
+    case TDH_INTYPE_POINTER:
+    case TDH_INTYPE_SIZET:
+        break;
+
+    default:
+        match = false;
+        goto Done;
+    }
+
+    switch (item.DataSize)
+    {
+    case 1:
+        bits = *static_cast<UINT8 const*>(item.Data);
+        bits = isSigned ? static_cast<UINT64>(static_cast<INT8>(bits)) : bits;
+        break;
+    case 2:
+        bits = *static_cast<UINT16 const UNALIGNED*>(item.Data);
+        bits = isSigned ? static_cast<UINT64>(static_cast<INT16>(bits)) : bits;
+        break;
+    case 4:
+        bits = *static_cast<UINT32 const UNALIGNED*>(item.Data);
+        bits = isSigned ? static_cast<UINT64>(static_cast<INT32>(bits)) : bits;
+        break;
+    case 8:
+        bits = *static_cast<UINT64 const UNALIGNED*>(item.Data);
+        break;
+    default:
+        match = false;
+        goto Done;
+    }
+
+    if (!node.IsInteger)
+    {
+        match = false;
+    }
+    else if (node.Op == Operator_AnyBits)
+    {
+        match = 0 != (bits & (node.IsNegative ? 0 - node.Integer : node.Integer));
+    }
+    else
+    {
+        bool const isNegative = isSigned && static_cast<INT64>(bits) < 0;
+        match = OrderMatches(node.Op, CompareSignMagnitude(
+            isNegative, isNegative ? 0 - bits : bits,
+            node.IsNegative, node.Integer));
+    }
+
+Done:
+
+    return match;
+}
+
+template<class CharT>
+bool
+EtwEventFilter::CompareText(
+    Node const& node,
+    _In_reads_(cch) CharT const UNALIGNED* pch,
+    unsigned cch) const noexcept
+{
+    auto const pchValue = m_text.data() + node.TextOffset;
+    unsigned const cchValue = node.TextLength;
+    bool found = false;
+
+    if (node.Op != Operator_Equal &&
+        node.Op != Operator_NotEqual &&
+        node.Op != Operator_Contains)
+    {
+        return false;
+    }
+
+    // For == and !=, the only candidate position is 0 and lengths must match.
+    unsigned const startCount = node.Op == Operator_Contains
+        ? (cch >= cchValue ? cch - cchValue + 1 : 0u)
+        : (cch == cchValue ? 1u : 0u);
+    for (unsigned start = 0; start != startCount; start += 1)
+    {
+        unsigned i = 0;
+        while (i != cchValue &&
+            FoldAscii(static_cast<EtwWCHAR>(pch[start + i])) == FoldAscii(pchValue[i]))
+        {
+            i += 1;
+        }
+
+        if (i == cchValue)
+        {
+            found = true;
+            break;
+        }
+    }
+
+    return node.Op == Operator_NotEqual ? !found : found;
+}
+
+bool
+EtwEnumerator::EvaluateFilter(
+    EtwEventFilter& filter,
+    _Out_ bool* pMatch) noexcept
+{
+    ASSERT(m_state != EtwEnumeratorState_None); // PRECONDITION
+
+    bool ok;
+    EtwEventFilter::Context context = {
+        m_pEventRecord,
+        this,
+        nullptr,
+        m_pTraceEventInfo->ProviderNameOffset != 0
+            ? TeiString(m_pTraceEventInfo->ProviderNameOffset)
+            : nullptr };
+
+    *pMatch = false;
+
+    if (filter.m_root == EtwEventFilter::NoNode)
+    {
+        *pMatch = true;
+        ok = true;
+        goto Done;
+    }
+
+    if (filter.m_fields.size() != 0)
+    {
+        unsigned schemaIndex;
+        if (!FindFilterSchema(filter, &schemaIndex))
+        {
+            m_lastError = ERROR_OUTOFMEMORY;
+            ok = false;
+            goto Done;
+        }
+
+        context.pPropertyIndices = filter.m_propertyIndices.data() + filter.m_schemas[schemaIndex];
+    }
+
+    *pMatch = EtwEventFilter::Result_True == filter.Evaluate(filter.m_root, context);
+    ResetImpl();
+    ok = true;
+
+Done:
+
+    return ok;
+}
+
+bool
+EtwEnumerator::FindFilterSchema(
+    EtwEventFilter& filter,
+    _Out_ unsigned* pSchemaIndex) noexcept
+{
+    EtwInternal::SchemaCache::Key key;
+    EtwInternal::SchemaCache::MakeKey(m_pEventRecord, &key);
+
+    auto const schemaIndex = filter.m_schemaIds.Find(key, static_cast<EtwJsonSuffixFlags>(0));
+    if (schemaIndex != EtwJsonSchemaTable::NoSchema)
+    {
+        *pSchemaIndex = schemaIndex;
+        return true;
+    }
+
+    return AddFilterSchema(filter, key, pSchemaIndex);
+}
+
+bool
+EtwEnumerator::AddFilterSchema(
+    EtwEventFilter& filter,
+    EtwInternal::SchemaCache::Key const& key,
+    _Out_ unsigned* pSchemaIndex) noexcept
+{
+    auto const pTei = m_pTraceEventInfo;
+    unsigned const topLevelCount =
+        pTei->TopLevelPropertyCount <= pTei->PropertyCount &&
+        pTei->TopLevelPropertyCount < EtwEventFilter::NoProperty
+        ? pTei->TopLevelPropertyCount
+        : 0u;
+    auto const firstIndex = filter.m_propertyIndices.size();
+    auto const fieldCount = filter.m_fields.size();
+    bool ok = false;
+
+    *pSchemaIndex = EtwEventFilter::NoNode;
+
+    if (!filter.m_propertyIndices.resize(firstIndex + fieldCount))
+    {
+        goto Done;
+    }
+
+    // Resolve each payload name to the first top-level property with that name.
+    for (unsigned fieldIndex = 0; fieldIndex != fieldCount; fieldIndex += 1)
+    {
+        auto const szField = filter.m_text.data() + filter.m_fields[fieldIndex];
+        USHORT propertyIndex = EtwEventFilter::NoProperty;
+        for (unsigned i = 0; i != topLevelCount; i += 1)
+        {
+            auto const szPropertyName = TeiString(pTei->EventPropertyInfoArray[i].NameOffset);
+            if (szPropertyName != nullptr && 0 == wcscmp(szPropertyName, szField))
+            {
+                propertyIndex = static_cast<USHORT>(i);
+                break;
+            }
+        }
+
+        filter.m_propertyIndices[firstIndex + fieldIndex] = propertyIndex;
+    }
+
+    if (!filter.m_schemas.push_back(firstIndex))
+    {
+        goto Done;
+    }
+
+    if (!filter.m_schemaIds.Add(key, static_cast<EtwJsonSuffixFlags>(0)))
+    {
+        filter.m_schemas.pop_back();
+        goto Done;
+    }
+
+    ASSERT(filter.m_schemas.size() == filter.m_schemaIds.Count());
+    *pSchemaIndex = filter.m_schemas.size() - 1;
+    ok = true;
+
+Done:
+
+    if (!ok)
+    {
+        filter.m_propertyIndices.resize_unchecked(firstIndex);
+    }
+
+    return ok;
+}
@@ -0,0 +1,176 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "stdafx.h"
+#include <EtwEnumerator.h>
+#include "EtwBuffer.inl"
+
+/*
+Implementation of EtwFieldProjection. Projections are resolved and
+enumerated by EtwEnumerator::MoveNextProjected (EtwEnumerator.cpp).
+*/
+
+EtwFieldProjection::EtwFieldProjection() noexcept
+    : m_text()
+    , m_paths()
+    , m_pathSteps()
+    , m_steps()
+    , m_schemaIds()
+    , m_schemas()
+    , m_nodes()
+    , m_offsets()
+    , m_levels()
+    , m_returned()
+    , m_schemaIndex(NoNode)
+{
+    return;
+}
+
+EtwFieldProjection::~EtwFieldProjection() noexcept
+{
+    return;
+}
+
+LSTATUS
+EtwFieldProjection::SetFields(
+    _In_reads_(cPaths) EtwPCWSTR const* pszPaths,
+    unsigned cPaths) noexcept
+{
+    LSTATUS status;
+
+    ClearPaths();
+
+    for (unsigned pathIndex = 0; pathIndex != cPaths; pathIndex += 1)
+    {
+        auto const szPath = pszPaths[pathIndex];
+        auto const cchPath = static_cast<unsigned>(wcslen(szPath));
+        auto const textOffset = m_text.size();
+
+        if (!m_paths.push_back(textOffset) ||
+            !m_pathSteps.push_back(m_steps.size()) ||
+            !m_text.resize(textOffset + cchPath + 1))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        memcpy(m_text.data() + textOffset, szPath, (cchPath + 1) * sizeof(EtwWCHAR));
+
+        // Parse: Name[Index].Name[Index]...
+        unsigned i = 0;
+        for (;;)
+        {
+            Step step;
+            step.NameOffset = textOffset + i;
+            while (i != cchPath && szPath[i] != L'.' && szPath[i] != L'[' && szPath[i] != L']')
+            {
+                i += 1;
+            }
+
+            step.NameLength = textOffset + i - step.NameOffset;
+            step.ArrayIndex = NoArrayIndex;
+
+            if (i != cchPath && szPath[i] == L'[')
+            {
+                unsigned arrayIndex = 0;
+                unsigned const digitsBegin = i + 1;
+                for (i = digitsBegin; i != cchPath && szPath[i] >= L'0' && szPath[i] <= L'9'; i += 1)
+                {
+                    arrayIndex = arrayIndex * 10 + (szPath[i] - L'0');
+                    if (arrayIndex >= NoArrayIndex)
+                    {
+                        status = ERROR_INVALID_PARAMETER;
+                        goto Done;
+                    }
+                }
+
+                if (i == digitsBegin || i == cchPath || szPath[i] != L']')
+                {
+                    status = ERROR_INVALID_PARAMETER;
+                    goto Done;
+                }
+
+                step.ArrayIndex = static_cast<USHORT>(arrayIndex);
+                i += 1; // Skip ']'.
+            }
+
+            if (step.NameLength == 0 ||
+                m_steps.size() - m_pathSteps[pathIndex] == MaxPathSteps)
+            {
+                status = ERROR_INVALID_PARAMETER;
+                goto Done;
+            }
+
+            if (!m_steps.push_back(step))
+            {
+                status = ERROR_OUTOFMEMORY;
+                goto Done;
+            }
+
+            if (i == cchPath)
+            {
+                break;
+            }
+            else if (szPath[i] != L'.')
+            {
+                status = ERROR_INVALID_PARAMETER;
+                goto Done;
+            }
+
+            i += 1; // Skip '.'.
+        }
+    }
+
+    if (!m_pathSteps.push_back(m_steps.size()))
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto Done;
+    }
+
+    status = ERROR_SUCCESS;
+
+Done:
+
+    if (status != ERROR_SUCCESS)
+    {
+        ClearPaths();
+    }
+
+    return status;
+}
+
+unsigned
+EtwFieldProjection::FieldCount() const noexcept
+{
+    return m_paths.size();
+}
+
+_Ret_z_ EtwPCWSTR
+EtwFieldProjection::FieldPath(
+    unsigned fieldIndex) const noexcept
+{
+    ASSERT(fieldIndex < m_paths.size()); // PRECONDITION
+    return m_text.data() + m_paths[fieldIndex];
+}
+
+void
+EtwFieldProjection::ClearSchemas() noexcept
+{
+    m_schemaIds.Clear();
+    m_schemas.clear();
+    m_nodes.clear();
+    m_offsets.clear();
+    m_levels.clear();
+    m_schemaIndex = NoNode;
+}
+
+void
+EtwFieldProjection::ClearPaths() noexcept
+{
+    ClearSchemas();
+    m_text.clear();
+    m_paths.clear();
+    m_pathSteps.clear();
+    m_steps.clear();
+}
+
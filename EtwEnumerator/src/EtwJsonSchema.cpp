@@ -0,0 +1,1229 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "stdafx.h"
+#include <EtwEnumerator.h>
+#include "EtwBuffer.inl"
+
+/*
+Implementation of EtwJsonSchemaTable and EtwJsonRehydrator.
+This code is in a separate file so that users who don't use schema JSON
+don't need to link it.
+*/
+
+// Deepest struct nesting accepted in a schema record.
+static unsigned const MaxFieldDepth = 256;
+
+// Metadata names (as JSON strings) in FormatCurrentEventAsJson order.
+static char const* const MetaNames[] = {
+    "\"provider\"",
+    "\"event\"",
+    "\"time\"",
+    "\"cpu\"",
+    "\"pid\"",
+    "\"tid\"",
+    "\"id\"",
+    "\"version\"",
+    "\"channel\"",
+    "\"level\"",
+    "\"opcode\"",
+    "\"task\"",
+    "\"keywords\"",
+    "\"tags\"",
+    "\"activity\"",
+    "\"relatedActivity\"",
+    "\"ptime\"",
+    "\"ktime\"",
+    "\"utime\"",
+    "\"attribs\"",
+};
+
+static bool
+AppendText(
+    EtwInternal::Buffer<char>& output,
+    _In_reads_(cch) char const* pch,
+    unsigned cch) noexcept
+{
+    auto const oldSize = output.size();
+    bool const ok = output.resize(oldSize + cch);
+    if (ok)
+    {
+        memcpy(output.data() + oldSize, pch, cch);
+    }
+
+    return ok;
+}
+
+template<unsigned N>
+static bool
+TokenEquals(
+    _In_reads_(cch) char const* pch,
+    unsigned cch,
+    char const (&stringLiteral)[N]) noexcept
+{
+    return cch == N - 1 && 0 == memcmp(pch, stringLiteral, N - 1);
+}
+
+static char const*
+SkipSpace(
+    _In_ char const* pch,
+    _In_ char const* pchEnd) noexcept
+{
+    while (pch != pchEnd &&
+        (*pch == ' ' || *pch == '\t' || *pch == '\r' || *pch == '\n'))
+    {
+        pch += 1;
+    }
+
+    return pch;
+}
+
+// pch points at '"'. Returns the position after the closing '"', or null.
+static char const*
+ScanString(
+    _In_ char const* pch,
+    _In_ char const* pchEnd) noexcept
+{
+    ASSERT(pch != pchEnd && *pch == '"');
+
+    for (pch += 1; pch != pchEnd; pch += 1)
+    {
+        if (*pch == '"')
+        {
+            return pch + 1;
+        }
+        else if (*pch == '\\')
+        {
+            pch += 1;
+            if (pch == pchEnd)
+            {
+                break;
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+/*
+pch points at the start of a JSON value. Returns the position after the
+value, or null if the value is not complete. This finds the end of the
+value but does not fully validate it.
+*/
+static char const*
+ScanValue(
+    _In_ char const* pch,
+    _In_ char const* pchEnd) noexcept
+{
+    unsigned depth = 0;
+
+    for (;;)
+    {
+        pch = SkipSpace(pch, pchEnd);
+        if (pch == pchEnd)
+        {
+            return nullptr;
+        }
+
+        char const ch = *pch;
+        if (ch == '"')
+        {
+            pch = ScanString(pch, pchEnd);
+            if (pch == nullptr)
+            {
+                return nullptr;
+            }
+        }
+        else if (ch == '[' || ch == '{')
+        {
+            depth += 1;
+            pch += 1;
+            continue;
+        }
+        else if (ch == ']' || ch == '}')
+        {
+            if (depth == 0)
+            {
+                return nullptr;
+            }
+
+            depth -= 1;
+            pch += 1;
+        }
+        else
+        {
+            // Number or literal.
+            auto const pchStart = pch;
+            while (pch != pchEnd &&
+                ((*pch >= '0' && *pch <= '9') || (*pch >= 'a' && *pch <= 'z') ||
+                    (*pch >= 'A' && *pch <= 'Z') || *pch == '-' || *pch == '+' || *pch == '.'))
+            {
+                pch += 1;
+            }
+
+            if (pch == pchStart)
+            {
+                return nullptr;
+            }
+        }
+
+        if (depth == 0)
+        {
+            return pch;
+        }
+
+        pch = SkipSpace(pch, pchEnd);
+        if (pch != pchEnd && (*pch == ',' || *pch == ':'))
+        {
+            pch += 1;
+        }
+    }
+}
+
+// Consumes optional whitespace and then ch. Returns false if ch is not next.
+static bool
+ConsumeChar(
+    _Inout_ char const** ppch,
+    _In_ char const* pchEnd,
+    char ch) noexcept
+{
+    auto const pch = SkipSpace(*ppch, pchEnd);
+    bool const found = pch != pchEnd && *pch == ch;
+    *ppch = found ? pch + 1 : pch;
+    return found;
+}
+
+// Consumes optional whitespace and a JSON string. Returns false if not found.
+static bool
+ConsumeString(
+    _Inout_ char const** ppch,
+    _In_ char const* pchEnd,
+    _Out_ char const** ppchString,
+    _Out_ unsigned* pcchString) noexcept
+{
+    auto const pch = SkipSpace(*ppch, pchEnd);
+    auto const pchStringEnd = pch != pchEnd && *pch == '"'
+        ? ScanString(pch, pchEnd)
+        : nullptr;
+    *ppchString = pch;
+    *pcchString = pchStringEnd ? static_cast<unsigned>(pchStringEnd - pch) : 0u;
+    *ppch = pchStringEnd ? pchStringEnd : pch;
+    return pchStringEnd != nullptr;
+}
+
+// Consumes optional whitespace and a decimal integer. Returns false if not found.
+static bool
+ConsumeUnsigned(
+    _Inout_ char const** ppch,
+    _In_ char const* pchEnd,
+    _Out_ unsigned* pValue) noexcept
+{
+    auto pch = SkipSpace(*ppch, pchEnd);
+    auto const pchStart = pch;
+    UINT64 value = 0;
+    while (pch != pchEnd && *pch >= '0' && *pch <= '9' && value <= 0xFFFFFFFF)
+    {
+        value = value * 10 + static_cast<unsigned>(*pch - '0');
+        pch += 1;
+    }
+
+    *ppch = pch;
+    *pValue = static_cast<unsigned>(value);
+    return pch != pchStart && value <= 0xFFFFFFFF;
+}
+
+#pragma region EtwJsonSchemaTable
+
+EtwJsonSchemaTable::EtwJsonSchemaTable() noexcept
+    : m_schemas()
+    , m_buckets()
+{
+    return;
+}
+
+EtwJsonSchemaTable::~EtwJsonSchemaTable() noexcept
+{
+    Clear();
+}
+
+void
+EtwJsonSchemaTable::Clear() noexcept
+{
+    for (auto& schema : m_schemas)
+    {
+        HeapFree(GetProcessHeap(), 0, schema.pKeyBlob);
+    }
+
+    m_schemas.clear();
+    m_buckets.clear();
+}
+
+unsigned
+EtwJsonSchemaTable::Count() const noexcept
+{
+    return m_schemas.size();
+}
+
+unsigned
+EtwJsonSchemaTable::Find(
+    EtwInternal::SchemaCache::Key const& key,
+    EtwJsonSuffixFlags jsonSuffixFlags) const noexcept
+{
+    if (m_buckets.size() != 0)
+    {
+        for (unsigned i = m_buckets[key.Hash & (m_buckets.size() - 1)];
+            i != NoSchema;
+            i = m_schemas[i].HashNext)
+        {
+            auto const& schema = m_schemas[i];
+            if (schema.Hash == key.Hash &&
+                schema.JsonSuffixFlags == static_cast<unsigned>(jsonSuffixFlags) &&
+                schema.Flags == key.Flags &&
+                schema.EventProperty == key.EventProperty &&
+                schema.cbSchemaTl == key.cbSchemaTl &&
+                schema.cbProvTraits == key.cbProvTraits &&
+                0 == memcmp(&schema.EventDescriptor, &key.EventDescriptor, sizeof(key.EventDescriptor)) &&
+                0 == memcmp(&schema.ProviderId, &key.ProviderId, sizeof(key.ProviderId)) &&
+                (key.cbSchemaTl == 0 || (
+                    0 == memcmp(schema.pKeyBlob, key.pSchemaTl, key.cbSchemaTl) &&
+                    0 == memcmp(schema.pKeyBlob + key.cbSchemaTl, key.pProvTraits, key.cbProvTraits))))
+            {
+                return i;
+            }
+        }
+    }
+
+    return NoSchema;
+}
+
+bool
+EtwJsonSchemaTable::Add(
+    EtwInternal::SchemaCache::Key const& key,
+    EtwJsonSuffixFlags jsonSuffixFlags) noexcept
+{
+    unsigned const cbKeyBlob = static_cast<unsigned>(key.cbSchemaTl) + key.cbProvTraits;
+
+    Schema schema = {};
+    schema.ProviderId = key.ProviderId;
+    schema.EventDescriptor = key.EventDescriptor;
+    schema.Flags = key.Flags;
+    schema.EventProperty = key.EventProperty;
+    schema.Hash = key.Hash;
+    schema.cbSchemaTl = key.cbSchemaTl;
+    schema.cbProvTraits = key.cbProvTraits;
+    schema.JsonSuffixFlags = jsonSuffixFlags;
+    schema.HashNext = NoSchema;
+
+    if (cbKeyBlob != 0)
+    {
+        schema.pKeyBlob = static_cast<BYTE*>(HeapAlloc(GetProcessHeap(), 0, cbKeyBlob));
+        if (schema.pKeyBlob == nullptr)
+        {
+            return false;
+        }
+
+        memcpy(schema.pKeyBlob, key.pSchemaTl, key.cbSchemaTl);
+        memcpy(schema.pKeyBlob + key.cbSchemaTl, key.pProvTraits, key.cbProvTraits);
+    }
+
+    if (!m_schemas.push_back(schema))
+    {
+        HeapFree(GetProcessHeap(), 0, schema.pKeyBlob);
+        return false;
+    }
+
+    if (m_buckets.size() < m_schemas.size())
+    {
+        // Rehash for an average chain length <= 1.
+        unsigned const bucketCount = m_buckets.size() == 0
+            ? 16u
+            : m_buckets.size() * 2;
+        if (m_buckets.resize(bucketCount, false))
+        {
+            memset(m_buckets.data(), 0xff, m_buckets.byte_size()); // NoSchema
+            for (unsigned i = 0; i != m_schemas.size(); i += 1)
+            {
+                LinkSchema(i);
+            }
+
+            return true;
+        }
+        else if (m_buckets.size() == 0)
+        {
+            m_schemas.pop_back();
+            HeapFree(GetProcessHeap(), 0, schema.pKeyBlob);
+            return false;
+        }
+
+        // Keep the old buckets. Chains get longer, which is ok.
+    }
+
+    LinkSchema(m_schemas.size() - 1);
+    return true;
+}
+
+void
+EtwJsonSchemaTable::RemoveLast() noexcept
+{
+    ASSERT(m_schemas.size() != 0);
+
+    // The last schema is always at the head of its chain.
+    unsigned const schemaId = m_schemas.size() - 1;
+    auto const& schema = m_schemas[schemaId];
+    auto& bucket = m_buckets[schema.Hash & (m_buckets.size() - 1)];
+    ASSERT(bucket == schemaId);
+    bucket = schema.HashNext;
+    HeapFree(GetProcessHeap(), 0, schema.pKeyBlob);
+    m_schemas.pop_back();
+}
+
+void
+EtwJsonSchemaTable::LinkSchema(
+    unsigned schemaId) noexcept
+{
+    auto& schema = m_schemas[schemaId];
+    auto& bucket = m_buckets[schema.Hash & (m_buckets.size() - 1)];
+    schema.HashNext = bucket;
+    bucket = schemaId;
+}
+
+#pragma endregion
+
+#pragma region EtwJsonRehydrator
+
+EtwJsonRehydrator::EtwJsonRehydrator() noexcept
+    : m_schemas()
+    , m_fields()
+    , m_meta()
+    , m_text()
+    , m_output()
+    , m_dynamic()
+{
+    return;
+}
+
+EtwJsonRehydrator::~EtwJsonRehydrator() noexcept
+{
+    return;
+}
+
+void
+EtwJsonRehydrator::Clear() noexcept
+{
+    m_schemas.clear();
+    m_fields.clear();
+    m_meta.clear();
+    m_text.clear();
+}
+
+LSTATUS
+EtwJsonRehydrator::RehydrateRecord(
+    _In_reads_(cchRecord) char const* pchRecord,
+    unsigned cchRecord,
+    EtwOutputSink& sink) noexcept
+{
+    LSTATUS status;
+    auto const pchEnd = pchRecord + cchRecord;
+    auto const pch = SkipSpace(pchRecord, pchEnd);
+
+    if (pch == pchEnd)
+    {
+        status = ERROR_SUCCESS; // Blank.
+    }
+    else if (*pch == '{')
+    {
+        status = AddSchema(pch, static_cast<unsigned>(pchEnd - pch));
+    }
+    else
+    {
+        m_output.clear();
+        status = AddEvent(pch, static_cast<unsigned>(pchEnd - pch));
+        if (status == ERROR_SUCCESS)
+        {
+            status = sink.Write(m_output.data(), m_output.size());
+        }
+    }
+
+    return status;
+}
+
+LSTATUS
+EtwJsonRehydrator::AddSchema(
+    _In_reads_(cch) char const* pch,
+    unsigned cch) noexcept
+{
+    LSTATUS status;
+    auto const pchEnd = pch + cch;
+    auto const oldFieldsSize = m_fields.size();
+    auto const oldMetaSize = m_meta.size();
+    auto const oldTextSize = m_text.size();
+    unsigned schemaId = NoIndex;
+    Schema schema = {};
+
+    schema.FirstField = oldFieldsSize;
+    schema.FieldEnd = oldFieldsSize;
+    schema.FirstMeta = oldMetaSize;
+    schema.IsDefined = true;
+
+    if (!ConsumeChar(&pch, pchEnd, '{'))
+    {
+        status = ERROR_INVALID_DATA;
+        goto Rollback;
+    }
+
+    if (!ConsumeChar(&pch, pchEnd, '}'))
+    {
+        for (;;)
+        {
+            char const* pchName;
+            unsigned cchName;
+            if (!ConsumeString(&pch, pchEnd, &pchName, &cchName) ||
+                !ConsumeChar(&pch, pchEnd, ':'))
+            {
+                status = ERROR_INVALID_DATA;
+                goto Rollback;
+            }
+
+            if (TokenEquals(pchName, cchName, "\"schema\""))
+            {
+                if (!ConsumeUnsigned(&pch, pchEnd, &schemaId))
+                {
+                    status = ERROR_INVALID_DATA;
+                    goto Rollback;
+                }
+            }
+            else if (TokenEquals(pchName, cchName, "\"meta\""))
+            {
+                schema.HasMeta = true;
+                status = AddMeta(&pch, pchEnd);
+                if (status != ERROR_SUCCESS)
+                {
+                    goto Rollback;
+                }
+            }
+            else if (TokenEquals(pchName, cchName, "\"dynamic\""))
+            {
+                auto const oldDynamicMetaSize = m_meta.size();
+                status = AddDynamicNames(&pch, pchEnd);
+                if (status != ERROR_SUCCESS)
+                {
+                    goto Rollback;
+                }
+
+                schema.DynamicCount = m_meta.size() - oldDynamicMetaSize;
+            }
+            else if (TokenEquals(pchName, cchName, "\"fields\""))
+            {
+                status = AddFields(&pch, pchEnd, 0);
+                if (status != ERROR_SUCCESS)
+                {
+                    goto Rollback;
+                }
+
+                schema.FieldEnd = m_fields.size();
+            }
+            else
+            {
+                // Unknown property. Skip it.
+                pch = ScanValue(pch, pchEnd);
+                if (pch == nullptr)
+                {
+                    status = ERROR_INVALID_DATA;
+                    goto Rollback;
+                }
+            }
+
+            if (ConsumeChar(&pch, pchEnd, '}'))
+            {
+                break;
+            }
+            else if (!ConsumeChar(&pch, pchEnd, ','))
+            {
+                status = ERROR_INVALID_DATA;
+                goto Rollback;
+            }
+        }
+    }
+
+    if (schemaId == NoIndex ||
+        schemaId > m_schemas.size() ||
+        SkipSpace(pch, pchEnd) != pchEnd)
+    {
+        status = ERROR_INVALID_DATA;
+        goto Rollback;
+    }
+
+    // Sort the metadata into FormatCurrentEventAsJson order (stable).
+    schema.MetaEnd = m_meta.size();
+    for (unsigned i = schema.FirstMeta + 1; i < schema.MetaEnd; i += 1)
+    {
+        auto const meta = m_meta[i];
+        unsigned j = i;
+        for (; j != schema.FirstMeta && m_meta[j - 1].Rank > meta.Rank; j -= 1)
+        {
+            m_meta[j] = m_meta[j - 1];
+        }
+
+        m_meta[j] = meta;
+    }
+
+    if (schemaId == m_schemas.size())
+    {
+        if (!m_schemas.push_back(schema))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Rollback;
+        }
+    }
+    else
+    {
+        // Replace. The old schema's fields are left unused.
+        m_schemas[schemaId] = schema;
+    }
+
+    status = ERROR_SUCCESS;
+    goto Done;
+
+Rollback:
+
+    m_fields.resize_unchecked(oldFieldsSize);
+    m_meta.resize_unchecked(oldMetaSize);
+    m_text.resize_unchecked(oldTextSize);
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwJsonRehydrator::AddFields(
+    _Inout_ char const** ppch,
+    _In_ char const* pchEnd,
+    unsigned depth) noexcept
+{
+    LSTATUS status;
+    auto pch = *ppch;
+
+    if (depth >= MaxFieldDepth ||
+        !ConsumeChar(&pch, pchEnd, '['))
+    {
+        status = ERROR_INVALID_DATA;
+        goto Done;
+    }
+
+    if (ConsumeChar(&pch, pchEnd, ']'))
+    {
+        status = ERROR_SUCCESS;
+        goto Done;
+    }
+
+    for (;;)
+    {
+        unsigned const fieldIndex = m_fields.size();
+        bool hasName = false;
+
+        if (!ConsumeChar(&pch, pchEnd, '{'))
+        {
+            status = ERROR_INVALID_DATA;
+            goto Done;
+        }
+
+        {
+            Field field = {};
+            if (!m_fields.push_back(field))
+            {
+                status = ERROR_OUTOFMEMORY;
+                goto Done;
+            }
+        }
+
+        if (!ConsumeChar(&pch, pchEnd, '}'))
+        {
+            for (;;)
+            {
+                char const* pchName;
+                unsigned cchName;
+                if (!ConsumeString(&pch, pchEnd, &pchName, &cchName) ||
+                    !ConsumeChar(&pch, pchEnd, ':'))
+                {
+                    status = ERROR_INVALID_DATA;
+                    goto Done;
+                }
+
+                if (TokenEquals(pchName, cchName, "\"name\""))
+                {
+                    char const* pchValue;
+                    unsigned cchValue;
+                    if (!ConsumeString(&pch, pchEnd, &pchValue, &cchValue))
+                    {
+                        status = ERROR_INVALID_DATA;
+                        goto Done;
+                    }
+
+                    m_fields[fieldIndex].NameOffset = m_text.size();
+                    m_fields[fieldIndex].NameLength = cchValue;
+                    if (!AppendText(m_text, pchValue, cchValue))
+                    {
+                        status = ERROR_OUTOFMEMORY;
+                        goto Done;
+                    }
+
+                    hasName = true;
+                }
+                else if (TokenEquals(pchName, cchName, "\"fields\""))
+                {
+                    m_fields[fieldIndex].IsStruct = true;
+                    status = AddFields(&pch, pchEnd, depth + 1);
+                    if (status != ERROR_SUCCESS)
+                    {
+                        goto Done;
+                    }
+                }
+                else
+                {
+                    auto const pchValue = SkipSpace(pch, pchEnd);
+                    pch = ScanValue(pchValue, pchEnd);
+                    if (pch == nullptr)
+                    {
+                        status = ERROR_INVALID_DATA;
+                        goto Done;
+                    }
+
+                    if (TokenEquals(pchName, cchName, "\"array\""))
+                    {
+                        m_fields[fieldIndex].IsArray =
+                            TokenEquals(pchValue, static_cast<unsigned>(pch - pchValue), "true");
+                    }
+                }
+
+                if (ConsumeChar(&pch, pchEnd, '}'))
+                {
+                    break;
+                }
+                else if (!ConsumeChar(&pch, pchEnd, ','))
+                {
+                    status = ERROR_INVALID_DATA;
+                    goto Done;
+                }
+            }
+        }
+
+        if (!hasName)
+        {
+            status = ERROR_INVALID_DATA;
+            goto Done;
+        }
+
+        m_fields[fieldIndex].End = m_fields.size();
+
+        if (ConsumeChar(&pch, pchEnd, ']'))
+        {
+            break;
+        }
+        else if (!ConsumeChar(&pch, pchEnd, ','))
+        {
+            status = ERROR_INVALID_DATA;
+            goto Done;
+        }
+    }
+
+    status = ERROR_SUCCESS;
+
+Done:
+
+    *ppch = pch;
+    return status;
+}
+
+LSTATUS
+EtwJsonRehydrator::AddMeta(
+    _Inout_ char const** ppch,
+    _In_ char const* pchEnd) noexcept
+{
+    LSTATUS status;
+    auto pch = *ppch;
+
+    if (!ConsumeChar(&pch, pchEnd, '{'))
+    {
+        status = ERROR_INVALID_DATA;
+        goto Done;
+    }
+
+    if (ConsumeChar(&pch, pchEnd, '}'))
+    {
+        status = ERROR_SUCCESS;
+        goto Done;
+    }
+
+    for (;;)
+    {
+        Meta meta = {};
+        char const* pchName;
+        unsigned cchName;
+        if (!ConsumeString(&pch, pchEnd, &pchName, &cchName) ||
+            !ConsumeChar(&pch, pchEnd, ':'))
+        {
+            status = ERROR_INVALID_DATA;
+            goto Done;
+        }
+
+        auto const pchValue = SkipSpace(pch, pchEnd);
+        pch = ScanValue(pchValue, pchEnd);
+        if (pch == nullptr)
+        {
+            status = ERROR_INVALID_DATA;
+            goto Done;
+        }
+
+        meta.Rank = _countof(MetaNames);
+        for (unsigned i = 0; i != _countof(MetaNames); i += 1)
+        {
+            if (cchName == strlen(MetaNames[i]) &&
+                0 == memcmp(pchName, MetaNames[i], cchName))
+            {
+                meta.Rank = i;
+                break;
+            }
+        }
+
+        meta.DynamicIndex = NoIndex;
+        meta.NameOffset = m_text.size();
+        meta.NameLength = cchName;
+        meta.ValueOffset = meta.NameOffset + cchName;
+        meta.ValueLength = static_cast<unsigned>(pch - pchValue);
+        if (!AppendText(m_text, pchName, cchName) ||
+            !AppendText(m_text, pchValue, meta.ValueLength) ||
+            !m_meta.push_back(meta))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        if (ConsumeChar(&pch, pchEnd, '}'))
+        {
+            break;
+        }
+        else if (!ConsumeChar(&pch, pchEnd, ','))
+        {
+            status = ERROR_INVALID_DATA;
+            goto Done;
+        }
+    }
+
+    status = ERROR_SUCCESS;
+
+Done:
+
+    *ppch = pch;
+    return status;
+}
+
+LSTATUS
+EtwJsonRehydrator::AddDynamicNames(
+    _Inout_ char const** ppch,
+    _In_ char const* pchEnd) noexcept
+{
+    LSTATUS status;
+    auto pch = *ppch;
+    unsigned dynamicIndex = 0;
+
+    if (!ConsumeChar(&pch, pchEnd, '['))
+    {
+        status = ERROR_INVALID_DATA;
+        goto Done;
+    }
+
+    if (ConsumeChar(&pch, pchEnd, ']'))
+    {
+        status = ERROR_SUCCESS;
+        goto Done;
+    }
+
+    for (;;)
+    {
+        Meta meta = {};
+        char const* pchName;
+        unsigned cchName;
+        if (!ConsumeString(&pch, pchEnd, &pchName, &cchName))
+        {
+            status = ERROR_INVALID_DATA;
+            goto Done;
+        }
+
+        meta.Rank = _countof(MetaNames);
+        for (unsigned i = 0; i != _countof(MetaNames); i += 1)
+        {
+            if (cchName == strlen(MetaNames[i]) &&
+                0 == memcmp(pchName, MetaNames[i], cchName))
+            {
+                meta.Rank = i;
+                break;
+            }
+        }
+
+        meta.DynamicIndex = dynamicIndex;
+        meta.NameOffset = m_text.size();
+        meta.NameLength = cchName;
+        if (!AppendText(m_text, pchName, cchName) ||
+            !m_meta.push_back(meta))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        dynamicIndex += 1;
+
+        if (ConsumeChar(&pch, pchEnd, ']'))
+        {
+            break;
+        }
+        else if (!ConsumeChar(&pch, pchEnd, ','))
+        {
+            status = ERROR_INVALID_DATA;
+            goto Done;
+        }
+    }
+
+    status = ERROR_SUCCESS;
+
+Done:
+
+    *ppch = pch;
+    return status;
+}
+
+LSTATUS
+EtwJsonRehydrator::AddEvent(
+    _In_reads_(cch) char const* pch,
+    unsigned cch) noexcept
+{
+    LSTATUS status;
+    auto const pchRecord = pch;
+    auto const pchEnd = pch + cch;
+    unsigned schemaId;
+    Schema schema;
+
+    m_dynamic.clear();
+
+    if (!ConsumeChar(&pch, pchEnd, '[') ||
+        !ConsumeUnsigned(&pch, pchEnd, &schemaId) ||
+        schemaId >= m_schemas.size() ||
+        !m_schemas[schemaId].IsDefined ||
+        !ConsumeChar(&pch, pchEnd, ','))
+    {
+        status = ERROR_INVALID_DATA;
+        goto Done;
+    }
+
+    schema = m_schemas[schemaId];
+
+    if (!m_output.push_back('{'))
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto Done;
+    }
+
+    status = AddStructValues(schema.FirstField, schema.FieldEnd, &pch, pchEnd);
+    if (status != ERROR_SUCCESS)
+    {
+        goto Done;
+    }
+
+    if (ConsumeChar(&pch, pchEnd, ','))
+    {
+        // Dynamic metadata values.
+        if (!ConsumeChar(&pch, pchEnd, '['))
+        {
+            status = ERROR_INVALID_DATA;
+            goto Done;
+        }
+
+        if (!ConsumeChar(&pch, pchEnd, ']'))
+        {
+            for (;;)
+            {
+                auto const pchValue = SkipSpace(pch, pchEnd);
+                pch = ScanValue(pchValue, pchEnd);
+                if (pch == nullptr)
+                {
+                    status = ERROR_INVALID_DATA;
+                    goto Done;
+                }
+
+                if (!m_dynamic.push_back(static_cast<unsigned>(pchValue - pchRecord)) ||
+                    !m_dynamic.push_back(static_cast<unsigned>(pch - pchValue)))
+                {
+                    status = ERROR_OUTOFMEMORY;
+                    goto Done;
+                }
+
+                if (ConsumeChar(&pch, pchEnd, ']'))
+                {
+                    break;
+                }
+                else if (!ConsumeChar(&pch, pchEnd, ','))
+                {
+                    status = ERROR_INVALID_DATA;
+                    goto Done;
+                }
+            }
+        }
+    }
+
+    if (!ConsumeChar(&pch, pchEnd, ']') ||
+        SkipSpace(pch, pchEnd) != pchEnd)
+    {
+        status = ERROR_INVALID_DATA;
+        goto Done;
+    }
+
+    if (schema.HasMeta)
+    {
+        bool needComma = false;
+
+        if ((m_output.size() != 1 && !m_output.push_back(',')) ||
+            !AppendText(m_output, "\"meta\":{", 8))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        for (unsigned i = schema.FirstMeta; i != schema.MetaEnd; i += 1)
+        {
+            auto const& meta = m_meta[i];
+            char const* pchValue;
+            unsigned cchValue;
+            if (meta.DynamicIndex == NoIndex)
+            {
+                pchValue = m_text.data() + meta.ValueOffset;
+                cchValue = meta.ValueLength;
+            }
+            else if (meta.DynamicIndex < m_dynamic.size() / 2)
+            {
+                pchValue = pchRecord + m_dynamic[meta.DynamicIndex * 2];
+                cchValue = m_dynamic[meta.DynamicIndex * 2 + 1];
+                if (TokenEquals(pchValue, cchValue, "null"))
+                {
+                    continue; // Omitted for this event.
+                }
+            }
+            else
+            {
+                continue; // Not present.
+            }
+
+            if ((needComma && !m_output.push_back(',')) ||
+                !AppendText(m_output, m_text.data() + meta.NameOffset, meta.NameLength) ||
+                !m_output.push_back(':') ||
+                !AppendText(m_output, pchValue, cchValue))
+            {
+                status = ERROR_OUTOFMEMORY;
+                goto Done;
+            }
+
+            needComma = true;
+        }
+
+        if (!m_output.push_back('}'))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+    }
+
+    if (!AppendText(m_output, "}\n", 2))
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto Done;
+    }
+
+    status = ERROR_SUCCESS;
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwJsonRehydrator::AddStructValues(
+    unsigned firstField,
+    unsigned fieldEnd,
+    _Inout_ char const** ppch,
+    _In_ char const* pchEnd) noexcept
+{
+    // Consumes an array of values and writes them as name:value pairs.
+    // There must be one value per field.
+    LSTATUS status;
+    auto pch = *ppch;
+    unsigned fieldIndex = firstField;
+
+    if (!ConsumeChar(&pch, pchEnd, '['))
+    {
+        status = ERROR_INVALID_DATA;
+        goto Done;
+    }
+
+    if (ConsumeChar(&pch, pchEnd, ']'))
+    {
+        status = fieldIndex == fieldEnd ? ERROR_SUCCESS : ERROR_INVALID_DATA;
+        goto Done;
+    }
+
+    for (;;)
+    {
+        if (fieldIndex >= fieldEnd)
+        {
+            status = ERROR_INVALID_DATA;
+            goto Done;
+        }
+
+        auto const& field = m_fields[fieldIndex];
+        if ((fieldIndex != firstField && !m_output.push_back(',')) ||
+            !AppendText(m_output, m_text.data() + field.NameOffset, field.NameLength) ||
+            !m_output.push_back(':'))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        status = AddFieldValue(fieldIndex, &pch, pchEnd);
+        if (status != ERROR_SUCCESS)
+        {
+            goto Done;
+        }
+
+        fieldIndex = m_fields[fieldIndex].End;
+
+        if (ConsumeChar(&pch, pchEnd, ']'))
+        {
+            break;
+        }
+        else if (!ConsumeChar(&pch, pchEnd, ','))
+        {
+            status = ERROR_INVALID_DATA;
+            goto Done;
+        }
+    }
+
+    status = fieldIndex == fieldEnd ? ERROR_SUCCESS : ERROR_INVALID_DATA;
+
+Done:
+
+    *ppch = pch;
+    return status;
+}
+
+LSTATUS
+EtwJsonRehydrator::AddFieldValue(
+    unsigned fieldIndex,
+    _Inout_ char const** ppch,
+    _In_ char const* pchEnd) noexcept
+{
+    LSTATUS status;
+    auto pch = *ppch;
+    auto const field = m_fields[fieldIndex];
+
+    if (!field.IsStruct)
+    {
+        // Value or array of values: copy as-is.
+        auto const pchValue = SkipSpace(pch, pchEnd);
+        pch = ScanValue(pchValue, pchEnd);
+        if (pch == nullptr)
+        {
+            status = ERROR_INVALID_DATA;
+        }
+        else if (!AppendText(m_output, pchValue, static_cast<unsigned>(pch - pchValue)))
+        {
+            status = ERROR_OUTOFMEMORY;
+        }
+        else
+        {
+            status = ERROR_SUCCESS;
+        }
+    }
+    else if (!field.IsArray)
+    {
+        if (!m_output.push_back('{'))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        status = AddStructValues(fieldIndex + 1, field.End, &pch, pchEnd);
+        if (status != ERROR_SUCCESS)
+        {
+            goto Done;
+        }
+
+        if (!m_output.push_back('}'))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+    }
+    else
+    {
+        // Array of structs.
+        if (!ConsumeChar(&pch, pchEnd, '['))
+        {
+            status = ERROR_INVALID_DATA;
+            goto Done;
+        }
+
+        if (!m_output.push_back('['))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        if (!ConsumeChar(&pch, pchEnd, ']'))
+        {
+            for (;;)
+            {
+                if (!m_output.push_back('{'))
+                {
+                    status = ERROR_OUTOFMEMORY;
+                    goto Done;
+                }
+
+                status = AddStructValues(fieldIndex + 1, field.End, &pch, pchEnd);
+                if (status != ERROR_SUCCESS)
+                {
+                    goto Done;
+                }
+
+                if (!m_output.push_back('}'))
+                {
+                    status = ERROR_OUTOFMEMORY;
+                    goto Done;
+                }
+
+                if (ConsumeChar(&pch, pchEnd, ']'))
+                {
+                    break;
+                }
+                else if (!ConsumeChar(&pch, pchEnd, ',') ||
+                    !m_output.push_back(','))
+                {
+                    status = ERROR_INVALID_DATA;
+                    goto Done;
+                }
+            }
+        }
+
+        if (!m_output.push_back(']'))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        status = ERROR_SUCCESS;
+    }
+
+Done:
+
+    *ppch = pch;
+    return status;
+}
+
+#pragma endregion
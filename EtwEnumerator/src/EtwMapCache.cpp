@@ -0,0 +1,479 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "stdafx.h"
+#include <EtwEnumerator.h>
+#include "EtwBuffer.inl"
+#include "EtwUtility.inl"
+#include <stdlib.h> // qsort
+
+/*
+Implementation of EtwInternal::MapCache and EtwInternal::MapIndex, the
+EVENT_MAP_INFO cache used by EtwEnumerator's format methods.
+*/
+
+static unsigned
+LowestBit(
+    UINT64 bits) noexcept
+{
+    ASSERT(bits != 0);
+    unsigned long index;
+    if (!_BitScanForward(&index, static_cast<ULONG>(bits)))
+    {
+        _BitScanForward(&index, static_cast<ULONG>(bits >> 32));
+        index += 32;
+    }
+    return index;
+}
+
+static int __cdecl
+CompareSlotPairs(
+    void const* p1,
+    void const* p2) noexcept
+{
+    // Sort by value, then by entry position.
+    auto const pPair1 = static_cast<ULONG const*>(p1);
+    auto const pPair2 = static_cast<ULONG const*>(p2);
+    return
+        pPair1[0] != pPair2[0] ? (pPair1[0] < pPair2[0] ? -1 : 1)
+        : pPair1[1] != pPair2[1] ? (pPair1[1] < pPair2[1] ? -1 : 1)
+        : 0;
+}
+
+using EtwInternal::MapIndex;
+
+/*
+Returns the size of the index (MapIndex plus slots) for the specified map.
+Sets *pKind to the kind of index to build. Matches the formatting rules of
+EtwEnumeratorCallbacks::FormatMapValue.
+*/
+static unsigned
+PlanMapIndex(
+    _In_reads_bytes_opt_(cbMapInfo) EVENT_MAP_INFO const* pMapInfo,
+    unsigned cbMapInfo,
+    _Out_ EtwInternal::MapIndexKind* pKind,
+    _Out_ ULONG* pMinValue,
+    _Out_ ULONG* pSlotCount) noexcept
+{
+    unsigned const cbHeader = static_cast<unsigned>(offsetof(MapIndex, Slots));
+    ULONG const entryCount = pMapInfo ? pMapInfo->EntryCount : 0;
+    ULONG minValue;
+    ULONG maxValue;
+
+    *pKind = EtwInternal::MapIndexKind_Scan;
+    *pMinValue = 0;
+    *pSlotCount = 0;
+
+    if (pMapInfo == nullptr ||
+        cbMapInfo < offsetof(EVENT_MAP_INFO, MapEntryArray) ||
+        entryCount > (cbMapInfo - offsetof(EVENT_MAP_INFO, MapEntryArray)) / sizeof(EVENT_MAP_ENTRY))
+    {
+        return cbHeader;
+    }
+
+    switch (pMapInfo->Flag & ~EVENTMAP_INFO_FLAG_WBEM_NO_MAP)
+    {
+    case EVENTMAP_INFO_FLAG_MANIFEST_VALUEMAP:
+    case EVENTMAP_INFO_FLAG_WBEM_VALUEMAP:
+
+        if ((pMapInfo->Flag & EVENTMAP_INFO_FLAG_WBEM_NO_MAP) ||
+            entryCount == 0)
+        {
+            // Indexed value maps are already O(1).
+            break;
+        }
+
+        minValue = maxValue = pMapInfo->MapEntryArray[0].Value;
+        for (ULONG i = 1; i != entryCount; i += 1)
+        {
+            ULONG const value = pMapInfo->MapEntryArray[i].Value;
+            minValue = value < minValue ? value : minValue;
+            maxValue = value > maxValue ? value : maxValue;
+        }
+
+        if (maxValue - minValue < 2 * entryCount + 16)
+        {
+            *pKind = EtwInternal::MapIndexKind_Dense;
+            *pMinValue = minValue;
+            *pSlotCount = maxValue - minValue + 1;
+            return cbHeader + *pSlotCount * static_cast<unsigned>(sizeof(ULONG));
+        }
+        else if (entryCount < 0x10000000)
+        {
+            *pKind = EtwInternal::MapIndexKind_Sorted;
+            *pSlotCount = entryCount;
+            return cbHeader + entryCount * 2 * static_cast<unsigned>(sizeof(ULONG));
+        }
+        break;
+
+    case EVENTMAP_INFO_FLAG_MANIFEST_BITMAP:
+    case EVENTMAP_INFO_FLAG_WBEM_BITMAP:
+    case EVENTMAP_INFO_FLAG_WBEM_VALUEMAP | EVENTMAP_INFO_FLAG_WBEM_FLAG:
+
+        if (entryCount <= 64)
+        {
+            *pKind = EtwInternal::MapIndexKind_Bitmap;
+        }
+        break;
+    }
+
+    return cbHeader;
+}
+
+static void
+BuildMapIndex(
+    _In_ EVENT_MAP_INFO const* pMapInfo,
+    _Inout_ MapIndex* pIndex) noexcept
+{
+    ULONG const entryCount = pMapInfo->EntryCount;
+
+    switch (pIndex->Kind)
+    {
+    case EtwInternal::MapIndexKind_Dense:
+        memset(pIndex->Slots, 0xff, pIndex->SlotCount * sizeof(ULONG)); // NoEntry
+        for (ULONG i = 0; i != entryCount; i += 1)
+        {
+            auto& slot = pIndex->Slots[pMapInfo->MapEntryArray[i].Value - pIndex->MinValue];
+            if (slot == MapIndex::NoEntry)
+            {
+                slot = i; // First match wins.
+            }
+        }
+        break;
+
+    case EtwInternal::MapIndexKind_Sorted:
+    {
+        ULONG* const pPairs = pIndex->Slots;
+        ULONG count = 0;
+
+        for (ULONG i = 0; i != entryCount; i += 1)
+        {
+            pPairs[i * 2] = pMapInfo->MapEntryArray[i].Value;
+            pPairs[i * 2 + 1] = i;
+        }
+
+        qsort(pPairs, entryCount, 2 * sizeof(ULONG), CompareSlotPairs);
+
+        // Keep only the first entry for each value.
+        for (ULONG i = 0; i != entryCount; i += 1)
+        {
+            if (count == 0 || pPairs[(count - 1) * 2] != pPairs[i * 2])
+            {
+                pPairs[count * 2] = pPairs[i * 2];
+                pPairs[count * 2 + 1] = pPairs[i * 2 + 1];
+                count += 1;
+            }
+        }
+
+        pIndex->SlotCount = count;
+        break;
+    }
+
+    case EtwInternal::MapIndexKind_Bitmap:
+        for (ULONG i = 0; i != entryCount; i += 1)
+        {
+            ULONG const mask = pMapInfo->MapEntryArray[i].Value;
+            UINT64 const entryBit = UINT64(1) << i;
+            if (mask != 0 && (mask & (mask - 1)) == 0)
+            {
+                pIndex->BitEntries[LowestBit(mask)] |= entryBit;
+            }
+            else
+            {
+                pIndex->ComplexEntries |= entryBit;
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+namespace EtwInternal
+{
+    ULONG
+    MapIndex::FindValue(
+        ULONG value) const noexcept
+    {
+        ULONG entry = NoEntry;
+
+        if (Kind == MapIndexKind_Dense)
+        {
+            ULONG const slot = value - MinValue;
+            if (slot < SlotCount)
+            {
+                entry = Slots[slot];
+            }
+        }
+        else
+        {
+            ASSERT(Kind == MapIndexKind_Sorted);
+            ULONG lo = 0;
+            ULONG hi = SlotCount;
+            while (lo != hi)
+            {
+                ULONG const mid = lo + (hi - lo) / 2;
+                ULONG const midValue = Slots[mid * 2];
+                if (midValue < value)
+                {
+                    lo = mid + 1;
+                }
+                else if (value < midValue)
+                {
+                    hi = mid;
+                }
+                else
+                {
+                    entry = Slots[mid * 2 + 1];
+                    break;
+                }
+            }
+        }
+
+        return entry;
+    }
+
+    UINT64
+    MapIndex::FindBits(
+        _In_ EVENT_MAP_INFO const* pMapInfo,
+        ULONG value) const noexcept
+    {
+        ASSERT(Kind == MapIndexKind_Bitmap);
+
+        UINT64 matched = 0;
+
+        for (ULONG bits = value; bits != 0; bits &= bits - 1)
+        {
+            matched |= BitEntries[LowestBit(bits)];
+        }
+
+        for (UINT64 complex = ComplexEntries; complex != 0; complex &= complex - 1)
+        {
+            unsigned const i = LowestBit(complex);
+            ULONG const mask = pMapInfo->MapEntryArray[i].Value;
+            if ((value & mask) == mask &&
+                (mask != 0 || value == 0))
+            {
+                matched |= UINT64(1) << i;
+            }
+        }
+
+        return matched;
+    }
+
+    MapCache::MapCache() noexcept
+        : m_entries()
+        , m_buckets()
+        , m_capacity(1024)
+    {
+        return;
+    }
+
+    MapCache::~MapCache() noexcept
+    {
+        for (auto& entry : m_entries)
+        {
+            HeapFree(GetProcessHeap(), 0, entry.pBlob);
+        }
+    }
+
+    unsigned
+    MapCache::Capacity() const noexcept
+    {
+        return m_capacity;
+    }
+
+    void
+    MapCache::SetCapacity(
+        unsigned capacity) noexcept
+    {
+        Clear();
+        m_buckets.clear(); // Resized for the new capacity on next Insert.
+        m_capacity = capacity;
+    }
+
+    void
+    MapCache::Clear() noexcept
+    {
+        for (auto& entry : m_entries)
+        {
+            HeapFree(GetProcessHeap(), 0, entry.pBlob);
+        }
+
+        m_entries.clear();
+        if (m_buckets.size() != 0)
+        {
+            memset(m_buckets.data(), 0xff, m_buckets.byte_size()); // NoEntry
+        }
+    }
+
+    void
+    MapCache::MakeKey(
+        _In_ EVENT_RECORD const* pEventRecord,
+        _In_ EtwPCWSTR pMapName,
+        _Out_ Key* pKey) noexcept
+    {
+        pKey->ProviderId = pEventRecord->EventHeader.ProviderId;
+        pKey->cchMapName = static_cast<unsigned>(wcslen(pMapName));
+        pKey->pMapName = pMapName;
+
+        UINT64 hash = HashBytes(0, &pKey->ProviderId, sizeof(pKey->ProviderId));
+        hash = HashBytes(hash, pMapName, pKey->cchMapName * sizeof(EtwWCHAR));
+        pKey->Hash = static_cast<unsigned>(hash ^ (hash >> 32));
+    }
+
+    bool
+    MapCache::Find(
+        Key const& key,
+        _Outptr_result_maybenull_ EVENT_MAP_INFO const** ppMapInfo,
+        _Outptr_result_maybenull_ MapIndex const** ppMapIndex) noexcept
+    {
+        *ppMapInfo = nullptr;
+        *ppMapIndex = nullptr;
+
+        if (m_buckets.size() != 0)
+        {
+            auto const bucketMask = m_buckets.size() - 1;
+            for (unsigned i = m_buckets[key.Hash & bucketMask]; i != NoEntry; i = m_entries[i].HashNext)
+            {
+                auto const& entry = m_entries[i];
+                if (entry.Hash == key.Hash &&
+                    entry.cchMapName == key.cchMapName &&
+                    0 == memcmp(&entry.ProviderId, &key.ProviderId, sizeof(key.ProviderId)))
+                {
+                    auto const pbName = entry.pBlob + entry.cbMapAligned;
+                    auto const cbName = key.cchMapName * static_cast<unsigned>(sizeof(EtwWCHAR));
+                    if (0 == memcmp(pbName, key.pMapName, cbName))
+                    {
+                        if (entry.cbMapAligned != 0)
+                        {
+                            *ppMapInfo = reinterpret_cast<EVENT_MAP_INFO const*>(entry.pBlob);
+                            *ppMapIndex = reinterpret_cast<MapIndex const*>(pbName + AlignBlobSize(cbName));
+                        }
+
+                        return true;
+                    }
+                }
+            }
+        }
+
+        return false;
+    }
+
+    bool
+    MapCache::Insert(
+        Key const& key,
+        _In_reads_bytes_opt_(cbMapInfo) EVENT_MAP_INFO const* pMapInfo,
+        unsigned cbMapInfo,
+        _Outptr_result_maybenull_ EVENT_MAP_INFO const** ppMapInfo,
+        _Outptr_result_maybenull_ MapIndex const** ppMapIndex) noexcept
+    {
+        bool ok = false;
+        MapIndexKind kind;
+        ULONG minValue;
+        ULONG slotCount;
+        BYTE* pBlob;
+        unsigned index;
+
+        *ppMapInfo = nullptr;
+        *ppMapIndex = nullptr;
+
+        if (pMapInfo == nullptr)
+        {
+            cbMapInfo = 0;
+        }
+
+        auto const cbMapAligned = AlignBlobSize(cbMapInfo);
+        auto const cbIndexAligned = AlignBlobSize(PlanMapIndex(pMapInfo, cbMapInfo, &kind, &minValue, &slotCount));
+        auto const cbName = key.cchMapName * static_cast<unsigned>(sizeof(EtwWCHAR));
+        auto const cbNameAligned = AlignBlobSize(cbName);
+
+        if (m_capacity == 0 ||
+            cbMapAligned < cbMapInfo ||
+            cbNameAligned < cbName ||
+            cbMapAligned + cbNameAligned < cbMapAligned ||
+            cbMapAligned + cbNameAligned + cbIndexAligned < cbIndexAligned)
+        {
+            goto Done;
+        }
+
+        if (m_buckets.size() == 0)
+        {
+            // Size the hash table for an average chain length <= 1.
+            unsigned bucketCount = 16;
+            while (bucketCount < m_capacity && bucketCount < 0x10000000)
+            {
+                bucketCount *= 2;
+            }
+
+            if (!m_buckets.resize(bucketCount, false))
+            {
+                goto Done;
+            }
+
+            memset(m_buckets.data(), 0xff, m_buckets.byte_size()); // NoEntry
+        }
+
+        pBlob = static_cast<BYTE*>(HeapAlloc(
+            GetProcessHeap(),
+            0,
+            cbMapAligned + cbNameAligned + cbIndexAligned));
+        if (pBlob == nullptr)
+        {
+            goto Done;
+        }
+
+        if (m_entries.size() >= m_capacity)
+        {
+            // Full. Maps are small and few, so start over.
+            Clear();
+        }
+
+        index = m_entries.size();
+        if (!m_entries.push_back(Entry()))
+        {
+            HeapFree(GetProcessHeap(), 0, pBlob);
+            goto Done;
+        }
+
+        {
+            auto const pIndex = reinterpret_cast<MapIndex*>(pBlob + cbMapAligned + cbNameAligned);
+            memcpy(pBlob, pMapInfo, cbMapInfo);
+            memcpy(pBlob + cbMapAligned, key.pMapName, cbName);
+            memset(pIndex, 0, offsetof(MapIndex, Slots));
+            pIndex->Kind = kind;
+            pIndex->MinValue = minValue;
+            pIndex->SlotCount = slotCount;
+            if (kind != MapIndexKind_Scan)
+            {
+                BuildMapIndex(reinterpret_cast<EVENT_MAP_INFO const*>(pBlob), pIndex);
+            }
+
+            if (cbMapInfo != 0)
+            {
+                *ppMapInfo = reinterpret_cast<EVENT_MAP_INFO const*>(pBlob);
+                *ppMapIndex = pIndex;
+            }
+        }
+
+        {
+            auto& entry = m_entries[index];
+            auto& bucket = m_buckets[key.Hash & (m_buckets.size() - 1)];
+            entry.ProviderId = key.ProviderId;
+            entry.Hash = key.Hash;
+            entry.cchMapName = key.cchMapName;
+            entry.cbMapAligned = cbMapAligned;
+            entry.pBlob = pBlob;
+            entry.HashNext = bucket;
+            bucket = index;
+        }
+
+        ok = true;
+
+    Done:
+
+        return ok;
+    }
+}
+// namespace EtwInternal
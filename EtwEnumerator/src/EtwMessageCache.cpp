@@ -0,0 +1,176 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "stdafx.h"
+#include <EtwEnumerator.h>
+#include "EtwBuffer.inl"
+#include "EtwUtility.inl"
+
+/*
+Implementation of EtwInternal::MessageCache, the compiled event message cache
+used by EtwEnumerator::FormatCurrentEvent.
+*/
+
+namespace EtwInternal
+{
+    MessageCache::MessageCache() noexcept
+        : m_entries()
+        , m_buckets()
+        , m_capacity(256)
+    {
+        return;
+    }
+
+    MessageCache::~MessageCache() noexcept
+    {
+        for (auto& entry : m_entries)
+        {
+            HeapFree(GetProcessHeap(), 0, entry.pBlob);
+        }
+    }
+
+    unsigned
+    MessageCache::Capacity() const noexcept
+    {
+        return m_capacity;
+    }
+
+    void
+    MessageCache::SetCapacity(
+        unsigned capacity) noexcept
+    {
+        Clear();
+        m_buckets.clear(); // Resized for the new capacity on next Insert.
+        m_capacity = capacity;
+    }
+
+    void
+    MessageCache::Clear() noexcept
+    {
+        for (auto& entry : m_entries)
+        {
+            HeapFree(GetProcessHeap(), 0, entry.pBlob);
+        }
+
+        m_entries.clear();
+        if (m_buckets.size() != 0)
+        {
+            memset(m_buckets.data(), 0xff, m_buckets.byte_size()); // NoEntry
+        }
+    }
+
+    void
+    MessageCache::MakeKey(
+        _In_z_ EtwPCWSTR szMessage,
+        _Out_ Key* pKey) noexcept
+    {
+        // Hash the address, not the content. The content is compared by Find.
+        UINT64 hash = reinterpret_cast<UINT_PTR>(szMessage) * HashMultiplier;
+        pKey->Hash = static_cast<unsigned>(hash >> 32);
+        pKey->cchMessage = static_cast<unsigned>(wcslen(szMessage));
+        pKey->pMessage = szMessage;
+    }
+
+    _Ret_maybenull_ void const*
+    MessageCache::Find(
+        Key const& key) const noexcept
+    {
+        if (m_buckets.size() != 0)
+        {
+            auto const bucketMask = m_buckets.size() - 1;
+            for (unsigned i = m_buckets[key.Hash & bucketMask]; i != NoEntry; i = m_entries[i].HashNext)
+            {
+                auto const& entry = m_entries[i];
+                auto const cbMessage = key.cchMessage * static_cast<unsigned>(sizeof(EtwWCHAR));
+                if (entry.pMessage == key.pMessage &&
+                    entry.cchMessage == key.cchMessage &&
+                    0 == memcmp(entry.pBlob, key.pMessage, cbMessage))
+                {
+                    return entry.pBlob + AlignBlobSize(cbMessage);
+                }
+            }
+        }
+
+        return nullptr;
+    }
+
+    _Ret_maybenull_ void const*
+    MessageCache::Insert(
+        Key const& key,
+        _In_reads_bytes_(cbCompiled) void const* pCompiled,
+        unsigned cbCompiled) noexcept
+    {
+        void const* pCachedCompiled = nullptr;
+        BYTE* pBlob;
+        unsigned index;
+
+        auto const cbMessage = key.cchMessage * static_cast<unsigned>(sizeof(EtwWCHAR));
+        auto const cbMessageAligned = AlignBlobSize(cbMessage);
+
+        if (m_capacity == 0 ||
+            key.cchMessage > 0x10000000 ||
+            cbMessageAligned + cbCompiled < cbCompiled)
+        {
+            goto Done;
+        }
+
+        if (m_buckets.size() == 0)
+        {
+            // Size the hash table for an average chain length <= 1.
+            unsigned bucketCount = 16;
+            while (bucketCount < m_capacity && bucketCount < 0x10000000)
+            {
+                bucketCount *= 2;
+            }
+
+            if (!m_buckets.resize(bucketCount, false))
+            {
+                goto Done;
+            }
+
+            memset(m_buckets.data(), 0xff, m_buckets.byte_size()); // NoEntry
+        }
+
+        pBlob = static_cast<BYTE*>(HeapAlloc(
+            GetProcessHeap(),
+            0,
+            cbMessageAligned + cbCompiled));
+        if (pBlob == nullptr)
+        {
+            goto Done;
+        }
+
+        if (m_entries.size() >= m_capacity)
+        {
+            // Full. Messages are few, so start over.
+            Clear();
+        }
+
+        index = m_entries.size();
+        if (!m_entries.push_back(Entry()))
+        {
+            HeapFree(GetProcessHeap(), 0, pBlob);
+            goto Done;
+        }
+
+        memcpy(pBlob, key.pMessage, cbMessage);
+        memcpy(pBlob + cbMessageAligned, pCompiled, cbCompiled);
+        pCachedCompiled = pBlob + cbMessageAligned;
+
+        {
+            auto& entry = m_entries[index];
+            auto& bucket = m_buckets[key.Hash & (m_buckets.size() - 1)];
+            entry.pMessage = key.pMessage;
+            entry.Hash = key.Hash;
+            entry.cchMessage = key.cchMessage;
+            entry.pBlob = pBlob;
+            entry.HashNext = bucket;
+            bucket = index;
+        }
+
+    Done:
+
+        return pCachedCompiled;
+    }
+}
+// namespace EtwInternal
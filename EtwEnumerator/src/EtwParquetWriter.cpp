@@ -0,0 +1,1584 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "stdafx.h"
+#include <EtwEnumerator.h>
+#include "EtwBuffer.inl"
+#include "EtwUtility.inl"
+
+/*
+Implementation of EtwParquetWriter.
+This code is in a separate file so that users who don't write Parquet files
+don't need to link it.
+
+A Parquet file is "PAR1", the column chunks of each row group, a FileMetaData
+footer (Thrift compact protocol), the footer's size, and "PAR1". Each column
+chunk is an optional dictionary page and one data page (format v1: repetition
+levels for list columns, definition levels, then values). Refer to
+parquet.thrift in the Parquet format specification for the structures and
+enumerations used here. The Thrift and Snappy encoders are small, so they are
+implemented here instead of adding dependencies.
+*/
+
+using EtwInternal::HashBytes;
+using EtwInternal::UnixEpochFileTime;
+using EtwInternal::WriteUtf16AsUtf8;
+
+static unsigned const NoEntry = ~0u;
+static unsigned const MaxDictionarySize = 1024 * 1024; // Fall back to PLAIN if larger.
+static unsigned const SnappyHashBits = 14;
+static unsigned const SnappyFragmentSize = 65536;
+static unsigned const DeltaBlockSize = 128;
+static unsigned const DeltaMiniblockCount = 4;
+static unsigned const DeltaMiniblockSize = DeltaBlockSize / DeltaMiniblockCount;
+
+// Parquet Type (physical type).
+static INT32 const ParquetType_Boolean = 0;
+static INT32 const ParquetType_Int32 = 1;
+static INT32 const ParquetType_Int64 = 2;
+static INT32 const ParquetType_Float = 4;
+static INT32 const ParquetType_Double = 5;
+static INT32 const ParquetType_ByteArray = 6;
+static INT32 const ParquetType_FixedLenByteArray = 7;
+
+// Parquet ConvertedType.
+static INT32 const ParquetConvertedType_Utf8 = 0;
+static INT32 const ParquetConvertedType_List = 3;
+static INT32 const ParquetConvertedType_Uint8 = 11;
+static INT32 const ParquetConvertedType_Int8 = 15;
+
+// Parquet Encoding.
+static UCHAR const ParquetEncoding_Plain = 0;
+static UCHAR const ParquetEncoding_Rle = 3;
+static UCHAR const ParquetEncoding_DeltaBinaryPacked = 5;
+static UCHAR const ParquetEncoding_RleDictionary = 8;
+
+// Other Parquet enumerations.
+static INT32 const ParquetRepetition_Optional = 1;
+static INT32 const ParquetRepetition_Repeated = 2;
+static INT32 const ParquetCodec_Snappy = 1;
+static INT32 const ParquetPageType_DataPage = 0;
+static INT32 const ParquetPageType_DictionaryPage = 2;
+
+// Thrift compact protocol types.
+static UCHAR const ThriftType_BoolTrue = 1;
+static UCHAR const ThriftType_BoolFalse = 2;
+static UCHAR const ThriftType_I8 = 3;
+static UCHAR const ThriftType_I32 = 5;
+static UCHAR const ThriftType_I64 = 6;
+static UCHAR const ThriftType_Binary = 8;
+static UCHAR const ThriftType_List = 9;
+static UCHAR const ThriftType_Struct = 12;
+
+// How a column is stored. Stored in EtwParquetWriter::Column::Kind.
+enum ParquetKind : UCHAR
+{
+    ParquetKind_Null,       // INT32, logical type UNKNOWN. Every value is null.
+    ParquetKind_Bool,       // BOOLEAN.
+    ParquetKind_Int32,      // INT32, logical type INTEGER(BitWidth, IsSigned).
+    ParquetKind_Int64,      // INT64, logical type INTEGER(64, IsSigned).
+    ParquetKind_Float,      // FLOAT.
+    ParquetKind_Double,     // DOUBLE.
+    ParquetKind_Timestamp,  // INT64, logical type TIMESTAMP(UTC, NANOS).
+    ParquetKind_Uuid,       // FIXED_LEN_BYTE_ARRAY(16), logical type UUID.
+    ParquetKind_String,     // BYTE_ARRAY, logical type STRING.
+    ParquetKind_Binary,     // BYTE_ARRAY.
+};
+
+struct ParquetColumnType
+{
+    ParquetKind Kind;
+    UCHAR BitWidth;
+    bool IsSigned;
+};
+
+static ParquetColumnType
+GetParquetColumnType(
+    EtwColumnInfo const& column,
+    unsigned columnIndex) noexcept
+{
+    if (columnIndex == 0)
+    {
+        return { ParquetKind_Timestamp, 64, true }; // TimeStamp
+    }
+    else if (columnIndex < EtwColumnBatch::HeaderColumnCount - 1)
+    {
+        return { ParquetKind_Int32, 32, false }; // ProcessId, ThreadId, ProcessorIndex
+    }
+
+    switch (column.Type)
+    {
+    case EtwColumnType_None:
+        return { ParquetKind_Null, 0, false };
+
+    case EtwColumnType_Int64:
+        switch (column.InType)
+        {
+        case TDH_INTYPE_INT8:
+            return { ParquetKind_Int32, 8, true };
+        case TDH_INTYPE_INT16:
+            return { ParquetKind_Int32, 16, true };
+        case TDH_INTYPE_INT32:
+            return { ParquetKind_Int32, 32, true };
+        default:
+            return { ParquetKind_Int64, 64, true };
+        }
+
+    case EtwColumnType_UInt64:
+        switch (column.InType)
+        {
+        case TDH_INTYPE_BOOLEAN:
+            return { ParquetKind_Bool, 0, false };
+        case TDH_INTYPE_FILETIME:
+            return { ParquetKind_Timestamp, 64, true };
+        case TDH_INTYPE_UINT8:
+            return { ParquetKind_Int32, 8, false };
+        case TDH_INTYPE_UINT16:
+            return { ParquetKind_Int32, 16, false };
+        case TDH_INTYPE_UINT32:
+        case TDH_INTYPE_HEXINT32:
+            return { ParquetKind_Int32, 32, false };
+        default:
+            return { ParquetKind_Int64, 64, false };
+        }
+
+    case EtwColumnType_Double:
+        return { column.InType == TDH_INTYPE_FLOAT ? ParquetKind_Float : ParquetKind_Double, 0, false };
+
+    case EtwColumnType_Guid:
+        return { ParquetKind_Uuid, 0, false };
+
+    case EtwColumnType_String:
+        return { ParquetKind_String, 0, false };
+
+    default:
+        return { ParquetKind_Binary, 0, false };
+    }
+}
+
+static INT32
+PhysicalType(
+    UCHAR kind) noexcept
+{
+    switch (kind)
+    {
+    case ParquetKind_Bool:
+        return ParquetType_Boolean;
+    case ParquetKind_Int64:
+    case ParquetKind_Timestamp:
+        return ParquetType_Int64;
+    case ParquetKind_Float:
+        return ParquetType_Float;
+    case ParquetKind_Double:
+        return ParquetType_Double;
+    case ParquetKind_Uuid:
+        return ParquetType_FixedLenByteArray;
+    case ParquetKind_String:
+    case ParquetKind_Binary:
+        return ParquetType_ByteArray;
+    default:
+        return ParquetType_Int32;
+    }
+}
+
+// Appends cch UTF-16 code units to output as UTF-8.
+static bool
+AppendUtf16AsUtf8(
+    EtwInternal::Buffer<char>& output,
+    _In_reads_(cch) EtwWCHAR const* pch,
+    unsigned cch) noexcept
+{
+    auto const oldSize = output.size();
+    UINT64 const maxSize = oldSize + UINT64(cch) * 3;
+    if (maxSize > 0x7FFFFFFF || !output.reserve(static_cast<unsigned>(maxSize)))
+    {
+        return false;
+    }
+
+    auto const pbEnd = WriteUtf16AsUtf8(
+        reinterpret_cast<BYTE*>(output.data() + oldSize), pch, cch);
+    output.resize_unchecked(static_cast<unsigned>(reinterpret_cast<char*>(pbEnd) - output.data()));
+    return true;
+}
+
+// Returns the number of bits needed to represent value.
+static unsigned
+BitLength(
+    UINT64 value) noexcept
+{
+    unsigned bits = 0;
+    for (; value != 0; value >>= 1)
+    {
+        bits += 1;
+    }
+
+    return bits;
+}
+
+static BYTE*
+WriteVarint(
+    _Out_writes_(10) BYTE* p,
+    UINT64 value) noexcept
+{
+    while (value >= 0x80)
+    {
+        *p++ = static_cast<BYTE>(value | 0x80);
+        value >>= 7;
+    }
+
+    *p++ = static_cast<BYTE>(value);
+    return p;
+}
+
+static UINT64
+ZigZag(
+    INT64 value) noexcept
+{
+    return (static_cast<UINT64>(value) << 1) ^ static_cast<UINT64>(value >> 63);
+}
+
+// ORs the low bitWidth bits of value into pb at bit position *pBitPos (LSB first).
+static void
+PutBits(
+    _Inout_ BYTE* pb,
+    _Inout_ UINT64* pBitPos,
+    UINT64 value,
+    unsigned bitWidth) noexcept
+{
+    auto bitPos = *pBitPos;
+    while (bitPos & 7 ? bitWidth != 0 : bitWidth >= 8)
+    {
+        unsigned const shift = static_cast<unsigned>(bitPos & 7);
+        unsigned const take = bitWidth < 8 - shift ? bitWidth : 8 - shift;
+        pb[bitPos / 8] |= static_cast<BYTE>((value & ((1u << take) - 1)) << shift);
+        value >>= take;
+        bitWidth -= take;
+        bitPos += take;
+    }
+
+    if (bitWidth != 0)
+    {
+        pb[bitPos / 8] |= static_cast<BYTE>(value & ((1u << bitWidth) - 1));
+        bitPos += bitWidth;
+    }
+
+    *pBitPos = bitPos;
+}
+
+#pragma region Encoders
+
+// Upper bound on the size of WriteRleHybrid output.
+static UINT64
+MaxRleHybridSize(
+    unsigned count,
+    unsigned bitWidth) noexcept
+{
+    return (UINT64(count) / 8 + 2) * (10 + bitWidth);
+}
+
+// Writes a bit-packed run of count values, padded to a multiple of 8 values.
+template<class T>
+static BYTE*
+WriteBitPackedRun(
+    _Out_ BYTE* p,
+    _In_reads_(count) T const* pValues,
+    unsigned count,
+    unsigned bitWidth) noexcept
+{
+    if (count != 0)
+    {
+        unsigned const groups = (count + 7) / 8;
+        p = WriteVarint(p, (UINT64(groups) << 1) | 1);
+        memset(p, 0, groups * bitWidth);
+
+        UINT64 bitPos = 0;
+        for (unsigned i = 0; i != count; i += 1)
+        {
+            PutBits(p, &bitPos, pValues[i], bitWidth);
+        }
+
+        p += groups * bitWidth;
+    }
+
+    return p;
+}
+
+/*
+Writes values using the RLE/bit-packing hybrid encoding (without a length
+prefix). Runs of 8 or more repeated values that start on a bit-packed group
+boundary are RLE-encoded. Everything else is bit-packed.
+*/
+template<class T>
+static BYTE*
+WriteRleHybrid(
+    _Out_ BYTE* p,
+    _In_reads_(count) T const* pValues,
+    unsigned count,
+    unsigned bitWidth) noexcept
+{
+    unsigned const cbValue = (bitWidth + 7) / 8;
+    unsigned packedStart = 0;
+    unsigned i = 0;
+    while (i != count)
+    {
+        unsigned run = 1;
+        while (i + run != count && pValues[i + run] == pValues[i])
+        {
+            run += 1;
+        }
+
+        if (run >= 8 && ((i - packedStart) & 7) == 0)
+        {
+            p = WriteBitPackedRun(p, pValues + packedStart, i - packedStart, bitWidth);
+            p = WriteVarint(p, UINT64(run) << 1);
+            UINT32 const value = pValues[i];
+            memcpy(p, &value, cbValue); // Little-endian.
+            p += cbValue;
+            i += run;
+            packedStart = i;
+        }
+        else
+        {
+            i += 1;
+        }
+    }
+
+    return WriteBitPackedRun(p, pValues + packedStart, count - packedStart, bitWidth);
+}
+
+// Writes the levels of a data page: a 4-byte size followed by the levels
+// (RLE/bit-packing hybrid). Needs 4 + MaxRleHybridSize(count, bitWidth) bytes.
+static BYTE*
+WriteLevels(
+    _Out_ BYTE* p,
+    _In_reads_(count) BYTE const* pLevels,
+    unsigned count,
+    unsigned bitWidth) noexcept
+{
+    auto const pEnd = WriteRleHybrid(p + 4, pLevels, count, bitWidth);
+    UINT32 const cbLevels = static_cast<UINT32>(pEnd - (p + 4));
+    memcpy(p, &cbLevels, 4);
+    return pEnd;
+}
+
+// Upper bound on the size of WriteDeltaBinaryPacked output.
+static UINT64
+MaxDeltaBinaryPackedSize(
+    unsigned count) noexcept
+{
+    return 64 + (UINT64(count) / DeltaBlockSize + 1) * (10 + DeltaMiniblockCount + DeltaBlockSize * 8);
+}
+
+// Writes values using the DELTA_BINARY_PACKED encoding.
+static BYTE*
+WriteDeltaBinaryPacked(
+    _Out_ BYTE* p,
+    _In_reads_(count) UINT64 const* pValues,
+    unsigned count) noexcept
+{
+    p = WriteVarint(p, DeltaBlockSize);
+    p = WriteVarint(p, DeltaMiniblockCount);
+    p = WriteVarint(p, count);
+    p = WriteVarint(p, ZigZag(count != 0 ? static_cast<INT64>(pValues[0]) : 0));
+
+    for (unsigned blockStart = 1; blockStart < count; blockStart += DeltaBlockSize)
+    {
+        unsigned const blockCount = count - blockStart < DeltaBlockSize ? count - blockStart : DeltaBlockSize;
+        auto const pBlock = pValues + blockStart - 1; // Starts with the previous value.
+
+        INT64 minDelta = 0x7FFFFFFFFFFFFFFF;
+        for (unsigned i = 0; i != blockCount; i += 1)
+        {
+            INT64 const delta = static_cast<INT64>(pBlock[i + 1] - pBlock[i]);
+            minDelta = delta < minDelta ? delta : minDelta;
+        }
+
+        p = WriteVarint(p, ZigZag(minDelta));
+
+        BYTE bitWidths[DeltaMiniblockCount] = {};
+        for (unsigned i = 0; i != blockCount; i += 1)
+        {
+            UINT64 const relative = (pBlock[i + 1] - pBlock[i]) - static_cast<UINT64>(minDelta);
+            auto const bits = BitLength(relative);
+            auto& bitWidth = bitWidths[i / DeltaMiniblockSize];
+            bitWidth = static_cast<BYTE>(bits > bitWidth ? bits : bitWidth);
+        }
+
+        memcpy(p, bitWidths, sizeof(bitWidths));
+        p += sizeof(bitWidths);
+
+        // Miniblocks are padded to DeltaMiniblockSize values. Miniblocks
+        // after the last value are not written.
+        for (unsigned m = 0; m * DeltaMiniblockSize < blockCount; m += 1)
+        {
+            unsigned const cb = bitWidths[m] * DeltaMiniblockSize / 8;
+            memset(p, 0, cb);
+
+            UINT64 bitPos = 0;
+            for (unsigned i = m * DeltaMiniblockSize; i != blockCount && i != (m + 1) * DeltaMiniblockSize; i += 1)
+            {
+                UINT64 const relative = (pBlock[i + 1] - pBlock[i]) - static_cast<UINT64>(minDelta);
+                PutBits(p, &bitPos, relative, bitWidths[m]);
+            }
+
+            p += cb;
+        }
+    }
+
+    return p;
+}
+
+// Upper bound on the size of SnappyCompress output.
+static UINT64
+MaxSnappySize(
+    unsigned cb) noexcept
+{
+    return 32 + UINT64(cb) + cb / 6;
+}
+
+static BYTE*
+SnappyLiteral(
+    _Out_ BYTE* p,
+    _In_reads_bytes_(cb) BYTE const* pb,
+    unsigned cb) noexcept
+{
+    if (cb != 0)
+    {
+        unsigned const n = cb - 1;
+        if (n < 60)
+        {
+            *p++ = static_cast<BYTE>(n << 2);
+        }
+        else if (n < 0x100)
+        {
+            *p++ = 60 << 2;
+            *p++ = static_cast<BYTE>(n);
+        }
+        else
+        {
+            ASSERT(n < 0x10000); // Literals are within a fragment.
+            *p++ = 61 << 2;
+            *p++ = static_cast<BYTE>(n);
+            *p++ = static_cast<BYTE>(n >> 8);
+        }
+
+        memcpy(p, pb, cb);
+        p += cb;
+    }
+
+    return p;
+}
+
+static BYTE*
+SnappyCopy(
+    _Out_ BYTE* p,
+    unsigned offset,
+    unsigned length) noexcept
+{
+    ASSERT(offset != 0 && offset < 0x10000 && length >= 4);
+
+    for (;;)
+    {
+        unsigned const chunk = length < 68
+            ? (length > 64 ? 60 : length)
+            : 64;
+        if (chunk < 12 && offset < 2048)
+        {
+            *p++ = static_cast<BYTE>(((offset >> 8) << 5) | ((chunk - 4) << 2) | 1);
+            *p++ = static_cast<BYTE>(offset);
+        }
+        else
+        {
+            *p++ = static_cast<BYTE>(((chunk - 1) << 2) | 2);
+            *p++ = static_cast<BYTE>(offset);
+            *p++ = static_cast<BYTE>(offset >> 8);
+        }
+
+        length -= chunk;
+        if (length == 0)
+        {
+            break;
+        }
+    }
+
+    return p;
+}
+
+/*
+Compresses pbIn[0..cbIn) in the Snappy raw format. Simple greedy matcher:
+each 64 KB fragment is compressed independently using a hash table of the
+most recent position of each 4-byte sequence. pTable must have room for
+(1 << SnappyHashBits) entries. Returns the end of the output.
+*/
+static BYTE*
+SnappyCompress(
+    _Out_ BYTE* p,
+    _In_reads_bytes_(cbIn) BYTE const* pbIn,
+    unsigned cbIn,
+    _Out_writes_(1u << SnappyHashBits) USHORT* pTable) noexcept
+{
+    p = WriteVarint(p, cbIn);
+
+    for (unsigned fragmentStart = 0; fragmentStart < cbIn; fragmentStart += SnappyFragmentSize)
+    {
+        auto const pb = pbIn + fragmentStart;
+        unsigned const cb = cbIn - fragmentStart < SnappyFragmentSize ? cbIn - fragmentStart : SnappyFragmentSize;
+        unsigned literalStart = 0;
+
+        if (cb >= 16)
+        {
+            memset(pTable, 0, sizeof(USHORT) << SnappyHashBits);
+            unsigned skip = 32; // Skip faster through data that does not compress.
+            unsigned pos = 0;
+            while (pos <= cb - 4)
+            {
+                UINT32 current;
+                memcpy(&current, pb + pos, 4);
+                unsigned const hash = (current * 0x1E35A7BDu) >> (32 - SnappyHashBits);
+                unsigned const candidate = pTable[hash];
+                pTable[hash] = static_cast<USHORT>(pos);
+
+                UINT32 candidateValue;
+                memcpy(&candidateValue, pb + candidate, 4);
+                if (candidate < pos && candidateValue == current)
+                {
+                    p = SnappyLiteral(p, pb + literalStart, pos - literalStart);
+                    unsigned length = 4;
+                    while (pos + length != cb && pb[candidate + length] == pb[pos + length])
+                    {
+                        length += 1;
+                    }
+
+                    p = SnappyCopy(p, pos - candidate, length);
+                    pos += length;
+                    literalStart = pos;
+                    skip = 32;
+                }
+                else
+                {
+                    pos += skip >> 5;
+                    skip += 1;
+                }
+            }
+        }
+
+        p = SnappyLiteral(p, pb + literalStart, cb - literalStart);
+    }
+
+    return p;
+}
+
+#pragma endregion
+
+#pragma region Thrift compact protocol writer
+
+/*
+Writes Thrift compact protocol structs to a buffer that has enough room
+for the output (does not check for overflow).
+*/
+class ThriftCompactWriter
+{
+    BYTE* m_p;
+    unsigned m_depth;
+    short m_lastFieldId[8]; // Per nesting level.
+
+public:
+
+    explicit
+    ThriftCompactWriter(_Out_ BYTE* p) noexcept
+        : m_p(p)
+        , m_depth(0)
+        , m_lastFieldId()
+    {
+        return;
+    }
+
+    BYTE*
+    Pos() const noexcept
+    {
+        return m_p;
+    }
+
+    void
+    I8(short fieldId, INT8 value) noexcept
+    {
+        FieldHeader(fieldId, ThriftType_I8);
+        *m_p++ = static_cast<BYTE>(value);
+    }
+
+    void
+    I32(short fieldId, INT32 value) noexcept
+    {
+        FieldHeader(fieldId, ThriftType_I32);
+        m_p = WriteVarint(m_p, ZigZag(value));
+    }
+
+    void
+    I64(short fieldId, INT64 value) noexcept
+    {
+        FieldHeader(fieldId, ThriftType_I64);
+        m_p = WriteVarint(m_p, ZigZag(value));
+    }
+
+    void
+    Bool(short fieldId, bool value) noexcept
+    {
+        FieldHeader(fieldId, value ? ThriftType_BoolTrue : ThriftType_BoolFalse);
+    }
+
+    void
+    Binary(short fieldId, _In_reads_bytes_(cb) void const* pb, unsigned cb) noexcept
+    {
+        FieldHeader(fieldId, ThriftType_Binary);
+        ListBinary(pb, cb);
+    }
+
+    // Begins a struct-valued field. End with EndStruct.
+    void
+    BeginStruct(short fieldId) noexcept
+    {
+        FieldHeader(fieldId, ThriftType_Struct);
+        BeginListStruct();
+    }
+
+    // Begins a struct element of a list. End with EndStruct.
+    void
+    BeginListStruct() noexcept
+    {
+        ASSERT(m_depth + 1 < _countof(m_lastFieldId));
+        m_depth += 1;
+        m_lastFieldId[m_depth] = 0;
+    }
+
+    void
+    EndStruct() noexcept
+    {
+        ASSERT(m_depth != 0);
+        *m_p++ = 0; // Stop
+        m_depth -= 1;
+    }
+
+    // Begins a list-valued field. Follow with count list elements.
+    void
+    BeginList(short fieldId, UCHAR elementType, unsigned count) noexcept
+    {
+        FieldHeader(fieldId, ThriftType_List);
+        if (count < 15)
+        {
+            *m_p++ = static_cast<BYTE>((count << 4) | elementType);
+        }
+        else
+        {
+            *m_p++ = static_cast<BYTE>(0xF0 | elementType);
+            m_p = WriteVarint(m_p, count);
+        }
+    }
+
+    void
+    ListI32(INT32 value) noexcept
+    {
+        m_p = WriteVarint(m_p, ZigZag(value));
+    }
+
+    void
+    ListBinary(_In_reads_bytes_(cb) void const* pb, unsigned cb) noexcept
+    {
+        m_p = WriteVarint(m_p, cb);
+        memcpy(m_p, pb, cb);
+        m_p += cb;
+    }
+
+    // Ends the top-level struct.
+    void
+    End() noexcept
+    {
+        ASSERT(m_depth == 0);
+        *m_p++ = 0; // Stop
+    }
+
+private:
+
+    void
+    FieldHeader(short fieldId, UCHAR type) noexcept
+    {
+        int const delta = fieldId - m_lastFieldId[m_depth];
+        if (delta > 0 && delta <= 15)
+        {
+            *m_p++ = static_cast<BYTE>((delta << 4) | type);
+        }
+        else
+        {
+            *m_p++ = type;
+            m_p = WriteVarint(m_p, ZigZag(fieldId));
+        }
+
+        m_lastFieldId[m_depth] = fieldId;
+    }
+};
+
+#pragma endregion
+
+#pragma region EtwParquetWriter
+
+EtwParquetWriter::EtwParquetWriter() noexcept
+    : m_columns()
+    , m_names()
+    , m_chunks()
+    , m_rowGroupRows()
+    , m_page()
+    , m_values()
+    , m_compressed()
+    , m_defined()
+    , m_repetitionLevels()
+    , m_definitionLevels()
+    , m_deltaValues()
+    , m_indexes()
+    , m_dictionary()
+    , m_dictionaryEntries()
+    , m_dictionaryBuckets()
+    , m_snappyTable()
+    , m_filePos(0)
+    , m_providerNameOffset(0)
+    , m_providerNameLength(0)
+    , m_eventNameOffset(0)
+    , m_eventNameLength(0)
+{
+    return;
+}
+
+EtwParquetWriter::~EtwParquetWriter() noexcept
+{
+    return;
+}
+
+LSTATUS
+EtwParquetWriter::Begin(
+    EtwColumnBatch const& batch,
+    unsigned tableIndex,
+    EtwOutputSink& sink) noexcept
+{
+    ASSERT(tableIndex < batch.TableCount()); // PRECONDITION
+
+    LSTATUS status;
+    auto const tableInfo = batch.GetTableInfo(tableIndex);
+
+    m_columns.clear();
+    m_names.clear();
+    m_chunks.clear();
+    m_rowGroupRows.clear();
+    m_filePos = 0;
+
+    if (!m_columns.resize(tableInfo.ColumnCount))
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto Done;
+    }
+
+    for (unsigned i = 0; i != tableInfo.ColumnCount; i += 1)
+    {
+        auto const columnInfo = batch.GetColumnInfo(tableIndex, i);
+        auto const type = GetParquetColumnType(columnInfo, i);
+        auto& column = m_columns[i];
+        column.NameOffset = m_names.size();
+        column.Kind = type.Kind;
+        column.BitWidth = type.BitWidth;
+        column.IsSigned = type.IsSigned;
+        column.IsList = columnInfo.ListOffsets != nullptr;
+        if (!AppendUtf16AsUtf8(m_names, columnInfo.Name, static_cast<unsigned>(wcslen(columnInfo.Name))))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        column.NameLength = m_names.size() - column.NameOffset;
+    }
+
+    m_providerNameOffset = m_names.size();
+    if (!AppendUtf16AsUtf8(m_names, tableInfo.ProviderName, static_cast<unsigned>(wcslen(tableInfo.ProviderName))))
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto Done;
+    }
+
+    m_providerNameLength = m_names.size() - m_providerNameOffset;
+    m_eventNameOffset = m_names.size();
+    if (!AppendUtf16AsUtf8(m_names, tableInfo.EventName, static_cast<unsigned>(wcslen(tableInfo.EventName))))
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto Done;
+    }
+
+    m_eventNameLength = m_names.size() - m_eventNameOffset;
+
+    status = sink.Write("PAR1", 4);
+    m_filePos = 4;
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwParquetWriter::WriteRowGroup(
+    EtwColumnBatch const& batch,
+    unsigned tableIndex,
+    EtwOutputSink& sink) noexcept
+{
+    ASSERT(tableIndex < batch.TableCount()); // PRECONDITION
+
+    LSTATUS status = ERROR_SUCCESS;
+    auto const tableInfo = batch.GetTableInfo(tableIndex);
+    ASSERT(tableInfo.ColumnCount == m_columns.size());
+
+    if (tableInfo.RowCount != 0)
+    {
+        if (!m_chunks.reserve(m_chunks.size() + m_columns.size()) ||
+            !m_rowGroupRows.reserve(m_rowGroupRows.size() + 1))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        for (unsigned i = 0; i != m_columns.size(); i += 1)
+        {
+            status = WriteColumnChunk(batch.GetColumnInfo(tableIndex, i), m_columns[i], sink);
+            if (status != ERROR_SUCCESS)
+            {
+                goto Done;
+            }
+        }
+
+        m_rowGroupRows.push_back(tableInfo.RowCount);
+    }
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwParquetWriter::WriteColumnChunk(
+    EtwColumnInfo const& columnInfo,
+    Column const& column,
+    EtwOutputSink& sink) noexcept
+{
+    LSTATUS status;
+    UINT32 const rows = columnInfo.RowCount;
+    UINT32 const valueCount = columnInfo.ValueCount; // List elements for a list column.
+    auto const pbValues = static_cast<BYTE const*>(columnInfo.Values);
+    UINT32 definedCount = 0;
+    unsigned levelCount;
+    UCHAR encoding = ParquetEncoding_Plain;
+    Chunk chunk = {};
+    UINT64 cbMax;
+    BYTE* p;
+
+    // 1 if the value is present, 0 if null. These are also the definition
+    // levels of a column that is not a list.
+    if (!m_defined.resize(valueCount, false))
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto Done;
+    }
+
+    for (UINT32 i = 0; i != valueCount; i += 1)
+    {
+        BYTE const defined = column.Kind != ParquetKind_Null &&
+            ((columnInfo.Validity[i / 8] >> (i & 7)) & 1);
+        m_defined[i] = defined;
+        definedCount += defined;
+    }
+
+    m_values.clear();
+    switch (column.Kind)
+    {
+    case ParquetKind_Null:
+        break;
+
+    case ParquetKind_Bool:
+        if (!m_values.resize((definedCount + 7) / 8, false))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+        else
+        {
+            UINT64 bitPos = 0;
+            memset(m_values.data(), 0, m_values.size());
+            for (UINT32 i = 0; i != valueCount; i += 1)
+            {
+                if (m_defined[i])
+                {
+                    UINT64 value;
+                    memcpy(&value, pbValues + i * 8, 8);
+                    PutBits(m_values.data(), &bitPos, value != 0, 1);
+                }
+            }
+        }
+        break;
+
+    case ParquetKind_Int32:
+    case ParquetKind_Int64:
+    case ParquetKind_Float:
+    case ParquetKind_Double:
+    {
+        unsigned const cbValue = column.Kind == ParquetKind_Int64 || column.Kind == ParquetKind_Double ? 8 : 4;
+        if (!m_values.resize(definedCount * cbValue, false))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        p = m_values.data();
+        for (UINT32 i = 0; i != valueCount; i += 1)
+        {
+            if (m_defined[i])
+            {
+                if (column.Kind == ParquetKind_Float)
+                {
+                    double value;
+                    memcpy(&value, pbValues + i * 8, 8);
+                    float const narrowValue = static_cast<float>(value);
+                    memcpy(p, &narrowValue, 4);
+                }
+                else
+                {
+                    // Column values are sign- or zero-extended to 64 bits, so
+                    // the low 4 bytes are the INT32 value (little-endian).
+                    memcpy(p, pbValues + i * 8, cbValue);
+                }
+
+                p += cbValue;
+            }
+        }
+        break;
+    }
+
+    case ParquetKind_Timestamp:
+        // FILETIME to nanoseconds since 1970. Out-of-range values are null.
+        m_deltaValues.clear();
+        if (!m_deltaValues.reserve(definedCount))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        for (UINT32 i = 0; i != valueCount; i += 1)
+        {
+            if (m_defined[i])
+            {
+                UINT64 fileTime;
+                memcpy(&fileTime, pbValues + i * 8, 8);
+                INT64 const ticks = static_cast<INT64>(fileTime - UnixEpochFileTime);
+                if (fileTime > 0x7FFFFFFFFFFFFFFF ||
+                    ticks < -0x7FFFFFFFFFFFFFFF / 100 ||
+                    ticks > 0x7FFFFFFFFFFFFFFF / 100)
+                {
+                    m_defined[i] = 0;
+                }
+                else
+                {
+                    m_deltaValues.push_back(static_cast<UINT64>(ticks * 100));
+                }
+            }
+        }
+
+        cbMax = MaxDeltaBinaryPackedSize(m_deltaValues.size());
+        if (cbMax > 0x7FFFFFFF || !m_values.resize(static_cast<unsigned>(cbMax), false))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        p = WriteDeltaBinaryPacked(m_values.data(), m_deltaValues.data(), m_deltaValues.size());
+        m_values.resize_unchecked(static_cast<unsigned>(p - m_values.data()));
+        encoding = ParquetEncoding_DeltaBinaryPacked;
+        break;
+
+    case ParquetKind_Uuid:
+        if (!m_values.resize(definedCount * 16, false))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        p = m_values.data();
+        for (UINT32 i = 0; i != valueCount; i += 1)
+        {
+            if (m_defined[i])
+            {
+                // GUID to RFC 4122 byte order (Data1, Data2, Data3 big-endian).
+                auto const pGuid = pbValues + i * 16;
+                static BYTE const order[16] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+                for (unsigned j = 0; j != 16; j += 1)
+                {
+                    p[j] = pGuid[order[j]];
+                }
+
+                p += 16;
+            }
+        }
+        break;
+
+    default: // String, Binary
+    {
+        bool const isString = column.Kind == ParquetKind_String;
+        auto const pOffsets = columnInfo.Offsets;
+
+        // Try dictionary encoding. Strings are converted to UTF-8 in m_page.
+        m_dictionary.clear();
+        m_dictionaryEntries.clear();
+        m_indexes.clear();
+        encoding = ParquetEncoding_RleDictionary;
+        for (UINT32 i = 0; i != valueCount; i += 1)
+        {
+            if (m_defined[i])
+            {
+                auto pb = pbValues + pOffsets[i];
+                unsigned cb = pOffsets[i + 1] - pOffsets[i];
+                if (isString)
+                {
+                    if (!m_page.resize(cb / 2 * 3, false))
+                    {
+                        status = ERROR_OUTOFMEMORY;
+                        goto Done;
+                    }
+
+                    cb = static_cast<unsigned>(WriteUtf16AsUtf8(
+                        m_page.data(), reinterpret_cast<EtwWCHAR const*>(pb), cb / 2) - m_page.data());
+                    pb = m_page.data();
+                }
+
+                unsigned index;
+                if (!AddDictionaryValue(pb, cb, &index) ||
+                    !m_indexes.push_back(index))
+                {
+                    status = ERROR_OUTOFMEMORY;
+                    goto Done;
+                }
+
+                if (index == NoEntry)
+                {
+                    encoding = ParquetEncoding_Plain; // Dictionary is too large.
+                    break;
+                }
+            }
+        }
+
+        if (encoding == ParquetEncoding_RleDictionary)
+        {
+            unsigned const entryCount = m_dictionaryEntries.size();
+            unsigned const bitWidth = entryCount > 1 ? BitLength(entryCount - 1) : 1;
+            cbMax = 1 + MaxRleHybridSize(m_indexes.size(), bitWidth);
+            if (cbMax > 0x7FFFFFFF || !m_values.resize(static_cast<unsigned>(cbMax), false))
+            {
+                status = ERROR_OUTOFMEMORY;
+                goto Done;
+            }
+
+            m_values[0] = static_cast<BYTE>(bitWidth);
+            p = WriteRleHybrid(m_values.data() + 1, m_indexes.data(), m_indexes.size(), bitWidth);
+            m_values.resize_unchecked(static_cast<unsigned>(p - m_values.data()));
+
+            status = WritePage(m_dictionary.data(), m_dictionary.size(), true, entryCount, ParquetEncoding_Plain, sink, chunk);
+            if (status != ERROR_SUCCESS)
+            {
+                goto Done;
+            }
+        }
+        else
+        {
+            // PLAIN: 4-byte length followed by the bytes of each value.
+            cbMax = 0;
+            for (UINT32 i = 0; i != valueCount; i += 1)
+            {
+                if (m_defined[i])
+                {
+                    unsigned const cb = pOffsets[i + 1] - pOffsets[i];
+                    cbMax += 4 + (isString ? cb / 2 * 3 : cb);
+                }
+            }
+
+            if (cbMax > 0x7FFFFFFF || !m_values.resize(static_cast<unsigned>(cbMax), false))
+            {
+                status = ERROR_OUTOFMEMORY;
+                goto Done;
+            }
+
+            p = m_values.data();
+            for (UINT32 i = 0; i != valueCount; i += 1)
+            {
+                if (m_defined[i])
+                {
+                    auto const pb = pbValues + pOffsets[i];
+                    UINT32 cb = pOffsets[i + 1] - pOffsets[i];
+                    if (isString)
+                    {
+                        cb = static_cast<UINT32>(WriteUtf16AsUtf8(
+                            p + 4, reinterpret_cast<EtwWCHAR const*>(pb), cb / 2) - (p + 4));
+                    }
+                    else
+                    {
+                        memcpy(p + 4, pb, cb);
+                    }
+
+                    memcpy(p, &cb, 4);
+                    p += 4 + cb;
+                }
+            }
+
+            m_values.resize_unchecked(static_cast<unsigned>(p - m_values.data()));
+        }
+        break;
+    }
+    }
+
+    levelCount = valueCount;
+    if (column.IsList)
+    {
+        // One level per list element, or one for a null or empty list.
+        // Repetition level 0 starts a row. Definition level 0 is a null list,
+        // 1 an empty list, 2 a null element, and 3 an element.
+        auto const pListOffsets = columnInfo.ListOffsets;
+        cbMax = UINT64(rows) + valueCount;
+        if (cbMax > 0x7FFFFFFF ||
+            !m_repetitionLevels.resize(static_cast<unsigned>(cbMax), false) ||
+            !m_definitionLevels.resize(static_cast<unsigned>(cbMax), false))
+        {
+            status = ERROR_OUTOFMEMORY;
+            goto Done;
+        }
+
+        levelCount = 0;
+        for (UINT32 row = 0; row != rows; row += 1)
+        {
+            if (pListOffsets[row] == pListOffsets[row + 1])
+            {
+                m_repetitionLevels[levelCount] = 0;
+                m_definitionLevels[levelCount] = (columnInfo.ListValidity[row / 8] >> (row & 7)) & 1;
+                levelCount += 1;
+            }
+
+            for (UINT32 i = pListOffsets[row]; i != pListOffsets[row + 1]; i += 1)
+            {
+                m_repetitionLevels[levelCount] = i != pListOffsets[row];
+                m_definitionLevels[levelCount] = static_cast<BYTE>(2 + m_defined[i]);
+                levelCount += 1;
+            }
+        }
+    }
+
+    // Data page: the repetition levels (list columns only), the definition
+    // levels, and the values.
+    cbMax = 8 + MaxRleHybridSize(levelCount, 1) + MaxRleHybridSize(levelCount, 2) + m_values.size();
+    if (cbMax > 0x7FFFFFFF || !m_page.resize(static_cast<unsigned>(cbMax), false))
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto Done;
+    }
+
+    if (column.IsList)
+    {
+        p = WriteLevels(m_page.data(), m_repetitionLevels.data(), levelCount, 1);
+        p = WriteLevels(p, m_definitionLevels.data(), levelCount, 2);
+    }
+    else
+    {
+        p = WriteLevels(m_page.data(), m_defined.data(), levelCount, 1);
+    }
+
+    memcpy(p, m_values.data(), m_values.size());
+    p += m_values.size();
+
+    chunk.NumValues = levelCount;
+    status = WritePage(m_page.data(), static_cast<unsigned>(p - m_page.data()), false, levelCount, encoding, sink, chunk);
+    if (status != ERROR_SUCCESS)
+    {
+        goto Done;
+    }
+
+    chunk.Encoding = encoding;
+    m_chunks.push_back(chunk);
+
+Done:
+
+    return status;
+}
+
+LSTATUS
+EtwParquetWriter::WritePage(
+    _In_reads_bytes_(cbPage) BYTE const* pbPage,
+    unsigned cbPage,
+    bool isDictionaryPage,
+    unsigned valueCount,
+    UCHAR encoding,
+    EtwOutputSink& sink,
+    Chunk& chunk) noexcept
+{
+    LSTATUS status;
+    BYTE header[64];
+    UINT64 const cbMax = MaxSnappySize(cbPage);
+
+    if (cbMax > 0x7FFFFFFF ||
+        !m_compressed.resize(static_cast<unsigned>(cbMax), false) ||
+        !m_snappyTable.resize(1u << SnappyHashBits, false))
+    {
+        status = ERROR_OUTOFMEMORY;
+    }
+    else
+    {
+        unsigned const cbCompressed = static_cast<unsigned>(
+            SnappyCompress(m_compressed.data(), pbPage, cbPage, m_snappyTable.data()) - m_compressed.data());
+
+        ThriftCompactWriter writer(header);
+        writer.I32(1, isDictionaryPage ? ParquetPageType_DictionaryPage : ParquetPageType_DataPage); // type
+        writer.I32(2, static_cast<INT32>(cbPage));       // uncompressed_page_size
+        writer.I32(3, static_cast<INT32>(cbCompressed)); // compressed_page_size
+        if (isDictionaryPage)
+        {
+            writer.BeginStruct(7);                        // dictionary_page_header
+            writer.I32(1, static_cast<INT32>(valueCount)); // num_values
+            writer.I32(2, encoding);                      // encoding
+            writer.EndStruct();
+        }
+        else
+        {
+            writer.BeginStruct(5);                        // data_page_header
+            writer.I32(1, static_cast<INT32>(valueCount)); // num_values
+            writer.I32(2, encoding);                      // encoding
+            writer.I32(3, ParquetEncoding_Rle);           // definition_level_encoding
+            writer.I32(4, ParquetEncoding_Rle);           // repetition_level_encoding
+            writer.EndStruct();
+        }
+
+        writer.End();
+        unsigned const cbHeader = static_cast<unsigned>(writer.Pos() - header);
+
+        if (isDictionaryPage)
+        {
+            chunk.DictionaryPageOffset = m_filePos;
+        }
+        else
+        {
+            chunk.DataPageOffset = m_filePos;
+        }
+
+        chunk.UncompressedSize += cbHeader + cbPage;
+        chunk.CompressedSize += cbHeader + cbCompressed;
+        m_filePos += cbHeader + cbCompressed;
+
+        status = sink.Write(header, cbHeader);
+        if (status == ERROR_SUCCESS)
+        {
+            status = sink.Write(m_compressed.data(), cbCompressed);
+        }
+    }
+
+    return status;
+}
+
+bool
+EtwParquetWriter::AddDictionaryValue(
+    _In_reads_bytes_(cb) BYTE const* pb,
+    unsigned cb,
+    _Out_ unsigned* pIndex) noexcept
+{
+    bool ok = true;
+    unsigned const hash = static_cast<unsigned>(HashBytes(0, pb, cb));
+    unsigned index = NoEntry;
+
+    if (m_dictionaryEntries.size() == 0)
+    {
+        // New dictionary.
+        if (!m_dictionaryBuckets.resize(1024, false))
+        {
+            ok = false;
+            goto Done;
+        }
+
+        memset(m_dictionaryBuckets.data(), 0xff, m_dictionaryBuckets.byte_size()); // NoEntry
+    }
+
+    for (unsigned i = m_dictionaryBuckets[hash & (m_dictionaryBuckets.size() - 1)];
+        i != NoEntry;
+        i = m_dictionaryEntries[i].HashNext)
+    {
+        auto const& entry = m_dictionaryEntries[i];
+        if (entry.Hash == hash &&
+            entry.Length == cb &&
+            0 == memcmp(m_dictionary.data() + entry.Offset, pb, cb))
+        {
+            index = i;
+            goto Done;
+        }
+    }
+
+    if (m_dictionary.size() + UINT64(cb) + 4 <= MaxDictionarySize)
+    {
+        DictionaryEntry entry;
+        entry.Offset = m_dictionary.size() + 4;
+        entry.Length = cb;
+        entry.Hash = hash;
+        if (!m_dictionary.resize(entry.Offset + cb) ||
+            !m_dictionaryEntries.reserve(m_dictionaryEntries.size() + 1))
+        {
+            ok = false;
+            goto Done;
+        }
+
+        memcpy(m_dictionary.data() + entry.Offset - 4, &cb, 4);
+        memcpy(m_dictionary.data() + entry.Offset, pb, cb);
+
+        index = m_dictionaryEntries.size();
+        if (index == m_dictionaryBuckets.size() &&
+            m_dictionaryBuckets.resize(index * 2, false))
+        {
+            // Rehash for an average chain length <= 1.
+            memset(m_dictionaryBuckets.data(), 0xff, m_dictionaryBuckets.byte_size()); // NoEntry
+            for (unsigned i = 0; i != m_dictionaryEntries.size(); i += 1)
+            {
+                auto& bucket = m_dictionaryBuckets[m_dictionaryEntries[i].Hash & (m_dictionaryBuckets.size() - 1)];
+                m_dictionaryEntries[i].HashNext = bucket;
+                bucket = i;
+            }
+        }
+
+        auto& bucket = m_dictionaryBuckets[hash & (m_dictionaryBuckets.size() - 1)];
+        entry.HashNext = bucket;
+        bucket = index;
+        m_dictionaryEntries.push_back(entry);
+    }
+
+Done:
+
+    *pIndex = index;
+    return ok;
+}
+
+LSTATUS
+EtwParquetWriter::End(
+    EtwOutputSink& sink) noexcept
+{
+    LSTATUS status;
+    unsigned const columnCount = m_columns.size();
+    unsigned listCount = 0;
+    UINT64 totalRows = 0;
+    UINT64 cbMax = 256 + m_names.size();
+    static char const CreatedBy[] = "EtwEnumerator";
+    static char const ProviderNameKey[] = "ProviderName";
+    static char const EventNameKey[] = "EventName";
+    static char const ListName[] = "list";
+    static char const ElementName[] = "element";
+
+    for (auto const& column : m_columns)
+    {
+        cbMax += 64 + column.NameLength * (m_rowGroupRows.size() + 1) + 128 * m_rowGroupRows.size();
+        if (column.IsList)
+        {
+            listCount += 1;
+            cbMax += 64 + 16 * m_rowGroupRows.size(); // Groups, path_in_schema.
+        }
+    }
+
+    if (cbMax > 0x7FFFFFFF || !m_compressed.resize(static_cast<unsigned>(cbMax), false))
+    {
+        status = ERROR_OUTOFMEMORY;
+    }
+    else
+    {
+        ThriftCompactWriter writer(m_compressed.data());
+
+        writer.I32(1, 1); // version
+
+        // schema: the root, then the columns. A list column is an optional
+        // LIST group, a repeated group, and the optional element.
+        writer.BeginList(2, ThriftType_Struct, columnCount + 2 * listCount + 1);
+        writer.BeginListStruct();
+        writer.Binary(4, "schema", 6);                        // name
+        writer.I32(5, static_cast<INT32>(columnCount));       // num_children
+        writer.EndStruct();
+        for (auto const& column : m_columns)
+        {
+            if (column.IsList)
+            {
+                writer.BeginListStruct();
+                writer.I32(3, ParquetRepetition_Optional);    // repetition_type
+                writer.Binary(4, m_names.data() + column.NameOffset, column.NameLength); // name
+                writer.I32(5, 1);                             // num_children
+                writer.I32(6, ParquetConvertedType_List);     // converted_type
+                writer.BeginStruct(10);                       // logicalType
+                writer.BeginStruct(3);                        // LIST
+                writer.EndStruct();
+                writer.EndStruct();
+                writer.EndStruct();
+                writer.BeginListStruct();
+                writer.I32(3, ParquetRepetition_Repeated);    // repetition_type
+                writer.Binary(4, ListName, sizeof(ListName) - 1); // name
+                writer.I32(5, 1);                             // num_children
+                writer.EndStruct();
+            }
+
+            writer.BeginListStruct();
+            writer.I32(1, PhysicalType(column.Kind));         // type
+            if (column.Kind == ParquetKind_Uuid)
+            {
+                writer.I32(2, 16);                            // type_length
+            }
+
+            writer.I32(3, ParquetRepetition_Optional);        // repetition_type
+            if (column.IsList)
+            {
+                writer.Binary(4, ElementName, sizeof(ElementName) - 1); // name
+            }
+            else
+            {
+                writer.Binary(4, m_names.data() + column.NameOffset, column.NameLength); // name
+            }
+
+            switch (column.Kind)
+            {
+            case ParquetKind_Null:
+                writer.BeginStruct(10);                       // logicalType
+                writer.BeginStruct(11);                       // UNKNOWN
+                writer.EndStruct();
+                writer.EndStruct();
+                break;
+            case ParquetKind_Int32:
+            case ParquetKind_Int64:
+            {
+                // INT_8, INT_16, INT_32, INT_64 follow UINT_8, UINT_16, UINT_32, UINT_64.
+                INT32 const convertedType =
+                    (column.IsSigned ? ParquetConvertedType_Int8 : ParquetConvertedType_Uint8) +
+                    (BitLength(column.BitWidth) - 4);
+                writer.I32(6, convertedType);                 // converted_type
+                writer.BeginStruct(10);                       // logicalType
+                writer.BeginStruct(10);                       // INTEGER
+                writer.I8(1, static_cast<INT8>(column.BitWidth)); // bitWidth
+                writer.Bool(2, column.IsSigned);              // isSigned
+                writer.EndStruct();
+                writer.EndStruct();
+                break;
+            }
+            case ParquetKind_Timestamp:
+                writer.BeginStruct(10);                       // logicalType
+                writer.BeginStruct(8);                        // TIMESTAMP
+                writer.Bool(1, true);                         // isAdjustedToUTC
+                writer.BeginStruct(2);                        // unit
+                writer.BeginStruct(3);                        // NANOS
+                writer.EndStruct();
+                writer.EndStruct();
+                writer.EndStruct();
+                writer.EndStruct();
+                break;
+            case ParquetKind_Uuid:
+                writer.BeginStruct(10);                       // logicalType
+                writer.BeginStruct(14);                       // UUID
+                writer.EndStruct();
+                writer.EndStruct();
+                break;
+            case ParquetKind_String:
+                writer.I32(6, ParquetConvertedType_Utf8);     // converted_type
+                writer.BeginStruct(10);                       // logicalType
+                writer.BeginStruct(1);                        // STRING
+                writer.EndStruct();
+                writer.EndStruct();
+                break;
+            default:
+                break;
+            }
+
+            writer.EndStruct();
+        }
+
+        for (auto const rowCount : m_rowGroupRows)
+        {
+            totalRows += rowCount;
+        }
+
+        writer.I64(3, static_cast<INT64>(totalRows));         // num_rows
+
+        // row_groups
+        writer.BeginList(4, ThriftType_Struct, m_rowGroupRows.size());
+        for (unsigned rowGroup = 0; rowGroup != m_rowGroupRows.size(); rowGroup += 1)
+        {
+            UINT64 totalByteSize = 0;
+            writer.BeginListStruct();
+            writer.BeginList(1, ThriftType_Struct, columnCount); // columns
+            for (unsigned i = 0; i != columnCount; i += 1)
+            {
+                auto const& column = m_columns[i];
+                auto const& chunk = m_chunks[rowGroup * columnCount + i];
+                totalByteSize += chunk.UncompressedSize;
+
+                writer.BeginListStruct();
+                writer.I64(2, static_cast<INT64>(chunk.DictionaryPageOffset ? chunk.DictionaryPageOffset : chunk.DataPageOffset)); // file_offset
+                writer.BeginStruct(3);                        // meta_data
+                writer.I32(1, PhysicalType(column.Kind));     // type
+                if (chunk.Encoding == ParquetEncoding_RleDictionary)
+                {
+                    writer.BeginList(2, ThriftType_I32, 3);   // encodings
+                    writer.ListI32(ParquetEncoding_Plain);
+                    writer.ListI32(ParquetEncoding_Rle);
+                    writer.ListI32(ParquetEncoding_RleDictionary);
+                }
+                else
+                {
+                    writer.BeginList(2, ThriftType_I32, 2);   // encodings
+                    writer.ListI32(chunk.Encoding);
+                    writer.ListI32(ParquetEncoding_Rle);
+                }
+
+                writer.BeginList(3, ThriftType_Binary, column.IsList ? 3 : 1); // path_in_schema
+                writer.ListBinary(m_names.data() + column.NameOffset, column.NameLength);
+                if (column.IsList)
+                {
+                    writer.ListBinary(ListName, sizeof(ListName) - 1);
+                    writer.ListBinary(ElementName, sizeof(ElementName) - 1);
+                }
+
+                writer.I32(4, ParquetCodec_Snappy);           // codec
+                writer.I64(5, static_cast<INT64>(chunk.NumValues));        // num_values
+                writer.I64(6, static_cast<INT64>(chunk.UncompressedSize)); // total_uncompressed_size
+                writer.I64(7, static_cast<INT64>(chunk.CompressedSize));   // total_compressed_size
+                writer.I64(9, static_cast<INT64>(chunk.DataPageOffset));   // data_page_offset
+                if (chunk.DictionaryPageOffset)
+                {
+                    writer.I64(11, static_cast<INT64>(chunk.DictionaryPageOffset)); // dictionary_page_offset
+                }
+
+                writer.EndStruct();
+                writer.EndStruct();
+            }
+
+            writer.I64(2, static_cast<INT64>(totalByteSize)); // total_byte_size
+            writer.I64(3, static_cast<INT64>(m_rowGroupRows[rowGroup])); // num_rows
+            writer.EndStruct();
+        }
+
+        // key_value_metadata
+        writer.BeginList(5, ThriftType_Struct, 2);
+        writer.BeginListStruct();
+        writer.Binary(1, ProviderNameKey, sizeof(ProviderNameKey) - 1);
+        writer.Binary(2, m_names.data() + m_providerNameOffset, m_providerNameLength);
+        writer.EndStruct();
+        writer.BeginListStruct();
+        writer.Binary(1, EventNameKey, sizeof(EventNameKey) - 1);
+        writer.Binary(2, m_names.data() + m_eventNameOffset, m_eventNameLength);
+        writer.EndStruct();
+
+        writer.Binary(6, CreatedBy, sizeof(CreatedBy) - 1); // created_by
+        writer.End();
+
+        // Footer, footer size, magic.
+        UINT32 const cbFooter = static_cast<UINT32>(writer.Pos() - m_compressed.data());
+        ASSERT(cbFooter + 8 <= cbMax);
+        memcpy(m_compressed.data() + cbFooter, &cbFooter, 4);
+        memcpy(m_compressed.data() + cbFooter + 4, "PAR1", 4);
+        status = sink.Write(m_compressed.data(), cbFooter + 8);
+        m_filePos += cbFooter + 8;
+    }
+
+    return status;
+}
+
+#pragma endregion
@@ -0,0 +1,387 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "stdafx.h"
+#include <EtwEnumerator.h>
+#include "EtwBuffer.inl"
+#include "EtwUtility.inl"
+
+/*
+Implementation of EtwInternal::SchemaCache, the TRACE_EVENT_INFO cache used by
+EtwEnumerator::StartEvent.
+*/
+
+// EVENT_HEADER.Flags bits that can change the TRACE_EVENT_INFO for an event.
+#define SCHEMA_KEY_FLAGS ( \
+    EVENT_HEADER_FLAG_STRING_ONLY | \
+    EVENT_HEADER_FLAG_TRACE_MESSAGE | \
+    EVENT_HEADER_FLAG_32_BIT_HEADER | \
+    EVENT_HEADER_FLAG_64_BIT_HEADER | \
+    EVENT_HEADER_FLAG_CLASSIC_HEADER)
+
+namespace EtwInternal
+{
+    SchemaCache::SchemaCache() noexcept
+        : m_entries()
+        , m_buckets()
+        , m_capacity(4096)
+        , m_lruHead(NoEntry)
+        , m_lruTail(NoEntry)
+        , m_hits()
+        , m_misses()
+    {
+        return;
+    }
+
+    SchemaCache::~SchemaCache() noexcept
+    {
+        for (auto& entry : m_entries)
+        {
+            HeapFree(GetProcessHeap(), 0, entry.pBlob);
+        }
+    }
+
+    unsigned
+    SchemaCache::Capacity() const noexcept
+    {
+        return m_capacity;
+    }
+
+    unsigned
+    SchemaCache::Count() const noexcept
+    {
+        return m_entries.size();
+    }
+
+    UINT64
+    SchemaCache::Hits() const noexcept
+    {
+        return m_hits;
+    }
+
+    UINT64
+    SchemaCache::Misses() const noexcept
+    {
+        return m_misses;
+    }
+
+    void
+    SchemaCache::SetCapacity(
+        unsigned capacity) noexcept
+    {
+        auto const hits = m_hits;
+        auto const misses = m_misses;
+        Clear();
+        m_hits = hits;
+        m_misses = misses;
+        m_capacity = capacity;
+    }
+
+    void
+    SchemaCache::Clear() noexcept
+    {
+        for (auto& entry : m_entries)
+        {
+            HeapFree(GetProcessHeap(), 0, entry.pBlob);
+        }
+
+        m_entries.clear();
+        m_buckets.clear();
+        m_lruHead = NoEntry;
+        m_lruTail = NoEntry;
+        m_hits = 0;
+        m_misses = 0;
+    }
+
+    void
+    SchemaCache::MakeKey(
+        _In_ EVENT_RECORD const* pEventRecord,
+        _Out_ Key* pKey) noexcept
+    {
+        auto const& header = pEventRecord->EventHeader;
+
+        pKey->ProviderId = header.ProviderId;
+        pKey->EventDescriptor = header.EventDescriptor;
+        pKey->Flags = header.Flags & SCHEMA_KEY_FLAGS;
+        pKey->EventProperty = header.EventProperty;
+        pKey->cbSchemaTl = 0;
+        pKey->cbProvTraits = 0;
+        pKey->pSchemaTl = nullptr;
+        pKey->pProvTraits = nullptr;
+
+        for (unsigned i = 0; i != pEventRecord->ExtendedDataCount; i += 1)
+        {
+            auto const& item = pEventRecord->ExtendedData[i];
+            switch (item.ExtType)
+            {
+            case EVENT_HEADER_EXT_TYPE_EVENT_SCHEMA_TL:
+                pKey->cbSchemaTl = item.DataSize;
+                pKey->pSchemaTl = reinterpret_cast<BYTE const*>(static_cast<ULONG_PTR>(item.DataPtr));
+                break;
+            case EVENT_HEADER_EXT_TYPE_PROV_TRAITS:
+                pKey->cbProvTraits = item.DataSize;
+                pKey->pProvTraits = reinterpret_cast<BYTE const*>(static_cast<ULONG_PTR>(item.DataPtr));
+                break;
+            }
+        }
+
+        if (pKey->pSchemaTl == nullptr)
+        {
+            // Provider traits only matter for TraceLogging decoding.
+            pKey->cbProvTraits = 0;
+            pKey->pProvTraits = nullptr;
+        }
+
+        UINT64 hash = HashBytes(0, &pKey->ProviderId, sizeof(pKey->ProviderId));
+        hash = HashBytes(hash, &pKey->EventDescriptor, sizeof(pKey->EventDescriptor));
+        hash = HashBytes(hash, &pKey->Flags, sizeof(pKey->Flags) + sizeof(pKey->EventProperty));
+        hash = HashBytes(hash, pKey->pSchemaTl, pKey->cbSchemaTl);
+        hash = HashBytes(hash, pKey->pProvTraits, pKey->cbProvTraits);
+        pKey->Hash = static_cast<unsigned>(hash ^ (hash >> 32));
+    }
+
+    _Ret_maybenull_ TRACE_EVENT_INFO const*
+    SchemaCache::Find(
+        Key const& key,
+        _Outptr_result_maybenull_ void const** ppPlan) noexcept
+    {
+        TRACE_EVENT_INFO const* pTei = nullptr;
+        *ppPlan = nullptr;
+
+        if (m_buckets.size() != 0)
+        {
+            auto const bucketMask = m_buckets.size() - 1;
+            for (unsigned i = m_buckets[key.Hash & bucketMask]; i != NoEntry; i = m_entries[i].HashNext)
+            {
+                if (Matches(m_entries[i], key))
+                {
+                    if (i != m_lruHead)
+                    {
+                        LruUnlink(i);
+                        LruPushFront(i);
+                    }
+
+                    auto const& entry = m_entries[i];
+                    pTei = reinterpret_cast<TRACE_EVENT_INFO const*>(entry.pBlob);
+                    if (entry.cbPlanAligned != 0)
+                    {
+                        *ppPlan = entry.pBlob + entry.cbTeiAligned;
+                    }
+                    break;
+                }
+            }
+        }
+
+        if (pTei != nullptr)
+        {
+            m_hits += 1;
+        }
+        else
+        {
+            m_misses += 1;
+        }
+
+        return pTei;
+    }
+
+    _Ret_maybenull_ TRACE_EVENT_INFO const*
+    SchemaCache::Insert(
+        Key const& key,
+        _In_reads_bytes_(cbTei) TRACE_EVENT_INFO const* pTei,
+        unsigned cbTei,
+        _In_reads_bytes_opt_(cbPlan) void const* pPlan,
+        unsigned cbPlan,
+        _Outptr_result_maybenull_ void const** ppCachedPlan) noexcept
+    {
+        TRACE_EVENT_INFO const* pCachedTei = nullptr;
+        unsigned index;
+        BYTE* pBlob;
+        auto const cbTeiAligned = AlignBlobSize(cbTei);
+        auto const cbPlanAligned = AlignBlobSize(cbPlan);
+        auto const cbMetadata = static_cast<unsigned>(key.cbSchemaTl) + key.cbProvTraits;
+
+        *ppCachedPlan = nullptr;
+
+        if (m_capacity == 0 ||
+            cbTeiAligned < cbTei ||
+            cbPlanAligned < cbPlan ||
+            cbTeiAligned + cbPlanAligned < cbTeiAligned ||
+            cbTeiAligned + cbPlanAligned + cbMetadata < cbMetadata)
+        {
+            goto Done;
+        }
+
+        if (m_buckets.size() == 0)
+        {
+            // Size the hash table for an average chain length <= 1.
+            unsigned bucketCount = 16;
+            while (bucketCount < m_capacity && bucketCount < 0x10000000)
+            {
+                bucketCount *= 2;
+            }
+
+            if (!m_buckets.resize(bucketCount, false))
+            {
+                goto Done;
+            }
+
+            memset(m_buckets.data(), 0xff, m_buckets.byte_size()); // NoEntry
+        }
+
+        pBlob = static_cast<BYTE*>(HeapAlloc(
+            GetProcessHeap(),
+            0,
+            cbTeiAligned + cbPlanAligned + cbMetadata));
+        if (pBlob == nullptr)
+        {
+            goto Done;
+        }
+
+        if (m_entries.size() < m_capacity)
+        {
+            index = m_entries.size();
+            if (!m_entries.push_back(Entry()))
+            {
+                HeapFree(GetProcessHeap(), 0, pBlob);
+                goto Done;
+            }
+        }
+        else
+        {
+            // Full. Reuse the least-recently-used entry.
+            index = m_lruTail;
+            Evict(index);
+        }
+
+        {
+            auto const pbPlan = pBlob + cbTeiAligned;
+            auto const pbSchemaTl = pbPlan + cbPlanAligned;
+            memcpy(pBlob, pTei, cbTei);
+            memcpy(pbPlan, pPlan, cbPlan);
+            memcpy(pbSchemaTl, key.pSchemaTl, key.cbSchemaTl);
+            memcpy(pbSchemaTl + key.cbSchemaTl, key.pProvTraits, key.cbProvTraits);
+            if (cbPlan != 0)
+            {
+                *ppCachedPlan = pbPlan;
+            }
+        }
+
+        {
+            auto& entry = m_entries[index];
+            auto& bucket = m_buckets[key.Hash & (m_buckets.size() - 1)];
+            entry.ProviderId = key.ProviderId;
+            entry.EventDescriptor = key.EventDescriptor;
+            entry.Flags = key.Flags;
+            entry.EventProperty = key.EventProperty;
+            entry.Hash = key.Hash;
+            entry.cbSchemaTl = key.cbSchemaTl;
+            entry.cbProvTraits = key.cbProvTraits;
+            entry.cbTeiAligned = cbTeiAligned;
+            entry.cbPlanAligned = cbPlan != 0 ? cbPlanAligned : 0;
+            entry.pBlob = pBlob;
+            entry.HashNext = bucket;
+            bucket = index;
+        }
+
+        LruPushFront(index);
+        pCachedTei = reinterpret_cast<TRACE_EVENT_INFO const*>(pBlob);
+
+    Done:
+
+        return pCachedTei;
+    }
+
+    bool
+    SchemaCache::Matches(
+        Entry const& entry,
+        Key const& key) const noexcept
+    {
+        if (entry.Hash != key.Hash ||
+            entry.Flags != key.Flags ||
+            entry.EventProperty != key.EventProperty ||
+            entry.cbSchemaTl != key.cbSchemaTl ||
+            entry.cbProvTraits != key.cbProvTraits ||
+            0 != memcmp(&entry.EventDescriptor, &key.EventDescriptor, sizeof(key.EventDescriptor)) ||
+            0 != memcmp(&entry.ProviderId, &key.ProviderId, sizeof(key.ProviderId)))
+        {
+            return false;
+        }
+
+        if (key.cbSchemaTl == 0)
+        {
+            return true;
+        }
+
+        auto const pbSchemaTl = entry.pBlob + entry.cbTeiAligned + entry.cbPlanAligned;
+        return
+            0 == memcmp(pbSchemaTl, key.pSchemaTl, key.cbSchemaTl) &&
+            0 == memcmp(pbSchemaTl + key.cbSchemaTl, key.pProvTraits, key.cbProvTraits);
+    }
+
+    void
+    SchemaCache::LruUnlink(
+        unsigned index) noexcept
+    {
+        auto& entry = m_entries[index];
+
+        if (entry.LruPrev == NoEntry)
+        {
+            m_lruHead = entry.LruNext;
+        }
+        else
+        {
+            m_entries[entry.LruPrev].LruNext = entry.LruNext;
+        }
+
+        if (entry.LruNext == NoEntry)
+        {
+            m_lruTail = entry.LruPrev;
+        }
+        else
+        {
+            m_entries[entry.LruNext].LruPrev = entry.LruPrev;
+        }
+    }
+
+    void
+    SchemaCache::LruPushFront(
+        unsigned index) noexcept
+    {
+        auto& entry = m_entries[index];
+
+        entry.LruPrev = NoEntry;
+        entry.LruNext = m_lruHead;
+        if (m_lruHead == NoEntry)
+        {
+            m_lruTail = index;
+        }
+        else
+        {
+            m_entries[m_lruHead].LruPrev = index;
+        }
+
+        m_lruHead = index;
+    }
+
+    void
+    SchemaCache::Evict(
+        unsigned index) noexcept
+    {
+        auto& entry = m_entries[index];
+
+        // Remove from hash chain.
+        unsigned* pLink = &m_buckets[entry.Hash & (m_buckets.size() - 1)];
+        while (*pLink != index)
+        {
+            ASSERT(*pLink != NoEntry);
+            pLink = &m_entries[*pLink].HashNext;
+        }
+        *pLink = entry.HashNext;
+
+        LruUnlink(index);
+
+        HeapFree(GetProcessHeap(), 0, entry.pBlob);
+        entry.pBlob = nullptr;
+    }
+}
+// namespace EtwInternal
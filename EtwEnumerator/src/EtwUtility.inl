@@ -0,0 +1,134 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Internal helpers shared by the EtwEnumerator implementation files.
+*/
+
+#pragma once
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h> // SSE2
+#endif
+
+namespace EtwInternal
+{
+    static UINT64 const HashMultiplier = 0x9E3779B97F4A7C15;
+    static UINT64 const UnixEpochFileTime = 116444736000000000; // 1970-01-01 as FILETIME.
+
+    /*
+    Mixes the cb bytes at p into hash. Used for the cache and dictionary hash
+    tables, not for anything persisted: the result may change between
+    versions.
+    */
+    inline UINT64
+    HashBytes(
+        UINT64 hash,
+        _In_reads_bytes_(cb) void const* p,
+        unsigned cb) noexcept
+    {
+        auto pb = static_cast<BYTE const*>(p);
+        UINT64 chunk;
+
+        for (; cb >= sizeof(chunk); cb -= sizeof(chunk), pb += sizeof(chunk))
+        {
+            memcpy(&chunk, pb, sizeof(chunk));
+            hash = (hash ^ chunk) * HashMultiplier;
+            hash ^= hash >> 29;
+        }
+
+        if (cb != 0)
+        {
+            chunk = 0;
+            memcpy(&chunk, pb, cb);
+            hash = (hash ^ chunk ^ (UINT64(cb) << 56)) * HashMultiplier;
+            hash ^= hash >> 29;
+        }
+
+        return hash;
+    }
+
+    // Rounds a size up so that the next item in a cache blob is aligned.
+    inline unsigned
+    AlignBlobSize(
+        unsigned cb) noexcept
+    {
+        return (cb + 7u) & ~7u;
+    }
+
+    /*
+    Writes pchInput[0..cchInput) to pbOutput, converted from UTF-16 to UTF-8.
+    Unpaired surrogates are converted to U+FFFD, as with WideCharToMultiByte.
+    pbOutput must have room for cchInput * 3 bytes. Returns the end of the
+    output.
+    */
+    inline BYTE*
+    WriteUtf16AsUtf8(
+        _Out_writes_(cchInput * 3) BYTE* pbOutput,
+        _In_reads_(cchInput) EtwWCHAR const* pchInput,
+        unsigned cchInput) noexcept
+    {
+        unsigned i = 0;
+
+        while (i != cchInput)
+        {
+#if defined(_M_IX86) || defined(_M_X64)
+            static_assert(sizeof(EtwWCHAR) == 2, "SSE2 kernel assumes UTF-16");
+
+            // Copy ASCII 8 characters at a time.
+            if (cchInput - i >= 8)
+            {
+                __m128i const chars = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pchInput + i));
+                __m128i const nonAscii = _mm_and_si128(chars, _mm_set1_epi16(static_cast<short>(0xFF80)));
+                if (0xFFFF == _mm_movemask_epi8(_mm_cmpeq_epi16(nonAscii, _mm_setzero_si128())))
+                {
+                    _mm_storel_epi64(reinterpret_cast<__m128i*>(pbOutput), _mm_packus_epi16(chars, chars));
+                    pbOutput += 8;
+                    i += 8;
+                    continue;
+                }
+            }
+#endif // SSE2
+
+            unsigned ch = pchInput[i];
+            i += 1;
+
+            if (ch < 0x80)
+            {
+                *pbOutput++ = static_cast<BYTE>(ch);
+            }
+            else if (ch < 0x800)
+            {
+                *pbOutput++ = static_cast<BYTE>(0xC0 | (ch >> 6));
+                *pbOutput++ = static_cast<BYTE>(0x80 | (ch & 0x3F));
+            }
+            else
+            {
+                if (ch >= 0xD800 && ch <= 0xDFFF)
+                {
+                    unsigned const low = i != cchInput ? pchInput[i] : 0u;
+                    if (ch <= 0xDBFF && low >= 0xDC00 && low <= 0xDFFF)
+                    {
+                        // Surrogate pair: 4 bytes for 2 code units.
+                        ch = 0x10000 + ((ch - 0xD800) << 10) + (low - 0xDC00);
+                        i += 1;
+                        *pbOutput++ = static_cast<BYTE>(0xF0 | (ch >> 18));
+                        *pbOutput++ = static_cast<BYTE>(0x80 | ((ch >> 12) & 0x3F));
+                        *pbOutput++ = static_cast<BYTE>(0x80 | ((ch >> 6) & 0x3F));
+                        *pbOutput++ = static_cast<BYTE>(0x80 | (ch & 0x3F));
+                        continue;
+                    }
+
+                    ch = 0xFFFD; // Unpaired surrogate.
+                }
+
+                *pbOutput++ = static_cast<BYTE>(0xE0 | (ch >> 12));
+                *pbOutput++ = static_cast<BYTE>(0x80 | ((ch >> 6) & 0x3F));
+                *pbOutput++ = static_cast<BYTE>(0x80 | (ch & 0x3F));
+            }
+        }
+
+        return pbOutput;
+    }
+}
+// namespace EtwInternal
@@ -0,0 +1,534 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for GetArraySpan and the EtwArraySpan helpers. Over random payloads
+with fixed-length and counted arrays (0 to a few hundred elements) of each
+fixed-size type, at unaligned offsets, 32-bit and 64-bit pointers, and
+truncation, each span must match the array's elements as read one at a time
+with MoveNext, and CopyTo, WidenTo, SumAsInt64, SumAsDouble, and MinMax must
+match a loop over those elements. GetArraySpan must fail (and leave the
+enumerator unchanged) for the wrong element size, for arrays without a fixed
+element size, and for items other than ArrayBegin. The 32-bit and 64-bit
+integer kernels are also checked at every count up to 40 (the SSE2 loops
+and their scalar tails) with extreme values.
+*/
+
+#include "EtwTest.h"
+#include <algorithm>
+#include <random>
+#include <type_traits>
+
+using namespace EtwTest;
+
+namespace
+{
+    struct Bytes3
+    {
+        BYTE Data[3];
+    };
+
+    USHORT const ArrayTypes[] = {
+        TDH_INTYPE_INT8, TDH_INTYPE_UINT8, TDH_INTYPE_INT16, TDH_INTYPE_UINT16,
+        TDH_INTYPE_INT32, TDH_INTYPE_UINT32, TDH_INTYPE_HEXINT32, TDH_INTYPE_INT64,
+        TDH_INTYPE_UINT64, TDH_INTYPE_HEXINT64, TDH_INTYPE_FLOAT, TDH_INTYPE_DOUBLE,
+        TDH_INTYPE_BOOLEAN, TDH_INTYPE_GUID, TDH_INTYPE_FILETIME, TDH_INTYPE_SYSTEMTIME,
+        TDH_INTYPE_POINTER, TDH_INTYPE_SIZET };
+    unsigned const ArrayTypeCount = sizeof(ArrayTypes) / sizeof(ArrayTypes[0]);
+
+    enum class Helpers
+    {
+        Copy,     // CopyTo.
+        Integer,  // CopyTo, WidenTo, SumAsInt64, SumAsDouble, MinMax.
+        Floating, // CopyTo, SumAsDouble, MinMax.
+    };
+
+    class SpanFixture
+    {
+        TestSchema m_schema;
+        TestCallbacks m_callbacks;
+        std::mt19937 m_rng;
+
+    public:
+
+        EtwEnumerator Enumerator;
+        unsigned Mismatches;
+        unsigned Spans;
+        unsigned Elements;
+
+        SpanFixture()
+            : m_schema()
+            , m_callbacks()
+            , m_rng(7)
+            , Enumerator(m_callbacks)
+            , Mismatches(0)
+            , Spans(0)
+            , Elements(0)
+        {
+            m_schema.Add("Pad", Scalar(TDH_INTYPE_UINT8));                         //  0 Misaligns the rest.
+            m_schema.Add("N", Scalar(TDH_INTYPE_UINT16));                          //  1
+            for (unsigned i = 0; i != ArrayTypeCount; i += 1)
+            {
+                // Counted (N) and fixed-length (5) arrays of each type.
+                auto const name = "A" + std::to_string(ArrayTypes[i]);
+                m_schema.Add((name + "n").c_str(), CountedArray(ArrayTypes[i], 1)); //  2, 4, ...
+                m_schema.Add((name + "5").c_str(), Scalar(ArrayTypes[i], TDH_OUTTYPE_NULL, 5));
+            }
+
+            m_schema.Add("Strs", Scalar(TDH_INTYPE_UNICODESTRING, TDH_OUTTYPE_NULL, 2)); // 38
+            m_schema.Add("Recs", Struct(41, 1, 2));                                // 39
+            m_schema.Add("Tail", Scalar(TDH_INTYPE_UINT8));                        // 40
+            m_schema.Add("V", Scalar(TDH_INTYPE_UINT32));                          // 41
+            m_schema.SetTopLevelCount(41);
+            m_callbacks.SetSchema(1, m_schema);
+        }
+
+        unsigned
+        Random(unsigned limit)
+        {
+            return static_cast<unsigned>(m_rng() % limit);
+        }
+
+        TestEvent
+        MakeEvent(unsigned cbPointer)
+        {
+            TestEvent event(1);
+            USHORT const n = static_cast<USHORT>(Random(10) == 0 ? 60000 : Random(4) == 0 ? Random(300) : Random(9));
+            event.Add(static_cast<BYTE>(m_rng()));
+            event.Add(n);
+            for (auto inType : ArrayTypes)
+            {
+                for (unsigned count : { n < 300u ? n : 300u, 5u })
+                {
+                    for (unsigned i = 0; i != count; i += 1)
+                    {
+                        AddValue(event, inType, cbPointer);
+                    }
+                }
+            }
+
+            event.AddString("s1").AddString("");
+            event.Add(static_cast<UINT32>(m_rng())).Add(static_cast<UINT32>(m_rng()));
+            event.Add(static_cast<BYTE>(m_rng()));
+            return event;
+        }
+
+        // Checks the span and the helpers of the array at ArrayBegin, then
+        // moves to its ArrayEnd.
+        void
+        CheckArray(EtwItemInfo const& info)
+        {
+            switch (info.InType)
+            {
+            case TDH_INTYPE_INT8: Check<INT8>(info, Helpers::Integer); break;
+            case TDH_INTYPE_UINT8: Check<UINT8>(info, Helpers::Integer); break;
+            case TDH_INTYPE_INT16: Check<INT16>(info, Helpers::Integer); break;
+            case TDH_INTYPE_UINT16: Check<UINT16>(info, Helpers::Integer); break;
+            case TDH_INTYPE_INT32: Check<INT32>(info, Helpers::Integer); break;
+            case TDH_INTYPE_UINT32:
+            case TDH_INTYPE_HEXINT32: Check<UINT32>(info, Helpers::Integer); break;
+            case TDH_INTYPE_INT64:
+            case TDH_INTYPE_FILETIME: Check<INT64>(info, Helpers::Integer); break;
+            case TDH_INTYPE_UINT64:
+            case TDH_INTYPE_HEXINT64: Check<UINT64>(info, Helpers::Integer); break;
+            case TDH_INTYPE_FLOAT: Check<float>(info, Helpers::Floating); break;
+            case TDH_INTYPE_DOUBLE: Check<double>(info, Helpers::Floating); break;
+            case TDH_INTYPE_BOOLEAN: Check<BOOL>(info, Helpers::Integer); break;
+            case TDH_INTYPE_GUID: Check<GUID>(info, Helpers::Copy); break;
+            case TDH_INTYPE_SYSTEMTIME: Check<SYSTEMTIME>(info, Helpers::Copy); break;
+            case TDH_INTYPE_POINTER:
+            case TDH_INTYPE_SIZET:
+                if (info.ElementSize == 8)
+                {
+                    Check<UINT64>(info, Helpers::Integer);
+                }
+                else
+                {
+                    Check<UINT32>(info, Helpers::Integer);
+                }
+                break;
+            default:
+                Report(false, "unexpected InType");
+                break;
+            }
+        }
+
+        // GetArraySpan fails at the current item (not an ArrayBegin).
+        template<class T>
+        void
+        CheckNotSpan(char const* szWhat)
+        {
+            EtwArraySpan<T> span = { reinterpret_cast<T const*>(1), 1 };
+            auto const state = Enumerator.State();
+            auto const pData = Enumerator.GetItemInfo().Data;
+            Report(!Enumerator.GetArraySpan(&span) && span.Data == nullptr && span.Count == 0, szWhat);
+            Report(Enumerator.State() == state && Enumerator.GetItemInfo().Data == pData, szWhat);
+        }
+
+        void
+        Report(bool ok, char const* szWhat)
+        {
+            if (!ok)
+            {
+                if (Mismatches < 5)
+                {
+                    printf("Mismatch: %s\n", szWhat);
+                }
+
+                Mismatches += 1;
+            }
+        }
+
+    private:
+
+        template<class T>
+        void
+        Check(EtwItemInfo const& info, Helpers helpers)
+        {
+            Report(info.ElementSize == sizeof(T), "ElementSize");
+
+            // Wrong element size: fails without changing the state.
+            EtwArraySpan<Bytes3> wrong = { reinterpret_cast<Bytes3 const*>(1), 1 };
+            Report(!Enumerator.GetArraySpan(&wrong) && wrong.Data == nullptr && wrong.Count == 0, "wrong size");
+
+            EtwArraySpan<T> span = {};
+            Report(Enumerator.GetArraySpan(&span), "GetArraySpan");
+            Report(Enumerator.State() == EtwEnumeratorState_ArrayBegin, "state");
+            Report(span.Count == info.ArrayCount, "Count");
+            Report(static_cast<void const*>(span.Data) == info.Data, "Data");
+
+            // Per-element reads.
+            std::vector<T> elements;
+            for (unsigned i = 0; i != info.ArrayCount; i += 1)
+            {
+                ETW_CHECK(Enumerator.MoveNext());
+                auto const element = Enumerator.GetItemInfo();
+                ETW_CHECK(element.DataSize == sizeof(T) && element.ArrayIndex == i);
+                T value;
+                memcpy(&value, element.Data, sizeof(T));
+                elements.push_back(value);
+                CheckNotSpan<T>("element");
+            }
+
+            ETW_CHECK(Enumerator.MoveNext());
+            ETW_CHECK(Enumerator.State() == EtwEnumeratorState_ArrayEnd);
+            CheckNotSpan<T>("ArrayEnd");
+            Spans += 1;
+            Elements += span.Count;
+
+            bool same = true;
+            for (UINT32 i = 0; i != span.Count && i < elements.size(); i += 1)
+            {
+                T const value = span[i];
+                same = same && 0 == memcmp(&value, &elements[i], sizeof(T));
+            }
+
+            Report(same, "elements");
+
+            std::vector<T> copy(span.Count + 1);
+            copy.back() = T();
+            span.CopyTo(copy.data());
+            Report(elements.empty() || 0 == memcmp(copy.data(), elements.data(), span.Count * sizeof(T)), "CopyTo");
+            T const zero = T();
+            Report(0 == memcmp(&copy.back(), &zero, sizeof(T)), "CopyTo overrun");
+
+            CheckHelpers(span, elements, helpers);
+        }
+
+        template<class T>
+        void
+        CheckHelpers(EtwArraySpan<T> const& span, std::vector<T> const& elements, Helpers helpers)
+        {
+            CheckNumbers(span, elements, helpers, std::is_arithmetic<T>());
+        }
+
+        template<class T>
+        void
+        CheckNumbers(EtwArraySpan<T> const&, std::vector<T> const&, Helpers, std::false_type)
+        {
+            return;
+        }
+
+        template<class T>
+        void
+        CheckNumbers(EtwArraySpan<T> const& span, std::vector<T> const& elements, Helpers helpers, std::true_type)
+        {
+            if (helpers == Helpers::Integer)
+            {
+                CheckIntegers(span, elements, std::is_integral<T>());
+            }
+
+            double expectedSum = 0;
+            double magnitude = 0;
+            for (T value : elements)
+            {
+                expectedSum += static_cast<double>(value);
+                magnitude += static_cast<double>(value) < 0 ? -static_cast<double>(value) : static_cast<double>(value);
+            }
+
+            double const sum = span.SumAsDouble();
+            double const difference = sum < expectedSum ? expectedSum - sum : sum - expectedSum;
+            Report(difference <= magnitude * 1e-12, "SumAsDouble");
+
+            T lo = T(1);
+            T hi = T(2);
+            bool const found = span.MinMax(&lo, &hi);
+            Report(found == !elements.empty(), "MinMax result");
+            if (elements.empty())
+            {
+                Report(lo == T() && hi == T(), "MinMax empty");
+            }
+            else
+            {
+                T expectedLo = elements[0];
+                T expectedHi = elements[0];
+                for (T value : elements)
+                {
+                    expectedLo = value < expectedLo ? value : expectedLo;
+                    expectedHi = expectedHi < value ? value : expectedHi;
+                }
+
+                Report(lo == expectedLo && hi == expectedHi, "MinMax");
+            }
+        }
+
+        template<class T>
+        void
+        CheckIntegers(EtwArraySpan<T> const&, std::vector<T> const&, std::false_type)
+        {
+            return;
+        }
+
+        template<class T>
+        void
+        CheckIntegers(EtwArraySpan<T> const& span, std::vector<T> const& elements, std::true_type)
+        {
+            std::vector<INT64> wide(span.Count + 1, 0x5a5a);
+            span.WidenTo(wide.data());
+            UINT64 expectedSum = 0;
+            bool same = true;
+            for (size_t i = 0; i != elements.size(); i += 1)
+            {
+                same = same && wide[i] == static_cast<INT64>(elements[i]);
+                expectedSum += static_cast<UINT64>(static_cast<INT64>(elements[i]));
+            }
+
+            Report(same && wide.back() == 0x5a5a, "WidenTo");
+            Report(static_cast<UINT64>(span.SumAsInt64()) == expectedSum, "SumAsInt64");
+        }
+
+        void
+        AddValue(TestEvent& event, USHORT inType, unsigned cbPointer)
+        {
+            switch (inType)
+            {
+            case TDH_INTYPE_FLOAT:
+                event.Add(static_cast<float>(static_cast<INT32>(m_rng())) / 64);
+                break;
+            case TDH_INTYPE_DOUBLE:
+                event.Add(static_cast<double>(static_cast<INT32>(m_rng())) * 1e10 / 3);
+                break;
+            default:
+            {
+                unsigned const cb =
+                    inType == TDH_INTYPE_POINTER || inType == TDH_INTYPE_SIZET ? cbPointer
+                    : inType == TDH_INTYPE_INT8 || inType == TDH_INTYPE_UINT8 ? 1
+                    : inType == TDH_INTYPE_INT16 || inType == TDH_INTYPE_UINT16 ? 2
+                    : inType == TDH_INTYPE_GUID || inType == TDH_INTYPE_SYSTEMTIME ? 16
+                    : inType == TDH_INTYPE_INT64 || inType == TDH_INTYPE_UINT64 ||
+                      inType == TDH_INTYPE_HEXINT64 || inType == TDH_INTYPE_FILETIME ? 8
+                    : 4;
+                for (unsigned i = 0; i != cb; i += 1)
+                {
+                    event.Add(static_cast<BYTE>(m_rng()));
+                }
+                break;
+            }
+            }
+        }
+    };
+}
+
+ETW_TEST(ArraySpan_MatchesElementReads)
+{
+    SpanFixture f;
+    unsigned errors = 0;
+    unsigned notSpans = 0;
+
+    for (unsigned eventIndex = 0; eventIndex != 600; eventIndex += 1)
+    {
+        unsigned const cbPointer = eventIndex % 2 ? 4 : 8;
+        TestEvent event = f.MakeEvent(cbPointer);
+        if (eventIndex % 4 == 3 && event.PayloadSize() != 0)
+        {
+            event.Truncate(f.Random(static_cast<unsigned>(event.PayloadSize())));
+        }
+
+        EVENT_RECORD& record = event.Record();
+        if (cbPointer == 4)
+        {
+            record.EventHeader.Flags = EVENT_HEADER_FLAG_32_BIT_HEADER;
+        }
+
+        f.Enumerator.SetDecodePlansEnabled(eventIndex % 3 != 0);
+        ETW_CHECK(f.Enumerator.StartEvent(&record));
+        while (f.Enumerator.MoveNext())
+        {
+            auto const info = f.Enumerator.GetItemInfo();
+            if (f.Enumerator.State() == EtwEnumeratorState_ArrayBegin && info.ElementSize != 0)
+            {
+                f.CheckArray(info);
+            }
+            else
+            {
+                // Not the ArrayBegin of a simple array.
+                f.CheckNotSpan<UINT32>("not a span");
+                f.CheckNotSpan<BYTE>("not a byte span");
+                notSpans += 1;
+            }
+        }
+
+        errors += f.Enumerator.State() == EtwEnumeratorState_Error;
+    }
+
+    ETW_CHECK(f.Mismatches == 0);
+    ETW_CHECK(f.Spans > 10000);
+    ETW_CHECK(f.Elements > 100000);
+    ETW_CHECK(notSpans != 0);
+    ETW_CHECK(errors != 0);
+    ETW_CHECK(errors < 600 / 2);
+}
+
+ETW_TEST(ArraySpan_Helpers)
+{
+    // Edge values, unaligned, with counts that are not multiples of 4.
+    BYTE buffer[1 + 7 * sizeof(INT64)];
+    INT64 const values[] = { -1, INT64(0x8000000000000000), 0x7fffffffffffffff, 0, 5, -3, 2 };
+    memcpy(buffer + 1, values, sizeof(values));
+    EtwArraySpan<INT64> span = { reinterpret_cast<INT64 const UNALIGNED*>(buffer + 1), 7 };
+    INT64 lo;
+    INT64 hi;
+    ETW_CHECK(span.MinMax(&lo, &hi));
+    ETW_CHECK(lo == values[1] && hi == values[2]);
+    ETW_CHECK(span.SumAsInt64() == 2); // Wraps.
+    ETW_CHECK(span[6] == 2);
+
+    UINT64 const big[] = { 0xffffffffffffffff, 2 };
+    EtwArraySpan<UINT64> bigSpan = { big, 2 };
+    INT64 wide[2];
+    bigSpan.WidenTo(wide);
+    ETW_CHECK(wide[0] == -1 && wide[1] == 2);
+    ETW_CHECK(static_cast<UINT64>(bigSpan.SumAsInt64()) == 1);
+
+    EtwArraySpan<double> empty = { nullptr, 0 };
+    double dlo = 1;
+    double dhi = 2;
+    ETW_CHECK(!empty.MinMax(&dlo, &dhi));
+    ETW_CHECK(dlo == 0 && dhi == 0);
+    ETW_CHECK(empty.SumAsDouble() == 0);
+}
+
+ETW_TEST(ArraySpan_KernelTails)
+{
+    // Every count from 0 to 40 (the SSE2 loops and their scalar tails) at
+    // each offset from 0 to 7, with the extreme values of each type (which
+    // must sign- or zero-extend, wrap, and order correctly).
+    static UINT32 const Patterns[] = {
+        0x80000000, 0x7fffffff, 0xffffffff, 0, 1, 0x80000001, 0x12345678, 0xfffffffe,
+    };
+    alignas(16) BYTE buffer[8 + 40 * sizeof(UINT64)];
+    INT64 wide[40];
+    UINT32 copy[40];
+    unsigned mismatches = 0;
+
+    for (UINT32 count = 0; count != 41; count += 1)
+    {
+        for (unsigned offset = 0; offset != 8; offset += 1)
+        {
+            std::vector<UINT32> values;
+            for (UINT32 i = 0; i != count; i += 1)
+            {
+                values.push_back(Patterns[(i * 5 + count + offset) % _countof(Patterns)]);
+            }
+
+            if (!values.empty())
+            {
+                memcpy(buffer + offset, values.data(), count * sizeof(UINT32));
+            }
+
+            EtwArraySpan<INT32> signedSpan = { reinterpret_cast<INT32 const UNALIGNED*>(buffer + offset), count };
+            EtwArraySpan<UINT32> unsignedSpan = { reinterpret_cast<UINT32 const UNALIGNED*>(buffer + offset), count };
+            UINT64 signedSum = 0;
+            UINT64 unsignedSum = 0;
+            INT32 signedLo = count ? static_cast<INT32>(values[0]) : 0;
+            INT32 signedHi = signedLo;
+            UINT32 unsignedLo = count ? values[0] : 0;
+            UINT32 unsignedHi = unsignedLo;
+            for (auto value : values)
+            {
+                signedSum += static_cast<UINT64>(static_cast<INT64>(static_cast<INT32>(value)));
+                unsignedSum += value;
+                signedLo = std::min(signedLo, static_cast<INT32>(value));
+                signedHi = std::max(signedHi, static_cast<INT32>(value));
+                unsignedLo = std::min(unsignedLo, value);
+                unsignedHi = std::max(unsignedHi, value);
+            }
+
+            INT32 slo;
+            INT32 shi;
+            UINT32 ulo;
+            UINT32 uhi;
+            mismatches += signedSpan.MinMax(&slo, &shi) != (count != 0) || slo != signedLo || shi != signedHi;
+            mismatches += unsignedSpan.MinMax(&ulo, &uhi) != (count != 0) || ulo != unsignedLo || uhi != unsignedHi;
+            mismatches += static_cast<UINT64>(signedSpan.SumAsInt64()) != signedSum;
+            mismatches += static_cast<UINT64>(unsignedSpan.SumAsInt64()) != unsignedSum;
+
+            signedSpan.WidenTo(wide);
+            for (UINT32 i = 0; i != count; i += 1)
+            {
+                mismatches += wide[i] != static_cast<INT32>(values[i]);
+            }
+
+            unsignedSpan.WidenTo(wide);
+            for (UINT32 i = 0; i != count; i += 1)
+            {
+                mismatches += wide[i] != static_cast<INT64>(values[i]);
+            }
+
+            memset(copy, 0xcc, sizeof(copy));
+            unsignedSpan.CopyTo(copy);
+            mismatches += 0 != memcmp(copy, values.data(), count * sizeof(UINT32));
+            mismatches += count != 40 && copy[count] != 0xcccccccc; // No overrun.
+
+            // The same bytes as 64-bit values.
+            UINT32 const count64 = count / 2;
+            EtwArraySpan<UINT64> span64 = { reinterpret_cast<UINT64 const UNALIGNED*>(buffer + offset), count64 };
+            UINT64 sum64 = 0;
+            for (UINT32 i = 0; i != count64; i += 1)
+            {
+                sum64 += values[i * 2] | (UINT64(values[i * 2 + 1]) << 32);
+            }
+
+            mismatches += static_cast<UINT64>(span64.SumAsInt64()) != sum64;
+        }
+    }
+
+    ETW_CHECK(mismatches == 0);
+
+    // Fixed values: extremes of each type.
+    UINT32 const extremes[] = { 0x80000000, 0x7fffffff, 0xffffffff, 0, 5 };
+    EtwArraySpan<INT32> signedSpan = { reinterpret_cast<INT32 const*>(extremes), 5 };
+    EtwArraySpan<UINT32> unsignedSpan = { extremes, 5 };
+    INT32 slo;
+    INT32 shi;
+    UINT32 ulo;
+    UINT32 uhi;
+    ETW_CHECK(signedSpan.MinMax(&slo, &shi) && slo == INT32(0x80000000) && shi == 0x7fffffff);
+    ETW_CHECK(unsignedSpan.MinMax(&ulo, &uhi) && ulo == 0 && uhi == 0xffffffff);
+    ETW_CHECK(signedSpan.SumAsInt64() == 3);
+    ETW_CHECK(unsignedSpan.SumAsInt64() == 0x200000003);
+    signedSpan.WidenTo(wide);
+    ETW_CHECK(wide[0] == -0x80000000LL && wide[2] == -1 && wide[4] == 5);
+    unsignedSpan.WidenTo(wide);
+    ETW_CHECK(wide[0] == 0x80000000LL && wide[2] == 0xffffffffLL);
+}
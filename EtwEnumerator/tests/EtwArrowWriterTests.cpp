@@ -0,0 +1,1307 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for EtwArrowWriter. The output is read back with a minimal Arrow IPC
+reader (flatbuffer metadata, dictionary and record batches, file footer)
+and each column is compared, as text, with the EtwColumnBatch it was
+written from. Struct fields are flattened back into one column per member
+for the comparison. Covers list columns, nulls, dictionary-encoded
+value-map columns with delta dictionaries, structs, arrays of structs, and
+the stream and file formats.
+*/
+
+#include "EtwTest.h"
+#include <map>
+#include <stdio.h>
+
+using namespace EtwTest;
+
+namespace
+{
+    typedef std::vector<std::string> Rows;
+
+    UINT64 const UnixEpochFileTime = 116444736000000000;
+
+    struct CollectingSink final
+        : EtwOutputSink
+    {
+        std::string Output;
+
+        LSTATUS __stdcall Write(
+            _In_reads_bytes_(cb) void const* pb,
+            unsigned cb) noexcept override
+        {
+            Output.append(static_cast<char const*>(pb), cb);
+            return ERROR_SUCCESS;
+        }
+    };
+
+    bool
+    IsSet(BYTE const* pBits, UINT64 i)
+    {
+        return (pBits[i / 8] >> (i & 7)) & 1;
+    }
+
+    std::string
+    Quote(std::string const& value)
+    {
+        return '"' + value + '"';
+    }
+
+    std::string
+    Hex(BYTE const* pb, size_t cb)
+    {
+        std::string text;
+        char buffer[4];
+        for (size_t i = 0; i != cb; i += 1)
+        {
+            snprintf(buffer, sizeof(buffer), "%02x", pb[i]);
+            text += buffer;
+        }
+
+        return text;
+    }
+
+    std::string
+    Decimal(UINT64 value, bool isSigned)
+    {
+        char buffer[32];
+        if (isSigned)
+        {
+            snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(value));
+        }
+        else
+        {
+            snprintf(buffer, sizeof(buffer), "%llu", static_cast<unsigned long long>(value));
+        }
+
+        return buffer;
+    }
+
+    std::string
+    ListText(Rows const& items, UINT32 begin, UINT32 end)
+    {
+        std::string text = "[";
+        for (UINT32 i = begin; i != end; i += 1)
+        {
+            text += (i == begin ? "" : ",") + items[i];
+        }
+
+        return text + "]";
+    }
+
+    // Text of value i of a batch column, as the Arrow reader formats it.
+    std::string
+    BatchValueText(
+        EtwColumnInfo const& info,
+        UINT32 i)
+    {
+        auto const pb = static_cast<BYTE const*>(info.Values);
+        if (info.Type == EtwColumnType_None || !IsSet(info.Validity, i))
+        {
+            return "null";
+        }
+
+        switch (info.Type)
+        {
+        case EtwColumnType_Int64:
+        case EtwColumnType_UInt64:
+        {
+            UINT64 value;
+            memcpy(&value, pb + i * 8, 8);
+            return Decimal(value, info.Type == EtwColumnType_Int64);
+        }
+        case EtwColumnType_Double:
+        {
+            char buffer[32];
+            double value;
+            memcpy(&value, pb + i * 8, 8);
+            snprintf(buffer, sizeof(buffer), "%g", value);
+            return buffer;
+        }
+        case EtwColumnType_Guid:
+            return Hex(pb + i * 16, 16);
+        case EtwColumnType_String:
+            return Quote(ToUtf8(
+                reinterpret_cast<EtwWCHAR const*>(pb + info.Offsets[i]),
+                (info.Offsets[i + 1] - info.Offsets[i]) / 2));
+        default:
+            return Quote(std::string(
+                reinterpret_cast<char const*>(pb + info.Offsets[i]),
+                info.Offsets[i + 1] - info.Offsets[i]));
+        }
+    }
+
+    // One string per row: the value, "[values]" for a list, or "null".
+    Rows
+    BatchColumnText(
+        EtwColumnBatch const& batch,
+        unsigned columnIndex)
+    {
+        auto const info = batch.GetColumnInfo(0, columnIndex);
+        Rows values;
+        for (UINT32 i = 0; i != info.ValueCount; i += 1)
+        {
+            values.push_back(BatchValueText(info, i));
+        }
+
+        if (info.ListOffsets == nullptr)
+        {
+            return values;
+        }
+
+        Rows rows;
+        for (UINT32 row = 0; row != info.RowCount; row += 1)
+        {
+            rows.push_back(IsSet(info.ListValidity, row)
+                ? ListText(values, info.ListOffsets[row], info.ListOffsets[row + 1])
+                : "null");
+        }
+
+        return rows;
+    }
+
+    // Reads tables from a flatbuffer. Positions are offsets from the start
+    // of the flatbuffer. Out-of-range reads return 0 and set Bad.
+    struct FbReader
+    {
+        BYTE const* Data;
+        size_t Size;
+        bool Bad;
+
+        FbReader(BYTE const* data, size_t size)
+            : Data(data)
+            , Size(size)
+            , Bad(false)
+        {
+            return;
+        }
+
+        UINT64
+        Read(size_t pos, unsigned cb)
+        {
+            UINT64 value = 0;
+            if (pos > Size || cb > Size - pos)
+            {
+                Bad = true;
+            }
+            else
+            {
+                memcpy(&value, Data + pos, cb);
+            }
+
+            return value;
+        }
+
+        // Position of field slot of the table at tablePos, or 0 if absent.
+        // A tablePos of 0 is an absent table.
+        size_t
+        FieldPos(size_t tablePos, unsigned slot)
+        {
+            if (tablePos == 0)
+            {
+                return 0;
+            }
+
+            size_t const vtablePos = tablePos - static_cast<INT32>(Read(tablePos, 4));
+            unsigned const cbVtable = static_cast<unsigned>(Read(vtablePos, 2));
+            unsigned const fieldOffset = 4 + slot * 2 < cbVtable
+                ? static_cast<unsigned>(Read(vtablePos + 4 + slot * 2, 2))
+                : 0u;
+            return fieldOffset == 0 ? 0 : tablePos + fieldOffset;
+        }
+
+        UINT64
+        Scalar(size_t tablePos, unsigned slot, unsigned cb, UINT64 defaultValue = 0)
+        {
+            size_t const pos = FieldPos(tablePos, slot);
+            return pos == 0 ? defaultValue : Read(pos, cb);
+        }
+
+        // Target of an offset at pos (a table, vector, or string).
+        size_t
+        Deref(size_t pos)
+        {
+            return pos + static_cast<size_t>(Read(pos, 4));
+        }
+
+        // Target of offset field slot, or 0 if absent.
+        size_t
+        Ref(size_t tablePos, unsigned slot)
+        {
+            size_t const pos = FieldPos(tablePos, slot);
+            return pos == 0 ? 0 : Deref(pos);
+        }
+
+        std::string
+        String(size_t tablePos, unsigned slot)
+        {
+            size_t const pos = Ref(tablePos, slot);
+            size_t const cch = pos == 0 ? 0 : static_cast<size_t>(Read(pos, 4));
+            return cch == 0 || Bad || cch > Size - pos - 4
+                ? std::string()
+                : std::string(reinterpret_cast<char const*>(Data + pos + 4), cch);
+        }
+
+        size_t
+        VectorCount(size_t vectorPos)
+        {
+            return vectorPos == 0 ? 0 : static_cast<size_t>(Read(vectorPos, 4));
+        }
+    };
+
+    struct ArrowField
+    {
+        std::string Name;
+        UCHAR TypeId;
+        unsigned BitWidth;      // Int.
+        bool IsSigned;          // Int.
+        unsigned Precision;     // FloatingPoint.
+        unsigned ByteWidth;     // FixedSizeBinary.
+        unsigned TimeUnit;      // Timestamp.
+        std::string TimeZone;   // Timestamp.
+        INT64 DictionaryId;     // -1 if not dictionary-encoded.
+        unsigned IndexBitWidth; // Dictionary-encoded.
+        std::vector<ArrowField> Children;
+    };
+
+    struct ArrowMessage
+    {
+        UCHAR HeaderType;       // 1 = Schema, 2 = DictionaryBatch, 3 = RecordBatch.
+        INT64 DictionaryId;     // DictionaryBatch.
+        bool IsDelta;           // DictionaryBatch.
+        UINT64 Length;          // Rows of a batch.
+        size_t Offset;          // Position of the message in the input.
+        size_t MetadataSize;    // Prefix + flatbuffer.
+        UINT64 BodyLength;
+    };
+
+    // Struct fields, and lists of structs, are read as their members.
+    ArrowField const*
+    StructType(ArrowField const& field)
+    {
+        return field.TypeId == 13 ? &field
+            : field.TypeId == 12 && field.Children.size() == 1 && field.Children[0].TypeId == 13 ? &field.Children[0]
+            : nullptr;
+    }
+
+    // Adds the names of the field's columns ("Struct.Member" for members).
+    void
+    AddColumnNames(
+        ArrowField const& field,
+        std::string const& prefix,
+        std::vector<std::string>& names)
+    {
+        auto const pStruct = StructType(field);
+        if (pStruct == nullptr)
+        {
+            names.push_back(prefix + field.Name);
+            return;
+        }
+
+        for (auto const& child : pStruct->Children)
+        {
+            AddColumnNames(child, prefix + field.Name + ".", names);
+        }
+    }
+
+    // Contents of an Arrow stream or file.
+    struct ArrowData
+    {
+        bool Ok = true;
+        std::vector<ArrowField> Fields;
+        std::vector<std::string> ColumnNames; // One per column of Batches.
+        std::map<std::string, std::string> Metadata;
+        std::vector<ArrowMessage> Messages;
+        std::map<INT64, Rows> Dictionaries;
+        std::vector<std::vector<Rows>> Batches; // Batch, column, row.
+    };
+
+    class ArrowReader
+    {
+        std::string const& m_input;
+        ArrowData& m_data;
+
+        // State of the RecordBatch being read.
+        FbReader* m_pFb;
+        size_t m_nodesPos;
+        size_t m_buffersPos;
+        size_t m_bodyPos;
+        size_t m_bodyLength;
+        size_t m_nodeIndex;
+        size_t m_bufferIndex;
+
+    public:
+
+        ArrowReader(std::string const& input, ArrowData& data)
+            : m_input(input)
+            , m_data(data)
+            , m_pFb(nullptr)
+            , m_nodesPos(0)
+            , m_buffersPos(0)
+            , m_bodyPos(0)
+            , m_bodyLength(0)
+            , m_nodeIndex(0)
+            , m_bufferIndex(0)
+        {
+            return;
+        }
+
+        // Reads the messages starting at pos until the end-of-stream marker.
+        // Returns the position after the marker.
+        size_t
+        ReadStream(size_t pos)
+        {
+            for (;;)
+            {
+                size_t const cbMetadata = ReadMessage(pos);
+                if (cbMetadata == 0)
+                {
+                    return pos + 8;
+                }
+
+                pos += cbMetadata + static_cast<size_t>(m_data.Messages.back().BodyLength);
+            }
+        }
+
+        // Reads the message at pos. Returns the size of its metadata
+        // (prefix + flatbuffer), or 0 for the end-of-stream marker.
+        size_t
+        ReadMessage(size_t pos)
+        {
+            UINT32 prefix[2] = {};
+            if (!Check(pos % 8 == 0 && pos + 8 <= m_input.size()))
+            {
+                return 0;
+            }
+
+            memcpy(prefix, m_input.data() + pos, 8);
+            Check(prefix[0] == 0xFFFFFFFF && prefix[1] % 8 == 0);
+            if (prefix[1] == 0 || !Check(prefix[1] <= m_input.size() - pos - 8))
+            {
+                return 0;
+            }
+
+            FbReader fb(reinterpret_cast<BYTE const*>(m_input.data()) + pos + 8, prefix[1]);
+            ArrowMessage message = {};
+            size_t const messagePos = fb.Deref(0);
+            message.HeaderType = static_cast<UCHAR>(fb.Scalar(messagePos, 1, 1));
+            message.Offset = pos;
+            message.MetadataSize = 8 + prefix[1];
+            message.BodyLength = fb.Scalar(messagePos, 3, 8);
+            Check(fb.Scalar(messagePos, 0, 2) == 4); // V5
+            Check(message.BodyLength % 8 == 0 &&
+                message.BodyLength <= m_input.size() - pos - message.MetadataSize);
+
+            size_t const headerPos = fb.Ref(messagePos, 2);
+            m_pFb = &fb;
+            m_bodyPos = pos + message.MetadataSize;
+            m_bodyLength = static_cast<size_t>(message.BodyLength);
+            switch (message.HeaderType)
+            {
+            case 1:
+                Check(m_data.Fields.empty());
+                ReadSchema(fb, headerPos);
+                break;
+            case 2:
+            {
+                message.DictionaryId = static_cast<INT64>(fb.Scalar(headerPos, 0, 8));
+                message.IsDelta = fb.Scalar(headerPos, 2, 1) != 0;
+                size_t const recordBatchPos = fb.Ref(headerPos, 1);
+                message.Length = fb.Scalar(recordBatchPos, 0, 8);
+                StartBatch(recordBatchPos);
+
+                ArrowField utf8 = {};
+                utf8.TypeId = 5;
+                utf8.DictionaryId = -1;
+                auto values = ReadArray(utf8, message.Length);
+                auto& dictionary = m_data.Dictionaries[message.DictionaryId];
+                if (!message.IsDelta)
+                {
+                    dictionary.clear();
+                }
+
+                for (auto& value : values)
+                {
+                    dictionary.push_back(value.substr(1, value.size() - 2)); // Unquote.
+                }
+
+                EndBatch();
+                break;
+            }
+            case 3:
+            {
+                size_t const recordBatchPos = headerPos;
+                message.Length = fb.Scalar(recordBatchPos, 0, 8);
+                StartBatch(recordBatchPos);
+                std::vector<Rows> columns;
+                for (auto const& field : m_data.Fields)
+                {
+                    ReadColumns(field, message.Length, columns);
+                }
+
+                m_data.Batches.push_back(columns);
+                EndBatch();
+                break;
+            }
+            default:
+                Check(false);
+                break;
+            }
+
+            Check(!fb.Bad);
+            m_pFb = nullptr;
+            m_data.Messages.push_back(message);
+            return message.MetadataSize;
+        }
+
+        // Reads a Schema table.
+        void
+        ReadSchema(FbReader& fb, size_t schemaPos)
+        {
+            Check(fb.Scalar(schemaPos, 0, 2) == 0); // Little-endian.
+            size_t const fieldsPos = fb.Ref(schemaPos, 1);
+            for (size_t i = 0; i != fb.VectorCount(fieldsPos); i += 1)
+            {
+                m_data.Fields.push_back(ReadField(fb, fb.Deref(fieldsPos + 4 + i * 4)));
+                AddColumnNames(m_data.Fields.back(), std::string(), m_data.ColumnNames);
+            }
+
+            size_t const metadataPos = fb.Ref(schemaPos, 2);
+            for (size_t i = 0; i != fb.VectorCount(metadataPos); i += 1)
+            {
+                size_t const keyValuePos = fb.Deref(metadataPos + 4 + i * 4);
+                m_data.Metadata[fb.String(keyValuePos, 0)] = fb.String(keyValuePos, 1);
+            }
+        }
+
+        bool
+        Check(bool condition)
+        {
+            if (!condition)
+            {
+                m_data.Ok = false;
+            }
+
+            return condition;
+        }
+
+    private:
+
+        ArrowField
+        ReadField(FbReader& fb, size_t fieldPos)
+        {
+            ArrowField field = {};
+            field.Name = fb.String(fieldPos, 0);
+            field.TypeId = static_cast<UCHAR>(fb.Scalar(fieldPos, 2, 1));
+            Check(fb.Scalar(fieldPos, 1, 1) == 1); // nullable
+
+            size_t const typePos = fb.Ref(fieldPos, 3);
+            switch (field.TypeId)
+            {
+            case 2: // Int
+                field.BitWidth = static_cast<unsigned>(fb.Scalar(typePos, 0, 4));
+                field.IsSigned = fb.Scalar(typePos, 1, 1) != 0;
+                break;
+            case 3: // FloatingPoint
+                field.Precision = static_cast<unsigned>(fb.Scalar(typePos, 0, 2));
+                break;
+            case 10: // Timestamp
+                field.TimeUnit = static_cast<unsigned>(fb.Scalar(typePos, 0, 2));
+                field.TimeZone = fb.String(typePos, 1);
+                break;
+            case 15: // FixedSizeBinary
+                field.ByteWidth = static_cast<unsigned>(fb.Scalar(typePos, 0, 4));
+                break;
+            }
+
+            field.DictionaryId = -1;
+            size_t const encodingPos = fb.Ref(fieldPos, 4);
+            if (encodingPos != 0)
+            {
+                size_t const indexTypePos = fb.Ref(encodingPos, 1);
+                field.DictionaryId = static_cast<INT64>(fb.Scalar(encodingPos, 0, 8));
+                field.IndexBitWidth = static_cast<unsigned>(fb.Scalar(indexTypePos, 0, 4));
+                Check(fb.Scalar(indexTypePos, 1, 1) == 1); // Signed.
+            }
+
+            size_t const childrenPos = fb.Ref(fieldPos, 5);
+            for (size_t i = 0; i != fb.VectorCount(childrenPos); i += 1)
+            {
+                field.Children.push_back(ReadField(fb, fb.Deref(childrenPos + 4 + i * 4)));
+            }
+
+            return field;
+        }
+
+        void
+        StartBatch(size_t recordBatchPos)
+        {
+            m_nodesPos = m_pFb->Ref(recordBatchPos, 1);
+            m_buffersPos = m_pFb->Ref(recordBatchPos, 2);
+            m_nodeIndex = 0;
+            m_bufferIndex = 0;
+        }
+
+        // All nodes and buffers were used.
+        void
+        EndBatch()
+        {
+            Check(m_nodeIndex == m_pFb->VectorCount(m_nodesPos));
+            Check(m_bufferIndex == m_pFb->VectorCount(m_buffersPos));
+        }
+
+        // Reads the next FieldNode. Returns its null count.
+        UINT64
+        NextNode(UINT64 length)
+        {
+            if (!Check(m_nodeIndex < m_pFb->VectorCount(m_nodesPos)))
+            {
+                return 0;
+            }
+
+            size_t const pos = m_nodesPos + 4 + m_nodeIndex * 16;
+            m_nodeIndex += 1;
+            Check(m_pFb->Read(pos, 8) == length);
+            return m_pFb->Read(pos + 8, 8);
+        }
+
+        // Returns the next body buffer, or an empty string.
+        std::string
+        NextBuffer()
+        {
+            if (!Check(m_bufferIndex < m_pFb->VectorCount(m_buffersPos)))
+            {
+                return std::string();
+            }
+
+            size_t const pos = m_buffersPos + 4 + m_bufferIndex * 16;
+            m_bufferIndex += 1;
+            UINT64 const offset = m_pFb->Read(pos, 8);
+            UINT64 const length = m_pFb->Read(pos + 8, 8);
+            if (!Check(offset % 8 == 0 && offset <= m_bodyLength && length <= m_bodyLength - offset))
+            {
+                return std::string();
+            }
+
+            return m_input.substr(m_bodyPos + static_cast<size_t>(offset), static_cast<size_t>(length));
+        }
+
+        // Reads the next validity buffer. Returns a bitmap with length bits
+        // (all set if the buffer is empty).
+        std::string
+        NextValidity(UINT64 length, UINT64 nullCount)
+        {
+            auto validity = NextBuffer();
+            size_t const cbValidity = static_cast<size_t>((length + 7) / 8);
+            if (validity.empty())
+            {
+                Check(nullCount == 0);
+                return std::string(cbValidity, '\xff');
+            }
+
+            Check(validity.size() >= cbValidity);
+            validity.resize(cbValidity);
+            UINT64 nulls = 0;
+            for (UINT64 i = 0; i != length; i += 1)
+            {
+                nulls += !IsSet(reinterpret_cast<BYTE const*>(validity.data()), i);
+            }
+
+            Check(nulls == nullCount);
+            return validity;
+        }
+
+        // Reads count offsets + 1 from the next buffer.
+        std::vector<INT32>
+        NextOffsets(UINT64 length)
+        {
+            auto const buffer = NextBuffer();
+            std::vector<INT32> offsets(static_cast<size_t>(length + 1));
+            if (Check(buffer.size() >= offsets.size() * 4))
+            {
+                memcpy(offsets.data(), buffer.data(), offsets.size() * 4);
+            }
+
+            Check(offsets[0] == 0);
+            for (size_t i = 0; i != length; i += 1)
+            {
+                Check(offsets[i] <= offsets[i + 1]);
+            }
+
+            return offsets;
+        }
+
+        // One string per list: "[items]" or "null".
+        Rows
+        ListRows(BYTE const* pValid, std::vector<INT32> const& offsets, Rows const& items)
+        {
+            Rows rows;
+            for (size_t i = 0; i + 1 < offsets.size(); i += 1)
+            {
+                Check(IsSet(pValid, i) || offsets[i] == offsets[i + 1]);
+                rows.push_back(IsSet(pValid, i) ? ListText(items, offsets[i], offsets[i + 1]) : "null");
+            }
+
+            return rows;
+        }
+
+        // Reads the arrays of a field as columns: one column, or for a struct
+        // (or list of structs) one column (or list column) per member.
+        void
+        ReadColumns(ArrowField const& field, UINT64 length, std::vector<Rows>& columns)
+        {
+            auto const pStruct = StructType(field);
+            if (pStruct == nullptr)
+            {
+                columns.push_back(ReadArray(field, length));
+                return;
+            }
+
+            std::vector<INT32> offsets;
+            std::string listValidity;
+            UINT64 structLength = length;
+            if (pStruct != &field)
+            {
+                listValidity = NextValidity(length, NextNode(length));
+                offsets = NextOffsets(length);
+                structLength = static_cast<UINT64>(offsets.back());
+            }
+
+            Check(NextNode(structLength) == 0); // Struct values are never null.
+            NextValidity(structLength, 0);
+
+            std::vector<Rows> members;
+            for (auto const& child : pStruct->Children)
+            {
+                ReadColumns(child, structLength, members);
+            }
+
+            for (auto& member : members)
+            {
+                columns.push_back(offsets.empty()
+                    ? member
+                    : ListRows(reinterpret_cast<BYTE const*>(listValidity.data()), offsets, member));
+            }
+        }
+
+        Rows
+        ReadArray(ArrowField const& field, UINT64 length)
+        {
+            Rows rows;
+            UINT64 const nullCount = NextNode(length);
+            if (field.TypeId == 1) // Null
+            {
+                Check(nullCount == length);
+                return Rows(static_cast<size_t>(length), "null");
+            }
+
+            auto const validity = NextValidity(length, nullCount);
+            auto const pValid = reinterpret_cast<BYTE const*>(validity.data());
+
+            if (field.TypeId == 12) // List
+            {
+                auto const offsets = NextOffsets(length);
+                Check(field.Children.size() == 1);
+                return ListRows(pValid, offsets, ReadArray(field.Children[0], static_cast<UINT64>(offsets.back())));
+            }
+
+            if (field.DictionaryId >= 0)
+            {
+                auto const& dictionary = m_data.Dictionaries[field.DictionaryId];
+                auto const indexes = NextBuffer();
+                Check(field.IndexBitWidth == 32 && indexes.size() >= length * 4);
+                for (size_t i = 0; i != length && indexes.size() >= length * 4; i += 1)
+                {
+                    INT32 index;
+                    memcpy(&index, indexes.data() + i * 4, 4);
+                    bool const valid = IsSet(pValid, i);
+                    Check(!valid || (index >= 0 && static_cast<size_t>(index) < dictionary.size()));
+                    rows.push_back(valid && index >= 0 && static_cast<size_t>(index) < dictionary.size()
+                        ? Quote(dictionary[index])
+                        : "null");
+                }
+
+                return rows;
+            }
+
+            std::vector<INT32> offsets;
+            if (field.TypeId == 4 || field.TypeId == 5) // Binary, Utf8
+            {
+                offsets = NextOffsets(length);
+            }
+
+            auto const values = NextBuffer();
+            auto const pb = reinterpret_cast<BYTE const*>(values.data());
+            unsigned const cbValue =
+                field.TypeId == 2 ? field.BitWidth / 8
+                : field.TypeId == 3 ? (field.Precision == 1 ? 4 : 8)
+                : field.TypeId == 10 ? 8
+                : field.TypeId == 15 ? field.ByteWidth
+                : 0;
+            Check(field.TypeId == 6
+                ? values.size() >= (length + 7) / 8
+                : offsets.empty()
+                ? values.size() >= length * cbValue
+                : values.size() >= static_cast<size_t>(offsets.back()));
+            if (!m_data.Ok)
+            {
+                return Rows(static_cast<size_t>(length), "?");
+            }
+
+            for (size_t i = 0; i != length; i += 1)
+            {
+                if (!IsSet(pValid, i))
+                {
+                    rows.push_back("null");
+                    continue;
+                }
+
+                UINT64 value = 0;
+                memcpy(&value, pb + i * cbValue, cbValue < 8 ? cbValue : 8);
+                switch (field.TypeId)
+                {
+                case 2: // Int
+                    if (field.IsSigned && cbValue < 8 && (value >> (cbValue * 8 - 1)) != 0)
+                    {
+                        value |= ~UINT64(0) << (cbValue * 8); // Sign-extend.
+                    }
+
+                    rows.push_back(Decimal(value, field.IsSigned));
+                    break;
+                case 3: // FloatingPoint
+                {
+                    char buffer[32];
+                    double f64;
+                    if (cbValue == 4)
+                    {
+                        float f32;
+                        memcpy(&f32, pb + i * 4, 4);
+                        f64 = f32;
+                    }
+                    else
+                    {
+                        memcpy(&f64, pb + i * 8, 8);
+                    }
+
+                    snprintf(buffer, sizeof(buffer), "%g", f64);
+                    rows.push_back(buffer);
+                    break;
+                }
+                case 4: // Binary
+                case 5: // Utf8
+                    rows.push_back(Quote(values.substr(offsets[i], offsets[i + 1] - offsets[i])));
+                    break;
+                case 6: // Bool
+                    rows.push_back(IsSet(pb, i) ? "1" : "0");
+                    break;
+                case 10: // Timestamp: nanoseconds to FILETIME.
+                    Check(static_cast<INT64>(value) % 100 == 0);
+                    rows.push_back(Decimal(static_cast<INT64>(value) / 100 + UnixEpochFileTime, false));
+                    break;
+                case 15: // FixedSizeBinary
+                    rows.push_back(Hex(pb + i * cbValue, cbValue));
+                    break;
+                default:
+                    Check(false);
+                    break;
+                }
+            }
+
+            return rows;
+        }
+    };
+
+    ArrowData
+    ReadArrowStream(std::string const& input)
+    {
+        ArrowData data;
+        ArrowReader reader(input, data);
+        reader.Check(reader.ReadStream(0) == input.size());
+        return data;
+    }
+
+    // Reads the file through its footer. *pStream receives the bytes
+    // between the file header and the footer.
+    ArrowData
+    ReadArrowFile(std::string const& input, _Out_ std::string* pStream)
+    {
+        ArrowData data;
+        ArrowReader reader(input, data);
+        pStream->clear();
+
+        if (!reader.Check(input.size() >= 8 + 8 + 10 &&
+            0 == memcmp(input.data(), "ARROW1\0\0", 8) &&
+            0 == memcmp(input.data() + input.size() - 6, "ARROW1", 6)))
+        {
+            return data;
+        }
+
+        UINT32 cbFooter;
+        memcpy(&cbFooter, input.data() + input.size() - 10, 4);
+        if (!reader.Check(cbFooter <= input.size() - 8 - 10))
+        {
+            return data;
+        }
+
+        size_t const footerBegin = input.size() - 10 - cbFooter;
+        *pStream = input.substr(8, footerBegin - 8);
+
+        FbReader fb(reinterpret_cast<BYTE const*>(input.data()) + footerBegin, cbFooter);
+        size_t const footerPos = fb.Deref(0);
+        reader.Check(fb.Scalar(footerPos, 0, 2) == 4); // V5
+        reader.ReadSchema(fb, fb.Ref(footerPos, 1));
+
+        // Dictionary blocks, then record batch blocks.
+        for (unsigned slot = 2; slot != 4; slot += 1)
+        {
+            size_t const blocksPos = fb.Ref(footerPos, slot);
+            reader.Check(blocksPos % 8 == 4); // Blocks are 8-byte aligned.
+            for (size_t i = 0; i != fb.VectorCount(blocksPos); i += 1)
+            {
+                size_t const blockPos = blocksPos + 4 + i * 24;
+                size_t const offset = static_cast<size_t>(fb.Read(blockPos, 8));
+                size_t const cbMetadata = static_cast<size_t>(fb.Read(blockPos + 8, 4));
+                UINT64 const bodyLength = fb.Read(blockPos + 16, 8);
+                reader.Check(offset >= 8 && offset < footerBegin);
+                if (reader.Check(reader.ReadMessage(offset) == cbMetadata))
+                {
+                    reader.Check(data.Messages.back().HeaderType == (slot == 2 ? 2 : 3));
+                    reader.Check(data.Messages.back().BodyLength == bodyLength);
+                }
+            }
+        }
+
+        reader.Check(!fb.Bad);
+        return data;
+    }
+
+    struct ArrowFixture
+    {
+        TestSchema Schema;
+        TestMap LevelMap;
+        TestMap KindMap;
+        TestCallbacks Callbacks;
+        EtwEnumerator Enumerator;
+        EtwColumnBatch Batch;
+
+        ArrowFixture()
+            : Schema("ArrowProvider", "ArrowEvent")
+            , LevelMap()
+            , KindMap()
+            , Callbacks()
+            , Enumerator(Callbacks)
+            , Batch()
+        {
+            Schema.Add("Id", Scalar(TDH_INTYPE_UINT32));                        // 0
+            Schema.Add("Level", Scalar(TDH_INTYPE_UINT32), "LevelMap");         // 1
+            Schema.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));               // 2
+            Schema.Add("Flag", Scalar(TDH_INTYPE_BOOLEAN));                     // 3
+            Schema.Add("Ratio", Scalar(TDH_INTYPE_FLOAT));                      // 4
+            Schema.Add("When", Scalar(TDH_INTYPE_FILETIME));                    // 5
+            Schema.Add("Activity", Scalar(TDH_INTYPE_GUID));                    // 6
+            Schema.Add("Count", Scalar(TDH_INTYPE_UINT8));                      // 7
+            Schema.Add("Values", CountedArray(TDH_INTYPE_INT16, 7));            // 8
+            Schema.Add("Kinds", CountedArray(TDH_INTYPE_UINT8, 7), "KindMap");  // 9
+            Schema.Add("Box", Struct(11, 1));                                   // 10
+            Schema.Add("Size", Scalar(TDH_INTYPE_INT64));                       // 11
+            Schema.SetTopLevelCount(11);
+            Callbacks.SetSchema(1, Schema);
+
+            LevelMap.Add(1, "Error").Add(2, "Warning").Add(3, "Info");
+            KindMap.Add(0, "Zero").Add(1, "One").Add(2, "Two");
+            Callbacks.SetMap("LevelMap", LevelMap);
+            Callbacks.SetMap("KindMap", KindMap);
+        }
+
+        // Decodes count events starting at event number first. Every 8th
+        // event is truncated in the Values array.
+        void
+        Decode(unsigned first, unsigned count)
+        {
+            std::vector<TestEvent> events;
+            for (unsigned n = first; n != first + count; n += 1)
+            {
+                TestEvent event(1, 0x01D3C9E5A1B2C3D4 + n * 1000);
+                event.Record().EventHeader.ProcessId = 100 + n;
+                char name[32];
+                snprintf(name, sizeof(name), "name %u \xC3\xA9", n);
+                GUID const activity = { n, 2, 3, { 4, 5, 6, 7, 8, 9, 10, static_cast<BYTE>(n) } };
+                UINT8 const valueCount = static_cast<UINT8>(n % 4);
+                event.Add<UINT32>(n)
+                    .Add<UINT32>(n % 5) // 0 and 4 are not in the map.
+                    .AddString(name)
+                    .Add<UINT32>(n % 2)
+                    .Add<float>(n * 0.5f)
+                    .Add<UINT64>(0x01D3C9E5A1B2C3D4 + n * 1234567)
+                    .Add<GUID>(activity)
+                    .Add<UINT8>(valueCount);
+                if (n % 8 == 3)
+                {
+                    event.Add<INT16>(-1); // Truncated.
+                }
+                else
+                {
+                    for (UINT8 i = 0; i != valueCount; i += 1)
+                    {
+                        event.Add<INT16>(static_cast<INT16>(i * 1000 - static_cast<int>(n)));
+                    }
+
+                    for (UINT8 i = 0; i != valueCount; i += 1)
+                    {
+                        event.Add<UINT8>(static_cast<UINT8>((n + i) % (3 + n / 8))); // New kinds later.
+                    }
+
+                    event.Add<INT64>(-static_cast<INT64>(n) * 1000000007);
+                }
+
+                events.push_back(event);
+            }
+
+            std::vector<EVENT_RECORD const*> records;
+            for (auto& event : events)
+            {
+                records.push_back(&event.Record());
+            }
+
+            ETW_CHECK(count == Enumerator.DecodeEventsToColumns(
+                records.data(), static_cast<unsigned>(records.size()), Batch, nullptr));
+        }
+
+        std::vector<Rows>
+        BatchText() const
+        {
+            std::vector<Rows> columns;
+            for (unsigned c = 0; c != Batch.GetTableInfo(0).ColumnCount; c += 1)
+            {
+                columns.push_back(BatchColumnText(Batch, c));
+            }
+
+            return columns;
+        }
+
+        /*
+        Writes batches of 0, 8, 8, and 4 events (ClearRows after each).
+        Returns the expected text of each batch.
+        */
+        std::vector<std::vector<Rows>>
+        Write(EtwArrowFormat format, std::string* pOutput)
+        {
+            std::vector<std::vector<Rows>> expected;
+            CollectingSink sink;
+            EtwArrowWriter writer;
+
+            Decode(0, 8);
+            ETW_CHECK(Batch.TableCount() == 1);
+            ETW_CHECK(ERROR_SUCCESS == writer.Begin(Batch, 0, format, sink));
+            Batch.ClearRows();
+
+            unsigned const batchSizes[] = { 0, 8, 8, 4 };
+            unsigned first = 0;
+            for (unsigned size : batchSizes)
+            {
+                Decode(first, size);
+                first += size;
+                expected.push_back(BatchText());
+                ETW_CHECK(ERROR_SUCCESS == writer.WriteRecordBatch(Batch, 0, sink));
+                Batch.ClearRows();
+            }
+
+            ETW_CHECK(ERROR_SUCCESS == writer.End(sink));
+            *pOutput = sink.Output;
+            return expected;
+        }
+    };
+
+    ArrowField const*
+    FindField(ArrowData const& data, char const* szName)
+    {
+        for (auto const& field : data.Fields)
+        {
+            if (field.Name == szName)
+            {
+                return &field;
+            }
+        }
+
+        return nullptr;
+    }
+}
+
+ETW_TEST(ArrowWriter_StreamMatchesBatch)
+{
+    ArrowFixture f;
+    std::string output;
+    auto const expected = f.Write(EtwArrowFormat_Stream, &output);
+    auto const data = ReadArrowStream(output);
+    ETW_CHECK(data.Ok);
+
+    // Schema.
+    auto const tableInfo = f.Batch.GetTableInfo(0);
+    ETW_CHECK(data.Fields.size() == tableInfo.ColumnCount); // Box has one member.
+    ETW_CHECK(data.ColumnNames.size() == tableInfo.ColumnCount);
+    for (unsigned c = 0; c != tableInfo.ColumnCount && c != data.ColumnNames.size(); c += 1)
+    {
+        ETW_CHECK(data.ColumnNames[c] == ToUtf8(f.Batch.GetColumnInfo(0, c).Name));
+    }
+
+    ETW_CHECK(data.Metadata.at("ProviderName") == "ArrowProvider");
+    ETW_CHECK(data.Metadata.at("EventName") == "ArrowEvent");
+
+    auto const pTimeStamp = FindField(data, "TimeStamp");
+    auto const pLevel = FindField(data, "Level");
+    auto const pValues = FindField(data, "Values");
+    auto const pKinds = FindField(data, "Kinds");
+    auto const pActivity = FindField(data, "Activity");
+    auto const pBox = FindField(data, "Box");
+    ETW_CHECK(pTimeStamp && pLevel && pValues && pKinds && pActivity && pBox);
+    if (!pTimeStamp || !pLevel || !pValues || !pKinds || !pActivity || !pBox)
+    {
+        return;
+    }
+
+    ETW_CHECK(pTimeStamp->TypeId == 10 && pTimeStamp->TimeUnit == 3 && pTimeStamp->TimeZone == "UTC");
+    ETW_CHECK(pLevel->TypeId == 5 && pLevel->DictionaryId >= 0);
+    ETW_CHECK(pValues->TypeId == 12 && pValues->DictionaryId < 0 && pValues->Children.size() == 1);
+    ETW_CHECK(pValues->Children.size() == 1 &&
+        pValues->Children[0].Name == "item" &&
+        pValues->Children[0].TypeId == 2 &&
+        pValues->Children[0].BitWidth == 16 &&
+        pValues->Children[0].IsSigned);
+    ETW_CHECK(pKinds->TypeId == 12 && pKinds->Children.size() == 1);
+    ETW_CHECK(pKinds->Children.size() == 1 &&
+        pKinds->Children[0].TypeId == 5 &&
+        pKinds->Children[0].DictionaryId >= 0 &&
+        pKinds->Children[0].DictionaryId != pLevel->DictionaryId);
+    ETW_CHECK(pActivity->TypeId == 15 && pActivity->ByteWidth == 16);
+    ETW_CHECK(pBox->TypeId == 13 && pBox->Children.size() == 1);
+    ETW_CHECK(pBox->Children.size() == 1 &&
+        pBox->Children[0].Name == "Size" &&
+        pBox->Children[0].TypeId == 2 &&
+        pBox->Children[0].BitWidth == 64 &&
+        pBox->Children[0].IsSigned);
+
+    // Values.
+    ETW_CHECK(data.Batches == expected);
+    // Columns 6, 13, and 14 (Level, Values, Kinds) of events 0 to 7.
+    // Event 3 is truncated.
+    ETW_CHECK(expected.size() == 4 && expected[1][6] == Rows({
+        "\"0(??)\"", "\"1(Error)\"", "\"2(Warning)\"", "\"3(Info)\"",
+        "\"4(??)\"", "\"0(??)\"", "\"1(Error)\"", "\"2(Warning)\"" }));
+    ETW_CHECK(expected.size() == 4 && expected[1][13] == Rows({
+        "[]", "[-1]", "[-2,998]", "null", "[]", "[-5]", "[-6,994]", "[-7,993,1993]" }));
+    ETW_CHECK(expected.size() == 4 && expected[1][14] == Rows({
+        "[]", "[\"1(One)\"]", "[\"2(Two)\",\"0(Zero)\"]", "null",
+        "[]", "[\"2(Two)\"]", "[\"0(Zero)\",\"1(One)\"]", "[\"1(One)\",\"2(Two)\",\"0(Zero)\"]" }));
+
+    // Messages: schema, then for each batch the new dictionary values
+    // (all values the first time, then deltas, and nothing if there are no
+    // new values), then the record batch. The empty first batch still
+    // writes both dictionaries.
+    std::string sequence;
+    for (auto const& message : data.Messages)
+    {
+        sequence += message.HeaderType == 1 ? "S"
+            : message.HeaderType == 3 ? "R"
+            : message.IsDelta ? "d"
+            : "D";
+    }
+
+    ETW_CHECK(sequence == "SDDRddRdRdR");
+    ETW_CHECK(data.Dictionaries.size() == 2);
+    ETW_CHECK(data.Dictionaries.at(pLevel->DictionaryId) == Rows({
+        "0(??)", "1(Error)", "2(Warning)", "3(Info)", "4(??)" }));
+    ETW_CHECK(data.Dictionaries.at(pKinds->Children[0].DictionaryId) == Rows({
+        "1(One)", "2(Two)", "0(Zero)", "3(??)", "4(??)" }));
+}
+
+ETW_TEST(ArrowWriter_FileMatchesStream)
+{
+    ArrowFixture streamFixture;
+    std::string streamOutput;
+    auto const expected = streamFixture.Write(EtwArrowFormat_Stream, &streamOutput);
+
+    ArrowFixture fileFixture;
+    std::string fileOutput;
+    ETW_CHECK(expected == fileFixture.Write(EtwArrowFormat_File, &fileOutput));
+
+    // The file is the stream between a header and a footer.
+    std::string stream;
+    auto const data = ReadArrowFile(fileOutput, &stream);
+    ETW_CHECK(data.Ok);
+    ETW_CHECK(stream == streamOutput);
+
+    // Reading the batches through the footer gives the same data.
+    auto const streamData = ReadArrowStream(streamOutput);
+    ETW_CHECK(data.Batches == expected);
+    ETW_CHECK(data.Dictionaries == streamData.Dictionaries);
+    ETW_CHECK(data.Fields.size() == streamData.Fields.size());
+    ETW_CHECK(data.Metadata == streamData.Metadata);
+    for (size_t i = 0; i != data.Fields.size() && i != streamData.Fields.size(); i += 1)
+    {
+        ETW_CHECK(data.Fields[i].Name == streamData.Fields[i].Name);
+        ETW_CHECK(data.Fields[i].TypeId == streamData.Fields[i].TypeId);
+        ETW_CHECK(data.Fields[i].DictionaryId == streamData.Fields[i].DictionaryId);
+        ETW_CHECK(data.Fields[i].Children.size() == streamData.Fields[i].Children.size());
+    }
+
+    // Footer blocks: the dictionary batches, then the record batches, each
+    // in stream order and pointing at the same message as in the stream.
+    std::vector<ArrowMessage> streamBatches;
+    for (UCHAR headerType : { 2, 3 })
+    {
+        for (auto const& message : streamData.Messages)
+        {
+            if (message.HeaderType == headerType)
+            {
+                streamBatches.push_back(message);
+            }
+        }
+    }
+
+    ETW_CHECK(data.Messages.size() == streamBatches.size());
+    for (size_t i = 0; i != data.Messages.size() && i != streamBatches.size(); i += 1)
+    {
+        ETW_CHECK(data.Messages[i].Offset == streamBatches[i].Offset + 8);
+        ETW_CHECK(data.Messages[i].HeaderType == streamBatches[i].HeaderType);
+        ETW_CHECK(data.Messages[i].IsDelta == streamBatches[i].IsDelta);
+        ETW_CHECK(data.Messages[i].Length == streamBatches[i].Length);
+    }
+
+    // A writer can be reused after End.
+    EtwArrowWriter writer;
+    CollectingSink sink;
+    ETW_CHECK(ERROR_SUCCESS == writer.Begin(fileFixture.Batch, 0, EtwArrowFormat_File, sink));
+    ETW_CHECK(ERROR_SUCCESS == writer.End(sink));
+    ETW_CHECK(ERROR_SUCCESS == writer.Begin(fileFixture.Batch, 0, EtwArrowFormat_File, sink));
+    ETW_CHECK(ERROR_SUCCESS == writer.End(sink));
+    size_t const cbFile = sink.Output.size() / 2;
+    ETW_CHECK(sink.Output.substr(0, cbFile) == sink.Output.substr(cbFile));
+    auto const empty = ReadArrowFile(sink.Output.substr(cbFile), &stream);
+    ETW_CHECK(empty.Ok);
+    ETW_CHECK(empty.Batches.empty());
+    ETW_CHECK(empty.Fields.size() == data.Fields.size());
+}
+
+ETW_TEST(ArrowWriter_NestedStructs)
+{
+    TestSchema schema("ArrowProvider", "NestedEvent");
+    schema.Add("Count", Scalar(TDH_INTYPE_UINT8));                  // 0
+    schema.Add("Items", CountedStruct(4, 4, 0));                    // 1
+    schema.Add("Pos", Struct(8, 2));                                // 2
+    schema.Add("After", Scalar(TDH_INTYPE_UINT16));                 // 3
+    schema.Add("N", Scalar(TDH_INTYPE_UINT8));                      // 4
+    schema.Add("Values", CountedArray(TDH_INTYPE_UINT16, 4));       // 5
+    schema.Add("Inner", Struct(10, 1));                             // 6
+    schema.Add("Id", Scalar(TDH_INTYPE_UINT32), "KindMap");         // 7
+    schema.Add("X", Scalar(TDH_INTYPE_INT32));                      // 8
+    schema.Add("Deep", Struct(11, 1));                              // 9
+    schema.Add("Flag", Scalar(TDH_INTYPE_BOOLEAN));                 // 10
+    schema.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));           // 11
+    schema.SetTopLevelCount(4);
+
+    TestMap kindMap;
+    kindMap.Add(1, "One").Add(2, "Two");
+    TestCallbacks callbacks;
+    callbacks.SetSchema(1, schema);
+    callbacks.SetMap("KindMap", kindMap);
+
+    std::vector<TestEvent> events;
+    events.emplace_back(1, 0x01D3C9E5A1B2C3D4);
+    events.back().Add<UINT8>(2)
+        .Add<UINT8>(2).Add<UINT16>(1).Add<UINT16>(2).Add<UINT32>(1).Add<UINT32>(1)
+        .Add<UINT8>(0).Add<UINT32>(0).Add<UINT32>(2)
+        .Add<INT32>(-5).AddString("a")
+        .Add<UINT16>(7);
+    events.emplace_back(1, 0x01D3C9E5A1B2C3D4);
+    events.back().Add<UINT8>(0)
+        .Add<INT32>(3).AddString("")
+        .Add<UINT16>(8);
+    events.emplace_back(1, 0x01D3C9E5A1B2C3D4);
+    events.back().Add<UINT8>(1)
+        .Add<UINT8>(1).Add<UINT16>(9); // Truncated in the first element.
+
+    std::vector<EVENT_RECORD const*> records;
+    for (auto& event : events)
+    {
+        records.push_back(&event.Record());
+    }
+
+    EtwEnumerator enumerator(callbacks);
+    EtwColumnBatch batch;
+    ETW_CHECK(3 == enumerator.DecodeEventsToColumns(records.data(), 3, batch, nullptr));
+
+    CollectingSink sink;
+    EtwArrowWriter writer;
+    ETW_CHECK(ERROR_SUCCESS == writer.Begin(batch, 0, EtwArrowFormat_Stream, sink));
+    ETW_CHECK(ERROR_SUCCESS == writer.WriteRecordBatch(batch, 0, sink));
+    ETW_CHECK(ERROR_SUCCESS == writer.End(sink));
+    auto const data = ReadArrowStream(sink.Output);
+    ETW_CHECK(data.Ok);
+
+    // Schema: Count, Items: list<struct<N, Values, Inner: struct<Flag>, Id>>,
+    // Pos: struct<X, Deep: struct<Name>>, After.
+    auto const tableInfo = batch.GetTableInfo(0);
+    ETW_CHECK(tableInfo.StructCount == 4);
+    ETW_CHECK(data.Fields.size() == EtwColumnBatch::HeaderColumnCount + 4);
+    ETW_CHECK(data.ColumnNames.size() == tableInfo.ColumnCount);
+    for (unsigned c = 0; c != tableInfo.ColumnCount && c != data.ColumnNames.size(); c += 1)
+    {
+        ETW_CHECK(data.ColumnNames[c] == ToUtf8(batch.GetColumnInfo(0, c).Name));
+    }
+
+    auto const pItems = FindField(data, "Items");
+    auto const pPos = FindField(data, "Pos");
+    ETW_CHECK(pItems && pPos);
+    if (!pItems || !pPos)
+    {
+        return;
+    }
+
+    ETW_CHECK(pItems->TypeId == 12 && pItems->Children.size() == 1);
+    auto const& item = pItems->Children[0];
+    ETW_CHECK(item.Name == "item" && item.TypeId == 13 && item.Children.size() == 4);
+    if (item.Children.size() == 4)
+    {
+        ETW_CHECK(item.Children[0].Name == "N" && item.Children[0].TypeId == 2 && item.Children[0].BitWidth == 8);
+        ETW_CHECK(item.Children[1].Name == "Values" && item.Children[1].TypeId == 1);
+        ETW_CHECK(item.Children[2].Name == "Inner" && item.Children[2].TypeId == 13 &&
+            item.Children[2].Children.size() == 1 &&
+            item.Children[2].Children[0].Name == "Flag" &&
+            item.Children[2].Children[0].TypeId == 6);
+        ETW_CHECK(item.Children[3].Name == "Id" && item.Children[3].TypeId == 5 &&
+            item.Children[3].DictionaryId >= 0);
+    }
+
+    ETW_CHECK(pPos->TypeId == 13 && pPos->Children.size() == 2);
+    if (pPos->Children.size() == 2)
+    {
+        ETW_CHECK(pPos->Children[0].Name == "X" && pPos->Children[0].TypeId == 2);
+        ETW_CHECK(pPos->Children[1].Name == "Deep" && pPos->Children[1].TypeId == 13 &&
+            pPos->Children[1].Children.size() == 1 &&
+            pPos->Children[1].Children[0].Name == "Name" &&
+            pPos->Children[1].Children[0].TypeId == 5);
+    }
+
+    // Values: the same as the batch, except that the dropped Items.Values
+    // column, which has a null per row in the batch, is a null per element
+    // in the list of structs.
+    std::vector<Rows> expected;
+    for (unsigned c = 0; c != tableInfo.ColumnCount; c += 1)
+    {
+        expected.push_back(BatchColumnText(batch, c));
+    }
+
+    ETW_CHECK(ToUtf8(batch.GetColumnInfo(0, 7).Name) == "Items.Values");
+    ETW_CHECK(expected[7] == Rows({ "null", "null", "null" }));
+    expected[7] = Rows({ "[null,null]", "[]", "[null]" });
+    ETW_CHECK(data.Batches.size() == 1);
+    ETW_CHECK(data.Batches.size() == 1 && data.Batches[0] == expected);
+    ETW_CHECK(expected[6] == Rows({ "[2,0]", "[]", "[1]" }));
+    ETW_CHECK(expected[8] == Rows({ "[1,0]", "[]", "[null]" }));
+    ETW_CHECK(expected[9] == Rows({ "[\"1(One)\",\"2(Two)\"]", "[]", "[null]" }));
+    ETW_CHECK(expected[10] == Rows({ "-5", "3", "null" }));
+    ETW_CHECK(expected[11] == Rows({ "\"a\"", "\"\"", "null" }));
+    ETW_CHECK(expected[12] == Rows({ "7", "8", "null" }));
+}
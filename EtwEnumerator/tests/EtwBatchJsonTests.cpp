@@ -0,0 +1,332 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests and benchmark for FormatEventsAsJsonUtf8 (batched NDJSON), compared
+with calling PreviewEvent, StartEvent, and FormatCurrentEventAsJsonUtf8 for
+each event. Batches include events that fail in PreviewEvent, in
+StartEvent, and part-way through formatting, which must be left out of the
+block without affecting the other events.
+*/
+
+#include "EtwTest.h"
+#include <algorithm>
+#include <stdio.h>
+
+using namespace EtwTest;
+
+namespace
+{
+    // Rejects events with ID RejectedEventId in PreviewEvent.
+    struct BatchCallbacks final
+        : TestCallbacks
+    {
+        static USHORT const RejectedEventId = 7;
+
+        LSTATUS __stdcall OnPreviewEvent(
+            _In_ EVENT_RECORD const* pEventRecord,
+            EtwEventCategory eventCategory) noexcept override
+        {
+            UNREFERENCED_PARAMETER(eventCategory);
+            return pEventRecord->EventHeader.EventDescriptor.Id == RejectedEventId
+                ? ERROR_NOT_SUPPORTED
+                : ERROR_SUCCESS;
+        }
+    };
+
+    struct BatchFixture
+    {
+        TestSchema Schema;
+        BatchCallbacks Callbacks;
+        EtwEnumerator Expected;
+        EtwEnumerator Actual;
+
+        BatchFixture()
+            : Schema("BatchProvider", "BatchEvent")
+            , Callbacks()
+            , Expected(Callbacks)
+            , Actual(Callbacks)
+        {
+            Schema.Add("Count", Scalar(TDH_INTYPE_UINT16));
+            Schema.Add("Values", CountedArray(TDH_INTYPE_UINT32, 0));
+            Schema.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));
+            Callbacks.SetSchema(1, Schema);
+            Callbacks.SetSchema(BatchCallbacks::RejectedEventId, Schema);
+        }
+    };
+
+    enum EventKind
+    {
+        EventKind_Good,
+        EventKind_Rejected,  // Fails in PreviewEvent.
+        EventKind_NoSchema,  // Fails in StartEvent.
+        EventKind_Truncated, // Fails while formatting the Values array.
+    };
+
+    TestEvent
+    MakeEvent(
+        EventKind kind,
+        unsigned index)
+    {
+        USHORT const id =
+            kind == EventKind_Rejected ? BatchCallbacks::RejectedEventId
+            : kind == EventKind_NoSchema ? 9
+            : 1;
+        UINT16 const count = static_cast<UINT16>(index % 40);
+        TestEvent event(id, 0x01D3C9E5A1B2C3D4 + index * 10000);
+        event.Record().EventHeader.ProcessId = index;
+        if (kind == EventKind_Truncated)
+        {
+            // Claims more values than the payload holds.
+            event.Add<UINT16>(count + 100);
+            event.Add<UINT32>(index);
+            return event;
+        }
+
+        event.Add<UINT16>(count);
+        for (UINT16 i = 0; i != count; i += 1)
+        {
+            event.Add<UINT32>(index * i);
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "event \"%u\" \xC3\xA9", index);
+        event.AddString(name);
+        return event;
+    }
+
+    // Mostly good events, with a failing event of each kind every few
+    // events.
+    std::vector<TestEvent>
+    TestEvents(unsigned count)
+    {
+        std::vector<TestEvent> events;
+        for (unsigned i = 0; i != count; i += 1)
+        {
+            EventKind const kind =
+                i % 11 == 3 ? EventKind_Rejected
+                : i % 13 == 5 ? EventKind_NoSchema
+                : i % 7 == 6 ? EventKind_Truncated
+                : EventKind_Good;
+            events.push_back(MakeEvent(kind, i));
+        }
+
+        return events;
+    }
+
+    std::vector<EVENT_RECORD const*>
+    Records(std::vector<TestEvent>& events)
+    {
+        std::vector<EVENT_RECORD const*> records;
+        for (auto& event : events)
+        {
+            records.push_back(&event.Record());
+        }
+
+        return records;
+    }
+
+    // NDJSON block and per-event results from the per-event methods.
+    struct Reference
+    {
+        std::string Block;
+        std::vector<LSTATUS> Errors;
+    };
+
+    Reference
+    FormatEachEvent(
+        EtwEnumerator& e,
+        std::vector<EVENT_RECORD const*> const& records,
+        EtwJsonSuffixFlags flags)
+    {
+        Reference result;
+        for (auto pRecord : records)
+        {
+            EtwStringViewUtf8Z utf8 = {};
+            if (EtwEventCategory_Error != e.PreviewEvent(pRecord) &&
+                e.StartEvent(pRecord) &&
+                e.FormatCurrentEventAsJsonUtf8(nullptr, flags, &utf8))
+            {
+                result.Block.append(utf8.Data, utf8.DataLength);
+                result.Block += '\n';
+            }
+
+            result.Errors.push_back(e.LastError());
+        }
+
+        return result;
+    }
+
+    EtwJsonSuffixFlags const TestSuffixFlags[] = {
+        EtwJsonSuffixFlags_None,
+        EtwJsonSuffixFlags_Default,
+        static_cast<EtwJsonSuffixFlags>(EtwJsonSuffixFlags_provider | EtwJsonSuffixFlags_pid),
+    };
+}
+
+ETW_TEST(BatchJson_MatchesPerEventFormatting)
+{
+    BatchFixture f;
+    auto events = TestEvents(200);
+    auto const records = Records(events);
+    unsigned const cRecords = static_cast<unsigned>(records.size());
+
+    for (EtwJsonSuffixFlags flags : TestSuffixFlags)
+    {
+        auto const expected = FormatEachEvent(f.Expected, records, flags);
+
+        // Each kind of event is present.
+        ETW_CHECK(std::count(expected.Errors.begin(), expected.Errors.end(), ERROR_SUCCESS) > 100);
+        ETW_CHECK(std::count(expected.Errors.begin(), expected.Errors.end(), ERROR_NOT_SUPPORTED) != 0);
+        ETW_CHECK(std::count(expected.Errors.begin(), expected.Errors.end(), ERROR_NOT_FOUND) != 0);
+        ETW_CHECK(std::count(expected.Errors.begin(), expected.Errors.end(), ERROR_INVALID_DATA) != 0);
+
+        std::vector<LSTATUS> errors(cRecords, ERROR_INVALID_STATE);
+        EtwStringViewUtf8 block = {};
+        unsigned const count = f.Actual.FormatEventsAsJsonUtf8(
+            records.data(), cRecords, flags, 0, errors.data(), &block);
+        ETW_CHECK(count == cRecords);
+        ETW_CHECK(expected.Block == std::string(block.Data, block.DataLength));
+        ETW_CHECK(expected.Errors == errors);
+        ETW_CHECK(f.Actual.LastError() == ERROR_SUCCESS);
+
+        // Errors are optional.
+        ETW_CHECK(cRecords == f.Actual.FormatEventsAsJsonUtf8(
+            records.data(), cRecords, flags, 0, nullptr, &block));
+        ETW_CHECK(expected.Block == std::string(block.Data, block.DataLength));
+    }
+}
+
+ETW_TEST(BatchJson_FlushThreshold)
+{
+    BatchFixture f;
+    auto events = TestEvents(200);
+    auto const records = Records(events);
+    unsigned const cRecords = static_cast<unsigned>(records.size());
+    auto const expected = FormatEachEvent(f.Expected, records, EtwJsonSuffixFlags_Default);
+
+    for (unsigned threshold : { 1u, 50u, 300u, 1000u, 4096u, 1000000u })
+    {
+        std::string blocks;
+        std::vector<LSTATUS> errors(cRecords, ERROR_INVALID_STATE);
+        unsigned calls = 0;
+        for (unsigned i = 0; i != cRecords;)
+        {
+            EtwStringViewUtf8 block = {};
+            unsigned const n = f.Actual.FormatEventsAsJsonUtf8(
+                records.data() + i, cRecords - i, EtwJsonSuffixFlags_Default, threshold,
+                errors.data() + i, &block);
+            calls += 1;
+
+            // Each call processes at least one event. A call stops only
+            // when the block reaches the threshold, and it stops at the
+            // first event after that.
+            ETW_CHECK(n != 0);
+            if (n == 0)
+            {
+                break;
+            }
+
+            std::string const text(block.Data, block.DataLength);
+            if (i + n != cRecords)
+            {
+                ETW_CHECK(text.size() >= threshold);
+                size_t const lastLine = text.rfind('\n', text.size() - 2);
+                ETW_CHECK(lastLine == std::string::npos || lastLine + 1 < threshold);
+            }
+
+            blocks += text;
+            i += n;
+        }
+
+        ETW_CHECK(expected.Block == blocks);
+        ETW_CHECK(expected.Errors == errors);
+        ETW_CHECK(threshold != 1 || calls >= std::count(errors.begin(), errors.end(), ERROR_SUCCESS));
+        ETW_CHECK(threshold != 1000000 || calls == 1);
+    }
+}
+
+ETW_TEST(BatchJson_EmptyAndFailedBatches)
+{
+    BatchFixture f;
+    EtwStringViewUtf8 block = { "x", 1 };
+
+    ETW_CHECK(0 == f.Actual.FormatEventsAsJsonUtf8(
+        nullptr, 0, EtwJsonSuffixFlags_Default, 0, nullptr, &block));
+    ETW_CHECK(block.DataLength == 0);
+
+    // A batch with no good events gives an empty block and every error.
+    std::vector<TestEvent> events;
+    events.push_back(MakeEvent(EventKind_Rejected, 0));
+    events.push_back(MakeEvent(EventKind_NoSchema, 1));
+    events.push_back(MakeEvent(EventKind_Truncated, 2));
+    auto const records = Records(events);
+
+    LSTATUS errors[3] = {};
+    ETW_CHECK(3 == f.Actual.FormatEventsAsJsonUtf8(
+        records.data(), 3, EtwJsonSuffixFlags_Default, 1, errors, &block));
+    ETW_CHECK(block.DataLength == 0);
+    ETW_CHECK(errors[0] == ERROR_NOT_SUPPORTED);
+    ETW_CHECK(errors[1] == ERROR_NOT_FOUND);
+    ETW_CHECK(errors[2] == ERROR_INVALID_DATA);
+
+    // A failed event between good events leaves no partial JSON.
+    events.clear();
+    events.push_back(MakeEvent(EventKind_Good, 10));
+    events.push_back(MakeEvent(EventKind_Truncated, 11));
+    events.push_back(MakeEvent(EventKind_Good, 12));
+    auto const mixed = Records(events);
+    auto const expected = FormatEachEvent(f.Expected, mixed, EtwJsonSuffixFlags_Default);
+    ETW_CHECK(3 == f.Actual.FormatEventsAsJsonUtf8(
+        mixed.data(), 3, EtwJsonSuffixFlags_Default, 0, errors, &block));
+    ETW_CHECK(expected.Block == std::string(block.Data, block.DataLength));
+    ETW_CHECK(2 == std::count(expected.Block.begin(), expected.Block.end(), '\n'));
+    ETW_CHECK(errors[1] == ERROR_INVALID_DATA);
+}
+
+ETW_BENCHMARK(BatchJson_Throughput)
+{
+    BatchFixture f;
+    std::vector<TestEvent> events;
+    for (unsigned i = 0; i != 10000; i += 1)
+    {
+        events.push_back(MakeEvent(EventKind_Good, i));
+    }
+
+    auto const records = Records(events);
+    unsigned const cRecords = static_cast<unsigned>(records.size());
+    std::string output;
+
+    // Reference: StartEvent and FormatCurrentEventAsJsonUtf8 for each event,
+    // then copy each event to the output.
+    double const referenceNs = BestTimeNs([&]()
+        {
+            output.clear();
+            for (auto pRecord : records)
+            {
+                EtwStringViewUtf8Z utf8;
+                f.Expected.PreviewEvent(pRecord);
+                f.Expected.StartEvent(pRecord);
+                f.Expected.FormatCurrentEventAsJsonUtf8(nullptr, EtwJsonSuffixFlags_Default, &utf8);
+                output.append(utf8.Data, utf8.DataLength);
+                output += '\n';
+            }
+        });
+    size_t const referenceSize = output.size();
+
+    // Current: one block per 1 MB.
+    double const currentNs = BestTimeNs([&]()
+        {
+            output.clear();
+            for (unsigned i = 0; i != cRecords;)
+            {
+                EtwStringViewUtf8 block;
+                i += f.Actual.FormatEventsAsJsonUtf8(
+                    records.data() + i, cRecords - i, EtwJsonSuffixFlags_Default, 1u << 20, nullptr, &block);
+                output.append(block.Data, block.DataLength);
+            }
+        });
+
+    ETW_CHECK(output.size() == referenceSize);
+    ReportBenchmark("10000 events (per event)", referenceNs, currentNs, cRecords);
+}
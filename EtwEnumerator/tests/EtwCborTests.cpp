@@ -0,0 +1,883 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for WriteCurrentEventAsCbor. The output is decoded by a strict CBOR
+reader (minimal heads, balanced breaks, no trailing bytes) into RFC 8949
+diagnostic notation and compared with the text expected from a MoveNext
+walk of the same event. Covers each canonical intype, outtypes that select
+a different encoding (STRING, PORT, IPV4, IPV6, LONG), mapped values and
+result codes with and without a name, arrays, structs, arrays of structs,
+the epoch-time and UUID tags, and the "meta" map.
+
+The benchmark compares WriteCurrentEventAsCbor with
+FormatCurrentEventAsJsonUtf8 (throughput and output size).
+*/
+
+#include "EtwTest.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace EtwTest;
+
+namespace
+{
+    struct CollectingSink final
+        : EtwOutputSink
+    {
+        std::string Output;
+
+        LSTATUS __stdcall Write(
+            _In_reads_bytes_(cb) void const* pb,
+            unsigned cb) noexcept override
+        {
+            Output.append(static_cast<char const*>(pb), cb);
+            return ERROR_SUCCESS;
+        }
+    };
+
+    struct CountingSink final
+        : EtwOutputSink
+    {
+        size_t Size = 0;
+
+        LSTATUS __stdcall Write(
+            _In_reads_bytes_(cb) void const* pb,
+            unsigned cb) noexcept override
+        {
+            UNREFERENCED_PARAMETER(pb);
+            Size += cb;
+            return ERROR_SUCCESS;
+        }
+    };
+
+    // Names result code 2 in every domain. Other codes are formatted as
+    // integers.
+    struct ResultCodeCallbacks final
+        : TestCallbacks
+    {
+        static ULONG const NamedCode = 2;
+
+        LSTATUS __stdcall
+        FormatResultCodeValue(
+            ResultCodeDomain domain,
+            UnderlyingType valueType,
+            ULONG value,
+            EtwStringBuilder& resultCodeBuilder) noexcept override
+        {
+            UNREFERENCED_PARAMETER(domain);
+            UNREFERENCED_PARAMETER(valueType);
+            return value == NamedCode
+                ? resultCodeBuilder.AppendWide(L"FILE_NOT_FOUND")
+                : ERROR_NOT_FOUND;
+        }
+    };
+
+    std::string
+    Hex(BYTE const* pb, size_t cb)
+    {
+        std::string text;
+        char buffer[4];
+        for (size_t i = 0; i != cb; i += 1)
+        {
+            snprintf(buffer, sizeof(buffer), "%02x", pb[i]);
+            text += buffer;
+        }
+
+        return text;
+    }
+
+    std::string
+    Quote(std::string const& value)
+    {
+        std::string text = "\"";
+        for (char ch : value)
+        {
+            if (ch == '"' || ch == '\\')
+            {
+                text += '\\';
+            }
+
+            text += ch;
+        }
+
+        return text + '"';
+    }
+
+    std::string
+    Unsigned(UINT64 value)
+    {
+        char buffer[24];
+        snprintf(buffer, sizeof(buffer), "%llu", static_cast<unsigned long long>(value));
+        return buffer;
+    }
+
+    std::string
+    Signed(INT64 value)
+    {
+        char buffer[24];
+        snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(value));
+        return buffer;
+    }
+
+    // Diagnostic notation uses an encoding indicator for the float size:
+    // _2 for float32, _3 for float64.
+    std::string
+    Float(double value, char const* szIndicator)
+    {
+        char buffer[40];
+        snprintf(buffer, sizeof(buffer), "%.17g%s", value, szIndicator);
+        return buffer;
+    }
+
+    /*
+    Decodes one CBOR data item as diagnostic notation. Indefinite-length
+    arrays and maps are written as "[_ ...]" and "{_ ...}". Rejects heads
+    that are not minimal, reserved or unused initial bytes, breaks outside
+    an indefinite-length item, and truncated input.
+    */
+    class CborDecoder
+    {
+        std::string const& m_input;
+        size_t m_pos;
+        bool m_ok;
+
+        bool
+        ReadBytes(size_t cb, _Out_ std::string* pBytes)
+        {
+            if (m_input.size() - m_pos < cb)
+            {
+                m_ok = false;
+                return false;
+            }
+
+            pBytes->assign(m_input, m_pos, cb);
+            m_pos += cb;
+            return true;
+        }
+
+        UINT64
+        ReadBigEndian(unsigned cb)
+        {
+            std::string bytes;
+            UINT64 value = 0;
+            if (ReadBytes(cb, &bytes))
+            {
+                for (unsigned i = 0; i != cb; i += 1)
+                {
+                    value = (value << 8) | static_cast<BYTE>(bytes[i]);
+                }
+            }
+
+            return value;
+        }
+
+        // Consumes a break if one is next.
+        bool
+        AtBreak()
+        {
+            if (m_pos == m_input.size())
+            {
+                m_ok = false;
+                return true;
+            }
+            else if (static_cast<BYTE>(m_input[m_pos]) == 0xFF)
+            {
+                m_pos += 1;
+                return true;
+            }
+
+            return false;
+        }
+
+        void
+        Item(std::string& out)
+        {
+            if (!m_ok || m_pos == m_input.size())
+            {
+                m_ok = false;
+                return;
+            }
+
+            BYTE const initial = static_cast<BYTE>(m_input[m_pos]);
+            m_pos += 1;
+            unsigned const major = initial >> 5;
+            unsigned const info = initial & 31;
+
+            if (major == 7)
+            {
+                switch (info)
+                {
+                case 20: out += "false"; break;
+                case 21: out += "true"; break;
+                case 22: out += "null"; break;
+                case 26:
+                {
+                    UINT32 const bits = static_cast<UINT32>(ReadBigEndian(4));
+                    float value;
+                    memcpy(&value, &bits, 4);
+                    out += Float(value, "_2");
+                    break;
+                }
+                case 27:
+                {
+                    UINT64 const bits = ReadBigEndian(8);
+                    double value;
+                    memcpy(&value, &bits, 8);
+                    out += Float(value, "_3");
+                    break;
+                }
+                default:
+                    m_ok = false; // Break, half float, or unused simple value.
+                    break;
+                }
+                return;
+            }
+
+            UINT64 argument = info;
+            bool indefinite = false;
+            if (info >= 24 && info <= 27)
+            {
+                unsigned const cbArgument = 1u << (info - 24);
+                argument = ReadBigEndian(cbArgument);
+                UINT64 const minimum =
+                    cbArgument == 1 ? 24
+                    : cbArgument == 2 ? 0x100
+                    : cbArgument == 4 ? 0x10000
+                    : 0x100000000;
+                if (argument < minimum)
+                {
+                    m_ok = false; // Not the preferred (shortest) head.
+                }
+            }
+            else if (info == 31 && (major == 4 || major == 5))
+            {
+                indefinite = true;
+            }
+            else if (info >= 24)
+            {
+                m_ok = false;
+            }
+
+            if (!m_ok)
+            {
+                return;
+            }
+
+            std::string bytes;
+            switch (major)
+            {
+            case 0:
+                out += Unsigned(argument);
+                break;
+            case 1:
+                out += argument == ~UINT64(0)
+                    ? "-18446744073709551616"
+                    : "-" + Unsigned(argument + 1);
+                break;
+            case 2:
+                if (ReadBytes(static_cast<size_t>(argument), &bytes))
+                {
+                    out += "h'" + Hex(reinterpret_cast<BYTE const*>(bytes.data()), bytes.size()) + "'";
+                }
+                break;
+            case 3:
+                if (ReadBytes(static_cast<size_t>(argument), &bytes))
+                {
+                    out += Quote(bytes);
+                }
+                break;
+            case 4:
+            case 5:
+                out += major == 4 ? "[" : "{";
+                out += indefinite ? "_ " : "";
+                for (UINT64 i = 0; m_ok && (indefinite ? !AtBreak() : i != argument); i += 1)
+                {
+                    out += i == 0 ? "" : ", ";
+                    Item(out);
+                    if (major == 5)
+                    {
+                        out += ": ";
+                        Item(out);
+                    }
+                }
+                out += major == 4 ? "]" : "}";
+                break;
+            case 6:
+                out += Unsigned(argument) + "(";
+                Item(out);
+                out += ")";
+                break;
+            }
+        }
+
+    public:
+
+        explicit CborDecoder(std::string const& input) noexcept
+            : m_input(input)
+            , m_pos(0)
+            , m_ok(true)
+        {
+            return;
+        }
+
+        // Returns the diagnostic notation of the input, which must be
+        // exactly one data item, or "(invalid)".
+        std::string
+        Decode()
+        {
+            std::string out;
+            Item(out);
+            return m_ok && m_pos == m_input.size() ? out : "(invalid)";
+        }
+    };
+
+    std::string
+    DecodeCbor(std::string const& input)
+    {
+        return CborDecoder(input).Decode();
+    }
+
+    std::string
+    FormattedText(EtwEnumerator& e)
+    {
+        EtwStringView value;
+        return e.FormatCurrentValue(&value)
+            ? Quote(ToUtf8(value.Data, value.DataLength))
+            : "(error)";
+    }
+
+    template<class T>
+    T
+    Read(void const* pData)
+    {
+        T value;
+        memcpy(&value, pData, sizeof(value));
+        return value;
+    }
+
+    /*
+    The diagnostic notation expected for the current value: a CBOR type for
+    each intype (with the outtypes that change it), a text string for values
+    that need formatting, and the name for mapped values and result codes
+    when there is one.
+    */
+    std::string
+    ExpectedValue(
+        EtwEnumerator& e,
+        bool hasMapInfo)
+    {
+        auto const info = e.GetItemInfo();
+        auto const pData = info.Data;
+        unsigned const cbData = info.DataSize;
+        auto const outType = info.OutType;
+
+        bool const isResultCode =
+            outType == TDH_OUTTYPE_HRESULT ||
+            outType == TDH_OUTTYPE_WIN32ERROR ||
+            outType == TDH_OUTTYPE_NTSTATUS;
+        if ((info.MapName && hasMapInfo) ||
+            (isResultCode && Read<UINT32>(pData) == ResultCodeCallbacks::NamedCode))
+        {
+            return FormattedText(e);
+        }
+
+        switch (info.InType)
+        {
+        case TDH_INTYPE_NULL:
+            return "null";
+
+        case TDH_INTYPE_UNICODESTRING:
+        case TDH_INTYPE_UNICODECHAR:
+            return Quote(ToUtf8(static_cast<EtwWCHAR const*>(pData), cbData / 2));
+
+        case TDH_INTYPE_INT8:
+            return outType == TDH_OUTTYPE_STRING ? FormattedText(e) : Signed(Read<INT8>(pData));
+        case TDH_INTYPE_INT16:
+            return Signed(Read<INT16>(pData));
+        case TDH_INTYPE_INT32:
+            return Signed(Read<INT32>(pData));
+        case TDH_INTYPE_INT64:
+            return Signed(Read<INT64>(pData));
+
+        case TDH_INTYPE_UINT8:
+            return outType == TDH_OUTTYPE_STRING ? FormattedText(e) : Unsigned(Read<UINT8>(pData));
+        case TDH_INTYPE_UINT16:
+        {
+            UINT16 const value = Read<UINT16>(pData);
+            return outType == TDH_OUTTYPE_STRING ? FormattedText(e)
+                : outType == TDH_OUTTYPE_PORT ? Unsigned(static_cast<UINT16>((value >> 8) | (value << 8)))
+                : Unsigned(value);
+        }
+        case TDH_INTYPE_UINT32:
+            return outType == TDH_OUTTYPE_IPV4 ? FormattedText(e) : Unsigned(Read<UINT32>(pData));
+        case TDH_INTYPE_HEXINT32:
+            return Unsigned(Read<UINT32>(pData));
+        case TDH_INTYPE_UINT64:
+        case TDH_INTYPE_HEXINT64:
+            return Unsigned(Read<UINT64>(pData));
+
+        case TDH_INTYPE_POINTER:
+        case TDH_INTYPE_SIZET:
+            return cbData == 8
+                ? (outType == TDH_OUTTYPE_LONG ? Signed(Read<INT64>(pData)) : Unsigned(Read<UINT64>(pData)))
+                : (outType == TDH_OUTTYPE_LONG ? Signed(Read<INT32>(pData)) : Unsigned(Read<UINT32>(pData)));
+
+        case TDH_INTYPE_FLOAT:
+            return Float(Read<float>(pData), "_2");
+        case TDH_INTYPE_DOUBLE:
+            return Float(Read<double>(pData), "_3");
+        case TDH_INTYPE_BOOLEAN:
+            return Read<INT32>(pData) != 0 ? "true" : "false";
+
+        case TDH_INTYPE_GUID:
+        {
+            auto const guid = Read<GUID>(pData);
+            BYTE const bytes[] = {
+                static_cast<BYTE>(guid.Data1 >> 24), static_cast<BYTE>(guid.Data1 >> 16),
+                static_cast<BYTE>(guid.Data1 >> 8), static_cast<BYTE>(guid.Data1),
+                static_cast<BYTE>(guid.Data2 >> 8), static_cast<BYTE>(guid.Data2),
+                static_cast<BYTE>(guid.Data3 >> 8), static_cast<BYTE>(guid.Data3) };
+            return "37(h'" + Hex(bytes, sizeof(bytes)) + Hex(guid.Data4, 8) + "')";
+        }
+
+        case TDH_INTYPE_FILETIME:
+        {
+            UINT64 const epoch = 116444736000000000;
+            UINT64 const fileTime = Read<UINT64>(pData);
+            bool const afterEpoch = fileTime >= epoch;
+            UINT64 const ticks = afterEpoch ? fileTime - epoch : epoch - fileTime;
+            if (ticks % 10000000 == 0)
+            {
+                return "1(" + (afterEpoch ? "" : std::string("-")) + Unsigned(ticks / 10000000) + ")";
+            }
+
+            double const seconds = double(ticks / 10000000) + double(ticks % 10000000) / 10000000;
+            return "1(" + Float(afterEpoch ? seconds : -seconds, "_3") + ")";
+        }
+
+        case TDH_INTYPE_ANSISTRING:
+        case TDH_INTYPE_ANSICHAR:
+        case TDH_INTYPE_SYSTEMTIME:
+        case TDH_INTYPE_SID:
+            return FormattedText(e);
+
+        default:
+            return outType == TDH_OUTTYPE_IPV6 || outType == TDH_OUTTYPE_SOCKETADDRESS
+                ? FormattedText(e)
+                : "h'" + Hex(static_cast<BYTE const*>(pData), cbData) + "'";
+        }
+    }
+
+    // The diagnostic notation expected for the items of the current event,
+    // without the enclosing map.
+    std::string
+    ExpectedItems(
+        EtwEnumerator& e,
+        std::string const& mapWithInfo)
+    {
+        std::string out;
+        std::vector<bool> first(1, true);
+        auto const separate = [&]()
+            {
+                out += first.back() ? "" : ", ";
+                first.back() = false;
+            };
+
+        while (e.MoveNext())
+        {
+            auto const info = e.GetItemInfo();
+            std::string const name = Quote(ToUtf8(info.Name)) + ": ";
+            switch (e.State())
+            {
+            case EtwEnumeratorState_Value:
+                separate();
+                out += info.IsArray ? "" : name;
+                out += ExpectedValue(e, info.MapName && ToUtf8(info.MapName) == mapWithInfo);
+                break;
+            case EtwEnumeratorState_ArrayBegin:
+                separate();
+                out += name + "[_ ";
+                first.push_back(true);
+                break;
+            case EtwEnumeratorState_StructBegin:
+                separate();
+                out += info.IsArray ? "{_ " : name + "{_ ";
+                first.push_back(true);
+                break;
+            case EtwEnumeratorState_ArrayEnd:
+            case EtwEnumeratorState_StructEnd:
+                out += e.State() == EtwEnumeratorState_ArrayEnd ? "]" : "}";
+                first.pop_back();
+                break;
+            default:
+                return "(error)";
+            }
+        }
+
+        return e.State() == EtwEnumeratorState_AfterLastItem ? out : "(error)";
+    }
+
+    struct CborFixture
+    {
+        TestSchema Schema;
+        TestSchema Schema32;
+        TestMap Levels;
+        ResultCodeCallbacks Callbacks;
+        EtwEnumerator Actual;
+        EtwEnumerator Expected;
+
+        CborFixture()
+            : Schema("CborProvider", "AllTypes")
+            , Schema32("CborProvider", "Pointers")
+            , Levels()
+            , Callbacks()
+            , Actual(Callbacks)
+            , Expected(Callbacks)
+        {
+            Schema.Add("Null", Scalar(TDH_INTYPE_NULL));                             // 0
+            Schema.Add("Text", Scalar(TDH_INTYPE_UNICODESTRING));                    // 1
+            Schema.Add("LongText", Scalar(TDH_INTYPE_UNICODESTRING));                // 2
+            Schema.Add("Counted", Scalar(TDH_INTYPE_COUNTEDSTRING));                 // 3
+            Schema.Add("Ansi", Scalar(TDH_INTYPE_ANSISTRING));                       // 4
+            Schema.Add("I8s", Scalar(TDH_INTYPE_INT8, TDH_OUTTYPE_NULL, 3));         // 5
+            Schema.Add("I8Text", Scalar(TDH_INTYPE_INT8, TDH_OUTTYPE_STRING));       // 6
+            Schema.Add("U8", Scalar(TDH_INTYPE_UINT8));                              // 7
+            Schema.Add("U8Text", Scalar(TDH_INTYPE_UINT8, TDH_OUTTYPE_STRING));      // 8
+            Schema.Add("I16", Scalar(TDH_INTYPE_INT16));                             // 9
+            Schema.Add("U16", Scalar(TDH_INTYPE_UINT16));                            // 10
+            Schema.Add("U16Text", Scalar(TDH_INTYPE_UINT16, TDH_OUTTYPE_STRING));    // 11
+            Schema.Add("Port", Scalar(TDH_INTYPE_UINT16, TDH_OUTTYPE_PORT));         // 12
+            Schema.Add("I32", Scalar(TDH_INTYPE_INT32));                             // 13
+            Schema.Add("U32", Scalar(TDH_INTYPE_UINT32));                            // 14
+            Schema.Add("Ipv4", Scalar(TDH_INTYPE_UINT32, TDH_OUTTYPE_IPV4));         // 15
+            Schema.Add("I64s", Scalar(TDH_INTYPE_INT64, TDH_OUTTYPE_NULL, 6));       // 16
+            Schema.Add("U64s", Scalar(TDH_INTYPE_UINT64, TDH_OUTTYPE_NULL, 10));     // 17
+            Schema.Add("Hex32", Scalar(TDH_INTYPE_HEXINT32));                        // 18
+            Schema.Add("Hex64", Scalar(TDH_INTYPE_HEXINT64));                        // 19
+            Schema.Add("Floats", Scalar(TDH_INTYPE_FLOAT, TDH_OUTTYPE_NULL, 3));     // 20
+            Schema.Add("Doubles", Scalar(TDH_INTYPE_DOUBLE, TDH_OUTTYPE_NULL, 3));   // 21
+            Schema.Add("Bools", Scalar(TDH_INTYPE_BOOLEAN, TDH_OUTTYPE_NULL, 2));    // 22
+            Schema.Add("Guids", Scalar(TDH_INTYPE_GUID, TDH_OUTTYPE_NULL, 2));       // 23
+            Schema.Add("Pointer", Scalar(TDH_INTYPE_POINTER));                       // 24
+            Schema.Add("SizeLong", Scalar(TDH_INTYPE_SIZET, TDH_OUTTYPE_LONG));      // 25
+            Schema.Add("FileTimes", Scalar(TDH_INTYPE_FILETIME, TDH_OUTTYPE_NULL, 4)); // 26
+            Schema.Add("SystemTime", Scalar(TDH_INTYPE_SYSTEMTIME));                 // 27
+            Schema.Add("Sid", Scalar(TDH_INTYPE_SID));                               // 28
+            Schema.Add("WChar", Scalar(TDH_INTYPE_UNICODECHAR));                     // 29
+            Schema.Add("AChar", Scalar(TDH_INTYPE_ANSICHAR));                        // 30
+            Schema.Add("BinLength", Scalar(TDH_INTYPE_UINT16));                      // 31
+            Schema.Add("Bin", Sized(TDH_INTYPE_BINARY, 31));                         // 32
+            Schema.Add("Ipv6Length", Scalar(TDH_INTYPE_UINT16));                     // 33
+            Schema.Add("Ipv6", Sized(TDH_INTYPE_BINARY, 33, TDH_OUTTYPE_IPV6));      // 34
+            Schema.Add("CountedBin", Scalar(TDH_INTYPE_MANIFEST_COUNTEDBINARY));     // 35
+            Schema.Add("Level", Scalar(TDH_INTYPE_UINT32), "Levels");                // 36
+            Schema.Add("Unmapped", Scalar(TDH_INTYPE_UINT32), "Levels");             // 37
+            Schema.Add("NoMap", Scalar(TDH_INTYPE_UINT32), "Missing");               // 38
+            Schema.Add("HResult", Scalar(TDH_INTYPE_INT32, TDH_OUTTYPE_HRESULT));    // 39
+            Schema.Add("HResultOther", Scalar(TDH_INTYPE_INT32, TDH_OUTTYPE_HRESULT)); // 40
+            Schema.Add("Win32", Scalar(TDH_INTYPE_UINT32, TDH_OUTTYPE_WIN32ERROR));  // 41
+            Schema.Add("NtStatus", Scalar(TDH_INTYPE_HEXINT32, TDH_OUTTYPE_NTSTATUS)); // 42
+            Schema.Add("Count", Scalar(TDH_INTYPE_UINT16));                          // 43
+            Schema.Add("Values", CountedArray(TDH_INTYPE_UINT16, 43));               // 44
+            Schema.Add("Items", CountedStruct(48, 2, 43));                           // 45
+            Schema.Add("Outer", Struct(50, 2));                                      // 46
+            Schema.Add("Tail", Scalar(TDH_INTYPE_UINT8));                            // 47
+            Schema.Add("Id", Scalar(TDH_INTYPE_UINT8));                              // 48
+            Schema.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));                    // 49
+            Schema.Add("Point", Struct(52, 2));                                      // 50
+            Schema.Add("Label", Scalar(TDH_INTYPE_ANSISTRING));                      // 51
+            Schema.Add("X", Scalar(TDH_INTYPE_INT32));                               // 52
+            Schema.Add("Y", Scalar(TDH_INTYPE_DOUBLE));                              // 53
+            Schema.SetTopLevelCount(48);
+
+            Schema32.Add("Pointer", Scalar(TDH_INTYPE_POINTER));
+            Schema32.Add("SizeLong", Scalar(TDH_INTYPE_SIZET, TDH_OUTTYPE_LONG));
+
+            Levels.Add(1, "Error").Add(2, "Warning");
+            Callbacks.SetSchema(1, Schema);
+            Callbacks.SetSchema(2, Schema32);
+            Callbacks.SetMap("Levels", Levels);
+            return;
+        }
+
+        // Returns the decoded CBOR, or "(failed)".
+        std::string
+        Cbor(EVENT_RECORD const& record, EtwJsonSuffixFlags flags)
+        {
+            CollectingSink sink;
+            return Actual.StartEvent(&record) && Actual.WriteCurrentEventAsCbor(sink, flags)
+                ? DecodeCbor(sink.Output)
+                : "(failed)";
+        }
+
+        // Returns the diagnostic notation expected for the items, or
+        // "(failed)".
+        std::string
+        ExpectedItems(EVENT_RECORD const& record)
+        {
+            return Expected.StartEvent(&record)
+                ? ::ExpectedItems(Expected, "Levels")
+                : "(failed)";
+        }
+    };
+
+    TestEvent
+    MakeAllTypesEvent(UINT64 timestamp)
+    {
+        TestEvent event(1, timestamp);
+
+        std::string longText;
+        for (unsigned i = 0; i != 300; i += 1)
+        {
+            longText += static_cast<char>('a' + i % 26);
+        }
+
+        char16_t const counted[] = u"abc";
+        GUID const guids[] = {
+            { 0x01234567, 0x89AB, 0xCDEF, { 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF } },
+            { 0xFFEEDDCC, 0xBBAA, 0x9988, { 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11, 0x00 } } };
+        UINT16 const systemTime[] = { 2019, 4, 3, 18, 1, 2, 3, 4 };
+        BYTE const sid[] = { 1, 1, 0, 0, 0, 0, 0, 5, 18, 0, 0, 0 }; // S-1-5-18
+        BYTE const bin[] = { 0x00, 0x01, 0xFE, 0xFF, 0x80 };
+        BYTE const ipv6[] = { 0xFE, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+        BYTE const countedBin[] = { 3, 0, 0xAA, 0xBB, 0xCC };
+
+        event
+            .AddString("Caf\xC3\xA9 \xF0\x9F\x98\x80 \"q\" \\")
+            .AddString(longText.c_str())
+            .Add<UINT16>(6).AddBytes(counted, 6)
+            .AddAnsiString("ansi")
+            .Add<INT8>(-128).Add<INT8>(-1).Add<INT8>(127)
+            .Add<INT8>('A')
+            .Add<UINT8>(200)
+            .Add<UINT8>('b')
+            .Add<INT16>(-300)
+            .Add<UINT16>(60000)
+            .Add<UINT16>('c')
+            .Add<UINT16>(0x5000)                          // Port 80 in network order.
+            .Add<INT32>(-100000)
+            .Add<UINT32>(4000000000u)
+            .Add<UINT32>(0x0100000A)                      // 10.0.0.1
+            .Add<INT64>(INT64(-0x7FFFFFFFFFFFFFFF) - 1).Add<INT64>(-1).Add<INT64>(-24)
+            .Add<INT64>(-25).Add<INT64>(-256).Add<INT64>(-257)
+            .Add<UINT64>(0).Add<UINT64>(23).Add<UINT64>(24).Add<UINT64>(255).Add<UINT64>(256)
+            .Add<UINT64>(65535).Add<UINT64>(65536).Add<UINT64>(0xFFFFFFFF)
+            .Add<UINT64>(0x100000000).Add<UINT64>(~UINT64(0))
+            .Add<UINT32>(0xDEADBEEF)
+            .Add<UINT64>(0x123456789ABCDEF0)
+            .Add<float>(1.5f).Add<float>(-0.0f).Add<float>(0.1f)
+            .Add<double>(2.5).Add<double>(-1e300).Add<double>(0.1)
+            .Add<INT32>(2).Add<INT32>(0)
+            .AddBytes(guids, sizeof(guids))
+            .Add<UINT64>(0xFFFF800012345678)
+            .Add<INT64>(-2)
+            .Add<UINT64>(132000000000000000)              // 2019-04-18, whole seconds.
+            .Add<UINT64>(132000000005000000)              // + 0.5 seconds.
+            .Add<UINT64>(0)                               // 1601-01-01.
+            .Add<UINT64>(116444736000000000 - 15000000)   // 1.5 seconds before 1970.
+            .AddBytes(systemTime, sizeof(systemTime))
+            .AddBytes(sid, sizeof(sid))
+            .Add<UINT16>(0x00E9)
+            .Add<char>('z')
+            .Add<UINT16>(sizeof(bin)).AddBytes(bin, sizeof(bin))
+            .Add<UINT16>(sizeof(ipv6)).AddBytes(ipv6, sizeof(ipv6))
+            .AddBytes(countedBin, sizeof(countedBin))
+            .Add<UINT32>(1)
+            .Add<UINT32>(7)
+            .Add<UINT32>(9)
+            .Add<INT32>(ResultCodeCallbacks::NamedCode)
+            .Add<INT32>(INT32(0x80004005))
+            .Add<UINT32>(ResultCodeCallbacks::NamedCode)
+            .Add<UINT32>(3)
+            .Add<UINT16>(2)
+            .Add<UINT16>(1).Add<UINT16>(65535)
+            .Add<UINT8>(1).AddString("one")
+            .Add<UINT8>(2).AddString("")
+            .Add<INT32>(-1).Add<double>(0.5).AddAnsiString("lbl")
+            .Add<UINT8>(255);
+
+        auto& header = event.Record().EventHeader;
+        header.EventDescriptor.Version = 3;
+        header.EventDescriptor.Level = 4;
+        header.EventDescriptor.Opcode = 11;
+        header.EventDescriptor.Keyword = 0x10;
+        header.ActivityId = guids[0];
+        return event;
+    }
+}
+
+ETW_TEST(Cbor_DecodesToEventValues)
+{
+    CborFixture f;
+    auto event = MakeAllTypesEvent(132000000005000000);
+    auto const& record = event.Record();
+
+    std::string const items = f.ExpectedItems(record);
+    std::string const actual = f.Cbor(record, EtwJsonSuffixFlags_None);
+    ETW_CHECK(actual == "{_ " + items + "}");
+
+    // Spot checks that do not depend on ExpectedValue.
+    ETW_CHECK(actual.find("\"Null\": null, \"Text\": \"Caf\xC3\xA9 \xF0\x9F\x98\x80 \\\"q\\\" \\\\\"") != std::string::npos);
+    ETW_CHECK(actual.find("\"Counted\": \"abc\"") != std::string::npos);
+    ETW_CHECK(actual.find("\"Ansi\": \"ansi\"") != std::string::npos);
+    ETW_CHECK(actual.find("\"I8s\": [_ -128, -1, 127]") != std::string::npos);
+    ETW_CHECK(actual.find("\"I8Text\": \"A\", \"U8\": 200, \"U8Text\": \"b\", \"I16\": -300, \"U16\": 60000, \"U16Text\": \"c\"") != std::string::npos);
+    ETW_CHECK(actual.find("\"Port\": 80") != std::string::npos);
+    ETW_CHECK(actual.find("\"Ipv4\": \"10.0.0.1\"") != std::string::npos);
+    ETW_CHECK(actual.find("\"I64s\": [_ -9223372036854775808, -1, -24, -25, -256, -257]") != std::string::npos);
+    ETW_CHECK(actual.find("\"U64s\": [_ 0, 23, 24, 255, 256, 65535, 65536, 4294967295, 4294967296, 18446744073709551615]") != std::string::npos);
+    ETW_CHECK(actual.find("\"Hex32\": 3735928559, \"Hex64\": 1311768467463790320") != std::string::npos);
+    ETW_CHECK(actual.find("\"Floats\": [_ 1.5_2, -0_2, 0.10000000149011612_2]") != std::string::npos);
+    ETW_CHECK(actual.find("\"Doubles\": [_ 2.5_3, -1.0000000000000001e+300_3, 0.10000000000000001_3]") != std::string::npos);
+    ETW_CHECK(actual.find("\"Bools\": [_ true, false]") != std::string::npos);
+    ETW_CHECK(actual.find("\"Guids\": [_ 37(h'0123456789abcdef0123456789abcdef'), 37(h'ffeeddccbbaa99887766554433221100')]") != std::string::npos);
+    ETW_CHECK(actual.find("\"Pointer\": 18446603336526616184, \"SizeLong\": -2") != std::string::npos);
+    ETW_CHECK(actual.find("\"FileTimes\": [_ 1(1555526400), 1(1555526400.5_3), 1(-11644473600), 1(-1.5_3)]") != std::string::npos);
+    ETW_CHECK(actual.find("\"SystemTime\": \"2019-04-18T01:02:03.004\", \"Sid\": \"S-1-5-18\"") != std::string::npos);
+    ETW_CHECK(actual.find("\"WChar\": \"\xC3\xA9\", \"AChar\": \"z\"") != std::string::npos);
+    ETW_CHECK(actual.find("\"Bin\": h'0001feff80'") != std::string::npos);
+    ETW_CHECK(actual.find("\"Ipv6\": \"fe80::1\", \"CountedBin\": h'aabbcc'") != std::string::npos);
+    ETW_CHECK(actual.find("\"Level\": \"1(Error)\", \"Unmapped\": \"7(??)\", \"NoMap\": 9") != std::string::npos);
+    ETW_CHECK(actual.find("\"HResult\": \"FILE_NOT_FOUND\", \"HResultOther\": -2147467259") != std::string::npos);
+    ETW_CHECK(actual.find("\"Win32\": \"FILE_NOT_FOUND\", \"NtStatus\": 3") != std::string::npos); // Unnamed HEXINT32.
+    ETW_CHECK(actual.find("\"Values\": [_ 1, 65535]") != std::string::npos);
+    ETW_CHECK(actual.find("\"Items\": [_ {_ \"Id\": 1, \"Name\": \"one\"}, {_ \"Id\": 2, \"Name\": \"\"}]") != std::string::npos);
+    ETW_CHECK(actual.find("\"Outer\": {_ \"Point\": {_ \"X\": -1, \"Y\": 0.5_3}, \"Label\": \"lbl\"}, \"Tail\": 255}") != std::string::npos);
+}
+
+ETW_TEST(Cbor_Meta)
+{
+    CborFixture f;
+    auto event = MakeAllTypesEvent(132000000005000000);
+    auto& record = event.Record();
+    record.BufferContext.ProcessorIndex = 3;
+
+    std::string const items = f.ExpectedItems(record);
+    auto const flags = static_cast<EtwJsonSuffixFlags>(
+        EtwJsonSuffixFlags_provider | EtwJsonSuffixFlags_event | EtwJsonSuffixFlags_time |
+        EtwJsonSuffixFlags_cpu | EtwJsonSuffixFlags_pid | EtwJsonSuffixFlags_tid |
+        EtwJsonSuffixFlags_id | EtwJsonSuffixFlags_version | EtwJsonSuffixFlags_channel |
+        EtwJsonSuffixFlags_level | EtwJsonSuffixFlags_opcode | EtwJsonSuffixFlags_task |
+        EtwJsonSuffixFlags_keywords | EtwJsonSuffixFlags_activity);
+    ETW_CHECK(f.Cbor(record, flags) ==
+        "{_ " + items + ", \"meta\": {_ "
+        "\"provider\": \"CborProvider\", \"event\": \"AllTypes\", "
+        "\"time\": 1(1555526400.5_3), \"cpu\": 3, \"pid\": 1234, \"tid\": 5678, "
+        "\"id\": 1, \"version\": 3, \"level\": 4, \"opcode\": 11, \"keywords\": 16, "
+        "\"activity\": 37(h'0123456789abcdef0123456789abcdef')}}");
+
+    // Omitted: zero activity, unknown pid/tid, zero version/level/opcode/keywords.
+    record.EventHeader.ActivityId = GUID();
+    record.EventHeader.ProcessId = 0xFFFFFFFF;
+    record.EventHeader.ThreadId = 0xFFFFFFFF;
+    record.EventHeader.EventDescriptor = EVENT_DESCRIPTOR();
+    record.EventHeader.EventDescriptor.Id = 1;
+    record.EventHeader.TimeStamp.QuadPart = 116444736000000000 - 10000000;
+    ETW_CHECK(f.Cbor(record, flags) ==
+        "{_ " + items + ", \"meta\": {_ "
+        "\"provider\": \"CborProvider\", \"event\": \"AllTypes\", "
+        "\"time\": 1(-1), \"cpu\": 3, \"id\": 1}}");
+}
+
+ETW_TEST(Cbor_PointerSize)
+{
+    CborFixture f;
+    TestEvent event(2);
+    event.Add<UINT32>(0x80001000).Add<INT32>(-2);
+    auto& record = event.Record();
+    record.EventHeader.Flags = EVENT_HEADER_FLAG_32_BIT_HEADER;
+
+    ETW_CHECK(f.ExpectedItems(record) == "\"Pointer\": 2147487744, \"SizeLong\": -2");
+    ETW_CHECK(f.Cbor(record, EtwJsonSuffixFlags_None) == "{_ \"Pointer\": 2147487744, \"SizeLong\": -2}");
+}
+
+ETW_TEST(Cbor_DecoderIsStrict)
+{
+    // Sanity checks for the test's decoder.
+    ETW_CHECK(DecodeCbor(std::string("\x18\x18", 2)) == "24");
+    ETW_CHECK(DecodeCbor(std::string("\x18\x17", 2)) == "(invalid)");         // Not minimal.
+    ETW_CHECK(DecodeCbor(std::string("\x19\x00\xFF", 3)) == "(invalid)");     // Not minimal.
+    ETW_CHECK(DecodeCbor(std::string("\x9F\x01\x02\xFF", 4)) == "[_ 1, 2]");
+    ETW_CHECK(DecodeCbor(std::string("\x9F\x01\x02", 3)) == "(invalid)");     // No break.
+    ETW_CHECK(DecodeCbor(std::string("\x01\xFF", 2)) == "(invalid)");         // Trailing break.
+    ETW_CHECK(DecodeCbor(std::string("\xBF\x61\x61\xFF", 4)) == "(invalid)"); // Key without value.
+    ETW_CHECK(DecodeCbor(std::string("\xC1\x3A\x00\x01\x00\x00", 6)) == "1(-65537)");
+    ETW_CHECK(DecodeCbor(std::string("\x62\x61", 2)) == "(invalid)");         // Truncated text.
+}
+
+ETW_BENCHMARK(Cbor_SizeAndThroughput)
+{
+    TestSchema schema("BenchmarkProvider", "Request");
+    schema.Add("Url", Scalar(TDH_INTYPE_UNICODESTRING));
+    schema.Add("Status", Scalar(TDH_INTYPE_UINT32));
+    schema.Add("Bytes", Scalar(TDH_INTYPE_UINT64));
+    schema.Add("Duration", Scalar(TDH_INTYPE_DOUBLE));
+    schema.Add("Session", Scalar(TDH_INTYPE_GUID));
+    schema.Add("Start", Scalar(TDH_INTYPE_FILETIME));
+    schema.Add("Count", Scalar(TDH_INTYPE_UINT16));
+    schema.Add("Samples", CountedArray(TDH_INTYPE_UINT32, 6));
+    TestCallbacks callbacks;
+    callbacks.SetSchema(1, schema);
+    EtwEnumerator enumerator(callbacks);
+
+    std::vector<TestEvent> events;
+    char url[64];
+    for (unsigned i = 0; i != 10000; i += 1)
+    {
+        snprintf(url, sizeof(url), "https://example.com/items/%u?page=%u", i * 7919u, i % 13);
+        events.emplace_back(1, 132000000000000000 + i * 12345ull);
+        auto& event = events.back();
+        event.AddString(url).Add<UINT32>(200 + i % 5).Add<UINT64>(i * 1031ull).Add<double>(i * 0.25)
+            .Add(GUID{ i, 1, 2, { 3, 4, 5, 6, 7, 8, 9, 10 } }).Add<UINT64>(132000000000000000 + i)
+            .Add<UINT16>(8);
+        for (unsigned j = 0; j != 8; j += 1)
+        {
+            event.Add<UINT32>(i * j);
+        }
+    }
+
+    std::vector<EVENT_RECORD const*> records;
+    for (auto& event : events)
+    {
+        records.push_back(&event.Record());
+    }
+
+    size_t jsonSize = 0;
+    double const referenceNs = BestTimeNs([&]()
+        {
+            jsonSize = 0;
+            for (auto pRecord : records)
+            {
+                EtwStringViewUtf8Z utf8;
+                enumerator.StartEvent(pRecord);
+                enumerator.FormatCurrentEventAsJsonUtf8(nullptr, EtwJsonSuffixFlags_Default, &utf8);
+                jsonSize += utf8.DataLength;
+            }
+        });
+
+    CountingSink sink;
+    double const currentNs = BestTimeNs([&]()
+        {
+            sink.Size = 0;
+            for (auto pRecord : records)
+            {
+                enumerator.StartEvent(pRecord);
+                enumerator.WriteCurrentEventAsCbor(sink, EtwJsonSuffixFlags_Default);
+            }
+        });
+
+    ETW_CHECK(jsonSize != 0);
+    ETW_CHECK(sink.Size != 0 && sink.Size < jsonSize);
+
+    ReportBenchmark("CBOR vs JSON (per event)", referenceNs, currentNs, double(records.size()));
+    printf("  %-28s JSON %9.2f MB/s,  CBOR %9.2f MB/s\n",
+        "  (output throughput)",
+        jsonSize * 1e3 / referenceNs,
+        sink.Size * 1e3 / currentNs);
+    printf("  %-28s JSON %9zu bytes, CBOR %9zu bytes (%.1f%%)\n",
+        "  (output size)",
+        jsonSize,
+        sink.Size,
+        100.0 * sink.Size / jsonSize);
+}
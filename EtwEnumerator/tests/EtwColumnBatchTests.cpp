@@ -0,0 +1,445 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for DecodeEventsToColumns with structs and arrays. Structs are
+flattened into "Struct.Member" columns, arrays become list columns, the
+member lists of an array of structs stay aligned, and arrays nested in
+arrays of structs are reported as dropped None columns. Each column is
+checked as text, one string per row. GetStructInfo is checked against the
+schema's struct properties, and DecodeCurrentEventToColumns against
+DecodeEventsToColumns.
+*/
+
+#include "EtwTest.h"
+#include <stdio.h>
+
+using namespace EtwTest;
+
+namespace
+{
+    typedef std::vector<std::string> Rows;
+
+    bool
+    IsSet(BYTE const* pBits, UINT32 i)
+    {
+        return (pBits[i / 8] >> (i & 7)) & 1;
+    }
+
+    std::string
+    ValueText(
+        EtwColumnInfo const& info,
+        UINT32 i)
+    {
+        char buffer[64];
+        auto const pb = static_cast<BYTE const*>(info.Values);
+        if (!IsSet(info.Validity, i))
+        {
+            return "null";
+        }
+
+        switch (info.Type)
+        {
+        case EtwColumnType_Int64:
+        {
+            INT64 value;
+            memcpy(&value, pb + i * 8, 8);
+            snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(value));
+            return buffer;
+        }
+        case EtwColumnType_UInt64:
+        {
+            UINT64 value;
+            memcpy(&value, pb + i * 8, 8);
+            snprintf(buffer, sizeof(buffer), "%llu", static_cast<unsigned long long>(value));
+            return buffer;
+        }
+        case EtwColumnType_Double:
+        {
+            double value;
+            memcpy(&value, pb + i * 8, 8);
+            snprintf(buffer, sizeof(buffer), "%g", value);
+            return buffer;
+        }
+        case EtwColumnType_String:
+            return '"' + ToUtf8(
+                reinterpret_cast<EtwWCHAR const*>(pb + info.Offsets[i]),
+                (info.Offsets[i + 1] - info.Offsets[i]) / 2) + '"';
+        case EtwColumnType_AnsiString:
+            return '"' + std::string(
+                reinterpret_cast<char const*>(pb + info.Offsets[i]),
+                info.Offsets[i + 1] - info.Offsets[i]) + '"';
+        default:
+            return "?";
+        }
+    }
+
+    // One string per row: the value, "[values]" for a list, or "null".
+    Rows
+    ColumnText(
+        EtwColumnBatch const& batch,
+        char const* szName)
+    {
+        Rows rows;
+        auto const tableInfo = batch.GetTableInfo(0);
+        for (unsigned c = 0; c != tableInfo.ColumnCount; c += 1)
+        {
+            auto const info = batch.GetColumnInfo(0, c);
+            if (ToUtf8(info.Name) != szName)
+            {
+                continue;
+            }
+
+            ETW_CHECK(info.RowCount == tableInfo.RowCount);
+            for (UINT32 row = 0; row != info.RowCount; row += 1)
+            {
+                if (info.ListOffsets == nullptr)
+                {
+                    rows.push_back(ValueText(info, row));
+                }
+                else if (!IsSet(info.ListValidity, row))
+                {
+                    ETW_CHECK(info.ListOffsets[row] == info.ListOffsets[row + 1]);
+                    rows.push_back("null");
+                }
+                else
+                {
+                    std::string text = "[";
+                    for (UINT32 i = info.ListOffsets[row]; i != info.ListOffsets[row + 1]; i += 1)
+                    {
+                        text += (i == info.ListOffsets[row] ? "" : ",") + ValueText(info, i);
+                    }
+
+                    rows.push_back(text + "]");
+                }
+            }
+
+            ETW_CHECK(info.ListOffsets == nullptr
+                ? info.ValueCount == info.RowCount
+                : info.ValueCount == info.ListOffsets[info.RowCount]);
+        }
+
+        return rows;
+    }
+
+    Rows
+    ColumnNames(EtwColumnBatch const& batch)
+    {
+        Rows names;
+        auto const tableInfo = batch.GetTableInfo(0);
+        for (unsigned c = EtwColumnBatch::HeaderColumnCount; c != tableInfo.ColumnCount; c += 1)
+        {
+            names.push_back(ToUtf8(batch.GetColumnInfo(0, c).Name));
+        }
+
+        return names;
+    }
+
+    bool
+    IsListColumn(EtwColumnBatch const& batch, char const* szName)
+    {
+        auto const tableInfo = batch.GetTableInfo(0);
+        for (unsigned c = 0; c != tableInfo.ColumnCount; c += 1)
+        {
+            auto const info = batch.GetColumnInfo(0, c);
+            if (ToUtf8(info.Name) == szName)
+            {
+                return info.ListOffsets != nullptr;
+            }
+        }
+
+        return false;
+    }
+
+    struct ColumnFixture
+    {
+        TestSchema Schema;
+        TestCallbacks Callbacks;
+        EtwEnumerator Enumerator;
+        EtwColumnBatch Batch;
+        std::vector<TestEvent> Events;
+        std::vector<LSTATUS> Errors;
+
+        ColumnFixture()
+            : Schema("ColumnProvider", "ColumnEvent")
+            , Callbacks()
+            , Enumerator(Callbacks)
+            , Batch()
+        {
+            return;
+        }
+
+        TestEvent&
+        AddEvent()
+        {
+            Events.push_back(TestEvent(1, 0x01D3C9E5A1B2C3D4 + Events.size()));
+            return Events.back();
+        }
+
+        unsigned
+        Decode()
+        {
+            Callbacks.SetSchema(1, Schema);
+            std::vector<EVENT_RECORD const*> records;
+            for (auto& event : Events)
+            {
+                records.push_back(&event.Record());
+            }
+
+            Errors.assign(records.size(), ERROR_INVALID_STATE);
+            return Enumerator.DecodeEventsToColumns(
+                records.data(), static_cast<unsigned>(records.size()), Batch, Errors.data());
+        }
+    };
+}
+
+ETW_TEST(ColumnBatch_StructsAreFlattened)
+{
+    ColumnFixture f;
+    f.Schema.Add("Id", Scalar(TDH_INTYPE_UINT32));                    // 0
+    f.Schema.Add("Point", Struct(3, 3));                              // 1
+    f.Schema.Add("Tail", Scalar(TDH_INTYPE_UINT16));                  // 2
+    f.Schema.Add("X", Scalar(TDH_INTYPE_INT32));                      // 3
+    f.Schema.Add("Y", Scalar(TDH_INTYPE_INT32));                      // 4
+    f.Schema.Add("Inner", Struct(6, 1));                              // 5
+    f.Schema.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));           // 6
+    f.Schema.SetTopLevelCount(3);
+
+    f.AddEvent().Add<UINT32>(1).Add<INT32>(-5).Add<INT32>(7).AddString("a").Add<UINT16>(9);
+    f.AddEvent().Add<UINT32>(2).Add<INT32>(0).Add<INT32>(0).AddString("").Add<UINT16>(10);
+    f.AddEvent().Add<UINT32>(3).Add<INT32>(4); // Truncated in the struct.
+
+    ETW_CHECK(3 == f.Decode());
+    ETW_CHECK(f.Errors == std::vector<LSTATUS>({ ERROR_SUCCESS, ERROR_SUCCESS, ERROR_INVALID_DATA }));
+    ETW_CHECK(f.Batch.TableCount() == 1);
+    ETW_CHECK(f.Batch.GetTableInfo(0).DroppedColumnCount == 0);
+    ETW_CHECK(ColumnNames(f.Batch) == Rows({ "Id", "Point.X", "Point.Y", "Point.Inner.Name", "Tail" }));
+    ETW_CHECK(ColumnText(f.Batch, "Id") == Rows({ "1", "2", "3" }));
+    ETW_CHECK(ColumnText(f.Batch, "Point.X") == Rows({ "-5", "0", "4" }));
+    ETW_CHECK(ColumnText(f.Batch, "Point.Y") == Rows({ "7", "0", "null" }));
+    ETW_CHECK(ColumnText(f.Batch, "Point.Inner.Name") == Rows({ "\"a\"", "\"\"", "null" }));
+    ETW_CHECK(ColumnText(f.Batch, "Tail") == Rows({ "9", "10", "null" }));
+    ETW_CHECK(!IsListColumn(f.Batch, "Point.X"));
+    ETW_CHECK(!IsListColumn(f.Batch, "Point.Inner.Name"));
+}
+
+ETW_TEST(ColumnBatch_ArraysAreLists)
+{
+    ColumnFixture f;
+    f.Schema.Add("Count", Scalar(TDH_INTYPE_UINT16));                 // 0
+    f.Schema.Add("Values", CountedArray(TDH_INTYPE_UINT32, 0));       // 1
+    f.Schema.Add("Fixed", Scalar(TDH_INTYPE_INT8, TDH_OUTTYPE_NULL, 3)); // 2
+    f.Schema.Add("Names", CountedArray(TDH_INTYPE_UNICODESTRING, 0)); // 3
+    f.Schema.Add("Box", Struct(5, 1));                                // 4
+    f.Schema.Add("Sizes", Scalar(TDH_INTYPE_UINT16, TDH_OUTTYPE_NULL, 2)); // 5
+    f.Schema.SetTopLevelCount(5);
+
+    f.AddEvent().Add<UINT16>(2).Add<UINT32>(10).Add<UINT32>(20)
+        .Add<INT8>(1).Add<INT8>(-2).Add<INT8>(3)
+        .AddString("x").AddString("yy")
+        .Add<UINT16>(100).Add<UINT16>(200);
+    f.AddEvent().Add<UINT16>(0)
+        .Add<INT8>(4).Add<INT8>(5).Add<INT8>(6)
+        .Add<UINT16>(300).Add<UINT16>(400);
+    f.AddEvent().Add<UINT16>(3).Add<UINT32>(30); // Truncated in Values.
+
+    ETW_CHECK(3 == f.Decode());
+    ETW_CHECK(f.Errors == std::vector<LSTATUS>({ ERROR_SUCCESS, ERROR_SUCCESS, ERROR_INVALID_DATA }));
+    ETW_CHECK(f.Batch.GetTableInfo(0).DroppedColumnCount == 0);
+    ETW_CHECK(ColumnNames(f.Batch) == Rows({ "Count", "Values", "Fixed", "Names", "Box.Sizes" }));
+    ETW_CHECK(!IsListColumn(f.Batch, "Count"));
+    ETW_CHECK(IsListColumn(f.Batch, "Values"));
+    ETW_CHECK(IsListColumn(f.Batch, "Box.Sizes"));
+    ETW_CHECK(ColumnText(f.Batch, "Count") == Rows({ "2", "0", "3" }));
+    ETW_CHECK(ColumnText(f.Batch, "Values") == Rows({ "[10,20]", "[]", "null" }));
+    ETW_CHECK(ColumnText(f.Batch, "Fixed") == Rows({ "[1,-2,3]", "[4,5,6]", "null" }));
+    ETW_CHECK(ColumnText(f.Batch, "Names") == Rows({ "[\"x\",\"yy\"]", "[]", "null" }));
+    ETW_CHECK(ColumnText(f.Batch, "Box.Sizes") == Rows({ "[100,200]", "[300,400]", "null" }));
+}
+
+ETW_TEST(ColumnBatch_StructArrayListsAreAligned)
+{
+    ColumnFixture f;
+    f.Schema.Add("Count", Scalar(TDH_INTYPE_UINT8));                  // 0
+    f.Schema.Add("Items", CountedStruct(3, 3, 0));                    // 1
+    f.Schema.Add("After", Scalar(TDH_INTYPE_UINT32));                 // 2
+    f.Schema.Add("Id", Scalar(TDH_INTYPE_UINT32));                    // 3
+    f.Schema.Add("Inner", Struct(6, 1));                              // 4
+    f.Schema.Add("Name", Scalar(TDH_INTYPE_ANSISTRING));              // 5
+    f.Schema.Add("Flag", Scalar(TDH_INTYPE_BOOLEAN));                 // 6
+    f.Schema.SetTopLevelCount(3);
+
+    f.AddEvent().Add<UINT8>(2)
+        .Add<UINT32>(1).Add<UINT32>(1).AddAnsiString("a")
+        .Add<UINT32>(2).Add<UINT32>(0).AddAnsiString("bc")
+        .Add<UINT32>(7);
+    f.AddEvent().Add<UINT8>(0).Add<UINT32>(8);
+    f.AddEvent().Add<UINT8>(2)
+        .Add<UINT32>(3).Add<UINT32>(1).AddAnsiString("x")
+        .Add<UINT32>(4); // Truncated in the second element.
+
+    ETW_CHECK(3 == f.Decode());
+    ETW_CHECK(f.Errors == std::vector<LSTATUS>({ ERROR_SUCCESS, ERROR_SUCCESS, ERROR_INVALID_DATA }));
+    ETW_CHECK(ColumnNames(f.Batch) == Rows({ "Count", "Items.Id", "Items.Inner.Flag", "Items.Name", "After" }));
+    ETW_CHECK(IsListColumn(f.Batch, "Items.Id"));
+    ETW_CHECK(IsListColumn(f.Batch, "Items.Inner.Flag"));
+    ETW_CHECK(!IsListColumn(f.Batch, "After"));
+    ETW_CHECK(ColumnText(f.Batch, "Items.Id") == Rows({ "[1,2]", "[]", "[3,4]" }));
+    ETW_CHECK(ColumnText(f.Batch, "Items.Inner.Flag") == Rows({ "[1,0]", "[]", "[1,null]" }));
+    ETW_CHECK(ColumnText(f.Batch, "Items.Name") == Rows({ "[\"a\",\"bc\"]", "[]", "[\"x\",null]" }));
+    ETW_CHECK(ColumnText(f.Batch, "After") == Rows({ "7", "8", "null" }));
+
+    // Columns: header, Count, Items.Id, Items.Inner.Flag, Items.Name, After.
+    unsigned const first = EtwColumnBatch::HeaderColumnCount;
+    ETW_CHECK(f.Batch.GetTableInfo(0).StructCount == 2);
+    auto const items = f.Batch.GetStructInfo(0, 0);
+    ETW_CHECK(ToUtf8(items.Name) == "Items");
+    ETW_CHECK(items.Parent == EtwColumnBatch::NoStruct);
+    ETW_CHECK(items.FirstColumn == first + 1 && items.ColumnCount == 3 && items.IsArray);
+    auto const inner = f.Batch.GetStructInfo(0, 1);
+    ETW_CHECK(ToUtf8(inner.Name) == "Inner");
+    ETW_CHECK(inner.Parent == 0);
+    ETW_CHECK(inner.FirstColumn == first + 2 && inner.ColumnCount == 1 && !inner.IsArray);
+
+    unsigned const expectedStructs[] = {
+        EtwColumnBatch::NoStruct, 0, 1, 0, EtwColumnBatch::NoStruct };
+    char const* const expectedMemberNames[] = { "Count", "Id", "Flag", "Name", "After" };
+    for (unsigned i = 0; i != _countof(expectedStructs); i += 1)
+    {
+        auto const info = f.Batch.GetColumnInfo(0, first + i);
+        ETW_CHECK(info.Struct == expectedStructs[i]);
+        ETW_CHECK(ToUtf8(info.MemberName) == expectedMemberNames[i]);
+    }
+
+    ETW_CHECK(f.Batch.GetColumnInfo(0, 0).Struct == EtwColumnBatch::NoStruct);
+    ETW_CHECK(ToUtf8(f.Batch.GetColumnInfo(0, 0).MemberName) == "TimeStamp");
+}
+
+ETW_TEST(ColumnBatch_NestedArraysAreReported)
+{
+    ColumnFixture f;
+    f.Schema.Add("Count", Scalar(TDH_INTYPE_UINT8));                  // 0
+    f.Schema.Add("Items", CountedStruct(3, 4, 0));                    // 1
+    f.Schema.Add("After", Scalar(TDH_INTYPE_UINT16));                 // 2
+    f.Schema.Add("N", Scalar(TDH_INTYPE_UINT8));                      // 3
+    f.Schema.Add("Values", CountedArray(TDH_INTYPE_UINT16, 3));       // 4
+    f.Schema.Add("Pairs", Struct(7, 1, 2));                           // 5
+    f.Schema.Add("Id", Scalar(TDH_INTYPE_UINT32));                    // 6
+    f.Schema.Add("P", Scalar(TDH_INTYPE_UINT8));                      // 7
+    f.Schema.SetTopLevelCount(3);
+
+    f.AddEvent().Add<UINT8>(2)
+        .Add<UINT8>(2).Add<UINT16>(1).Add<UINT16>(2).Add<UINT8>(5).Add<UINT8>(6).Add<UINT32>(10)
+        .Add<UINT8>(0).Add<UINT8>(7).Add<UINT8>(8).Add<UINT32>(11)
+        .Add<UINT16>(5);
+
+    ETW_CHECK(1 == f.Decode());
+    ETW_CHECK(f.Errors[0] == ERROR_SUCCESS);
+    ETW_CHECK(f.Batch.GetTableInfo(0).DroppedColumnCount == 2);
+    ETW_CHECK(ColumnNames(f.Batch) == Rows({ "Count", "Items.N", "Items.Values", "Items.Pairs", "Items.Id", "After" }));
+    ETW_CHECK(ColumnText(f.Batch, "Items.N") == Rows({ "[2,0]" }));
+    ETW_CHECK(ColumnText(f.Batch, "Items.Values") == Rows({ "null" }));
+    ETW_CHECK(ColumnText(f.Batch, "Items.Pairs") == Rows({ "null" }));
+    ETW_CHECK(ColumnText(f.Batch, "Items.Id") == Rows({ "[10,11]" }));
+    ETW_CHECK(ColumnText(f.Batch, "After") == Rows({ "5" }));
+
+    auto const tableInfo = f.Batch.GetTableInfo(0);
+    for (unsigned c = 0; c != tableInfo.ColumnCount; c += 1)
+    {
+        auto const info = f.Batch.GetColumnInfo(0, c);
+        auto const name = ToUtf8(info.Name);
+        ETW_CHECK((info.Type == EtwColumnType_None) == (name == "Items.Values" || name == "Items.Pairs"));
+    }
+}
+
+ETW_TEST(ColumnBatch_CurrentEventMatchesBatch)
+{
+    ColumnFixture f;
+    f.Schema.Add("Id", Scalar(TDH_INTYPE_UINT32));                    // 0
+    f.Schema.Add("Count", Scalar(TDH_INTYPE_UINT16));                 // 1
+    f.Schema.Add("Values", CountedArray(TDH_INTYPE_UINT32, 1));       // 2
+    f.Schema.SetTopLevelCount(3);
+
+    f.AddEvent().Add<UINT32>(1).Add<UINT16>(2).Add<UINT32>(10).Add<UINT32>(20);
+    f.AddEvent().Add<UINT32>(2).Add<UINT16>(0);
+    f.AddEvent().Add<UINT32>(3).Add<UINT16>(1).Add<UINT32>(30);
+    f.AddEvent().Add<UINT32>(4).Add<UINT16>(3).Add<UINT32>(40); // Truncated in Values.
+
+    ETW_CHECK(4 == f.Decode());
+    auto const ids = ColumnText(f.Batch, "Id");
+    auto const values = ColumnText(f.Batch, "Values");
+    ETW_CHECK(values == Rows({ "[10,20]", "[]", "[30]", "null" }));
+
+    // Rows for started events, after EvaluateFilter or a partial walk, are
+    // the same as the rows from DecodeEventsToColumns.
+    EtwEventFilter filter;
+    std::vector<EtwWCHAR> const expression = { 'I', 'd', ' ', '!', '=', ' ', '2', 0 };
+    ETW_CHECK(ERROR_SUCCESS == filter.SetExpression(expression.data()));
+
+    EtwColumnBatch batch;
+    std::vector<LSTATUS> errors;
+    for (auto& event : f.Events)
+    {
+        bool match = false;
+        ETW_CHECK(f.Enumerator.StartEvent(&event.Record()));
+        ETW_CHECK(f.Enumerator.EvaluateFilter(filter, &match));
+        if (match)
+        {
+            ETW_CHECK(f.Enumerator.MoveNext());
+            ETW_CHECK(f.Enumerator.DecodeCurrentEventToColumns(batch));
+            errors.push_back(f.Enumerator.LastError());
+        }
+    }
+
+    ETW_CHECK(errors == std::vector<LSTATUS>({ ERROR_SUCCESS, ERROR_SUCCESS, ERROR_INVALID_DATA }));
+    ETW_CHECK(batch.GetTableInfo(0).RowCount == 3);
+    ETW_CHECK(ColumnText(batch, "Id") == Rows({ ids[0], ids[2], ids[3] }));
+    ETW_CHECK(ColumnText(batch, "Values") == Rows({ values[0], values[2], values[3] }));
+}
+
+ETW_TEST(ColumnBatch_ClearRowsResetsLists)
+{
+    ColumnFixture f;
+    f.Schema.Add("Count", Scalar(TDH_INTYPE_UINT8));                  // 0
+    f.Schema.Add("Items", CountedStruct(3, 2, 0));                    // 1
+    f.Schema.Add("Values", CountedArray(TDH_INTYPE_UNICODESTRING, 0)); // 2
+    f.Schema.Add("Id", Scalar(TDH_INTYPE_UINT16));                    // 3
+    f.Schema.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));           // 4
+    f.Schema.SetTopLevelCount(3);
+
+    for (UINT8 i = 0; i != 20; i += 1)
+    {
+        auto& event = f.AddEvent().Add<UINT8>(i % 4);
+        for (UINT8 j = 0; j != i % 4; j += 1)
+        {
+            event.Add<UINT16>(i * 10 + j).AddString(j % 2 ? "odd" : "");
+        }
+
+        for (UINT8 j = 0; j != i % 4; j += 1)
+        {
+            event.AddString("v");
+        }
+    }
+
+    ETW_CHECK(20 == f.Decode());
+    auto const ids = ColumnText(f.Batch, "Items.Id");
+    auto const names = ColumnText(f.Batch, "Items.Name");
+    auto const values = ColumnText(f.Batch, "Values");
+    ETW_CHECK(ids[5] == "[50]");
+    ETW_CHECK(names[7] == "[\"\",\"odd\",\"\"]");
+    ETW_CHECK(values[8] == "[]");
+
+    // Rows accumulate across calls, and ClearRows starts over.
+    ETW_CHECK(20 == f.Decode());
+    ETW_CHECK(f.Batch.GetTableInfo(0).RowCount == 40);
+    auto idsTwice = ids;
+    idsTwice.insert(idsTwice.end(), ids.begin(), ids.end());
+    ETW_CHECK(ColumnText(f.Batch, "Items.Id") == idsTwice);
+
+    f.Batch.ClearRows();
+    ETW_CHECK(f.Batch.GetTableInfo(0).RowCount == 0);
+    ETW_CHECK(20 == f.Decode());
+    ETW_CHECK(ColumnText(f.Batch, "Items.Id") == ids);
+    ETW_CHECK(ColumnText(f.Batch, "Items.Name") == names);
+    ETW_CHECK(ColumnText(f.Batch, "Values") == values);
+}
@@ -0,0 +1,272 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for EtwCompiledPrefix. Every method that accepts a compiled prefix
+must produce the same output as the corresponding method given the prefix
+format string.
+*/
+
+#include "EtwTest.h"
+#include <random>
+#include <stdio.h>
+
+using namespace EtwTest;
+
+namespace
+{
+    typedef std::vector<wchar_t> WideString;
+
+    WideString
+    Widen(std::string const& str)
+    {
+        WideString result(str.begin(), str.end());
+        result.push_back(0);
+        return result;
+    }
+
+    struct CollectingSink final
+        : EtwOutputSink
+    {
+        std::string Output;
+
+        LSTATUS __stdcall Write(
+            _In_reads_bytes_(cb) void const* pb,
+            unsigned cb) noexcept override
+        {
+            Output.append(static_cast<char const*>(pb), cb);
+            return ERROR_SUCCESS;
+        }
+    };
+
+    struct CompiledPrefixFixture
+    {
+        TestSchema Schema;         // Event 1: named event.
+        TestSchema UnnamedSchema;  // Event 2: no event name, with a message.
+        TestCallbacks Callbacks;
+        EtwEnumerator Enumerator;
+
+        CompiledPrefixFixture()
+            : Schema("PrefixProvider", "PrefixEvent")
+            , UnnamedSchema("PrefixProvider")
+            , Callbacks()
+            , Enumerator(Callbacks)
+        {
+            Schema.Add("Value", Scalar(TDH_INTYPE_UINT32));
+            Schema.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));
+            UnnamedSchema.Add("Value", Scalar(TDH_INTYPE_UINT32));
+            UnnamedSchema.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));
+            UnnamedSchema.SetEventMessage("value %1, name %2");
+            Callbacks.SetSchema(1, Schema);
+            Callbacks.SetSchema(2, UnnamedSchema);
+        }
+    };
+
+    // Events with different header values: private session (PTIME instead
+    // of KTIME/UTIME), 16-bit processor index, level, keywords.
+    std::vector<TestEvent>
+    TestEvents()
+    {
+        std::vector<TestEvent> events;
+        for (USHORT i = 0; i != 6; i += 1)
+        {
+            TestEvent event(1 + i % 2, 0x01D3C9E5A1B2C3D4 + i * 1234567);
+            event.Add<UINT32>(i * 1000u);
+            event.AddString(i % 3 ? "name" : "");
+
+            auto& header = event.Record().EventHeader;
+            header.ProcessId = 0x1000 + i;
+            header.ThreadId = 0x2000 + i;
+            header.EventDescriptor.Level = static_cast<UCHAR>(i);
+            header.EventDescriptor.Keyword = 0x8000000000000000ull >> i;
+            if (i % 3 == 1)
+            {
+                header.Flags |= EVENT_HEADER_FLAG_PRIVATE_SESSION;
+                header.ProcessorTime = 0x123456789ull * i;
+            }
+            else
+            {
+                header.KernelTime = 10 * i;
+                header.UserTime = 20 * i;
+            }
+
+            if (i % 2)
+            {
+                event.Record().EventHeader.Flags |= EVENT_HEADER_FLAG_PROCESSOR_INDEX;
+                event.Record().BufferContext.ProcessorIndex = static_cast<USHORT>(300 + i);
+            }
+            else
+            {
+                event.Record().BufferContext.ProcessorNumber = static_cast<UCHAR>(i);
+            }
+
+            events.push_back(event);
+        }
+
+        return events;
+    }
+
+    char const* const FixedPrefixes[] = {
+        "",
+        "[%9]%8.%3::%4 [%1]",
+        "%1 %2 %3 %4 %5 %6 %7 %8 %9",
+        "%!PROVIDER! %!EVENT! %!TID! %!TIME! %!KTIME! %!UTIME! %!PID! %!CPU!",
+        "%!FLAGS! %!KEYWORDS! %!LEVEL! %!ATTRIBS! %!FUNC! %!FILE! %!LINE!",
+        "%!MJ! %!COMPNAME! %!MN! %!SUBCOMP! %!PTIME!",
+        "%!PCT!%!PERCENT!%!BANG!%!EXCLAMATION!",
+        "%0 %10 %99 %!UNKNOWN! %!TIME %! % %% !x! %1!08x!",
+        "literal",
+        "trailing %",
+    };
+
+    char const* const Tokens[] = {
+        "[", "]", ".", "::", " ", "abc", "%1", "%2", "%3", "%4", "%5", "%6", "%7", "%8",
+        "%9", "%0", "%10", "%!PROVIDER!", "%!EVENT!", "%!TID!", "%!TIME!", "%!KTIME!",
+        "%!UTIME!", "%!PID!", "%!CPU!", "%!FLAGS!", "%!LEVEL!", "%!ATTRIBS!", "%!FUNC!",
+        "%!PTIME!", "%!PCT!", "%!BANG!", "%!FOO!", "%!", "%", "%%", "%%1", "!", "%1!x!",
+        "%!TIME", "\t",
+    };
+
+    std::vector<std::string>
+    TestPrefixes(unsigned randomCount)
+    {
+        std::vector<std::string> prefixes(std::begin(FixedPrefixes), std::end(FixedPrefixes));
+        std::mt19937 rng(11);
+        for (unsigned i = 0; i != randomCount; i += 1)
+        {
+            std::string prefix;
+            unsigned const tokenCount = rng() % 10;
+            for (unsigned j = 0; j != tokenCount; j += 1)
+            {
+                prefix += Tokens[rng() % (sizeof(Tokens) / sizeof(Tokens[0]))];
+            }
+
+            prefixes.push_back(prefix);
+        }
+
+        return prefixes;
+    }
+
+    // Formats the event with each method, returning the outputs (UTF-8),
+    // each preceded by the return value and LastError.
+    template<class Prefix>
+    std::vector<std::string>
+    FormatAll(
+        EtwEnumerator& e,
+        EVENT_RECORD const& record,
+        Prefix const& prefix)
+    {
+        std::vector<std::string> results;
+        auto const add = [&](bool ok, std::string const& text)
+        {
+            char status[32];
+            snprintf(status, sizeof(status), "%d:%d:", ok, static_cast<int>(e.LastError()));
+            results.push_back(status + text);
+        };
+
+        EtwStringViewZ str = {};
+        ETW_CHECK(e.StartEvent(&record));
+        bool ok = e.FormatCurrentEventPrefix(prefix, &str);
+        add(ok, ToUtf8(str.Data, str.DataLength));
+
+        for (EtwJsonSuffixFlags flags : { EtwJsonSuffixFlags_None, EtwJsonSuffixFlags_Default })
+        {
+            ok = e.FormatCurrentEvent(prefix, flags, &str);
+            add(ok, ToUtf8(str.Data, str.DataLength));
+
+            EtwStringViewUtf8Z utf8 = {};
+            ok = e.FormatCurrentEventUtf8(prefix, flags, &utf8);
+            add(ok, std::string(utf8.Data, utf8.DataLength));
+
+            CollectingSink sink;
+            ok = e.WriteCurrentEvent(sink, prefix, flags);
+            add(ok, ToUtf8(reinterpret_cast<wchar_t const*>(sink.Output.data()),
+                sink.Output.size() / sizeof(wchar_t)));
+
+            CollectingSink sinkUtf8;
+            ok = e.WriteCurrentEventUtf8(sinkUtf8, prefix, flags);
+            add(ok, sinkUtf8.Output);
+        }
+
+        return results;
+    }
+}
+
+ETW_TEST(CompiledPrefix_MatchesFormatString)
+{
+    CompiledPrefixFixture f;
+    auto events = TestEvents();
+    unsigned failures = 0;
+    unsigned checks = 0;
+
+    EtwCompiledPrefix compiled;
+    for (auto const& prefix : TestPrefixes(2000))
+    {
+        WideString const wide = Widen(prefix);
+        ETW_CHECK(ERROR_SUCCESS == compiled.Compile(wide.data()));
+        ETW_CHECK(compiled.Empty() == prefix.empty());
+        for (auto& event : events)
+        {
+            auto const expected = FormatAll(f.Enumerator, event.Record(), wide.data());
+            auto const actual = FormatAll(f.Enumerator, event.Record(), compiled);
+            checks += 1;
+            if (expected != actual && failures++ < 10)
+            {
+                printf("  \"%s\": expected \"%s\", got \"%s\"\n",
+                    prefix.c_str(), expected[0].c_str(), actual[0].c_str());
+            }
+        }
+    }
+
+    ETW_CHECK(checks != 0);
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(CompiledPrefix_SharedAcrossEnumerators)
+{
+    // One compiled prefix used by several enumerators with different
+    // timestamp formats.
+    CompiledPrefixFixture f1;
+    CompiledPrefixFixture f2;
+    f2.Enumerator.SetTimestampFormat(static_cast<EtwTimestampFormat>(
+        EtwTimestampFormat_Wpp | EtwTimestampFormat_LowPrecision));
+    auto events = TestEvents();
+
+    EtwCompiledPrefix compiled;
+    ETW_CHECK(ERROR_SUCCESS == compiled.Compile(L"[%9]%8.%3::%4 [%1] %!LEVEL!"));
+    for (auto& event : events)
+    {
+        ETW_CHECK(FormatAll(f1.Enumerator, event.Record(), compiled) ==
+            FormatAll(f1.Enumerator, event.Record(), L"[%9]%8.%3::%4 [%1] %!LEVEL!"));
+        ETW_CHECK(FormatAll(f2.Enumerator, event.Record(), compiled) ==
+            FormatAll(f2.Enumerator, event.Record(), L"[%9]%8.%3::%4 [%1] %!LEVEL!"));
+    }
+}
+
+ETW_TEST(CompiledPrefix_EmptyAndRecompile)
+{
+    CompiledPrefixFixture f;
+    auto events = TestEvents();
+    EVENT_RECORD const& record = events[0].Record();
+
+    EtwCompiledPrefix compiled;
+    ETW_CHECK(compiled.Empty());
+    ETW_CHECK(FormatAll(f.Enumerator, record, compiled) == FormatAll(f.Enumerator, record, L""));
+
+    ETW_CHECK(ERROR_SUCCESS == compiled.Compile(L"%1"));
+    ETW_CHECK(!compiled.Empty());
+    ETW_CHECK(FormatAll(f.Enumerator, record, compiled) == FormatAll(f.Enumerator, record, L"%1"));
+
+    // Recompiling replaces the previous result.
+    ETW_CHECK(ERROR_SUCCESS == compiled.Compile(L"<%!TID!>"));
+    ETW_CHECK(FormatAll(f.Enumerator, record, compiled) == FormatAll(f.Enumerator, record, L"<%!TID!>"));
+
+    EtwStringViewZ str = {};
+    ETW_CHECK(f.Enumerator.StartEvent(&record));
+    ETW_CHECK(f.Enumerator.FormatCurrentEventPrefix(compiled, &str));
+    ETW_CHECK(ToUtf8(str.Data, str.DataLength) == "<2000>");
+
+    ETW_CHECK(ERROR_SUCCESS == compiled.Compile(nullptr));
+    ETW_CHECK(compiled.Empty());
+    ETW_CHECK(FormatAll(f.Enumerator, record, compiled) == FormatAll(f.Enumerator, record, L""));
+}
@@ -0,0 +1,398 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Compares the decode-plan decoder with the reference decoder
+(SetDecodePlansEnabled(false)) item by item, over random payloads for a
+schema with counts, lengths, structs, arrays of structs, and strings, with
+and without truncation.
+*/
+
+#include "EtwTest.h"
+#include <random>
+
+using namespace EtwTest;
+
+namespace
+{
+    struct ItemRecord
+    {
+        EtwEnumeratorState State;
+        std::string Name;
+        unsigned InType;
+        unsigned OutType;
+        unsigned IsArray;
+        unsigned ArrayIndex;
+        unsigned ArrayCount;
+        unsigned ElementSize;
+        unsigned DataSize;
+        ptrdiff_t DataOffset;
+        ptrdiff_t RawOffset;
+
+        bool operator==(ItemRecord const& other) const
+        {
+            return State == other.State
+                && Name == other.Name
+                && InType == other.InType
+                && OutType == other.OutType
+                && IsArray == other.IsArray
+                && ArrayIndex == other.ArrayIndex
+                && ArrayCount == other.ArrayCount
+                && ElementSize == other.ElementSize
+                && DataSize == other.DataSize
+                && DataOffset == other.DataOffset
+                && RawOffset == other.RawOffset;
+        }
+    };
+
+    struct DecodeResult
+    {
+        std::vector<ItemRecord> Items;
+        EtwEnumeratorState FinalState;
+        LSTATUS FinalError;
+
+        bool operator==(DecodeResult const& other) const
+        {
+            return Items == other.Items
+                && FinalState == other.FinalState
+                && FinalError == other.FinalError;
+        }
+    };
+
+    enum class Walk
+    {
+        MoveNext,
+        MoveNextSibling,
+        Mixed,
+    };
+
+    class PlanFixture
+    {
+        TestSchema m_schema;
+        TestCallbacks m_callbacks;
+        std::mt19937 m_rng;
+        std::vector<unsigned> m_values; // Last value of each count/length property.
+
+    public:
+
+        EtwEnumerator Enumerator;
+
+        PlanFixture()
+            : m_schema()
+            , m_callbacks()
+            , m_rng(2)
+            , m_values()
+            , Enumerator(m_callbacks)
+        {
+            m_schema.Add("Hdr", Scalar(TDH_INTYPE_UINT32));                //  0
+            m_schema.Add("Pt", Struct(11, 2));                             //  1 Fixed-size struct.
+            m_schema.Add("N", Scalar(TDH_INTYPE_UINT16));                  //  2
+            m_schema.Add("Recs", CountedStruct(13, 3, 2));                 //  3 Fixed-size structs[N].
+            m_schema.Add("Len", Scalar(TDH_INTYPE_UINT16));                //  4
+            m_schema.Add("Data", Sized(TDH_INTYPE_BINARY, 4));             //  5 Binary[Len].
+            m_schema.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));        //  6
+            m_schema.Add("Ids", CountedArray(TDH_INTYPE_UINT32, 2));       //  7 UINT32[N].
+            m_schema.Add("Fix3", Struct(11, 2, 3));                        //  8 Fixed-size structs[3].
+            m_schema.Add("Var", Struct(18, 2, 2));                         //  9 Variable-size structs[2].
+            m_schema.Add("Tail", Scalar(TDH_INTYPE_GUID));                 // 10
+            m_schema.Add("X", Scalar(TDH_INTYPE_INT32));                   // 11
+            m_schema.Add("Y", Scalar(TDH_INTYPE_INT32));                   // 12
+            m_schema.Add("A", Scalar(TDH_INTYPE_UINT64));                  // 13
+            m_schema.Add("B", Scalar(TDH_INTYPE_GUID));                    // 14
+            m_schema.Add("Sub", Struct(16, 2, 2));                         // 15
+            m_schema.Add("P", Scalar(TDH_INTYPE_UINT8));                   // 16
+            m_schema.Add("Q", Scalar(TDH_INTYPE_INT16, TDH_OUTTYPE_NULL, 2)); // 17
+            m_schema.Add("S", Scalar(TDH_INTYPE_ANSISTRING));              // 18
+            m_schema.Add("C", Scalar(TDH_INTYPE_COUNTEDSTRING));           // 19
+            m_schema.SetTopLevelCount(11);
+            m_callbacks.SetSchema(1, m_schema);
+        }
+
+        TestEvent
+        MakeEvent()
+        {
+            TestEvent event(1);
+            m_values.assign(20, 0);
+            for (USHORT i = 0; i != 11; i += 1)
+            {
+                AddProperty(event, i);
+            }
+
+            return event;
+        }
+
+        unsigned
+        Random(unsigned limit)
+        {
+            return static_cast<unsigned>(m_rng() % limit);
+        }
+
+        DecodeResult
+        Decode(TestEvent& event, bool plans, Walk walk)
+        {
+            DecodeResult result;
+            Enumerator.SetDecodePlansEnabled(plans);
+            EVENT_RECORD const& record = event.Record();
+            auto const pbUserData = static_cast<BYTE const*>(record.UserData);
+            if (!Enumerator.StartEvent(&record))
+            {
+                result.FinalState = Enumerator.State();
+                result.FinalError = Enumerator.LastError();
+                return result;
+            }
+
+            for (unsigned step = 0;; step += 1)
+            {
+                bool const moved =
+                    walk == Walk::MoveNext ? Enumerator.MoveNext()
+                    : walk == Walk::MoveNextSibling ? Enumerator.MoveNextSibling()
+                    : step % 3 == 2 ? Enumerator.MoveNextSibling()
+                    : Enumerator.MoveNext();
+                if (!moved)
+                {
+                    break;
+                }
+
+                auto const info = Enumerator.GetItemInfo();
+                auto const raw = Enumerator.GetRawDataPosition();
+                ItemRecord item;
+                item.State = Enumerator.State();
+                item.Name = ToUtf8(info.Name);
+                item.InType = info.InType;
+                item.OutType = info.OutType;
+                item.IsArray = info.IsArray;
+                item.ArrayIndex = info.ArrayIndex;
+                item.ArrayCount = info.ArrayCount;
+                item.ElementSize = info.ElementSize;
+                item.DataSize = info.DataSize;
+                item.DataOffset = info.Data ? static_cast<BYTE const*>(info.Data) - pbUserData : -1;
+                item.RawOffset = raw.Data ? static_cast<BYTE const*>(raw.Data) - pbUserData : -1;
+                result.Items.push_back(item);
+            }
+
+            result.FinalState = Enumerator.State();
+            result.FinalError = Enumerator.LastError();
+            return result;
+        }
+
+    private:
+
+        void
+        AddProperty(TestEvent& event, USHORT index)
+        {
+            static USHORT const structs[][3] = {
+                // index, first member, member count
+                { 1, 11, 2 }, { 3, 13, 3 }, { 8, 11, 2 }, { 9, 18, 2 }, { 15, 16, 2 } };
+            static USHORT const counts[] = {
+                //  0  1  2  3  4  5  6  7  8  9 10 11 12 13 14 15 16 17 18 19
+                    1, 1, 1, 0, 1, 1, 1, 0, 3, 2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 1 };
+
+            // Counted by N. Write at most 8 elements so that a large N runs
+            // past the end of the payload.
+            unsigned const count =
+                index == 3 || index == 7 ? (m_values[2] < 8 ? m_values[2] : 8)
+                : counts[index];
+
+            for (auto const& s : structs)
+            {
+                if (s[0] == index)
+                {
+                    for (unsigned element = 0; element != count; element += 1)
+                    {
+                        for (USHORT member = 0; member != s[2]; member += 1)
+                        {
+                            AddProperty(event, static_cast<USHORT>(s[1] + member));
+                        }
+                    }
+
+                    return;
+                }
+            }
+
+            for (unsigned element = 0; element != count; element += 1)
+            {
+                switch (index)
+                {
+                case 2: // N
+                case 4: // Len
+                {
+                    // Usually small. Sometimes too large for the payload.
+                    USHORT const value = static_cast<USHORT>(Random(8) == 0 ? 200 + Random(60000) : Random(6));
+                    m_values[index] = value;
+                    event.Add(value);
+                    break;
+                }
+                case 5: // Data[Len]
+                    for (unsigned i = 0; i != m_values[4] && i < 64; i += 1)
+                    {
+                        event.Add(static_cast<BYTE>(Random(256)));
+                    }
+                    break;
+                case 6: // Name
+                case 18: // S
+                {
+                    char sz[8] = {};
+                    unsigned const cch = Random(6);
+                    for (unsigned i = 0; i != cch; i += 1)
+                    {
+                        sz[i] = static_cast<char>('a' + Random(26));
+                    }
+
+                    if (index == 6)
+                    {
+                        event.AddString(sz);
+                    }
+                    else
+                    {
+                        event.AddAnsiString(sz);
+                    }
+                    break;
+                }
+                case 19: // C (byte count + UTF-16 chars)
+                {
+                    USHORT const cb = static_cast<USHORT>(Random(5) * 2 + (Random(8) == 0));
+                    event.Add(cb);
+                    for (unsigned i = 0; i != cb; i += 1)
+                    {
+                        event.Add(static_cast<BYTE>('a' + Random(26)));
+                    }
+                    break;
+                }
+                case 16: // P
+                    event.Add(static_cast<BYTE>(Random(256)));
+                    break;
+                case 17: // Q
+                    event.Add(static_cast<USHORT>(Random(65536)));
+                    break;
+                case 0: // Hdr
+                case 11: // X
+                case 12: // Y
+                case 7: // Ids
+                    event.Add(static_cast<UINT32>(m_rng()));
+                    break;
+                case 13: // A
+                    event.Add(static_cast<UINT64>(m_rng()) << 32 | m_rng());
+                    break;
+                case 10: // Tail
+                case 14: // B
+                    for (unsigned i = 0; i != 4; i += 1)
+                    {
+                        event.Add(static_cast<UINT32>(m_rng()));
+                    }
+                    break;
+                }
+            }
+        }
+    };
+}
+
+ETW_TEST(DecodePlan_MatchesReferenceDecoder)
+{
+    PlanFixture f;
+    unsigned mismatches = 0;
+    unsigned truncated = 0;
+    unsigned errors = 0;
+
+    for (unsigned eventIndex = 0; eventIndex != 3000; eventIndex += 1)
+    {
+        TestEvent event = f.MakeEvent();
+        if (eventIndex % 4 == 3 && event.PayloadSize() != 0)
+        {
+            event.Truncate(f.Random(static_cast<unsigned>(event.PayloadSize())));
+            truncated += 1;
+        }
+
+        for (auto walk : { Walk::MoveNext, Walk::MoveNextSibling, Walk::Mixed })
+        {
+            DecodeResult const reference = f.Decode(event, false, walk);
+            DecodeResult const planned = f.Decode(event, true, walk);
+            if (!(reference == planned))
+            {
+                if (mismatches < 5)
+                {
+                    printf("Mismatch: event %u, walk %u, items %u vs %u\n",
+                        eventIndex, static_cast<unsigned>(walk),
+                        static_cast<unsigned>(reference.Items.size()),
+                        static_cast<unsigned>(planned.Items.size()));
+                }
+
+                mismatches += 1;
+            }
+
+            if (reference.FinalState == EtwEnumeratorState_Error)
+            {
+                errors += 1;
+            }
+        }
+    }
+
+    ETW_CHECK(mismatches == 0);
+    ETW_CHECK(truncated != 0);
+    ETW_CHECK(errors != 0); // Truncated and oversized payloads were covered.
+    ETW_CHECK(errors < 3000 * 3 / 2); // Most events decoded successfully.
+}
+
+ETW_TEST(DecodePlan_IsUsed)
+{
+    PlanFixture f;
+    TestEvent event = f.MakeEvent();
+    unsigned cbStruct = 0;
+
+    // GetFixedStructSize only succeeds when the event is following a plan.
+    f.Enumerator.SetDecodePlansEnabled(true);
+    ETW_CHECK(f.Enumerator.StartEvent(&event.Record()));
+    ETW_CHECK(f.Enumerator.MoveNext()); // Hdr
+    ETW_CHECK(f.Enumerator.MoveNext()); // Pt
+    ETW_CHECK(f.Enumerator.State() == EtwEnumeratorState_StructBegin);
+    ETW_CHECK(f.Enumerator.GetFixedStructSize(&cbStruct));
+    ETW_CHECK(cbStruct == 8);
+
+    f.Enumerator.SetDecodePlansEnabled(false);
+    ETW_CHECK(f.Enumerator.StartEvent(&event.Record()));
+    ETW_CHECK(f.Enumerator.MoveNext());
+    ETW_CHECK(f.Enumerator.MoveNext());
+    ETW_CHECK(!f.Enumerator.GetFixedStructSize(&cbStruct));
+}
+
+ETW_TEST(DecodePlan_GetFieldByIndexMatchesReferenceDecoder)
+{
+    PlanFixture f;
+    unsigned mismatches = 0;
+
+    for (unsigned eventIndex = 0; eventIndex != 500; eventIndex += 1)
+    {
+        TestEvent event = f.MakeEvent();
+        if (eventIndex % 4 == 3 && event.PayloadSize() != 0)
+        {
+            event.Truncate(f.Random(static_cast<unsigned>(event.PayloadSize())));
+        }
+
+        for (unsigned propertyIndex = 0; propertyIndex != 11; propertyIndex += 1)
+        {
+            EtwItemInfo infos[2] = {};
+            bool found[2] = {};
+            LSTATUS lastErrors[2] = {};
+            for (unsigned plans = 0; plans != 2; plans += 1)
+            {
+                f.Enumerator.SetDecodePlansEnabled(plans != 0);
+                if (f.Enumerator.StartEvent(&event.Record()))
+                {
+                    found[plans] = f.Enumerator.GetFieldByIndex(propertyIndex, &infos[plans]);
+                    lastErrors[plans] = f.Enumerator.LastError();
+                }
+            }
+
+            if (found[0] != found[1] ||
+                lastErrors[0] != lastErrors[1] ||
+                (found[0] && (
+                    infos[0].Data != infos[1].Data ||
+                    infos[0].DataSize != infos[1].DataSize ||
+                    infos[0].ArrayCount != infos[1].ArrayCount)))
+            {
+                mismatches += 1;
+            }
+        }
+    }
+
+    ETW_CHECK(mismatches == 0);
+}
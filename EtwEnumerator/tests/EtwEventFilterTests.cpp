@@ -0,0 +1,789 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for EtwEventFilter, MatchesHeader, and EvaluateFilter. Random
+expressions (&&, ||, !, parentheses, every operator, header and payload
+fields, integer, hex, GUID, and quoted values) are evaluated against random
+events from two schemas that use the same names with different types. The
+reference is a separate evaluator that runs after the event has been
+decoded with a plain MoveNext walk (decode plans disabled), reading
+integers from the decoded items and strings from FormatCurrentValue. The
+events include truncation, 32-bit pointers, NaN, duplicate names, arrays,
+structs, and names that are missing from one of the schemas. Each filter
+is reused for all of the events, so names are resolved once per schema.
+*/
+
+#include "EtwTest.h"
+#include <deque>
+#include <limits>
+#include <random>
+
+using namespace EtwTest;
+
+namespace
+{
+    GUID const Provider1 = { 0x12345678, 0x1234, 0x5678, { 1, 2, 3, 4, 5, 6, 7, 8 } };
+    GUID const Provider2 = { 0xabcdef01, 0x2345, 0x6789, { 0xab, 0xcd, 0xef, 0, 1, 2, 3, 4 } };
+
+    enum class Op
+    {
+        Equal,
+        NotEqual,
+        Less,
+        LessEqual,
+        Greater,
+        GreaterEqual,
+        AnyBits,
+        Contains,
+    };
+
+    char const* const OpText[] = { "==", "!=", "<", "<=", ">", ">=", "&", "contains" };
+
+    struct Literal
+    {
+        std::string Text;
+        bool IsInteger;
+        bool IsNegative;
+        UINT64 Magnitude;
+        bool IsGuid;
+        GUID Guid;
+    };
+
+    struct Expr
+    {
+        enum Kind { And, Or, Not, Comparison };
+        Kind ExprKind;
+        std::vector<Expr> Children;
+        std::string Field;
+        Op Operator;
+        Literal Value;
+    };
+
+    // A top-level item from the reference walk.
+    struct TopItem
+    {
+        std::string Name;
+        EtwEnumeratorState State;
+        USHORT InType;
+        std::vector<BYTE> Bytes; // Value: the item's data.
+        std::string Text;        // Value: FormatCurrentValue.
+    };
+
+    // What the reference evaluator knows about an event.
+    struct EventFacts
+    {
+        EVENT_HEADER Header;
+        std::string ProviderName;
+        std::vector<TopItem> Items;
+        unsigned ItemCount;       // Items in the reference walk (all levels).
+        EtwEnumeratorState EndState;
+    };
+
+    std::vector<EtwWCHAR>
+    Widen(std::string const& text)
+    {
+        std::vector<EtwWCHAR> wide(text.begin(), text.end());
+        wide.push_back(0);
+        return wide;
+    }
+
+    std::string
+    GuidText(GUID const& g, bool braces, bool upper)
+    {
+        char text[40];
+        snprintf(text, sizeof(text),
+            upper
+            ? "%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X"
+            : "%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+            static_cast<unsigned>(g.Data1), g.Data2, g.Data3,
+            g.Data4[0], g.Data4[1], g.Data4[2], g.Data4[3],
+            g.Data4[4], g.Data4[5], g.Data4[6], g.Data4[7]);
+        return braces ? "{" + std::string(text) + "}" : std::string(text);
+    }
+
+    char
+    Fold(char ch)
+    {
+        return ch >= 'A' && ch <= 'Z' ? static_cast<char>(ch + ('a' - 'A')) : ch;
+    }
+
+    bool
+    TextEqual(std::string const& a, std::string const& b)
+    {
+        bool equal = a.size() == b.size();
+        for (size_t i = 0; equal && i != a.size(); i += 1)
+        {
+            equal = Fold(a[i]) == Fold(b[i]);
+        }
+
+        return equal;
+    }
+
+    // Compares value with literal as mathematical integers.
+    int
+    IntegerOrder(bool isNegative, UINT64 magnitude, Literal const& literal)
+    {
+        if (isNegative != literal.IsNegative)
+        {
+            return isNegative ? -1 : 1;
+        }
+
+        int const order = magnitude < literal.Magnitude ? -1 : magnitude > literal.Magnitude ? 1 : 0;
+        return isNegative ? -order : order;
+    }
+
+    bool
+    OrderMatches(Op op, int order)
+    {
+        switch (op)
+        {
+        case Op::Equal: return order == 0;
+        case Op::NotEqual: return order != 0;
+        case Op::Less: return order < 0;
+        case Op::LessEqual: return order <= 0;
+        case Op::Greater: return order > 0;
+        case Op::GreaterEqual: return order >= 0;
+        default: return false;
+        }
+    }
+
+    bool
+    CompareInteger(Op op, bool isNegative, UINT64 magnitude, UINT64 bits, Literal const& literal)
+    {
+        if (!literal.IsInteger)
+        {
+            return false;
+        }
+        else if (op == Op::AnyBits)
+        {
+            UINT64 const mask = literal.IsNegative ? ~literal.Magnitude + 1 : literal.Magnitude;
+            return (bits & mask) != 0;
+        }
+        else
+        {
+            return OrderMatches(op, IntegerOrder(isNegative, magnitude, literal));
+        }
+    }
+
+    bool
+    CompareString(Op op, std::string const& text, Literal const& literal)
+    {
+        switch (op)
+        {
+        case Op::Equal:
+            return TextEqual(text, literal.Text);
+        case Op::NotEqual:
+            return !TextEqual(text, literal.Text);
+        case Op::Contains:
+            for (size_t start = 0; start + literal.Text.size() <= text.size(); start += 1)
+            {
+                if (TextEqual(text.substr(start, literal.Text.size()), literal.Text))
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        default:
+            return false;
+        }
+    }
+
+    bool
+    CompareGuid(Op op, GUID const& value, Literal const& literal)
+    {
+        bool const equal = literal.IsGuid && 0 == memcmp(&value, &literal.Guid, sizeof(GUID));
+        return literal.IsGuid && (
+            (op == Op::Equal && equal) ||
+            (op == Op::NotEqual && !equal));
+    }
+
+    bool
+    ComparePayload(Expr const& expr, TopItem const& item)
+    {
+        if (item.State != EtwEnumeratorState_Value)
+        {
+            return false; // Array or struct.
+        }
+
+        auto const& bytes = item.Bytes;
+        bool isSigned = false;
+        switch (item.InType)
+        {
+        case TDH_INTYPE_UNICODESTRING:
+        case TDH_INTYPE_ANSISTRING:
+            return CompareString(expr.Operator, item.Text, expr.Value);
+
+        case TDH_INTYPE_GUID:
+        {
+            GUID value;
+            memcpy(&value, bytes.data(), sizeof(value));
+            return CompareGuid(expr.Operator, value, expr.Value);
+        }
+
+        case TDH_INTYPE_FLOAT:
+        case TDH_INTYPE_DOUBLE:
+        {
+            double value;
+            if (bytes.size() == sizeof(float))
+            {
+                float f;
+                memcpy(&f, bytes.data(), sizeof(f));
+                value = f;
+            }
+            else
+            {
+                memcpy(&value, bytes.data(), sizeof(value));
+            }
+
+            if (!expr.Value.IsInteger || expr.Operator == Op::AnyBits || expr.Operator == Op::Contains)
+            {
+                return false;
+            }
+            else if (value != value)
+            {
+                return expr.Operator == Op::NotEqual; // NaN.
+            }
+
+            double const literal = expr.Value.IsNegative
+                ? -static_cast<double>(expr.Value.Magnitude)
+                : static_cast<double>(expr.Value.Magnitude);
+            return OrderMatches(expr.Operator, value < literal ? -1 : value > literal ? 1 : 0);
+        }
+
+        case TDH_INTYPE_INT8:
+        case TDH_INTYPE_INT16:
+        case TDH_INTYPE_INT32:
+        case TDH_INTYPE_INT64:
+            isSigned = true;
+            break;
+
+        default:
+            break;
+        }
+
+        UINT64 bits = 0;
+        memcpy(&bits, bytes.data(), bytes.size()); // Little-endian.
+        if (isSigned && bytes.size() < 8 && (bits >> (bytes.size() * 8 - 1)) != 0)
+        {
+            bits |= ~0ull << (bytes.size() * 8); // Sign-extend.
+        }
+
+        bool const isNegative = isSigned && static_cast<INT64>(bits) < 0;
+        return CompareInteger(expr.Operator, isNegative, isNegative ? ~bits + 1 : bits, bits, expr.Value);
+    }
+
+    bool
+    Evaluate(Expr const& expr, EventFacts const& facts)
+    {
+        switch (expr.ExprKind)
+        {
+        case Expr::And:
+            for (auto const& child : expr.Children)
+            {
+                if (!Evaluate(child, facts))
+                {
+                    return false;
+                }
+            }
+
+            return true;
+
+        case Expr::Or:
+            for (auto const& child : expr.Children)
+            {
+                if (Evaluate(child, facts))
+                {
+                    return true;
+                }
+            }
+
+            return false;
+
+        case Expr::Not:
+            return !Evaluate(expr.Children[0], facts);
+
+        default:
+            break;
+        }
+
+        auto const& header = facts.Header;
+        auto const op = expr.Operator;
+        UINT64 headerValue;
+        if (expr.Field == "provider")
+        {
+            return expr.Value.IsGuid
+                ? CompareGuid(op, header.ProviderId, expr.Value)
+                : CompareString(op, facts.ProviderName, expr.Value);
+        }
+        else if (expr.Field == "id")
+        {
+            headerValue = header.EventDescriptor.Id;
+        }
+        else if (expr.Field == "level")
+        {
+            headerValue = header.EventDescriptor.Level;
+        }
+        else if (expr.Field == "keywords")
+        {
+            headerValue = header.EventDescriptor.Keyword;
+        }
+        else if (expr.Field == "pid")
+        {
+            headerValue = header.ProcessId;
+        }
+        else if (expr.Field == "tid")
+        {
+            headerValue = header.ThreadId;
+        }
+        else
+        {
+            // First top-level property with the name.
+            for (auto const& item : facts.Items)
+            {
+                if (item.Name == expr.Field)
+                {
+                    return ComparePayload(expr, item);
+                }
+            }
+
+            return false; // Missing, or not decoded.
+        }
+
+        return CompareInteger(op, false, headerValue, headerValue, expr.Value);
+    }
+
+    bool
+    UsesPayload(Expr const& expr)
+    {
+        if (expr.ExprKind == Expr::Comparison)
+        {
+            return expr.Field != "id" && expr.Field != "level" && expr.Field != "keywords" &&
+                expr.Field != "pid" && expr.Field != "tid" &&
+                !(expr.Field == "provider" && expr.Value.IsGuid);
+        }
+
+        for (auto const& child : expr.Children)
+        {
+            if (UsesPayload(child))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    class FilterFixture
+    {
+        TestSchema m_schema1;
+        TestSchema m_schema2;
+        TestCallbacks m_callbacks;
+        std::mt19937 m_rng;
+
+    public:
+
+        EtwEnumerator Enumerator;
+
+        FilterFixture()
+            : m_schema1("TestProvider")
+            , m_schema2("Other Provider")
+            , m_callbacks()
+            , m_rng(25)
+            , Enumerator(m_callbacks)
+        {
+            m_schema1.Add("Status", Scalar(TDH_INTYPE_INT32));                      //  0
+            m_schema1.Add("Code", Scalar(TDH_INTYPE_UINT16));                       //  1
+            m_schema1.Add("Flags", Scalar(TDH_INTYPE_HEXINT32));                    //  2
+            m_schema1.Add("Big", Scalar(TDH_INTYPE_UINT64));                        //  3
+            m_schema1.Add("Small", Scalar(TDH_INTYPE_INT8));                        //  4
+            m_schema1.Add("Ok", Scalar(TDH_INTYPE_BOOLEAN));                        //  5
+            m_schema1.Add("Ratio", Scalar(TDH_INTYPE_DOUBLE));                      //  6
+            m_schema1.Add("F", Scalar(TDH_INTYPE_FLOAT));                           //  7
+            m_schema1.Add("Ptr", Scalar(TDH_INTYPE_POINTER));                       //  8
+            m_schema1.Add("G", Scalar(TDH_INTYPE_GUID));                            //  9
+            m_schema1.Add("FileName", Scalar(TDH_INTYPE_UNICODESTRING));            // 10
+            m_schema1.Add("Tag", Scalar(TDH_INTYPE_ANSISTRING));                    // 11
+            m_schema1.Add("Arr", Scalar(TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 2));   // 12
+            m_schema1.Add("Rec", Struct(15, 1));                                    // 13
+            m_schema1.Add("Status", Scalar(TDH_INTYPE_UINT8));                      // 14 Duplicate name.
+            m_schema1.Add("M", Scalar(TDH_INTYPE_UINT32));                          // 15 Rec
+            m_schema1.SetTopLevelCount(15);
+            m_callbacks.SetSchema(1, m_schema1);
+
+            m_schema2.Add("FileName", Scalar(TDH_INTYPE_ANSISTRING));               //  0
+            m_schema2.Add("Status", Scalar(TDH_INTYPE_UINT64));                     //  1
+            m_schema2.Add("Code", Scalar(TDH_INTYPE_UNICODESTRING));                //  2
+            m_schema2.Add("Ratio", Scalar(TDH_INTYPE_INT16));                       //  3
+            m_schema2.Add("G", Scalar(TDH_INTYPE_UINT32));                          //  4
+            m_callbacks.SetSchema(2, m_schema2);
+        }
+
+        unsigned
+        Random(unsigned limit)
+        {
+            return static_cast<unsigned>(m_rng() % limit);
+        }
+
+        // Builds a random event (not yet recorded).
+        void
+        MakeEvent(TestEvent& event, USHORT id, unsigned cbPointer)
+        {
+            static char const* const Strings[] = {
+                "C:\\Temp\\a.txt", "c:\\temp\\B.TXT", "x", "", "ab cd", "TEMP" };
+            static INT32 const Integers[] = { -3, -1, 0, 1, 2, 5, 8, 0x7fffffff };
+
+            if (id == 1)
+            {
+                event.Add(static_cast<INT32>(Random(3) ? Integers[Random(8)] : static_cast<INT32>(m_rng())));
+                event.Add(static_cast<UINT16>(Random(6)));
+                event.Add(static_cast<UINT32>(1u << Random(32) | Random(4)));
+                event.Add(static_cast<UINT64>(Random(3) ? ~0ull - Random(2) : Random(9)));
+                event.Add(static_cast<INT8>(Random(2) ? -128 + static_cast<int>(Random(3)) : static_cast<int>(Random(9)) - 3));
+                event.Add(static_cast<UINT32>(Random(3)));
+                event.Add(Random(5) == 0
+                    ? std::numeric_limits<double>::quiet_NaN()
+                    : static_cast<double>(Integers[Random(8)]) + (Random(2) ? 0.5 : 0.0));
+                event.Add(Random(5) == 0
+                    ? std::numeric_limits<float>::quiet_NaN()
+                    : static_cast<float>(static_cast<int>(Random(9)) - 3));
+                if (cbPointer == 4)
+                {
+                    event.Add(static_cast<UINT32>(Random(2) ? 0xfffffff0u : Random(9)));
+                }
+                else
+                {
+                    event.Add(static_cast<UINT64>(Random(2) ? 0xfffffffffffffff0ull : Random(9)));
+                }
+
+                event.Add(Random(2) ? Provider1 : Provider2);
+                event.AddString(Strings[Random(6)]);
+                event.AddAnsiString(Strings[Random(6)]);
+                event.Add(static_cast<UINT32>(Random(4))).Add(static_cast<UINT32>(Random(4)));
+                event.Add(static_cast<UINT32>(Random(4)));
+                event.Add(static_cast<UINT8>(Random(4)));
+            }
+            else
+            {
+                event.AddAnsiString(Strings[Random(6)]);
+                event.Add(static_cast<UINT64>(Random(2) ? ~0ull : Random(9)));
+                event.AddString(Random(2) ? "3" : Strings[Random(6)]);
+                event.Add(static_cast<INT16>(static_cast<int>(Random(9)) - 3));
+                event.Add(static_cast<UINT32>(Random(3)));
+            }
+        }
+
+        // Sets the header fields that the filter can test.
+        void
+        SetHeader(EVENT_RECORD& record)
+        {
+            static UINT64 const Keywords[] = { 0, 1, 0x10, 0x8000000000000001 };
+            record.EventHeader.ProviderId = Random(2) ? Provider1 : Provider2;
+            record.EventHeader.EventDescriptor.Level = static_cast<UCHAR>(Random(6));
+            record.EventHeader.EventDescriptor.Keyword = Keywords[Random(4)];
+            record.EventHeader.ProcessId = Random(2) ? 1234 : 4;
+            record.EventHeader.ThreadId = Random(2) ? 5678 : 0;
+        }
+
+        // Decodes the event with a plain MoveNext walk.
+        EventFacts
+        Decode(EVENT_RECORD const& record)
+        {
+            EventFacts facts = {};
+            facts.Header = record.EventHeader;
+            Enumerator.SetDecodePlansEnabled(false);
+            ETW_CHECK(Enumerator.StartEvent(&record));
+            facts.ProviderName = ToUtf8(Enumerator.GetEventInfo().ProviderName);
+
+            int depth = 0;
+            while (Enumerator.MoveNext())
+            {
+                auto const state = Enumerator.State();
+                auto const info = Enumerator.GetItemInfo();
+                facts.ItemCount += 1;
+                if (state == EtwEnumeratorState_ArrayEnd || state == EtwEnumeratorState_StructEnd)
+                {
+                    depth -= 1;
+                    continue;
+                }
+
+                if (depth == 0)
+                {
+                    TopItem item = { ToUtf8(info.Name), state, info.InType, {}, {} };
+                    if (state == EtwEnumeratorState_Value)
+                    {
+                        auto const pb = static_cast<BYTE const*>(info.Data);
+                        item.Bytes.assign(pb, pb + info.DataSize);
+                        EtwStringView value;
+                        ETW_CHECK(Enumerator.FormatCurrentValue(&value));
+                        item.Text = ToUtf8(value.Data, value.DataLength);
+                    }
+
+                    facts.Items.push_back(item);
+                }
+
+                depth += state == EtwEnumeratorState_ArrayBegin || state == EtwEnumeratorState_StructBegin;
+            }
+
+            facts.EndState = Enumerator.State();
+            return facts;
+        }
+
+        Literal
+        MakeLiteral()
+        {
+            static char const* const Strings[] = {
+                "\\Temp\\", "temp", "a.TXT", "x", "", "ab cd", "1.5", "TestProvider",
+                "testprov", "Other Provider", "provider", "c:\\temp\\b.txt" };
+            Literal literal = {};
+            switch (Random(4))
+            {
+            case 0:
+            case 1:
+            {
+                // Integer: small, extreme, decimal or hex.
+                static UINT64 const Magnitudes[] = {
+                    0, 1, 2, 3, 4, 5, 8, 0x10, 0x80, 128, 1234, 5678,
+                    0x7fffffff, 0x8000000000000000, 0xfffffffffffffff0, ~0ull };
+                literal.IsInteger = true;
+                literal.Magnitude = Random(2) ? Random(9) : Magnitudes[Random(16)];
+                literal.IsNegative = literal.Magnitude != 0 && Random(3) == 0;
+                char text[40];
+                snprintf(text, sizeof(text), Random(3) == 0 ? "%s0x%llx" : "%s%llu",
+                    literal.IsNegative ? "-" : "", static_cast<unsigned long long>(literal.Magnitude));
+                literal.Text = text;
+                break;
+            }
+            case 2:
+                literal.Text = Strings[Random(12)];
+                break;
+            default:
+                literal.IsGuid = true;
+                literal.Guid = Random(2) ? Provider1 : Provider2;
+                literal.Guid.Data3 += Random(4) == 0; // No match.
+                literal.Text = GuidText(literal.Guid, Random(2) == 0, Random(2) == 0);
+                break;
+            }
+
+            return literal;
+        }
+
+        Expr
+        MakeExpr(unsigned depth)
+        {
+            static char const* const Fields[] = {
+                "provider", "id", "level", "keywords", "pid", "tid",
+                "Status", "Code", "Flags", "Big", "Small", "Ok", "Ratio", "F", "Ptr", "G",
+                "FileName", "Tag", "Arr", "Rec", "M", "Missing" };
+            Expr expr = {};
+            unsigned const choice = depth < 3 ? Random(6) : 5;
+            if (choice < 2)
+            {
+                expr.ExprKind = choice == 0 ? Expr::And : Expr::Or;
+                unsigned const count = 2 + Random(2);
+                for (unsigned i = 0; i != count; i += 1)
+                {
+                    expr.Children.push_back(MakeExpr(depth + 1));
+                }
+            }
+            else if (choice == 2)
+            {
+                expr.ExprKind = Expr::Not;
+                expr.Children.push_back(MakeExpr(depth + 1));
+            }
+            else
+            {
+                expr.ExprKind = Expr::Comparison;
+                expr.Field = Fields[Random(22)];
+                expr.Operator = static_cast<Op>(Random(8));
+                expr.Value = MakeLiteral();
+            }
+
+            return expr;
+        }
+
+        // Formats the expression with random spacing and redundant parentheses.
+        std::string
+        Format(Expr const& expr, bool inAnd)
+        {
+            std::string text;
+            std::string const space = Random(2) ? " " : "";
+            switch (expr.ExprKind)
+            {
+            case Expr::And:
+            case Expr::Or:
+            {
+                bool const parens = (expr.ExprKind == Expr::Or && inAnd) || Random(4) == 0;
+                for (auto const& child : expr.Children)
+                {
+                    if (!text.empty())
+                    {
+                        text += space + (expr.ExprKind == Expr::And ? "&&" : "||") + space;
+                    }
+
+                    text += Format(child, expr.ExprKind == Expr::And);
+                }
+
+                return parens ? "(" + space + text + space + ")" : text;
+            }
+
+            case Expr::Not:
+            {
+                auto const& child = expr.Children[0];
+                bool const parens = child.ExprKind != Expr::Comparison && child.ExprKind != Expr::Not;
+                text = Format(child, true);
+                return "!" + space + (parens ? "(" + text + ")" : text);
+            }
+
+            default:
+            {
+                auto const& value = expr.Value.Text;
+                bool const quote = value.empty() || value.find(' ') != std::string::npos || Random(4) == 0;
+                std::string const opSpace = expr.Operator == Op::Contains ? " " : space;
+                return expr.Field + opSpace + OpText[static_cast<int>(expr.Operator)] +
+                    (quote ? space + "\"" + value + "\"" : opSpace + value);
+            }
+            }
+        }
+    };
+}
+
+ETW_TEST(EventFilter_MatchesPostDecodeEvaluator)
+{
+    FilterFixture f;
+    std::deque<TestEvent> events;
+    std::vector<EventFacts> facts;
+    unsigned errors = 0;
+
+    for (unsigned eventIndex = 0; eventIndex != 60; eventIndex += 1)
+    {
+        USHORT const id = static_cast<USHORT>(1 + f.Random(2));
+        unsigned const cbPointer = eventIndex % 2 ? 4 : 8;
+        events.emplace_back(id);
+        auto& event = events.back();
+        f.MakeEvent(event, id, cbPointer);
+        if (eventIndex % 4 == 3 && event.PayloadSize() != 0)
+        {
+            event.Truncate(f.Random(static_cast<unsigned>(event.PayloadSize())));
+        }
+
+        EVENT_RECORD& record = event.Record();
+        if (cbPointer == 4)
+        {
+            record.EventHeader.Flags = EVENT_HEADER_FLAG_32_BIT_HEADER;
+        }
+
+        f.SetHeader(record);
+        facts.push_back(f.Decode(record));
+        errors += facts.back().EndState == EtwEnumeratorState_Error;
+    }
+
+    unsigned mismatches = 0;
+    unsigned matched = 0;
+    unsigned headerDecided = 0;
+    unsigned payloadDecided = 0;
+    EtwEventFilter filter;
+
+    for (unsigned exprIndex = 0; exprIndex != 400; exprIndex += 1)
+    {
+        Expr const expr = f.MakeExpr(0);
+        std::string const text = f.Format(expr, false);
+        ETW_CHECK(ERROR_SUCCESS == filter.SetExpression(Widen(text).data()));
+        ETW_CHECK(!filter.IsEmpty());
+        bool const usesPayload = UsesPayload(expr);
+
+        for (unsigned eventIndex = 0; eventIndex != events.size(); eventIndex += 1)
+        {
+            EVENT_RECORD const& record = events[eventIndex].Record();
+            auto const& eventFacts = facts[eventIndex];
+            bool const expected = Evaluate(expr, eventFacts);
+            matched += expected;
+
+            // MatchesHeader decides every expression without payload fields.
+            bool match = !expected;
+            bool const decided = filter.MatchesHeader(&record, &match);
+            bool ok = decided || usesPayload;
+            ok = ok && (decided ? match == expected : !match);
+            headerDecided += decided;
+
+            f.Enumerator.SetDecodePlansEnabled((exprIndex + eventIndex) % 3 != 0);
+            ETW_CHECK(f.Enumerator.StartEvent(&record));
+            match = !expected;
+            ok = ok && f.Enumerator.EvaluateFilter(filter, &match) && match == expected;
+            payloadDecided += !decided;
+
+            // The enumerator is reset, so the event can be enumerated as usual.
+            ok = ok && f.Enumerator.State() == EtwEnumeratorState_BeforeFirstItem;
+            unsigned itemCount = 0;
+            while (f.Enumerator.MoveNext())
+            {
+                itemCount += 1;
+            }
+
+            ok = ok && itemCount == eventFacts.ItemCount && f.Enumerator.State() == eventFacts.EndState;
+            if (!ok)
+            {
+                if (mismatches < 5)
+                {
+                    printf("Mismatch: event %u (id %u): expected %d: %s\n",
+                        eventIndex, record.EventHeader.EventDescriptor.Id, expected, text.c_str());
+                }
+
+                mismatches += 1;
+            }
+        }
+    }
+
+    ETW_CHECK(mismatches == 0);
+    ETW_CHECK(matched > 2000);
+    ETW_CHECK(matched < 400 * 60 - 2000);
+    ETW_CHECK(headerDecided > 1000);
+    ETW_CHECK(payloadDecided > 1000);
+    ETW_CHECK(errors != 0);
+}
+
+ETW_TEST(EventFilter_Expressions)
+{
+    FilterFixture f;
+    TestEvent event(1);
+    f.MakeEvent(event, 1, 8);
+    EVENT_RECORD& record = event.Record();
+    record.EventHeader.EventDescriptor.Level = 3;
+
+    EtwEventFilter filter;
+    bool match = false;
+
+    // Empty matches everything.
+    ETW_CHECK(ERROR_SUCCESS == filter.SetExpression(Widen("  ").data()));
+    ETW_CHECK(filter.IsEmpty());
+    ETW_CHECK(filter.MatchesHeader(&record, &match) && match);
+    ETW_CHECK(f.Enumerator.StartEvent(&record));
+    match = false;
+    ETW_CHECK(f.Enumerator.EvaluateFilter(filter, &match) && match);
+
+    char const* const Invalid[] = {
+        "Status", "Status ==", "== 1", "(Status == 1", "Status == 1)", "Status ~ 1",
+        "Tag == \"x", "!", "Status == 1 &&", "|| Status == 1", "Status == 1 Code == 2",
+        "Tag containsx", "()" };
+    for (auto szInvalid : Invalid)
+    {
+        ETW_CHECK(ERROR_SUCCESS == filter.SetExpression(Widen("level == 3").data()));
+        ETW_CHECK(ERROR_INVALID_PARAMETER == filter.SetExpression(Widen(szInvalid).data()));
+        ETW_CHECK(filter.IsEmpty());
+    }
+
+    // Header-only expressions are decided without the payload.
+    ETW_CHECK(ERROR_SUCCESS == filter.SetExpression(Widen("level <= 3 && !(pid == 4)").data()));
+    ETW_CHECK(filter.MatchesHeader(&record, &match) && match);
+    ETW_CHECK(ERROR_SUCCESS == filter.SetExpression(Widen("level > 3 && Status == 1").data()));
+    ETW_CHECK(filter.MatchesHeader(&record, &match) && !match);
+    ETW_CHECK(ERROR_SUCCESS == filter.SetExpression(Widen("level == 3 && Status == 1").data()));
+    ETW_CHECK(!filter.MatchesHeader(&record, &match) && !match);
+    ETW_CHECK(ERROR_SUCCESS == filter.SetExpression(Widen("provider contains \"test\"").data()));
+    ETW_CHECK(!filter.MatchesHeader(&record, &match) && !match);
+    ETW_CHECK(f.Enumerator.StartEvent(&record));
+    ETW_CHECK(f.Enumerator.EvaluateFilter(filter, &match) && match);
+    ETW_CHECK(ERROR_SUCCESS == filter.SetExpression(Widen("provider == {12345678-1234-5678-0102-030405060708}").data()));
+    ETW_CHECK(filter.MatchesHeader(&record, &match) && match);
+}
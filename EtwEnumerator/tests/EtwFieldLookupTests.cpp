@@ -0,0 +1,426 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for GetFieldByIndex and GetFieldByName. Each lookup is compared with a
+linear search (a MoveNextSibling walk over the top-level properties, with
+decode plans disabled): the same item, the same items when enumeration
+continues with MoveNext, and the same error for truncated or oversized
+payloads. The property names are chosen so that many of them share one
+bucket of the name index, and one name is used twice.
+*/
+
+#include "EtwTest.h"
+#include <random>
+
+using namespace EtwTest;
+
+namespace
+{
+    struct ItemRecord
+    {
+        EtwEnumeratorState State;
+        std::string Name;
+        unsigned ArrayIndex;
+        unsigned ArrayCount;
+        unsigned DataSize;
+        ptrdiff_t DataOffset;
+
+        bool operator==(ItemRecord const& other) const
+        {
+            return State == other.State
+                && Name == other.Name
+                && ArrayIndex == other.ArrayIndex
+                && ArrayCount == other.ArrayCount
+                && DataSize == other.DataSize
+                && DataOffset == other.DataOffset;
+        }
+    };
+
+    // The found item and the items that follow it, or the error.
+    struct LookupResult
+    {
+        bool Found;
+        std::vector<ItemRecord> Items;
+        EtwEnumeratorState FinalState;
+        LSTATUS FinalError;
+
+        bool operator==(LookupResult const& other) const
+        {
+            return Found == other.Found
+                && Items == other.Items
+                && FinalState == other.FinalState
+                && FinalError == other.FinalError;
+        }
+    };
+
+    // Same hash as the name index (FNV-1a over UTF-16 code units).
+    unsigned
+    NameHash(std::string const& name)
+    {
+        unsigned hash = 2166136261u;
+        for (char ch : name)
+        {
+            hash = (hash ^ static_cast<BYTE>(ch)) * 16777619u;
+        }
+
+        return hash;
+    }
+
+    std::vector<EtwWCHAR>
+    WideName(std::string const& name)
+    {
+        std::vector<EtwWCHAR> wide(name.begin(), name.end());
+        wide.push_back(0);
+        return wide;
+    }
+
+    unsigned const TopLevelCount = 12;
+
+    class LookupFixture
+    {
+        TestSchema m_schema;
+        TestCallbacks m_callbacks;
+        std::mt19937 m_rng;
+
+    public:
+
+        EtwEnumerator Enumerator;
+        std::vector<std::string> Names;        // Top-level names. Names[9] == Names[4].
+        std::vector<std::string> MissingNames; // Not in the event.
+        unsigned CollisionCount;               // Names in the largest bucket.
+
+        LookupFixture()
+            : m_schema()
+            , m_callbacks()
+            , m_rng(4)
+            , Enumerator(m_callbacks)
+            , Names()
+            , MissingNames()
+            , CollisionCount(0)
+        {
+            // Put 6 of the 11 distinct names, and 3 missing names, in the
+            // bucket of "Field0". Put the other names in other buckets.
+            unsigned const bucket = NameHash("Field0") % TopLevelCount;
+            std::vector<std::string> colliding;
+            std::vector<std::string> other;
+            for (unsigned i = 0; colliding.size() != 9 || other.size() != 5; i += 1)
+            {
+                std::string name = "Field" + std::to_string(i);
+                auto& list = NameHash(name) % TopLevelCount == bucket ? colliding : other;
+                if (list.size() != (&list == &colliding ? 9u : 5u))
+                {
+                    list.push_back(name);
+                }
+            }
+
+            static unsigned char const order[] = { 0, 1, 0, 0, 1, 0, 1, 0, 1, 9, 0, 1 };
+            unsigned nextColliding = 0;
+            unsigned nextOther = 0;
+            for (unsigned i = 0; i != TopLevelCount; i += 1)
+            {
+                Names.push_back(
+                    order[i] == 9 ? Names[4]
+                    : order[i] == 0 ? colliding[nextColliding++]
+                    : other[nextOther++]);
+            }
+
+            MissingNames.assign(colliding.begin() + nextColliding, colliding.end());
+            MissingNames.push_back("");
+            MissingNames.push_back(Names[0] + "x");
+            MissingNames.push_back("X"); // Struct member, not top-level.
+
+            for (unsigned i = 0; i != TopLevelCount; i += 1)
+            {
+                unsigned count = 0;
+                for (auto const& name : Names)
+                {
+                    count += NameHash(name) % TopLevelCount == NameHash(Names[i]) % TopLevelCount;
+                }
+
+                CollisionCount = count > CollisionCount ? count : CollisionCount;
+            }
+
+            m_schema.Add(Names[0].c_str(), Scalar(TDH_INTYPE_UINT32));             //  0
+            m_schema.Add(Names[1].c_str(), Struct(12, 2));                         //  1 Fixed-size struct.
+            m_schema.Add(Names[2].c_str(), Scalar(TDH_INTYPE_UINT16));             //  2 Count, length.
+            m_schema.Add(Names[3].c_str(), CountedArray(TDH_INTYPE_UINT32, 2));    //  3 UINT32[2].
+            m_schema.Add(Names[4].c_str(), Scalar(TDH_INTYPE_UINT64));             //  4
+            m_schema.Add(Names[5].c_str(), Scalar(TDH_INTYPE_UNICODESTRING));      //  5
+            m_schema.Add(Names[6].c_str(), Scalar(TDH_INTYPE_UINT8));              //  6
+            m_schema.Add(Names[7].c_str(), Struct(14, 2, 2));                      //  7 Variable-size structs[2].
+            m_schema.Add(Names[8].c_str(), Scalar(TDH_INTYPE_GUID));               //  8
+            m_schema.Add(Names[9].c_str(), Scalar(TDH_INTYPE_UINT16));             //  9 Same name as 4.
+            m_schema.Add(Names[10].c_str(), Sized(TDH_INTYPE_BINARY, 2));          // 10 Binary[2].
+            m_schema.Add(Names[11].c_str(), Scalar(TDH_INTYPE_INT32));             // 11
+            m_schema.Add("X", Scalar(TDH_INTYPE_INT32));                           // 12
+            m_schema.Add("Y", Scalar(TDH_INTYPE_INT16));                           // 13
+            m_schema.Add("S", Scalar(TDH_INTYPE_ANSISTRING));                      // 14
+            m_schema.Add("V", Scalar(TDH_INTYPE_UINT32));                          // 15
+            m_schema.SetTopLevelCount(TopLevelCount);
+            m_callbacks.SetSchema(1, m_schema);
+        }
+
+        unsigned
+        Random(unsigned limit)
+        {
+            return static_cast<unsigned>(m_rng() % limit);
+        }
+
+        TestEvent
+        MakeEvent()
+        {
+            TestEvent event(1);
+            USHORT const n = static_cast<USHORT>(Random(8) == 0 ? 1000 : Random(5));
+            event.Add(static_cast<UINT32>(m_rng()));
+            event.Add(static_cast<INT32>(m_rng())).Add(static_cast<INT16>(m_rng()));
+            event.Add(n);
+            for (unsigned i = 0; i != n && i != 8; i += 1)
+            {
+                event.Add(static_cast<UINT32>(m_rng()));
+            }
+
+            event.Add(static_cast<UINT64>(m_rng()));
+            event.AddString(std::string(Random(4), 'w').c_str());
+            event.Add(static_cast<BYTE>(m_rng()));
+            for (unsigned i = 0; i != 2; i += 1)
+            {
+                event.AddAnsiString(std::string(Random(4), 's').c_str());
+                event.Add(static_cast<UINT32>(m_rng()));
+            }
+
+            for (unsigned i = 0; i != 4; i += 1)
+            {
+                event.Add(static_cast<UINT32>(m_rng()));
+            }
+
+            event.Add(static_cast<USHORT>(m_rng()));
+            for (unsigned i = 0; i != n && i != 8; i += 1)
+            {
+                event.Add(static_cast<BYTE>(m_rng()));
+            }
+
+            event.Add(static_cast<INT32>(m_rng()));
+            return event;
+        }
+
+        // Linear search: walks the top-level properties with decode plans
+        // disabled. Returns the first index with the name, or TopLevelCount.
+        unsigned
+        FindName(std::string const& name)
+        {
+            for (unsigned i = 0; i != TopLevelCount; i += 1)
+            {
+                if (Names[i] == name)
+                {
+                    return i;
+                }
+            }
+
+            return TopLevelCount;
+        }
+
+        LookupResult
+        LinearLookup(EVENT_RECORD const& record, unsigned propertyIndex)
+        {
+            LookupResult result = {};
+            Enumerator.SetDecodePlansEnabled(false);
+            ETW_CHECK(Enumerator.StartEvent(&record));
+            if (propertyIndex >= TopLevelCount)
+            {
+                result.FinalState = Enumerator.State();
+                result.FinalError = ERROR_NOT_FOUND;
+                return result;
+            }
+
+            result.Found = Enumerator.MoveNext();
+            for (unsigned i = 0; result.Found && i != propertyIndex; i += 1)
+            {
+                result.Found = Enumerator.MoveNextSibling();
+            }
+
+            return Finish(record, result);
+        }
+
+        // Moves a few items into the event, then looks the property up.
+        LookupResult
+        Lookup(EVENT_RECORD const& record, bool plans, unsigned propertyIndex, char const* szName)
+        {
+            LookupResult result = {};
+            Enumerator.SetDecodePlansEnabled(plans);
+            ETW_CHECK(Enumerator.StartEvent(&record));
+            for (unsigned i = Random(4); i != 0 && Enumerator.MoveNext(); i -= 1)
+            {
+                continue;
+            }
+
+            if (Enumerator.State() == EtwEnumeratorState_Error)
+            {
+                ETW_CHECK(Enumerator.StartEvent(&record));
+            }
+
+            auto const stateBefore = Enumerator.State();
+            EtwItemInfo info;
+            if (szName != nullptr)
+            {
+                auto const wideName = WideName(szName);
+                result.Found = Enumerator.GetFieldByName(wideName.data(), &info);
+            }
+            else
+            {
+                result.Found = Enumerator.GetFieldByIndex(propertyIndex, &info);
+            }
+
+            if (result.Found)
+            {
+                auto const current = Enumerator.GetItemInfo();
+                ETW_CHECK(info.Data == current.Data && info.DataSize == current.DataSize);
+            }
+            else
+            {
+                ETW_CHECK(info.Name == nullptr && info.Data == nullptr && info.DataSize == 0);
+                if (Enumerator.LastError() == ERROR_NOT_FOUND)
+                {
+                    ETW_CHECK(Enumerator.State() == stateBefore);
+                    result.FinalState = EtwEnumeratorState_BeforeFirstItem;
+                    result.FinalError = ERROR_NOT_FOUND;
+                    return result;
+                }
+            }
+
+            return Finish(record, result);
+        }
+
+    private:
+
+        // Records the current item and the items after it (MoveNext).
+        LookupResult&
+        Finish(EVENT_RECORD const& record, LookupResult& result)
+        {
+            auto const pbUserData = static_cast<BYTE const*>(record.UserData);
+            if (result.Found)
+            {
+                do
+                {
+                    auto const info = Enumerator.GetItemInfo();
+                    ItemRecord item;
+                    item.State = Enumerator.State();
+                    item.Name = ToUtf8(info.Name);
+                    item.ArrayIndex = info.ArrayIndex;
+                    item.ArrayCount = info.ArrayCount;
+                    item.DataSize = info.DataSize;
+                    item.DataOffset = info.Data ? static_cast<BYTE const*>(info.Data) - pbUserData : -1;
+                    result.Items.push_back(item);
+                } while (Enumerator.MoveNext());
+            }
+
+            result.FinalState = Enumerator.State();
+            result.FinalError = Enumerator.LastError();
+            return result;
+        }
+    };
+}
+
+ETW_TEST(FieldLookup_MatchesLinearSearch)
+{
+    LookupFixture f;
+    unsigned mismatches = 0;
+    unsigned found = 0;
+    unsigned errors = 0;
+
+    ETW_CHECK(f.CollisionCount >= 6);
+    ETW_CHECK(f.MissingNames.size() == 6);
+
+    for (unsigned eventIndex = 0; eventIndex != 400; eventIndex += 1)
+    {
+        TestEvent event = f.MakeEvent();
+        if (eventIndex % 4 == 3 && event.PayloadSize() != 0)
+        {
+            event.Truncate(f.Random(static_cast<unsigned>(event.PayloadSize())));
+        }
+
+        EVENT_RECORD const& record = event.Record();
+
+        // By index, including out of range.
+        for (unsigned propertyIndex = 0; propertyIndex != TopLevelCount + 2; propertyIndex += 1)
+        {
+            LookupResult const expected = f.LinearLookup(record, propertyIndex);
+            for (bool plans : { false, true })
+            {
+                if (!(f.Lookup(record, plans, propertyIndex, nullptr) == expected))
+                {
+                    if (mismatches < 5)
+                    {
+                        printf("Mismatch: event %u, index %u, plans %u\n",
+                            eventIndex, propertyIndex, plans);
+                    }
+
+                    mismatches += 1;
+                }
+            }
+
+            found += expected.Found;
+            errors += expected.FinalState == EtwEnumeratorState_Error;
+        }
+
+        // By name: each name (the duplicate finds the first), then names
+        // that are not in the event.
+        std::vector<std::string> names = f.Names;
+        names.insert(names.end(), f.MissingNames.begin(), f.MissingNames.end());
+        for (auto const& name : names)
+        {
+            LookupResult const expected = f.LinearLookup(record, f.FindName(name));
+            for (bool plans : { false, true })
+            {
+                if (!(f.Lookup(record, plans, 0, name.c_str()) == expected))
+                {
+                    if (mismatches < 5)
+                    {
+                        printf("Mismatch: event %u, name \"%s\", plans %u\n",
+                            eventIndex, name.c_str(), plans);
+                    }
+
+                    mismatches += 1;
+                }
+            }
+        }
+    }
+
+    ETW_CHECK(mismatches == 0);
+    ETW_CHECK(found > 400 * TopLevelCount / 2);
+    ETW_CHECK(errors != 0);
+}
+
+ETW_TEST(FieldLookup_DuplicateAndMissingNames)
+{
+    LookupFixture f;
+    TestEvent event = f.MakeEvent();
+    EVENT_RECORD const& record = event.Record();
+    EtwItemInfo info;
+
+    for (bool plans : { false, true })
+    {
+        f.Enumerator.SetDecodePlansEnabled(plans);
+        ETW_CHECK(f.Enumerator.StartEvent(&record));
+
+        auto const duplicate = WideName(f.Names[9]);
+        ETW_CHECK(f.Enumerator.GetFieldByName(duplicate.data(), &info));
+        ETW_CHECK(info.InType == TDH_INTYPE_UINT64); // Property 4, not 9.
+        ETW_CHECK(info.DataSize == 8);
+
+        auto const missing = WideName(f.MissingNames[0]);
+        ETW_CHECK(!f.Enumerator.GetFieldByName(missing.data(), &info));
+        ETW_CHECK(f.Enumerator.LastError() == ERROR_NOT_FOUND);
+        ETW_CHECK(f.Enumerator.State() == EtwEnumeratorState_Value); // Unchanged.
+
+        auto const member = WideName("X");
+        ETW_CHECK(!f.Enumerator.GetFieldByName(member.data(), &info));
+        ETW_CHECK(f.Enumerator.LastError() == ERROR_NOT_FOUND);
+
+        auto const last = WideName(f.Names[11]);
+        ETW_CHECK(f.Enumerator.GetFieldByName(last.data(), &info));
+        ETW_CHECK(info.InType == TDH_INTYPE_INT32);
+        ETW_CHECK(!f.Enumerator.MoveNext());
+        ETW_CHECK(f.Enumerator.State() == EtwEnumeratorState_AfterLastItem);
+    }
+}
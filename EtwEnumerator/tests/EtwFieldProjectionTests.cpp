@@ -0,0 +1,566 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for EtwFieldProjection. For random sets of paths (valid, nested,
+duplicate, out of range, and paths that do not fit the schema) and random
+events of two schemas, the projected JSON must equal the full JSON
+filtered to the selected paths: the JSON values of the selected items, in
+event order, named by path, with the same "meta" section. A MoveNextProjected
+walk must visit the same items.
+*/
+
+#include "EtwTest.h"
+#include <random>
+
+using namespace EtwTest;
+
+namespace
+{
+    struct CollectingSink final
+        : EtwOutputSink
+    {
+        std::string Output;
+
+        LSTATUS __stdcall Write(
+            _In_reads_bytes_(cb) void const* pb,
+            unsigned cb) noexcept override
+        {
+            Output.append(static_cast<char const*>(pb), cb);
+            return ERROR_SUCCESS;
+        }
+    };
+
+    struct JsonItem
+    {
+        std::string Path;
+        std::string Value; // JSON text of the value.
+
+        bool operator==(JsonItem const& other) const
+        {
+            return Path == other.Path && Value == other.Value;
+        }
+    };
+
+    // Returns the position after the JSON value that starts at pos.
+    size_t
+    SkipJsonValue(std::string const& json, size_t pos)
+    {
+        if (json[pos] == '"')
+        {
+            pos += 1;
+            while (json[pos] != '"')
+            {
+                pos += json[pos] == '\\' ? 2 : 1;
+            }
+
+            return pos + 1;
+        }
+        else if (json[pos] == '{' || json[pos] == '[')
+        {
+            pos += 1;
+            while (json[pos] != '}' && json[pos] != ']')
+            {
+                pos = SkipJsonValue(json, pos);
+                if (json[pos] == ':' || json[pos] == ',')
+                {
+                    pos += 1;
+                }
+            }
+
+            return pos + 1;
+        }
+        else
+        {
+            while (pos != json.size() && json[pos] != ',' && json[pos] != '}' && json[pos] != ']')
+            {
+                pos += 1;
+            }
+
+            return pos;
+        }
+    }
+
+    // Splits a JSON object into its members. Names are not escaped.
+    std::vector<JsonItem>
+    JsonMembers(std::string const& json)
+    {
+        std::vector<JsonItem> members;
+        size_t pos = 1;
+        while (pos < json.size() && json[pos] == '"')
+        {
+            size_t const nameEnd = SkipJsonValue(json, pos);
+            size_t const valueEnd = SkipJsonValue(json, nameEnd + 1);
+            members.push_back({
+                json.substr(pos + 1, nameEnd - pos - 2),
+                json.substr(nameEnd + 1, valueEnd - nameEnd - 1) });
+            pos = valueEnd + (json[valueEnd] == ',');
+        }
+
+        ETW_CHECK(json.size() == pos + 1 && json[pos] == '}');
+        return members;
+    }
+
+    bool
+    IsSelected(std::vector<std::string> const& paths, std::string const& path)
+    {
+        for (auto const& selected : paths)
+        {
+            if (selected == path)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Adds the selected items within the JSON value at path, in order. The
+    // outermost selected item wins.
+    void
+    FilterJsonValue(
+        std::vector<std::string> const& paths,
+        std::string const& path,
+        std::string const& value,
+        std::vector<JsonItem>* pItems)
+    {
+        if (IsSelected(paths, path))
+        {
+            pItems->push_back({ path, value });
+        }
+        else if (value[0] == '{')
+        {
+            for (auto const& member : JsonMembers(value))
+            {
+                FilterJsonValue(paths, path + "." + member.Path, member.Value, pItems);
+            }
+        }
+        else if (value[0] == '[')
+        {
+            size_t pos = 1;
+            for (unsigned index = 0; value[pos] != ']'; index += 1)
+            {
+                size_t const end = SkipJsonValue(value, pos);
+                FilterJsonValue(paths, path + "[" + std::to_string(index) + "]",
+                    value.substr(pos, end - pos), pItems);
+                pos = end + (value[end] == ',');
+            }
+        }
+    }
+
+    class ProjectionFixture
+    {
+        TestSchema m_schema1;
+        TestSchema m_schema2;
+        TestMap m_map;
+        TestCallbacks m_callbacks;
+        std::mt19937 m_rng;
+
+    public:
+
+        EtwEnumerator Enumerator;
+
+        ProjectionFixture()
+            : m_schema1()
+            , m_schema2()
+            , m_map()
+            , m_callbacks()
+            , m_rng(3)
+            , Enumerator(m_callbacks)
+        {
+            m_schema1.Add("Hdr", Scalar(TDH_INTYPE_UINT32), "HdrMap");     //  0
+            m_schema1.Add("Pt", Struct(11, 2));                            //  1 Fixed-size struct.
+            m_schema1.Add("N", Scalar(TDH_INTYPE_UINT16));                 //  2
+            m_schema1.Add("Recs", CountedStruct(13, 3, 2));                //  3 Structs[N].
+            m_schema1.Add("Len", Scalar(TDH_INTYPE_UINT16));               //  4
+            m_schema1.Add("Data", Sized(TDH_INTYPE_BINARY, 4));            //  5 Binary[Len].
+            m_schema1.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));       //  6
+            m_schema1.Add("Ids", CountedArray(TDH_INTYPE_UINT32, 2));      //  7 UINT32[N].
+            m_schema1.Add("Fix3", Struct(11, 2, 3));                       //  8 Fixed-size structs[3].
+            m_schema1.Add("Var", Struct(18, 2, 2));                        //  9 Variable-size structs[2].
+            m_schema1.Add("Tail", Scalar(TDH_INTYPE_GUID));                // 10
+            m_schema1.Add("X", Scalar(TDH_INTYPE_INT32));                  // 11
+            m_schema1.Add("Y", Scalar(TDH_INTYPE_INT32));                  // 12
+            m_schema1.Add("A", Scalar(TDH_INTYPE_UINT64));                 // 13
+            m_schema1.Add("B", Scalar(TDH_INTYPE_GUID));                   // 14
+            m_schema1.Add("Sub", Struct(16, 2, 2));                        // 15
+            m_schema1.Add("P", Scalar(TDH_INTYPE_UINT8));                  // 16
+            m_schema1.Add("Q", Scalar(TDH_INTYPE_INT16, TDH_OUTTYPE_NULL, 2)); // 17
+            m_schema1.Add("S", Scalar(TDH_INTYPE_ANSISTRING));             // 18
+            m_schema1.Add("C", Scalar(TDH_INTYPE_COUNTEDSTRING));          // 19
+            m_schema1.SetTopLevelCount(11);
+            m_callbacks.SetSchema(1, m_schema1);
+
+            // Same names, different shapes.
+            m_schema2.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));       //  0
+            m_schema2.Add("Pt", Scalar(TDH_INTYPE_UINT32));                //  1 Not a struct.
+            m_schema2.Add("Ids", Scalar(TDH_INTYPE_UINT16, TDH_OUTTYPE_NULL, 3)); // 2 UINT16[3].
+            m_schema2.Add("Recs", Struct(5, 2, 2));                        //  3 Structs[2].
+            m_schema2.Add("Hdr", Scalar(TDH_INTYPE_UINT32));               //  4
+            m_schema2.Add("A", Scalar(TDH_INTYPE_UINT64));                 //  5
+            m_schema2.Add("Sub", Struct(7, 1));                            //  6 Struct, not an array.
+            m_schema2.Add("P", Scalar(TDH_INTYPE_UINT8));                  //  7
+            m_schema2.SetTopLevelCount(5);
+            m_callbacks.SetSchema(2, m_schema2);
+
+            m_map.Add(0, "Zero").Add(1, "One").Add(2, "Two");
+            m_callbacks.SetMap("HdrMap", m_map);
+        }
+
+        unsigned
+        Random(unsigned limit)
+        {
+            return static_cast<unsigned>(m_rng() % limit);
+        }
+
+        TestEvent
+        MakeEvent(USHORT eventId)
+        {
+            TestEvent event(eventId, 0x01d3c0a5f1e2d3c4 + Random(1000000));
+            if (eventId == 1)
+            {
+                USHORT const n = static_cast<USHORT>(Random(5));
+                USHORT const len = static_cast<USHORT>(Random(6));
+                event.Add(static_cast<UINT32>(Random(4)));           // Hdr (3 is not in the map).
+                AddInt32s(event, 2);                                 // Pt
+                event.Add(n);                                        // N
+                for (unsigned i = 0; i != n; i += 1)                 // Recs
+                {
+                    event.Add(static_cast<UINT64>(m_rng()) << 32 | m_rng());
+                    AddInt32s(event, 4);                             // B
+                    for (unsigned j = 0; j != 2; j += 1)             // Sub
+                    {
+                        event.Add(static_cast<BYTE>(Random(256)));
+                        event.Add(static_cast<USHORT>(Random(65536)));
+                        event.Add(static_cast<USHORT>(Random(65536)));
+                    }
+                }
+
+                event.Add(len);                                      // Len
+                for (unsigned i = 0; i != len; i += 1)               // Data
+                {
+                    event.Add(static_cast<BYTE>(Random(256)));
+                }
+
+                event.AddString(RandomString().c_str());             // Name
+                AddInt32s(event, n);                                 // Ids
+                AddInt32s(event, 6);                                 // Fix3
+                for (unsigned i = 0; i != 2; i += 1)                 // Var
+                {
+                    event.AddAnsiString(RandomString().c_str());
+                    std::string const chars = RandomString();
+                    event.Add(static_cast<USHORT>(chars.size() * 2));
+                    for (char ch : chars)
+                    {
+                        event.Add(static_cast<EtwWCHAR>(ch));
+                    }
+                }
+
+                AddInt32s(event, 4);                                 // Tail
+            }
+            else
+            {
+                event.AddString(RandomString().c_str());             // Name
+                AddInt32s(event, 1);                                 // Pt
+                for (unsigned i = 0; i != 3; i += 1)                 // Ids
+                {
+                    event.Add(static_cast<USHORT>(Random(65536)));
+                }
+
+                for (unsigned i = 0; i != 2; i += 1)                 // Recs
+                {
+                    event.Add(static_cast<UINT64>(m_rng()));
+                    event.Add(static_cast<BYTE>(Random(256)));
+                }
+
+                AddInt32s(event, 1);                                 // Hdr
+            }
+
+            return event;
+        }
+
+        // Returns the full JSON filtered to the paths, and the "meta" member.
+        std::vector<JsonItem>
+        FilteredJson(
+            EVENT_RECORD const& record,
+            std::vector<std::string> const& paths,
+            EtwJsonSuffixFlags flags,
+            std::string* pMeta)
+        {
+            std::vector<JsonItem> items;
+            EtwStringViewZ json;
+            ETW_CHECK(Enumerator.StartEvent(&record));
+            ETW_CHECK(Enumerator.FormatCurrentEventAsJson(nullptr, flags, &json));
+            pMeta->clear();
+            for (auto const& member : JsonMembers(ToUtf8(json.Data, json.DataLength)))
+            {
+                if (member.Path == "meta")
+                {
+                    *pMeta = member.Value;
+                }
+                else
+                {
+                    FilterJsonValue(paths, member.Path, member.Value, &items);
+                }
+            }
+
+            return items;
+        }
+
+        // Returns the projected JSON, and the "meta" member.
+        std::vector<JsonItem>
+        ProjectedJson(
+            EVENT_RECORD const& record,
+            EtwFieldProjection& projection,
+            EtwJsonSuffixFlags flags,
+            std::string* pMeta)
+        {
+            std::vector<JsonItem> items;
+            EtwStringViewZ json;
+            ETW_CHECK(Enumerator.StartEvent(&record));
+            ETW_CHECK(Enumerator.FormatCurrentEventAsJson(projection, nullptr, flags, &json));
+            std::string const utf8 = ToUtf8(json.Data, json.DataLength);
+
+            CollectingSink sink;
+            ETW_CHECK(Enumerator.StartEvent(&record));
+            ETW_CHECK(Enumerator.WriteCurrentEventAsJsonUtf8(sink, projection, nullptr, flags));
+            ETW_CHECK(sink.Output == utf8);
+
+            pMeta->clear();
+            for (auto const& member : JsonMembers(utf8))
+            {
+                if (member.Path == "meta")
+                {
+                    *pMeta = member.Value;
+                }
+                else
+                {
+                    items.push_back(member);
+                }
+            }
+
+            return items;
+        }
+
+        // Returns the items visited by MoveNextProjected. Each item is
+        // formatted, skipped with MoveNextSibling, or left in place; only
+        // formatted items have a Value.
+        std::vector<JsonItem>
+        ProjectedWalk(
+            EVENT_RECORD const& record,
+            EtwFieldProjection& projection,
+            std::vector<unsigned>* pFormatted)
+        {
+            std::vector<JsonItem> items;
+            pFormatted->clear();
+            ETW_CHECK(Enumerator.StartEvent(&record));
+            unsigned fieldIndex;
+            while (Enumerator.MoveNextProjected(projection, &fieldIndex))
+            {
+                ETW_CHECK(fieldIndex < projection.FieldCount());
+                JsonItem item = { ToUtf8(projection.FieldPath(fieldIndex)), std::string() };
+                switch (Random(3))
+                {
+                case 0:
+                {
+                    EtwStringViewZ json;
+                    ETW_CHECK(Enumerator.FormatCurrentItemAsJsonAndMoveNextSibling(EtwJsonItemFlags_None, &json));
+                    item.Value = ToUtf8(json.Data, json.DataLength);
+                    pFormatted->push_back(static_cast<unsigned>(items.size()));
+                    break;
+                }
+                case 1:
+                    Enumerator.MoveNextSibling();
+                    break;
+                }
+
+                items.push_back(item);
+            }
+
+            ETW_CHECK(Enumerator.State() == EtwEnumeratorState_AfterLastItem);
+            return items;
+        }
+
+    private:
+
+        void
+        AddInt32s(TestEvent& event, unsigned count)
+        {
+            for (unsigned i = 0; i != count; i += 1)
+            {
+                event.Add(static_cast<UINT32>(m_rng()));
+            }
+        }
+
+        std::string
+        RandomString()
+        {
+            std::string s;
+            for (unsigned cch = Random(5); cch != 0; cch -= 1)
+            {
+                s += static_cast<char>('a' + Random(26));
+            }
+
+            return s;
+        }
+    };
+
+    char const* const CandidatePaths[] = {
+        // Fit schema 1 (some also fit schema 2).
+        "Hdr", "Pt", "Pt.X", "Pt.Y", "N", "Recs", "Recs[0]", "Recs[1].A",
+        "Recs[2].Sub", "Recs[0].Sub[1]", "Recs[1].Sub[0].Q", "Recs[0].Sub[1].Q[1]",
+        "Len", "Data", "Name", "Ids", "Ids[0]", "Ids[3]", "Fix3", "Fix3[0]",
+        "Fix3[2].Y", "Var", "Var[0]", "Var[1].C", "Tail",
+        // Fit schema 2 only.
+        "Recs[1].Sub", "Recs[0].Sub.P", "Ids[2]",
+        // Fit neither.
+        "Nope", "Hdr[0]", "Pt[0].X", "Pt.Z", "Recs.A", "Ids[100]", "Fix3[3]",
+        "Var.S", "Hdr.X", "Recs[0].Sub.Q", "Sub", "P",
+    };
+}
+
+ETW_TEST(Projection_MatchesFilteredJson)
+{
+    ProjectionFixture f;
+    unsigned const candidateCount = sizeof(CandidatePaths) / sizeof(CandidatePaths[0]);
+    unsigned mismatches = 0;
+    unsigned selectedItems = 0;
+    unsigned formattedItems = 0;
+
+    for (unsigned setIndex = 0; setIndex != 300; setIndex += 1)
+    {
+        // 1..6 random paths, possibly duplicated or nested.
+        std::vector<std::string> paths;
+        for (unsigned i = f.Random(6) + 1; i != 0; i -= 1)
+        {
+            paths.push_back(CandidatePaths[f.Random(candidateCount)]);
+        }
+
+        // Paths are ASCII.
+        std::vector<std::vector<EtwWCHAR>> widePaths;
+        std::vector<EtwPCWSTR> pszPaths;
+        for (auto const& path : paths)
+        {
+            widePaths.emplace_back(path.begin(), path.end());
+            widePaths.back().push_back(0);
+        }
+
+        for (auto const& widePath : widePaths)
+        {
+            pszPaths.push_back(widePath.data());
+        }
+
+        EtwFieldProjection projection;
+        ETW_CHECK(ERROR_SUCCESS == projection.SetFields(pszPaths.data(), static_cast<unsigned>(pszPaths.size())));
+        ETW_CHECK(projection.FieldCount() == paths.size());
+
+        for (unsigned eventIndex = 0; eventIndex != 12; eventIndex += 1)
+        {
+            TestEvent event = f.MakeEvent(static_cast<USHORT>(f.Random(2) + 1));
+            EVENT_RECORD const& record = event.Record();
+            auto const flags = eventIndex % 3 == 0 ? EtwJsonSuffixFlags_None : EtwJsonSuffixFlags_Default;
+
+            std::string filteredMeta;
+            std::string projectedMeta;
+            auto const filtered = f.FilteredJson(record, paths, flags, &filteredMeta);
+            auto const projected = f.ProjectedJson(record, projection, flags, &projectedMeta);
+            std::vector<unsigned> formatted;
+            auto walked = f.ProjectedWalk(record, projection, &formatted);
+
+            // The walk only has values for the formatted items.
+            std::vector<JsonItem> expectedWalk = filtered;
+            for (auto& item : expectedWalk)
+            {
+                item.Value.clear();
+            }
+
+            for (unsigned index : formatted)
+            {
+                if (index < expectedWalk.size())
+                {
+                    expectedWalk[index].Value = filtered[index].Value;
+                }
+            }
+
+            if (!(filtered == projected) || filteredMeta != projectedMeta || !(walked == expectedWalk))
+            {
+                if (mismatches < 5)
+                {
+                    printf("Mismatch: set %u, event %u, items %u vs %u vs %u\n",
+                        setIndex, eventIndex,
+                        static_cast<unsigned>(filtered.size()),
+                        static_cast<unsigned>(projected.size()),
+                        static_cast<unsigned>(walked.size()));
+                }
+
+                mismatches += 1;
+            }
+
+            selectedItems += static_cast<unsigned>(filtered.size());
+            formattedItems += static_cast<unsigned>(formatted.size());
+        }
+    }
+
+    ETW_CHECK(mismatches == 0);
+    ETW_CHECK(selectedItems > 1000);
+    ETW_CHECK(formattedItems != 0);
+}
+
+ETW_TEST(Projection_Output)
+{
+    ProjectionFixture f;
+    TestEvent event(2);
+    event.AddString("ab").Add<UINT32>(7).Add<USHORT>(1).Add<USHORT>(2).Add<USHORT>(3);
+    event.Add<UINT64>(10).Add<BYTE>(11).Add<UINT64>(20).Add<BYTE>(21).Add<UINT32>(99);
+    EVENT_RECORD const& record = event.Record();
+
+    // Event order, named by path; the outer item wins; absent paths omitted.
+    EtwPCWSTR const paths[] = { L"Hdr", L"Recs[1].Sub.P", L"Ids[1]", L"Recs[1]", L"Pt.X", L"Ids[3]", L"Name" };
+    EtwFieldProjection projection;
+    ETW_CHECK(ERROR_SUCCESS == projection.SetFields(paths, 7));
+    EtwStringViewZ json;
+    ETW_CHECK(f.Enumerator.StartEvent(&record));
+    ETW_CHECK(f.Enumerator.FormatCurrentEventAsJson(projection, L"P", EtwJsonSuffixFlags_id, &json));
+    ETW_CHECK(ToUtf8(json.Data, json.DataLength) ==
+        R"(P{"Name":"ab","Ids[1]":2,"Recs[1]":{"A":20,"Sub":{"P":21}},"Hdr":99,"meta":{"id":2}})");
+
+    ETW_CHECK(f.Enumerator.StartEvent(&record));
+    unsigned fieldIndex = 99;
+    ETW_CHECK(f.Enumerator.MoveNextProjected(projection, &fieldIndex));
+    ETW_CHECK(fieldIndex == 6);
+    ETW_CHECK(f.Enumerator.MoveNextProjected(projection, &fieldIndex));
+    ETW_CHECK(fieldIndex == 2);
+    ETW_CHECK(f.Enumerator.MoveNextProjected(projection, &fieldIndex));
+    ETW_CHECK(fieldIndex == 3);
+    ETW_CHECK(f.Enumerator.MoveNextProjected(projection, &fieldIndex));
+    ETW_CHECK(fieldIndex == 0);
+    ETW_CHECK(!f.Enumerator.MoveNextProjected(projection, &fieldIndex));
+    ETW_CHECK(f.Enumerator.State() == EtwEnumeratorState_AfterLastItem);
+
+    // Nothing selected.
+    EtwPCWSTR const nothing[] = { L"Nope", L"Pt.X" };
+    ETW_CHECK(ERROR_SUCCESS == projection.SetFields(nothing, 2));
+    ETW_CHECK(f.Enumerator.StartEvent(&record));
+    ETW_CHECK(f.Enumerator.FormatCurrentEventAsJson(projection, nullptr, EtwJsonSuffixFlags_None, &json));
+    ETW_CHECK(ToUtf8(json.Data, json.DataLength) == "{}");
+}
+
+ETW_TEST(Projection_InvalidPaths)
+{
+    EtwPCWSTR const valid[] = { L"A", L"B[2].C" };
+    EtwPCWSTR const invalid[] = {
+        L"", L".A", L"A.", L"A..B", L"A[", L"A[]", L"A[x]", L"A[1", L"A[1]x",
+        L"A]", L"[1]", L"A[65535]", L"A[99999999999]" };
+    EtwFieldProjection projection;
+    for (auto szInvalid : invalid)
+    {
+        ETW_CHECK(ERROR_SUCCESS == projection.SetFields(valid, 2));
+        ETW_CHECK(projection.FieldCount() == 2);
+        EtwPCWSTR const paths[] = { valid[0], szInvalid };
+        ETW_CHECK(ERROR_INVALID_PARAMETER == projection.SetFields(paths, 2));
+        ETW_CHECK(projection.FieldCount() == 0);
+    }
+
+    ETW_CHECK(ERROR_SUCCESS == projection.SetFields(valid, 2));
+    ETW_CHECK(ToUtf8(projection.FieldPath(1)) == "B[2].C");
+}
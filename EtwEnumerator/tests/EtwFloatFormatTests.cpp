@@ -0,0 +1,403 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests and benchmark for EtwFloatFormat_RoundTrip. Each formatted FLOAT or
+DOUBLE must parse back (strtof/strtod) to the same bits, and must have no
+more significant digits than the shortest "%.*e" string that round-trips
+(with the same digits when the lengths are equal). Fixed expected strings
+cover the layout and values that are known to be hard to format.
+*/
+
+#include "EtwTest.h"
+#include <float.h>
+#include <math.h>
+#include <limits>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <type_traits>
+
+using namespace EtwTest;
+
+namespace
+{
+    template<class T>
+    struct FloatTraits;
+
+    template<>
+    struct FloatTraits<float>
+    {
+        typedef UINT32 Bits;
+        static USHORT const InType = TDH_INTYPE_FLOAT;
+        static unsigned const MaxDigits = 9;
+        static float Parse(char const* sz) { return strtof(sz, nullptr); }
+    };
+
+    template<>
+    struct FloatTraits<double>
+    {
+        typedef UINT64 Bits;
+        static USHORT const InType = TDH_INTYPE_DOUBLE;
+        static unsigned const MaxDigits = 17;
+        static double Parse(char const* sz) { return strtod(sz, nullptr); }
+    };
+
+    template<class T>
+    typename FloatTraits<T>::Bits
+    ToBits(T value)
+    {
+        typename FloatTraits<T>::Bits bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    template<class T>
+    T
+    FromBits(typename FloatTraits<T>::Bits bits)
+    {
+        T value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    // Formats each value with FormatCurrentValue using the specified format.
+    template<class T>
+    std::vector<std::string>
+    FormatValues(
+        std::vector<T> const& values,
+        EtwFloatFormat format)
+    {
+        TestSchema schema;
+        schema.Add("Count", Scalar(TDH_INTYPE_UINT16));
+        schema.Add("Values", CountedArray(FloatTraits<T>::InType, 0));
+        TestCallbacks callbacks;
+        callbacks.SetSchema(1, schema);
+        EtwEnumerator enumerator(callbacks);
+        ETW_CHECK(enumerator.SetFloatFormat(format));
+
+        std::vector<std::string> result;
+        size_t const maxPerEvent = 4000; // Keep UserDataLength < 64KB.
+        for (size_t i = 0; i < values.size(); i += maxPerEvent)
+        {
+            size_t const count = values.size() - i < maxPerEvent ? values.size() - i : maxPerEvent;
+            TestEvent event(1);
+            event.Add<UINT16>(static_cast<UINT16>(count));
+            event.AddBytes(&values[i], count * sizeof(T));
+
+            ETW_CHECK(enumerator.StartEvent(&event.Record()));
+            ETW_CHECK(enumerator.MoveNext()); // Count
+            ETW_CHECK(enumerator.MoveNext()); // ArrayBegin
+            while (enumerator.MoveNext() &&
+                enumerator.State() == EtwEnumeratorState_Value)
+            {
+                EtwStringView str;
+                ETW_CHECK(enumerator.FormatCurrentValue(&str));
+                result.push_back(ToUtf8(str.Data, str.DataLength));
+            }
+        }
+
+        ETW_CHECK(result.size() == values.size());
+        return result;
+    }
+
+    // Returns the significant digits of a decimal string, without sign,
+    // decimal point, exponent, leading zeros or trailing zeros.
+    std::string
+    SignificantDigits(std::string const& text)
+    {
+        std::string digits;
+        for (char ch : text)
+        {
+            if (ch == 'e' || ch == 'E')
+            {
+                break;
+            }
+            else if (ch >= '0' && ch <= '9' && (ch != '0' || !digits.empty()))
+            {
+                digits += ch;
+            }
+        }
+
+        while (!digits.empty() && digits.back() == '0')
+        {
+            digits.pop_back();
+        }
+
+        return digits;
+    }
+
+    // Reference: the significant digits of the shortest "%.*e" string that
+    // parses back to value.
+    template<class T>
+    std::string
+    ReferenceDigits(T value)
+    {
+        char buffer[64];
+        for (unsigned precision = 1;; precision += 1)
+        {
+            snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, static_cast<double>(value));
+            if (precision == FloatTraits<T>::MaxDigits ||
+                ToBits(FloatTraits<T>::Parse(buffer)) == ToBits(value))
+            {
+                return SignificantDigits(buffer);
+            }
+        }
+    }
+
+    template<class T>
+    void
+    CheckRoundTrip(std::vector<T> const& values)
+    {
+        auto const strings = FormatValues(values, EtwFloatFormat_RoundTrip);
+        unsigned failures = 0;
+        for (size_t i = 0; i != strings.size() && i != values.size(); i += 1)
+        {
+            T const value = values[i];
+            std::string const& text = strings[i];
+            std::string const digits = SignificantDigits(text);
+            std::string const reference = ReferenceDigits(value);
+            bool const ok =
+                ToBits(FloatTraits<T>::Parse(text.c_str())) == ToBits(value) &&
+                digits.size() <= reference.size() &&
+                (digits.size() != reference.size() || digits == reference);
+            if (!ok && failures++ < 10)
+            {
+                printf("  %.17g: got \"%s\", shortest digits \"%s\"\n",
+                    static_cast<double>(value), text.c_str(), reference.c_str());
+            }
+        }
+
+        ETW_CHECK(failures == 0);
+    }
+
+    // Powers of two, neighbors of powers of two, subnormals, limits and
+    // integers around the largest exactly-representable integer.
+    template<class T>
+    std::vector<T>
+    BoundaryValues(
+        int minExponent,
+        int maxExponent,
+        unsigned mantissaBits)
+    {
+        typedef typename FloatTraits<T>::Bits Bits;
+        std::vector<T> values;
+
+        for (int e = minExponent; e <= maxExponent; e += 1)
+        {
+            T const power = static_cast<T>(ldexp(1.0, e));
+            Bits const bits = ToBits(power);
+            values.push_back(power);
+            values.push_back(-power);
+            values.push_back(FromBits<T>(bits - 1));
+            values.push_back(FromBits<T>(bits + 1));
+        }
+
+        // Subnormals: smallest, largest, and a few in between.
+        Bits const subnormalMax = (Bits(1) << mantissaBits) - 1;
+        for (Bits bits : { Bits(1), Bits(2), Bits(3), Bits(10), Bits(12345), subnormalMax / 3, subnormalMax - 1, subnormalMax })
+        {
+            values.push_back(FromBits<T>(bits));
+        }
+
+        // Integers around 2^(mantissaBits + 1).
+        double const maxExact = ldexp(1.0, static_cast<int>(mantissaBits) + 1);
+        for (int delta = -4; delta <= 4; delta += 1)
+        {
+            values.push_back(static_cast<T>(maxExact + delta));
+            values.push_back(static_cast<T>(-(maxExact + delta)));
+        }
+
+        // Powers of 10 and their neighbors.
+        for (int e = -324; e <= 308; e += 1)
+        {
+            double const power10 = pow(10.0, e);
+            if (power10 >= std::numeric_limits<T>::denorm_min() &&
+                power10 <= std::numeric_limits<T>::max())
+            {
+                T const power = static_cast<T>(power10);
+                values.push_back(power);
+                values.push_back(FromBits<T>(ToBits(power) + 1));
+                values.push_back(FromBits<T>(ToBits(power) - 1));
+            }
+        }
+
+        values.push_back(std::numeric_limits<T>::max());
+        values.push_back(std::numeric_limits<T>::lowest());
+        values.push_back(std::numeric_limits<T>::min());
+        values.push_back(std::numeric_limits<T>::epsilon());
+        values.push_back(static_cast<T>(0.0));
+        values.push_back(static_cast<T>(-0.0));
+        return values;
+    }
+
+    template<class T>
+    std::vector<T>
+    RandomValues(unsigned count)
+    {
+        typedef typename FloatTraits<T>::Bits Bits;
+        std::mt19937_64 rng(5);
+        std::vector<T> values;
+        while (values.size() != count)
+        {
+            T const value = FromBits<T>(static_cast<Bits>(rng()));
+            if (value == value && value - value == 0) // Finite.
+            {
+                values.push_back(value);
+            }
+        }
+
+        return values;
+    }
+}
+
+ETW_TEST(FloatFormat_DoubleBoundaries)
+{
+    CheckRoundTrip(BoundaryValues<double>(-1074, 1023, 52));
+}
+
+ETW_TEST(FloatFormat_DoubleRandom)
+{
+    CheckRoundTrip(RandomValues<double>(20000));
+}
+
+ETW_TEST(FloatFormat_FloatBoundaries)
+{
+    CheckRoundTrip(BoundaryValues<float>(-149, 127, 23));
+}
+
+ETW_TEST(FloatFormat_FloatRandom)
+{
+    CheckRoundTrip(RandomValues<float>(20000));
+}
+
+ETW_TEST(FloatFormat_Layout)
+{
+    std::vector<double> const doubles = {
+        0.0, -0.0, 1.0, -1.5, 0.1, 123.456, 1e20, 1e21, 1.5e-7, 1e-6, 0.000001234,
+        9007199254740992.0, 9007199254740994.0, DBL_MAX, DBL_MIN, 4.9406564584124654e-324,
+    };
+    char const* const doubleStrings[] = {
+        "0", "-0", "1", "-1.5", "0.1", "123.456", "100000000000000000000", "1e+21",
+        "1.5e-7", "0.000001", "0.000001234",
+        "9007199254740992", "9007199254740994", "1.7976931348623157e+308",
+        "2.2250738585072014e-308", "5e-324",
+    };
+
+    auto const strings = FormatValues(doubles, EtwFloatFormat_RoundTrip);
+    for (size_t i = 0; i != strings.size(); i += 1)
+    {
+        ETW_CHECK(strings[i] == doubleStrings[i]);
+    }
+
+    std::vector<float> const floats = { 0.1f, -0.0f, 16777216.0f, FLT_MAX, FLT_MIN, 1e-45f };
+    char const* const floatStrings[] = { "0.1", "-0", "16777216", "3.4028235e+38", "1.1754944e-38", "1e-45" };
+    auto const floatResults = FormatValues(floats, EtwFloatFormat_RoundTrip);
+    for (size_t i = 0; i != floatResults.size(); i += 1)
+    {
+        ETW_CHECK(floatResults[i] == floatStrings[i]);
+    }
+
+    // Printf (the default) is unchanged.
+    auto const printfStrings = FormatValues(doubles, EtwFloatFormat_Printf);
+    ETW_CHECK(printfStrings.size() == doubles.size() && printfStrings[5] == "123.456");
+}
+
+ETW_TEST(FloatFormat_CornerCases)
+{
+    // Values that are known to be hard for shortest round-trip algorithms
+    // or that sit on a layout boundary, with their expected strings. The
+    // strings do not depend on strtod or printf.
+    std::vector<double> const doubles = {
+        0.3, 0.30000000000000004, 1.0 / 3, 9223372036854775808.0,
+        9.999999999999999e20, 1e21, 1e-7, 1.23e-18, 1e23, 8.41e21,
+        2.225073858507201e-308, 2.2250738585072014e-308, 2.989102097996e-312,
+        -1.5e-323, 9060801153433600.0, 4.708356024711512e18,
+        9.409340012568248e18, 5.764607523034235e39, 1.2345678901234568e-300,
+    };
+    char const* const doubleStrings[] = {
+        "0.3", "0.30000000000000004", "0.3333333333333333", "9223372036854776000",
+        "999999999999999900000", "1e+21", "1e-7", "1.23e-18", "1e+23", "8.41e+21",
+        "2.225073858507201e-308", "2.2250738585072014e-308", "2.989102097996e-312",
+        "-1.5e-323", "9060801153433600", "4708356024711512000",
+        "9409340012568248000", "5.764607523034235e+39", "1.2345678901234568e-300",
+    };
+
+    auto const strings = FormatValues(doubles, EtwFloatFormat_RoundTrip);
+    for (size_t i = 0; i != strings.size(); i += 1)
+    {
+        if (strings[i] != doubleStrings[i])
+        {
+            printf("  expected \"%s\", got \"%s\"\n", doubleStrings[i], strings[i].c_str());
+        }
+
+        ETW_CHECK(strings[i] == doubleStrings[i]);
+    }
+
+    std::vector<float> const floats = {
+        7.038531e-26f, 1.00014165e-36f, 9.223404e18f, 67108870.0f, 1.1920929e-7f,
+        0.3f, 3.0517578e-5f, 8.589974e9f, 3e-45f,
+    };
+    char const* const floatStrings[] = {
+        "7.038531e-26", "1.00014165e-36", "9223404000000000000", "67108870", "1.1920929e-7",
+        "0.3", "0.000030517578", "8589974000", "3e-45",
+    };
+
+    auto const floatResults = FormatValues(floats, EtwFloatFormat_RoundTrip);
+    for (size_t i = 0; i != floatResults.size(); i += 1)
+    {
+        if (floatResults[i] != floatStrings[i])
+        {
+            printf("  expected \"%s\", got \"%s\"\n", floatStrings[i], floatResults[i].c_str());
+        }
+
+        ETW_CHECK(floatResults[i] == floatStrings[i]);
+    }
+}
+
+ETW_BENCHMARK(FloatFormat_RoundTripVsPrintf)
+{
+    unsigned const valueCount = 4000;
+
+    auto const timeFormat = [](auto const& values, EtwFloatFormat format)
+    {
+        typedef typename std::decay<decltype(values[0])>::type T;
+        TestSchema schema;
+        schema.Add("Values", Scalar(FloatTraits<T>::InType, TDH_OUTTYPE_NULL, valueCount));
+        TestCallbacks callbacks;
+        callbacks.SetSchema(1, schema);
+        EtwEnumerator enumerator(callbacks);
+        enumerator.SetFloatFormat(format);
+
+        TestEvent event(1);
+        event.AddBytes(values.data(), values.size() * sizeof(T));
+
+        size_t totalChars = 0;
+        double const ns = BestTimeNs([&]()
+            {
+                enumerator.StartEvent(&event.Record());
+                enumerator.MoveNext(); // ArrayBegin
+                while (enumerator.MoveNext() &&
+                    enumerator.State() == EtwEnumeratorState_Value)
+                {
+                    EtwStringView str;
+                    enumerator.FormatCurrentValue(&str);
+                    totalChars += str.DataLength;
+                }
+            });
+        ETW_CHECK(totalChars != 0);
+        return ns;
+    };
+
+    auto const doubles = RandomValues<double>(valueCount);
+    ReportBenchmark("DOUBLE",
+        timeFormat(doubles, EtwFloatFormat_Printf),
+        timeFormat(doubles, EtwFloatFormat_RoundTrip),
+        valueCount);
+
+    auto const floats = RandomValues<float>(valueCount);
+    ReportBenchmark("FLOAT",
+        timeFormat(floats, EtwFloatFormat_Printf),
+        timeFormat(floats, EtwFloatFormat_RoundTrip),
+        valueCount);
+}
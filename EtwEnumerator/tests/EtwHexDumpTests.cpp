@@ -0,0 +1,169 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests and benchmark for hex-encoding of BINARY values (AppendHexDump, which
+uses SSE2 on x86 and x64), compared with the per-byte formatter that
+AppendHexDump used before.
+*/
+
+#include "EtwTest.h"
+#include <random>
+#include <stdio.h>
+
+using namespace EtwTest;
+
+namespace
+{
+    // Reference: the per-byte loop that AppendHexDump used before.
+    unsigned
+    ReferenceHexDump(
+        _In_reads_bytes_(cbData) BYTE const* pbData,
+        unsigned cbData,
+        _Out_writes_(2 + cbData * 2) wchar_t* pchOutput)
+    {
+        static wchar_t const HexChars[] = L"0123456789ABCDEF";
+        wchar_t* pch = pchOutput;
+        *pch++ = L'0';
+        *pch++ = L'x';
+        for (unsigned i = 0; i != cbData; i++)
+        {
+            UINT8 val = pbData[i];
+            pch[i * 2 + 0] = HexChars[val >> 4];
+            pch[i * 2 + 1] = HexChars[val & 0xf];
+        }
+
+        return 2 + cbData * 2;
+    }
+
+    // Random bytes, followed by every byte value.
+    std::vector<BYTE>
+    TestData(size_t cb)
+    {
+        std::mt19937 rng(7);
+        std::vector<BYTE> data(cb + 256);
+        for (size_t i = 0; i != cb; i += 1)
+        {
+            data[i] = static_cast<BYTE>(rng());
+        }
+
+        for (unsigned i = 0; i != 256; i += 1)
+        {
+            data[cb + i] = static_cast<BYTE>(i);
+        }
+
+        return data;
+    }
+
+    bool
+    CheckHexDump(
+        EtwEnumerator& enumerator,
+        _In_reads_bytes_(cbData) BYTE const* pbData,
+        unsigned cbData)
+    {
+        std::vector<wchar_t> expected(2 + cbData * 2);
+        ReferenceHexDump(pbData, cbData, expected.data());
+
+        EtwStringView value;
+        return enumerator.FormatValue(pbData, cbData, TDH_INTYPE_BINARY, TDH_OUTTYPE_HEXBINARY, &value) &&
+            value.DataLength == expected.size() &&
+            0 == memcmp(value.Data, expected.data(), expected.size() * sizeof(wchar_t));
+    }
+}
+
+ETW_TEST(HexDump_MatchesPerByteFormatter)
+{
+    TestCallbacks callbacks;
+    EtwEnumerator enumerator(callbacks);
+    auto const data = TestData(1024);
+    unsigned failures = 0;
+
+    // Every length up to 600 bytes (the 16-byte SSE2 steps and the scalar
+    // tail) at every alignment.
+    for (unsigned cb = 0; cb <= 600; cb += 1)
+    {
+        for (unsigned offset = 0; offset != 16; offset += 1)
+        {
+            failures += !CheckHexDump(enumerator, data.data() + offset, cb);
+        }
+    }
+
+    // Every byte value.
+    failures += !CheckHexDump(enumerator, data.data() + 1024, 256);
+
+    // Large values.
+    auto const large = TestData(65536);
+    failures += !CheckHexDump(enumerator, large.data(), 65536 + 256);
+    failures += !CheckHexDump(enumerator, large.data() + 3, 65536 - 5);
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(HexDump_EventValue)
+{
+    // Same output when the value comes from an event (BINARY with a length
+    // property).
+    TestSchema schema;
+    schema.Add("Length", Scalar(TDH_INTYPE_UINT16));
+    schema.Add("Data", Sized(TDH_INTYPE_BINARY, 0));
+    TestCallbacks callbacks;
+    callbacks.SetSchema(1, schema);
+    EtwEnumerator enumerator(callbacks);
+
+    static BYTE const data[] = {
+        0x00, 0x01, 0x09, 0x0A, 0x0F, 0x10, 0x7F, 0x80, 0x99, 0x9A, 0xA9, 0xAF,
+        0xF0, 0xFA, 0xFF, 0x5C, 0x22, 0x3C };
+    TestEvent event(1);
+    event.Add<UINT16>(sizeof(data));
+    event.AddBytes(data, sizeof(data));
+
+    EtwStringView value = {};
+    ETW_CHECK(enumerator.StartEvent(&event.Record()));
+    ETW_CHECK(enumerator.MoveNext());
+    ETW_CHECK(enumerator.MoveNext());
+    ETW_CHECK(enumerator.FormatCurrentValue(&value));
+    ETW_CHECK(ToUtf8(value.Data, value.DataLength) == "0x0001090A0F107F80999AA9AFF0FAFF5C223C");
+}
+
+ETW_BENCHMARK(HexDump_Throughput)
+{
+    TestCallbacks callbacks;
+    EtwEnumerator enumerator(callbacks);
+    auto const data = TestData(65536);
+    std::vector<wchar_t> buffer(2 + 65536 * 2);
+
+    for (unsigned cb : { 16u, 64u, 256u, 1024u, 4096u, 16384u, 65536u })
+    {
+        // Repeat small sizes so that each timing covers about 1 MB.
+        unsigned const repeat = (1u << 20) / cb;
+        size_t totalChars = 0;
+
+        double const referenceNs = BestTimeNs([&]()
+            {
+                for (unsigned i = 0; i != repeat; i += 1)
+                {
+                    totalChars += ReferenceHexDump(data.data(), cb, buffer.data());
+                }
+            });
+
+        double const currentNs = BestTimeNs([&]()
+            {
+                for (unsigned i = 0; i != repeat; i += 1)
+                {
+                    EtwStringView value;
+                    enumerator.FormatValue(data.data(), cb, TDH_INTYPE_BINARY, TDH_OUTTYPE_HEXBINARY, &value);
+                    totalChars += value.DataLength;
+                }
+            });
+
+        ETW_CHECK(totalChars != 0);
+
+        char label[32];
+        snprintf(label, sizeof(label), "%u B (per byte)", cb);
+        ReportBenchmark(label, referenceNs, currentNs, double(repeat) * cb);
+        printf("  %-28s reference %9.2f GB/s,  current %9.2f GB/s\n",
+            "  (throughput)",
+            double(repeat) * cb / referenceNs,
+            double(repeat) * cb / currentNs);
+    }
+}
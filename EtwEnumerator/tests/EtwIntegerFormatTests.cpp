@@ -0,0 +1,331 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests and benchmark for integer, hex and pointer formatting in
+FormatCurrentValue, compared with the printf-style formatting (_vsnwprintf
+with %d, %u, %lld, %llu, 0x%X, 0x%llX) that AddValue used before, and with
+fixed expected strings that do not depend on any printf implementation.
+*/
+
+#include "EtwTest.h"
+#include <random>
+#include <stdio.h>
+#include <wchar.h>
+
+using namespace EtwTest;
+
+namespace
+{
+    struct IntegerCase
+    {
+        char const* Label;
+        USHORT InType;
+        USHORT OutType;
+        USHORT Size;
+        bool Signed;
+        wchar_t const* Format; // Format string used by the reference.
+    };
+
+    IntegerCase const IntegerCases[] = {
+        { "INT8",              TDH_INTYPE_INT8,     TDH_OUTTYPE_NULL,    1, true,  L"%d" },
+        { "UINT8",             TDH_INTYPE_UINT8,    TDH_OUTTYPE_NULL,    1, false, L"%u" },
+        { "UINT8 (HEXINT8)",   TDH_INTYPE_UINT8,    TDH_OUTTYPE_HEXINT8, 1, false, L"0x%X" },
+        { "INT16",             TDH_INTYPE_INT16,    TDH_OUTTYPE_NULL,    2, true,  L"%d" },
+        { "UINT16",            TDH_INTYPE_UINT16,   TDH_OUTTYPE_NULL,    2, false, L"%u" },
+        { "INT32",             TDH_INTYPE_INT32,    TDH_OUTTYPE_NULL,    4, true,  L"%d" },
+        { "UINT32",            TDH_INTYPE_UINT32,   TDH_OUTTYPE_NULL,    4, false, L"%u" },
+        { "UINT32 (PID)",      TDH_INTYPE_UINT32,   TDH_OUTTYPE_PID,     4, false, L"%u" },
+        { "HEXINT32",          TDH_INTYPE_HEXINT32, TDH_OUTTYPE_NULL,    4, false, L"0x%X" },
+        { "INT64",             TDH_INTYPE_INT64,    TDH_OUTTYPE_NULL,    8, true,  L"%lld" },
+        { "UINT64",            TDH_INTYPE_UINT64,   TDH_OUTTYPE_NULL,    8, false, L"%llu" },
+        { "HEXINT64",          TDH_INTYPE_HEXINT64, TDH_OUTTYPE_NULL,    8, false, L"0x%llX" },
+        { "POINTER",           TDH_INTYPE_POINTER,  TDH_OUTTYPE_NULL,    8, false, L"0x%llX" },
+    };
+
+    struct ExpectedString
+    {
+        USHORT InType;
+        USHORT OutType;
+        USHORT Size;
+        UINT64 Bits;
+        char const* Expected;
+    };
+
+    // Expected output for edge cases, written out by hand.
+    ExpectedString const ExpectedStrings[] = {
+        { TDH_INTYPE_INT8,     TDH_OUTTYPE_NULL,    1, 0x00, "0" },
+        { TDH_INTYPE_INT8,     TDH_OUTTYPE_NULL,    1, 0x7F, "127" },
+        { TDH_INTYPE_INT8,     TDH_OUTTYPE_NULL,    1, 0x80, "-128" },
+        { TDH_INTYPE_INT8,     TDH_OUTTYPE_NULL,    1, 0xFF, "-1" },
+        { TDH_INTYPE_UINT8,    TDH_OUTTYPE_NULL,    1, 0xFF, "255" },
+        { TDH_INTYPE_UINT8,    TDH_OUTTYPE_HEXINT8, 1, 0x00, "0x0" },
+        { TDH_INTYPE_UINT8,    TDH_OUTTYPE_HEXINT8, 1, 0xAB, "0xAB" },
+        { TDH_INTYPE_INT16,    TDH_OUTTYPE_NULL,    2, 0x8000, "-32768" },
+        { TDH_INTYPE_INT16,    TDH_OUTTYPE_NULL,    2, 0x7FFF, "32767" },
+        { TDH_INTYPE_UINT16,   TDH_OUTTYPE_NULL,    2, 0xFFFF, "65535" },
+        { TDH_INTYPE_INT32,    TDH_OUTTYPE_NULL,    4, 0x80000000, "-2147483648" },
+        { TDH_INTYPE_INT32,    TDH_OUTTYPE_NULL,    4, 0x7FFFFFFF, "2147483647" },
+        { TDH_INTYPE_INT32,    TDH_OUTTYPE_NULL,    4, 0xFFFFFFFF, "-1" },
+        { TDH_INTYPE_INT32,    TDH_OUTTYPE_NULL,    4, 0xFFFFFFF6, "-10" },
+        { TDH_INTYPE_UINT32,   TDH_OUTTYPE_NULL,    4, 0x80000000, "2147483648" },
+        { TDH_INTYPE_UINT32,   TDH_OUTTYPE_NULL,    4, 0xFFFFFFFF, "4294967295" },
+        { TDH_INTYPE_UINT32,   TDH_OUTTYPE_NULL,    4, 1000000000, "1000000000" },
+        { TDH_INTYPE_UINT32,   TDH_OUTTYPE_NULL,    4, 999999999, "999999999" },
+        { TDH_INTYPE_UINT32,   TDH_OUTTYPE_PID,     4, 4, "4" },
+        { TDH_INTYPE_HEXINT32, TDH_OUTTYPE_NULL,    4, 0x00000000, "0x0" },
+        { TDH_INTYPE_HEXINT32, TDH_OUTTYPE_NULL,    4, 0x80000000, "0x80000000" },
+        { TDH_INTYPE_HEXINT32, TDH_OUTTYPE_NULL,    4, 0x0000BEEF, "0xBEEF" },
+        { TDH_INTYPE_INT64,    TDH_OUTTYPE_NULL,    8, 0x8000000000000000, "-9223372036854775808" },
+        { TDH_INTYPE_INT64,    TDH_OUTTYPE_NULL,    8, 0x7FFFFFFFFFFFFFFF, "9223372036854775807" },
+        { TDH_INTYPE_INT64,    TDH_OUTTYPE_NULL,    8, 0xFFFFFFFFFFFFFFFF, "-1" },
+        { TDH_INTYPE_INT64,    TDH_OUTTYPE_NULL,    8, 0xFFFFFFFF00000000, "-4294967296" },
+        { TDH_INTYPE_INT64,    TDH_OUTTYPE_NULL,    8, 10000000000000000000u - 0x8000000000000000u, "776627963145224192" },
+        { TDH_INTYPE_UINT64,   TDH_OUTTYPE_NULL,    8, 0x8000000000000000, "9223372036854775808" },
+        { TDH_INTYPE_UINT64,   TDH_OUTTYPE_NULL,    8, 0xFFFFFFFFFFFFFFFF, "18446744073709551615" },
+        { TDH_INTYPE_UINT64,   TDH_OUTTYPE_NULL,    8, 10000000000000000000u, "10000000000000000000" },
+        { TDH_INTYPE_UINT64,   TDH_OUTTYPE_NULL,    8, 9999999999999999999u, "9999999999999999999" },
+        { TDH_INTYPE_UINT64,   TDH_OUTTYPE_NULL,    8, 0x100000000, "4294967296" },
+        { TDH_INTYPE_HEXINT64, TDH_OUTTYPE_NULL,    8, 0x8000000000000000, "0x8000000000000000" },
+        { TDH_INTYPE_HEXINT64, TDH_OUTTYPE_NULL,    8, 0xFFFFFFFFFFFFFFFF, "0xFFFFFFFFFFFFFFFF" },
+        { TDH_INTYPE_HEXINT64, TDH_OUTTYPE_NULL,    8, 0x0000000100000000, "0x100000000" },
+        { TDH_INTYPE_POINTER,  TDH_OUTTYPE_NULL,    8, 0x00007FF612340000, "0x7FF612340000" },
+        { TDH_INTYPE_POINTER,  TDH_OUTTYPE_NULL,    8, 0, "0x0" },
+    };
+
+    unsigned const ValuesPerEvent = 1000;
+
+    // Reference: the printf-based formatting that AddValue used before.
+    int
+    FormatReference(
+        IntegerCase const& c,
+        _In_reads_bytes_(c.Size) void const* pData,
+        _Out_writes_(cchBuffer) wchar_t* pBuffer,
+        unsigned cchBuffer)
+    {
+        UINT64 bits = 0;
+        memcpy(&bits, pData, c.Size);
+        if (c.Size == 8)
+        {
+            return c.Signed
+                ? swprintf(pBuffer, cchBuffer, c.Format, static_cast<long long>(bits))
+                : swprintf(pBuffer, cchBuffer, c.Format, static_cast<unsigned long long>(bits));
+        }
+
+        if (c.Signed)
+        {
+            int const shift = 64 - 8 * c.Size;
+            int const value = static_cast<int>(static_cast<INT64>(bits << shift) >> shift);
+            return swprintf(pBuffer, cchBuffer, c.Format, value);
+        }
+
+        return swprintf(pBuffer, cchBuffer, c.Format, static_cast<unsigned>(bits));
+    }
+
+    // Values that exercise every digit count and every hex width: 0, the
+    // limits of each integer size, every power of 10 +/- 1, and every power
+    // of 16 +/- 1. Each value is truncated to the size of the type under
+    // test.
+    std::vector<UINT64>
+    BoundaryValues()
+    {
+        std::vector<UINT64> values = {
+            0,
+            0x7F, 0x80, 0xFF,
+            0x7FFF, 0x8000, 0xFFFF,
+            0x7FFFFFFF, 0x80000000, 0xFFFFFFFF,
+            0x7FFFFFFFFFFFFFFF, // INT64_MAX
+            0x8000000000000000, // INT64_MIN
+            0xFFFFFFFFFFFFFFFF, // UINT64_MAX, -1
+        };
+
+        UINT64 power = 1;
+        for (unsigned i = 0; i != 20; i += 1, power *= 10)
+        {
+            values.push_back(power - 1);
+            values.push_back(power);
+            values.push_back(power + 1);
+            values.push_back(0 - power); // Negative powers of 10.
+        }
+
+        for (unsigned shift = 0; shift != 64; shift += 4)
+        {
+            values.push_back((UINT64(1) << shift) - 1);
+            values.push_back(UINT64(1) << shift);
+            values.push_back((UINT64(1) << shift) + 1);
+        }
+
+        return values;
+    }
+
+    // Formats every value in the event's array and checks it against the
+    // reference.
+    void
+    CheckEvent(
+        IntegerCase const& c,
+        EtwEnumerator& enumerator,
+        TestEvent& event)
+    {
+        wchar_t buffer[32];
+        unsigned count = 0;
+
+        ETW_CHECK(enumerator.StartEvent(&event.Record()));
+        while (enumerator.MoveNext() &&
+            enumerator.State() != EtwEnumeratorState_ArrayBegin)
+        {
+            continue;
+        }
+
+        while (enumerator.MoveNext() &&
+            enumerator.State() == EtwEnumeratorState_Value)
+        {
+            EtwStringView value;
+            ETW_CHECK(enumerator.FormatCurrentValue(&value));
+            int const cch = FormatReference(c, enumerator.GetItemInfo().Data, buffer, 32);
+            bool const match = cch >= 0 &&
+                value.DataLength == static_cast<unsigned>(cch) &&
+                0 == memcmp(value.Data, buffer, cch * sizeof(wchar_t));
+            if (!match)
+            {
+                printf("  %s: expected \"%s\", got \"%s\"\n",
+                    c.Label,
+                    ToUtf8(buffer, cch < 0 ? 0 : cch).c_str(),
+                    ToUtf8(value.Data, value.DataLength).c_str());
+            }
+
+            ETW_CHECK(match);
+            count += 1;
+        }
+
+        ETW_CHECK(count != 0);
+    }
+}
+
+ETW_TEST(IntegerFormat_BoundaryValues)
+{
+    auto const values = BoundaryValues();
+
+    for (auto const& c : IntegerCases)
+    {
+        TestSchema schema;
+        schema.Add("Count", Scalar(TDH_INTYPE_UINT16));
+        schema.Add("Values", CountedArray(c.InType, 0, c.OutType));
+        TestCallbacks callbacks;
+        callbacks.SetSchema(1, schema);
+        EtwEnumerator enumerator(callbacks);
+
+        TestEvent event(1);
+        event.Add<UINT16>(static_cast<UINT16>(values.size()));
+        for (UINT64 value : values)
+        {
+            event.AddBytes(&value, c.Size);
+        }
+
+        CheckEvent(c, enumerator, event);
+    }
+}
+
+ETW_TEST(IntegerFormat_RandomValues)
+{
+    std::mt19937_64 rng(4);
+
+    for (auto const& c : IntegerCases)
+    {
+        TestSchema schema;
+        schema.Add("Values", Scalar(c.InType, c.OutType, ValuesPerEvent));
+        TestCallbacks callbacks;
+        callbacks.SetSchema(1, schema);
+        EtwEnumerator enumerator(callbacks);
+
+        // Values of every magnitude: random bits, shifted right by 0..63.
+        TestEvent event(1);
+        for (unsigned i = 0; i != ValuesPerEvent; i += 1)
+        {
+            UINT64 const value = rng() >> (rng() % 64);
+            event.AddBytes(&value, c.Size);
+        }
+
+        CheckEvent(c, enumerator, event);
+    }
+}
+
+ETW_TEST(IntegerFormat_ExpectedStrings)
+{
+    for (auto const& c : ExpectedStrings)
+    {
+        TestSchema schema;
+        schema.Add("Value", Scalar(c.InType, c.OutType));
+        TestCallbacks callbacks;
+        callbacks.SetSchema(1, schema);
+        EtwEnumerator enumerator(callbacks);
+
+        TestEvent event(1);
+        event.AddBytes(&c.Bits, c.Size);
+
+        EtwStringView value = {};
+        ETW_CHECK(enumerator.StartEvent(&event.Record()));
+        ETW_CHECK(enumerator.MoveNext());
+        ETW_CHECK(enumerator.FormatCurrentValue(&value));
+        std::string const actual = ToUtf8(value.Data, value.DataLength);
+        if (actual != c.Expected)
+        {
+            printf("  InType %u: expected \"%s\", got \"%s\"\n",
+                c.InType, c.Expected, actual.c_str());
+        }
+
+        ETW_CHECK(actual == c.Expected);
+    }
+}
+
+ETW_BENCHMARK(IntegerFormat_FormatCurrentValue)
+{
+    std::mt19937_64 rng(4);
+
+    for (auto const& c : IntegerCases)
+    {
+        TestSchema schema;
+        schema.Add("Values", Scalar(c.InType, c.OutType, ValuesPerEvent));
+        TestCallbacks callbacks;
+        callbacks.SetSchema(1, schema);
+        EtwEnumerator enumerator(callbacks);
+
+        // Values of every magnitude: random bits, shifted right by 0..63.
+        TestEvent event(1);
+        for (unsigned i = 0; i != ValuesPerEvent; i += 1)
+        {
+            UINT64 const value = rng() >> (rng() % 64);
+            event.AddBytes(&value, c.Size);
+        }
+
+        wchar_t buffer[32];
+        size_t totalChars = 0;
+
+        // Same enumeration in both loops so that only formatting differs.
+        double const referenceNs = BestTimeNs([&]()
+            {
+                enumerator.StartEvent(&event.Record());
+                enumerator.MoveNext(); // ArrayBegin
+                while (enumerator.MoveNext() &&
+                    enumerator.State() == EtwEnumeratorState_Value)
+                {
+                    totalChars += FormatReference(c, enumerator.GetItemInfo().Data, buffer, 32);
+                }
+            });
+
+        double const currentNs = BestTimeNs([&]()
+            {
+                enumerator.StartEvent(&event.Record());
+                enumerator.MoveNext(); // ArrayBegin
+                while (enumerator.MoveNext() &&
+                    enumerator.State() == EtwEnumeratorState_Value)
+                {
+                    EtwStringView value;
+                    enumerator.FormatCurrentValue(&value);
+                    totalChars += value.DataLength;
+                }
+            });
+
+        ETW_CHECK(totalChars != 0);
+        ReportBenchmark(c.Label, referenceNs, currentNs, ValuesPerEvent);
+    }
+}
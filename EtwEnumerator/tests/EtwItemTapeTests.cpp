@@ -0,0 +1,383 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for the item tape (SetItemTapeEnabled). Over random payloads, with and
+without truncation, an enumerator that records and replays a tape must
+produce the same items (state, name, types, indexes, sizes, data, raw data,
+and formatted value) as a MoveNext walk without a tape: while recording,
+after a Reset in the middle of the recording, after a Reset in the middle of
+a replay, for MoveNextSibling walks, for GetFieldByIndex, and for the
+FormatCurrentEvent* methods.
+*/
+
+#include "EtwTest.h"
+#include <algorithm>
+#include <random>
+
+using namespace EtwTest;
+
+namespace
+{
+    struct ItemRecord
+    {
+        EtwEnumeratorState State;
+        std::string Name;
+        unsigned InType;
+        unsigned OutType;
+        unsigned IsArray;
+        unsigned ArrayIndex;
+        unsigned ArrayCount;
+        unsigned ElementSize;
+        unsigned DataSize;
+        ptrdiff_t DataOffset;
+        ptrdiff_t RawOffset;
+        unsigned RawSize;
+        std::string Value; // FormatCurrentValue, for Value items.
+
+        bool operator==(ItemRecord const& other) const
+        {
+            return State == other.State
+                && Name == other.Name
+                && InType == other.InType
+                && OutType == other.OutType
+                && IsArray == other.IsArray
+                && ArrayIndex == other.ArrayIndex
+                && ArrayCount == other.ArrayCount
+                && ElementSize == other.ElementSize
+                && DataSize == other.DataSize
+                && DataOffset == other.DataOffset
+                && RawOffset == other.RawOffset
+                && RawSize == other.RawSize
+                && Value == other.Value;
+        }
+    };
+
+    struct WalkResult
+    {
+        std::vector<ItemRecord> Items;
+        EtwEnumeratorState FinalState;
+        LSTATUS FinalError;
+
+        bool operator==(WalkResult const& other) const
+        {
+            return Items == other.Items
+                && FinalState == other.FinalState
+                && FinalError == other.FinalError;
+        }
+    };
+
+    class TapeFixture
+    {
+        TestSchema m_schema;
+        TestMap m_map;
+        TestCallbacks m_callbacks;
+        std::mt19937 m_rng;
+
+    public:
+
+        EtwEnumerator Reference; // No tape.
+        EtwEnumerator Taped;
+
+        TapeFixture()
+            : m_schema()
+            , m_map()
+            , m_callbacks()
+            , m_rng(5)
+            , Reference(m_callbacks)
+            , Taped(m_callbacks)
+        {
+            m_schema.Add("Hdr", Scalar(TDH_INTYPE_UINT32), "HdrMap");      //  0
+            m_schema.Add("Pt", Struct(11, 2));                             //  1 Fixed-size struct.
+            m_schema.Add("N", Scalar(TDH_INTYPE_UINT16));                  //  2
+            m_schema.Add("Recs", CountedStruct(13, 3, 2));                 //  3 Structs[N].
+            m_schema.Add("Len", Scalar(TDH_INTYPE_UINT16));                //  4
+            m_schema.Add("Data", Sized(TDH_INTYPE_BINARY, 4));             //  5 Binary[Len].
+            m_schema.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));        //  6
+            m_schema.Add("Ids", CountedArray(TDH_INTYPE_UINT32, 2));       //  7 UINT32[N].
+            m_schema.Add("Ptr", Scalar(TDH_INTYPE_POINTER));               //  8
+            m_schema.Add("Var", Struct(18, 2, 2));                         //  9 Variable-size structs[2].
+            m_schema.Add("Tail", Scalar(TDH_INTYPE_GUID));                 // 10
+            m_schema.Add("X", Scalar(TDH_INTYPE_INT32));                   // 11
+            m_schema.Add("Y", Scalar(TDH_INTYPE_INT32));                   // 12
+            m_schema.Add("A", Scalar(TDH_INTYPE_UINT64));                  // 13
+            m_schema.Add("B", Scalar(TDH_INTYPE_FLOAT));                   // 14
+            m_schema.Add("Sub", Struct(16, 2, 2));                         // 15
+            m_schema.Add("P", Scalar(TDH_INTYPE_UINT8));                   // 16
+            m_schema.Add("Q", Scalar(TDH_INTYPE_INT16, TDH_OUTTYPE_NULL, 2)); // 17
+            m_schema.Add("S", Scalar(TDH_INTYPE_ANSISTRING));              // 18
+            m_schema.Add("C", Scalar(TDH_INTYPE_COUNTEDSTRING));           // 19
+            m_schema.SetTopLevelCount(11);
+            m_callbacks.SetSchema(1, m_schema);
+
+            m_map.Add(0, "Zero").Add(1, "One");
+            m_callbacks.SetMap("HdrMap", m_map);
+
+            Taped.SetItemTapeEnabled(true);
+        }
+
+        unsigned
+        Random(unsigned limit)
+        {
+            return static_cast<unsigned>(m_rng() % limit);
+        }
+
+        TestEvent
+        MakeEvent()
+        {
+            TestEvent event(1, 0x01d3c0a5f1e2d3c4);
+            USHORT const n = static_cast<USHORT>(Random(10) == 0 ? 500 : Random(4));
+            USHORT const len = static_cast<USHORT>(Random(5));
+            event.Add(static_cast<UINT32>(Random(3)));
+            AddInt32s(event, 2);
+            event.Add(n);
+            for (unsigned i = 0; i != n && i != 6; i += 1)
+            {
+                event.Add(static_cast<UINT64>(m_rng()) << 32 | m_rng());
+                event.Add(static_cast<float>(Random(1000)) / 8);
+                for (unsigned j = 0; j != 2; j += 1)
+                {
+                    event.Add(static_cast<BYTE>(m_rng()));
+                    event.Add(static_cast<INT16>(m_rng())).Add(static_cast<INT16>(m_rng()));
+                }
+            }
+
+            event.Add(len);
+            for (unsigned i = 0; i != len; i += 1)
+            {
+                event.Add(static_cast<BYTE>(m_rng()));
+            }
+
+            event.AddString(std::string(Random(4), 'n').c_str());
+            AddInt32s(event, n < 6 ? n : 6);
+            event.Add(static_cast<UINT64>(m_rng()) << 32 | m_rng());
+            for (unsigned i = 0; i != 2; i += 1)
+            {
+                event.AddAnsiString(std::string(Random(4), 's').c_str());
+                USHORT const cb = static_cast<USHORT>(Random(3) * 2);
+                event.Add(cb);
+                for (unsigned j = 0; j != cb; j += 1)
+                {
+                    event.Add(static_cast<BYTE>('a' + Random(26)));
+                }
+            }
+
+            AddInt32s(event, 4);
+            return event;
+        }
+
+        static ItemRecord
+        Item(EtwEnumerator& enumerator, EVENT_RECORD const& record)
+        {
+            auto const pbUserData = static_cast<BYTE const*>(record.UserData);
+            auto const info = enumerator.GetItemInfo();
+            auto const raw = enumerator.GetRawDataPosition();
+            ItemRecord item;
+            item.State = enumerator.State();
+            item.Name = ToUtf8(info.Name);
+            item.InType = info.InType;
+            item.OutType = info.OutType;
+            item.IsArray = info.IsArray;
+            item.ArrayIndex = info.ArrayIndex;
+            item.ArrayCount = info.ArrayCount;
+            item.ElementSize = info.ElementSize;
+            item.DataSize = info.DataSize;
+            item.DataOffset = info.Data ? static_cast<BYTE const*>(info.Data) - pbUserData : -1;
+            item.RawOffset = raw.Data ? static_cast<BYTE const*>(raw.Data) - pbUserData : -1;
+            item.RawSize = raw.DataSize;
+            if (item.State == EtwEnumeratorState_Value)
+            {
+                EtwStringView value;
+                ETW_CHECK(enumerator.FormatCurrentValue(&value));
+                item.Value = ToUtf8(value.Data, value.DataLength);
+            }
+
+            return item;
+        }
+
+        // Moves with MoveNext until it returns false or maxCount items have
+        // been visited.
+        static WalkResult
+        Walk(EtwEnumerator& enumerator, EVENT_RECORD const& record, unsigned maxCount = ~0u)
+        {
+            WalkResult result;
+            while (result.Items.size() != maxCount && enumerator.MoveNext())
+            {
+                result.Items.push_back(Item(enumerator, record));
+            }
+
+            result.FinalState = enumerator.State();
+            result.FinalError = enumerator.LastError();
+            return result;
+        }
+
+        // Moves with MoveNext or MoveNextSibling, as selected by the bits of
+        // pattern.
+        static WalkResult
+        MixedWalk(EtwEnumerator& enumerator, EVENT_RECORD const& record, unsigned pattern)
+        {
+            WalkResult result;
+            for (unsigned step = 0;; step += 1)
+            {
+                bool const sibling = (pattern >> (step % 32)) & 1;
+                if (!(sibling && enumerator.State() > EtwEnumeratorState_BeforeFirstItem
+                    ? enumerator.MoveNextSibling()
+                    : enumerator.MoveNext()))
+                {
+                    break;
+                }
+
+                result.Items.push_back(Item(enumerator, record));
+            }
+
+            result.FinalState = enumerator.State();
+            result.FinalError = enumerator.LastError();
+            return result;
+        }
+
+    private:
+
+        void
+        AddInt32s(TestEvent& event, unsigned count)
+        {
+            for (unsigned i = 0; i != count; i += 1)
+            {
+                event.Add(static_cast<UINT32>(m_rng()));
+            }
+        }
+    };
+
+    bool
+    IsPrefix(WalkResult const& prefix, WalkResult const& whole)
+    {
+        return prefix.Items.size() <= whole.Items.size()
+            && std::equal(prefix.Items.begin(), prefix.Items.end(), whole.Items.begin());
+    }
+}
+
+ETW_TEST(ItemTape_MatchesMoveNextWalk)
+{
+    TapeFixture f;
+    unsigned mismatches = 0;
+    unsigned errors = 0;
+
+    auto check = [&](bool ok, char const* szWhat, unsigned eventIndex)
+    {
+        if (!ok)
+        {
+            if (mismatches < 5)
+            {
+                printf("Mismatch: event %u, %s\n", eventIndex, szWhat);
+            }
+
+            mismatches += 1;
+        }
+    };
+
+    for (unsigned eventIndex = 0; eventIndex != 1500; eventIndex += 1)
+    {
+        TestEvent event = f.MakeEvent();
+        if (eventIndex % 4 == 3 && event.PayloadSize() != 0)
+        {
+            event.Truncate(f.Random(static_cast<unsigned>(event.PayloadSize())));
+        }
+
+        EVENT_RECORD const& record = event.Record();
+        bool const plans = eventIndex % 3 != 0;
+        f.Reference.SetDecodePlansEnabled(plans);
+        f.Taped.SetDecodePlansEnabled(plans);
+
+        ETW_CHECK(f.Reference.StartEvent(&record));
+        WalkResult const expected = TapeFixture::Walk(f.Reference, record);
+        errors += expected.FinalState == EtwEnumeratorState_Error;
+        unsigned const itemCount = static_cast<unsigned>(expected.Items.size());
+
+        // Record part of the tape, then Reset in the middle of it.
+        ETW_CHECK(f.Taped.StartEvent(&record));
+        WalkResult const recorded = TapeFixture::Walk(f.Taped, record, f.Random(itemCount + 2));
+        check(IsPrefix(recorded, expected), "recording", eventIndex);
+        f.Taped.Reset();
+        check(TapeFixture::Walk(f.Taped, record) == expected, "replay after Reset while recording", eventIndex);
+
+        // Reset in the middle of a replay.
+        f.Taped.Reset();
+        WalkResult const replayed = TapeFixture::Walk(f.Taped, record, f.Random(itemCount + 2));
+        check(IsPrefix(replayed, expected), "partial replay", eventIndex);
+        f.Taped.Reset();
+        check(TapeFixture::Walk(f.Taped, record) == expected, "replay after Reset while replaying", eventIndex);
+
+        // MoveNextSibling, both while recording and while replaying.
+        unsigned const pattern = static_cast<unsigned>(f.Random(0x7fffffff));
+        ETW_CHECK(f.Reference.StartEvent(&record));
+        WalkResult const expectedMixed = TapeFixture::MixedWalk(f.Reference, record, pattern);
+        ETW_CHECK(f.Taped.StartEvent(&record));
+        TapeFixture::Walk(f.Taped, record, f.Random(itemCount + 2));
+        f.Taped.Reset();
+        check(TapeFixture::MixedWalk(f.Taped, record, pattern) == expectedMixed, "mixed walk", eventIndex);
+        ETW_CHECK(f.Taped.StartEvent(&record));
+        check(TapeFixture::MixedWalk(f.Taped, record, pattern) == expectedMixed, "mixed walk while recording", eventIndex);
+
+        // GetFieldByIndex, then MoveNext to the end.
+        unsigned const propertyIndex = f.Random(12);
+        EtwItemInfo info;
+        ETW_CHECK(f.Reference.StartEvent(&record));
+        bool const expectedFound = f.Reference.GetFieldByIndex(propertyIndex, &info);
+        LSTATUS const expectedError = f.Reference.LastError();
+        WalkResult const expectedRest = expectedFound ? TapeFixture::Walk(f.Reference, record) : WalkResult();
+        f.Taped.Reset();
+        TapeFixture::Walk(f.Taped, record, f.Random(itemCount + 2));
+        bool const found = f.Taped.GetFieldByIndex(propertyIndex, &info);
+        check(found == expectedFound && f.Taped.LastError() == expectedError &&
+            (!found || TapeFixture::Walk(f.Taped, record) == expectedRest),
+            "GetFieldByIndex", eventIndex);
+
+        // Formatting replays the tape, and leaves it usable.
+        EtwStringViewZ text;
+        ETW_CHECK(f.Reference.StartEvent(&record));
+        bool const expectedOk = f.Reference.FormatCurrentEvent(L"[%9]", EtwJsonSuffixFlags_Default, &text);
+        std::string const expectedText = expectedOk ? ToUtf8(text.Data, text.DataLength) : std::string();
+        bool const expectedJsonOk = f.Reference.FormatCurrentEventAsJson(L"[%9]", EtwJsonSuffixFlags_Default, &text);
+        std::string const expectedJson = expectedJsonOk ? ToUtf8(text.Data, text.DataLength) : std::string();
+
+        ETW_CHECK(f.Taped.StartEvent(&record));
+        TapeFixture::Walk(f.Taped, record, f.Random(itemCount + 2));
+        bool const ok = f.Taped.FormatCurrentEvent(L"[%9]", EtwJsonSuffixFlags_Default, &text);
+        check(ok == expectedOk && (!ok || ToUtf8(text.Data, text.DataLength) == expectedText),
+            "FormatCurrentEvent", eventIndex);
+        bool const jsonOk = f.Taped.FormatCurrentEventAsJson(L"[%9]", EtwJsonSuffixFlags_Default, &text);
+        check(jsonOk == expectedJsonOk && (!jsonOk || ToUtf8(text.Data, text.DataLength) == expectedJson),
+            "FormatCurrentEventAsJson", eventIndex);
+        f.Taped.Reset();
+        check(TapeFixture::Walk(f.Taped, record) == expected, "replay after formatting", eventIndex);
+    }
+
+    ETW_CHECK(mismatches == 0);
+    ETW_CHECK(errors != 0);
+    ETW_CHECK(errors < 1500 / 2);
+}
+
+ETW_TEST(ItemTape_NewEvent)
+{
+    TapeFixture f;
+    TestEvent event1 = f.MakeEvent();
+    TestEvent event2 = f.MakeEvent();
+    EVENT_RECORD const& record1 = event1.Record();
+    EVENT_RECORD const& record2 = event2.Record();
+
+    // A tape from one event is not replayed for the next one.
+    ETW_CHECK(f.Reference.StartEvent(&record2));
+    WalkResult const expected = TapeFixture::Walk(f.Reference, record2);
+    ETW_CHECK(f.Taped.StartEvent(&record1));
+    TapeFixture::Walk(f.Taped, record1);
+    f.Taped.Reset();
+    ETW_CHECK(f.Taped.StartEvent(&record2));
+    ETW_CHECK(TapeFixture::Walk(f.Taped, record2) == expected);
+
+    // Disabling the tape takes effect on the next StartEvent.
+    f.Taped.SetItemTapeEnabled(false);
+    ETW_CHECK(!f.Taped.ItemTapeEnabled());
+    f.Taped.Reset();
+    ETW_CHECK(TapeFixture::Walk(f.Taped, record2) == expected);
+    ETW_CHECK(f.Taped.StartEvent(&record2));
+    ETW_CHECK(TapeFixture::Walk(f.Taped, record2) == expected);
+}
@@ -0,0 +1,268 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Differential tests for JSON string escaping (FindJsonEscape and
+AppendStringAsJson, which use SSE2 on x86 and x64). Strings are formatted
+with FormatCurrentItemAsJsonAndMoveNextSibling and compared with a scalar
+reference escaper (the per-character loop that AppendStringAsJson used
+before), and with fixed expected strings.
+*/
+
+#include "EtwTest.h"
+#include <random>
+
+using namespace EtwTest;
+
+namespace
+{
+    typedef std::vector<wchar_t> WideString;
+
+    // Reference: escape one character at a time.
+    WideString
+    ReferenceJson(WideString const& input)
+    {
+        static char const HexChars[] = "0123456789ABCDEF";
+        WideString result;
+        result.push_back(L'"');
+        for (wchar_t ch : input)
+        {
+            wchar_t escape = 0;
+            switch (ch)
+            {
+            case 8:  escape = L'b'; break;
+            case 9:  escape = L't'; break;
+            case 10: escape = L'n'; break;
+            case 12: escape = L'f'; break;
+            case 13: escape = L'r'; break;
+            case L'"':
+            case L'\\':
+                escape = ch;
+                break;
+            }
+
+            if (escape != 0)
+            {
+                result.push_back(L'\\');
+                result.push_back(escape);
+            }
+            else if (static_cast<USHORT>(ch) < 0x20)
+            {
+                result.push_back(L'\\');
+                result.push_back(L'u');
+                result.push_back(L'0');
+                result.push_back(L'0');
+                result.push_back(HexChars[ch >> 4]);
+                result.push_back(HexChars[ch & 0xF]);
+            }
+            else
+            {
+                result.push_back(ch);
+            }
+        }
+
+        result.push_back(L'"');
+        return result;
+    }
+
+    struct JsonEscapeFixture
+    {
+        TestSchema Schema;
+        TestCallbacks Callbacks;
+        EtwEnumerator Enumerator;
+
+        JsonEscapeFixture()
+            : Schema()
+            , Callbacks()
+            , Enumerator(Callbacks)
+        {
+            // Counted string: may contain nul.
+            Schema.Add("Value", Scalar(TDH_INTYPE_COUNTEDSTRING));
+            Callbacks.SetSchema(1, Schema);
+        }
+
+        WideString FormatJson(WideString const& input)
+        {
+            TestEvent event(1);
+            event.Add<UINT16>(static_cast<UINT16>(input.size() * sizeof(wchar_t)));
+            event.AddBytes(input.data(), input.size() * sizeof(wchar_t));
+
+            EtwStringViewZ json = {};
+            ETW_CHECK(Enumerator.StartEvent(&event.Record()));
+            ETW_CHECK(Enumerator.MoveNext());
+            ETW_CHECK(Enumerator.FormatCurrentItemAsJsonAndMoveNextSibling(EtwJsonItemFlags_None, &json));
+            return WideString(json.Data, json.Data + json.DataLength);
+        }
+
+        // Returns true if the formatted JSON matches the reference.
+        bool Check(WideString const& input)
+        {
+            return FormatJson(input) == ReferenceJson(input);
+        }
+    };
+
+    // Characters that must be escaped: every control character, '"', '\'.
+    WideString
+    EscapedChars()
+    {
+        WideString chars;
+        for (wchar_t ch = 0; ch != 0x20; ch += 1)
+        {
+            chars.push_back(ch);
+        }
+
+        chars.push_back(L'"');
+        chars.push_back(L'\\');
+        return chars;
+    }
+}
+
+ETW_TEST(JsonEscape_EachEscapeAtEachPosition)
+{
+    JsonEscapeFixture f;
+    unsigned failures = 0;
+
+    // Lengths and positions cover the 8-unit (SSE2) and 16-unit boundaries
+    // and the scalar tail.
+    for (unsigned length = 1; length != 41; length += 1)
+    {
+        for (wchar_t ch : EscapedChars())
+        {
+            for (unsigned pos = 0; pos != length; pos += 1)
+            {
+                WideString input(length, L'a');
+                input[pos] = ch;
+                failures += !f.Check(input);
+
+                // Two escapes: one at pos, one at the end.
+                input.back() = L'"';
+                failures += !f.Check(input);
+            }
+        }
+    }
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(JsonEscape_ExpectedStrings)
+{
+    JsonEscapeFixture f;
+
+    struct
+    {
+        char const* Input;
+        unsigned InputLength;
+        char const* Expected;
+    } const cases[] = {
+        { "", 0, R"("")" },
+        { "plain text", 10, R"("plain text")" },
+        { "\"", 1, R"("\"")" },
+        { "\\", 1, R"("\\")" },
+        { "a\"b\\c", 5, R"("a\"b\\c")" },
+        { "\b\t\n\f\r", 5, R"("\b\t\n\f\r")" },
+        { "\0\x01\x0B\x0E\x1F", 5, R"("\u0000\u0001\u000B\u000E\u001F")" },
+        { "/ \x7F", 3, "\"/ \x7F\"" },
+        { "0123456\n89abcdef\"", 17, R"("0123456\n89abcdef\"")" },
+        { "0123456789abcdefghijklmn\x1F", 25, R"("0123456789abcdefghijklmn\u001F")" },
+    };
+
+    for (auto const& c : cases)
+    {
+        WideString const input(c.Input, c.Input + c.InputLength);
+        WideString const json = f.FormatJson(input);
+        std::string const actual = ToUtf8(json.data(), json.size());
+        if (actual != c.Expected)
+        {
+            printf("  expected %s, got %s\n", c.Expected, actual.c_str());
+        }
+
+        ETW_CHECK(actual == c.Expected);
+    }
+
+    // Non-ASCII characters are not escaped.
+    WideString const input = { 0xE9, L'"', 0x4E2D, 0xD83D, 0xDE00 };
+    WideString const json = f.FormatJson(input);
+    ETW_CHECK(ToUtf8(json.data(), json.size()) ==
+        "\"\xC3\xA9\\\"\xE4\xB8\xAD\xF0\x9F\x98\x80\"");
+}
+
+ETW_TEST(JsonEscape_CleanStrings)
+{
+    JsonEscapeFixture f;
+
+    // Characters near the escape set that must not be escaped, including
+    // code units whose low or high byte is a control character, '"' or '\'.
+    WideString const clean = {
+        L' ', L'!', L'#', L'[', L']', 0x7F, 0x80, 0xFF, 0x100, 0x11F, 0x2200,
+        0x5C00, 0xFF1F, 0xFF22, 0xD800, 0xDBFF, 0xDC00, 0xDFFF, 0xFFFD, 0xFFFF,
+    };
+
+    unsigned failures = 0;
+    for (unsigned length = 0; length != 41; length += 1)
+    {
+        for (wchar_t ch : clean)
+        {
+            WideString const input(length, ch);
+            WideString const json = f.FormatJson(input);
+            failures += json != ReferenceJson(input);
+            failures += json.size() != length + 2; // Copied unchanged.
+        }
+    }
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(JsonEscape_UnpairedSurrogates)
+{
+    JsonEscapeFixture f;
+
+    // Surrogates are copied unchanged, paired or not.
+    WideString const input = {
+        0xD800, L'a', 0xDC00, 0xDC00, 0xD800, L'\n', 0xD83D, 0xDE00, 0xDBFF, 0xD800, L'"', 0xDFFF,
+        0xD800, 0xD800, 0xD800, 0xD800, 0xD800, 0xD800, 0xD800, 0x1F,
+    };
+
+    WideString const json = f.FormatJson(input);
+    ETW_CHECK(json == ReferenceJson(input));
+    ETW_CHECK(json.size() == input.size() + 2 + 1 + 1 + 5);
+}
+
+ETW_TEST(JsonEscape_Random)
+{
+    JsonEscapeFixture f;
+    std::mt19937 rng(6);
+
+    // A mix of clean ASCII, characters to escape, surrogates (paired and
+    // unpaired), and non-ASCII characters.
+    WideString palette = EscapedChars();
+    for (wchar_t ch : { L'a', L'z', L' ', L'/', wchar_t(0x7F), wchar_t(0xE9), wchar_t(0x4E2D),
+        wchar_t(0xD800), wchar_t(0xDBFF), wchar_t(0xDC00), wchar_t(0xDFFF), wchar_t(0xFF1F), wchar_t(0xFFFF) })
+    {
+        // Clean characters are more common than escapes.
+        palette.insert(palette.end(), 6, ch);
+    }
+
+    unsigned failures = 0;
+    for (unsigned i = 0; i != 20000; i += 1)
+    {
+        // Lengths around multiples of 8, up to 74.
+        unsigned length = 8 * (rng() % 10) + rng() % 3;
+        if (length != 0 && i % 2 != 0)
+        {
+            length -= 1;
+        }
+
+        WideString input;
+        for (unsigned j = 0; j < length; j += 1)
+        {
+            // Sometimes a long clean run, sometimes a random character.
+            input.push_back(rng() % 4 == 0
+                ? palette[rng() % palette.size()]
+                : static_cast<wchar_t>(L'A' + rng() % 26));
+        }
+
+        failures += !f.Check(input);
+    }
+
+    ETW_CHECK(failures == 0);
+}
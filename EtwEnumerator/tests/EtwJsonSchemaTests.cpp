@@ -0,0 +1,398 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for WriteCurrentEventAsSchemaJsonUtf8 and EtwJsonRehydrator. Streams
+of schema JSON records are rehydrated and compared with the output of
+WriteCurrentEventAsJsonUtf8 for the same events. The events cover arrays,
+structs, arrays of structs, names that need escaping, TraceLogging
+metadata (part of the schema key), different versions of an event, and
+per-event metadata that is present, omitted, or selected by the event's
+header flags (ptime, ktime/utime, relatedActivity).
+*/
+
+#include "EtwTest.h"
+#include <stdio.h>
+
+using namespace EtwTest;
+
+namespace
+{
+    struct CollectingSink final
+        : EtwOutputSink
+    {
+        std::string Output;
+        unsigned WriteCount = 0;
+
+        LSTATUS __stdcall Write(
+            _In_reads_bytes_(cb) void const* pb,
+            unsigned cb) noexcept override
+        {
+            Output.append(static_cast<char const*>(pb), cb);
+            WriteCount += 1;
+            return ERROR_SUCCESS;
+        }
+    };
+
+    std::vector<std::string>
+    SplitLines(std::string const& text)
+    {
+        std::vector<std::string> lines;
+        size_t start = 0;
+        for (size_t pos; (pos = text.find('\n', start)) != std::string::npos; start = pos + 1)
+        {
+            lines.push_back(text.substr(start, pos + 1 - start));
+        }
+
+        ETW_CHECK(start == text.size());
+        return lines;
+    }
+
+    bool
+    IsSchemaRecord(std::string const& line)
+    {
+        return line.compare(0, 10, "{\"schema\":") == 0;
+    }
+
+    // Returns the rehydrated stream, or "(error N)" for the first record
+    // that fails.
+    std::string
+    Rehydrate(
+        EtwJsonRehydrator& rehydrator,
+        std::string const& stream)
+    {
+        CollectingSink sink;
+        for (auto const& line : SplitLines(stream))
+        {
+            unsigned const writeCount = sink.WriteCount;
+            LSTATUS const status = rehydrator.RehydrateRecord(
+                line.data(), static_cast<unsigned>(line.size()), sink);
+            if (status != ERROR_SUCCESS)
+            {
+                return "(error " + std::to_string(status) + ")";
+            }
+
+            // One Write per event record, none for a schema record.
+            ETW_CHECK(sink.WriteCount == writeCount + (IsSchemaRecord(line) ? 0u : 1u));
+        }
+
+        return sink.Output;
+    }
+
+    LSTATUS
+    RehydrateOne(
+        EtwJsonRehydrator& rehydrator,
+        std::string const& record,
+        _Out_ std::string* pOutput)
+    {
+        CollectingSink sink;
+        LSTATUS const status = rehydrator.RehydrateRecord(
+            record.data(), static_cast<unsigned>(record.size()), sink);
+        *pOutput = sink.Output;
+        return status;
+    }
+
+    struct SchemaJsonFixture
+    {
+        TestSchema Schema1;
+        TestSchema Schema2;
+        TestSchema Schema3;
+        TestCallbacks Callbacks;
+        EtwEnumerator Enumerator;
+        std::vector<TestEvent> Events;
+        std::vector<EVENT_RECORD const*> Records;
+        GUID RelatedActivity;
+        EVENT_HEADER_EXTENDED_DATA_ITEM RelatedActivityItem;
+
+        SchemaJsonFixture()
+            : Schema1("SchemaProvider", "Request")
+            , Schema2("SchemaProvider", "Batch")
+            , Schema3("SchemaProvider", "Empty")
+            , Callbacks()
+            , Enumerator(Callbacks)
+            , Events()
+            , Records()
+            , RelatedActivity{ 0xA1B2C3D4, 0x1111, 0x2222, { 1, 2, 3, 4, 5, 6, 7, 8 } }
+            , RelatedActivityItem()
+        {
+            Schema1.Add("Url", Scalar(TDH_INTYPE_UNICODESTRING));                 // 0
+            Schema1.Add("Status", Scalar(TDH_INTYPE_UINT32));                     // 1
+            Schema1.Add("Na\"me\\", Scalar(TDH_INTYPE_ANSISTRING));               // 2
+            Schema1.Add("Count", Scalar(TDH_INTYPE_UINT16));                      // 3
+            Schema1.Add("Samples", CountedArray(TDH_INTYPE_INT32, 3));            // 4
+            Schema1.Add("Point", Struct(6, 2));                                   // 5
+            Schema1.Add("X", Scalar(TDH_INTYPE_DOUBLE));                          // 6
+            Schema1.Add("Y", Scalar(TDH_INTYPE_FLOAT));                           // 7
+            Schema1.SetTopLevelCount(6);
+
+            Schema2.Add("Session", Scalar(TDH_INTYPE_GUID));                      // 0
+            Schema2.Add("Count", Scalar(TDH_INTYPE_UINT8));                       // 1
+            Schema2.Add("Items", CountedStruct(4, 2, 1));                         // 2
+            Schema2.Add("Flags", Scalar(TDH_INTYPE_HEXINT32, TDH_OUTTYPE_NULL, 2)); // 3
+            Schema2.Add("Id", Scalar(TDH_INTYPE_UINT64));                         // 4
+            Schema2.Add("Inner", Struct(6, 1));                                   // 5
+            Schema2.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));                // 6
+            Schema2.SetTopLevelCount(4);
+
+            Callbacks.SetSchema(1, Schema1);
+            Callbacks.SetSchema(2, Schema2);
+            Callbacks.SetSchema(3, Schema3);
+
+            static BYTE const metadataA[] = { 5, 0, 'A', 0, 0 };
+            static BYTE const metadataB[] = { 5, 0, 'B', 0, 0 };
+
+            for (unsigned i = 0; i != 12; i += 1)
+            {
+                USHORT const eventId =
+                    i == 1 || i == 8 ? 2
+                    : i == 4 ? 3
+                    : 1;
+                Events.emplace_back(eventId, 132000000000000000 + i * 10001234ull);
+                auto& event = Events.back();
+
+                if (eventId == 1)
+                {
+                    char url[40];
+                    snprintf(url, sizeof(url), "https://example.com/\"%u\"\n", i);
+                    event.AddString(url).Add<UINT32>(200 + i).AddAnsiString("a\\b")
+                        .Add<UINT16>(static_cast<UINT16>(i % 3));
+                    for (unsigned j = 0; j != i % 3; j += 1)
+                    {
+                        event.Add<INT32>(-static_cast<INT32>(i * j));
+                    }
+
+                    event.Add<double>(i * 0.5).Add<float>(1.25f);
+                }
+                else if (eventId == 2)
+                {
+                    event.Add(GUID{ i, 2, 3, { 4, 5, 6, 7, 8, 9, 10, 11 } }).Add<UINT8>(2)
+                        .Add<UINT64>(i).AddString("first").Add<UINT32>(1).Add<UINT32>(2)
+                        .Add<UINT64>(i + 1).AddString("").Add<UINT32>(3).Add<UINT32>(4);
+                }
+
+                if (i == 5 || i == 7)
+                {
+                    event.SetSchemaTl(metadataA, sizeof(metadataA));
+                }
+                else if (i == 6)
+                {
+                    event.SetSchemaTl(metadataB, sizeof(metadataB));
+                }
+            }
+
+            for (auto& event : Events)
+            {
+                Records.push_back(&event.Record());
+            }
+
+            for (unsigned i = 0; i != Events.size(); i += 1)
+            {
+                auto& header = Events[i].Record().EventHeader;
+                header.ThreadId = 100 + i;
+                header.KernelTime = 30 * i;
+                header.UserTime = 40 * i;
+                header.EventDescriptor.Level = 4;
+                header.EventDescriptor.Keyword = 0x8000;
+                header.ActivityId = GUID{ i, 0, 0, { 0, 0, 0, 0, 0, 0, 0, 1 } };
+            }
+
+            auto& versioned = Events[3].Record();
+            versioned.EventHeader.EventDescriptor.Version = 1;
+            versioned.EventHeader.ProcessId = 0xFFFFFFFF;
+            versioned.EventHeader.ThreadId = 0xFFFFFFFF;
+            versioned.EventHeader.ActivityId = GUID();
+
+            auto& related = Events[8].Record();
+            RelatedActivityItem.ExtType = EVENT_HEADER_EXT_TYPE_RELATED_ACTIVITYID;
+            RelatedActivityItem.DataSize = sizeof(RelatedActivity);
+            RelatedActivityItem.DataPtr = reinterpret_cast<ULONGLONG>(&RelatedActivity);
+            related.EventHeader.Flags |= EVENT_HEADER_FLAG_EXTENDED_INFO;
+            related.ExtendedDataCount = 1;
+            related.ExtendedData = &RelatedActivityItem;
+
+            Events[9].Record().EventHeader.Flags |= EVENT_HEADER_FLAG_PRIVATE_SESSION;
+            Events[9].Record().EventHeader.ProcessorTime = 12345;
+            Events[10].Record().EventHeader.Flags |= EVENT_HEADER_FLAG_NO_CPUTIME;
+            return;
+        }
+
+        // The JSON stream from WriteCurrentEventAsJsonUtf8, one event per line.
+        std::string
+        JsonStream(std::vector<EtwJsonSuffixFlags> const& flags)
+        {
+            CollectingSink sink;
+            for (unsigned i = 0; i != Records.size(); i += 1)
+            {
+                ETW_CHECK(Enumerator.StartEvent(Records[i]));
+                ETW_CHECK(Enumerator.WriteCurrentEventAsJsonUtf8(sink, nullptr, flags[i % flags.size()]));
+                sink.Output += '\n';
+            }
+
+            return sink.Output;
+        }
+
+        // The schema JSON stream from WriteCurrentEventAsSchemaJsonUtf8.
+        std::string
+        SchemaJsonStream(
+            EtwJsonSchemaTable& schemas,
+            std::vector<EtwJsonSuffixFlags> const& flags)
+        {
+            CollectingSink sink;
+            for (unsigned i = 0; i != Records.size(); i += 1)
+            {
+                unsigned const writeCount = sink.WriteCount;
+                ETW_CHECK(Enumerator.StartEvent(Records[i]));
+                ETW_CHECK(Enumerator.WriteCurrentEventAsSchemaJsonUtf8(schemas, sink, flags[i % flags.size()]));
+                ETW_CHECK(sink.WriteCount == writeCount + 1);
+            }
+
+            return sink.Output;
+        }
+    };
+
+    auto const SomeDynamicFlags = static_cast<EtwJsonSuffixFlags>(
+        EtwJsonSuffixFlags_time | EtwJsonSuffixFlags_pid | EtwJsonSuffixFlags_event);
+}
+
+ETW_TEST(SchemaJson_RehydratesToJson)
+{
+    SchemaJsonFixture f;
+
+    std::vector<std::vector<EtwJsonSuffixFlags>> const flagSets = {
+        { EtwJsonSuffixFlags_Default },
+        { EtwJsonSuffixFlags_All },
+        { EtwJsonSuffixFlags_None },
+        { SomeDynamicFlags },
+        { EtwJsonSuffixFlags_Default, EtwJsonSuffixFlags_None, SomeDynamicFlags }, // Mixed in one stream.
+    };
+
+    for (auto const& flags : flagSets)
+    {
+        EtwJsonSchemaTable schemas;
+        EtwJsonRehydrator rehydrator;
+        std::string const json = f.JsonStream(flags);
+        std::string const schemaJson = f.SchemaJsonStream(schemas, flags);
+        ETW_CHECK(Rehydrate(rehydrator, schemaJson) == json);
+
+        // A schema record precedes the first event of each schema, with
+        // IDs in order.
+        unsigned schemaCount = 0;
+        char prefix[32];
+        for (auto const& line : SplitLines(schemaJson))
+        {
+            if (IsSchemaRecord(line))
+            {
+                snprintf(prefix, sizeof(prefix), "{\"schema\":%u,", schemaCount);
+                ETW_CHECK(line.compare(0, strlen(prefix), prefix) == 0);
+                schemaCount += 1;
+            }
+            else
+            {
+                ETW_CHECK(line[0] == '[');
+            }
+        }
+
+        ETW_CHECK(schemas.Count() == schemaCount);
+        ETW_CHECK(SplitLines(schemaJson).size() == f.Records.size() + schemaCount);
+    }
+
+    // The events have each kind of per-event metadata.
+    std::string const json = f.JsonStream({ EtwJsonSuffixFlags_All });
+    for (char const* szName : { "\"time\":", "\"cpu\":", "\"pid\":", "\"tid\":", "\"activity\":",
+        "\"relatedActivity\":", "\"ptime\":12345", "\"ktime\":", "\"utime\":" })
+    {
+        ETW_CHECK(json.find(szName) != std::string::npos);
+    }
+
+    // Six schemas: events 1, 2 and 3, event 1 version 1, and event 1 with
+    // TraceLogging metadata A and B. The flags are part of the key.
+    EtwJsonSchemaTable schemas;
+    f.SchemaJsonStream(schemas, { EtwJsonSuffixFlags_Default });
+    ETW_CHECK(schemas.Count() == 6);
+    f.SchemaJsonStream(schemas, { EtwJsonSuffixFlags_Default });
+    ETW_CHECK(schemas.Count() == 6);
+    f.SchemaJsonStream(schemas, { EtwJsonSuffixFlags_None });
+    ETW_CHECK(schemas.Count() == 12);
+}
+
+ETW_TEST(SchemaJson_NewStream)
+{
+    SchemaJsonFixture f;
+    EtwJsonSchemaTable schemas;
+    EtwJsonRehydrator rehydrator;
+    std::string const json = f.JsonStream({ EtwJsonSuffixFlags_Default });
+
+    std::string const first = f.SchemaJsonStream(schemas, { EtwJsonSuffixFlags_Default });
+    ETW_CHECK(Rehydrate(rehydrator, first) == json);
+
+    // The same table: no schema records.
+    std::string const second = f.SchemaJsonStream(schemas, { EtwJsonSuffixFlags_Default });
+    ETW_CHECK(second.find("{\"schema\":") == std::string::npos);
+    ETW_CHECK(second.size() < first.size());
+    ETW_CHECK(Rehydrate(rehydrator, second) == json);
+
+    // A cleared table starts at ID 0 again, and the schema records replace
+    // the rehydrator's schemas with the same ID.
+    schemas.Clear();
+    ETW_CHECK(schemas.Count() == 0);
+    std::string const reordered = f.SchemaJsonStream(schemas, { EtwJsonSuffixFlags_All });
+    ETW_CHECK(reordered.compare(0, 11, "{\"schema\":0") == 0);
+    ETW_CHECK(Rehydrate(rehydrator, reordered) == f.JsonStream({ EtwJsonSuffixFlags_All }));
+
+    // A cleared rehydrator does not know the schemas.
+    rehydrator.Clear();
+    std::string output;
+    ETW_CHECK(RehydrateOne(rehydrator, SplitLines(second)[0], &output) == ERROR_INVALID_DATA);
+    ETW_CHECK(output.empty());
+}
+
+ETW_TEST(SchemaJson_InvalidRecords)
+{
+    SchemaJsonFixture f;
+    EtwJsonSchemaTable schemas;
+    EtwJsonRehydrator rehydrator;
+    auto const lines = SplitLines(f.SchemaJsonStream(schemas, { EtwJsonSuffixFlags_Default }));
+    ETW_CHECK(IsSchemaRecord(lines[0]) && !IsSchemaRecord(lines[1]));
+
+    std::string output;
+    ETW_CHECK(RehydrateOne(rehydrator, lines[1], &output) == ERROR_INVALID_DATA); // Unknown schema.
+    ETW_CHECK(RehydrateOne(rehydrator, lines[0], &output) == ERROR_SUCCESS);
+    ETW_CHECK(output.empty());
+    ETW_CHECK(RehydrateOne(rehydrator, "\n", &output) == ERROR_SUCCESS);         // Blank.
+    ETW_CHECK(output.empty());
+
+    std::string expected;
+    ETW_CHECK(RehydrateOne(rehydrator, lines[1], &expected) == ERROR_SUCCESS);
+    ETW_CHECK(!expected.empty() && expected.back() == '\n');
+
+    // Without the trailing '\n'.
+    ETW_CHECK(RehydrateOne(rehydrator, lines[1].substr(0, lines[1].size() - 1), &output) == ERROR_SUCCESS);
+    ETW_CHECK(output == expected);
+
+    // Truncated records and wrong value counts write nothing.
+    for (size_t cch = 1; cch < lines[1].size() - 1; cch += 1)
+    {
+        LSTATUS const status = RehydrateOne(rehydrator, lines[1].substr(0, cch), &output);
+        ETW_CHECK(status == ERROR_INVALID_DATA);
+        ETW_CHECK(output.empty());
+    }
+
+    // One value per field, and per struct member.
+    std::string const record = lines[1];
+    ETW_CHECK(record.compare(0, 4, "[0,[") == 0);
+    ETW_CHECK(record.find(",[0,1.25]],") != std::string::npos);
+    std::string const extraValue = "[0,[1," + record.substr(4);
+    std::string missingMember = record;
+    missingMember.replace(record.find(",[0,1.25]],"), 11, ",[0]],");
+    ETW_CHECK(RehydrateOne(rehydrator, extraValue, &output) == ERROR_INVALID_DATA);
+    ETW_CHECK(RehydrateOne(rehydrator, missingMember, &output) == ERROR_INVALID_DATA);
+    ETW_CHECK(RehydrateOne(rehydrator, "[0,[]]", &output) == ERROR_INVALID_DATA);
+    ETW_CHECK(RehydrateOne(rehydrator, "[99,[]]", &output) == ERROR_INVALID_DATA);
+    ETW_CHECK(RehydrateOne(rehydrator, "{\"schema\":", &output) == ERROR_INVALID_DATA);
+    ETW_CHECK(RehydrateOne(rehydrator, "not json", &output) == ERROR_INVALID_DATA);
+    ETW_CHECK(output.empty());
+
+    // The stored schema is still usable.
+    ETW_CHECK(RehydrateOne(rehydrator, lines[1], &output) == ERROR_SUCCESS);
+    ETW_CHECK(output == expected);
+}
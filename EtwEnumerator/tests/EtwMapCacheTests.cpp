@@ -0,0 +1,191 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for the map cache (SetMapCacheCapacity, ClearMapCache) and for
+FormatMapValueUsingIndex. Values formatted with a cached, indexed map must
+match the values formatted by FormatMapValue without the cache.
+*/
+
+#include "EtwTest.h"
+
+using namespace EtwTest;
+
+namespace
+{
+    unsigned const MapCount = 6; // Number of distinct map names in the schema.
+
+    struct MapCacheFixture
+    {
+        TestMap DenseMap;
+        TestMap SparseMap;
+        TestMap BitMap;
+        TestMap IndexedMap;
+        TestMap WbemFlagMap;
+        TestSchema Schema;
+        TestCallbacks Callbacks;
+        EtwEnumerator Enumerator;
+
+        MapCacheFixture()
+            : DenseMap()
+            , SparseMap()
+            , BitMap(EVENTMAP_INFO_FLAG_MANIFEST_BITMAP)
+            , IndexedMap(static_cast<MAP_FLAGS>(EVENTMAP_INFO_FLAG_WBEM_VALUEMAP | EVENTMAP_INFO_FLAG_WBEM_NO_MAP))
+            , WbemFlagMap(static_cast<MAP_FLAGS>(EVENTMAP_INFO_FLAG_WBEM_VALUEMAP | EVENTMAP_INFO_FLAG_WBEM_FLAG))
+            , Schema()
+            , Callbacks()
+            , Enumerator(Callbacks)
+        {
+            // Unsorted values 1..7 with trailing spaces (trimmed on output).
+            DenseMap.Add(3, "Three").Add(1, "One").Add(2, "Two  ").Add(7, "Seven")
+                .Add(4, "Four").Add(6, "Six").Add(5, "Five");
+
+            // Sparse values, with a duplicate (the first entry wins).
+            SparseMap.Add(100, "Hundred").Add(1, "One").Add(0xFFFFFFFF, "Max")
+                .Add(5000, "FiveThousand").Add(100, "DuplicateHundred");
+
+            // Single bits, a multi-bit entry, and a zero entry.
+            BitMap.Add(0, "None").Add(1, "A").Add(2, "B").Add(6, "BC")
+                .Add(4, "C").Add(0x80000000, "High");
+
+            IndexedMap.Add(0, "Zero").Add(1, "One").Add(2, "Two").Add(3, "Three");
+
+            WbemFlagMap.Add(1, "Read").Add(2, "Write").Add(0x10, "Exec");
+
+            Schema.Add("Dense", Scalar(TDH_INTYPE_UINT32), "DenseMap");
+            Schema.Add("Sparse", Scalar(TDH_INTYPE_UINT32, TDH_OUTTYPE_HEXINT32), "SparseMap");
+            Schema.Add("Bits", Scalar(TDH_INTYPE_HEXINT32), "BitMap");
+            Schema.Add("Indexed", Scalar(TDH_INTYPE_UINT16), "IndexedMap");
+            Schema.Add("WbemFlag", Scalar(TDH_INTYPE_UINT8, TDH_OUTTYPE_HEXINT8), "WbemFlagMap");
+            Schema.Add("Missing", Scalar(TDH_INTYPE_UINT32), "MissingMap");
+            Callbacks.SetSchema(1, Schema);
+            Callbacks.SetMap("DenseMap", DenseMap);
+            Callbacks.SetMap("SparseMap", SparseMap);
+            Callbacks.SetMap("BitMap", BitMap);
+            Callbacks.SetMap("IndexedMap", IndexedMap);
+            Callbacks.SetMap("WbemFlagMap", WbemFlagMap);
+        }
+
+        // Formats every field of an event in which every field has the
+        // specified value (truncated to the field's size).
+        std::vector<std::string> Format(UINT32 value)
+        {
+            std::vector<std::string> result;
+
+            TestEvent event(1);
+            event.Add<UINT32>(value).Add<UINT32>(value).Add<UINT32>(value)
+                .Add<UINT16>(static_cast<UINT16>(value))
+                .Add<UINT8>(static_cast<UINT8>(value))
+                .Add<UINT32>(value);
+            ETW_CHECK(Enumerator.StartEvent(&event.Record()));
+            while (Enumerator.MoveNext())
+            {
+                EtwStringView str;
+                ETW_CHECK(Enumerator.FormatCurrentValue(&str));
+                result.push_back(ToUtf8(str.Data, str.DataLength));
+            }
+
+            ETW_CHECK(Enumerator.State() == EtwEnumeratorState_AfterLastItem);
+            return result;
+        }
+    };
+
+    UINT32 const TestValues[] = {
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 0x10, 0x11, 0x17, 99, 100, 101, 5000,
+        0x100, 0x8000, 0xFFFF, 0x80000000, 0x80000006, 0xFFFFFFFE, 0xFFFFFFFF,
+    };
+}
+
+ETW_TEST(MapCache_IndexedMatchesUncached)
+{
+    MapCacheFixture uncached;
+    uncached.Enumerator.SetMapCacheCapacity(0);
+
+    MapCacheFixture cached;
+
+    MapCacheFixture indexed;
+    indexed.Callbacks.UseMapIndex = true;
+
+    unsigned formatCount = 0;
+    for (UINT32 value : TestValues)
+    {
+        auto const expected = uncached.Format(value);
+        ETW_CHECK(expected.size() == MapCount);
+        ETW_CHECK(cached.Format(value) == expected);
+        ETW_CHECK(indexed.Format(value) == expected);
+        formatCount += 1;
+    }
+
+    // Without the cache, every formatted value looks up its map. With the
+    // cache, each map (including the missing one) is looked up once.
+    ETW_CHECK(uncached.Callbacks.MapLookupCount == formatCount * MapCount);
+    ETW_CHECK(cached.Callbacks.MapLookupCount == MapCount);
+    ETW_CHECK(indexed.Callbacks.MapLookupCount == MapCount);
+}
+
+ETW_TEST(MapCache_ExpectedOutput)
+{
+    MapCacheFixture f;
+    f.Callbacks.UseMapIndex = true;
+
+    auto result = f.Format(2);
+    ETW_CHECK(result.size() == MapCount);
+    if (result.size() == MapCount)
+    {
+        ETW_CHECK(result[0] == "2(Two)");
+        ETW_CHECK(result[1] == "0x2(??)");
+        ETW_CHECK(result[2] == "0x2[B]");
+        ETW_CHECK(result[3] == "2(Two)");
+        ETW_CHECK(result[4] == "0x2[Write]");
+        ETW_CHECK(result[5] == "2");
+    }
+
+    result = f.Format(100);
+    if (result.size() == MapCount)
+    {
+        ETW_CHECK(result[0] == "100(??)");
+        ETW_CHECK(result[1] == "0x64(Hundred)");
+        ETW_CHECK(result[2] == "0x64[C,0x60]");
+        ETW_CHECK(result[3] == "100(??)");
+    }
+
+    result = f.Format(0x80000006);
+    if (result.size() == MapCount)
+    {
+        ETW_CHECK(result[2] == "0x80000006[B,BC,C,High]");
+    }
+
+    result = f.Format(0);
+    if (result.size() == MapCount)
+    {
+        ETW_CHECK(result[2] == "0x0[None]");
+        ETW_CHECK(result[4] == "0x0[]");
+    }
+}
+
+ETW_TEST(MapCache_ClearAndCapacity)
+{
+    MapCacheFixture f;
+
+    f.Format(1);
+    f.Format(2);
+    ETW_CHECK(f.Callbacks.MapLookupCount == MapCount);
+
+    f.Enumerator.ClearMapCache();
+    auto const expected = f.Format(3);
+    ETW_CHECK(f.Callbacks.MapLookupCount == 2 * MapCount);
+
+    // When the cache is full, it is cleared before inserting, so a capacity
+    // smaller than the number of maps never hits for all of them.
+    f.Enumerator.SetMapCacheCapacity(2);
+    unsigned const before = f.Callbacks.MapLookupCount;
+    ETW_CHECK(f.Format(3) == expected);
+    ETW_CHECK(f.Format(3) == expected);
+    ETW_CHECK(f.Callbacks.MapLookupCount > before + MapCount);
+
+    f.Enumerator.SetMapCacheCapacity(MapCount);
+    unsigned const filled = f.Callbacks.MapLookupCount + MapCount;
+    ETW_CHECK(f.Format(3) == expected);
+    ETW_CHECK(f.Format(3) == expected);
+    ETW_CHECK(f.Callbacks.MapLookupCount == filled);
+}
@@ -0,0 +1,343 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for the compiled event message cache (SetMessageCacheCapacity,
+ClearMessageCache). Messages formatted from a cached compiled message (cache
+hits) and from a newly compiled one (cache misses) must match the output of
+an enumerator with the cache disabled, which parses the message for every
+event.
+*/
+
+#include "EtwTest.h"
+#include <random>
+#include <stdio.h>
+
+using namespace EtwTest;
+
+namespace
+{
+    typedef std::vector<wchar_t> WideString;
+
+    // Returns a nul-terminated copy of an ASCII string.
+    WideString
+    Widen(std::string const& str)
+    {
+        WideString result(str.begin(), str.end());
+        result.push_back(0);
+        return result;
+    }
+
+    struct Result
+    {
+        bool Ok;
+        LSTATUS Error;
+        std::string Text;
+
+        bool operator==(Result const& other) const
+        {
+            return Ok == other.Ok && Error == other.Error && Text == other.Text;
+        }
+
+        bool operator!=(Result const& other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    struct MessageCacheFixture
+    {
+        TestMap FlagsMap;
+        TestSchema Schema;
+        TestCallbacks Callbacks;
+        EtwEnumerator Enumerator;
+
+        MessageCacheFixture()
+            : FlagsMap(EVENTMAP_INFO_FLAG_MANIFEST_BITMAP)
+            , Schema("MessageProvider", "MessageEvent")
+            , Callbacks()
+            , Enumerator(Callbacks)
+        {
+            FlagsMap.Add(1, "Read").Add(2, "Write").Add(4, "Exec");
+
+            Schema.Add("Count", Scalar(TDH_INTYPE_UINT16));                      // 0 (%1)
+            Schema.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));                // 1 (%2)
+            Schema.Add("Flags", Scalar(TDH_INTYPE_HEXINT32), "FlagsMap");        // 2 (%3)
+            Schema.Add("Big", Scalar(TDH_INTYPE_INT64));                         // 3 (%4)
+            Schema.Add("Values", CountedArray(TDH_INTYPE_UINT16, 0));            // 4 (%5)
+            Schema.Add("Pt", Struct(7, 2));                                      // 5 (%6)
+            Schema.Add("Text", Scalar(TDH_INTYPE_ANSISTRING));                   // 6 (%7)
+            Schema.Add("X", Scalar(TDH_INTYPE_UINT8));                           // 7
+            Schema.Add("Y", Scalar(TDH_INTYPE_INT8));                            // 8
+            Schema.SetTopLevelCount(7);
+            Callbacks.SetSchema(1, Schema);
+            Callbacks.SetMap("FlagsMap", FlagsMap);
+            Callbacks.SetParameterMessage(1, "param one [%1]");
+            Callbacks.SetParameterMessage(2, "param two");
+            Callbacks.SetParameterMessage(3, "nested %%2 %7");
+        }
+
+        Result FormatWithMessage(
+            TestEvent& event,
+            _In_opt_z_ EtwPCWSTR szPrefix,
+            _In_z_ EtwPCWSTR szMessage)
+        {
+            Result result;
+            EtwStringViewZ str = {};
+            ETW_CHECK(Enumerator.StartEvent(&event.Record()));
+            result.Ok = Enumerator.FormatCurrentEventWithMessage(szPrefix, szMessage, &str);
+            result.Error = Enumerator.LastError();
+            result.Text = ToUtf8(str.Data, str.DataLength);
+            return result;
+        }
+
+        Result FormatEvent(
+            TestEvent& event,
+            _In_opt_z_ EtwPCWSTR szPrefix)
+        {
+            Result result;
+            EtwStringViewZ str = {};
+            ETW_CHECK(Enumerator.StartEvent(&event.Record()));
+            result.Ok = Enumerator.FormatCurrentEvent(szPrefix, EtwJsonSuffixFlags_Default, &str);
+            result.Error = Enumerator.LastError();
+            result.Text = ToUtf8(str.Data, str.DataLength);
+            return result;
+        }
+    };
+
+    // Events with string values that are plain, contain inserts (expanded
+    // recursively unless !S! or another format is used), or are malformed.
+    std::vector<TestEvent>
+    TestEvents()
+    {
+        static char const* const names[] = {
+            "plain", "", "has %1 insert", "param %%2", "pct %!PCT! %!TID!", "bad %", "%%99",
+        };
+
+        std::vector<TestEvent> events;
+        for (UINT16 i = 0; i != sizeof(names) / sizeof(names[0]); i += 1)
+        {
+            TestEvent event(1, 0x01D3C9E5A1B2C3D4 + i * 12345);
+            UINT16 const count = i % 4;
+            event.Add<UINT16>(count);
+            event.AddString(names[i]);
+            event.Add<UINT32>(i * 3u);
+            event.Add<INT64>(-1234567890123 * i);
+            for (UINT16 j = 0; j != count; j += 1)
+            {
+                event.Add<UINT16>(static_cast<UINT16>(j * 1000));
+            }
+
+            event.Add<UINT8>(static_cast<UINT8>(i)).Add<INT8>(static_cast<INT8>(-i));
+            event.AddAnsiString(i % 2 ? "ansi %2" : "ansi");
+            events.push_back(event);
+        }
+
+        return events;
+    }
+
+    char const* const FixedMessages[] = {
+        "",
+        "literal only",
+        "%1 %2 %3 %4 %5 %6 %7",
+        "%3!08x! %1!u! %4!I64d! %4!lld! %2!s! %2!S! %7!hs!",
+        "%!PROVIDER!/%!EVENT! tid=%!TID! pid=%!PID! cpu=%!CPU! at %!TIME! %!LEVEL! %!FLAGS!",
+        "%!PCT!%!PERCENT!%!BANG!%!EXCLAMATION! %!UNKNOWN! %!TIME %!",
+        "%%1 and %%2 and %%3",
+        "%%99 missing",
+        "%0 %8 %10 %99 %1%2%3",
+        "% %% %%% %%%1 %n %t %r %b %. %! !x! %1! %1!08 %1!!",
+        "trailing spaces   ",
+        "tab\tnewline\ncr\r%1%",
+    };
+
+    char const* const Tokens[] = {
+        "abc", " ", "%1", "%2", "%3", "%4", "%5", "%6", "%7", "%8", "%0", "%10",
+        "%3!08x!", "%2!S!", "%2!s!", "%4!I64d!", "%1!5u!", "%1!-5d!", "%4!llx!",
+        "%!PROVIDER!", "%!EVENT!", "%!TID!", "%!TIME!", "%!PCT!", "%!BANG!", "%!FOO!",
+        "%!", "%", "%%", "%%1", "%%2", "%%3", "%%99", "%%%1", "!", "!x!", "%1!", "%1!08",
+        "%n", "%t", "%r", "%b", "%.", "%!TIME", "\t", "  ",
+    };
+
+    std::vector<std::string>
+    TestMessages(unsigned randomCount)
+    {
+        std::vector<std::string> messages(std::begin(FixedMessages), std::end(FixedMessages));
+        std::mt19937 rng(10);
+        for (unsigned i = 0; i != randomCount; i += 1)
+        {
+            std::string message;
+            unsigned const tokenCount = rng() % 12;
+            for (unsigned j = 0; j != tokenCount; j += 1)
+            {
+                message += Tokens[rng() % (sizeof(Tokens) / sizeof(Tokens[0]))];
+            }
+
+            messages.push_back(message);
+        }
+
+        return messages;
+    }
+
+    EtwPCWSTR const TestPrefixes[] = {
+        nullptr,
+        L"[%9]%8.%3::%4 [%1]",
+    };
+}
+
+ETW_TEST(MessageCache_HitsAndMissesMatchUncached)
+{
+    MessageCacheFixture uncached;
+    uncached.Enumerator.SetMessageCacheCapacity(0);
+    MessageCacheFixture cached;
+    auto events = TestEvents();
+    unsigned failures = 0;
+
+    for (auto const& message : TestMessages(3000))
+    {
+        WideString const wide = Widen(message);
+        for (EtwPCWSTR szPrefix : TestPrefixes)
+        {
+            // The first event compiles the message (miss), the others reuse
+            // it (hits).
+            for (auto& event : events)
+            {
+                Result const expected = uncached.FormatWithMessage(event, szPrefix, wide.data());
+                Result const actual = cached.FormatWithMessage(event, szPrefix, wide.data());
+                if (expected != actual && failures++ < 10)
+                {
+                    printf("  \"%s\": expected \"%s\" (%d), got \"%s\" (%d)\n",
+                        message.c_str(), expected.Text.c_str(), static_cast<int>(expected.Error),
+                        actual.Text.c_str(), static_cast<int>(actual.Error));
+                }
+            }
+        }
+    }
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(MessageCache_ModifiedMessageBuffer)
+{
+    // A caller-supplied message at the same address with different content
+    // must not reuse the compiled form of the old content.
+    MessageCacheFixture uncached;
+    uncached.Enumerator.SetMessageCacheCapacity(0);
+    MessageCacheFixture cached;
+    auto events = TestEvents();
+    auto const messages = TestMessages(200);
+
+    size_t maxLength = 0;
+    for (auto const& message : messages)
+    {
+        maxLength = message.size() > maxLength ? message.size() : maxLength;
+    }
+
+    WideString buffer(maxLength + 1);
+    unsigned failures = 0;
+    for (unsigned pass = 0; pass != 2; pass += 1)
+    {
+        for (auto const& message : messages)
+        {
+            WideString const wide = Widen(message);
+            std::copy(wide.begin(), wide.end(), buffer.begin());
+            for (auto& event : events)
+            {
+                failures += uncached.FormatWithMessage(event, nullptr, buffer.data()) !=
+                    cached.FormatWithMessage(event, nullptr, buffer.data());
+            }
+        }
+    }
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(MessageCache_CapacityAndClear)
+{
+    MessageCacheFixture uncached;
+    uncached.Enumerator.SetMessageCacheCapacity(0);
+    MessageCacheFixture cached;
+    auto events = TestEvents();
+
+    // Keep every message alive so that each has its own address.
+    std::vector<WideString> messages;
+    for (auto const& message : TestMessages(40))
+    {
+        messages.push_back(Widen(message));
+    }
+
+    unsigned failures = 0;
+    for (unsigned capacity : { 1u, 2u, 7u, 1000u })
+    {
+        cached.Enumerator.SetMessageCacheCapacity(capacity);
+        for (unsigned pass = 0; pass != 3; pass += 1)
+        {
+            for (auto const& message : messages)
+            {
+                for (auto& event : events)
+                {
+                    failures += uncached.FormatWithMessage(event, nullptr, message.data()) !=
+                        cached.FormatWithMessage(event, nullptr, message.data());
+                }
+            }
+
+            if (pass == 1)
+            {
+                cached.Enumerator.ClearMessageCache();
+            }
+        }
+    }
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(MessageCache_EventMessageMatchesUncached)
+{
+    // FormatCurrentEvent with the schema's EventMessage, including messages
+    // whose parameter strings cannot be resolved (fall back to JSON).
+    unsigned failures = 0;
+    for (auto const& message : TestMessages(300))
+    {
+        MessageCacheFixture uncached;
+        uncached.Enumerator.SetMessageCacheCapacity(0);
+        uncached.Schema.SetEventMessage(message.c_str());
+        MessageCacheFixture cached;
+        cached.Schema.SetEventMessage(message.c_str());
+        auto events = TestEvents();
+
+        for (unsigned pass = 0; pass != 2; pass += 1)
+        {
+            for (auto& event : events)
+            {
+                for (EtwPCWSTR szPrefix : TestPrefixes)
+                {
+                    failures += uncached.FormatEvent(event, szPrefix) !=
+                        cached.FormatEvent(event, szPrefix);
+                }
+            }
+        }
+    }
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(MessageCache_ExpectedOutput)
+{
+    MessageCacheFixture f;
+    auto events = TestEvents();
+
+    // events[2]: Count = 2, Name = "has %1 insert" (expanded recursively
+    // unless !S! is used), Flags = 6.
+    for (unsigned pass = 0; pass != 2; pass += 1)
+    {
+        Result const result = f.FormatWithMessage(events[2], nullptr,
+            L"n=%1 name=%2 raw=%2!S! flags=%3 param=%%1 %!PCT!");
+        ETW_CHECK(result.Ok);
+        ETW_CHECK(result.Text ==
+            "n=2 name=has 2 insert raw=has %1 insert flags=0x6[Write,Exec] param=param one [2] %");
+    }
+
+    Result const missing = f.FormatWithMessage(events[0], nullptr, L"%%99");
+    ETW_CHECK(!missing.Ok);
+    ETW_CHECK(missing.Error == ERROR_MR_MID_NOT_FOUND);
+}
@@ -0,0 +1,1427 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for EtwParquetWriter. The output is read back with a minimal Parquet
+reader (Thrift compact protocol footer and page headers, Snappy, RLE/bit-
+packing hybrid, DELTA_BINARY_PACKED, PLAIN and dictionary pages, 3-level
+LIST groups) and each column chunk is compared, as text, with the
+EtwColumnBatch it was written from. Also checks the schema, the row counts,
+and the file layout.
+*/
+
+#include "EtwTest.h"
+#include <stdio.h>
+
+using namespace EtwTest;
+
+namespace
+{
+    typedef std::vector<std::string> Rows;
+
+    UINT64 const UnixEpochFileTime = 116444736000000000;
+
+    // Parquet Type, LogicalType, and Encoding values used by the tests.
+    INT64 const Type_Boolean = 0;
+    INT64 const Type_Int32 = 1;
+    INT64 const Type_Int64 = 2;
+    INT64 const Type_Float = 4;
+    INT64 const Type_Double = 5;
+    INT64 const Type_ByteArray = 6;
+    INT64 const Type_FixedLenByteArray = 7;
+    short const Logical_String = 1;
+    short const Logical_List = 3;
+    short const Logical_Timestamp = 8;
+    short const Logical_Integer = 10;
+    short const Logical_Unknown = 11;
+    short const Logical_Uuid = 14;
+    INT64 const Encoding_Plain = 0;
+    INT64 const Encoding_Rle = 3;
+    INT64 const Encoding_DeltaBinaryPacked = 5;
+    INT64 const Encoding_RleDictionary = 8;
+
+    struct CollectingSink final
+        : EtwOutputSink
+    {
+        std::string Output;
+
+        LSTATUS __stdcall Write(
+            _In_reads_bytes_(cb) void const* pb,
+            unsigned cb) noexcept override
+        {
+            Output.append(static_cast<char const*>(pb), cb);
+            return ERROR_SUCCESS;
+        }
+    };
+
+    bool
+    IsSet(BYTE const* pBits, UINT64 i)
+    {
+        return (pBits[i / 8] >> (i & 7)) & 1;
+    }
+
+    std::string
+    Hex(BYTE const* pb, size_t cb)
+    {
+        std::string text;
+        char buffer[4];
+        for (size_t i = 0; i != cb; i += 1)
+        {
+            snprintf(buffer, sizeof(buffer), "%02x", pb[i]);
+            text += buffer;
+        }
+
+        return text;
+    }
+
+    std::string
+    Decimal(UINT64 value, bool isSigned)
+    {
+        char buffer[32];
+        if (isSigned)
+        {
+            snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(value));
+        }
+        else
+        {
+            snprintf(buffer, sizeof(buffer), "%llu", static_cast<unsigned long long>(value));
+        }
+
+        return buffer;
+    }
+
+    std::string
+    DoubleText(double value)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.17g", value);
+        return buffer;
+    }
+
+    // FILETIME as text, or "null" if it is outside the range of INT64
+    // nanoseconds since 1970.
+    std::string
+    FileTimeText(UINT64 fileTime)
+    {
+        INT64 const ticks = static_cast<INT64>(fileTime - UnixEpochFileTime);
+        return fileTime > 0x7FFFFFFFFFFFFFFF ||
+            ticks < -0x7FFFFFFFFFFFFFFF / 100 ||
+            ticks > 0x7FFFFFFFFFFFFFFF / 100
+            ? "null"
+            : Decimal(fileTime, false);
+    }
+
+    // Value i of a batch column as the Parquet reader formats it, or "null".
+    std::string
+    BatchValueText(
+        EtwColumnInfo const& info,
+        bool isFileTime,
+        UINT32 i)
+    {
+        auto const pb = static_cast<BYTE const*>(info.Values);
+        if (info.Type == EtwColumnType_None || !IsSet(info.Validity, i))
+        {
+            return "null";
+        }
+
+        UINT64 value = 0;
+        switch (info.Type)
+        {
+        case EtwColumnType_Int64:
+        case EtwColumnType_UInt64:
+            memcpy(&value, pb + i * 8, 8);
+            return isFileTime ? FileTimeText(value)
+                : info.InType == TDH_INTYPE_BOOLEAN ? (value != 0 ? "1" : "0")
+                : Decimal(value, info.Type == EtwColumnType_Int64);
+        case EtwColumnType_Double:
+        {
+            double f64;
+            memcpy(&f64, pb + i * 8, 8);
+            return DoubleText(f64);
+        }
+        case EtwColumnType_Guid:
+            return Hex(pb + i * 16, 16);
+        case EtwColumnType_String:
+            return '"' + ToUtf8(
+                reinterpret_cast<EtwWCHAR const*>(pb + info.Offsets[i]),
+                (info.Offsets[i + 1] - info.Offsets[i]) / 2) + '"';
+        default:
+            return Hex(pb + info.Offsets[i], info.Offsets[i + 1] - info.Offsets[i]);
+        }
+    }
+
+    // One string per row of a batch column, as the Parquet reader formats
+    // it: the value, "[value,...]" for a list, or "null".
+    Rows
+    BatchColumnText(
+        EtwColumnBatch const& batch,
+        unsigned columnIndex)
+    {
+        auto const info = batch.GetColumnInfo(0, columnIndex);
+        bool const isFileTime = columnIndex == 0 || info.InType == TDH_INTYPE_FILETIME;
+        Rows rows;
+        for (UINT32 row = 0; row != info.RowCount; row += 1)
+        {
+            if (info.ListOffsets == nullptr)
+            {
+                rows.push_back(BatchValueText(info, isFileTime, row));
+            }
+            else if (!IsSet(info.ListValidity, row))
+            {
+                rows.push_back("null");
+            }
+            else
+            {
+                std::string text = "[";
+                for (UINT32 i = info.ListOffsets[row]; i != info.ListOffsets[row + 1]; i += 1)
+                {
+                    text += (i != info.ListOffsets[row] ? "," : "") + BatchValueText(info, isFileTime, i);
+                }
+
+                rows.push_back(text + "]");
+            }
+        }
+
+        return rows;
+    }
+
+    /*
+    Reads bytes from an input range. Reads past the end return 0 and set
+    Bad (shared by readers of the same file).
+    */
+    struct ByteReader
+    {
+        BYTE const* Pos;
+        BYTE const* End;
+        bool* pBad;
+
+        ByteReader(void const* pb, size_t cb, bool* bad)
+            : Pos(static_cast<BYTE const*>(pb))
+            , End(static_cast<BYTE const*>(pb) + cb)
+            , pBad(bad)
+        {
+            return;
+        }
+
+        bool
+        Check(bool condition)
+        {
+            if (!condition)
+            {
+                *pBad = true;
+            }
+
+            return condition;
+        }
+
+        BYTE const*
+        Take(size_t cb)
+        {
+            static BYTE const Zeros[16] = {};
+            if (!Check(cb <= static_cast<size_t>(End - Pos)))
+            {
+                Pos = End;
+                return cb <= sizeof(Zeros) ? Zeros : nullptr;
+            }
+
+            auto const p = Pos;
+            Pos += cb;
+            return p;
+        }
+
+        UINT64
+        Fixed(unsigned cb)
+        {
+            UINT64 value = 0;
+            auto const p = Take(cb);
+            if (p)
+            {
+                memcpy(&value, p, cb);
+            }
+
+            return value;
+        }
+
+        UINT64
+        Varint()
+        {
+            UINT64 value = 0;
+            for (unsigned shift = 0; Check(shift < 64); shift += 7)
+            {
+                BYTE const b = static_cast<BYTE>(Fixed(1));
+                value |= UINT64(b & 0x7F) << shift;
+                if (b < 0x80)
+                {
+                    break;
+                }
+            }
+
+            return value;
+        }
+
+        INT64
+        ZigZag()
+        {
+            UINT64 const value = Varint();
+            return static_cast<INT64>(value >> 1) ^ -static_cast<INT64>(value & 1);
+        }
+    };
+
+    /*
+    A value read with the Thrift compact protocol. Structs keep their fields
+    (in order, each with its Id) in Items, as do lists (with Id 0).
+    */
+    struct ThriftValue
+    {
+        short Id = 0;
+        UCHAR Type = 0; // Compact protocol type; Bool for either bool type.
+        INT64 Int = 0;
+        std::string Binary;
+        std::vector<ThriftValue> Items;
+
+        static UCHAR const Bool = 1;
+        static UCHAR const Byte = 3;
+        static UCHAR const I16 = 4;
+        static UCHAR const I32 = 5;
+        static UCHAR const I64 = 6;
+        static UCHAR const BinaryType = 8;
+        static UCHAR const List = 9;
+        static UCHAR const Struct = 12;
+
+        // The field with the specified Id, or an empty value (Type 0).
+        ThriftValue const&
+        operator[](short id) const
+        {
+            static ThriftValue const Missing;
+            for (auto const& item : Items)
+            {
+                if (item.Id == id)
+                {
+                    return item;
+                }
+            }
+
+            return Missing;
+        }
+
+        bool
+        Has(short id) const
+        {
+            return (*this)[id].Type != 0;
+        }
+    };
+
+    void
+    ReadThriftValue(ByteReader& reader, UCHAR type, ThriftValue& value, unsigned depth);
+
+    void
+    ReadThriftStruct(ByteReader& reader, ThriftValue& value, unsigned depth)
+    {
+        value.Type = ThriftValue::Struct;
+        short lastId = 0;
+        while (reader.Check(depth < 16) && reader.Pos != reader.End)
+        {
+            BYTE const header = static_cast<BYTE>(reader.Fixed(1));
+            if (header == 0)
+            {
+                return; // Stop
+            }
+
+            ThriftValue field;
+            field.Id = header >> 4
+                ? static_cast<short>(lastId + (header >> 4))
+                : static_cast<short>(reader.ZigZag());
+            lastId = field.Id;
+            UCHAR const fieldType = header & 0xF;
+            if (fieldType == 1 || fieldType == 2)
+            {
+                field.Type = ThriftValue::Bool;
+                field.Int = fieldType == 1;
+            }
+            else
+            {
+                ReadThriftValue(reader, fieldType, field, depth);
+            }
+
+            value.Items.push_back(field);
+        }
+
+        reader.Check(false); // No Stop.
+    }
+
+    void
+    ReadThriftValue(ByteReader& reader, UCHAR type, ThriftValue& value, unsigned depth)
+    {
+        value.Type = type;
+        switch (type)
+        {
+        case ThriftValue::Bool:
+            value.Int = reader.Fixed(1) == 1; // List element.
+            break;
+        case ThriftValue::Byte:
+            value.Int = static_cast<INT8>(reader.Fixed(1));
+            break;
+        case ThriftValue::I16:
+        case ThriftValue::I32:
+        case ThriftValue::I64:
+            value.Int = reader.ZigZag();
+            break;
+        case ThriftValue::BinaryType:
+        {
+            size_t const cb = static_cast<size_t>(reader.Varint());
+            auto const p = reader.Take(cb);
+            if (p)
+            {
+                value.Binary.assign(reinterpret_cast<char const*>(p), cb);
+            }
+            break;
+        }
+        case ThriftValue::List:
+        {
+            BYTE const header = static_cast<BYTE>(reader.Fixed(1));
+            size_t count = header >> 4;
+            if (count == 15)
+            {
+                count = static_cast<size_t>(reader.Varint());
+            }
+
+            UCHAR const elementType = header & 0xF;
+            for (size_t i = 0; i != count && reader.Check(reader.Pos != reader.End); i += 1)
+            {
+                ThriftValue item;
+                if (elementType == ThriftValue::Struct)
+                {
+                    ReadThriftStruct(reader, item, depth + 1);
+                }
+                else
+                {
+                    ReadThriftValue(reader, elementType == 2 ? ThriftValue::Bool : elementType, item, depth + 1);
+                }
+
+                value.Items.push_back(item);
+            }
+            break;
+        }
+        case ThriftValue::Struct:
+            ReadThriftStruct(reader, value, depth + 1);
+            break;
+        default:
+            reader.Check(false); // Not used by the writer.
+            break;
+        }
+    }
+
+    // Decompresses a Snappy raw block.
+    std::string
+    SnappyDecompress(ByteReader reader)
+    {
+        size_t const cbOutput = static_cast<size_t>(reader.Varint());
+        std::string output;
+        if (!reader.Check(cbOutput < 0x10000000))
+        {
+            return output;
+        }
+
+        output.reserve(cbOutput);
+        while (reader.Pos != reader.End && reader.Check(output.size() < cbOutput))
+        {
+            BYTE const tag = static_cast<BYTE>(reader.Fixed(1));
+            size_t length;
+            size_t offset;
+            switch (tag & 3)
+            {
+            case 0: // Literal
+                length = tag >> 2;
+                if (length >= 60)
+                {
+                    length = static_cast<size_t>(reader.Fixed(static_cast<unsigned>(length - 59)));
+                }
+
+                length += 1;
+                if (auto const p = reader.Take(length))
+                {
+                    output.append(reinterpret_cast<char const*>(p), length);
+                }
+                continue;
+            case 1:
+                length = ((tag >> 2) & 7) + 4;
+                offset = (size_t(tag >> 5) << 8) | static_cast<size_t>(reader.Fixed(1));
+                break;
+            case 2:
+                length = (tag >> 2) + 1;
+                offset = static_cast<size_t>(reader.Fixed(2));
+                break;
+            default:
+                length = (tag >> 2) + 1;
+                offset = static_cast<size_t>(reader.Fixed(4));
+                break;
+            }
+
+            if (!reader.Check(offset != 0 && offset <= output.size()))
+            {
+                break;
+            }
+
+            for (size_t i = 0; i != length; i += 1)
+            {
+                output += output[output.size() - offset]; // May overlap.
+            }
+        }
+
+        reader.Check(output.size() == cbOutput);
+        return output;
+    }
+
+    // Reads count values with the RLE/bit-packing hybrid encoding.
+    std::vector<UINT32>
+    ReadRleHybrid(ByteReader& reader, unsigned bitWidth, size_t count)
+    {
+        std::vector<UINT32> values;
+        reader.Check(bitWidth <= 32);
+        while (values.size() < count && reader.Check(reader.Pos != reader.End))
+        {
+            UINT64 const header = reader.Varint();
+            if (header & 1)
+            {
+                // Bit-packed groups of 8 values.
+                size_t const cb = static_cast<size_t>(header >> 1) * bitWidth;
+                auto const p = reader.Take(cb);
+                for (UINT64 bitPos = 0; p && bitPos + bitWidth <= cb * 8; bitPos += bitWidth)
+                {
+                    UINT32 value = 0;
+                    for (unsigned bit = 0; bit != bitWidth; bit += 1)
+                    {
+                        value |= UINT32(IsSet(p, bitPos + bit)) << bit;
+                    }
+
+                    values.push_back(value);
+                }
+            }
+            else
+            {
+                UINT32 const value = static_cast<UINT32>(reader.Fixed((bitWidth + 7) / 8));
+                reader.Check(header >> 1 != 0 && header >> 1 <= count - values.size());
+                values.insert(values.end(), static_cast<size_t>(header >> 1), value);
+            }
+        }
+
+        if (reader.Check(values.size() >= count))
+        {
+            values.resize(count); // Remove the padding of the last group.
+        }
+
+        return values;
+    }
+
+    // Reads values with the DELTA_BINARY_PACKED encoding.
+    std::vector<UINT64>
+    ReadDeltaBinaryPacked(ByteReader& reader)
+    {
+        std::vector<UINT64> values;
+        UINT64 const blockSize = reader.Varint();
+        UINT64 const miniblockCount = reader.Varint();
+        UINT64 const count = reader.Varint();
+        UINT64 value = static_cast<UINT64>(reader.ZigZag());
+        if (!reader.Check(blockSize % 128 == 0 && miniblockCount != 0 &&
+            blockSize % miniblockCount == 0 && (blockSize / miniblockCount) % 32 == 0 &&
+            count < 0x1000000))
+        {
+            return values;
+        }
+
+        if (count != 0)
+        {
+            values.push_back(value);
+        }
+
+        UINT64 const miniblockSize = blockSize / miniblockCount;
+        while (values.size() < count && reader.Check(reader.Pos != reader.End))
+        {
+            UINT64 const minDelta = static_cast<UINT64>(reader.ZigZag());
+            std::vector<BYTE> bitWidths(static_cast<size_t>(miniblockCount));
+            for (auto& bitWidth : bitWidths)
+            {
+                bitWidth = static_cast<BYTE>(reader.Fixed(1));
+                reader.Check(bitWidth <= 64);
+            }
+
+            for (size_t m = 0; m != miniblockCount && values.size() < count; m += 1)
+            {
+                size_t const cb = static_cast<size_t>(miniblockSize * bitWidths[m] / 8);
+                auto const p = reader.Take(cb);
+                for (UINT64 i = 0; p && i != miniblockSize && values.size() < count; i += 1)
+                {
+                    UINT64 relative = 0;
+                    for (unsigned bit = 0; bit != bitWidths[m]; bit += 1)
+                    {
+                        relative |= UINT64(IsSet(p, i * bitWidths[m] + bit)) << bit;
+                    }
+
+                    value += minDelta + relative;
+                    values.push_back(value);
+                }
+            }
+        }
+
+        return values;
+    }
+
+    struct ParquetColumn
+    {
+        std::string Name;
+        INT64 Type;
+        INT64 TypeLength;
+        INT64 ConvertedType;  // -1 if absent.
+        short LogicalType;    // LogicalType union field, or 0 if absent.
+        unsigned BitWidth;    // Logical_Integer.
+        bool IsSigned;        // Logical_Integer.
+        bool IsList;          // LIST group. The other fields describe the element.
+    };
+
+    struct ParquetChunk
+    {
+        Rows Values;
+        std::vector<INT64> Encodings;   // ColumnMetaData encodings.
+        INT64 DataEncoding;             // Data page encoding.
+        bool HasDictionary;
+        size_t DictionarySize;          // Entries in the dictionary page.
+    };
+
+    // Contents of a Parquet file.
+    struct ParquetData
+    {
+        bool Bad = false;
+        ThriftValue Footer;             // FileMetaData.
+        std::vector<ParquetColumn> Columns;
+        std::vector<INT64> RowGroupRows;
+        std::vector<std::vector<ParquetChunk>> RowGroups; // Row group, column.
+    };
+
+    class ParquetReader
+    {
+        std::string const& m_input;
+        ParquetData& m_data;
+
+    public:
+
+        ParquetReader(std::string const& input, ParquetData& data)
+            : m_input(input)
+            , m_data(data)
+        {
+            return;
+        }
+
+        void
+        Read()
+        {
+            ByteReader file(m_input.data(), m_input.size(), &m_data.Bad);
+            if (!file.Check(m_input.size() >= 12 &&
+                0 == memcmp(m_input.data(), "PAR1", 4) &&
+                0 == memcmp(m_input.data() + m_input.size() - 4, "PAR1", 4)))
+            {
+                return;
+            }
+
+            UINT32 cbFooter;
+            memcpy(&cbFooter, m_input.data() + m_input.size() - 8, 4);
+            if (!file.Check(cbFooter <= m_input.size() - 12))
+            {
+                return;
+            }
+
+            size_t const footerBegin = m_input.size() - 8 - cbFooter;
+            ByteReader footer(m_input.data() + footerBegin, cbFooter, &m_data.Bad);
+            ReadThriftStruct(footer, m_data.Footer, 0);
+            file.Check(footer.Pos == footer.End);
+
+            // Schema: the root, then one element per column, or for a list
+            // column an optional LIST group, a repeated group named "list",
+            // and an optional leaf named "element".
+            auto const& schema = m_data.Footer[2].Items;
+            file.Check(!schema.empty());
+            for (size_t i = 1; i < schema.size(); i += 1)
+            {
+                ParquetColumn column = {};
+                column.Name = schema[i][4].Binary;
+                if (!schema[i].Has(1) && file.Check(i + 2 < schema.size()))
+                {
+                    auto const& group = schema[i];
+                    auto const& repeated = schema[i + 1];
+                    column.IsList = true;
+                    file.Check(group[3].Int == 1 && group[5].Int == 1); // OPTIONAL, 1 child
+                    file.Check(group[6].Int == 3);                      // LIST
+                    file.Check(group[10].Items.size() == 1 && group[10].Has(Logical_List));
+                    file.Check(repeated[3].Int == 2 && repeated[5].Int == 1); // REPEATED, 1 child
+                    file.Check(!repeated.Has(1) && repeated[4].Binary == "list");
+                    file.Check(schema[i + 2][4].Binary == "element");
+                    i += 2;
+                }
+
+                auto const& element = schema[i];
+                auto const& logicalType = element[10];
+                column.Type = element[1].Int;
+                column.TypeLength = element[2].Int;
+                column.ConvertedType = element.Has(6) ? element[6].Int : -1;
+                column.LogicalType = logicalType.Items.empty() ? 0 : logicalType.Items[0].Id;
+                column.BitWidth = static_cast<unsigned>(logicalType[Logical_Integer][1].Int);
+                column.IsSigned = logicalType[Logical_Integer][2].Int != 0;
+                file.Check(element[3].Int == 1); // OPTIONAL
+                file.Check(logicalType.Items.size() <= 1);
+                m_data.Columns.push_back(column);
+            }
+
+            file.Check(!schema.empty() && schema[0][5].Int == static_cast<INT64>(m_data.Columns.size()));
+
+            // Column chunks, which must be contiguous from the header to the
+            // footer.
+            size_t expectedOffset = 4;
+            for (auto const& rowGroup : m_data.Footer[4].Items)
+            {
+                INT64 totalByteSize = 0;
+                m_data.RowGroupRows.push_back(rowGroup[3].Int);
+                m_data.RowGroups.emplace_back();
+                file.Check(rowGroup[1].Items.size() == m_data.Columns.size());
+                for (size_t i = 0; i != rowGroup[1].Items.size() && i != m_data.Columns.size(); i += 1)
+                {
+                    auto const& chunk = rowGroup[1].Items[i];
+                    auto const& metadata = chunk[3];
+                    file.Check(static_cast<size_t>(chunk[2].Int) == expectedOffset);
+                    file.Check(metadata[1].Int == m_data.Columns[i].Type);
+                    file.Check(PathText(metadata[3]) == m_data.Columns[i].Name +
+                        (m_data.Columns[i].IsList ? ".list.element" : ""));
+                    file.Check(metadata[4].Int == 1); // SNAPPY
+                    totalByteSize += metadata[6].Int;
+                    expectedOffset += static_cast<size_t>(metadata[7].Int);
+                    m_data.RowGroups.back().push_back(ReadChunk(m_data.Columns[i], metadata, rowGroup[3].Int));
+                }
+
+                file.Check(rowGroup[2].Int == totalByteSize);
+            }
+
+            file.Check(expectedOffset == footerBegin);
+        }
+
+    private:
+
+        // path_in_schema joined with ".".
+        static std::string
+        PathText(ThriftValue const& path)
+        {
+            std::string text;
+            for (auto const& item : path.Items)
+            {
+                text += (text.empty() ? "" : ".") + item.Binary;
+            }
+
+            return text;
+        }
+
+        // Reads a page header and the page. Returns the uncompressed page.
+        std::string
+        ReadPage(size_t offset, size_t end, _Out_ ThriftValue* pHeader, _Out_ size_t* pEnd, _Inout_ INT64* pUncompressedSize)
+        {
+            ByteReader reader(m_input.data() + offset, end - offset, &m_data.Bad);
+            *pHeader = ThriftValue();
+            ReadThriftStruct(reader, *pHeader, 0);
+            size_t const cbCompressed = static_cast<size_t>((*pHeader)[3].Int);
+            size_t const cbHeader = reader.Pos - reinterpret_cast<BYTE const*>(m_input.data() + offset);
+            auto const p = reader.Take(cbCompressed);
+            *pEnd = offset + cbHeader + cbCompressed;
+            *pUncompressedSize += cbHeader + (*pHeader)[2].Int;
+            if (!p)
+            {
+                return std::string();
+            }
+
+            auto const page = SnappyDecompress(ByteReader(p, cbCompressed, &m_data.Bad));
+            reader.Check(page.size() == static_cast<size_t>((*pHeader)[2].Int));
+            return page;
+        }
+
+        ParquetChunk
+        ReadChunk(ParquetColumn const& column, ThriftValue const& metadata, INT64 rows)
+        {
+            ParquetChunk chunk = {};
+            ByteReader check(nullptr, 0, &m_data.Bad);
+            size_t const begin = static_cast<size_t>(metadata.Has(11) ? metadata[11].Int : metadata[9].Int);
+            size_t const end = begin + static_cast<size_t>(metadata[7].Int);
+            INT64 uncompressedSize = 0;
+            size_t pos = begin;
+            std::vector<std::string> dictionary;
+            ThriftValue header;
+
+            for (auto const& encoding : metadata[2].Items)
+            {
+                chunk.Encodings.push_back(encoding.Int);
+            }
+
+            if (!check.Check(begin >= 4 && end <= m_input.size() && begin < end))
+            {
+                return chunk;
+            }
+
+            chunk.HasDictionary = metadata.Has(11);
+            if (chunk.HasDictionary)
+            {
+                auto const page = ReadPage(pos, end, &header, &pos, &uncompressedSize);
+                chunk.DictionarySize = static_cast<size_t>(header[7][1].Int);
+                check.Check(header[1].Int == 2); // DICTIONARY_PAGE
+                check.Check(header[7][2].Int == Encoding_Plain);
+                ByteReader values(page.data(), page.size(), &m_data.Bad);
+                for (size_t i = 0; i != chunk.DictionarySize && !m_data.Bad; i += 1)
+                {
+                    dictionary.push_back(ReadPlainValue(column, values));
+                }
+
+                check.Check(values.Pos == values.End);
+            }
+
+            check.Check(pos == static_cast<size_t>(metadata[9].Int));
+            auto const page = ReadPage(pos, end, &header, &pos, &uncompressedSize);
+            auto const& dataPageHeader = header[5];
+            INT64 const levelCount = dataPageHeader[1].Int;
+            UINT32 const maxLevel = column.IsList ? 3 : 1;
+            check.Check(header[1].Int == 0); // DATA_PAGE
+            check.Check(levelCount == metadata[5].Int);
+            check.Check(column.IsList ? levelCount >= rows && levelCount < 0x1000000 : levelCount == rows);
+            check.Check(dataPageHeader[3].Int == Encoding_Rle);
+            check.Check(dataPageHeader[4].Int == Encoding_Rle);
+            check.Check(pos == end);
+            check.Check(uncompressedSize == metadata[6].Int);
+            chunk.DataEncoding = dataPageHeader[2].Int;
+
+            // Repetition levels (list columns only) and definition levels,
+            // each with a 4-byte length, then the values that are not null.
+            ByteReader reader(page.data(), page.size(), &m_data.Bad);
+            std::vector<UINT32> repetitionLevels;
+            if (column.IsList)
+            {
+                repetitionLevels = ReadLevels(reader, 1, static_cast<size_t>(levelCount));
+            }
+
+            auto const levels = ReadLevels(reader, maxLevel, static_cast<size_t>(levelCount));
+            size_t definedCount = 0;
+            for (auto level : levels)
+            {
+                definedCount += level == maxLevel;
+            }
+
+            Rows values;
+            if (chunk.DataEncoding == Encoding_RleDictionary)
+            {
+                unsigned const bitWidth = static_cast<unsigned>(reader.Fixed(1));
+                for (auto index : ReadRleHybrid(reader, bitWidth, definedCount))
+                {
+                    values.push_back(check.Check(index < dictionary.size()) ? dictionary[index] : "?");
+                }
+            }
+            else if (chunk.DataEncoding == Encoding_DeltaBinaryPacked)
+            {
+                check.Check(column.Type == Type_Int64);
+                for (auto value : ReadDeltaBinaryPacked(reader))
+                {
+                    values.push_back(ValueText(column, value));
+                }
+            }
+            else if (column.Type == Type_Boolean)
+            {
+                check.Check(chunk.DataEncoding == Encoding_Plain);
+                auto const p = reader.Take((definedCount + 7) / 8);
+                for (size_t i = 0; p && i != definedCount; i += 1)
+                {
+                    values.push_back(IsSet(p, i) ? "1" : "0");
+                }
+            }
+            else
+            {
+                check.Check(chunk.DataEncoding == Encoding_Plain);
+                for (size_t i = 0; i != definedCount && !m_data.Bad; i += 1)
+                {
+                    values.push_back(ReadPlainValue(column, reader));
+                }
+            }
+
+            check.Check(reader.Pos == reader.End);
+            check.Check(values.size() == definedCount);
+            bool rowHasElements = false;
+            for (size_t level = 0, i = 0; level != levels.size(); level += 1)
+            {
+                std::string const value =
+                    levels[level] != maxLevel ? "null"
+                    : i < values.size() ? values[i++]
+                    : "?";
+                if (!column.IsList)
+                {
+                    chunk.Values.push_back(value);
+                }
+                else if (repetitionLevels[level] == 0)
+                {
+                    // Starts a row: null list, empty list, or first element.
+                    rowHasElements = levels[level] >= 2;
+                    chunk.Values.push_back(
+                        levels[level] == 0 ? "null"
+                        : levels[level] == 1 ? "[]"
+                        : "[" + value + "]");
+                }
+                else if (check.Check(rowHasElements && levels[level] >= 2))
+                {
+                    auto& text = chunk.Values.back();
+                    text.insert(text.size() - 1, "," + value);
+                }
+            }
+
+            check.Check(chunk.Values.size() == static_cast<size_t>(rows));
+            return chunk;
+        }
+
+        // Reads count levels (with a 4-byte length) that are <= maxLevel.
+        std::vector<UINT32>
+        ReadLevels(ByteReader& reader, UINT32 maxLevel, size_t count)
+        {
+            size_t const cbLevels = static_cast<size_t>(reader.Fixed(4));
+            ByteReader levelReader(reader.Take(cbLevels), cbLevels, &m_data.Bad);
+            auto const levels = ReadRleHybrid(levelReader, BitWidth(maxLevel), count);
+            levelReader.Check(levelReader.Pos == levelReader.End);
+            for (auto level : levels)
+            {
+                levelReader.Check(level <= maxLevel);
+            }
+
+            return levels;
+        }
+
+        static unsigned
+        BitWidth(UINT32 maxLevel)
+        {
+            unsigned bits = 0;
+            for (; maxLevel != 0; maxLevel >>= 1)
+            {
+                bits += 1;
+            }
+
+            return bits;
+        }
+
+        std::string
+        ReadPlainValue(ParquetColumn const& column, ByteReader& reader)
+        {
+            switch (column.Type)
+            {
+            case Type_Int32:
+                return ValueText(column, reader.Fixed(4));
+            case Type_Int64:
+                return ValueText(column, reader.Fixed(8));
+            case Type_Float:
+            {
+                UINT32 const bits = static_cast<UINT32>(reader.Fixed(4));
+                float f32;
+                memcpy(&f32, &bits, 4);
+                return DoubleText(f32);
+            }
+            case Type_Double:
+            {
+                UINT64 const bits = reader.Fixed(8);
+                double f64;
+                memcpy(&f64, &bits, 8);
+                return DoubleText(f64);
+            }
+            case Type_FixedLenByteArray:
+            {
+                // UUID in RFC 4122 byte order, as a GUID.
+                static BYTE const order[16] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+                BYTE guid[16] = {};
+                auto const p = reader.Take(16);
+                reader.Check(column.TypeLength == 16 && column.LogicalType == Logical_Uuid);
+                for (unsigned i = 0; p && i != 16; i += 1)
+                {
+                    guid[order[i]] = p[i];
+                }
+
+                return Hex(guid, 16);
+            }
+            case Type_ByteArray:
+            {
+                size_t const cb = static_cast<size_t>(reader.Fixed(4));
+                auto const p = reader.Take(cb);
+                std::string const value = p ? std::string(reinterpret_cast<char const*>(p), cb) : std::string();
+                return column.LogicalType == Logical_String
+                    ? '"' + value + '"'
+                    : Hex(reinterpret_cast<BYTE const*>(value.data()), value.size());
+            }
+            default:
+                reader.Check(false);
+                return "?";
+            }
+        }
+
+        std::string
+        ValueText(ParquetColumn const& column, UINT64 value)
+        {
+            if (column.LogicalType == Logical_Timestamp)
+            {
+                return Decimal(static_cast<INT64>(value) / 100 + UnixEpochFileTime, false);
+            }
+
+            if (column.Type == Type_Int32)
+            {
+                value = column.IsSigned
+                    ? static_cast<UINT64>(static_cast<INT64>(static_cast<INT32>(value)))
+                    : static_cast<UINT32>(value);
+            }
+
+            return Decimal(value, column.IsSigned);
+        }
+    };
+
+    ParquetData
+    ReadParquet(std::string const& input)
+    {
+        ParquetData data;
+        ParquetReader(input, data).Read();
+        return data;
+    }
+
+    struct ParquetFixture
+    {
+        TestSchema Schema;
+        TestCallbacks Callbacks;
+        EtwEnumerator Enumerator;
+        EtwColumnBatch Batch;
+
+        ParquetFixture()
+            : Schema("ParquetProvider", "ParquetEvent")
+            , Callbacks()
+            , Enumerator(Callbacks)
+            , Batch()
+        {
+            Schema.Add("I8", Scalar(TDH_INTYPE_INT8));                  // 0
+            Schema.Add("U16", Scalar(TDH_INTYPE_UINT16));               // 1
+            Schema.Add("I32", Scalar(TDH_INTYPE_INT32));                // 2
+            Schema.Add("Hex32", Scalar(TDH_INTYPE_HEXINT32));           // 3
+            Schema.Add("I64", Scalar(TDH_INTYPE_INT64));                // 4
+            Schema.Add("U64", Scalar(TDH_INTYPE_UINT64));               // 5
+            Schema.Add("Flag", Scalar(TDH_INTYPE_BOOLEAN));             // 6
+            Schema.Add("Ratio", Scalar(TDH_INTYPE_FLOAT));              // 7
+            Schema.Add("Value", Scalar(TDH_INTYPE_DOUBLE));             // 8
+            Schema.Add("When", Scalar(TDH_INTYPE_FILETIME));            // 9
+            Schema.Add("Activity", Scalar(TDH_INTYPE_GUID));            // 10
+            Schema.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));       // 11
+            Schema.Add("Ansi", Scalar(TDH_INTYPE_ANSISTRING));          // 12
+            Schema.Add("Size", Scalar(TDH_INTYPE_UINT16));              // 13
+            Schema.Add("Data", Sized(TDH_INTYPE_BINARY, 13));           // 14
+            Schema.Add("Values", CountedArray(TDH_INTYPE_UINT32, 13));  // 15
+            Schema.Add("Tail", Scalar(TDH_INTYPE_UINT32));              // 16
+            Callbacks.SetSchema(1, Schema);
+        }
+
+        /*
+        Decodes count events starting at event number first. Every 16th
+        event is truncated after Name, so that the following columns have
+        nulls (in runs, for long enough batches). Timestamps and When values
+        that are out of range for Parquet also become nulls.
+        */
+        void
+        Decode(unsigned first, unsigned count)
+        {
+            std::vector<TestEvent> events;
+            for (unsigned n = first; n != first + count; n += 1)
+            {
+                TestEvent event(1, n % 50 == 7 ? 0 : 0x01D3C9E5A1B2C3D4 + n * 100000 + (n % 3) * 7);
+                event.Record().EventHeader.ProcessId = 100 + n % 3;
+                event.Record().EventHeader.ThreadId = n % 20 < 10 ? 5 : 1000 + n;
+                GUID const activity = { n * 0x01020304u, 2, 3, { 4, 5, 6, 7, 8, 9, 10, static_cast<BYTE>(n) } };
+                char name[32];
+                snprintf(name, sizeof(name), "name %u \xC3\xA9", n % 7);
+                char ansi[32];
+                snprintf(ansi, sizeof(ansi), "ansi %u", n);
+                UINT64 const when =
+                    n % 40 == 11 ? ~UINT64(0)
+                    : n % 40 == 12 ? 0
+                    : 0x01D3C9E5A1B2C3D4 - n * n * 1234567;
+                event.Add<INT8>(static_cast<INT8>(n * 37))
+                    .Add<UINT16>(static_cast<UINT16>(n * 999))
+                    .Add<INT32>(static_cast<INT32>(n * 0x10001) * (n % 2 ? -1 : 1))
+                    .Add<UINT32>(0x80000000u + n)
+                    .Add<INT64>(static_cast<INT64>(n) * -0x123456789)
+                    .Add<UINT64>(~UINT64(0) - n)
+                    .Add<UINT32>(n % 3 == 0)
+                    .Add<float>(n * 0.25f - 3)
+                    .Add<double>(n / 3.0)
+                    .Add<UINT64>(when)
+                    .Add<GUID>(activity)
+                    .AddString(name);
+                if (n % 16 != 15)
+                {
+                    UINT16 const size = static_cast<UINT16>(n % 5);
+                    event.AddAnsiString(ansi).Add<UINT16>(size);
+                    for (UINT16 i = 0; i != size; i += 1)
+                    {
+                        event.Add<BYTE>(static_cast<BYTE>(n + i));
+                    }
+
+                    for (UINT16 i = 0; i != size; i += 1)
+                    {
+                        event.Add<UINT32>(n * i);
+                    }
+
+                    event.Add<UINT32>(n % 4 == 0 ? 7 : n);
+                }
+
+                events.push_back(event);
+            }
+
+            std::vector<EVENT_RECORD const*> records;
+            for (auto& event : events)
+            {
+                records.push_back(&event.Record());
+            }
+
+            ETW_CHECK(count == Enumerator.DecodeEventsToColumns(
+                records.data(), static_cast<unsigned>(records.size()), Batch, nullptr));
+        }
+
+        std::vector<Rows>
+        BatchText() const
+        {
+            std::vector<Rows> columns;
+            for (unsigned c = 0; c != Batch.GetTableInfo(0).ColumnCount; c += 1)
+            {
+                columns.push_back(BatchColumnText(Batch, c));
+            }
+
+            return columns;
+        }
+    };
+
+    std::vector<Rows>
+    ChunkValues(std::vector<ParquetChunk> const& chunks)
+    {
+        std::vector<Rows> columns;
+        for (auto const& chunk : chunks)
+        {
+            columns.push_back(chunk.Values);
+        }
+
+        return columns;
+    }
+}
+
+ETW_TEST(ParquetWriter_RowGroupsMatchBatch)
+{
+    ParquetFixture f;
+    CollectingSink sink;
+    EtwParquetWriter writer;
+    std::vector<std::vector<Rows>> expected;
+
+    // Row groups of 300 and 37 rows. The empty batch adds no row group.
+    f.Decode(0, 1);
+    ETW_CHECK(f.Batch.TableCount() == 1);
+    ETW_CHECK(ERROR_SUCCESS == writer.Begin(f.Batch, 0, sink));
+    f.Batch.ClearRows();
+    unsigned first = 0;
+    for (unsigned size : { 300u, 0u, 37u })
+    {
+        f.Decode(first, size);
+        first += size;
+        if (size != 0)
+        {
+            expected.push_back(f.BatchText());
+        }
+
+        ETW_CHECK(ERROR_SUCCESS == writer.WriteRowGroup(f.Batch, 0, sink));
+        f.Batch.ClearRows();
+    }
+
+    ETW_CHECK(ERROR_SUCCESS == writer.End(sink));
+    auto const data = ReadParquet(sink.Output);
+    ETW_CHECK(!data.Bad);
+
+    // Values and nulls.
+    ETW_CHECK(data.RowGroups.size() == 2);
+    for (size_t i = 0; i != data.RowGroups.size() && i != expected.size(); i += 1)
+    {
+        ETW_CHECK(ChunkValues(data.RowGroups[i]) == expected[i]);
+    }
+
+    // Event 15 is truncated after Name: Ansi is empty (not null) and Size
+    // is null. TimeStamp 0 of event 7 and When ~0 and 0 of events 11 and
+    // 12 are null.
+    ETW_CHECK(expected.size() == 2 && expected[0].size() == 22);
+    ETW_CHECK(expected[0][17][14] == Hex(reinterpret_cast<BYTE const*>("ansi 14"), 7));
+    ETW_CHECK(expected[0][17][15] == "" && expected[0][18][15] == "null");
+    ETW_CHECK(expected[0][0][7] == "null" && expected[0][0][8] != "null");
+    ETW_CHECK(expected[0][14][11] == "null" && expected[0][14][12] == "null" && expected[0][14][13] != "null");
+
+    // Row counts.
+    ETW_CHECK(data.Footer[1].Int == 1);                     // version
+    ETW_CHECK(data.Footer[3].Int == 337);                   // num_rows
+    ETW_CHECK(data.RowGroupRows == std::vector<INT64>({ 300, 37 }));
+
+    // Schema.
+    auto const tableInfo = f.Batch.GetTableInfo(0);
+    ETW_CHECK(data.Footer[2].Items.size() == tableInfo.ColumnCount + 3); // Values is a LIST group.
+    ETW_CHECK(data.Footer[2].Items.size() != 0 && data.Footer[2].Items[0][4].Binary == "schema");
+    ETW_CHECK(data.Columns.size() == tableInfo.ColumnCount);
+    if (data.Columns.size() != tableInfo.ColumnCount || data.Columns.size() != 22)
+    {
+        return;
+    }
+
+    struct ExpectedColumn
+    {
+        INT64 Type;
+        short LogicalType;
+        unsigned BitWidth;
+        bool IsSigned;
+        INT64 ConvertedType;
+    };
+
+    ExpectedColumn const expectedColumns[] = {
+        { Type_Int64, Logical_Timestamp, 0, false, -1 },        // TimeStamp
+        { Type_Int32, Logical_Integer, 32, false, 13 },         // ProcessId (UINT_32)
+        { Type_Int32, Logical_Integer, 32, false, 13 },         // ThreadId
+        { Type_Int32, Logical_Integer, 32, false, 13 },         // ProcessorIndex
+        { Type_FixedLenByteArray, Logical_Uuid, 0, false, -1 }, // ActivityId
+        { Type_Int32, Logical_Integer, 8, true, 15 },           // I8 (INT_8)
+        { Type_Int32, Logical_Integer, 16, false, 12 },         // U16 (UINT_16)
+        { Type_Int32, Logical_Integer, 32, true, 17 },          // I32 (INT_32)
+        { Type_Int32, Logical_Integer, 32, false, 13 },         // Hex32
+        { Type_Int64, Logical_Integer, 64, true, 18 },          // I64 (INT_64)
+        { Type_Int64, Logical_Integer, 64, false, 14 },         // U64 (UINT_64)
+        { Type_Boolean, 0, 0, false, -1 },                      // Flag
+        { Type_Float, 0, 0, false, -1 },                        // Ratio
+        { Type_Double, 0, 0, false, -1 },                       // Value
+        { Type_Int64, Logical_Timestamp, 0, false, -1 },        // When
+        { Type_FixedLenByteArray, Logical_Uuid, 0, false, -1 }, // Activity
+        { Type_ByteArray, Logical_String, 0, false, 0 },        // Name (UTF8)
+        { Type_ByteArray, 0, 0, false, -1 },                    // Ansi
+        { Type_Int32, Logical_Integer, 16, false, 12 },         // Size
+        { Type_ByteArray, 0, 0, false, -1 },                    // Data
+        { Type_Int32, Logical_Integer, 32, false, 13 },         // Values (list element)
+        { Type_Int32, Logical_Integer, 32, false, 13 },         // Tail
+    };
+
+    for (unsigned i = 0; i != tableInfo.ColumnCount; i += 1)
+    {
+        auto const& column = data.Columns[i];
+        auto const& e = expectedColumns[i];
+        ETW_CHECK(column.Name == ToUtf8(f.Batch.GetColumnInfo(0, i).Name));
+        ETW_CHECK(column.Type == e.Type);
+        ETW_CHECK(column.LogicalType == e.LogicalType);
+        ETW_CHECK(column.BitWidth == e.BitWidth);
+        ETW_CHECK(column.IsSigned == e.IsSigned);
+        ETW_CHECK(column.ConvertedType == e.ConvertedType);
+        ETW_CHECK(column.TypeLength == (e.Type == Type_FixedLenByteArray ? 16 : 0));
+        ETW_CHECK(column.IsList == (f.Batch.GetColumnInfo(0, i).ListOffsets != nullptr));
+    }
+
+    ETW_CHECK(data.Columns[20].IsList);
+
+    auto const& timestamp = data.Footer[2].Items[1][10][Logical_Timestamp];
+    ETW_CHECK(timestamp[1].Int == 1);           // isAdjustedToUTC
+    ETW_CHECK(timestamp[2].Has(3));             // NANOS
+
+    // Encodings: timestamps use DELTA_BINARY_PACKED, strings and binary use
+    // a dictionary, and everything else is PLAIN.
+    for (auto const& rowGroup : data.RowGroups)
+    {
+        for (unsigned i = 0; i != rowGroup.size(); i += 1)
+        {
+            auto const& chunk = rowGroup[i];
+            INT64 const type = expectedColumns[i].Type;
+            bool const isTimestamp = expectedColumns[i].LogicalType == Logical_Timestamp;
+            INT64 const encoding =
+                isTimestamp ? Encoding_DeltaBinaryPacked
+                : type == Type_ByteArray ? Encoding_RleDictionary
+                : Encoding_Plain;
+            ETW_CHECK(chunk.DataEncoding == encoding);
+            ETW_CHECK(chunk.HasDictionary == (encoding == Encoding_RleDictionary));
+            ETW_CHECK(chunk.Encodings == (encoding == Encoding_RleDictionary
+                ? std::vector<INT64>({ Encoding_Plain, Encoding_Rle, Encoding_RleDictionary })
+                : std::vector<INT64>({ encoding, Encoding_Rle })));
+        }
+
+        ETW_CHECK(rowGroup[16].DictionarySize == 7); // Name: 7 distinct values.
+    }
+
+    // Key-value metadata.
+    auto const& keyValues = data.Footer[5].Items;
+    ETW_CHECK(keyValues.size() == 2);
+    ETW_CHECK(keyValues.size() == 2 &&
+        keyValues[0][1].Binary == "ProviderName" && keyValues[0][2].Binary == "ParquetProvider" &&
+        keyValues[1][1].Binary == "EventName" && keyValues[1][2].Binary == "ParquetEvent");
+    ETW_CHECK(data.Footer[6].Binary == "EtwEnumerator");
+
+    // A writer can be reused after End.
+    CollectingSink sink2;
+    ETW_CHECK(ERROR_SUCCESS == writer.Begin(f.Batch, 0, sink2));
+    ETW_CHECK(ERROR_SUCCESS == writer.End(sink2));
+    auto const empty = ReadParquet(sink2.Output);
+    ETW_CHECK(!empty.Bad);
+    ETW_CHECK(empty.Footer[3].Int == 0);
+    ETW_CHECK(empty.RowGroups.empty());
+    ETW_CHECK(empty.Columns.size() == data.Columns.size());
+}
+
+ETW_TEST(ParquetWriter_LargeDictionaryUsesPlain)
+{
+    // Unique strings totalling more than 1 MB do not fit in a dictionary.
+    // A column with few distinct values still uses one.
+    TestSchema schema("ParquetProvider", "LargeEvent");
+    schema.Add("Text", Scalar(TDH_INTYPE_UNICODESTRING));
+    schema.Add("Kind", Scalar(TDH_INTYPE_ANSISTRING));
+    TestCallbacks callbacks;
+    callbacks.SetSchema(1, schema);
+    EtwEnumerator enumerator(callbacks);
+    EtwColumnBatch batch;
+
+    std::string const pattern(600, 'x');
+    std::vector<TestEvent> events;
+    for (unsigned n = 0; n != 2000; n += 1)
+    {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "%u:", n * 7919);
+        char kind[2] = { static_cast<char>('a' + n % 3), 0 };
+        TestEvent event(1, 0x01D3C9E5A1B2C3D4 + n);
+        event.AddString((prefix + pattern.substr(n % 100)).c_str()).AddAnsiString(kind);
+        events.push_back(event);
+    }
+
+    std::vector<EVENT_RECORD const*> records;
+    for (auto& event : events)
+    {
+        records.push_back(&event.Record());
+    }
+
+    ETW_CHECK(2000 == enumerator.DecodeEventsToColumns(records.data(), 2000, batch, nullptr));
+    std::vector<Rows> expected;
+    for (unsigned c = 0; c != batch.GetTableInfo(0).ColumnCount; c += 1)
+    {
+        expected.push_back(BatchColumnText(batch, c));
+    }
+
+    CollectingSink sink;
+    EtwParquetWriter writer;
+    ETW_CHECK(ERROR_SUCCESS == writer.Begin(batch, 0, sink));
+    ETW_CHECK(ERROR_SUCCESS == writer.WriteRowGroup(batch, 0, sink));
+    ETW_CHECK(ERROR_SUCCESS == writer.End(sink));
+
+    // The values compress well, so the file is smaller than the text.
+    ETW_CHECK(sink.Output.size() < 2000 * 600 / 4);
+
+    auto const data = ReadParquet(sink.Output);
+    ETW_CHECK(!data.Bad);
+    ETW_CHECK(data.RowGroups.size() == 1);
+    if (data.RowGroups.size() != 1 || data.RowGroups[0].size() != 7)
+    {
+        return;
+    }
+
+    auto const& chunks = data.RowGroups[0];
+    ETW_CHECK(ChunkValues(chunks) == expected);
+    ETW_CHECK(chunks[5].DataEncoding == Encoding_Plain);
+    ETW_CHECK(!chunks[5].HasDictionary);
+    ETW_CHECK(chunks[5].Encodings == std::vector<INT64>({ Encoding_Plain, Encoding_Rle }));
+    ETW_CHECK(chunks[6].DataEncoding == Encoding_RleDictionary);
+    ETW_CHECK(chunks[6].DictionarySize == 3);
+    ETW_CHECK(data.RowGroupRows == std::vector<INT64>({ 2000 }));
+}
+
+ETW_TEST(ParquetWriter_ListsRoundTrip)
+{
+    // Arrays and the members of an array of structs are LIST columns. An
+    // array in an array of structs is not decoded (a null column).
+    TestSchema schema("ParquetProvider", "ListEvent");
+    schema.Add("N", Scalar(TDH_INTYPE_UINT8));                      // 0
+    schema.Add("Times", CountedArray(TDH_INTYPE_FILETIME, 0));      // 1
+    schema.Add("Count", Scalar(TDH_INTYPE_UINT8));                  // 2
+    schema.Add("Items", CountedStruct(5, 3, 2));                    // 3
+    schema.Add("Tail", Scalar(TDH_INTYPE_UINT16));                  // 4
+    schema.Add("Id", Scalar(TDH_INTYPE_UINT32));                    // 5
+    schema.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));           // 6
+    schema.Add("Pair", Scalar(TDH_INTYPE_UINT8, TDH_OUTTYPE_NULL, 2)); // 7
+    schema.SetTopLevelCount(5);
+    TestCallbacks callbacks;
+    callbacks.SetSchema(1, schema);
+
+    UINT64 const t1 = 0x01D3C9E5A1B2C3D4;
+    UINT64 const t2 = 0x01D3C9E5A1B2C3D4 + 10000000;
+    std::vector<TestEvent> events;
+    events.emplace_back(1, t1);
+    events.back().Add<UINT8>(3).Add<UINT64>(t1).Add<UINT64>(~UINT64(0)).Add<UINT64>(t2)
+        .Add<UINT8>(2)
+        .Add<UINT32>(1).AddString("a").Add<UINT8>(1).Add<UINT8>(2)
+        .Add<UINT32>(2).AddString("").Add<UINT8>(3).Add<UINT8>(4)
+        .Add<UINT16>(7);
+    events.emplace_back(1, t1);
+    events.back().Add<UINT8>(0).Add<UINT8>(0).Add<UINT16>(8);
+    events.emplace_back(1, t1);
+    events.back().Add<UINT8>(1).Add<UINT64>(t2)
+        .Add<UINT8>(1).Add<UINT32>(5); // Truncated in the first element.
+    events.emplace_back(1, t1);
+    events.back().Add<UINT8>(2); // Truncated before Times.
+
+    std::vector<EVENT_RECORD const*> records;
+    for (auto& event : events)
+    {
+        records.push_back(&event.Record());
+    }
+
+    EtwEnumerator enumerator(callbacks);
+    EtwColumnBatch batch;
+    ETW_CHECK(4 == enumerator.DecodeEventsToColumns(records.data(), 4, batch, nullptr));
+    auto const tableInfo = batch.GetTableInfo(0);
+    std::vector<Rows> expected;
+    for (unsigned c = 0; c != tableInfo.ColumnCount; c += 1)
+    {
+        expected.push_back(BatchColumnText(batch, c));
+    }
+
+    CollectingSink sink;
+    EtwParquetWriter writer;
+    ETW_CHECK(ERROR_SUCCESS == writer.Begin(batch, 0, sink));
+    ETW_CHECK(ERROR_SUCCESS == writer.WriteRowGroup(batch, 0, sink));
+    ETW_CHECK(ERROR_SUCCESS == writer.WriteRowGroup(batch, 0, sink));
+    ETW_CHECK(ERROR_SUCCESS == writer.End(sink));
+    auto const data = ReadParquet(sink.Output);
+    ETW_CHECK(!data.Bad);
+    ETW_CHECK(data.RowGroupRows == std::vector<INT64>({ 4, 4 }));
+    ETW_CHECK(data.RowGroups.size() == 2);
+    for (auto const& rowGroup : data.RowGroups)
+    {
+        ETW_CHECK(ChunkValues(rowGroup) == expected);
+    }
+
+    // Columns: header, N, Times, Count, Items.Id, Items.Name, Items.Pair, Tail.
+    unsigned const h = EtwColumnBatch::HeaderColumnCount;
+    ETW_CHECK(tableInfo.ColumnCount == h + 7);
+    if (expected.size() != h + 7 || data.Columns.size() != h + 7)
+    {
+        return;
+    }
+
+    // Null element (FILETIME out of range), empty list, null list.
+    ETW_CHECK(expected[h + 1] == Rows({
+        "[" + Decimal(t1, false) + ",null," + Decimal(t2, false) + "]",
+        "[]",
+        "[" + Decimal(t2, false) + "]",
+        "null" }));
+    ETW_CHECK(expected[h + 3] == Rows({ "[1,2]", "[]", "[5]", "null" }));
+    ETW_CHECK(expected[h + 4] == Rows({ "[\"a\",\"\"]", "[]", "[\"\"]", "null" }));
+    ETW_CHECK(expected[h + 5] == Rows({ "null", "null", "null", "null" }));
+    ETW_CHECK(expected[h + 6] == Rows({ "7", "8", "null", "null" }));
+
+    ETW_CHECK(data.Footer[2].Items.size() == tableInfo.ColumnCount + 7); // 3 LIST groups.
+    for (unsigned i = 0; i != tableInfo.ColumnCount; i += 1)
+    {
+        auto const& column = data.Columns[i];
+        ETW_CHECK(column.Name == ToUtf8(batch.GetColumnInfo(0, i).Name));
+        ETW_CHECK(column.IsList == (i == h + 1 || i == h + 3 || i == h + 4));
+    }
+
+    ETW_CHECK(data.Columns[h + 1].LogicalType == Logical_Timestamp);
+    ETW_CHECK(data.Columns[h + 3].Type == Type_Int32 && data.Columns[h + 3].BitWidth == 32);
+    ETW_CHECK(data.Columns[h + 4].LogicalType == Logical_String);
+    ETW_CHECK(data.Columns[h + 5].LogicalType == Logical_Unknown);
+    ETW_CHECK(data.Columns[h + 4].Name == "Items.Name");
+}
@@ -0,0 +1,197 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for the StartEvent schema cache (SetSchemaCacheCapacity,
+GetSchemaCacheInfo, ClearSchemaCache).
+*/
+
+#include "EtwTest.h"
+
+using namespace EtwTest;
+
+namespace
+{
+    struct SchemaCacheFixture
+    {
+        TestSchema Schema;
+        TestCallbacks Callbacks;
+        EtwEnumerator Enumerator;
+
+        SchemaCacheFixture()
+            : Schema()
+            , Callbacks()
+            , Enumerator(Callbacks)
+        {
+            Schema.Add("Value", Scalar(TDH_INTYPE_UINT32));
+            for (USHORT eventId = 1; eventId != 5; eventId += 1)
+            {
+                Callbacks.SetSchema(eventId, Schema);
+            }
+        }
+
+        // Starts an event and returns the decoded Value field.
+        UINT32 Start(TestEvent& event)
+        {
+            UINT32 value = 0;
+            ETW_CHECK(Enumerator.StartEvent(&event.Record()));
+            ETW_CHECK(Enumerator.MoveNext());
+            auto const info = Enumerator.GetItemInfo();
+            ETW_CHECK(info.DataSize == sizeof(value));
+            if (info.DataSize == sizeof(value))
+            {
+                memcpy(&value, info.Data, sizeof(value));
+            }
+
+            return value;
+        }
+
+        UINT32 Start(USHORT eventId)
+        {
+            TestEvent event(eventId);
+            event.Add<UINT32>(eventId * 100u);
+            return Start(event);
+        }
+    };
+}
+
+ETW_TEST(SchemaCache_HitsAndMisses)
+{
+    SchemaCacheFixture f;
+
+    EtwSchemaCacheInfo info = f.Enumerator.GetSchemaCacheInfo();
+    ETW_CHECK(info.Capacity == 4096);
+    ETW_CHECK(info.Count == 0);
+    ETW_CHECK(info.Hits == 0);
+    ETW_CHECK(info.Misses == 0);
+
+    ETW_CHECK(f.Start(1) == 100);
+    ETW_CHECK(f.Start(2) == 200);
+    ETW_CHECK(f.Callbacks.LookupCount == 2);
+
+    ETW_CHECK(f.Start(1) == 100);
+    ETW_CHECK(f.Start(1) == 100);
+    ETW_CHECK(f.Start(2) == 200);
+    ETW_CHECK(f.Callbacks.LookupCount == 2); // Served from the cache.
+
+    info = f.Enumerator.GetSchemaCacheInfo();
+    ETW_CHECK(info.Count == 2);
+    ETW_CHECK(info.Hits == 3);
+    ETW_CHECK(info.Misses == 2);
+}
+
+ETW_TEST(SchemaCache_LruEviction)
+{
+    SchemaCacheFixture f;
+    f.Enumerator.SetSchemaCacheCapacity(2);
+
+    f.Start(1);                             // Miss: [1]
+    f.Start(2);                             // Miss: [2, 1]
+    f.Start(1);                             // Hit:  [1, 2]
+    ETW_CHECK(f.Callbacks.LookupCount == 2);
+
+    f.Start(3);                             // Miss, evicts 2: [3, 1]
+    ETW_CHECK(f.Callbacks.LookupCount == 3);
+    ETW_CHECK(f.Enumerator.GetSchemaCacheInfo().Count == 2);
+
+    f.Start(1);                             // Hit:  [1, 3]
+    ETW_CHECK(f.Callbacks.LookupCount == 3);
+
+    ETW_CHECK(f.Start(2) == 200);           // Miss, evicts 3: [2, 1]
+    ETW_CHECK(f.Callbacks.LookupCount == 4);
+
+    f.Start(1);                             // Hit
+    ETW_CHECK(f.Callbacks.LookupCount == 4);
+    f.Start(3);                             // Miss (was evicted)
+    ETW_CHECK(f.Callbacks.LookupCount == 5);
+
+    auto const info = f.Enumerator.GetSchemaCacheInfo();
+    ETW_CHECK(info.Capacity == 2);
+    ETW_CHECK(info.Count == 2);
+    ETW_CHECK(info.Hits == 3);
+    ETW_CHECK(info.Misses == 5);
+}
+
+ETW_TEST(SchemaCache_KeyIncludesDescriptorAndTraceLoggingMetadata)
+{
+    SchemaCacheFixture f;
+
+    TestEvent v0(1);
+    v0.Add<UINT32>(10);
+    f.Start(v0);
+
+    TestEvent v1(1);
+    v1.Add<UINT32>(11);
+    v1.Record().EventHeader.EventDescriptor.Version = 1;
+    f.Start(v1);
+    ETW_CHECK(f.Callbacks.LookupCount == 2); // Different version: miss.
+
+    static BYTE const metadataA[] = { 5, 0, 'A', 0, 0 };
+    static BYTE const metadataB[] = { 5, 0, 'B', 0, 0 };
+
+    TestEvent tlA(1);
+    tlA.Add<UINT32>(20);
+    tlA.SetSchemaTl(metadataA, sizeof(metadataA));
+    ETW_CHECK(f.Start(tlA) == 20);
+    ETW_CHECK(f.Callbacks.LookupCount == 3); // TraceLogging metadata: miss.
+
+    TestEvent tlB(1);
+    tlB.Add<UINT32>(21);
+    tlB.SetSchemaTl(metadataB, sizeof(metadataB));
+    ETW_CHECK(f.Start(tlB) == 21);
+    ETW_CHECK(f.Callbacks.LookupCount == 4); // Different metadata: miss.
+
+    // Same content at a different address: hit.
+    TestEvent tlA2(1);
+    tlA2.Add<UINT32>(22);
+    tlA2.SetSchemaTl(metadataA, sizeof(metadataA));
+    ETW_CHECK(f.Start(tlA2) == 22);
+    ETW_CHECK(f.Start(v0) == 10);
+    ETW_CHECK(f.Start(v1) == 11);
+    ETW_CHECK(f.Callbacks.LookupCount == 4);
+
+    auto const info = f.Enumerator.GetSchemaCacheInfo();
+    ETW_CHECK(info.Count == 4);
+    ETW_CHECK(info.Hits == 3);
+    ETW_CHECK(info.Misses == 4);
+}
+
+ETW_TEST(SchemaCache_Disabled)
+{
+    SchemaCacheFixture f;
+    f.Enumerator.SetSchemaCacheCapacity(0);
+
+    for (unsigned i = 0; i != 5; i += 1)
+    {
+        ETW_CHECK(f.Start(1) == 100);
+    }
+
+    ETW_CHECK(f.Callbacks.LookupCount == 5);
+    auto const info = f.Enumerator.GetSchemaCacheInfo();
+    ETW_CHECK(info.Capacity == 0);
+    ETW_CHECK(info.Count == 0);
+    ETW_CHECK(info.Hits == 0);
+}
+
+ETW_TEST(SchemaCache_Clear)
+{
+    SchemaCacheFixture f;
+
+    f.Start(1);
+    f.Start(1);
+    ETW_CHECK(f.Callbacks.LookupCount == 1);
+
+    f.Enumerator.ClearSchemaCache();
+    ETW_CHECK(f.Enumerator.State() == EtwEnumeratorState_None);
+    auto info = f.Enumerator.GetSchemaCacheInfo();
+    ETW_CHECK(info.Capacity == 4096);
+    ETW_CHECK(info.Count == 0);
+    ETW_CHECK(info.Hits == 0);
+    ETW_CHECK(info.Misses == 0);
+
+    ETW_CHECK(f.Start(1) == 100);
+    ETW_CHECK(f.Callbacks.LookupCount == 2);
+    info = f.Enumerator.GetSchemaCacheInfo();
+    ETW_CHECK(info.Count == 1);
+    ETW_CHECK(info.Misses == 1);
+}
@@ -0,0 +1,391 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for MoveNextSibling and GetFixedStructSize. Each event is first walked
+with MoveNext only (decode plans disabled), which is the reference. It is
+then walked again, with and without decode plans, choosing MoveNext or
+MoveNextSibling at random for each item. Each move must land on the item
+that the reference walk reaches after the skipped item's matching end (or on
+the reference walk's error if the skipped item was not complete). The
+payloads have arrays of nested fixed-size structs (which are skipped in one
+step when plans are enabled), structs that are not fixed-size (strings,
+pointers, counted members), 32-bit and 64-bit pointers, and truncation.
+GetFixedStructSize must report the expected size exactly when plans are
+enabled and the struct is fixed-size and complete, and element i of an array
+of fixed-size structs must start at Data + i * size.
+*/
+
+#include "EtwTest.h"
+#include <random>
+
+using namespace EtwTest;
+
+namespace
+{
+    unsigned const NoIndex = ~0u;
+
+    struct ReferenceItem
+    {
+        EtwEnumeratorState State;
+        std::string Name;
+        void const* Data;
+        unsigned DataSize;
+        USHORT ArrayIndex;
+        USHORT ArrayCount;
+        USHORT ElementSize;
+        unsigned EndIndex; // For ArrayBegin/StructBegin: index of matching end, or NoIndex.
+        unsigned Parent;   // Index of the enclosing ArrayBegin/StructBegin, or NoIndex.
+    };
+
+    class SkipFixture
+    {
+        TestSchema m_schema;
+        TestCallbacks m_callbacks;
+        std::mt19937 m_rng;
+
+    public:
+
+        EtwEnumerator Enumerator;
+        std::vector<ReferenceItem> Items; // The reference walk.
+        EtwEnumeratorState EndState;      // State after the reference walk.
+        LSTATUS EndError;                 // LastError after the reference walk.
+        unsigned Mismatches;
+
+        SkipFixture()
+            : m_schema()
+            , m_callbacks()
+            , m_rng(24)
+            , Enumerator(m_callbacks)
+            , Items()
+            , EndState()
+            , EndError()
+            , Mismatches(0)
+        {
+            m_schema.Add("Pad", Scalar(TDH_INTYPE_UINT8));                      //  0 Misaligns the rest.
+            m_schema.Add("N", Scalar(TDH_INTYPE_UINT16));                       //  1
+            m_schema.Add("Recs", CountedStruct(8, 3, 1));                       //  2 Fixed, 105 bytes.
+            m_schema.Add("One", Struct(15, 2));                                 //  3 Fixed, 8 bytes.
+            m_schema.Add("Var", CountedStruct(17, 2, 1));                       //  4 String member.
+            m_schema.Add("Mixed", Struct(19, 2, 2));                            //  5 Pointer in nested struct.
+            m_schema.Add("Cnt", Struct(23, 2, 2));                              //  6 Counted member.
+            m_schema.Add("Tail", Scalar(TDH_INTYPE_UINT32));                    //  7
+            m_schema.Add("A", Scalar(TDH_INTYPE_UINT16));                       //  8 Recs
+            m_schema.Add("Inner", Struct(11, 2, 3));                            //  9 Recs, fixed, 29 bytes.
+            m_schema.Add("G", Scalar(TDH_INTYPE_GUID));                         // 10 Recs
+            m_schema.Add("X", Scalar(TDH_INTYPE_UINT8));                        // 11 Inner
+            m_schema.Add("Deep", Struct(13, 2, 2));                             // 12 Inner, fixed, 14 bytes.
+            m_schema.Add("D", Scalar(TDH_INTYPE_UINT16));                       // 13 Deep
+            m_schema.Add("E", Scalar(TDH_INTYPE_INT32, TDH_OUTTYPE_NULL, 3));   // 14 Deep
+            m_schema.Add("P", Scalar(TDH_INTYPE_UINT32));                       // 15 One
+            m_schema.Add("Q", Scalar(TDH_INTYPE_UINT8, TDH_OUTTYPE_NULL, 4));   // 16 One
+            m_schema.Add("S", Scalar(TDH_INTYPE_UNICODESTRING));                // 17 Var
+            m_schema.Add("Z", Scalar(TDH_INTYPE_UINT16));                       // 18 Var
+            m_schema.Add("F", Scalar(TDH_INTYPE_UINT16));                       // 19 Mixed
+            m_schema.Add("Nest", Struct(21, 2));                                // 20 Mixed
+            m_schema.Add("W", Scalar(TDH_INTYPE_POINTER));                      // 21 Nest
+            m_schema.Add("H", Scalar(TDH_INTYPE_UINT16));                       // 22 Nest
+            m_schema.Add("C", Scalar(TDH_INTYPE_UINT8));                        // 23 Cnt
+            m_schema.Add("Vals", CountedArray(TDH_INTYPE_UINT16, 23));          // 24 Cnt
+            m_schema.SetTopLevelCount(8);
+            m_callbacks.SetSchema(1, m_schema);
+        }
+
+        unsigned
+        Random(unsigned limit)
+        {
+            return static_cast<unsigned>(m_rng() % limit);
+        }
+
+        TestEvent
+        MakeEvent(unsigned cbPointer)
+        {
+            TestEvent event(1);
+            USHORT const n = static_cast<USHORT>(Random(10) == 0 ? 500 : Random(9));
+            event.Add(static_cast<BYTE>(m_rng()));
+            event.Add(n);
+            for (unsigned i = 0; i != n; i += 1) // Recs
+            {
+                event.Add(static_cast<UINT16>(m_rng()));
+                for (unsigned j = 0; j != 3; j += 1) // Inner
+                {
+                    event.Add(static_cast<BYTE>(m_rng()));
+                    for (unsigned k = 0; k != 2; k += 1) // Deep
+                    {
+                        event.Add(static_cast<UINT16>(m_rng()));
+                        event.Add(static_cast<INT32>(m_rng())).Add(static_cast<INT32>(m_rng())).Add(static_cast<INT32>(m_rng()));
+                    }
+                }
+
+                GUID g;
+                memset(&g, static_cast<BYTE>(i), sizeof(g));
+                event.Add(g);
+            }
+
+            event.Add(static_cast<UINT32>(m_rng())); // One
+            event.Add(static_cast<UINT32>(m_rng()));
+            for (unsigned i = 0; i != n; i += 1) // Var
+            {
+                event.AddString(Random(2) ? "ab" : "");
+                event.Add(static_cast<UINT16>(m_rng()));
+            }
+
+            for (unsigned i = 0; i != 2; i += 1) // Mixed
+            {
+                event.Add(static_cast<UINT16>(m_rng()));
+                if (cbPointer == 4)
+                {
+                    event.Add(static_cast<UINT32>(m_rng()));
+                }
+                else
+                {
+                    event.Add(static_cast<UINT64>(m_rng()));
+                }
+
+                event.Add(static_cast<UINT16>(m_rng()));
+            }
+
+            for (unsigned i = 0; i != 2; i += 1) // Cnt
+            {
+                BYTE const count = static_cast<BYTE>(Random(4));
+                event.Add(count);
+                for (unsigned j = 0; j != count; j += 1)
+                {
+                    event.Add(static_cast<UINT16>(m_rng()));
+                }
+            }
+
+            event.Add(static_cast<UINT32>(m_rng())); // Tail
+            return event;
+        }
+
+        // Walks the current event with MoveNext and records each item in Items.
+        void
+        RecordReference()
+        {
+            std::vector<unsigned> open;
+            Items.clear();
+            while (Enumerator.MoveNext())
+            {
+                auto const info = Enumerator.GetItemInfo();
+                auto const state = Enumerator.State();
+                unsigned const index = static_cast<unsigned>(Items.size());
+                ReferenceItem item = {
+                    state, ToUtf8(info.Name), info.Data, info.DataSize,
+                    info.ArrayIndex, info.ArrayCount, info.ElementSize,
+                    NoIndex, open.empty() ? NoIndex : open.back() };
+
+                if (state == EtwEnumeratorState_ArrayEnd || state == EtwEnumeratorState_StructEnd)
+                {
+                    ETW_CHECK(!open.empty());
+                    Items[open.back()].EndIndex = index;
+                    open.pop_back();
+                    item.Parent = open.empty() ? NoIndex : open.back();
+                }
+
+                Items.push_back(item);
+                if (state == EtwEnumeratorState_ArrayBegin || state == EtwEnumeratorState_StructBegin)
+                {
+                    open.push_back(index);
+                }
+            }
+
+            EndState = Enumerator.State();
+            EndError = Enumerator.LastError();
+        }
+
+        // The size that GetFixedStructSize reports at the reference item, or
+        // 0 if it should fail.
+        unsigned
+        ExpectedStructSize(unsigned index, bool plans) const
+        {
+            auto const& item = Items[index];
+            if (!plans || item.EndIndex == NoIndex ||
+                (item.State != EtwEnumeratorState_StructBegin &&
+                (item.State != EtwEnumeratorState_ArrayBegin || item.ElementSize != 0)))
+            {
+                return 0;
+            }
+
+            return
+                item.Name == "Recs" ? 105u :
+                item.Name == "Inner" ? 29u :
+                item.Name == "Deep" ? 14u :
+                item.Name == "One" ? 8u :
+                0u;
+        }
+
+        // Checks that the enumerator is at the reference item with the
+        // specified index (Items.size() for the end of the walk).
+        void
+        CheckAt(unsigned index, bool plans, char const* szWhat)
+        {
+            if (index == Items.size())
+            {
+                Report(Enumerator.State() == EndState && Enumerator.LastError() == EndError, szWhat);
+                return;
+            }
+
+            auto const& item = Items[index];
+            auto const info = Enumerator.GetItemInfo();
+            Report(
+                Enumerator.State() == item.State &&
+                ToUtf8(info.Name) == item.Name &&
+                info.Data == item.Data &&
+                info.DataSize == item.DataSize &&
+                info.ArrayIndex == item.ArrayIndex &&
+                info.ArrayCount == item.ArrayCount &&
+                info.ElementSize == item.ElementSize,
+                szWhat);
+
+            unsigned cbStruct = 1;
+            bool const fixed = Enumerator.GetFixedStructSize(&cbStruct);
+            unsigned const expected = ExpectedStructSize(index, plans);
+            Report(fixed == (expected != 0) && cbStruct == expected, "GetFixedStructSize");
+        }
+
+        void
+        Report(bool ok, char const* szWhat)
+        {
+            if (!ok)
+            {
+                if (Mismatches < 5)
+                {
+                    printf("Mismatch: %s\n", szWhat);
+                }
+
+                Mismatches += 1;
+            }
+        }
+    };
+}
+
+ETW_TEST(SiblingSkip_MatchesMoveNextWalk)
+{
+    SkipFixture f;
+    unsigned errors = 0;
+    unsigned fixedSkips = 0;
+    unsigned strides = 0;
+
+    for (unsigned eventIndex = 0; eventIndex != 600; eventIndex += 1)
+    {
+        unsigned const cbPointer = eventIndex % 2 ? 4 : 8;
+        TestEvent event = f.MakeEvent(cbPointer);
+        if (eventIndex % 4 == 3 && event.PayloadSize() != 0)
+        {
+            event.Truncate(f.Random(static_cast<unsigned>(event.PayloadSize())));
+        }
+
+        EVENT_RECORD& record = event.Record();
+        if (cbPointer == 4)
+        {
+            record.EventHeader.Flags = EVENT_HEADER_FLAG_32_BIT_HEADER;
+        }
+
+        f.Enumerator.SetDecodePlansEnabled(false);
+        ETW_CHECK(f.Enumerator.StartEvent(&record));
+        f.RecordReference();
+        errors += f.EndState == EtwEnumeratorState_Error;
+
+        // Element i of a complete array of fixed-size structs starts at
+        // Data + i * size.
+        for (auto const& item : f.Items)
+        {
+            if (item.State == EtwEnumeratorState_StructBegin && item.Parent != NoIndex &&
+                f.Items[item.Parent].State == EtwEnumeratorState_ArrayBegin)
+            {
+                unsigned const cbStruct = f.ExpectedStructSize(item.Parent, true);
+                if (cbStruct != 0)
+                {
+                    auto const pArray = static_cast<BYTE const*>(f.Items[item.Parent].Data);
+                    f.Report(item.Data == pArray + item.ArrayIndex * cbStruct, "stride");
+                    strides += 1;
+                }
+            }
+        }
+
+        for (bool plans : { true, false })
+        {
+            for (unsigned walk = 0; walk != 3; walk += 1)
+            {
+                // Walk 0 uses only MoveNextSibling, walk 1 only MoveNext.
+                f.Enumerator.SetDecodePlansEnabled(plans);
+                ETW_CHECK(f.Enumerator.StartEvent(&record));
+                unsigned index = NoIndex;
+                for (;;)
+                {
+                    bool const sibling = walk == 0 || (walk == 2 && f.Random(2) == 0);
+                    unsigned next = index + 1;
+                    if (sibling && index != NoIndex &&
+                        (f.Items[index].State == EtwEnumeratorState_ArrayBegin ||
+                        f.Items[index].State == EtwEnumeratorState_StructBegin))
+                    {
+                        auto const endIndex = f.Items[index].EndIndex;
+                        next = endIndex == NoIndex
+                            ? static_cast<unsigned>(f.Items.size())
+                            : endIndex + 1;
+                        fixedSkips += plans && f.ExpectedStructSize(index, true) != 0;
+                    }
+
+                    bool const moved = sibling
+                        ? f.Enumerator.MoveNextSibling()
+                        : f.Enumerator.MoveNext();
+                    f.Report(moved == (next != f.Items.size()), sibling ? "MoveNextSibling result" : "MoveNext result");
+                    f.CheckAt(moved ? next : static_cast<unsigned>(f.Items.size()), plans, sibling ? "MoveNextSibling" : "MoveNext");
+                    if (!moved || f.Mismatches != 0)
+                    {
+                        break;
+                    }
+
+                    index = next;
+                }
+            }
+        }
+    }
+
+    ETW_CHECK(f.Mismatches == 0);
+    ETW_CHECK(fixedSkips > 1000);
+    ETW_CHECK(strides > 10000);
+    ETW_CHECK(errors != 0);
+    ETW_CHECK(errors < 600 / 2);
+}
+
+ETW_TEST(SiblingSkip_TopLevel)
+{
+    // Skipping every top-level property must reach the same top-level items
+    // as a full walk, in one step for each array of fixed-size structs.
+    SkipFixture f;
+    for (unsigned eventIndex = 0; eventIndex != 50; eventIndex += 1)
+    {
+        TestEvent event = f.MakeEvent(8);
+        EVENT_RECORD& record = event.Record();
+
+        f.Enumerator.SetDecodePlansEnabled(false);
+        ETW_CHECK(f.Enumerator.StartEvent(&record));
+        f.RecordReference();
+        ETW_CHECK(f.EndState == EtwEnumeratorState_AfterLastItem);
+
+        std::vector<std::string> topLevel;
+        for (auto const& item : f.Items)
+        {
+            if (item.Parent == NoIndex &&
+                item.State != EtwEnumeratorState_ArrayEnd && item.State != EtwEnumeratorState_StructEnd)
+            {
+                topLevel.push_back(item.Name);
+            }
+        }
+
+        f.Enumerator.SetDecodePlansEnabled(true);
+        ETW_CHECK(f.Enumerator.StartEvent(&record));
+        std::vector<std::string> skipped;
+        while (f.Enumerator.MoveNextSibling())
+        {
+            skipped.push_back(ToUtf8(f.Enumerator.GetItemInfo().Name));
+        }
+
+        ETW_CHECK(f.Enumerator.State() == EtwEnumeratorState_AfterLastItem);
+        ETW_CHECK(skipped == topLevel);
+    }
+
+    ETW_CHECK(f.Mismatches == 0);
+}
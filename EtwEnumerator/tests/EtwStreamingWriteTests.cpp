@@ -0,0 +1,548 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for the Write methods (WriteCurrentEvent, WriteCurrentEventAsJson,
+WriteCurrentItemAsJsonAndMoveNextSibling, their UTF-8 variants, and
+WriteCurrentEventAsCbor). These send the items of large events to the sink
+in segments as they are formatted, so the concatenated segments must match
+the output of the corresponding Format method, and a sink error must stop
+the output. If a Write method fails after sending part of its result, it
+must call the sink's Abort method.
+*/
+
+#include "EtwTest.h"
+#include <stdio.h>
+
+using namespace EtwTest;
+
+namespace
+{
+    struct CollectingSink
+        : EtwOutputSink
+    {
+        std::string Output;
+        unsigned WriteCount = 0;
+        unsigned AbortCount = 0;
+
+        LSTATUS __stdcall Write(
+            _In_reads_bytes_(cb) void const* pb,
+            unsigned cb) noexcept override
+        {
+            Output.append(static_cast<char const*>(pb), cb);
+            WriteCount += 1;
+            return ERROR_SUCCESS;
+        }
+
+        // Keeps the partial result so that tests can check it.
+        void __stdcall Abort() noexcept override
+        {
+            AbortCount += 1;
+        }
+    };
+
+    // Provides Reserve/Commit so that UTF-16 results are encoded directly
+    // into the sink.
+    struct ReservingSink final
+        : CollectingSink
+    {
+        size_t ReservedSize = 0;
+
+        void* __stdcall Reserve(
+            unsigned cbMin,
+            _Out_ unsigned* pcbAvailable) noexcept override
+        {
+            ReservedSize = Output.size();
+            Output.resize(ReservedSize + cbMin);
+            *pcbAvailable = cbMin;
+            return &Output[ReservedSize];
+        }
+
+        LSTATUS __stdcall Commit(
+            unsigned cb) noexcept override
+        {
+            Output.resize(ReservedSize + cb);
+            WriteCount += 1;
+            return ERROR_SUCCESS;
+        }
+    };
+
+    // Fails the Write call with index FailIndex.
+    struct FailingSink final
+        : CollectingSink
+    {
+        unsigned FailIndex = 0;
+
+        LSTATUS __stdcall Write(
+            _In_reads_bytes_(cb) void const* pb,
+            unsigned cb) noexcept override
+        {
+            if (WriteCount == FailIndex)
+            {
+                WriteCount += 1;
+                return ERROR_NOT_SUPPORTED;
+            }
+
+            return CollectingSink::Write(pb, cb);
+        }
+    };
+
+    // Fails every map lookup with an error other than ERROR_NOT_FOUND, so
+    // formatting a value that has a map fails.
+    struct FailingMapCallbacks final
+        : TestCallbacks
+    {
+        LSTATUS __stdcall GetEventMapInformation(
+            _In_ EVENT_RECORD const* pEvent,
+            _In_z_ EtwPCWSTR szMapName,
+            _Out_writes_bytes_opt_(*pcbBuffer) EVENT_MAP_INFO* pBuffer,
+            _Inout_ ULONG* pcbBuffer) noexcept override
+        {
+            UNREFERENCED_PARAMETER(pEvent);
+            UNREFERENCED_PARAMETER(szMapName);
+            UNREFERENCED_PARAMETER(pBuffer);
+            UNREFERENCED_PARAMETER(pcbBuffer);
+            return ERROR_INVALID_DATA;
+        }
+    };
+
+    /*
+    Event 1: no message. Event 2: a message. Event 3: a message with a
+    parameter string that cannot be resolved, so it is formatted as JSON.
+    */
+    struct StreamingFixture
+    {
+        TestSchema Schemas[3];
+        TestCallbacks Callbacks;
+        EtwEnumerator Expected;
+        EtwEnumerator Actual;
+
+        StreamingFixture()
+            : Schemas()
+            , Callbacks()
+            , Expected(Callbacks)
+            , Actual(Callbacks)
+        {
+            for (unsigned i = 0; i != 3; i += 1)
+            {
+                auto& schema = Schemas[i];
+                schema.Add("Count", Scalar(TDH_INTYPE_UINT16));                 // 0
+                schema.Add("Names", CountedArray(TDH_INTYPE_UNICODESTRING, 0)); // 1
+                schema.Add("Tail", Scalar(TDH_INTYPE_UINT32));                  // 2
+                schema.Add("Pairs", CountedStruct(4, 2, 0));                    // 3
+                schema.Add("A", Scalar(TDH_INTYPE_UINT32));                     // 4
+                schema.Add("B", Scalar(TDH_INTYPE_UNICODESTRING));              // 5
+                schema.SetTopLevelCount(4);
+                Callbacks.SetSchema(static_cast<USHORT>(i + 1), schema);
+            }
+
+            Schemas[1].SetEventMessage("count %1, names %2, tail %3, pairs %4");
+            Schemas[2].SetEventMessage("%%9 count %1");
+        }
+    };
+
+    // Names include non-ASCII characters and surrogate pairs so that UTF-8
+    // segments must not split characters.
+    TestEvent
+    MakeEvent(
+        USHORT id,
+        UINT16 count)
+    {
+        char name[40];
+        TestEvent event(id, 0x01D3C9E5A1B2C3D4);
+        event.Add<UINT16>(count);
+        for (UINT16 i = 0; i != count; i += 1)
+        {
+            snprintf(name, sizeof(name), "n\xC3\xA9\xF0\x9F\x98\x80 \"%u\"", i);
+            event.AddString(name);
+        }
+
+        event.Add<UINT32>(0xFEEDF00D);
+        for (UINT16 i = 0; i != count; i += 1)
+        {
+            snprintf(name, sizeof(name), "b\xE4\xB8\xAD%u", i * 7u);
+            event.Add<UINT32>(i);
+            event.AddString(name);
+        }
+
+        return event;
+    }
+
+    std::string
+    Bytes(EtwStringViewZ const& str)
+    {
+        return std::string(reinterpret_cast<char const*>(str.Data), str.DataLength * sizeof(wchar_t));
+    }
+
+    std::string
+    Bytes(EtwStringViewUtf8Z const& str)
+    {
+        return std::string(str.Data, str.DataLength);
+    }
+
+    // Checks each Write method against the Format method for one event.
+    // Returns the number of mismatches and adds the number of sink calls
+    // used by WriteCurrentEventAsJson to *pWriteCount.
+    unsigned
+    CheckEvent(
+        StreamingFixture& f,
+        EVENT_RECORD const& record,
+        EtwJsonSuffixFlags flags,
+        _Inout_ unsigned* pWriteCount)
+    {
+        auto& expected = f.Expected;
+        auto& actual = f.Actual;
+        unsigned failures = 0;
+        EtwStringViewZ wide = {};
+        EtwStringViewUtf8Z utf8 = {};
+
+        auto const check = [&](char const* szMethod, bool ok, std::string const& want, CollectingSink const& sink)
+        {
+            if (!ok || want != sink.Output || sink.AbortCount != 0)
+            {
+                failures += 1;
+                printf("  %s: event %u, ok %d, expected %zu bytes, got %zu bytes\n",
+                    szMethod, record.EventHeader.EventDescriptor.Id, ok,
+                    want.size(), sink.Output.size());
+            }
+        };
+
+        ETW_CHECK(expected.StartEvent(&record));
+        ETW_CHECK(actual.StartEvent(&record));
+
+        ETW_CHECK(expected.FormatCurrentEvent(L"[%9]", flags, &wide));
+        {
+            CollectingSink sink;
+            check("WriteCurrentEvent", actual.WriteCurrentEvent(sink, L"[%9]", flags), Bytes(wide), sink);
+        }
+
+        ETW_CHECK(expected.FormatCurrentEventUtf8(L"[%9]", flags, &utf8));
+        {
+            CollectingSink sink;
+            check("WriteCurrentEventUtf8", actual.WriteCurrentEventUtf8(sink, L"[%9]", flags), Bytes(utf8), sink);
+            ReservingSink reserving;
+            check("WriteCurrentEventUtf8 (Reserve)", actual.WriteCurrentEventUtf8(reserving, L"[%9]", flags), Bytes(utf8), reserving);
+        }
+
+        ETW_CHECK(expected.FormatCurrentEventAsJson(L"[%9]", flags, &wide));
+        {
+            CollectingSink sink;
+            check("WriteCurrentEventAsJson", actual.WriteCurrentEventAsJson(sink, L"[%9]", flags), Bytes(wide), sink);
+            *pWriteCount += sink.WriteCount;
+        }
+
+        ETW_CHECK(expected.FormatCurrentEventAsJsonUtf8(L"[%9]", flags, &utf8));
+        {
+            CollectingSink sink;
+            check("WriteCurrentEventAsJsonUtf8", actual.WriteCurrentEventAsJsonUtf8(sink, L"[%9]", flags), Bytes(utf8), sink);
+        }
+
+        EtwPCWSTR const paths[] = { L"Pairs", L"Tail", L"Names" };
+        EtwFieldProjection projection;
+        ETW_CHECK(ERROR_SUCCESS == projection.SetFields(paths, 3));
+        ETW_CHECK(expected.FormatCurrentEventAsJson(projection, L"[%9]", flags, &wide));
+        {
+            std::string const want = ToUtf8(wide.Data, wide.DataLength);
+            CollectingSink sink;
+            check("WriteCurrentEventAsJsonUtf8 (projection)",
+                actual.WriteCurrentEventAsJsonUtf8(sink, projection, L"[%9]", flags), want, sink);
+        }
+
+        // Each top-level item, then the whole event from BeforeFirstItem.
+        for (int pass = 0; pass != 2; pass += 1)
+        {
+            ETW_CHECK(expected.StartEvent(&record));
+            ETW_CHECK(actual.StartEvent(&record));
+            if (pass == 0)
+            {
+                ETW_CHECK(expected.MoveNext());
+                ETW_CHECK(actual.MoveNext());
+            }
+
+            do
+            {
+                ETW_CHECK(expected.FormatCurrentItemAsJsonAndMoveNextSibling(EtwJsonItemFlags_Name, &wide));
+                CollectingSink sink;
+                check("WriteCurrentItemAsJsonAndMoveNextSibling",
+                    actual.WriteCurrentItemAsJsonAndMoveNextSibling(sink, EtwJsonItemFlags_Name), Bytes(wide), sink);
+                ETW_CHECK(expected.State() == actual.State());
+            } while (pass == 0 && expected.State() > EtwEnumeratorState_AfterLastItem);
+
+            ETW_CHECK(expected.StartEvent(&record));
+            ETW_CHECK(actual.StartEvent(&record));
+            if (pass == 0)
+            {
+                ETW_CHECK(expected.MoveNext());
+                ETW_CHECK(actual.MoveNext());
+            }
+
+            do
+            {
+                ETW_CHECK(expected.FormatCurrentItemAsJsonAndMoveNextSiblingUtf8(EtwJsonItemFlags_Name, &utf8));
+                CollectingSink sink;
+                check("WriteCurrentItemAsJsonAndMoveNextSiblingUtf8",
+                    actual.WriteCurrentItemAsJsonAndMoveNextSiblingUtf8(sink, EtwJsonItemFlags_Name), Bytes(utf8), sink);
+                ETW_CHECK(expected.State() == actual.State());
+            } while (pass == 0 && expected.State() > EtwEnumeratorState_AfterLastItem);
+        }
+
+        return failures;
+    }
+}
+
+ETW_TEST(StreamingWrite_MatchesFormat)
+{
+    StreamingFixture f;
+    unsigned failures = 0;
+
+    for (USHORT id = 1; id <= 3; id += 1)
+    {
+        for (UINT16 count : { 0, 1, 10, 300, 1200 })
+        {
+            auto event = MakeEvent(id, count);
+            for (auto flags : { EtwJsonSuffixFlags_None, EtwJsonSuffixFlags_Default })
+            {
+                unsigned writeCount = 0;
+                failures += CheckEvent(f, event.Record(), flags, &writeCount);
+
+                // Small events are sent in one call. Large ones are sent in
+                // segments.
+                ETW_CHECK(count >= 300 ? writeCount > 1 : writeCount == 1);
+            }
+        }
+    }
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(StreamingWrite_MessageIsBuffered)
+{
+    // An event with a message is not sent in segments, even if it is large,
+    // because the message might fall back to JSON.
+    StreamingFixture f;
+    auto event = MakeEvent(2, 1200);
+    EtwStringViewZ wide = {};
+    EtwStringViewUtf8Z utf8 = {};
+
+    ETW_CHECK(f.Expected.StartEvent(&event.Record()));
+    ETW_CHECK(f.Expected.FormatCurrentEvent(nullptr, EtwJsonSuffixFlags_Default, &wide));
+    std::string const expected = Bytes(wide);
+    ETW_CHECK(wide.DataLength > 20000);
+    ETW_CHECK(f.Expected.FormatCurrentEventAsJsonUtf8(nullptr, EtwJsonSuffixFlags_Default, &utf8));
+
+    CollectingSink sink;
+    ETW_CHECK(f.Actual.StartEvent(&event.Record()));
+    ETW_CHECK(f.Actual.WriteCurrentEvent(sink, nullptr, EtwJsonSuffixFlags_Default));
+    ETW_CHECK(sink.WriteCount == 1);
+    ETW_CHECK(sink.Output == expected);
+
+    // Same event as JSON is sent in segments.
+    CollectingSink jsonSink;
+    ETW_CHECK(f.Actual.WriteCurrentEventAsJsonUtf8(jsonSink, nullptr, EtwJsonSuffixFlags_Default));
+    ETW_CHECK(jsonSink.WriteCount > 1);
+    ETW_CHECK(jsonSink.Output == Bytes(utf8));
+}
+
+ETW_TEST(StreamingWrite_SinkFailure)
+{
+    StreamingFixture f;
+    auto event = MakeEvent(1, 1200);
+    EtwStringViewZ wide = {};
+    EtwStringViewUtf8Z utf8 = {};
+
+    ETW_CHECK(f.Expected.StartEvent(&event.Record()));
+    ETW_CHECK(f.Expected.FormatCurrentEventAsJson(nullptr, EtwJsonSuffixFlags_Default, &wide));
+    std::string const expected = Bytes(wide);
+
+    ETW_CHECK(f.Actual.StartEvent(&event.Record()));
+    for (unsigned failIndex : { 0u, 1u, 3u })
+    {
+        FailingSink sink;
+        sink.FailIndex = failIndex;
+        ETW_CHECK(!f.Actual.WriteCurrentEventAsJson(sink, nullptr, EtwJsonSuffixFlags_Default));
+        ETW_CHECK(f.Actual.LastError() == ERROR_NOT_SUPPORTED);
+        ETW_CHECK(sink.WriteCount == failIndex + 1);
+        ETW_CHECK(sink.AbortCount == 1);
+
+        // The segments sent before the failure are a prefix of the result.
+        ETW_CHECK(sink.Output.size() < expected.size());
+        ETW_CHECK(0 == expected.compare(0, sink.Output.size(), sink.Output));
+
+        FailingSink utf8Sink;
+        utf8Sink.FailIndex = failIndex;
+        ETW_CHECK(!f.Actual.WriteCurrentEventAsJsonUtf8(utf8Sink, nullptr, EtwJsonSuffixFlags_Default));
+        ETW_CHECK(f.Actual.LastError() == ERROR_NOT_SUPPORTED);
+        ETW_CHECK(utf8Sink.WriteCount == failIndex + 1);
+        ETW_CHECK(utf8Sink.AbortCount == 1);
+    }
+
+    // After a Write method, Format methods return the whole result.
+    ETW_CHECK(f.Actual.FormatCurrentEventAsJson(nullptr, EtwJsonSuffixFlags_Default, &wide));
+    ETW_CHECK(Bytes(wide) == expected);
+    ETW_CHECK(f.Expected.FormatCurrentEventAsJsonUtf8(nullptr, EtwJsonSuffixFlags_Default, &utf8));
+    std::string const expectedUtf8 = Bytes(utf8);
+    ETW_CHECK(f.Actual.FormatCurrentEventAsJsonUtf8(nullptr, EtwJsonSuffixFlags_Default, &utf8));
+    ETW_CHECK(Bytes(utf8) == expectedUtf8);
+}
+
+ETW_TEST(StreamingWrite_FormatFailureAborts)
+{
+    // Formatting "Status" fails because its map lookup fails. In a large
+    // event, the Names have already been sent in segments by then.
+    TestSchema schema;
+    schema.Add("Count", Scalar(TDH_INTYPE_UINT16));                 // 0
+    schema.Add("Names", CountedArray(TDH_INTYPE_UNICODESTRING, 0)); // 1
+    schema.Add("Status", Scalar(TDH_INTYPE_UINT32), "StatusMap");   // 2
+    FailingMapCallbacks callbacks;
+    callbacks.SetSchema(1, schema);
+    EtwEnumerator enumerator(callbacks);
+
+    auto const makeEvent = [](UINT16 count)
+    {
+        TestEvent event(1, 0x01D3C9E5A1B2C3D4);
+        event.Add<UINT16>(count);
+        for (UINT16 i = 0; i != count; i += 1)
+        {
+            event.AddString("name \xC3\xA9");
+        }
+
+        event.Add<UINT32>(2);
+        return event;
+    };
+
+    unsigned failures = 0;
+    for (UINT16 count : { 1, 2000 })
+    {
+        auto event = makeEvent(count);
+        unsigned const abortCount = count == 1 ? 0 : 1;
+        auto const check = [&](char const* szMethod, auto&& write)
+        {
+            ReservingSink sink;
+            ETW_CHECK(enumerator.StartEvent(&event.Record()));
+            bool const ok = write(sink);
+            if (ok ||
+                enumerator.LastError() != ERROR_INVALID_DATA ||
+                (sink.WriteCount != 0) != (abortCount != 0) ||
+                sink.AbortCount != abortCount)
+            {
+                failures += 1;
+                printf("  %s: count %u, ok %d, error %u, %u writes, %u aborts\n",
+                    szMethod, count, ok, static_cast<unsigned>(enumerator.LastError()),
+                    sink.WriteCount, sink.AbortCount);
+            }
+        };
+
+        check("WriteCurrentEvent", [&](EtwOutputSink& sink)
+            {
+                return enumerator.WriteCurrentEvent(sink, nullptr, EtwJsonSuffixFlags_Default);
+            });
+        check("WriteCurrentEventAsJson", [&](EtwOutputSink& sink)
+            {
+                return enumerator.WriteCurrentEventAsJson(sink, nullptr, EtwJsonSuffixFlags_Default);
+            });
+        check("WriteCurrentItemAsJsonAndMoveNextSibling", [&](EtwOutputSink& sink)
+            {
+                return enumerator.WriteCurrentItemAsJsonAndMoveNextSibling(sink, EtwJsonItemFlags_Name);
+            });
+        check("WriteCurrentEventUtf8", [&](EtwOutputSink& sink)
+            {
+                return enumerator.WriteCurrentEventUtf8(sink, nullptr, EtwJsonSuffixFlags_Default);
+            });
+        check("WriteCurrentEventAsJsonUtf8", [&](EtwOutputSink& sink)
+            {
+                return enumerator.WriteCurrentEventAsJsonUtf8(sink, nullptr, EtwJsonSuffixFlags_Default);
+            });
+        check("WriteCurrentItemAsJsonAndMoveNextSiblingUtf8", [&](EtwOutputSink& sink)
+            {
+                return enumerator.WriteCurrentItemAsJsonAndMoveNextSiblingUtf8(sink, EtwJsonItemFlags_Name);
+            });
+    }
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(StreamingWrite_FlushedItemsNeedComma)
+{
+    // The items are flushed at the long value, leaving only "}" unsent, so
+    // the output size is the same as before the items. The "meta" suffix
+    // still needs a comma.
+    TestSchema schema;
+    schema.Add("Last", Struct(1, 1)); // 0
+    schema.Add("X", Scalar(TDH_INTYPE_UNICODESTRING)); // 1
+    schema.SetTopLevelCount(1);
+    TestCallbacks callbacks;
+    callbacks.SetSchema(1, schema);
+    EtwEnumerator expected(callbacks);
+    EtwEnumerator actual(callbacks);
+
+    TestEvent event(1, 0x01D3C9E5A1B2C3D4);
+    event.AddString(std::string(9000, 'x').c_str());
+
+    EtwStringViewZ wide = {};
+    ETW_CHECK(expected.StartEvent(&event.Record()));
+    ETW_CHECK(expected.FormatCurrentEventAsJson(nullptr, EtwJsonSuffixFlags_Default, &wide));
+    std::string const expectedWide = Bytes(wide);
+
+    EtwStringViewUtf8Z utf8 = {};
+    ETW_CHECK(expected.FormatCurrentEventAsJsonUtf8(nullptr, EtwJsonSuffixFlags_Default, &utf8));
+    std::string const expectedUtf8 = Bytes(utf8);
+
+    ETW_CHECK(actual.StartEvent(&event.Record()));
+    CollectingSink sink;
+    ETW_CHECK(actual.WriteCurrentEventAsJson(sink, nullptr, EtwJsonSuffixFlags_Default));
+    ETW_CHECK(sink.WriteCount == 2);
+    ETW_CHECK(sink.Output == expectedWide);
+
+    CollectingSink utf8Sink;
+    ETW_CHECK(actual.WriteCurrentEventAsJsonUtf8(utf8Sink, nullptr, EtwJsonSuffixFlags_Default));
+    ETW_CHECK(utf8Sink.WriteCount == 2);
+    ETW_CHECK(utf8Sink.Output == expectedUtf8);
+}
+
+ETW_TEST(StreamingWrite_Cbor)
+{
+    StreamingFixture f;
+    auto event = MakeEvent(1, 1200);
+
+    ETW_CHECK(f.Actual.StartEvent(&event.Record()));
+    CollectingSink sink;
+    ETW_CHECK(f.Actual.WriteCurrentEventAsCbor(sink, EtwJsonSuffixFlags_Default));
+    ETW_CHECK(sink.WriteCount > 1);
+    ETW_CHECK(sink.Output.size() > 2);
+    ETW_CHECK(sink.Output.front() == '\xBF'); // Map (indefinite length).
+    ETW_CHECK(sink.Output.back() == '\xFF');  // Break.
+
+    // Every string appears in order in the concatenated segments.
+    char name[40];
+    size_t pos = 0;
+    for (unsigned i = 0; i != 1200 && pos != std::string::npos; i += 1)
+    {
+        snprintf(name, sizeof(name), "n\xC3\xA9\xF0\x9F\x98\x80 \"%u\"", i);
+        pos = sink.Output.find(name, pos);
+    }
+
+    for (unsigned i = 0; i != 1200 && pos != std::string::npos; i += 1)
+    {
+        snprintf(name, sizeof(name), "b\xE4\xB8\xAD%u", i * 7u);
+        pos = sink.Output.find(name, pos);
+    }
+
+    ETW_CHECK(pos != std::string::npos);
+
+    // The segments sent before a sink failure are a prefix of the result.
+    FailingSink failing;
+    failing.FailIndex = 2;
+    ETW_CHECK(!f.Actual.WriteCurrentEventAsCbor(failing, EtwJsonSuffixFlags_Default));
+    ETW_CHECK(f.Actual.LastError() == ERROR_NOT_SUPPORTED);
+    ETW_CHECK(failing.WriteCount == 3);
+    ETW_CHECK(failing.AbortCount == 1);
+    ETW_CHECK(failing.Output.size() < sink.Output.size());
+    ETW_CHECK(0 == sink.Output.compare(0, failing.Output.size(), failing.Output));
+
+    // A small event is sent in one call.
+    auto small = MakeEvent(1, 10);
+    ETW_CHECK(f.Actual.StartEvent(&small.Record()));
+    CollectingSink smallSink;
+    ETW_CHECK(f.Actual.WriteCurrentEventAsCbor(smallSink, EtwJsonSuffixFlags_Default));
+    ETW_CHECK(smallSink.WriteCount == 1);
+}
@@ -0,0 +1,375 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Minimal test harness for the EtwEnumerator tests.
+
+- ETW_TEST(Name) defines and registers a test function.
+- ETW_BENCHMARK(Name) defines and registers a benchmark. Benchmarks run only
+  when the runner is invoked with -bench. Each benchmark times the current
+  code against a reference implementation of the code it replaced.
+- ETW_CHECK(expr) reports a failure (file, line, expression) if expr is false.
+  The test keeps running after a failed check.
+- TestSchema builds a TRACE_EVENT_INFO from a list of properties.
+- TestMap builds an EVENT_MAP_INFO from a list of entries.
+- TestCallbacks is an EtwEnumeratorCallbacks that returns TestSchema
+  information (by event ID) and TestMap information (by map name) instead of
+  calling TDH, and counts the lookups.
+- TestEvent builds an EVENT_RECORD with a payload.
+
+Tests do not need TDH, a trace session, or an ETL file, so they also build
+and run on non-Windows platforms using the stand-in headers in compat/ (see
+compat/windows.h).
+*/
+
+#pragma once
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN 1 // Exclude rarely-used APIs from <windows.h>
+#endif
+
+#include <windows.h>
+#include <tdh.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <EtwEnumerator.h>
+
+namespace EtwTest
+{
+    typedef void TestFunction();
+
+    struct TestRegistration
+    {
+        TestRegistration(
+            _In_z_ char const* szName,
+            TestFunction* pfnTest,
+            bool isBenchmark = false) noexcept;
+    };
+
+    void
+    ReportFailure(
+        _In_z_ char const* szFile,
+        unsigned line,
+        _In_z_ char const* szExpression) noexcept;
+
+    /*
+    Calls fn() repeatCount times and returns the fastest run in nanoseconds.
+    */
+    template<class Fn>
+    double
+    BestTimeNs(
+        Fn&& fn,
+        unsigned repeatCount = 5)
+    {
+        double best = 0;
+        for (unsigned i = 0; i != repeatCount; i += 1)
+        {
+            auto const start = std::chrono::steady_clock::now();
+            fn();
+            double const ns = std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - start).count();
+            if (i == 0 || ns < best)
+            {
+                best = ns;
+            }
+        }
+
+        return best;
+    }
+
+    /*
+    Prints one line of benchmark results: the time per operation of the
+    reference implementation and of the current code, and the speedup.
+    */
+    void
+    ReportBenchmark(
+        _In_z_ char const* szLabel,
+        double referenceNs,
+        double currentNs,
+        double operationCount) noexcept;
+
+    /*
+    Converts UTF-16 to UTF-8 (unpaired surrogates become U+FFFD).
+    */
+    std::string
+    ToUtf8(
+        _In_reads_(cch) EtwWCHAR const* pch,
+        size_t cch);
+
+    std::string
+    ToUtf8(
+        _In_opt_z_ EtwWCHAR const* sz);
+
+    /*
+    Helpers for TestSchema::Add. Returns an EVENT_PROPERTY_INFO for:
+    - A scalar (count == 1) or fixed-length array (count > 1).
+    - A variable-length array whose count is the value of property countIndex.
+    - A binary/string whose length is the value of property lengthIndex.
+    - A struct (count == 1) or fixed-length array of structs (count > 1).
+    - A variable-length array of structs whose count is property countIndex.
+    */
+    EVENT_PROPERTY_INFO
+    Scalar(USHORT inType, USHORT outType = TDH_OUTTYPE_NULL, USHORT count = 1) noexcept;
+
+    EVENT_PROPERTY_INFO
+    CountedArray(USHORT inType, USHORT countIndex, USHORT outType = TDH_OUTTYPE_NULL) noexcept;
+
+    EVENT_PROPERTY_INFO
+    Sized(USHORT inType, USHORT lengthIndex, USHORT outType = TDH_OUTTYPE_NULL) noexcept;
+
+    EVENT_PROPERTY_INFO
+    Struct(USHORT startIndex, USHORT memberCount, USHORT count = 1) noexcept;
+
+    EVENT_PROPERTY_INFO
+    CountedStruct(USHORT startIndex, USHORT memberCount, USHORT countIndex) noexcept;
+
+    /*
+    Builds a TRACE_EVENT_INFO. Properties are added in payload order. By
+    default all properties are top-level; call SetTopLevelCount if some of
+    them are struct members (struct members go after the top-level
+    properties).
+    */
+    class TestSchema
+    {
+        struct Property
+        {
+            std::string Name;
+            std::string MapName;
+            EVENT_PROPERTY_INFO Info;
+        };
+
+        std::string m_providerName;
+        std::string m_eventName;
+        std::string m_eventMessage;
+        std::vector<Property> m_properties;
+        ULONG m_topLevelCount;
+        DECODING_SOURCE m_decodingSource;
+
+    public:
+
+        explicit TestSchema(
+            _In_z_ char const* szProviderName = "TestProvider",
+            _In_opt_z_ char const* szEventName = nullptr);
+
+        // Returns the index of the new property. szMapName is the name of
+        // the property's map (see TestCallbacks::SetMap), if any.
+        USHORT
+        Add(
+            _In_z_ char const* szName,
+            EVENT_PROPERTY_INFO const& info,
+            _In_opt_z_ char const* szMapName = nullptr);
+
+        void
+        SetTopLevelCount(
+            ULONG topLevelCount) noexcept;
+
+        void
+        SetDecodingSource(
+            DECODING_SOURCE decodingSource) noexcept;
+
+        // Sets the EventMessage (empty for none).
+        void
+        SetEventMessage(
+            _In_z_ char const* szEventMessage);
+
+        // Same contract as TdhGetEventInformation.
+        LSTATUS
+        GetEventInformation(
+            _Out_writes_bytes_opt_(*pcbBuffer) TRACE_EVENT_INFO* pBuffer,
+            _Inout_ ULONG* pcbBuffer) const noexcept;
+    };
+
+    /*
+    Builds an EVENT_MAP_INFO. Entries are added in map order.
+    */
+    class TestMap
+    {
+        struct Entry
+        {
+            ULONG Value;
+            std::string Name;
+        };
+
+        MAP_FLAGS m_flags;
+        std::vector<Entry> m_entries;
+
+    public:
+
+        explicit TestMap(
+            MAP_FLAGS flags = EVENTMAP_INFO_FLAG_MANIFEST_VALUEMAP);
+
+        TestMap&
+        Add(
+            ULONG value,
+            _In_z_ char const* szName);
+
+        // Same contract as TdhGetEventMapInformation.
+        LSTATUS
+        GetMapInformation(
+            _Out_writes_bytes_opt_(*pcbBuffer) EVENT_MAP_INFO* pBuffer,
+            _Inout_ ULONG* pcbBuffer) const noexcept;
+    };
+
+    /*
+    Returns TestSchema information for events (selected by event ID),
+    TestMap information for maps (selected by name), and parameter messages
+    (selected by message ID). Counts the successful
+    GetEventInformation calls and the GetEventMapInformation calls that did
+    not return ERROR_INSUFFICIENT_BUFFER.
+
+    If UseMapIndex is true, FormatIndexedMapValue calls
+    FormatMapValueUsingIndex (like the callbacks of a default-constructed
+    EtwEnumerator). Otherwise it uses the default implementation, which calls
+    FormatMapValue.
+    */
+    class TestCallbacks
+        : public EtwEnumeratorCallbacks
+    {
+        struct NamedMap
+        {
+            std::string Name;
+            TestMap const* Map;
+        };
+
+        struct ParameterMessage
+        {
+            ULONG MessageId;
+            std::string Message;
+        };
+
+        std::vector<TestSchema const*> m_schemas;
+        std::vector<NamedMap> m_maps;
+        std::vector<ParameterMessage> m_parameterMessages;
+
+    public:
+
+        unsigned LookupCount;
+        unsigned MapLookupCount;
+        bool UseMapIndex;
+
+        TestCallbacks() noexcept;
+
+        void
+        SetSchema(
+            USHORT eventId,
+            TestSchema const& schema);
+
+        void
+        SetMap(
+            _In_z_ char const* szName,
+            TestMap const& map);
+
+        // Sets the string returned by GetParameterMessage for messageId
+        // (ASCII). Other IDs return ERROR_MR_MID_NOT_FOUND.
+        void
+        SetParameterMessage(
+            ULONG messageId,
+            _In_z_ char const* szMessage);
+
+        LSTATUS __stdcall
+        GetEventInformation(
+            _In_ EVENT_RECORD const* pEvent,
+            ULONG cTdhContext,
+            _In_reads_opt_(cTdhContext) TDH_CONTEXT const* pTdhContext,
+            _Out_writes_bytes_opt_(*pcbBuffer) TRACE_EVENT_INFO* pBuffer,
+            _Inout_ ULONG* pcbBuffer) noexcept override;
+
+        LSTATUS __stdcall
+        GetEventMapInformation(
+            _In_ EVENT_RECORD const* pEvent,
+            _In_z_ EtwPCWSTR szMapName,
+            _Out_writes_bytes_opt_(*pcbBuffer) EVENT_MAP_INFO* pBuffer,
+            _Inout_ ULONG* pcbBuffer) noexcept override;
+
+        LSTATUS __stdcall
+        FormatIndexedMapValue(
+            _In_ EVENT_MAP_INFO const* pMapInfo,
+            EtwInternal::MapIndex const& mapIndex,
+            UnderlyingType valueType,
+            ULONG value,
+            EtwStringBuilder& mapBuilder) noexcept override;
+
+        LSTATUS __stdcall
+        GetParameterMessage(
+            _In_ EVENT_RECORD const* pEvent,
+            ULONG messageId,
+            EtwStringBuilder& parameterMessageBuilder) noexcept override;
+    };
+
+    /*
+    Builds an EVENT_RECORD. The record points into this object's buffers, so
+    call Record() again after modifying or moving the TestEvent.
+    */
+    class TestEvent
+    {
+        std::vector<BYTE> m_payload;
+        std::vector<BYTE> m_schemaTl;
+        EVENT_HEADER_EXTENDED_DATA_ITEM m_extendedData;
+        EVENT_RECORD m_record;
+
+    public:
+
+        explicit TestEvent(
+            USHORT eventId,
+            UINT64 timestamp = 0);
+
+        template<class T>
+        TestEvent&
+        Add(T value)
+        {
+            return AddBytes(&value, sizeof(value));
+        }
+
+        TestEvent&
+        AddBytes(
+            _In_reads_bytes_(cb) void const* pb,
+            size_t cb);
+
+        // Appends a nul-terminated UTF-16 string (input is UTF-8).
+        TestEvent&
+        AddString(
+            _In_z_ char const* szUtf8);
+
+        // Appends a nul-terminated 8-bit string.
+        TestEvent&
+        AddAnsiString(
+            _In_z_ char const* sz);
+
+        // Removes bytes from the end of the payload.
+        void
+        Truncate(
+            size_t cbPayload);
+
+        size_t
+        PayloadSize() const noexcept;
+
+        // Adds an EVENT_HEADER_EXT_TYPE_EVENT_SCHEMA_TL item (TraceLogging
+        // metadata) to the event.
+        void
+        SetSchemaTl(
+            _In_reads_bytes_(cb) void const* pb,
+            size_t cb);
+
+        EVENT_RECORD&
+        Record() noexcept;
+    };
+}
+
+#define ETW_TEST_CONCAT2(a, b) a##b
+#define ETW_TEST_CONCAT(a, b) ETW_TEST_CONCAT2(a, b)
+
+#define ETW_TEST(name) \
+    static void name(); \
+    static EtwTest::TestRegistration const ETW_TEST_CONCAT(name, _Registration)(#name, &name); \
+    static void name()
+
+#define ETW_BENCHMARK(name) \
+    static void name(); \
+    static EtwTest::TestRegistration const ETW_TEST_CONCAT(name, _Registration)(#name, &name, true); \
+    static void name()
+
+#define ETW_CHECK(expr) \
+    ((expr) ? (void)0 : EtwTest::ReportFailure(__FILE__, __LINE__, #expr))
@@ -0,0 +1,670 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Test runner and shared helpers for the EtwEnumerator tests.
+
+Usage: EtwEnumeratorTests [-bench] [NameFilter]
+Runs every registered test whose name contains NameFilter (default: all).
+With -bench, runs the benchmarks instead of the tests. Build with
+optimizations enabled (e.g. Release) before running benchmarks.
+Returns 0 if all checks passed, 1 otherwise.
+*/
+
+#include "EtwTest.h"
+#include <stdio.h>
+
+#pragma comment(lib, "tdh.lib") // Link against TDH.dll
+
+namespace
+{
+    struct RegisteredTest
+    {
+        char const* Name;
+        EtwTest::TestFunction* Function;
+        bool IsBenchmark;
+    };
+
+    // Function-local static so that registration does not depend on the
+    // initialization order of the test files.
+    std::vector<RegisteredTest>&
+    RegisteredTests()
+    {
+        static std::vector<RegisteredTest> tests;
+        return tests;
+    }
+
+    unsigned g_failureCount;
+
+    static void
+    AppendUtf8(
+        std::string& dest,
+        unsigned ch)
+    {
+        if (ch < 0x80)
+        {
+            dest += static_cast<char>(ch);
+        }
+        else if (ch < 0x800)
+        {
+            dest += static_cast<char>(0xC0 | (ch >> 6));
+            dest += static_cast<char>(0x80 | (ch & 0x3F));
+        }
+        else if (ch < 0x10000)
+        {
+            dest += static_cast<char>(0xE0 | (ch >> 12));
+            dest += static_cast<char>(0x80 | ((ch >> 6) & 0x3F));
+            dest += static_cast<char>(0x80 | (ch & 0x3F));
+        }
+        else
+        {
+            dest += static_cast<char>(0xF0 | (ch >> 18));
+            dest += static_cast<char>(0x80 | ((ch >> 12) & 0x3F));
+            dest += static_cast<char>(0x80 | ((ch >> 6) & 0x3F));
+            dest += static_cast<char>(0x80 | (ch & 0x3F));
+        }
+    }
+
+    static void
+    AppendUtf16(
+        std::vector<BYTE>& dest,
+        unsigned ch)
+    {
+        dest.push_back(static_cast<BYTE>(ch));
+        dest.push_back(static_cast<BYTE>(ch >> 8));
+    }
+}
+
+EtwTest::TestRegistration::TestRegistration(
+    _In_z_ char const* szName,
+    TestFunction* pfnTest,
+    bool isBenchmark) noexcept
+{
+    RegisteredTests().push_back(RegisteredTest{ szName, pfnTest, isBenchmark });
+}
+
+void
+EtwTest::ReportFailure(
+    _In_z_ char const* szFile,
+    unsigned line,
+    _In_z_ char const* szExpression) noexcept
+{
+    g_failureCount += 1;
+    printf("%s(%u): check failed: %s\n", szFile, line, szExpression);
+}
+
+void
+EtwTest::ReportBenchmark(
+    _In_z_ char const* szLabel,
+    double referenceNs,
+    double currentNs,
+    double operationCount) noexcept
+{
+    printf("  %-28s reference %9.2f ns/op, current %9.2f ns/op, %6.2fx\n",
+        szLabel,
+        referenceNs / operationCount,
+        currentNs / operationCount,
+        currentNs > 0 ? referenceNs / currentNs : 0.0);
+}
+
+std::string
+EtwTest::ToUtf8(
+    _In_reads_(cch) EtwWCHAR const* pch,
+    size_t cch)
+{
+    std::string result;
+    for (size_t i = 0; i != cch; i += 1)
+    {
+        unsigned ch = static_cast<USHORT>(pch[i]);
+        if (ch >= 0xD800 && ch < 0xDC00 &&
+            i + 1 != cch &&
+            static_cast<USHORT>(pch[i + 1]) >= 0xDC00 &&
+            static_cast<USHORT>(pch[i + 1]) < 0xE000)
+        {
+            i += 1;
+            ch = 0x10000 + ((ch - 0xD800) << 10) + (static_cast<USHORT>(pch[i]) - 0xDC00);
+        }
+        else if (ch >= 0xD800 && ch < 0xE000)
+        {
+            ch = 0xFFFD;
+        }
+
+        AppendUtf8(result, ch);
+    }
+
+    return result;
+}
+
+std::string
+EtwTest::ToUtf8(
+    _In_opt_z_ EtwWCHAR const* sz)
+{
+    size_t cch = 0;
+    if (sz != nullptr)
+    {
+        while (sz[cch] != 0)
+        {
+            cch += 1;
+        }
+    }
+
+    return ToUtf8(sz, cch);
+}
+
+EVENT_PROPERTY_INFO
+EtwTest::Scalar(USHORT inType, USHORT outType, USHORT count) noexcept
+{
+    EVENT_PROPERTY_INFO info = {};
+    info.nonStructType.InType = inType;
+    info.nonStructType.OutType = outType;
+    info.count = count;
+    info.length = 0;
+    return info;
+}
+
+EVENT_PROPERTY_INFO
+EtwTest::CountedArray(USHORT inType, USHORT countIndex, USHORT outType) noexcept
+{
+    EVENT_PROPERTY_INFO info = Scalar(inType, outType);
+    info.Flags = PropertyParamCount;
+    info.countPropertyIndex = countIndex;
+    return info;
+}
+
+EVENT_PROPERTY_INFO
+EtwTest::Sized(USHORT inType, USHORT lengthIndex, USHORT outType) noexcept
+{
+    EVENT_PROPERTY_INFO info = Scalar(inType, outType);
+    info.Flags = PropertyParamLength;
+    info.lengthPropertyIndex = lengthIndex;
+    return info;
+}
+
+EVENT_PROPERTY_INFO
+EtwTest::Struct(USHORT startIndex, USHORT memberCount, USHORT count) noexcept
+{
+    EVENT_PROPERTY_INFO info = {};
+    info.Flags = PropertyStruct;
+    info.structType.StructStartIndex = startIndex;
+    info.structType.NumOfStructMembers = memberCount;
+    info.count = count;
+    return info;
+}
+
+EVENT_PROPERTY_INFO
+EtwTest::CountedStruct(USHORT startIndex, USHORT memberCount, USHORT countIndex) noexcept
+{
+    EVENT_PROPERTY_INFO info = Struct(startIndex, memberCount);
+    info.Flags = static_cast<PROPERTY_FLAGS>(PropertyStruct | PropertyParamCount);
+    info.countPropertyIndex = countIndex;
+    return info;
+}
+
+EtwTest::TestSchema::TestSchema(
+    _In_z_ char const* szProviderName,
+    _In_opt_z_ char const* szEventName)
+    : m_providerName(szProviderName)
+    , m_eventName(szEventName ? szEventName : "")
+    , m_eventMessage()
+    , m_properties()
+    , m_topLevelCount(~0u)
+    , m_decodingSource(DecodingSourceXMLFile)
+{
+    return;
+}
+
+USHORT
+EtwTest::TestSchema::Add(
+    _In_z_ char const* szName,
+    EVENT_PROPERTY_INFO const& info,
+    _In_opt_z_ char const* szMapName)
+{
+    m_properties.push_back(Property{ szName, szMapName ? szMapName : "", info });
+    return static_cast<USHORT>(m_properties.size() - 1);
+}
+
+void
+EtwTest::TestSchema::SetTopLevelCount(
+    ULONG topLevelCount) noexcept
+{
+    m_topLevelCount = topLevelCount;
+}
+
+void
+EtwTest::TestSchema::SetDecodingSource(
+    DECODING_SOURCE decodingSource) noexcept
+{
+    m_decodingSource = decodingSource;
+}
+
+void
+EtwTest::TestSchema::SetEventMessage(
+    _In_z_ char const* szEventMessage)
+{
+    m_eventMessage = szEventMessage;
+}
+
+LSTATUS
+EtwTest::TestSchema::GetEventInformation(
+    _Out_writes_bytes_opt_(*pcbBuffer) TRACE_EVENT_INFO* pBuffer,
+    _Inout_ ULONG* pcbBuffer) const noexcept
+{
+    // Layout: TRACE_EVENT_INFO, EVENT_PROPERTY_INFO[], then UTF-16 strings.
+    ULONG const cProperties = static_cast<ULONG>(m_properties.size());
+    ULONG const cbFixed = static_cast<ULONG>(
+        offsetof(TRACE_EVENT_INFO, EventPropertyInfoArray) +
+        (cProperties ? cProperties : 1) * sizeof(EVENT_PROPERTY_INFO));
+
+    std::vector<BYTE> strings;
+    auto const addString = [&](std::string const& value) -> ULONG
+    {
+        ULONG const offset = cbFixed + static_cast<ULONG>(strings.size());
+        for (char ch : value)
+        {
+            AppendUtf16(strings, static_cast<unsigned char>(ch));
+        }
+
+        AppendUtf16(strings, 0);
+        return offset;
+    };
+
+    std::vector<ULONG> nameOffsets;
+    std::vector<ULONG> mapNameOffsets;
+    for (auto const& property : m_properties)
+    {
+        nameOffsets.push_back(addString(property.Name));
+        mapNameOffsets.push_back(property.MapName.empty() ? 0 : addString(property.MapName));
+    }
+
+    ULONG const providerNameOffset = addString(m_providerName);
+    ULONG const eventNameOffset = m_eventName.empty() ? 0 : addString(m_eventName);
+    ULONG const eventMessageOffset = m_eventMessage.empty() ? 0 : addString(m_eventMessage);
+
+    ULONG const cbNeeded = cbFixed + static_cast<ULONG>(strings.size());
+    if (pBuffer == nullptr || *pcbBuffer < cbNeeded)
+    {
+        *pcbBuffer = cbNeeded;
+        return ERROR_INSUFFICIENT_BUFFER;
+    }
+
+    memset(pBuffer, 0, cbFixed);
+    pBuffer->DecodingSource = m_decodingSource;
+    pBuffer->PropertyCount = cProperties;
+    pBuffer->TopLevelPropertyCount = m_topLevelCount < cProperties ? m_topLevelCount : cProperties;
+    pBuffer->ProviderNameOffset = providerNameOffset;
+    pBuffer->EventMessageOffset = eventMessageOffset;
+    if (m_decodingSource == DecodingSourceTlg)
+    {
+        pBuffer->TaskNameOffset = eventNameOffset;
+    }
+    else
+    {
+        pBuffer->EventNameOffset = eventNameOffset;
+    }
+
+    for (ULONG i = 0; i != cProperties; i += 1)
+    {
+        pBuffer->EventPropertyInfoArray[i] = m_properties[i].Info;
+        pBuffer->EventPropertyInfoArray[i].NameOffset = nameOffsets[i];
+        if (mapNameOffsets[i] != 0)
+        {
+            pBuffer->EventPropertyInfoArray[i].nonStructType.MapNameOffset = mapNameOffsets[i];
+        }
+    }
+
+    memcpy(reinterpret_cast<BYTE*>(pBuffer) + cbFixed, strings.data(), strings.size());
+    *pcbBuffer = cbNeeded;
+    return ERROR_SUCCESS;
+}
+
+EtwTest::TestMap::TestMap(
+    MAP_FLAGS flags)
+    : m_flags(flags)
+    , m_entries()
+{
+    return;
+}
+
+EtwTest::TestMap&
+EtwTest::TestMap::Add(
+    ULONG value,
+    _In_z_ char const* szName)
+{
+    m_entries.push_back(Entry{ value, szName });
+    return *this;
+}
+
+LSTATUS
+EtwTest::TestMap::GetMapInformation(
+    _Out_writes_bytes_opt_(*pcbBuffer) EVENT_MAP_INFO* pBuffer,
+    _Inout_ ULONG* pcbBuffer) const noexcept
+{
+    // Layout: EVENT_MAP_INFO, EVENT_MAP_ENTRY[], then UTF-16 strings.
+    ULONG const cEntries = static_cast<ULONG>(m_entries.size());
+    ULONG const cbFixed = static_cast<ULONG>(
+        offsetof(EVENT_MAP_INFO, MapEntryArray) +
+        (cEntries ? cEntries : 1) * sizeof(EVENT_MAP_ENTRY));
+
+    std::vector<BYTE> strings;
+    std::vector<ULONG> nameOffsets;
+    for (auto const& entry : m_entries)
+    {
+        nameOffsets.push_back(cbFixed + static_cast<ULONG>(strings.size()));
+        for (char ch : entry.Name)
+        {
+            AppendUtf16(strings, static_cast<unsigned char>(ch));
+        }
+
+        AppendUtf16(strings, 0);
+    }
+
+    ULONG const cbNeeded = cbFixed + static_cast<ULONG>(strings.size());
+    if (pBuffer == nullptr || *pcbBuffer < cbNeeded)
+    {
+        *pcbBuffer = cbNeeded;
+        return ERROR_INSUFFICIENT_BUFFER;
+    }
+
+    memset(pBuffer, 0, cbFixed);
+    pBuffer->Flag = m_flags;
+    pBuffer->EntryCount = cEntries;
+    pBuffer->MapEntryValueType = EVENTMAP_ENTRY_VALUETYPE_ULONG;
+    for (ULONG i = 0; i != cEntries; i += 1)
+    {
+        pBuffer->MapEntryArray[i].OutputOffset = nameOffsets[i];
+        pBuffer->MapEntryArray[i].Value = m_entries[i].Value;
+    }
+
+    memcpy(reinterpret_cast<BYTE*>(pBuffer) + cbFixed, strings.data(), strings.size());
+    *pcbBuffer = cbNeeded;
+    return ERROR_SUCCESS;
+}
+
+EtwTest::TestCallbacks::TestCallbacks() noexcept
+    : m_schemas()
+    , m_maps()
+    , m_parameterMessages()
+    , LookupCount(0)
+    , MapLookupCount(0)
+    , UseMapIndex(false)
+{
+    return;
+}
+
+void
+EtwTest::TestCallbacks::SetSchema(
+    USHORT eventId,
+    TestSchema const& schema)
+{
+    if (m_schemas.size() <= eventId)
+    {
+        m_schemas.resize(eventId + 1u);
+    }
+
+    m_schemas[eventId] = &schema;
+}
+
+void
+EtwTest::TestCallbacks::SetMap(
+    _In_z_ char const* szName,
+    TestMap const& map)
+{
+    m_maps.push_back(NamedMap{ szName, &map });
+}
+
+void
+EtwTest::TestCallbacks::SetParameterMessage(
+    ULONG messageId,
+    _In_z_ char const* szMessage)
+{
+    m_parameterMessages.push_back(ParameterMessage{ messageId, szMessage });
+}
+
+LSTATUS __stdcall
+EtwTest::TestCallbacks::GetEventInformation(
+    _In_ EVENT_RECORD const* pEvent,
+    ULONG cTdhContext,
+    _In_reads_opt_(cTdhContext) TDH_CONTEXT const* pTdhContext,
+    _Out_writes_bytes_opt_(*pcbBuffer) TRACE_EVENT_INFO* pBuffer,
+    _Inout_ ULONG* pcbBuffer) noexcept
+{
+    UNREFERENCED_PARAMETER(cTdhContext);
+    UNREFERENCED_PARAMETER(pTdhContext);
+
+    USHORT const eventId = pEvent->EventHeader.EventDescriptor.Id;
+    if (m_schemas.size() <= eventId || m_schemas[eventId] == nullptr)
+    {
+        return ERROR_NOT_FOUND;
+    }
+
+    LSTATUS const status = m_schemas[eventId]->GetEventInformation(pBuffer, pcbBuffer);
+    if (status == ERROR_SUCCESS)
+    {
+        LookupCount += 1;
+    }
+
+    return status;
+}
+
+LSTATUS __stdcall
+EtwTest::TestCallbacks::GetEventMapInformation(
+    _In_ EVENT_RECORD const* pEvent,
+    _In_z_ EtwPCWSTR szMapName,
+    _Out_writes_bytes_opt_(*pcbBuffer) EVENT_MAP_INFO* pBuffer,
+    _Inout_ ULONG* pcbBuffer) noexcept
+{
+    UNREFERENCED_PARAMETER(pEvent);
+
+    LSTATUS status = ERROR_NOT_FOUND;
+    std::string const name = ToUtf8(szMapName);
+    for (auto const& map : m_maps)
+    {
+        if (map.Name == name)
+        {
+            status = map.Map->GetMapInformation(pBuffer, pcbBuffer);
+            break;
+        }
+    }
+
+    if (status != ERROR_INSUFFICIENT_BUFFER)
+    {
+        MapLookupCount += 1;
+    }
+
+    return status;
+}
+
+LSTATUS __stdcall
+EtwTest::TestCallbacks::FormatIndexedMapValue(
+    _In_ EVENT_MAP_INFO const* pMapInfo,
+    EtwInternal::MapIndex const& mapIndex,
+    UnderlyingType valueType,
+    ULONG value,
+    EtwStringBuilder& mapBuilder) noexcept
+{
+    return UseMapIndex
+        ? FormatMapValueUsingIndex(pMapInfo, mapIndex, valueType, value, mapBuilder)
+        : EtwEnumeratorCallbacks::FormatIndexedMapValue(pMapInfo, mapIndex, valueType, value, mapBuilder);
+}
+
+LSTATUS __stdcall
+EtwTest::TestCallbacks::GetParameterMessage(
+    _In_ EVENT_RECORD const* pEvent,
+    ULONG messageId,
+    EtwStringBuilder& parameterMessageBuilder) noexcept
+{
+    UNREFERENCED_PARAMETER(pEvent);
+
+    for (auto const& parameterMessage : m_parameterMessages)
+    {
+        if (parameterMessage.MessageId == messageId)
+        {
+            LSTATUS status = ERROR_SUCCESS;
+            for (char ch : parameterMessage.Message)
+            {
+                status = parameterMessageBuilder.AppendChar(static_cast<unsigned char>(ch));
+                if (status != ERROR_SUCCESS)
+                {
+                    break;
+                }
+            }
+
+            return status;
+        }
+    }
+
+    return ERROR_MR_MID_NOT_FOUND;
+}
+
+EtwTest::TestEvent::TestEvent(
+    USHORT eventId,
+    UINT64 timestamp)
+    : m_payload()
+    , m_schemaTl()
+    , m_extendedData()
+    , m_record()
+{
+    m_record.EventHeader.Size = sizeof(EVENT_HEADER);
+    m_record.EventHeader.Flags = EVENT_HEADER_FLAG_64_BIT_HEADER;
+    m_record.EventHeader.ProcessId = 1234;
+    m_record.EventHeader.ThreadId = 5678;
+    m_record.EventHeader.TimeStamp.QuadPart = static_cast<LONGLONG>(timestamp);
+    m_record.EventHeader.ProviderId = GUID{ 0x12345678, 0x1234, 0x5678, { 1, 2, 3, 4, 5, 6, 7, 8 } };
+    m_record.EventHeader.EventDescriptor.Id = eventId;
+}
+
+EtwTest::TestEvent&
+EtwTest::TestEvent::AddBytes(
+    _In_reads_bytes_(cb) void const* pb,
+    size_t cb)
+{
+    auto const pbBytes = static_cast<BYTE const*>(pb);
+    m_payload.insert(m_payload.end(), pbBytes, pbBytes + cb);
+    return *this;
+}
+
+EtwTest::TestEvent&
+EtwTest::TestEvent::AddString(
+    _In_z_ char const* szUtf8)
+{
+    auto psz = reinterpret_cast<unsigned char const*>(szUtf8);
+    while (*psz != 0)
+    {
+        unsigned ch = *psz++;
+        unsigned cTrail = ch >= 0xF0 ? 3 : ch >= 0xE0 ? 2 : ch >= 0xC0 ? 1 : 0;
+        ch &= cTrail == 3 ? 0x07 : cTrail == 2 ? 0x0F : cTrail == 1 ? 0x1F : 0x7F;
+        for (; cTrail != 0 && *psz != 0; cTrail -= 1)
+        {
+            ch = (ch << 6) | (*psz++ & 0x3F);
+        }
+
+        if (ch >= 0x10000)
+        {
+            AppendUtf16(m_payload, 0xD800 + ((ch - 0x10000) >> 10));
+            AppendUtf16(m_payload, 0xDC00 + ((ch - 0x10000) & 0x3FF));
+        }
+        else
+        {
+            AppendUtf16(m_payload, ch);
+        }
+    }
+
+    AppendUtf16(m_payload, 0);
+    return *this;
+}
+
+EtwTest::TestEvent&
+EtwTest::TestEvent::AddAnsiString(
+    _In_z_ char const* sz)
+{
+    return AddBytes(sz, strlen(sz) + 1);
+}
+
+void
+EtwTest::TestEvent::Truncate(
+    size_t cbPayload)
+{
+    if (cbPayload < m_payload.size())
+    {
+        m_payload.resize(cbPayload);
+    }
+}
+
+size_t
+EtwTest::TestEvent::PayloadSize() const noexcept
+{
+    return m_payload.size();
+}
+
+void
+EtwTest::TestEvent::SetSchemaTl(
+    _In_reads_bytes_(cb) void const* pb,
+    size_t cb)
+{
+    auto const pbBytes = static_cast<BYTE const*>(pb);
+    m_schemaTl.assign(pbBytes, pbBytes + cb);
+}
+
+EVENT_RECORD&
+EtwTest::TestEvent::Record() noexcept
+{
+    m_record.UserDataLength = static_cast<USHORT>(m_payload.size());
+    m_record.UserData = m_payload.empty() ? nullptr : m_payload.data();
+    if (m_schemaTl.empty())
+    {
+        m_record.ExtendedDataCount = 0;
+        m_record.ExtendedData = nullptr;
+    }
+    else
+    {
+        m_extendedData = EVENT_HEADER_EXTENDED_DATA_ITEM();
+        m_extendedData.ExtType = EVENT_HEADER_EXT_TYPE_EVENT_SCHEMA_TL;
+        m_extendedData.DataSize = static_cast<USHORT>(m_schemaTl.size());
+        m_extendedData.DataPtr = reinterpret_cast<ULONGLONG>(m_schemaTl.data());
+        m_record.ExtendedDataCount = 1;
+        m_record.ExtendedData = &m_extendedData;
+    }
+
+    return m_record;
+}
+
+int __cdecl
+main(int argc, _In_count_(argc) char* argv[])
+{
+    int argIndex = 1;
+    bool const runBenchmarks = argc > argIndex && strcmp(argv[argIndex], "-bench") == 0;
+    if (runBenchmarks)
+    {
+        argIndex += 1;
+    }
+
+    char const* const szFilter = argc > argIndex ? argv[argIndex] : "";
+    unsigned testCount = 0;
+    unsigned failedTestCount = 0;
+
+    for (auto const& test : RegisteredTests())
+    {
+        if (test.IsBenchmark != runBenchmarks ||
+            strstr(test.Name, szFilter) == nullptr)
+        {
+            continue;
+        }
+
+        unsigned const failuresBefore = g_failureCount;
+        printf("[ RUN  ] %s\n", test.Name);
+        test.Function();
+        testCount += 1;
+        if (g_failureCount != failuresBefore)
+        {
+            failedTestCount += 1;
+            printf("[ FAIL ] %s\n", test.Name);
+        }
+        else
+        {
+            printf("[  OK  ] %s\n", test.Name);
+        }
+    }
+
+    printf("%u tests, %u failed.\n", testCount, failedTestCount);
+    return failedTestCount == 0 && testCount != 0 ? 0 : 1;
+}
@@ -0,0 +1,440 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests and benchmark for FILETIME formatting (AppendFileTime and its
+per-second TimestampCache). Timestamps formatted with a warm cache (time-
+sorted input) and with a cold cache must both match the FileTimeToSystemTime
+plus printf formatter that AppendFileTime used before, for every
+EtwTimestampFormat type and flag combination. Known timestamps are also
+checked against fixed expected strings.
+*/
+
+#include "EtwTest.h"
+#include <random>
+#include <stdio.h>
+
+using namespace EtwTest;
+
+namespace
+{
+    UINT64 const TicksPerSecond = 10000000;
+    UINT64 const TicksPerDay = TicksPerSecond * 86400;
+
+    // Reference: FileTimeToSystemTime, then printf (the previous AppendFileTime).
+    std::string
+    ReferenceFileTime(
+        UINT64 fileTime,
+        EtwTimestampFormat format,
+        int timeZoneBiasMinutes,
+        bool timeIsUtc)
+    {
+        UINT64 fileTimeAdjusted;
+        if (!timeIsUtc)
+        {
+            fileTimeAdjusted = fileTime;
+            format = static_cast<EtwTimestampFormat>(format | EtwTimestampFormat_NoTimeZoneSuffix);
+        }
+        else if (!(format & EtwTimestampFormat_Local))
+        {
+            fileTimeAdjusted = fileTime;
+        }
+        else
+        {
+            fileTimeAdjusted = EtwEnumerator::AdjustFileTime(fileTime, timeZoneBiasMinutes);
+        }
+
+        SYSTEMTIME st = {};
+        FileTimeToSystemTime(reinterpret_cast<FILETIME const*>(&fileTimeAdjusted), &st);
+
+        unsigned subseconds;
+        int subsecondsDigits;
+        if (format & EtwTimestampFormat_LowPrecision)
+        {
+            subseconds = st.wMilliseconds;
+            subsecondsDigits = 3;
+        }
+        else
+        {
+            subseconds = static_cast<unsigned>(fileTimeAdjusted % TicksPerSecond);
+            subsecondsDigits = 7;
+        }
+
+        char buffer[64];
+        if ((format & EtwTimestampFormat_TypeMask) == EtwTimestampFormat_Wpp)
+        {
+            snprintf(buffer, sizeof(buffer), "%02u/%02u/%04u-%02u:%02u:%02u.%0*u",
+                st.wMonth, st.wDay, st.wYear, st.wHour, st.wMinute, st.wSecond,
+                subsecondsDigits, subseconds);
+        }
+        else
+        {
+            snprintf(buffer, sizeof(buffer), "%04u-%02u-%02uT%02u:%02u:%02u.%0*u",
+                st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond,
+                subsecondsDigits, subseconds);
+        }
+
+        std::string result = buffer;
+        if (format & EtwTimestampFormat_NoTimeZoneSuffix)
+        {
+            // No suffix.
+        }
+        else if (format & EtwTimestampFormat_Local)
+        {
+            unsigned const absBiasMinutes = timeZoneBiasMinutes < 0 ? -timeZoneBiasMinutes : timeZoneBiasMinutes;
+            snprintf(buffer, sizeof(buffer), "%c%02u:%02u",
+                timeZoneBiasMinutes < 0 ? '-' : '+', absBiasMinutes / 60, absBiasMinutes % 60);
+            result += buffer;
+        }
+        else
+        {
+            result += 'Z';
+        }
+
+        return result;
+    }
+
+    UINT64
+    MakeFileTime(
+        WORD year,
+        WORD month,
+        WORD day,
+        WORD hour = 0,
+        WORD minute = 0,
+        WORD second = 0)
+    {
+        SYSTEMTIME st = {};
+        st.wYear = year;
+        st.wMonth = month;
+        st.wDay = day;
+        st.wHour = hour;
+        st.wMinute = minute;
+        st.wSecond = second;
+        UINT64 fileTime = 0;
+        ETW_CHECK(SystemTimeToFileTime(&st, reinterpret_cast<FILETIME*>(&fileTime)));
+        return fileTime;
+    }
+
+    // Sorted timestamps around second, minute, day, month, year and leap-day
+    // boundaries, the ends of the FILETIME range, and local-time (bias)
+    // boundaries.
+    std::vector<UINT64>
+    BoundaryFileTimes()
+    {
+        std::vector<UINT64> bases = {
+            0,
+            MakeFileTime(1601, 1, 1, 0, 0, 1),
+            MakeFileTime(1601, 12, 31, 23, 59, 59),
+            MakeFileTime(1899, 12, 31, 23, 59, 59),
+            MakeFileTime(1900, 2, 28, 23, 59, 59), // Not a leap year.
+            MakeFileTime(1970, 1, 1),
+            MakeFileTime(1999, 12, 31, 23, 59, 59),
+            MakeFileTime(2000, 2, 28, 23, 59, 59), // Leap year.
+            MakeFileTime(2000, 2, 29, 23, 59, 59),
+            MakeFileTime(2001, 1, 1),
+            MakeFileTime(2023, 12, 31, 23, 59, 59),
+            MakeFileTime(2024, 2, 29, 12, 0, 0),
+            MakeFileTime(2024, 3, 10, 9, 59, 59),  // US DST start (2:00 local at -8:00).
+            MakeFileTime(2024, 11, 3, 8, 59, 59),  // US DST end (2:00 local at -7:00).
+            MakeFileTime(2024, 3, 31, 0, 59, 59),  // EU DST start (1:00 UTC).
+            MakeFileTime(2100, 2, 28, 23, 59, 59), // Not a leap year.
+            MakeFileTime(2400, 2, 29, 23, 59, 59), // Leap year.
+            MakeFileTime(9999, 12, 31, 23, 59, 59),
+            MakeFileTime(30827, 12, 31, 23, 59, 59),
+            0x7FFFFFFFFFFFFFFF - TicksPerDay,
+            0x7FFFFFFFFFFFFFFF - TicksPerSecond,
+        };
+
+        std::vector<UINT64> fileTimes;
+        for (UINT64 base : bases)
+        {
+            for (UINT64 delta : {
+                UINT64(0), UINT64(1), UINT64(9999), UINT64(10000), UINT64(TicksPerSecond - 1),
+                UINT64(TicksPerSecond), UINT64(TicksPerSecond + 1), UINT64(TicksPerSecond * 60),
+                UINT64(TicksPerSecond * 3600), UINT64(TicksPerDay) })
+            {
+                if (base <= 0xFFFFFFFFFFFFFFFF - delta)
+                {
+                    fileTimes.push_back(base + delta);
+                }
+            }
+        }
+
+        // The end of the range, where local time saturates or
+        // FileTimeToSystemTime fails.
+        for (UINT64 fileTime : {
+            UINT64(0x7FFFFFFFFFFFFFFF), UINT64(0x8000000000000000), UINT64(0x8000000000000001),
+            UINT64(0xFFFFFFFFFFFFFFFF) })
+        {
+            fileTimes.push_back(fileTime);
+        }
+
+        return fileTimes;
+    }
+
+    struct TimestampFixture
+    {
+        TestCallbacks Callbacks;
+        EtwEnumerator Warm; // Formats the timestamps in order.
+        EtwEnumerator Cold; // Formats a distant timestamp before each one.
+
+        TimestampFixture()
+            : Callbacks()
+            , Warm(Callbacks)
+            , Cold(Callbacks)
+        {
+            return;
+        }
+
+        void SetFormat(EtwTimestampFormat format, int biasMinutes)
+        {
+            ETW_CHECK(Warm.SetTimestampFormat(format));
+            ETW_CHECK(Cold.SetTimestampFormat(format));
+            Warm.SetTimeZoneBiasMinutes(biasMinutes);
+            Cold.SetTimeZoneBiasMinutes(biasMinutes);
+        }
+
+        static std::string Format(EtwEnumerator& e, UINT64 fileTime, USHORT outType)
+        {
+            EtwStringView str = {};
+            ETW_CHECK(e.FormatValue(&fileTime, sizeof(fileTime), TDH_INTYPE_FILETIME,
+                static_cast<_TDH_OUT_TYPE>(outType), &str));
+            return ToUtf8(str.Data, str.DataLength);
+        }
+
+        // Returns the number of mismatches.
+        unsigned Check(UINT64 fileTime, USHORT outType)
+        {
+            EtwTimestampFormat const format = Warm.TimestampFormat();
+            bool const timeIsUtc = outType == TDH_OUTTYPE_DATETIME_UTC ||
+                0 != (format & EtwTimestampFormat_AssumeFileTimeUTC);
+            std::string const expected = ReferenceFileTime(
+                fileTime, format, Warm.TimeZoneBiasMinutes(), timeIsUtc);
+
+            std::string const warm = Format(Warm, fileTime, outType);
+
+            UINT64 const distant = fileTime ^ 0x0100000000000000;
+            Format(Cold, distant, outType);
+            std::string const cold = Format(Cold, fileTime, outType);
+
+            unsigned const failures = (warm != expected) + (cold != expected);
+            if (failures != 0)
+            {
+                printf("  0x%llX format 0x%X: expected \"%s\", warm \"%s\", cold \"%s\"\n",
+                    static_cast<unsigned long long>(fileTime), static_cast<unsigned>(format),
+                    expected.c_str(), warm.c_str(), cold.c_str());
+            }
+
+            return failures;
+        }
+    };
+
+    // Every type, every combination of flags.
+    std::vector<EtwTimestampFormat>
+    AllFormats()
+    {
+        std::vector<EtwTimestampFormat> formats;
+        for (unsigned type : { EtwTimestampFormat_Internet, EtwTimestampFormat_Wpp })
+        {
+            for (unsigned flags = 0; flags != 16; flags += 1)
+            {
+                formats.push_back(static_cast<EtwTimestampFormat>(type | (flags << 8)));
+            }
+        }
+
+        return formats;
+    }
+
+    int const TestBiases[] = { 0, -480, -420, 60, 330, 345, -1440, 1440 };
+}
+
+ETW_TEST(TimestampFormat_BoundariesMatchReference)
+{
+    TimestampFixture f;
+    auto const fileTimes = BoundaryFileTimes();
+    unsigned failures = 0;
+
+    for (EtwTimestampFormat format : AllFormats())
+    {
+        for (int bias : TestBiases)
+        {
+            f.SetFormat(format, bias);
+            for (USHORT outType : { TDH_OUTTYPE_DATETIME_UTC, TDH_OUTTYPE_DATETIME })
+            {
+                for (UINT64 fileTime : fileTimes)
+                {
+                    failures += f.Check(fileTime, outType);
+                }
+            }
+        }
+    }
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(TimestampFormat_ExpectedStrings)
+{
+    unsigned const Internet = EtwTimestampFormat_Internet;
+    unsigned const Wpp = EtwTimestampFormat_Wpp;
+    unsigned const Local = EtwTimestampFormat_Local;
+    unsigned const Low = EtwTimestampFormat_LowPrecision;
+    unsigned const NoSuffix = EtwTimestampFormat_NoTimeZoneSuffix;
+
+    // FILETIME values computed independently of FileTimeToSystemTime.
+    UINT64 const Unix = 0x019DB1DED53E8000;    // 1970-01-01T00:00:00Z
+    UINT64 const LeapDay = 0x01BF82B162C9FCCB; // 2000-02-29T12:34:56.7890123Z
+    UINT64 const NewYear = 0x01DB5BE019BA3FFF; // 2024-12-31T23:59:59.9999999Z
+    UINT64 const Mar2024 = 0x01DA72869064CC00; // 2024-03-10T01:02:03.456Z
+    UINT64 const Mar1900 = 0x014F6598C43F8000; // 1900-03-01T00:00:00Z
+    UINT64 const Y9999 = 0x24C85A5ED1C03FFF;   // 9999-12-31T23:59:59.9999999Z
+
+    struct
+    {
+        unsigned Format;
+        int BiasMinutes;
+        USHORT OutType;
+        UINT64 FileTime;
+        char const* Expected;
+    } const cases[] = {
+        { Internet, 0, TDH_OUTTYPE_DATETIME_UTC, 0, "1601-01-01T00:00:00.0000000Z" },
+        { Internet, 0, TDH_OUTTYPE_DATETIME_UTC, Unix, "1970-01-01T00:00:00.0000000Z" },
+        { Internet, 0, TDH_OUTTYPE_DATETIME_UTC, LeapDay, "2000-02-29T12:34:56.7890123Z" },
+        { Internet | Low, 0, TDH_OUTTYPE_DATETIME_UTC, LeapDay, "2000-02-29T12:34:56.789Z" },
+        { Internet | Local, -480, TDH_OUTTYPE_DATETIME_UTC, LeapDay, "2000-02-29T04:34:56.7890123-08:00" },
+        { Internet | Local, 330, TDH_OUTTYPE_DATETIME_UTC, LeapDay, "2000-02-29T18:04:56.7890123+05:30" },
+        { Internet | Local | NoSuffix, 330, TDH_OUTTYPE_DATETIME_UTC, LeapDay, "2000-02-29T18:04:56.7890123" },
+        { Wpp, 0, TDH_OUTTYPE_DATETIME_UTC, LeapDay, "02/29/2000-12:34:56.7890123Z" },
+        { Wpp | Low | NoSuffix, 0, TDH_OUTTYPE_DATETIME_UTC, LeapDay, "02/29/2000-12:34:56.789" },
+        { Internet | Local, 60, TDH_OUTTYPE_DATETIME_UTC, NewYear, "2025-01-01T00:59:59.9999999+01:00" },
+        { Wpp | Local | Low, 60, TDH_OUTTYPE_DATETIME_UTC, NewYear, "01/01/2025-00:59:59.999+01:00" },
+        { Internet | Local, -120, TDH_OUTTYPE_DATETIME_UTC, Mar2024, "2024-03-09T23:02:03.4560000-02:00" },
+        { Internet | Local, -1440, TDH_OUTTYPE_DATETIME_UTC, Mar1900, "1900-02-28T00:00:00.0000000-24:00" },
+        { Internet, 0, TDH_OUTTYPE_DATETIME_UTC, Y9999, "9999-12-31T23:59:59.9999999Z" },
+        { Internet, 0, TDH_OUTTYPE_DATETIME_UTC, 0x7FFFFFFFFFFFFFFF, "30828-09-14T02:48:05.4775807Z" },
+
+        // Not known to be UTC: no adjustment and no suffix, even with Local.
+        { Internet, 0, TDH_OUTTYPE_DATETIME, LeapDay, "2000-02-29T12:34:56.7890123" },
+        { Internet | Local, -480, TDH_OUTTYPE_DATETIME, LeapDay, "2000-02-29T12:34:56.7890123" },
+    };
+
+    TimestampFixture f;
+    unsigned failures = 0;
+    for (auto const& c : cases)
+    {
+        f.SetFormat(static_cast<EtwTimestampFormat>(c.Format), c.BiasMinutes);
+        std::string const actual = TimestampFixture::Format(f.Warm, c.FileTime, c.OutType);
+        if (actual != c.Expected)
+        {
+            printf("  0x%llX format 0x%X: expected \"%s\", got \"%s\"\n",
+                static_cast<unsigned long long>(c.FileTime), c.Format, c.Expected, actual.c_str());
+            failures += 1;
+        }
+    }
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(TimestampFormat_SortedStreamMatchesReference)
+{
+    TimestampFixture f;
+    std::mt19937_64 rng(9);
+    unsigned failures = 0;
+
+    // Time-sorted streams (mostly the same second, sometimes crossing a
+    // second, minute or day) for each format.
+    for (EtwTimestampFormat format : AllFormats())
+    {
+        f.SetFormat(format, -480);
+        UINT64 fileTime = MakeFileTime(2024, 2, 28, 23, 59, 58);
+        for (unsigned i = 0; i != 2000; i += 1)
+        {
+            failures += f.Check(fileTime, TDH_OUTTYPE_DATETIME_UTC);
+            fileTime += rng() % (TicksPerSecond / 4);
+        }
+    }
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(TimestampFormat_FormatChangesInvalidateCache)
+{
+    // The same second, alternating the type, flags, or bias between calls.
+    TimestampFixture f;
+    UINT64 const fileTime = MakeFileTime(2024, 11, 3, 8, 59, 59) + 1234567;
+    auto const formats = AllFormats();
+    unsigned failures = 0;
+
+    for (size_t i = 0; i != formats.size() * 2; i += 1)
+    {
+        // Alternates Internet and Wpp with the same flags, so consecutive
+        // calls are in the same adjusted second.
+        EtwTimestampFormat const format = formats[(i % 2) * 16 + (i / 2) % 16];
+        for (int bias : TestBiases)
+        {
+            f.Warm.SetTimestampFormat(format);
+            f.Warm.SetTimeZoneBiasMinutes(bias);
+            bool const timeIsUtc = 0 != (format & EtwTimestampFormat_AssumeFileTimeUTC);
+            failures += TimestampFixture::Format(f.Warm, fileTime, TDH_OUTTYPE_NULL) !=
+                ReferenceFileTime(fileTime, format, bias, timeIsUtc);
+            failures += TimestampFixture::Format(f.Warm, fileTime, TDH_OUTTYPE_DATETIME_UTC) !=
+                ReferenceFileTime(fileTime, format, bias, true);
+
+            EtwTimestampFormat const otherType = static_cast<EtwTimestampFormat>(
+                format ^ (EtwTimestampFormat_Internet ^ EtwTimestampFormat_Wpp));
+            f.Warm.SetTimestampFormat(otherType);
+            failures += TimestampFixture::Format(f.Warm, fileTime, TDH_OUTTYPE_DATETIME_UTC) !=
+                ReferenceFileTime(fileTime, otherType, bias, true);
+        }
+    }
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_BENCHMARK(TimestampFormat_SortedStream)
+{
+    // 10M time-sorted timestamps, about 4000 per second.
+    unsigned const count = 10000000;
+    std::vector<UINT64> fileTimes(count);
+    std::mt19937_64 rng(10);
+    UINT64 fileTime = MakeFileTime(2024, 3, 10, 9, 0, 0);
+    for (auto& value : fileTimes)
+    {
+        value = fileTime;
+        fileTime += rng() % 5000;
+    }
+
+    TestCallbacks callbacks;
+    EtwEnumerator enumerator(callbacks);
+
+    for (EtwTimestampFormat format : {
+        EtwTimestampFormat_Internet,
+        static_cast<EtwTimestampFormat>(EtwTimestampFormat_Wpp | EtwTimestampFormat_Local | EtwTimestampFormat_LowPrecision) })
+    {
+        enumerator.SetTimestampFormat(format);
+        enumerator.SetTimeZoneBiasMinutes(-480);
+        size_t totalChars = 0;
+
+        double const referenceNs = BestTimeNs([&]()
+            {
+                for (UINT64 value : fileTimes)
+                {
+                    totalChars += ReferenceFileTime(value, format, -480, true).size();
+                }
+            }, 1);
+
+        double const currentNs = BestTimeNs([&]()
+            {
+                for (UINT64 value : fileTimes)
+                {
+                    EtwStringView str;
+                    enumerator.FormatValue(&value, sizeof(value), TDH_INTYPE_FILETIME, TDH_OUTTYPE_DATETIME_UTC, &str);
+                    totalChars += str.DataLength;
+                }
+            }, 1);
+
+        ETW_CHECK(totalChars != 0);
+        ReportBenchmark(
+            format == EtwTimestampFormat_Internet ? "10M sorted (Internet)" : "10M sorted (Wpp|Local|Low)",
+            referenceNs, currentNs, count);
+    }
+}
@@ -0,0 +1,368 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for the UTF-8 JSON and value formatters (FormatCurrentEventAsJsonUtf8,
+FormatCurrentItemAsJsonAndMoveNextSiblingUtf8, FormatCurrentValueUtf8,
+FormatEventsAsJsonUtf8, and the corresponding Write methods). These write
+UTF-8 directly, so their output must match the UTF-16 formatters' output
+after conversion to UTF-8.
+*/
+
+#include "EtwTest.h"
+#include <string>
+
+using namespace EtwTest;
+
+namespace
+{
+    typedef std::vector<wchar_t> WideString;
+
+    struct CollectingSink final
+        : EtwOutputSink
+    {
+        std::string Output;
+
+        LSTATUS __stdcall Write(
+            _In_reads_bytes_(cb) void const* pb,
+            unsigned cb) noexcept override
+        {
+            Output.append(static_cast<char const*>(pb), cb);
+            return ERROR_SUCCESS;
+        }
+    };
+
+    struct Utf8FormatFixture
+    {
+        TestMap Map;
+        TestSchema Schema;
+        TestCallbacks Callbacks;
+        EtwEnumerator Wide;
+        EtwEnumerator Utf8;
+
+        Utf8FormatFixture()
+            : Map()
+            , Schema()
+            , Callbacks()
+            , Wide(Callbacks)
+            , Utf8(Callbacks)
+        {
+            Map.Add(1, "One").Add(2, "Two \"2\"");
+
+            Schema.Add("Name", Scalar(TDH_INTYPE_UNICODESTRING));                 // 0
+            Schema.Add("Text", Scalar(TDH_INTYPE_ANSISTRING, TDH_OUTTYPE_UTF8));  // 1
+            Schema.Add("Count", Scalar(TDH_INTYPE_UINT16));                       // 2
+            Schema.Add("Values", CountedArray(TDH_INTYPE_INT32, 2));              // 3
+            Schema.Add("Hex", Scalar(TDH_INTYPE_UINT32, TDH_OUTTYPE_HEXINT32));   // 4
+            Schema.Add("Mapped", Scalar(TDH_INTYPE_UINT32), "Map");               // 5
+            Schema.Add("Pairs", Struct(9, 2, 2));                                 // 6
+            Schema.Add("Names", Scalar(TDH_INTYPE_UNICODESTRING, TDH_OUTTYPE_NULL, 2)); // 7
+            Schema.Add("Id", Scalar(TDH_INTYPE_GUID));                            // 8
+            Schema.Add("A", Scalar(TDH_INTYPE_UINT8));                            // 9
+            Schema.Add("S", Scalar(TDH_INTYPE_UNICODESTRING));                    // 10 (unaligned)
+            Schema.SetTopLevelCount(9);
+            Callbacks.SetSchema(1, Schema);
+            Callbacks.SetMap("Map", Map);
+        }
+    };
+
+    void
+    AddWide(TestEvent& event, WideString const& str)
+    {
+        event.AddBytes(str.data(), str.size() * sizeof(wchar_t));
+        event.Add<wchar_t>(0);
+    }
+
+    WideString
+    Widen(char const* sz)
+    {
+        WideString str;
+        for (; *sz; sz += 1)
+        {
+            str.push_back(static_cast<unsigned char>(*sz));
+        }
+
+        return str;
+    }
+
+    // UTF-16 strings: empty, escapes, non-ASCII, surrogate pairs, unpaired
+    // surrogates, and a long string with escapes near the end.
+    std::vector<WideString>
+    TestStrings()
+    {
+        std::vector<WideString> strings = {
+            {},
+            Widen("plain"),
+            Widen("quote\" backslash\\ newline\n tab\t ctl\x01\x1F"),
+            { 0xE9, L' ', 0x4E2D, 0x6587, L' ', 0xD83D, 0xDE00, L'!' },
+            { 0xD800, L'a', 0xDC00, 0xDBFF, L'"', 0xDFFF, 0xD800 },
+            { 0x7F, 0x80, 0x7FF, 0x800, 0xFFFD, 0xFFFF },
+        };
+
+        WideString longString(200, L'x');
+        longString[150] = L'"';
+        longString[199] = 0xD800;
+        strings.push_back(longString);
+        return strings;
+    }
+
+    char const* const TestTexts[] = {
+        "",
+        "ascii",
+        "caf\xC3\xA9 \"q\" \\ \n\x01 \xF0\x9F\x98\x80",
+        "bad \xC3\x28 utf8 \xFF\x80", // Invalid UTF-8: not returned as-is.
+    };
+
+    TestEvent
+    MakeEvent(
+        WideString const& name,
+        char const* szText,
+        UINT32 value)
+    {
+        static GUID const guid = { 0x12345678, 0x9ABC, 0xDEF0, { 1, 2, 3, 4, 5, 6, 7, 8 } };
+        TestEvent event(1, 0x01D3C9E5A1B2C3D4);
+        AddWide(event, name);
+        event.AddAnsiString(szText);
+        event.Add<UINT16>(3);
+        event.Add<INT32>(-1).Add<INT32>(0).Add<INT32>(static_cast<INT32>(value));
+        event.Add<UINT32>(value);
+        event.Add<UINT32>(value);
+        for (UINT8 i = 0; i != 2; i += 1)
+        {
+            event.Add<UINT8>(i);
+            AddWide(event, name);
+        }
+
+        AddWide(event, name);
+        AddWide(event, Widen(szText));
+        event.Add(guid);
+        return event;
+    }
+
+    std::string
+    WideEventJson(
+        EtwEnumerator& e,
+        EVENT_RECORD const& record,
+        _In_opt_z_ EtwPCWSTR szPrefix,
+        EtwJsonSuffixFlags flags)
+    {
+        EtwStringViewZ json = {};
+        ETW_CHECK(e.StartEvent(&record));
+        ETW_CHECK(e.FormatCurrentEventAsJson(szPrefix, flags, &json));
+        return ToUtf8(json.Data, json.DataLength);
+    }
+
+    EtwJsonSuffixFlags const TestSuffixFlags[] = {
+        EtwJsonSuffixFlags_None,
+        EtwJsonSuffixFlags_Default,
+        EtwJsonSuffixFlags_All,
+    };
+
+    EtwPCWSTR const TestPrefixes[] = {
+        nullptr,
+        L"[%9]%8.%3::%4 [%1]",
+    };
+}
+
+ETW_TEST(Utf8Format_EventMatchesWide)
+{
+    Utf8FormatFixture f;
+    unsigned failures = 0;
+
+    for (auto const& name : TestStrings())
+    {
+        for (char const* szText : TestTexts)
+        {
+            for (UINT32 value : { 0u, 1u, 2u, 0xFFFFFFFFu })
+            {
+                TestEvent event = MakeEvent(name, szText, value);
+                for (EtwPCWSTR szPrefix : TestPrefixes)
+                {
+                    for (EtwJsonSuffixFlags flags : TestSuffixFlags)
+                    {
+                        std::string const expected = WideEventJson(f.Wide, event.Record(), szPrefix, flags);
+
+                        EtwStringViewUtf8Z utf8 = {};
+                        ETW_CHECK(f.Utf8.StartEvent(&event.Record()));
+                        ETW_CHECK(f.Utf8.FormatCurrentEventAsJsonUtf8(szPrefix, flags, &utf8));
+                        failures += expected != std::string(utf8.Data, utf8.DataLength);
+                        failures += utf8.Data[utf8.DataLength] != 0;
+
+                        CollectingSink sink;
+                        ETW_CHECK(f.Utf8.WriteCurrentEventAsJsonUtf8(sink, szPrefix, flags));
+                        failures += expected != sink.Output;
+                    }
+                }
+            }
+        }
+    }
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(Utf8Format_ItemsMatchWide)
+{
+    Utf8FormatFixture f;
+    unsigned failures = 0;
+
+    for (auto const& name : TestStrings())
+    {
+        for (char const* szText : TestTexts)
+        {
+            TestEvent event = MakeEvent(name, szText, 2);
+            for (EtwJsonItemFlags flags : {
+                EtwJsonItemFlags_None,
+                EtwJsonItemFlags_Name,
+                EtwJsonItemFlags_Space,
+                static_cast<EtwJsonItemFlags>(EtwJsonItemFlags_Name | EtwJsonItemFlags_Space) })
+            {
+                // Each top-level item, then each item within arrays and
+                // structs (MoveNext into each array or struct).
+                for (unsigned depth = 0; depth != 2; depth += 1)
+                {
+                    ETW_CHECK(f.Wide.StartEvent(&event.Record()));
+                    ETW_CHECK(f.Utf8.StartEvent(&event.Record()));
+                    bool wideMore = f.Wide.MoveNext();
+                    bool utf8More = f.Utf8.MoveNext();
+                    while (wideMore && utf8More)
+                    {
+                        if (depth != 0 &&
+                            (f.Wide.State() == EtwEnumeratorState_ArrayBegin ||
+                                f.Wide.State() == EtwEnumeratorState_StructBegin))
+                        {
+                            wideMore = f.Wide.MoveNext();
+                            utf8More = f.Utf8.MoveNext();
+                            continue;
+                        }
+
+                        if (f.Wide.State() == EtwEnumeratorState_ArrayEnd ||
+                            f.Wide.State() == EtwEnumeratorState_StructEnd)
+                        {
+                            wideMore = f.Wide.MoveNext();
+                            utf8More = f.Utf8.MoveNext();
+                            continue;
+                        }
+
+                        EtwStringViewZ wide = {};
+                        EtwStringViewUtf8Z utf8 = {};
+                        wideMore = f.Wide.FormatCurrentItemAsJsonAndMoveNextSibling(flags, &wide);
+                        utf8More = f.Utf8.FormatCurrentItemAsJsonAndMoveNextSiblingUtf8(flags, &utf8);
+                        failures += ToUtf8(wide.Data, wide.DataLength) != std::string(utf8.Data, utf8.DataLength);
+                        failures += f.Wide.State() != f.Utf8.State();
+                        wideMore = f.Wide.State() != EtwEnumeratorState_AfterLastItem;
+                        utf8More = f.Utf8.State() != EtwEnumeratorState_AfterLastItem;
+                    }
+
+                    failures += wideMore != utf8More;
+                }
+
+                // From BeforeFirstItem, through the Write method.
+                EtwStringViewZ wide = {};
+                ETW_CHECK(f.Wide.StartEvent(&event.Record()));
+                ETW_CHECK(f.Wide.FormatCurrentItemAsJsonAndMoveNextSibling(flags, &wide));
+                CollectingSink sink;
+                ETW_CHECK(f.Utf8.StartEvent(&event.Record()));
+                ETW_CHECK(f.Utf8.WriteCurrentItemAsJsonAndMoveNextSiblingUtf8(sink, flags));
+                failures += ToUtf8(wide.Data, wide.DataLength) != sink.Output;
+            }
+        }
+    }
+
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(Utf8Format_ValuesMatchWide)
+{
+    Utf8FormatFixture f;
+    unsigned failures = 0;
+    unsigned valueCount = 0;
+
+    for (auto const& name : TestStrings())
+    {
+        for (char const* szText : TestTexts)
+        {
+            TestEvent event = MakeEvent(name, szText, 1);
+            ETW_CHECK(f.Wide.StartEvent(&event.Record()));
+            ETW_CHECK(f.Utf8.StartEvent(&event.Record()));
+            while (f.Wide.MoveNext())
+            {
+                ETW_CHECK(f.Utf8.MoveNext());
+                if (f.Wide.State() == EtwEnumeratorState_Value)
+                {
+                    EtwStringView wide = {};
+                    EtwStringViewUtf8 utf8 = {};
+                    ETW_CHECK(f.Wide.FormatCurrentValue(&wide));
+                    ETW_CHECK(f.Utf8.FormatCurrentValueUtf8(&utf8));
+                    failures += ToUtf8(wide.Data, wide.DataLength) != std::string(utf8.Data, utf8.DataLength);
+
+                    CollectingSink sink;
+                    ETW_CHECK(f.Utf8.WriteCurrentValueUtf8(sink));
+                    failures += ToUtf8(wide.Data, wide.DataLength) != sink.Output;
+                    valueCount += 1;
+                }
+            }
+        }
+    }
+
+    ETW_CHECK(valueCount != 0);
+    ETW_CHECK(failures == 0);
+}
+
+ETW_TEST(Utf8Format_EventsBlockMatchesWide)
+{
+    Utf8FormatFixture f;
+
+    std::vector<TestEvent> events;
+    for (auto const& name : TestStrings())
+    {
+        for (char const* szText : TestTexts)
+        {
+            events.push_back(MakeEvent(name, szText, static_cast<UINT32>(events.size())));
+        }
+    }
+
+    std::vector<EVENT_RECORD const*> records;
+    for (auto& event : events)
+    {
+        records.push_back(&event.Record());
+    }
+
+    for (EtwJsonSuffixFlags flags : TestSuffixFlags)
+    {
+        std::string expected;
+        for (auto pRecord : records)
+        {
+            expected += WideEventJson(f.Wide, *pRecord, nullptr, flags);
+            expected += '\n';
+        }
+
+        std::vector<LSTATUS> errors(records.size(), ERROR_INVALID_STATE);
+        EtwStringViewUtf8 block = {};
+        unsigned const count = f.Utf8.FormatEventsAsJsonUtf8(
+            records.data(), static_cast<unsigned>(records.size()), flags, 0, errors.data(), &block);
+        ETW_CHECK(count == records.size());
+        ETW_CHECK(expected == std::string(block.Data, block.DataLength));
+        for (LSTATUS error : errors)
+        {
+            ETW_CHECK(error == ERROR_SUCCESS);
+        }
+
+        // With a flush threshold, the blocks concatenate to the same output.
+        std::string blocks;
+        for (unsigned i = 0; i != records.size();)
+        {
+            unsigned const n = f.Utf8.FormatEventsAsJsonUtf8(
+                records.data() + i, static_cast<unsigned>(records.size() - i), flags, 1000, nullptr, &block);
+            ETW_CHECK(n != 0);
+            if (n == 0)
+            {
+                break;
+            }
+
+            blocks.append(block.Data, block.DataLength);
+            i += n;
+        }
+
+        ETW_CHECK(expected == blocks);
+    }
+}
@@ -0,0 +1,531 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+/*
+Tests for EtwEnumerator::Visit. Over random payloads for a schema with every
+canonical InType, fixed-length and counted arrays of each array handler's
+type, arrays that are delivered element by element, structs, and arrays of
+structs, with 32-bit and 64-bit pointers and with truncation, the handler
+calls must match a MoveNext walk: simple arrays are built from the values of
+their elements, and everything else from one item at a time. A visitor that
+stops early must leave the enumerator at the item it stopped on.
+*/
+
+#include "EtwTest.h"
+#include <random>
+
+using namespace EtwTest;
+
+namespace
+{
+    std::string
+    Hex(void const* pb, size_t cb)
+    {
+        std::string s;
+        char sz[4];
+        for (size_t i = 0; i != cb; i += 1)
+        {
+            snprintf(sz, sizeof(sz), "%02X", static_cast<BYTE const*>(pb)[i]);
+            s += sz;
+        }
+
+        return s;
+    }
+
+    std::string
+    SystemTimeText(SYSTEMTIME const& st)
+    {
+        char sz[64];
+        snprintf(sz, sizeof(sz), "%u-%u-%u-%u-%u-%u-%u-%u",
+            st.wYear, st.wMonth, st.wDayOfWeek, st.wDay,
+            st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+        return sz;
+    }
+
+    std::string
+    FloatText(double value)
+    {
+        char sz[32];
+        snprintf(sz, sizeof(sz), "%.17g", value);
+        return sz;
+    }
+
+    template<class T>
+    T
+    Read(void const* pb)
+    {
+        T value;
+        memcpy(&value, pb, sizeof(T));
+        return value;
+    }
+
+    // Text of one value of the specified canonical InType, as passed to a
+    // handler. Array elements of BOOLEAN keep their BOOL value.
+    std::string
+    ValueText(unsigned inType, void const* pb, unsigned cb, bool arrayElement)
+    {
+        switch (inType)
+        {
+        case TDH_INTYPE_INT8: return std::to_string(Read<INT8>(pb));
+        case TDH_INTYPE_UINT8: return std::to_string(Read<UINT8>(pb));
+        case TDH_INTYPE_INT16: return std::to_string(Read<INT16>(pb));
+        case TDH_INTYPE_UINT16: return std::to_string(Read<UINT16>(pb));
+        case TDH_INTYPE_INT32: return std::to_string(Read<INT32>(pb));
+        case TDH_INTYPE_UINT32:
+        case TDH_INTYPE_HEXINT32: return std::to_string(Read<UINT32>(pb));
+        case TDH_INTYPE_INT64:
+        case TDH_INTYPE_FILETIME: return std::to_string(Read<INT64>(pb));
+        case TDH_INTYPE_UINT64:
+        case TDH_INTYPE_HEXINT64: return std::to_string(Read<UINT64>(pb));
+        case TDH_INTYPE_FLOAT: return FloatText(Read<float>(pb));
+        case TDH_INTYPE_DOUBLE: return FloatText(Read<double>(pb));
+        case TDH_INTYPE_BOOLEAN: return std::to_string(arrayElement ? Read<BOOL>(pb) : Read<BOOL>(pb) != 0);
+        case TDH_INTYPE_GUID: return Hex(pb, sizeof(GUID));
+        case TDH_INTYPE_SYSTEMTIME: return SystemTimeText(Read<SYSTEMTIME>(pb));
+        case TDH_INTYPE_POINTER:
+        case TDH_INTYPE_SIZET: return std::to_string(cb == 8 ? Read<UINT64>(pb) : Read<UINT32>(pb));
+        case TDH_INTYPE_UNICODESTRING:
+        case TDH_INTYPE_UNICODECHAR: return ToUtf8(static_cast<EtwWCHAR const*>(pb), cb / 2);
+        case TDH_INTYPE_ANSISTRING:
+        case TDH_INTYPE_ANSICHAR: return std::string(static_cast<char const*>(pb), cb);
+        default: return std::to_string(inType) + ":" + Hex(pb, cb);
+        }
+    }
+
+    // Handler name for a value of the specified canonical InType.
+    char const*
+    Kind(unsigned inType)
+    {
+        switch (inType)
+        {
+        case TDH_INTYPE_INT8: return "Int8";
+        case TDH_INTYPE_UINT8: return "UInt8";
+        case TDH_INTYPE_INT16: return "Int16";
+        case TDH_INTYPE_UINT16: return "UInt16";
+        case TDH_INTYPE_INT32: return "Int32";
+        case TDH_INTYPE_UINT32:
+        case TDH_INTYPE_HEXINT32: return "UInt32";
+        case TDH_INTYPE_INT64: return "Int64";
+        case TDH_INTYPE_UINT64:
+        case TDH_INTYPE_HEXINT64: return "UInt64";
+        case TDH_INTYPE_FLOAT: return "Float";
+        case TDH_INTYPE_DOUBLE: return "Double";
+        case TDH_INTYPE_BOOLEAN: return "Boolean";
+        case TDH_INTYPE_GUID: return "Guid";
+        case TDH_INTYPE_FILETIME: return "FileTime";
+        case TDH_INTYPE_SYSTEMTIME: return "SystemTime";
+        case TDH_INTYPE_POINTER:
+        case TDH_INTYPE_SIZET: return "Pointer";
+        case TDH_INTYPE_UNICODESTRING:
+        case TDH_INTYPE_UNICODECHAR: return "String";
+        case TDH_INTYPE_ANSISTRING:
+        case TDH_INTYPE_ANSICHAR: return "AnsiString";
+        default: return "Other";
+        }
+    }
+
+    std::string
+    Call(char const* szKind, EtwPCWSTR szName, std::string const& value)
+    {
+        return std::string(szKind) + " " + ToUtf8(szName) + "=" + value;
+    }
+
+    // Records each handler call as text. Stops after StopAfter calls.
+    class RecordingVisitor
+        : public EtwVisitor
+    {
+        bool Add(char const* szKind, EtwPCWSTR szName, std::string const& value)
+        {
+            Calls.push_back(Call(szKind, szName, value));
+            return Calls.size() != StopAfter;
+        }
+
+        template<class T>
+        bool AddArray(char const* szKind, EtwPCWSTR szName, EtwArraySpan<T> span, unsigned inType)
+        {
+            std::string value = "[";
+            for (UINT32 i = 0; i != span.Count; i += 1)
+            {
+                T const element = span[i];
+                value += (i == 0 ? "" : ",") + ValueText(inType, &element, sizeof(T), true);
+            }
+
+            return Add(szKind, szName, value + "]");
+        }
+
+    public:
+
+        std::vector<std::string> Calls;
+        size_t StopAfter = ~size_t(0);
+
+        bool OnInt8(EtwPCWSTR n, INT8 v) noexcept { return Add("Int8", n, std::to_string(v)); }
+        bool OnUInt8(EtwPCWSTR n, UINT8 v) noexcept { return Add("UInt8", n, std::to_string(v)); }
+        bool OnInt16(EtwPCWSTR n, INT16 v) noexcept { return Add("Int16", n, std::to_string(v)); }
+        bool OnUInt16(EtwPCWSTR n, UINT16 v) noexcept { return Add("UInt16", n, std::to_string(v)); }
+        bool OnInt32(EtwPCWSTR n, INT32 v) noexcept { return Add("Int32", n, std::to_string(v)); }
+        bool OnUInt32(EtwPCWSTR n, UINT32 v) noexcept { return Add("UInt32", n, std::to_string(v)); }
+        bool OnInt64(EtwPCWSTR n, INT64 v) noexcept { return Add("Int64", n, std::to_string(v)); }
+        bool OnUInt64(EtwPCWSTR n, UINT64 v) noexcept { return Add("UInt64", n, std::to_string(v)); }
+        bool OnFloat(EtwPCWSTR n, float v) noexcept { return Add("Float", n, FloatText(v)); }
+        bool OnDouble(EtwPCWSTR n, double v) noexcept { return Add("Double", n, FloatText(v)); }
+        bool OnBoolean(EtwPCWSTR n, bool v) noexcept { return Add("Boolean", n, std::to_string(v)); }
+        bool OnGuid(EtwPCWSTR n, GUID const& v) noexcept { return Add("Guid", n, Hex(&v, sizeof(v))); }
+        bool OnFileTime(EtwPCWSTR n, INT64 v) noexcept { return Add("FileTime", n, std::to_string(v)); }
+        bool OnSystemTime(EtwPCWSTR n, SYSTEMTIME const& v) noexcept { return Add("SystemTime", n, SystemTimeText(v)); }
+        bool OnPointer(EtwPCWSTR n, UINT64 v) noexcept { return Add("Pointer", n, std::to_string(v)); }
+        bool OnString(EtwPCWSTR n, EtwStringView v) noexcept { return Add("String", n, ToUtf8(v.Data, v.DataLength)); }
+        bool OnAnsiString(EtwPCWSTR n, char const* pch, UINT32 cch) noexcept { return Add("AnsiString", n, std::string(pch, cch)); }
+        bool OnOther(EtwPCWSTR n, _TDH_IN_TYPE t, void const* pb, UINT32 cb) noexcept { return Add("Other", n, ValueText(t, pb, cb, false)); }
+
+        bool OnInt8Array(EtwPCWSTR n, EtwArraySpan<INT8> v) noexcept { return AddArray("Int8Array", n, v, TDH_INTYPE_INT8); }
+        bool OnUInt8Array(EtwPCWSTR n, EtwArraySpan<UINT8> v) noexcept { return AddArray("UInt8Array", n, v, TDH_INTYPE_UINT8); }
+        bool OnInt16Array(EtwPCWSTR n, EtwArraySpan<INT16> v) noexcept { return AddArray("Int16Array", n, v, TDH_INTYPE_INT16); }
+        bool OnUInt16Array(EtwPCWSTR n, EtwArraySpan<UINT16> v) noexcept { return AddArray("UInt16Array", n, v, TDH_INTYPE_UINT16); }
+        bool OnInt32Array(EtwPCWSTR n, EtwArraySpan<INT32> v) noexcept { return AddArray("Int32Array", n, v, TDH_INTYPE_INT32); }
+        bool OnUInt32Array(EtwPCWSTR n, EtwArraySpan<UINT32> v) noexcept { return AddArray("UInt32Array", n, v, TDH_INTYPE_UINT32); }
+        bool OnInt64Array(EtwPCWSTR n, EtwArraySpan<INT64> v) noexcept { return AddArray("Int64Array", n, v, TDH_INTYPE_INT64); }
+        bool OnUInt64Array(EtwPCWSTR n, EtwArraySpan<UINT64> v) noexcept { return AddArray("UInt64Array", n, v, TDH_INTYPE_UINT64); }
+        bool OnFloatArray(EtwPCWSTR n, EtwArraySpan<float> v) noexcept { return AddArray("FloatArray", n, v, TDH_INTYPE_FLOAT); }
+        bool OnDoubleArray(EtwPCWSTR n, EtwArraySpan<double> v) noexcept { return AddArray("DoubleArray", n, v, TDH_INTYPE_DOUBLE); }
+        bool OnBooleanArray(EtwPCWSTR n, EtwArraySpan<BOOL> v) noexcept { return AddArray("BooleanArray", n, v, TDH_INTYPE_BOOLEAN); }
+        bool OnGuidArray(EtwPCWSTR n, EtwArraySpan<GUID> v) noexcept { return AddArray("GuidArray", n, v, TDH_INTYPE_GUID); }
+        bool OnFileTimeArray(EtwPCWSTR n, EtwArraySpan<INT64> v) noexcept { return AddArray("FileTimeArray", n, v, TDH_INTYPE_FILETIME); }
+        bool OnSystemTimeArray(EtwPCWSTR n, EtwArraySpan<SYSTEMTIME> v) noexcept { return AddArray("SystemTimeArray", n, v, TDH_INTYPE_SYSTEMTIME); }
+
+        bool OnArrayBegin(EtwPCWSTR n, UINT32 count, _TDH_IN_TYPE t) noexcept
+        {
+            return Add("ArrayBegin", n, std::to_string(count) + ":" + std::to_string(t));
+        }
+
+        bool OnArrayEnd(EtwPCWSTR n) noexcept { return Add("ArrayEnd", n, ""); }
+        bool OnStructBegin(EtwPCWSTR n) noexcept { return Add("StructBegin", n, ""); }
+        bool OnStructEnd(EtwPCWSTR n) noexcept { return Add("StructEnd", n, ""); }
+    };
+
+    // Handler calls expected from a MoveNext walk, and the item passed to
+    // each call.
+    struct ExpectedVisit
+    {
+        std::vector<std::string> Calls;
+        std::vector<EtwEnumeratorState> States;
+        std::vector<void const*> Data;
+        EtwEnumeratorState FinalState;
+        LSTATUS FinalError;
+    };
+
+    USHORT const Scalars[] = {
+        TDH_INTYPE_INT8, TDH_INTYPE_UINT8, TDH_INTYPE_INT16, TDH_INTYPE_UINT16,
+        TDH_INTYPE_INT32, TDH_INTYPE_UINT32, TDH_INTYPE_HEXINT32, TDH_INTYPE_INT64,
+        TDH_INTYPE_UINT64, TDH_INTYPE_HEXINT64, TDH_INTYPE_FLOAT, TDH_INTYPE_DOUBLE,
+        TDH_INTYPE_BOOLEAN, TDH_INTYPE_GUID, TDH_INTYPE_FILETIME, TDH_INTYPE_SYSTEMTIME,
+        TDH_INTYPE_POINTER, TDH_INTYPE_SIZET, TDH_INTYPE_UNICODESTRING, TDH_INTYPE_ANSISTRING };
+    unsigned const ScalarCount = sizeof(Scalars) / sizeof(Scalars[0]);
+
+    class VisitorFixture
+    {
+        TestSchema m_schema;
+        TestCallbacks m_callbacks;
+        std::mt19937 m_rng;
+
+    public:
+
+        EtwEnumerator Enumerator;
+        unsigned SimpleArrays;
+        unsigned ElementArrays;
+
+        VisitorFixture()
+            : m_schema()
+            , m_callbacks()
+            , m_rng(6)
+            , Enumerator(m_callbacks)
+            , SimpleArrays(0)
+            , ElementArrays(0)
+        {
+            for (auto inType : Scalars)
+            {
+                m_schema.Add(("V" + std::to_string(inType)).c_str(), Scalar(inType)); //  0..19
+            }
+
+            m_schema.Add("Ch", Scalar(TDH_INTYPE_UNICODECHAR, TDH_OUTTYPE_NULL, 3));      // 20
+            m_schema.Add("ACh", Scalar(TDH_INTYPE_ANSICHAR, TDH_OUTTYPE_NULL, 3));        // 21
+            m_schema.Add("Len", Scalar(TDH_INTYPE_UINT16));                              // 22
+            m_schema.Add("Bin", Sized(TDH_INTYPE_BINARY, 22));                           // 23
+            m_schema.Add("CStr", Scalar(TDH_INTYPE_COUNTEDSTRING));                      // 24
+            m_schema.Add("N", Scalar(TDH_INTYPE_UINT16));                                // 25
+            for (unsigned i = 0; i != ScalarCount; i += 1)
+            {
+                // Alternate fixed-length (2) and counted (N) arrays.
+                auto const name = "A" + std::to_string(Scalars[i]);
+                m_schema.Add(name.c_str(), i % 2 == 0
+                    ? Scalar(Scalars[i], TDH_OUTTYPE_NULL, 2)
+                    : CountedArray(Scalars[i], 25));                           // 26..45
+            }
+
+            m_schema.Add("Rec", Struct(49, 3));                                          // 46
+            m_schema.Add("Recs", CountedStruct(49, 3, 25));                              // 47
+            m_schema.Add("Tail", Scalar(TDH_INTYPE_UINT32));                             // 48
+            m_schema.Add("A", Scalar(TDH_INTYPE_INT32));                                 // 49
+            m_schema.Add("Sub", Struct(52, 2));                                          // 50
+            m_schema.Add("Ids", Scalar(TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 2));         // 51
+            m_schema.Add("P", Scalar(TDH_INTYPE_UINT8));                                 // 52
+            m_schema.Add("Q", Scalar(TDH_INTYPE_ANSISTRING));                            // 53
+            m_schema.SetTopLevelCount(49);
+            m_callbacks.SetSchema(1, m_schema);
+        }
+
+        unsigned
+        Random(unsigned limit)
+        {
+            return static_cast<unsigned>(m_rng() % limit);
+        }
+
+        TestEvent
+        MakeEvent(unsigned cbPointer)
+        {
+            TestEvent event(1);
+            for (auto inType : Scalars)
+            {
+                AddValue(event, inType, cbPointer);
+            }
+
+            for (unsigned i = 0; i != 3; i += 1)
+            {
+                event.Add(static_cast<EtwWCHAR>('a' + Random(26)));
+            }
+
+            event.AddBytes("xyz", 3);
+            USHORT const len = static_cast<USHORT>(Random(5));
+            event.Add(len);
+            for (unsigned i = 0; i != len; i += 1)
+            {
+                event.Add(static_cast<BYTE>(m_rng()));
+            }
+
+            event.Add<USHORT>(4).Add<EtwWCHAR>('c').Add<EtwWCHAR>('s');
+            USHORT const n = static_cast<USHORT>(Random(4));
+            event.Add(n);
+            for (unsigned i = 0; i != ScalarCount; i += 1)
+            {
+                for (unsigned j = i % 2 == 0 ? 2 : n; j != 0; j -= 1)
+                {
+                    AddValue(event, Scalars[i], cbPointer);
+                }
+            }
+
+            for (unsigned i = 0; i != n + 1u; i += 1)
+            {
+                event.Add(static_cast<INT32>(m_rng()));
+                event.Add(static_cast<BYTE>(m_rng()));
+                event.AddAnsiString(std::string(Random(3), 'q').c_str());
+                event.Add(static_cast<UINT32>(m_rng())).Add(static_cast<UINT32>(m_rng()));
+            }
+
+            event.Add(static_cast<UINT32>(m_rng()));
+            return event;
+        }
+
+        // Visit, with the enumerator's own walk as the expected result.
+        ExpectedVisit
+        Expected(EVENT_RECORD const& record)
+        {
+            ExpectedVisit expected;
+            ETW_CHECK(Enumerator.StartEvent(&record));
+            bool moved = Enumerator.MoveNext();
+            while (moved)
+            {
+                auto const info = Enumerator.GetItemInfo();
+                auto const state = Enumerator.State();
+                std::string call;
+                switch (state)
+                {
+                case EtwEnumeratorState_ArrayBegin:
+                    if (info.ElementSize != 0 &&
+                        info.InType != TDH_INTYPE_POINTER &&
+                        info.InType != TDH_INTYPE_SIZET)
+                    {
+                        // Build the span from the elements.
+                        bool const chars = info.InType == TDH_INTYPE_UNICODECHAR || info.InType == TDH_INTYPE_ANSICHAR;
+                        std::string value = chars ? "" : "[";
+                        for (unsigned i = 0; i != info.ArrayCount; i += 1)
+                        {
+                            ETW_CHECK(Enumerator.MoveNext());
+                            auto const element = Enumerator.GetItemInfo();
+                            ETW_CHECK(Enumerator.State() == EtwEnumeratorState_Value && element.ArrayIndex == i);
+                            value += (chars || i == 0 ? "" : ",") +
+                                ValueText(element.InType, element.Data, element.DataSize, true);
+                        }
+
+                        // Continue from ArrayEnd, as Visit continues with
+                        // MoveNextSibling from ArrayBegin.
+                        ETW_CHECK(Enumerator.MoveNext());
+                        ETW_CHECK(Enumerator.State() == EtwEnumeratorState_ArrayEnd);
+                        call = Call(chars ? Kind(info.InType) : (Kind(info.InType) + std::string("Array")).c_str(),
+                            info.Name, chars ? value : value + "]");
+                        SimpleArrays += 1;
+                    }
+                    else
+                    {
+                        call = Call("ArrayBegin", info.Name,
+                            std::to_string(info.ArrayCount) + ":" + std::to_string(info.InType));
+                        ElementArrays += 1;
+                    }
+                    break;
+                case EtwEnumeratorState_ArrayEnd:
+                    call = Call("ArrayEnd", info.Name, "");
+                    break;
+                case EtwEnumeratorState_StructBegin:
+                    call = Call("StructBegin", info.Name, "");
+                    break;
+                case EtwEnumeratorState_StructEnd:
+                    call = Call("StructEnd", info.Name, "");
+                    break;
+                default:
+                    call = Call(Kind(info.InType), info.Name,
+                        ValueText(info.InType, info.Data, info.DataSize, false));
+                    break;
+                }
+
+                expected.Calls.push_back(call);
+                expected.States.push_back(state);
+                expected.Data.push_back(info.Data);
+                moved = Enumerator.MoveNext();
+            }
+
+            expected.FinalState = Enumerator.State();
+            expected.FinalError = Enumerator.LastError();
+            return expected;
+        }
+
+    private:
+
+        void
+        AddValue(TestEvent& event, USHORT inType, unsigned cbPointer)
+        {
+            switch (inType)
+            {
+            case TDH_INTYPE_UNICODESTRING:
+                event.AddString(std::string(Random(4), 'u').c_str());
+                break;
+            case TDH_INTYPE_ANSISTRING:
+                event.AddAnsiString(std::string(Random(4), 'a').c_str());
+                break;
+            case TDH_INTYPE_FLOAT:
+                event.Add(static_cast<float>(static_cast<INT32>(m_rng())) / 64);
+                break;
+            case TDH_INTYPE_DOUBLE:
+                event.Add(static_cast<double>(static_cast<INT32>(m_rng())) / 1024);
+                break;
+            case TDH_INTYPE_BOOLEAN:
+                event.Add(static_cast<BOOL>(Random(3)));
+                break;
+            case TDH_INTYPE_POINTER:
+            case TDH_INTYPE_SIZET:
+                AddRandomBytes(event, cbPointer);
+                break;
+            case TDH_INTYPE_INT8:
+            case TDH_INTYPE_UINT8:
+                AddRandomBytes(event, 1);
+                break;
+            case TDH_INTYPE_INT16:
+            case TDH_INTYPE_UINT16:
+                AddRandomBytes(event, 2);
+                break;
+            case TDH_INTYPE_INT32:
+            case TDH_INTYPE_UINT32:
+            case TDH_INTYPE_HEXINT32:
+                AddRandomBytes(event, 4);
+                break;
+            case TDH_INTYPE_GUID:
+            case TDH_INTYPE_SYSTEMTIME:
+                AddRandomBytes(event, 16);
+                break;
+            default: // INT64, UINT64, HEXINT64, FILETIME.
+                AddRandomBytes(event, 8);
+                break;
+            }
+        }
+
+        void
+        AddRandomBytes(TestEvent& event, unsigned cb)
+        {
+            for (unsigned i = 0; i != cb; i += 1)
+            {
+                event.Add(static_cast<BYTE>(m_rng()));
+            }
+        }
+    };
+}
+
+ETW_TEST(Visitor_MatchesMoveNextWalk)
+{
+    VisitorFixture f;
+    unsigned mismatches = 0;
+    unsigned stopped = 0;
+    unsigned errors = 0;
+
+    for (unsigned eventIndex = 0; eventIndex != 1000; eventIndex += 1)
+    {
+        unsigned const cbPointer = eventIndex % 2 ? 4 : 8;
+        TestEvent event = f.MakeEvent(cbPointer);
+        if (eventIndex % 4 == 3 && event.PayloadSize() != 0)
+        {
+            event.Truncate(f.Random(static_cast<unsigned>(event.PayloadSize())));
+        }
+
+        EVENT_RECORD& record = event.Record();
+        if (cbPointer == 4)
+        {
+            record.EventHeader.Flags = EVENT_HEADER_FLAG_32_BIT_HEADER;
+        }
+
+        f.Enumerator.SetDecodePlansEnabled(eventIndex % 3 != 0);
+        ExpectedVisit const expected = f.Expected(record);
+        errors += expected.FinalState == EtwEnumeratorState_Error;
+
+        RecordingVisitor visitor;
+        ETW_CHECK(f.Enumerator.StartEvent(&record));
+        bool const ok = f.Enumerator.Visit(visitor);
+        if (ok != (expected.FinalState == EtwEnumeratorState_AfterLastItem) ||
+            visitor.Calls != expected.Calls ||
+            f.Enumerator.State() != expected.FinalState ||
+            f.Enumerator.LastError() != expected.FinalError)
+        {
+            if (mismatches < 5)
+            {
+                printf("Mismatch: event %u, calls %u vs %u\n", eventIndex,
+                    static_cast<unsigned>(visitor.Calls.size()),
+                    static_cast<unsigned>(expected.Calls.size()));
+                for (size_t i = 0; i != visitor.Calls.size() && i != expected.Calls.size(); i += 1)
+                {
+                    if (visitor.Calls[i] != expected.Calls[i])
+                    {
+                        printf("  %s\n  %s\n", visitor.Calls[i].c_str(), expected.Calls[i].c_str());
+                        break;
+                    }
+                }
+            }
+
+            mismatches += 1;
+        }
+
+        // Stop at a random call: the enumerator is left at that item.
+        if (!expected.Calls.empty())
+        {
+            RecordingVisitor stopping;
+            stopping.StopAfter = f.Random(static_cast<unsigned>(expected.Calls.size())) + 1;
+            ETW_CHECK(f.Enumerator.StartEvent(&record));
+            ETW_CHECK(f.Enumerator.Visit(stopping));
+            ETW_CHECK(stopping.Calls.size() == stopping.StopAfter);
+            ETW_CHECK(f.Enumerator.State() == expected.States[stopping.StopAfter - 1]);
+            ETW_CHECK(f.Enumerator.GetItemInfo().Data == expected.Data[stopping.StopAfter - 1]);
+            stopped += 1;
+        }
+    }
+
+    ETW_CHECK(mismatches == 0);
+    ETW_CHECK(stopped > 500);
+    ETW_CHECK(errors != 0);
+    ETW_CHECK(errors < 1000 / 2);
+    ETW_CHECK(f.SimpleArrays > 10000);
+    ETW_CHECK(f.ElementArrays > 1000);
+}